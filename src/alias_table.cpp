@@ -0,0 +1,53 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "alias_table.hpp"
+#include "numerical_utils.hpp"
+
+void AliasTable::SetRangeFromLogWeights(Range range,
+                                        EigenConstVectorXdRef log_weights) {
+  const auto &[start, end] = range;
+  Assert(start < end && end <= size(), "Invalid range in AliasTable.");
+  const size_t range_size = end - start;
+  Assert(static_cast<size_t>(log_weights.size()) == range_size,
+         "Log weights don't match the range in AliasTable.");
+  const double log_total = NumericalUtils::LogSum(log_weights);
+  Assert(log_total > DOUBLE_NEG_INF, "AliasTable needs a positive total weight.");
+  // Scale the probabilities so that they average to 1, then split the entries into
+  // those below and at or above average.
+  SizeVector small;
+  SizeVector large;
+  for (size_t i = start; i < end; i++) {
+    keep_probabilities_[i] =
+        static_cast<double>(range_size) * exp(log_weights[i - start] - log_total);
+    aliases_[i] = i;
+    (keep_probabilities_[i] < 1. ? small : large).push_back(i);
+  }
+  // Fill up each small entry with the excess of a large one.
+  while (!small.empty() && !large.empty()) {
+    const size_t small_idx = small.back();
+    small.pop_back();
+    const size_t large_idx = large.back();
+    aliases_[small_idx] = large_idx;
+    keep_probabilities_[large_idx] -= 1. - keep_probabilities_[small_idx];
+    if (keep_probabilities_[large_idx] < 1.) {
+      large.pop_back();
+      small.push_back(large_idx);
+    }
+  }
+  // Whatever is left over is only away from 1 by rounding error.
+  for (const auto idx : large) {
+    keep_probabilities_[idx] = 1.;
+  }
+  for (const auto idx : small) {
+    keep_probabilities_[idx] = 1.;
+  }
+}
+
+size_t AliasTable::Sample(Range range, std::mt19937 &generator) const {
+  const auto &[start, end] = range;
+  std::uniform_int_distribution<size_t> pick(start, end - 1);
+  std::uniform_real_distribution<double> coin(0., 1.);
+  const size_t idx = pick(generator);
+  return coin(generator) < keep_probabilities_[idx] ? idx : aliases_[idx];
+}
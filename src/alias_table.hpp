@@ -0,0 +1,74 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Alias tables for constant-time sampling from discrete distributions, using Vose's
+// version of Walker's alias method: https://www.keithschwarz.com/darts-dice-coins/
+//
+// An AliasTable covers a vector of entries that is partitioned into disjoint ranges,
+// each with its own distribution, just as sbn_parameters_ is partitioned into the
+// rootsplits and the children of each parent subsplit. Each entry i stores the
+// probability of keeping i once it has been picked uniformly from its range, and
+// otherwise the (absolute) index of its alias. The whole thing lives in two flat
+// vectors, so sampling doesn't allocate.
+
+#ifndef SRC_ALIAS_TABLE_HPP_
+#define SRC_ALIAS_TABLE_HPP_
+
+#include <random>
+#include <utility>
+#include <vector>
+#include "eigen_sugar.hpp"
+#include "sugar.hpp"
+
+class AliasTable {
+ public:
+  using Range = std::pair<size_t, size_t>;
+
+  AliasTable() = default;
+  explicit AliasTable(size_t size) : keep_probabilities_(size, 1.), aliases_(size) {}
+
+  size_t size() const { return aliases_.size(); }
+
+  // Set up the distribution on [range.first, range.second) to be proportional to
+  // the exponentiated log_weights, which must be as long as the range.
+  void SetRangeFromLogWeights(Range range, EigenConstVectorXdRef log_weights);
+  // Sample an index in [range.first, range.second), which must be a range that was
+  // set up with SetRangeFromLogWeights.
+  size_t Sample(Range range, std::mt19937 &generator) const;
+
+ private:
+  std::vector<double> keep_probabilities_;
+  std::vector<size_t> aliases_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("AliasTable") {
+  AliasTable table(7);
+  EigenVectorXd first_weights(3);
+  first_weights << 1., 2., 5.;
+  EigenVectorXd second_weights(4);
+  second_weights << 0., 3., 0., 1.;
+  table.SetRangeFromLogWeights({0, 3}, first_weights.array().log().matrix());
+  table.SetRangeFromLogWeights({3, 7}, second_weights.array().log().matrix());
+  std::mt19937 generator(42);
+  const size_t sample_count = 200000;
+  std::vector<size_t> counts(table.size(), 0);
+  for (size_t i = 0; i < sample_count; i++) {
+    counts[table.Sample({0, 3}, generator)]++;
+    counts[table.Sample({3, 7}, generator)]++;
+  }
+  const auto frequency = [&counts, sample_count](size_t i) {
+    return static_cast<double>(counts[i]) / sample_count;
+  };
+  CHECK_LT(fabs(frequency(0) - 1. / 8.), 5e-3);
+  CHECK_LT(fabs(frequency(1) - 2. / 8.), 5e-3);
+  CHECK_LT(fabs(frequency(2) - 5. / 8.), 5e-3);
+  // Zero-weight entries are never sampled.
+  CHECK_EQ(counts[3], 0);
+  CHECK_EQ(counts[5], 0);
+  CHECK_LT(fabs(frequency(4) - 3. / 4.), 5e-3);
+  CHECK_LT(fabs(frequency(6) - 1. / 4.), 5e-3);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_ALIAS_TABLE_HPP_
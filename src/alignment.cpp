@@ -2,11 +2,12 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "alignment.hpp"
-#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include "mmapped_file.hpp"
 
 size_t Alignment::Length() const {
   Assert(SequenceCount() > 0,
@@ -25,7 +26,7 @@ bool Alignment::IsValid() const {
   return std::all_of(data_.cbegin(), data_.cend(), is_same_length);
 }
 
-std::string Alignment::at(const std::string &taxon) const {
+const std::string &Alignment::at(const std::string &taxon) const {
   auto search = data_.find(taxon);
   if (search != data_.end()) {
     return search->second;
@@ -44,12 +45,11 @@ Alignment Alignment::ReadFasta(const std::string &fname) {
       SafeInsert(data, taxon, sequence);
     }
   };
-  std::ifstream input(fname);
-  if (!input.good()) {
-    Failwith("Could not open '" + fname + "'");
-  }
-  std::string line, taxon, sequence;
-  while (std::getline(input, line)) {
+  const MmappedFile file(fname);
+  LineReader lines(file);
+  std::string_view line;
+  std::string taxon, sequence;
+  while (lines.NextLine(line)) {
     if (line.empty()) {
       continue;
     }
@@ -13,14 +13,14 @@ class Alignment {
   Alignment() = default;
   explicit Alignment(StringStringMap data) : data_(std::move(data)) {}
 
-  StringStringMap Data() const { return data_; }
+  const StringStringMap& Data() const { return data_; }
   size_t SequenceCount() const { return data_.size(); }
   size_t Length() const;
   bool operator==(const Alignment& other) const { return data_ == other.Data(); }
 
   // Is the alignment non-empty and do all sequences have the same length?
   bool IsValid() const;
-  std::string at(const std::string& taxon) const;
+  const std::string& at(const std::string& taxon) const;
 
   static Alignment ReadFasta(const std::string& fname);
 
@@ -39,6 +39,8 @@ TEST_CASE("Alignment") {
   auto alignment = Alignment::ReadFasta("data/hello.fasta");
   CHECK_EQ(alignment, Alignment::HelloAlignment());
   CHECK(alignment.IsValid());
+  // This is gzipped as two gzip streams.
+  CHECK_EQ(Alignment::ReadFasta("data/hello.fasta.gz"), alignment);
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
@@ -3,13 +3,16 @@
 //
 // BeagleAccessories are collections of artifacts that we can make in constant
 // time given the tree, and remain const througout any operation-gathering tree
-// traversal.
+// traversal. Making them doesn't allocate, since FatBeagle makes them for every
+// likelihood computation.
 
 #ifndef SRC_BEAGLE_ACCESSORIES_HPP_
 #define SRC_BEAGLE_ACCESSORIES_HPP_
 
+#include <array>
 #include <numeric>
 #include <vector>
+#include "flat_topology.hpp"
 #include "libhmsbeagle/beagle.h"
 #include "node.hpp"
 
@@ -31,38 +34,48 @@ struct BeagleAccessories {
   // using destinationScaleRead.
   const int destinationScaleRead_ = BEAGLE_OP_NONE;
   // This is the entry of scaleBuffer in which we store accumulated factors.
-  const std::vector<int> cumulative_scale_index_;
-  const std::vector<int> node_indices_;
+  const std::array<int, 1> cumulative_scale_index_;
   // pattern weights
-  const std::vector<int> category_weight_index_ = {0};
+  const std::array<int, 1> category_weight_index_ = {0};
   // state frequencies
-  const std::vector<int> state_frequency_index_ = {0};
+  const std::array<int, 1> state_frequency_index_ = {0};
   // indices of parent partialsBuffers
-  std::vector<int> upper_partials_index_ = {0};
+  std::array<int, 1> upper_partials_index_ = {0};
   // indices of child partialsBuffers
-  std::vector<int> node_partial_indices_ = {0};
+  std::array<int, 1> node_partial_indices_ = {0};
   // transition probability matrices
-  std::vector<int> node_mat_indices_ = {0};
+  std::array<int, 1> node_mat_indices_ = {0};
   // first derivative matrices
-  std::vector<int> node_deriv_index_ = {0};
+  std::array<int, 1> node_deriv_index_ = {0};
 
   BeagleAccessories(int beagle_instance, bool rescaling, const Node::NodePtr topology)
-      : beagle_instance_(beagle_instance),
-        rescaling_(rescaling),
-        root_id_(static_cast<int>(topology->Id())),
-        fixed_node_id_(static_cast<int>(topology->Children()[1]->Id())),
-        root_child_id_(static_cast<int>(topology->Children()[0]->Id())),
-        node_count_(static_cast<int>(topology->LeafCount() * 2 - 1)),
-        taxon_count_(static_cast<int>(topology->LeafCount())),
-        internal_count_(taxon_count_ - 1),
-        cumulative_scale_index_({rescaling ? 0 : BEAGLE_OP_NONE}),
-        node_indices_(IotaVector(node_count_ - 1, 0)) {}
+      : BeagleAccessories(beagle_instance, rescaling, topology->Id(),
+                          topology->Children()[1]->Id(), topology->Children()[0]->Id(),
+                          topology->LeafCount()) {}
+  BeagleAccessories(int beagle_instance, bool rescaling, const FlatTopology &topology)
+      : BeagleAccessories(beagle_instance, rescaling, topology.RootId(),
+                          topology.ChildrenOf(topology.RootId())[1],
+                          topology.ChildrenOf(topology.RootId())[0],
+                          topology.LeafCount()) {}
 
   static std::vector<int> IotaVector(size_t size, int start_value) {
     std::vector<int> v(size);
     std::iota(v.begin(), v.end(), start_value);
     return v;
   }
+
+ private:
+  BeagleAccessories(int beagle_instance, bool rescaling, size_t root_id,
+                    size_t fixed_node_id, size_t root_child_id, size_t taxon_count)
+      : beagle_instance_(beagle_instance),
+        rescaling_(rescaling),
+        root_id_(static_cast<int>(root_id)),
+        fixed_node_id_(static_cast<int>(fixed_node_id)),
+        root_child_id_(static_cast<int>(root_child_id)),
+        node_count_(static_cast<int>(taxon_count * 2 - 1)),
+        taxon_count_(static_cast<int>(taxon_count)),
+        internal_count_(taxon_count_ - 1),
+        cumulative_scale_index_({rescaling ? 0 : BEAGLE_OP_NONE}) {}
 };
 
 #endif  // SRC_BEAGLE_ACCESSORIES_HPP_
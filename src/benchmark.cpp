@@ -0,0 +1,623 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Microbenchmarks of the hot paths of libsbn on the files in data/, in the style of
+// Google Benchmark. Run from the root of the repository:
+//
+//   ./_build/benchmark [--benchmark_filter=<regex>] [--benchmark_min_time=<seconds>]
+//                      [--benchmark_repetitions=<count>] [--benchmark_out=<file>]
+//                      [--baseline_out=<file>] [--baseline=<file>]
+//                      [--regression_threshold=<fraction>]
+//
+// Each benchmark has a setup, which isn't timed, that returns the body to time. We
+// call the body once to warm up, then in batches of growing size until a batch takes
+// at least the minimum time, and report the time per call of the last batch. We do
+// that once per repetition. The results go to standard output (or the
+// --benchmark_out file) as JSON in the format of Google Benchmark, so the usual
+// comparison tools work on them; progress goes to standard error. The CPU time is
+// that of the whole process, so it counts the work of every thread.
+//
+// For regression tracking, --baseline_out writes the median and median absolute
+// deviation (MAD) of the time of each benchmark, along with the operator new
+// allocations per call and the peak resident set size of the process after the
+// benchmark, to a JSON file. Running with --baseline compares against such a file:
+// a benchmark regresses if its median time or its allocations grow by more than the
+// threshold (0.1 by default), where for the time the growth also has to exceed twice
+// the MAD of the baseline so that noisy benchmarks don't fail on noise. The peak RSS
+// depends on which benchmarks ran before, so we only report it. We exit with status
+// 1 if anything regressed.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include "driver.hpp"
+#include "engine.hpp"
+#include "gp_engine.hpp"
+#include "unrooted_sbn_instance.hpp"
+
+using namespace GPOperations;
+
+// We count the calls of the global operator new, which is what the standard
+// containers allocate with. Eigen allocates with malloc, so those aren't counted.
+std::atomic<size_t> allocation_count{0};
+
+void *operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *pointer = std::malloc(size == 0 ? 1 : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept { std::free(pointer); }
+
+// Keep the compiler from optimizing away the computation of value, as does
+// benchmark::DoNotOptimize.
+template <typename T>
+void DoNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// The peak resident set size of this process, in kilobytes.
+size_t MaxRSSKilobytes() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  // macOS reports bytes rather than kilobytes.
+  return static_cast<size_t>(usage.ru_maxrss) / 1024;
+#else
+  return static_cast<size_t>(usage.ru_maxrss);
+#endif
+}
+
+class BenchmarkRegistry {
+ public:
+  using Body = std::function<void()>;
+  using Setup = std::function<Body()>;
+
+  // One repetition of a benchmark. Times are in nanoseconds per call.
+  struct Result {
+    std::string name_;
+    size_t repetition_index_;
+    size_t iterations_;
+    double real_time_;
+    double cpu_time_;
+    double allocations_;
+    size_t max_rss_kb_;
+  };
+
+  void Register(const std::string &name, Setup setup) {
+    benchmarks_.emplace_back(name, std::move(setup));
+  }
+
+  // Run the benchmarks whose names match filter, skipping those whose setup throws
+  // (for example because BEAGLE can't make an instance with the requested flags).
+  // The repetitions of a benchmark come one after another in the results.
+  std::vector<Result> Run(const std::regex &filter, double min_time,
+                          size_t repetitions) const {
+    std::vector<Result> results;
+    for (const auto &[name, setup] : benchmarks_) {
+      if (!std::regex_search(name, filter)) {
+        continue;
+      }
+      Body body;
+      try {
+        body = setup();
+      } catch (const std::exception &exception) {
+        std::cerr << "Skipping " << name << ": " << exception.what() << std::endl;
+        continue;
+      }
+      body();
+      for (size_t repetition = 0; repetition < repetitions; repetition++) {
+        results.push_back(Time(body, min_time));
+        Result &result = results.back();
+        result.name_ = name;
+        result.repetition_index_ = repetition;
+        std::cerr << std::left << std::setw(56) << name << std::right << std::setw(16)
+                  << std::fixed << std::setprecision(0) << result.real_time_ << " ns"
+                  << std::setw(12) << result.iterations_ << std::endl;
+      }
+    }
+    return results;
+  }
+
+ private:
+  std::vector<std::pair<std::string, Setup>> benchmarks_;
+
+  static Result Time(const Body &body, double min_time) {
+    using Clock = std::chrono::steady_clock;
+    size_t iterations = 1;
+    while (true) {
+      const size_t allocations_start = allocation_count.load();
+      const auto real_start = Clock::now();
+      const std::clock_t cpu_start = std::clock();
+      for (size_t iteration = 0; iteration < iterations; iteration++) {
+        body();
+      }
+      const double cpu_seconds =
+          static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+      const double real_seconds =
+          std::chrono::duration<double>(Clock::now() - real_start).count();
+      const size_t allocations = allocation_count.load() - allocations_start;
+      if (real_seconds >= min_time || iterations >= max_iterations_) {
+        const double per_iteration = 1. / static_cast<double>(iterations);
+        return {"",
+                0,
+                iterations,
+                1e9 * real_seconds * per_iteration,
+                1e9 * cpu_seconds * per_iteration,
+                static_cast<double>(allocations) * per_iteration,
+                MaxRSSKilobytes()};
+      }
+      // As in Google Benchmark, aim a bit past the minimum time, growing by a factor
+      // between 2 and 10.
+      const double factor =
+          real_seconds <= 0. ? 10. : std::clamp(1.4 * min_time / real_seconds, 2., 10.);
+      const double next_iterations = static_cast<double>(iterations) * factor;
+      iterations = std::min(max_iterations_, static_cast<size_t>(next_iterations));
+    }
+  }
+
+  static constexpr size_t max_iterations_ = 1000000000;
+};
+
+// The summary of the repetitions of a benchmark that we keep as a baseline.
+struct Baseline {
+  std::string name_;
+  double median_;
+  double mad_;
+  double allocations_;
+  size_t max_rss_kb_;
+};
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  const size_t middle = values.size() / 2;
+  return values.size() % 2 == 1 ? values[middle]
+                                 : 0.5 * (values[middle - 1] + values[middle]);
+}
+
+std::vector<Baseline> BaselinesOf(
+    const std::vector<BenchmarkRegistry::Result> &results) {
+  std::vector<Baseline> baselines;
+  auto start = results.begin();
+  while (start != results.end()) {
+    const auto end = std::find_if(start, results.end(), [start](const auto &result) {
+      return result.name_ != start->name_;
+    });
+    std::vector<double> times;
+    std::vector<double> allocations;
+    for (auto result = start; result != end; ++result) {
+      times.push_back(result->real_time_);
+      allocations.push_back(result->allocations_);
+    }
+    const double median = Median(times);
+    std::vector<double> deviations;
+    for (const double time : times) {
+      deviations.push_back(std::abs(time - median));
+    }
+    baselines.push_back({start->name_, median, Median(deviations),
+                         Median(allocations), std::prev(end)->max_rss_kb_});
+    start = end;
+  }
+  return baselines;
+}
+
+std::string JSONEscape(const std::string &str) {
+  std::string escaped;
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+void WriteJSON(std::ostream &os, const std::string &executable, size_t repetitions,
+               const std::vector<BenchmarkRegistry::Result> &results) {
+  const std::time_t now = std::time(nullptr);
+#ifdef NDEBUG
+  const std::string build_type = "release";
+#else
+  const std::string build_type = "debug";
+#endif
+  os << "{\n  \"context\": {\n";
+  os << "    \"date\": \"" << std::put_time(std::localtime(&now), "%FT%T%z") << "\",\n";
+  os << "    \"executable\": \"" << JSONEscape(executable) << "\",\n";
+  os << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+  os << "    \"library_build_type\": \"" << build_type << "\"\n";
+  os << "  },\n  \"benchmarks\": [";
+  std::string separator = "\n";
+  os << std::setprecision(10);
+  for (const auto &result : results) {
+    os << separator << "    {\n";
+    os << "      \"name\": \"" << JSONEscape(result.name_) << "\",\n";
+    os << "      \"run_name\": \"" << JSONEscape(result.name_) << "\",\n";
+    os << "      \"run_type\": \"iteration\",\n";
+    os << "      \"repetitions\": " << repetitions << ",\n";
+    os << "      \"repetition_index\": " << result.repetition_index_ << ",\n";
+    os << "      \"iterations\": " << result.iterations_ << ",\n";
+    os << "      \"real_time\": " << result.real_time_ << ",\n";
+    os << "      \"cpu_time\": " << result.cpu_time_ << ",\n";
+    os << "      \"time_unit\": \"ns\",\n";
+    os << "      \"allocations_per_iteration\": " << result.allocations_ << ",\n";
+    os << "      \"max_rss_kb\": " << result.max_rss_kb_ << "\n";
+    os << "    }";
+    separator = ",\n";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// Write one baseline per line, so that ReadBaselines can read them back without a
+// JSON library.
+void WriteBaselines(std::ostream &os, const std::vector<Baseline> &baselines) {
+  os << "{\n  \"baselines\": [";
+  std::string separator = "\n";
+  os << std::setprecision(10);
+  for (const auto &baseline : baselines) {
+    os << separator << "    {\"name\": \"" << JSONEscape(baseline.name_)
+       << "\", \"median\": " << baseline.median_ << ", \"mad\": " << baseline.mad_
+       << ", \"allocations\": " << baseline.allocations_
+       << ", \"max_rss_kb\": " << baseline.max_rss_kb_ << "}";
+    separator = ",\n";
+  }
+  os << "\n  ]\n}\n";
+}
+
+std::unordered_map<std::string, Baseline> ReadBaselines(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    Failwith("Couldn't open baseline file " + path);
+  }
+  const std::regex line_regex(
+      "\\{\"name\": \"(.*)\", \"median\": ([^,]+), \"mad\": ([^,]+), "
+      "\"allocations\": ([^,]+), \"max_rss_kb\": ([0-9]+)\\}");
+  std::unordered_map<std::string, Baseline> baselines;
+  std::string line;
+  std::smatch match;
+  while (std::getline(in, line)) {
+    if (std::regex_search(line, match, line_regex)) {
+      baselines[match[1]] = {match[1], std::stod(match[2]), std::stod(match[3]),
+                             std::stod(match[4]), std::stoul(match[5])};
+    }
+  }
+  return baselines;
+}
+
+// Compare the baselines of this run to the stored ones, reporting to standard error,
+// and return the number of regressions.
+size_t CompareToBaselines(const std::vector<Baseline> &current,
+                          const std::unordered_map<std::string, Baseline> &stored,
+                          double threshold) {
+  size_t regression_count = 0;
+  std::cerr << "\nComparison to baseline (threshold " << std::defaultfloat << threshold
+            << "):\n";
+  for (const auto &baseline : current) {
+    const auto search = stored.find(baseline.name_);
+    if (search == stored.end()) {
+      std::cerr << baseline.name_ << ": no baseline\n";
+      continue;
+    }
+    const Baseline &old = search->second;
+    const double time_change = baseline.median_ / old.median_ - 1.;
+    const bool slower = time_change > threshold &&
+                        baseline.median_ - old.median_ > 2. * old.mad_;
+    const bool allocates_more =
+        baseline.allocations_ > (1. + threshold) * old.allocations_ &&
+        baseline.allocations_ - old.allocations_ >= 1.;
+    std::cerr << std::left << std::setw(56) << baseline.name_ << std::right
+              << std::showpos << std::fixed << std::setprecision(1) << std::setw(8)
+              << 100. * time_change << "% time " << std::noshowpos << std::setw(12)
+              << old.allocations_ << " -> " << baseline.allocations_
+              << " allocations " << std::setw(10) << old.max_rss_kb_ << " -> "
+              << baseline.max_rss_kb_ << " kB peak RSS";
+    if (slower || allocates_more) {
+      std::cerr << "  REGRESSION";
+      regression_count++;
+    }
+    std::cerr << "\n";
+  }
+  return regression_count;
+}
+
+// ** The benchmarks
+
+const std::string ds1_fasta = "data/DS1.fasta";
+const std::string ds1_nexus = "data/DS1.subsampled_10.t";
+const std::string ds1_topologies = "data/DS1.100_topologies.nwk";
+
+void RegisterBitsetBenchmarks(BenchmarkRegistry &registry) {
+  // The rootsplits of the DS1 topologies.
+  auto make_bitsets = []() {
+    UnrootedSBNInstance inst("bitsets");
+    inst.ReadNewickFile(ds1_topologies);
+    inst.ProcessLoadedTrees();
+    BitsetVector bitsets;
+    for (const auto &[bitset, _] : inst.indexer_) {
+      if (bitset.size() == inst.TaxonCount()) {
+        bitsets.push_back(bitset);
+      }
+    }
+    return bitsets;
+  };
+  registry.Register("Bitset/Union", [make_bitsets]() {
+    return [bitsets = make_bitsets()]() {
+      Bitset result(bitsets.front().size());
+      for (const auto &bitset : bitsets) {
+        result |= bitset;
+      }
+      DoNotOptimize(result);
+    };
+  });
+  registry.Register("Bitset/Minorize", [make_bitsets]() {
+    return [bitsets = make_bitsets()]() mutable {
+      for (auto &bitset : bitsets) {
+        bitset.Minorize();
+      }
+    };
+  });
+  registry.Register("Bitset/Hash", [make_bitsets]() {
+    return [bitsets = make_bitsets()]() {
+      size_t hash = 0;
+      for (const auto &bitset : bitsets) {
+        hash ^= bitset.Hash();
+      }
+      DoNotOptimize(hash);
+    };
+  });
+  registry.Register("Bitset/Sort", [make_bitsets]() {
+    return [bitsets = make_bitsets()]() {
+      BitsetVector sorted = bitsets;
+      std::sort(sorted.begin(), sorted.end());
+      DoNotOptimize(sorted);
+    };
+  });
+}
+
+void RegisterDriverBenchmarks(BenchmarkRegistry &registry) {
+  registry.Register("Driver/ParseNexusFile", []() {
+    return []() {
+      Driver driver;
+      DoNotOptimize(driver.ParseNexusFile(ds1_nexus));
+    };
+  });
+  registry.Register("Driver/ParseNewickFile", []() {
+    return []() {
+      Driver driver;
+      DoNotOptimize(driver.ParseNewickFile(ds1_topologies));
+    };
+  });
+}
+
+void RegisterSitePatternBenchmarks(BenchmarkRegistry &registry) {
+  for (const auto &[order_name, order] :
+       std::vector<std::pair<std::string, SitePatternOrder>>{
+           {"FirstAppearance", SitePatternOrder::FirstAppearance},
+           {"Lexicographic", SitePatternOrder::Lexicographic}}) {
+    registry.Register("SitePattern/Compress/" + order_name, [order = order]() {
+      UnrootedSBNInstance inst("site_pattern");
+      inst.ReadNexusFile(ds1_nexus);
+      return [alignment = Alignment::ReadFasta(ds1_fasta),
+              tag_taxon_map = inst.TagTaxonMap(), order]() {
+        DoNotOptimize(SitePattern(alignment, tag_taxon_map, 1, order));
+      };
+    });
+  }
+}
+
+void RegisterSBNBenchmarks(BenchmarkRegistry &registry) {
+  auto make_instance = []() {
+    auto inst = std::make_shared<UnrootedSBNInstance>("sbn");
+    inst->ReadNewickFile(ds1_topologies);
+    inst->ProcessLoadedTrees();
+    return inst;
+  };
+  registry.Register("SBNInstance/ProcessLoadedTrees", [make_instance]() {
+    return [inst = make_instance()]() { inst->ProcessLoadedTrees(); };
+  });
+  registry.Register("SBNInstance/TrainExpectationMaximization", [make_instance]() {
+    return [inst = make_instance()]() {
+      DoNotOptimize(inst->TrainExpectationMaximization(0.0001, 10));
+    };
+  });
+  registry.Register("SBNInstance/SampleTrees/1000", [make_instance]() {
+    auto inst = make_instance();
+    inst->TrainSimpleAverage();
+    inst->SetSeed(1);
+    return [inst]() { inst->SampleTrees(1000); };
+  });
+}
+
+std::string ConfigurationName(const BeagleConfiguration &configuration) {
+  std::string name;
+  for (const auto flag : configuration.beagle_flag_vector_) {
+    switch (flag) {
+      case BEAGLE_FLAG_VECTOR_NONE:
+        name += "cpu";
+        break;
+      case BEAGLE_FLAG_VECTOR_SSE:
+        name += "sse";
+        break;
+      case BEAGLE_FLAG_VECTOR_AVX:
+        name += "avx";
+        break;
+      case BEAGLE_FLAG_FRAMEWORK_CUDA:
+        name += "cuda";
+        break;
+      case BEAGLE_FLAG_FRAMEWORK_OPENCL:
+        name += "opencl";
+        break;
+      default:
+        break;
+    }
+  }
+  return name + (configuration.use_tip_states_ ? "/tip_states" : "/tip_partials");
+}
+
+void RegisterEngineBenchmarks(BenchmarkRegistry &registry) {
+  const PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  for (const auto &configuration : Engine::AutoTuneCandidates()) {
+    auto make_instance = [specification, configuration]() {
+      auto inst = std::make_shared<UnrootedSBNInstance>("engine");
+      inst->ReadNexusFile(ds1_nexus);
+      inst->ReadFastaFile(ds1_fasta);
+      inst->PrepareForPhyloLikelihood(specification, 1,
+                                      configuration.beagle_flag_vector_,
+                                      configuration.use_tip_states_);
+      return inst;
+    };
+    const std::string name = ConfigurationName(configuration);
+    registry.Register("Engine/LogLikelihoods/" + name, [make_instance]() {
+      return [inst = make_instance()]() { DoNotOptimize(inst->LogLikelihoods()); };
+    });
+    registry.Register("Engine/Gradients/" + name, [make_instance]() {
+      return [inst = make_instance()]() { DoNotOptimize(inst->Gradients()); };
+    });
+  }
+}
+
+// A sweep over a caterpillar tree on the taxa of the alignment. We join the taxa one
+// at a time: the PLV so far and the PLV of the next taxon are each moved rootward
+// along their branch and multiplied. If optimize is true, we optimize the branch
+// length of each taxon on the way, using the stationary distribution as the message
+// from the rest of the tree. Either way, we finish with the likelihood at the root.
+GPOperationVector CaterpillarSweep(size_t taxon_count, bool optimize) {
+  GPOperationVector operations;
+  size_t next_plv = taxon_count;
+  size_t next_branch = 0;
+  const size_t stationary = next_plv++;
+  operations.push_back(SetToStationaryDistribution{stationary});
+  size_t rootward = 0;
+  for (size_t taxon = 1; taxon < taxon_count; taxon++) {
+    const size_t evolved_rootward = next_plv++;
+    const size_t evolved_taxon = next_plv++;
+    const size_t product = next_plv++;
+    operations.push_back(EvolveRootward{evolved_rootward, rootward, next_branch++});
+    if (optimize) {
+      operations.push_back(
+          OptimizeRootward{evolved_taxon, taxon, stationary, next_branch++});
+    } else {
+      operations.push_back(EvolveRootward{evolved_taxon, taxon, next_branch++});
+    }
+    operations.push_back(Multiply{product, evolved_rootward, evolved_taxon});
+    rootward = product;
+  }
+  operations.push_back(Likelihood{next_branch, stationary, rootward});
+  return operations;
+}
+
+void RegisterGPEngineBenchmarks(BenchmarkRegistry &registry) {
+  const size_t hardware_thread_count = std::thread::hardware_concurrency();
+  SizeVector thread_counts = {1};
+  if (hardware_thread_count > 1) {
+    thread_counts.push_back(hardware_thread_count);
+  }
+  for (const bool optimize : {false, true}) {
+    for (const size_t thread_count : thread_counts) {
+      const std::string name = std::string("GPEngine/") +
+                               (optimize ? "OptimizeSweep" : "RootwardSweep") +
+                               "/threads:" + std::to_string(thread_count);
+      registry.Register(name, [optimize, thread_count]() {
+        UnrootedSBNInstance inst("gp_engine");
+        inst.ReadNexusFile(ds1_nexus);
+        const SitePattern site_pattern(Alignment::ReadFasta(ds1_fasta),
+                                       inst.TagTaxonMap());
+        const size_t taxon_count = site_pattern.SequenceCount();
+        // Each taxon after the first takes three PLVs and two branches.
+        const size_t gpcsp_count = 3 * taxon_count;
+        auto engine = std::make_shared<GPEngine>(site_pattern, gpcsp_count, "",
+                                                 MmapBacking::Anonymous);
+        engine->SetBranchLengths(EigenVectorXd::Constant(gpcsp_count, 0.1));
+        engine->SetThreadCount(thread_count);
+        return [engine, operations = CaterpillarSweep(taxon_count, optimize)]() {
+          engine->ProcessOperations(operations);
+        };
+      });
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::string filter = ".";
+  double min_time = 0.5;
+  size_t repetitions = 1;
+  std::string out_path;
+  std::string baseline_out_path;
+  std::string baseline_path;
+  double threshold = 0.1;
+  for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
+    const std::string arg = argv[arg_idx];
+    const auto has_flag = [&arg](const std::string &flag) {
+      return arg.rfind(flag + "=", 0) == 0;
+    };
+    const auto value_of = [&arg](const std::string &flag) {
+      return arg.substr(flag.size() + 1);
+    };
+    if (has_flag("--benchmark_filter")) {
+      filter = value_of("--benchmark_filter");
+    } else if (has_flag("--benchmark_min_time")) {
+      min_time = std::stod(value_of("--benchmark_min_time"));
+    } else if (has_flag("--benchmark_repetitions")) {
+      repetitions = std::max(1ul, std::stoul(value_of("--benchmark_repetitions")));
+    } else if (has_flag("--benchmark_out")) {
+      out_path = value_of("--benchmark_out");
+    } else if (has_flag("--baseline_out")) {
+      baseline_out_path = value_of("--baseline_out");
+    } else if (has_flag("--baseline")) {
+      baseline_path = value_of("--baseline");
+    } else if (has_flag("--regression_threshold")) {
+      threshold = std::stod(value_of("--regression_threshold"));
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 1;
+    }
+  }
+  // Read the baselines first, so that we don't run for nothing if they're missing.
+  std::unordered_map<std::string, Baseline> stored_baselines;
+  if (!baseline_path.empty()) {
+    stored_baselines = ReadBaselines(baseline_path);
+  }
+  BenchmarkRegistry registry;
+  RegisterBitsetBenchmarks(registry);
+  RegisterDriverBenchmarks(registry);
+  RegisterSitePatternBenchmarks(registry);
+  RegisterSBNBenchmarks(registry);
+  RegisterEngineBenchmarks(registry);
+  RegisterGPEngineBenchmarks(registry);
+  // Send anything the library prints, such as progress bars, to standard error so
+  // that standard output is just the JSON.
+  std::streambuf *stdout_buffer = std::cout.rdbuf(std::cerr.rdbuf());
+  const auto results = registry.Run(std::regex(filter), min_time, repetitions);
+  std::cout.rdbuf(stdout_buffer);
+  if (out_path.empty()) {
+    WriteJSON(std::cout, argv[0], repetitions, results);
+  } else {
+    std::ofstream out(out_path);
+    WriteJSON(out, argv[0], repetitions, results);
+  }
+  const auto baselines = BaselinesOf(results);
+  if (!baseline_out_path.empty()) {
+    std::ofstream out(baseline_out_path);
+    WriteBaselines(out, baselines);
+  }
+  if (!baseline_path.empty() &&
+      CompareToBaselines(baselines, stored_baselines, threshold) > 0) {
+    return 1;
+  }
+  return 0;
+}
@@ -5,142 +5,169 @@
 #include <utility>
 #include "sugar.hpp"
 
-Bitset::Bitset(std::vector<bool> value) : value_(std::move(value)) {}
+Bitset::Bitset(std::vector<bool> value) : Bitset(value.size()) {
+  for (size_t i = 0; i < value.size(); i++) {
+    if (value[i]) {
+      set(i);
+    }
+  }
+}
 
-Bitset::Bitset(size_t n, bool initial_value) : value_(n, initial_value) {}
+Bitset::Bitset(size_t n, bool initial_value)
+    : words_(WordCount(n), initial_value ? ~Word(0) : Word(0)), size_(n) {
+  ClearUnusedBits();
+}
 
 Bitset::Bitset(std::string str) : Bitset(str.length()) {
-  for (size_t i = 0; i < value_.size(); i++) {
-    if (str[i] == '0') {
-      value_[i] = false;
-    } else if (str[i] == '1') {
-      value_[i] = true;
-    } else {
+  for (size_t i = 0; i < size_; i++) {
+    if (str[i] == '1') {
+      set(i);
+    } else if (str[i] != '0') {
       Failwith("String constructor for Bitset must use only 0s or 1s; found '" +
                std::string(1, str[i]) + "'.");
     }
   }
 }
 
-bool Bitset::operator[](size_t i) const { return value_[i]; }
+bool Bitset::operator[](size_t i) const {
+  return (words_[i / word_width_] >> (i % word_width_)) & Word(1);
+}
 
-size_t Bitset::size() const { return value_.size(); }
+size_t Bitset::size() const { return size_; }
 
 void Bitset::set(size_t i, bool value) {
-  Assert(i < value_.size(), "i out of range in Bitset::set.");
-  value_[i] = value;
+  Assert(i < size_, "i out of range in Bitset::set.");
+  const Word mask = Word(1) << (i % word_width_);
+  if (value) {
+    words_[i / word_width_] |= mask;
+  } else {
+    words_[i / word_width_] &= ~mask;
+  }
 }
 
 void Bitset::reset(size_t i) {
-  Assert(i < value_.size(), "i out of range in Bitset::reset.");
-  value_[i] = false;
+  Assert(i < size_, "i out of range in Bitset::reset.");
+  words_[i / word_width_] &= ~(Word(1) << (i % word_width_));
 }
 
-void Bitset::flip() { value_.flip(); }
+void Bitset::flip() {
+  for (auto &word : words_) {
+    word = ~word;
+  }
+  ClearUnusedBits();
+}
 
-bool Bitset::operator==(const Bitset& other) const { return value_ == other.value_; }
-bool Bitset::operator!=(const Bitset& other) const { return value_ != other.value_; }
-bool Bitset::operator<(const Bitset& other) const { return value_ < other.value_; }
-bool Bitset::operator<=(const Bitset& other) const { return value_ <= other.value_; }
-bool Bitset::operator>(const Bitset& other) const { return value_ > other.value_; }
-bool Bitset::operator>=(const Bitset& other) const { return value_ >= other.value_; }
+bool Bitset::operator==(const Bitset& other) const {
+  return size_ == other.size_ && words_ == other.words_;
+}
+bool Bitset::operator!=(const Bitset& other) const { return !(*this == other); }
+bool Bitset::operator<(const Bitset& other) const { return Compare(other) < 0; }
+bool Bitset::operator<=(const Bitset& other) const { return Compare(other) <= 0; }
+bool Bitset::operator>(const Bitset& other) const { return Compare(other) > 0; }
+bool Bitset::operator>=(const Bitset& other) const { return Compare(other) >= 0; }
 
 Bitset Bitset::operator&(const Bitset& other) const {
-  Assert(value_.size() == other.size(), "Size mismatch in Bitset::operator&.");
-  Bitset r(value_.size());
-  for (size_t i = 0; i < value_.size(); i++) {
-    if (value_[i] && other.value_[i]) {
-      r.set(i);
-    }
+  Assert(size_ == other.size(), "Size mismatch in Bitset::operator&.");
+  Bitset r(*this);
+  for (size_t w = 0; w < words_.size(); w++) {
+    r.words_[w] &= other.words_[w];
   }
   return r;
 }
 
 Bitset Bitset::operator|(const Bitset& other) const {
-  Assert(value_.size() == other.size(), "Size mismatch in Bitset::operator|.");
-  Bitset r(value_.size());
-  for (size_t i = 0; i < value_.size(); i++) {
-    if (value_[i] || other.value_[i]) {
-      r.set(i);
-    }
+  Assert(size_ == other.size(), "Size mismatch in Bitset::operator|.");
+  Bitset r(*this);
+  for (size_t w = 0; w < words_.size(); w++) {
+    r.words_[w] |= other.words_[w];
   }
   return r;
 }
 
 Bitset Bitset::operator^(const Bitset& other) const {
-  Assert(value_.size() == other.size(), "Size mismatch in Bitset::operator^.");
-  Bitset r(value_.size());
-  for (size_t i = 0; i < value_.size(); i++) {
-    if (value_[i] != other.value_[i]) {
-      r.set(i);
-    }
+  Assert(size_ == other.size(), "Size mismatch in Bitset::operator^.");
+  Bitset r(*this);
+  for (size_t w = 0; w < words_.size(); w++) {
+    r.words_[w] ^= other.words_[w];
   }
   return r;
 }
 
 Bitset Bitset::operator~() const {
-  Bitset r(value_);
-  r.value_.flip();
+  Bitset r(*this);
+  r.flip();
   return r;
 }
 
 Bitset Bitset::operator+(const Bitset& other) const {
-  Bitset sum(value_.size() + other.size());
+  Bitset sum(size_ + other.size());
   sum.CopyFrom(*this, 0, false);
-  sum.CopyFrom(other, value_.size(), false);
+  sum.CopyFrom(other, size_, false);
   return sum;
 }
 
 void Bitset::operator&=(const Bitset& other) {
-  Assert(value_.size() == other.size(), "Size mismatch in Bitset::operator&=.");
-  for (size_t i = 0; i < value_.size(); i++) {
-    value_[i] = value_[i] && other[i];
+  Assert(size_ == other.size(), "Size mismatch in Bitset::operator&=.");
+  for (size_t w = 0; w < words_.size(); w++) {
+    words_[w] &= other.words_[w];
   }
 }
 
 void Bitset::operator|=(const Bitset& other) {
-  Assert(value_.size() == other.size(), "Size mismatch in Bitset::operator|=.");
-  for (size_t i = 0; i < value_.size(); i++) {
-    value_[i] = value_[i] || other[i];
+  Assert(size_ == other.size(), "Size mismatch in Bitset::operator|=.");
+  for (size_t w = 0; w < words_.size(); w++) {
+    words_[w] |= other.words_[w];
   }
 }
 
 // These methods aren't in the bitset interface.
 
-void Bitset::Zero() { std::fill(value_.begin(), value_.end(), false); }
-
-size_t Bitset::Hash() const { return std::hash<std::vector<bool>>{}(value_); }
+void Bitset::Zero() { std::fill(words_.begin(), words_.end(), Word(0)); }
+
+size_t Bitset::Hash() const {
+  // Fold each word into the state and scramble with the splitmix64 finalizer, so
+  // that every input bit affects every output bit.
+  const auto mix = [](uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  };
+  uint64_t hash = mix(size_ + 0x9e3779b97f4a7c15ULL);
+  for (const auto word : words_) {
+    hash = mix(hash ^ word) + 0x9e3779b97f4a7c15ULL;
+  }
+  return static_cast<size_t>(hash);
+}
 
 std::string Bitset::ToString() const {
-  std::string str;
-  for (size_t i = 0; i < value_.size(); ++i) {
-    str += (value_[i] ? '1' : '0');
+  std::string str(size_, '0');
+  for (size_t i = 0; i < size_; ++i) {
+    if ((*this)[i]) {
+      str[i] = '1';
+    }
   }
   return str;
 }
 
 bool Bitset::All() const {
-  for (size_t i = 0; i < value_.size(); ++i) {
-    if (!value_[i]) {
-      return false;
-    }
+  size_t count = 0;
+  for (const auto word : words_) {
+    count += __builtin_popcountll(word);
   }
-  return true;
+  return count == size_;
 }
 
 bool Bitset::Any() const {
-  for (size_t i = 0; i < value_.size(); ++i) {
-    if (value_[i]) {
-      return true;
-    }
-  }
-  return false;
+  return std::any_of(words_.begin(), words_.end(), [](Word word) { return word != 0; });
 }
 
 void Bitset::Minorize() {
-  Assert(!(value_.empty()), "Can't Bitset::Minorize an empty bitset.");
-  if (value_[0]) {
-    value_.flip();
+  Assert(size_ > 0, "Can't Bitset::Minorize an empty bitset.");
+  if ((*this)[0]) {
+    flip();
   }
 }
 
@@ -148,56 +175,117 @@ void Bitset::Minorize() {
 // begin, and optionally flipping the bits as they get copied.
 void Bitset::CopyFrom(const Bitset& other, size_t begin, bool flip) {
   Assert(begin + other.size() <= size(), "Can't fit copy in Bitset::CopyFrom.");
-  if (flip) {
-    for (size_t i = 0; i < other.size(); i++) {
-      value_[i + begin] = !other[i];
-    }
-  } else {
-    for (size_t i = 0; i < other.size(); i++) {
-      value_[i + begin] = other[i];
-    }
+  for (size_t w = 0; w < other.words_.size(); w++) {
+    const size_t bit_count = std::min(word_width_, other.size_ - w * word_width_);
+    SetWordAt(begin + w * word_width_, flip ? ~other.words_[w] : other.words_[w],
+              bit_count);
   }
 }
 
 std::optional<uint32_t> Bitset::SingletonOption() const {
-  bool found_already = false;
-  uint32_t found_index;
-  for (uint32_t i = 0; i < size(); i++) {
-    if (value_[i]) {
-      if (found_already) {
-        // We previously found an index, so this isn't a singleton.
-        return std::nullopt;
-      }  // else
-      found_already = true;
-      found_index = i;
+  std::optional<uint32_t> found_index;
+  for (size_t w = 0; w < words_.size(); w++) {
+    const Word word = words_[w];
+    if (word == 0) {
+      continue;
+    }
+    // We previously found an index, or this word has more than one bit on, so this
+    // isn't a singleton.
+    if (found_index.has_value() || __builtin_popcountll(word) > 1) {
+      return std::nullopt;
+    }  // else
+    found_index = static_cast<uint32_t>(w * word_width_ + __builtin_ctzll(word));
+  }
+  return found_index;
+}
+
+void Bitset::CopyWordsTo(uint64_t* words) const {
+  std::copy(words_.begin(), words_.end(), words);
+}
+
+// ** Word-level helpers
+
+size_t Bitset::WordCount(size_t bit_count) {
+  return (bit_count + word_width_ - 1) / word_width_;
+}
+
+void Bitset::ClearUnusedBits() {
+  const size_t used_bit_count = size_ % word_width_;
+  if (used_bit_count > 0) {
+    words_.back() &= (Word(1) << used_bit_count) - 1;
+  }
+}
+
+Bitset::Word Bitset::WordAt(size_t begin) const {
+  const size_t w = begin / word_width_;
+  const size_t offset = begin % word_width_;
+  if (w >= words_.size()) {
+    return 0;
+  }  // else
+  Word word = words_[w] >> offset;
+  if (offset > 0 && w + 1 < words_.size()) {
+    word |= words_[w + 1] << (word_width_ - offset);
+  }
+  return word;
+}
+
+void Bitset::SetWordAt(size_t begin, Word word, size_t bit_count) {
+  const Word mask = bit_count == word_width_ ? ~Word(0) : (Word(1) << bit_count) - 1;
+  word &= mask;
+  const size_t w = begin / word_width_;
+  const size_t offset = begin % word_width_;
+  words_[w] = (words_[w] & ~(mask << offset)) | (word << offset);
+  if (offset > 0 && offset + bit_count > word_width_) {
+    const size_t shift = word_width_ - offset;
+    words_[w + 1] = (words_[w + 1] & ~(mask >> shift)) | (word >> shift);
+  }
+}
+
+Bitset Bitset::Slice(size_t begin, size_t length) const {
+  Assert(begin + length <= size_, "Slice out of range in Bitset::Slice.");
+  Bitset slice(length);
+  for (size_t w = 0; w < slice.words_.size(); w++) {
+    slice.words_[w] = WordAt(begin + w * word_width_);
+  }
+  // The last word may have picked up bits from past the end of the slice.
+  slice.ClearUnusedBits();
+  return slice;
+}
+
+int Bitset::Compare(const Bitset& other) const {
+  const size_t common_size = std::min(size_, other.size_);
+  const size_t common_word_count = WordCount(common_size);
+  for (size_t w = 0; w < common_word_count; w++) {
+    Word difference = words_[w] ^ other.words_[w];
+    if (w + 1 == common_word_count && common_size % word_width_ > 0) {
+      difference &= (Word(1) << (common_size % word_width_)) - 1;
+    }
+    if (difference != 0) {
+      // The first differing bit decides: the bitset with a 0 there comes first.
+      const Word first_difference = difference & (~difference + 1);
+      return (words_[w] & first_difference) ? 1 : -1;
     }
   }
-  if (found_already) {
-    return found_index;
+  // One is a prefix of the other, so the shorter one comes first.
+  if (size_ == other.size_) {
+    return 0;
   }  // else
-  return std::nullopt;
+  return size_ < other.size_ ? -1 : 1;
 }
 
 // ** SBN-related functions
 
 Bitset Bitset::RotateSubsplit() const {
   Assert(size() % 2 == 0, "Bitset::RotateSubsplit requires an even-size bitset.");
-  Bitset exchanged(size());
   size_t chunk_size = size() / 2;
-  for (size_t i = 0; i < chunk_size; i++) {
-    exchanged.set(i, value_[i + chunk_size]);
-    exchanged.set(i + chunk_size, value_[i]);
-  }
-  return exchanged;
+  return Slice(chunk_size, chunk_size) + Slice(0, chunk_size);
 }
 
 Bitset Bitset::SplitChunk(size_t i) const {
   Assert(size() % 2 == 0, "Bitset::SplitChunk requires an even-size bitset.");
   Assert(i < 2, "Bitset::SplitChunk only allows 2 chunks.");
   size_t chunk_size = size() / 2;
-  std::vector<bool> new_value(value_.begin() + int32_t(i * chunk_size),
-                              value_.begin() + int32_t((i + 1) * chunk_size));
-  return Bitset(new_value);
+  return Slice(i * chunk_size, chunk_size);
 }
 
 std::string Bitset::ToStringChunked(size_t chunk_count) const {
@@ -205,9 +293,9 @@ std::string Bitset::ToStringChunked(size_t chunk_count) const {
          "Size isn't a multiple of chunk_count in Bitset::ToStringChunked.");
   size_t chunk_size = size() / chunk_count;
   std::string str;
-  for (size_t i = 0; i < value_.size(); ++i) {
-    str += (value_[i] ? '1' : '0');
-    if ((i + 1) % chunk_size == 0 && i + 1 < value_.size()) {
+  for (size_t i = 0; i < size_; ++i) {
+    str += ((*this)[i] ? '1' : '0');
+    if ((i + 1) % chunk_size == 0 && i + 1 < size_) {
       // The next item will start a new chunk, so add a separator.
       str += '|';
     }
@@ -225,33 +313,24 @@ size_t Bitset::PCSSChunkSize() const {
 
 Bitset Bitset::PCSSChunk(size_t i) const {
   size_t chunk_size = PCSSChunkSize();
-  std::vector<bool> new_value(value_.begin() + int32_t(i * chunk_size),
-                              value_.begin() + int32_t((i + 1) * chunk_size));
-  return Bitset(new_value);
+  return Slice(i * chunk_size, chunk_size);
 }
 
 Bitset Bitset::PCSSParent() const {
   size_t chunk_size = PCSSChunkSize();
-  std::vector<bool> new_value(value_.begin(), value_.begin() + int32_t(2 * chunk_size));
-  return Bitset(new_value);
+  return Slice(0, 2 * chunk_size);
 }
 
 Bitset Bitset::PCSSWithoutParent() const {
   size_t chunk_size = PCSSChunkSize();
-  std::vector<bool> new_value(value_.begin() + int32_t(chunk_size), value_.end());
-  return Bitset(new_value);
+  return Slice(chunk_size, 2 * chunk_size);
 }
 
 Bitset Bitset::PCSSChildSubsplit() const {
-  size_t chunk_size = PCSSChunkSize();
-  std::vector<bool> new_value(value_.begin() + int32_t(chunk_size),
-                              value_.begin() + int32_t(3 * chunk_size));
-  for (size_t i = 0; i < chunk_size; i++) {
-    // If A is the child clade, and B is one half of the child split, take the
-    // things that are in A but not in B.
-    new_value[i] = new_value[i] && !(new_value[i + chunk_size]);
-  }
-  return Bitset(new_value);
+  // If A is the child clade, and B is one half of the child split, take the
+  // things that are in A but not in B.
+  Bitset child_half = PCSSChunk(2);
+  return (PCSSChunk(1) & ~child_half) + child_half;
 }
 
 bool Bitset::PCSSIsValid() const {
@@ -291,14 +370,15 @@ Bitset Bitset::Singleton(size_t n, size_t which_on) {
   return singleton;
 }
 
+Bitset Bitset::FromWords(size_t n, const uint64_t* words) {
+  Bitset result(n);
+  std::copy_n(words, result.words_.size(), result.words_.begin());
+  result.ClearUnusedBits();
+  return result;
+}
+
 Bitset Bitset::ChildSubsplit(const Bitset& parent_subsplit, const Bitset& child_half) {
-  size_t taxon_count = child_half.size();
-  Bitset result(2 * taxon_count);
-  Assert(result.size() == parent_subsplit.size(),
+  Assert(2 * child_half.size() == parent_subsplit.size(),
          "Size mismatch in Bitset::ChildSubsplit.");
-  for (size_t i = 0; i < taxon_count; i++) {
-    result.set(i, parent_subsplit[taxon_count + i] ^ child_half[i]);
-    result.set(i + taxon_count, child_half[i]);
-  }
-  return result;
+  return (parent_subsplit.SplitChunk(1) ^ child_half) + child_half;
 }
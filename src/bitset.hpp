@@ -5,6 +5,8 @@
 #define SRC_BITSET_HPP_
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <functional>
 #include <optional>
 #include <string>
@@ -15,6 +17,18 @@
 // this class goes way beyond what std::bitset offers.
 // Note that we can't use std::bitset because we don't know the size of the
 // bitsets at compile time.
+//
+// The bits are packed into 64-bit words, with bit i stored in word i / 64 at
+// position i % 64. The bits of the last word past size() are always kept at zero so
+// that whole-word comparison, popcount, and hashing are valid.
+//
+// Bitsets of up to LIBSBN_BITSET_INLINE_BITS bits keep their words inline rather
+// than on the heap, so that the many temporary subsplits and PCSSs made by the SBN
+// code don't allocate. The default covers the PCSSs of up to 213 taxa.
+
+#ifndef LIBSBN_BITSET_INLINE_BITS
+#define LIBSBN_BITSET_INLINE_BITS 640
+#endif
 
 class Bitset {
  public:
@@ -59,6 +73,9 @@ class Bitset {
   // If the bitset only has one bit on, then we return the location of that bit.
   // Otherwise, return nullopt.
   std::optional<uint32_t> SingletonOption() const;
+  // Copy the packed words into an array of PackedWordCount(size()) words, as
+  // for binary files.
+  void CopyWordsTo(uint64_t *words) const;
 
   // These methods require the bitset to be a "subsplit bitset" of even length,
   // consisting of two equal sized "chunks" representing the two sides of the
@@ -101,9 +118,75 @@ class Bitset {
   // Make the full subsplit out of the parent subsplit, whose second half is
   // split by child_half.
   static Bitset ChildSubsplit(const Bitset &parent_subsplit, const Bitset &child_half);
+  // The number of bytes this bitset keeps on the heap, which is zero unless it is too
+  // big to keep its words inline.
+  size_t HeapByteCount() const {
+    return words_.size() > inline_word_count_ ? words_.size() * sizeof(Word) : 0;
+  }
+  // The number of 64-bit words that hold the packed bits of a bitset of this size.
+  static size_t PackedWordCount(size_t bit_count) { return WordCount(bit_count); }
+  // Make a bitset of size n from its packed words, as written by CopyWordsTo.
+  static Bitset FromWords(size_t n, const uint64_t *words);
 
  private:
-  std::vector<bool> value_;
+  using Word = uint64_t;
+  static constexpr size_t word_width_ = 64;
+  static constexpr size_t inline_word_count_ =
+      (LIBSBN_BITSET_INLINE_BITS + word_width_ - 1) / word_width_;
+
+  // A fixed-size array of words that lives inline when it is small enough, and on
+  // the heap otherwise.
+  class WordStorage {
+   public:
+    WordStorage(size_t count, Word value) : count_(count), inline_words_{} {
+      if (IsInline()) {
+        std::fill_n(inline_words_.begin(), count, value);
+      } else {
+        heap_words_.assign(count, value);
+      }
+    }
+
+    size_t size() const { return count_; }
+    Word &operator[](size_t i) { return data()[i]; }
+    const Word &operator[](size_t i) const { return data()[i]; }
+    Word &back() { return data()[count_ - 1]; }
+    Word *begin() { return data(); }
+    Word *end() { return data() + count_; }
+    const Word *begin() const { return data(); }
+    const Word *end() const { return data() + count_; }
+
+    bool operator==(const WordStorage &other) const {
+      return count_ == other.count_ && std::equal(begin(), end(), other.begin());
+    }
+
+   private:
+    size_t count_;
+    std::array<Word, inline_word_count_> inline_words_;
+    std::vector<Word> heap_words_;
+
+    bool IsInline() const { return count_ <= inline_word_count_; }
+    Word *data() { return IsInline() ? inline_words_.data() : heap_words_.data(); }
+    const Word *data() const {
+      return IsInline() ? inline_words_.data() : heap_words_.data();
+    }
+  };
+
+  WordStorage words_;
+  size_t size_;
+
+  static size_t WordCount(size_t bit_count);
+  // Zero out the bits of the last word that lie past the end of the bitset.
+  void ClearUnusedBits();
+  // Get the (up to) 64 bits starting at position begin, zero-filled past the end.
+  Word WordAt(size_t begin) const;
+  // Overwrite the bit_count <= 64 bits starting at position begin with the low bits
+  // of word.
+  void SetWordAt(size_t begin, Word word, size_t bit_count);
+  // Copy out the bits in [begin, begin + length).
+  Bitset Slice(size_t begin, size_t length) const;
+  // Lexicographic comparison in bit order, as for std::vector<bool>: negative if
+  // this bitset comes first, zero if they are equal, and positive otherwise.
+  int Compare(const Bitset &other) const;
 };
 
 // This is how we inject a hash routine and a custom comparator into the std
@@ -161,6 +244,13 @@ TEST_CASE("Bitset") {
   CHECK_EQ(Bitset("101") + Bitset("011"), Bitset("101011"));
   CHECK_EQ(std::min(Bitset("1100"), Bitset("1010")), Bitset("1010"));
 
+  const Bitset long_bitset = Bitset::Singleton(130, 129) | Bitset::Singleton(130, 3);
+  std::vector<uint64_t> words(Bitset::PackedWordCount(long_bitset.size()));
+  CHECK_EQ(words.size(), 3);
+  long_bitset.CopyWordsTo(words.data());
+  CHECK_EQ(words, std::vector<uint64_t>({8, 0, 2}));
+  CHECK_EQ(Bitset::FromWords(130, words.data()), long_bitset);
+
   a &= Bitset("0110");
   CHECK_EQ(a, Bitset("0100"));
 
@@ -212,6 +302,64 @@ TEST_CASE("Bitset") {
   CHECK_EQ(Bitset::ChildSubsplit(Bitset("00011110"), Bitset("1010")),
            Bitset("01001010"));
 }
+
+TEST_CASE("Bitset: Multi-word") {
+  // Build bitsets that straddle word boundaries, and check them against the
+  // string representation.
+  std::string str;
+  for (size_t i = 0; i < 150; i++) {
+    str += (i % 3 == 0 || i % 7 == 0) ? '1' : '0';
+  }
+  Bitset a(str);
+  CHECK_EQ(a.ToString(), str);
+  CHECK_EQ((~a).ToString().find('1'), 1);
+  CHECK_EQ((a ^ a).Any(), false);
+  CHECK_EQ((a | ~a).All(), true);
+  CHECK_EQ(Bitset(150, true).size(), 150);
+  CHECK_EQ(Bitset(150, true).All(), true);
+  CHECK_EQ(Bitset(150, false).Any(), false);
+  CHECK_EQ(Bitset::Singleton(150, 131).SingletonOption(), 131);
+  CHECK_EQ(a.SingletonOption(), std::nullopt);
+  auto two_on = Bitset::Singleton(150, 3) | Bitset::Singleton(150, 131);
+  CHECK_EQ(two_on.SingletonOption(), std::nullopt);
+
+  // Bit order comparison, where the first differing bit is past the first word.
+  CHECK_LT(Bitset::Singleton(150, 131), Bitset::Singleton(150, 100));
+  CHECK_LT(Bitset(str.substr(0, 70)), a);
+  CHECK_EQ(a, Bitset(str));
+  CHECK_NE(a, Bitset(str.substr(0, 149) + (str[149] == '1' ? "0" : "1")));
+  CHECK_EQ(a.Hash(), Bitset(str).Hash());
+  CHECK_NE(a.Hash(), (~a).Hash());
+
+  // Chunk extraction with unaligned chunk boundaries.
+  CHECK_EQ(a.SplitChunk(0).ToString(), str.substr(0, 75));
+  CHECK_EQ(a.SplitChunk(1).ToString(), str.substr(75, 75));
+  CHECK_EQ(a.RotateSubsplit().ToString(), str.substr(75, 75) + str.substr(0, 75));
+  for (size_t i = 0; i < 3; i++) {
+    CHECK_EQ(a.PCSSChunk(i).ToString(), str.substr(50 * i, 50));
+  }
+  CHECK_EQ((a.SplitChunk(0) + a.SplitChunk(1)), a);
+  Bitset b(150);
+  b.CopyFrom(a.SplitChunk(0), 75, true);
+  CHECK_EQ(b.SplitChunk(1), ~a.SplitChunk(0));
+  CHECK_EQ(b.SplitChunk(0).Any(), false);
+}
+
+TEST_CASE("Bitset: Heap storage") {
+  // Bitsets too big for inline storage should behave the same as small ones.
+  const size_t size = 2 * LIBSBN_BITSET_INLINE_BITS + 10;
+  Bitset big = Bitset::Singleton(size, size - 1);
+  CHECK_EQ(big.SingletonOption(), size - 1);
+  CHECK_EQ(big.SplitChunk(1), Bitset::Singleton(size / 2, size / 2 - 1));
+  CHECK_EQ(big.RotateSubsplit().SingletonOption(), size / 2 - 1);
+  CHECK_EQ((big | ~big).All(), true);
+  Bitset copy = big;
+  copy.flip();
+  CHECK_EQ(copy, ~big);
+  CHECK_GT(copy, big);
+  // Mixing heap and inline bitsets.
+  CHECK_EQ(big.SplitChunk(0) + big.SplitChunk(1), big);
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
 #endif  // SRC_BITSET_HPP_
@@ -0,0 +1,157 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A flat version of the per-tree representations, such as indexer representations
+// and PSP indexer representations, that are vectors of vectors of indices for each
+// tree.
+//
+// These are packed as in compressed sparse row (CSR) storage. Each tree has a run of
+// rows, and each row has a run of indices: the rows of tree i are
+// tree_offsets_[i], ..., tree_offsets_[i + 1] - 1, and the indices of row j are
+// indices_[row_offsets_[j]], ..., indices_[row_offsets_[j + 1] - 1]. So a whole
+// collection of trees lives in three vectors rather than in many small ones, and
+// each of them can be handed to NumPy without copying.
+//
+// The indices are indices into sbn_parameters_ or the PSP indexer, so we store them
+// as 32-bit integers.
+
+#ifndef SRC_CSR_REPRESENTATION_HPP_
+#define SRC_CSR_REPRESENTATION_HPP_
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "sugar.hpp"
+
+class CSRRepresentation {
+ public:
+  using Index = uint32_t;
+  using IndexVector = std::vector<Index>;
+
+  // A view of the indices of one row, which works like a const SizeVector in
+  // range-based for loops.
+  class Row {
+   public:
+    Row(const Index *begin, const Index *end) : begin_(begin), end_(end) {}
+
+    const Index *begin() const { return begin_; }
+    const Index *end() const { return end_; }
+    size_t size() const { return static_cast<size_t>(end_ - begin_); }
+    Index operator[](size_t idx) const { return begin_[idx]; }
+
+   private:
+    const Index *begin_;
+    const Index *end_;
+  };
+
+  // A view of the rows of one tree, for use in range-based for loops.
+  class TreeRows {
+   public:
+    class Iterator {
+     public:
+      Iterator(const CSRRepresentation &csr, size_t row_idx)
+          : csr_(csr), row_idx_(row_idx) {}
+      Row operator*() const { return csr_.GetRow(row_idx_); }
+      Iterator &operator++() {
+        row_idx_++;
+        return *this;
+      }
+      bool operator!=(const Iterator &other) const {
+        return row_idx_ != other.row_idx_;
+      }
+
+     private:
+      const CSRRepresentation &csr_;
+      size_t row_idx_;
+    };
+
+    TreeRows(const CSRRepresentation &csr, size_t tree_idx)
+        : csr_(csr),
+          begin_(csr.tree_offsets_[tree_idx]),
+          end_(csr.tree_offsets_[tree_idx + 1]) {}
+
+    Iterator begin() const { return {csr_, begin_}; }
+    Iterator end() const { return {csr_, end_}; }
+    size_t size() const { return end_ - begin_; }
+
+   private:
+    const CSRRepresentation &csr_;
+    size_t begin_;
+    size_t end_;
+  };
+
+  CSRRepresentation() : tree_offsets_({0}), row_offsets_({0}) {}
+
+  size_t TreeCount() const { return tree_offsets_.size() - 1; }
+  size_t RowCount() const { return row_offsets_.size() - 1; }
+
+  const SizeVector &TreeOffsets() const { return tree_offsets_; }
+  const SizeVector &RowOffsets() const { return row_offsets_; }
+  const IndexVector &Indices() const { return indices_; }
+
+  void Reserve(size_t tree_count, size_t row_count, size_t index_count) {
+    tree_offsets_.reserve(tree_count + 1);
+    row_offsets_.reserve(row_count + 1);
+    indices_.reserve(index_count);
+  }
+
+  // Append a tree given as a vector of rows of indices.
+  void PushBack(const SizeVectorVector &rows) {
+    for (const auto &row : rows) {
+      for (const auto idx : row) {
+        Assert(idx <= std::numeric_limits<Index>::max(),
+               "Index too large for a CSRRepresentation.");
+        indices_.push_back(static_cast<Index>(idx));
+      }
+      row_offsets_.push_back(indices_.size());
+    }
+    tree_offsets_.push_back(RowCount());
+  }
+
+  Row GetRow(size_t row_idx) const {
+    const Index *data = indices_.data();
+    return {data + row_offsets_[row_idx], data + row_offsets_[row_idx + 1]};
+  }
+  TreeRows RowsOf(size_t tree_idx) const { return {*this, tree_idx}; }
+
+  // Unpack the representation of a tree into a vector of vectors.
+  SizeVectorVector VectorsOf(size_t tree_idx) const {
+    SizeVectorVector result;
+    for (const auto row : RowsOf(tree_idx)) {
+      result.emplace_back(row.begin(), row.end());
+    }
+    return result;
+  }
+
+ private:
+  SizeVector tree_offsets_;
+  SizeVector row_offsets_;
+  IndexVector indices_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("CSRRepresentation") {
+  CSRRepresentation csr;
+  CHECK_EQ(csr.TreeCount(), 0);
+  const std::vector<SizeVectorVector> trees = {
+      {{0, 1, 2}, {3}}, {}, {{4, 5}, {}, {6, 7, 8, 9}}};
+  for (const auto &tree : trees) {
+    csr.PushBack(tree);
+  }
+  CHECK_EQ(csr.TreeCount(), 3);
+  CHECK_EQ(csr.RowCount(), 5);
+  CHECK_EQ(csr.TreeOffsets(), SizeVector({0, 2, 2, 5}));
+  CHECK_EQ(csr.RowOffsets(), SizeVector({0, 3, 4, 6, 6, 10}));
+  CHECK_EQ(csr.Indices(),
+           CSRRepresentation::IndexVector({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+  for (size_t tree_idx = 0; tree_idx < trees.size(); tree_idx++) {
+    CHECK_EQ(csr.VectorsOf(tree_idx), trees[tree_idx]);
+    CHECK_EQ(csr.RowsOf(tree_idx).size(), trees[tree_idx].size());
+  }
+  CHECK_EQ(csr.GetRow(4).size(), 4);
+  CHECK_EQ(csr.GetRow(4)[1], 7);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_CSR_REPRESENTATION_HPP_
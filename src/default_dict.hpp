@@ -30,6 +30,7 @@ class DefaultDict {
   T at(const Key &key) { return AtWithDefault(map_, key, default_value_); }
 
   bool contains(const Key &key) const { return (map_.find(key) != map_.end()); }
+  void clear() { map_.clear(); }
 
   void increment(const Key &key, const T &value) {
     auto search = map_.find(key);
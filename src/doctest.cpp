@@ -5,6 +5,7 @@
 #include "doctest.h"
 #include <string>
 #include "rooted_sbn_instance.hpp"
+#include "stochastic_optimizer.hpp"
 #include "taxon_name_munging.hpp"
 #include "unrooted_sbn_instance.hpp"
 
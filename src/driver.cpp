@@ -5,10 +5,17 @@
 // https://www.gnu.org/software/bison/manual/html_node/Calc_002b_002b-Parsing-Driver.html#Calc_002b_002b-Parsing-Driver
 
 #include "driver.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <regex>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 #include "parser.hpp"
@@ -19,6 +26,7 @@ Driver::Driver()
       taxa_complete_(false),
       trace_parsing_(0),
       trace_scanning_(false),
+      use_fast_newick_(true),
       latest_tree_(nullptr) {}
 
 void Driver::Clear() {
@@ -31,115 +39,318 @@ void Driver::Clear() {
   branch_lengths_.clear();
 }
 
+Driver::NewickCursor::NewickCursor(Driver &driver, const LineReader &lines,
+                                   size_t thread_count, double burn_in_fraction,
+                                   size_t thinning)
+    : lines_(lines),
+      parser_(driver),
+      parallel_line_count_(thread_count * parallel_lines_per_thread_),
+      thinning_(thinning) {
+  Assert(thread_count > 0, "Thread count must be positive.");
+  Assert(0. <= burn_in_fraction && burn_in_fraction <= 1.,
+         "The burn-in fraction must be between 0 and 1.");
+  Assert(thinning > 0, "Thinning must be positive.");
+  parser_.set_debug_level(driver.trace_parsing_);
+  // Once the taxa are known, the fast path can parse lines independently, so in
+  // parallel mode we gather lines and parse them on the thread pool.
+  if (thread_count > 1 && driver.use_fast_newick_) {
+    SizeVector thread_indices(thread_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    thread_pool_ = std::make_unique<WorkStealingPool<size_t>>(thread_indices);
+  }
+  if (burn_in_fraction > 0.) {
+    // Count the trees ahead of us, then go back.
+    const size_t start_position = lines_.Position();
+    std::string_view line;
+    size_t tree_count = 0;
+    while (lines_.NextLine(line)) {
+      if (line.find_first_of('(') != std::string_view::npos) {
+        tree_count++;
+      }
+    }
+    lines_.SetPosition(start_position);
+    burn_in_count_ = static_cast<size_t>(burn_in_fraction * tree_count);
+  }
+}
+
 // This parser will allow anything before the first '('.
-TreeCollection Driver::ParseNewick(std::ifstream &in) {
-  yy::parser parser_instance(*this);
-  parser_instance.set_debug_level(trace_parsing_);
-  std::string line;
-  unsigned int line_number = 1;
+Tree::TreeVector Driver::ParseNewickBatch(NewickCursor &cursor, size_t batch_size) {
+  Assert(batch_size > 0, "Batch size must be positive.");
   Tree::TreeVector trees;
-  while (std::getline(in, line)) {
+  // Trees in a batch that have the same topology share it. See topology_interner.hpp.
+  TopologyInterner interner;
+  const auto add_tree = [&trees, &interner](Tree tree) {
+    trees.push_back(std::move(tree));
+    interner.Intern(trees.back());
+  };
+  std::vector<NumberedLine> pending_lines;
+  const auto parse_pending_lines = [this, &cursor, &pending_lines, &add_tree]() {
+    for (auto &tree : ParseNewickLinesInParallel(&cursor.parser_, *cursor.thread_pool_,
+                                                 pending_lines)) {
+      add_tree(std::move(tree));
+    }
+    pending_lines.clear();
+  };
+  std::string_view line;
+  while (trees.size() + pending_lines.size() < batch_size &&
+         cursor.lines_.NextLine(line)) {
     // Set the Bison location line number properly so we get useful error
     // messages.
-    location_.initialize(nullptr, line_number);
-    line_number++;
+    location_.initialize(nullptr, cursor.line_number_);
+    cursor.line_number_++;
     auto tree_start = line.find_first_of('(');
-    if (!line.empty() && tree_start != std::string::npos) {
-      // Erase any characters before the first '('.
-      line.erase(0, tree_start);
-      trees.push_back(ParseString(&parser_instance, line));
+    if (line.empty() || tree_start == std::string_view::npos) {
+      continue;
+    }
+    const size_t tree_idx = cursor.tree_line_count_;
+    cursor.tree_line_count_++;
+    const bool keep = tree_idx >= cursor.burn_in_count_ &&
+                      (tree_idx - cursor.burn_in_count_) % cursor.thinning_ == 0;
+    if (!keep && taxa_complete_) {
+      continue;
+    }
+    // Drop any characters before the first '('.
+    line.remove_prefix(tree_start);
+    if (cursor.thread_pool_ != nullptr && taxa_complete_) {
+      pending_lines.push_back({line, cursor.line_number_ - 1});
+      if (pending_lines.size() == cursor.parallel_line_count_) {
+        parse_pending_lines();
+      }
+    } else {
+      Tree tree = ParseString(&cursor.parser_, line);
+      if (keep) {
+        add_tree(std::move(tree));
+      }
+    }
+  }
+  if (!pending_lines.empty()) {
+    parse_pending_lines();
+  }
+  return trees;
+}
+
+void Driver::ParseNewick(const LineReader &lines, size_t batch_size,
+                         const std::function<void(Tree::TreeVector)> &consume,
+                         size_t thread_count) {
+  NewickCursor cursor(*this, lines, thread_count, 0., 1);
+  while (true) {
+    Tree::TreeVector trees = ParseNewickBatch(cursor, batch_size);
+    if (trees.empty()) {
+      break;
+    }
+    const bool finished = trees.size() < batch_size;
+    consume(std::move(trees));
+    if (finished) {
+      break;
+    }
+  }
+}
+
+Tree::TreeVector Driver::ParseNewickLinesInParallel(
+    yy::parser *parser_instance, WorkStealingPool<size_t> &thread_pool,
+    const std::vector<NumberedLine> &lines) {
+  Assert(taxa_complete_, "We need the taxa to parse Newick lines in parallel.");
+  std::vector<std::optional<Tree>> parsed_trees(lines.size());
+  // Each unit of work is a contiguous chunk of lines, with a few chunks per thread
+  // so that the work can be balanced.
+  const size_t chunk_count = std::min(lines.size(), 4 * thread_pool.ExecutorCount());
+  const auto chunk_begin = [&lines, chunk_count](size_t chunk_idx) {
+    return chunk_idx * lines.size() / chunk_count;
+  };
+  thread_pool.Run(chunk_count, [this, &lines, &parsed_trees, &chunk_begin](
+                                   size_t, size_t chunk_idx) {
+    const size_t chunk_end = chunk_begin(chunk_idx + 1);
+    for (size_t line_idx = chunk_begin(chunk_idx); line_idx < chunk_end; line_idx++) {
+      parsed_trees[line_idx] = ParseNewickFastPath(lines[line_idx].first);
+    }
+  });
+  Tree::TreeVector trees;
+  trees.reserve(lines.size());
+  for (size_t line_idx = 0; line_idx < lines.size(); line_idx++) {
+    if (parsed_trees[line_idx].has_value()) {
+      trees.push_back(std::move(*parsed_trees[line_idx]));
+    } else {
+      // The Bison parser takes the lines that the fast path doesn't handle, one at a
+      // time and in file order.
+      location_.initialize(nullptr, lines[line_idx].second);
+      trees.push_back(ParseString(parser_instance, lines[line_idx].first));
     }
   }
-  in.close();
+  return trees;
+}
+
+TreeCollection Driver::ParseNewick(const LineReader &lines, size_t thread_count) {
+  Tree::TreeVector trees;
+  ParseNewick(
+      lines, std::numeric_limits<size_t>::max(),
+      [&trees](Tree::TreeVector batch) { trees = std::move(batch); }, thread_count);
   return TreeCollection(std::move(trees), this->TagTaxonMap());
 }
 
-TreeCollection Driver::ParseNewickFile(const std::string &fname) {
+TreeCollection Driver::ParseNewickFile(const std::string &fname, size_t thread_count) {
   Clear();
-  std::ifstream in(fname.c_str());
-  if (!in) {
-    Failwith("Cannot open the File : " + fname);
-  }
-  TreeCollection perhaps_quoted_trees = ParseNewick(in);
+  const MmappedFile file(fname);
+  TreeCollection perhaps_quoted_trees =
+      ParseNewick(LineReader(file), thread_count);
   return TreeCollection(
       std::move(perhaps_quoted_trees.trees_),
       TaxonNameMunging::DequoteTagStringMap(perhaps_quoted_trees.TagTaxonMap()));
 }
 
-TreeCollection Driver::ParseNexusFile(const std::string &fname) {
+void Driver::ParseNewickFileInBatches(const std::string &fname, size_t batch_size,
+                                      const BatchConsumer &consume,
+                                      size_t thread_count) {
   Clear();
-  std::ifstream in(fname.c_str());
-  try {
-    if (!in) {
-      throw std::runtime_error("Cannot open file.");
-    }
-    std::string line;
-    std::getline(in, line);
-    if (line != "#NEXUS") {
-      throw std::runtime_error("Putative Nexus file doesn't begin with #NEXUS.");
+  const MmappedFile file(fname);
+  // The taxa are complete once the first tree is parsed, so every batch gets the
+  // same TagTaxonMap.
+  ParseNewick(
+      LineReader(file), batch_size,
+      [this, &consume](Tree::TreeVector trees) {
+        consume(TreeCollection(std::move(trees), TaxonNameMunging::DequoteTagStringMap(
+                                                     this->TagTaxonMap())));
+      },
+      thread_count);
+}
+
+TagStringMap Driver::ParseNexusTranslateBlock(LineReader &lines) {
+  // The header is short, so we copy its lines to work on them.
+  std::string_view line_view;
+  const auto next_line = [&lines, &line_view]() { return lines.NextLine(line_view); };
+  std::string line;
+  if (!next_line() || line_view != "#NEXUS") {
+    throw std::runtime_error("Putative Nexus file doesn't begin with #NEXUS.");
+  }
+  do {
+    if (!next_line()) {
+      throw std::runtime_error("Finished reading and couldn't find 'begin trees;'");
     }
-    do {
-      if (in.eof()) {
-        throw std::runtime_error("Finished reading and couldn't find 'begin trees;'");
-      }
-      std::getline(in, line);
-      // BEAST uses "Begin trees;" so we tolower here.
+    line = line_view;
+    // BEAST uses "Begin trees;" so we tolower here.
+    if (!line.empty()) {
       line[0] = std::tolower(line[0]);
-    } while (line != "begin trees;");
-    std::getline(in, line);
-    std::regex translate_start("^\\s*[Tt]ranslate");
-    if (!std::regex_match(line, translate_start)) {
-      throw std::runtime_error("Missing translate block.");
-    }
-    std::getline(in, line);
-    std::regex translate_item_regex(R"raw(^\s*(\d+)\s([^,;]*)[,;]?$)raw");
-    std::regex lone_semicolon_regex(R"raw(\s*;$)raw");
-    std::smatch match;
-    auto previous_position = in.tellg();
-    TagStringMap long_name_taxon_map;
-    uint32_t leaf_id = 0;
-    while (std::regex_match(line, match, translate_item_regex)) {
-      const auto short_name = match[1].str();
-      const auto long_name = match[2].str();
-      // We prepare taxa_ so that it can parse the short taxon names.
-      SafeInsert(taxa_, short_name, leaf_id);
-      // However, we keep the long names for the TagTaxonMap.
-      SafeInsert(long_name_taxon_map, PackInts(leaf_id, 1), long_name);
-      leaf_id++;
-      // Semicolon marks the end of the translate block.
-      // It appears at the end of a translation statement line in MrBayes.
-      if (match[3].str() == ";") {
-        break;
-      }
-      previous_position = in.tellg();
-      std::getline(in, line);
-      // BEAST has the ending semicolon on a line of its own.
-      if (std::regex_match(line, match, lone_semicolon_regex)) {
-        break;
-      }
-      if (in.eof()) {
-        throw std::runtime_error("Encountered EOF while parsing translate block.");
-      }
     }
-    Assert(leaf_id > 0, "No taxa found in translate block!");
-    taxa_complete_ = true;
-    // Back up one line to hit the first tree.
-    in.seekg(previous_position);
+  } while (line != "begin trees;");
+  line = next_line() ? line_view : "";
+  std::regex translate_start("^\\s*[Tt]ranslate");
+  if (!std::regex_match(line, translate_start)) {
+    throw std::runtime_error("Missing translate block.");
+  }
+  line = next_line() ? line_view : "";
+  std::regex translate_item_regex(R"raw(^\s*(\d+)\s([^,;]*)[,;]?$)raw");
+  std::regex lone_semicolon_regex(R"raw(\s*;$)raw");
+  std::smatch match;
+  auto previous_position = lines.Position();
+  TagStringMap long_name_taxon_map;
+  uint32_t leaf_id = 0;
+  while (std::regex_match(line, match, translate_item_regex)) {
+    const auto short_name = match[1].str();
+    const auto long_name = match[2].str();
+    // We prepare taxa_ so that it can parse the short taxon names.
+    SafeInsert(taxa_, short_name, leaf_id);
+    // However, we keep the long names for the TagTaxonMap.
+    SafeInsert(long_name_taxon_map, PackInts(leaf_id, 1), long_name);
+    leaf_id++;
+    // Semicolon marks the end of the translate block.
+    // It appears at the end of a translation statement line in MrBayes.
+    if (match[3].str() == ";") {
+      break;
+    }
+    previous_position = lines.Position();
+    if (!next_line()) {
+      throw std::runtime_error("Encountered EOF while parsing translate block.");
+    }
+    line = line_view;
+    // BEAST has the ending semicolon on a line of its own.
+    if (std::regex_match(line, match, lone_semicolon_regex)) {
+      break;
+    }
+  }
+  Assert(leaf_id > 0, "No taxa found in translate block!");
+  taxa_complete_ = true;
+  // Back up one line to hit the first tree.
+  lines.SetPosition(previous_position);
+  return TaxonNameMunging::DequoteTagStringMap(long_name_taxon_map);
+}
+
+TreeCollection Driver::ParseNexusFile(const std::string &fname, size_t thread_count) {
+  Clear();
+  const MmappedFile file(fname);
+  try {
+    LineReader lines(file);
+    auto long_name_taxon_map = ParseNexusTranslateBlock(lines);
     // Now we make a new TagTaxonMap to replace the one with numbers in place of
     // taxon names.
-    auto short_name_tree_collection = ParseNewick(in);
+    auto short_name_tree_collection = ParseNewick(lines, thread_count);
     // We're using the public member directly rather than the const accessor because we
     // want to move.
     return TreeCollection(std::move(short_name_tree_collection.trees_),
-                          TaxonNameMunging::DequoteTagStringMap(long_name_taxon_map));
+                          std::move(long_name_taxon_map));
   } catch (const std::exception &exception) {
     Failwith("Problem parsing '" + fname + "':\n" + exception.what());
   }
 }
 
-Tree Driver::ParseString(yy::parser *parser_instance, const std::string &str) {
+void Driver::ParseNexusFileInBatches(const std::string &fname, size_t batch_size,
+                                     const BatchConsumer &consume,
+                                     size_t thread_count) {
+  Clear();
+  const MmappedFile file(fname);
+  try {
+    LineReader lines(file);
+    const auto long_name_taxon_map = ParseNexusTranslateBlock(lines);
+    ParseNewick(
+        lines, batch_size,
+        [&long_name_taxon_map, &consume](Tree::TreeVector trees) {
+          consume(TreeCollection(std::move(trees), long_name_taxon_map));
+        },
+        thread_count);
+  } catch (const std::exception &exception) {
+    Failwith("Problem parsing '" + fname + "':\n" + exception.what());
+  }
+}
+
+TreeFileStream::TreeFileStream(const std::string &fname, bool is_nexus,
+                               size_t batch_size, double burn_in_fraction,
+                               size_t thinning, size_t thread_count)
+    : fname_(fname), is_nexus_(is_nexus), batch_size_(batch_size), file_(fname) {
+  try {
+    LineReader lines(file_);
+    if (is_nexus_) {
+      tag_taxon_map_ = driver_.ParseNexusTranslateBlock(lines);
+    }
+    cursor_ = std::make_unique<Driver::NewickCursor>(driver_, lines, thread_count,
+                                                     burn_in_fraction, thinning);
+  } catch (const std::exception &exception) {
+    Failwith("Problem parsing '" + fname_ + "':\n" + exception.what());
+  }
+}
+
+std::optional<TreeCollection> TreeFileStream::NextBatch() {
+  Tree::TreeVector trees;
+  try {
+    trees = driver_.ParseNewickBatch(*cursor_, batch_size_);
+  } catch (const std::exception &exception) {
+    Failwith("Problem parsing '" + fname_ + "':\n" + exception.what());
+  }
+  if (trees.empty()) {
+    return std::nullopt;
+  }  // else
+  // The taxa of a Newick file are complete once we have parsed a tree.
+  if (!is_nexus_ && tag_taxon_map_.empty()) {
+    tag_taxon_map_ = TaxonNameMunging::DequoteTagStringMap(driver_.TagTaxonMap());
+  }
+  return TreeCollection(std::move(trees), tag_taxon_map_);
+}
+
+Tree Driver::ParseString(yy::parser *parser_instance, std::string_view str) {
+  if (use_fast_newick_) {
+    if (auto tree = ParseNewickFastPath(str)) {
+      return std::move(*tree);
+    }
+  }
   // Scan the string using the lexer into hidden state.
-  this->ScanString(str);
+  this->ScanString(std::string(str));
   // Parse the scanned string.
   int return_code = (*parser_instance)();
   Assert(return_code == 0, "Parser had nonzero return value.");
@@ -155,6 +366,162 @@ TreeCollection Driver::ParseString(const std::string &str) {
                         TaxonNameMunging::DequoteTagStringMap(this->TagTaxonMap()));
 }
 
+namespace {
+
+// The characters that the scanner skips between tokens.
+bool IsBlank(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+// The characters of an unquoted label, as in LABEL in scanner.ll.
+bool IsLabelChar(char c) {
+  return std::isgraph(static_cast<unsigned char>(c)) &&
+         std::strchr("();,:'[]", c) == nullptr;
+}
+
+}  // namespace
+
+std::optional<Tree> Driver::ParseNewickFastPath(std::string_view str) {
+  const char *position = str.data();
+  const char *const end = position + str.size();
+  const auto skip_blanks = [&position, end]() {
+    while (position < end && IsBlank(*position)) {
+      position++;
+    }
+  };
+  // Scan a quoted or unquoted label, returning an empty view if there isn't one.
+  const auto scan_label = [&position, end]() {
+    const char *label_start = position;
+    if (position < end && *position == '\'') {
+      // As in QUOTED in scanner.ll, a quoted label is a run of quoted strings.
+      while (position < end && *position == '\'') {
+        const char *closing_quote = static_cast<const char *>(
+            std::memchr(position + 1, '\'', end - position - 1));
+        if (closing_quote == nullptr) {
+          return std::string_view();
+        }
+        position = closing_quote + 1;
+      }
+    } else {
+      while (position < end && IsLabelChar(*position)) {
+        position++;
+      }
+    }
+    return std::string_view(label_start, position - label_start);
+  };
+
+  // The children of each open parenthesis that we haven't closed yet.
+  std::vector<Node::NodePtrVec> open_children;
+  std::vector<std::pair<const Node *, double>> branch_lengths;
+  // The taxa of the first tree, which we only add to taxa_ once we have succeeded.
+  std::map<std::string_view, uint32_t> new_taxa;
+  Node::NodePtr node;
+  while (true) {
+    // Read the start of a node: open parentheses, then a leaf label.
+    skip_blanks();
+    while (position < end && *position == '(') {
+      open_children.emplace_back();
+      position++;
+      skip_blanks();
+    }
+    const auto label = scan_label();
+    if (label.empty()) {
+      return std::nullopt;
+    }
+    uint32_t leaf_id;
+    if (taxa_complete_) {
+      const auto search = taxa_.find(label);
+      if (search == taxa_.end()) {
+        return std::nullopt;
+      }
+      leaf_id = search->second;
+    } else {
+      leaf_id = next_id_ + static_cast<uint32_t>(new_taxa.size());
+      if (!new_taxa.emplace(label, leaf_id).second) {
+        return std::nullopt;
+      }
+    }
+    node = Node::Leaf(leaf_id);
+    // Read what follows a node: a branch length, then a comma, which starts a
+    // sister node, a closing parenthesis, which finishes the parent node and is
+    // followed by the same things, or the final semicolon.
+    bool read_sister = false;
+    while (!read_sister) {
+      skip_blanks();
+      if (position < end && *position == ':') {
+        position++;
+        skip_blanks();
+        if (end - position >= 2 && position[0] == '[' && position[1] == '&') {
+          const char *comment_end = position + 2;
+          while (comment_end < end && *comment_end != ']') {
+            if (*comment_end == '[' ||
+                !std::isprint(static_cast<unsigned char>(*comment_end))) {
+              return std::nullopt;
+            }
+            comment_end++;
+          }
+          if (comment_end == end || comment_end == position + 2) {
+            return std::nullopt;
+          }
+          position = comment_end + 1;
+          skip_blanks();
+        }
+        const char *length_start = position;
+        while (position < end && IsLabelChar(*position)) {
+          position++;
+        }
+        // The character after the label stops strtod, so we require that it reads
+        // exactly the label.
+        char *length_end;
+        const double branch_length = std::strtod(length_start, &length_end);
+        if (position == length_start || length_end != position) {
+          return std::nullopt;
+        }
+        branch_lengths.emplace_back(node.get(), branch_length);
+        skip_blanks();
+      }
+      if (position == end || open_children.empty()) {
+        break;
+      }  // else
+      if (*position == ',') {
+        open_children.back().push_back(std::move(node));
+        position++;
+        read_sister = true;
+      } else if (*position == ')') {
+        open_children.back().push_back(std::move(node));
+        node = Node::Join(std::move(open_children.back()));
+        open_children.pop_back();
+        position++;
+      } else {
+        return std::nullopt;
+      }
+    }
+    if (!read_sister) {
+      break;
+    }
+  }
+  // We should be at the semicolon, with only blanks after it.
+  if (position == end || *position != ';') {
+    return std::nullopt;
+  }
+  position++;
+  skip_blanks();
+  if (position != end) {
+    return std::nullopt;
+  }
+  if (!taxa_complete_) {
+    for (const auto &[name, leaf_id] : new_taxa) {
+      taxa_.emplace(std::string(name), leaf_id);
+    }
+    next_id_ += static_cast<uint32_t>(new_taxa.size());
+    taxa_complete_ = true;
+  }
+  node->Polish();
+  Tree::BranchLengthVector branch_length_vector(node->Id() + 1, 0.);
+  for (const auto &[length_node, branch_length] : branch_lengths) {
+    branch_length_vector[length_node->Id()] = branch_length;
+  }
+  return Tree(node, std::move(branch_length_vector));
+}
+
 TagStringMap Driver::TagTaxonMap() {
   TagStringMap m;
   for (const auto &iter : taxa_) {
@@ -5,12 +5,20 @@
 
 #ifndef SRC_DRIVER_HPP_
 #define SRC_DRIVER_HPP_
+#include <fstream>
+#include <functional>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
 #include <vector>
+#include "mmapped_file.hpp"
 #include "parser.hpp"
 #include "sugar.hpp"
+#include "task_processor.hpp"
 #include "tree_collection.hpp"
 
 // Give Flex the prototype of yylex we want ...
@@ -38,22 +46,39 @@ class Driver {
   int trace_parsing_;
   // Whether to generate scanner debug traces.
   bool trace_scanning_;
+  // Whether to try the hand-written Newick parser before the Bison one. See
+  // ParseNewickFastPath.
+  bool use_fast_newick_;
   // The most recent tree parsed.
   std::shared_ptr<Tree> latest_tree_;
-  // Map from taxon names to their numerical identifiers.
-  std::map<std::string, uint32_t> taxa_;
+  // Map from taxon names to their numerical identifiers. The transparent comparator
+  // lets the fast Newick parser look names up without copying them.
+  std::map<std::string, uint32_t, std::less<>> taxa_;
   // The token's location, used by the scanner to give good debug info.
   TagDoubleMap branch_lengths_;
   // The token's location, used by the scanner to give good debug info.
   yy::location location_;
 
   // These three parsing methods also remove quotes from Newick strings and Nexus files.
+  // Trees with the same topology share one Node graph (see topology_interner.hpp).
+  // Files are mapped into memory and parsed in place (see mmapped_file.hpp).
   // Make a parser and then parse a string for a one-off parsing.
   TreeCollection ParseString(const std::string& s);
-  // Run the parser on a Newick file.
-  TreeCollection ParseNewickFile(const std::string& fname);
+  // Run the parser on a Newick file. With more than one thread, the trees after the
+  // first (or, in a Nexus file, after the translate block) are parsed on a thread
+  // pool by the fast path, and the Bison parser handles whatever the fast path
+  // can't, one tree at a time. Either way the trees come out in file order.
+  TreeCollection ParseNewickFile(const std::string& fname, size_t thread_count = 1);
   // Run the parser on a Nexus file.
-  TreeCollection ParseNexusFile(const std::string& fname);
+  TreeCollection ParseNexusFile(const std::string& fname, size_t thread_count = 1);
+  // These two parse a file in batches of at most batch_size trees, handing each
+  // batch to consume as soon as it has been read. Only one batch is in memory at a
+  // time, so these can be used on files that are too big to load.
+  using BatchConsumer = std::function<void(TreeCollection)>;
+  void ParseNewickFileInBatches(const std::string& fname, size_t batch_size,
+                                const BatchConsumer& consume, size_t thread_count = 1);
+  void ParseNexusFileInBatches(const std::string& fname, size_t batch_size,
+                               const BatchConsumer& consume, size_t thread_count = 1);
   // Clear out stored state.
   void Clear();
   // Make the map from the edge tags of the tree to the taxon names from taxa_.
@@ -63,9 +88,87 @@ class Driver {
   // Scan a string with flex.
   void ScanString(const std::string& str);
   // Parse a string with an existing parser object.
-  Tree ParseString(yy::parser* parser_instance, const std::string& str);
-  // Run the parser on a Newick stream.
-  TreeCollection ParseNewick(std::ifstream& in);
+  Tree ParseString(yy::parser* parser_instance, std::string_view str);
+  // Parse a Newick string without the Bison parser, as long as it uses the common
+  // grammar: labels that may be quoted, branch lengths that may have a [&...]
+  // comment before them, and no internal node labels. Return nullopt, with no change
+  // in our state, for anything else, including anything the Bison parser would
+  // reject. The Bison parser takes over in that case, so that we get its errors.
+  // Once taxa_complete_ is set this doesn't change our state, so it is safe to call
+  // from several threads at once.
+  std::optional<Tree> ParseNewickFastPath(std::string_view str);
+  // A line of a file along with its line number. The line is a view of the file.
+  using NumberedLine = std::pair<std::string_view, unsigned int>;
+  // In parallel mode, the number of lines per thread that we gather before parsing.
+  static constexpr size_t parallel_lines_per_thread_ = 256;
+
+  // Run the parser on the lines of a Newick file.
+  TreeCollection ParseNewick(const LineReader& lines, size_t thread_count);
+  // Run the parser on the lines of a Newick file, handing the trees to consume in
+  // batches of at most batch_size.
+  void ParseNewick(const LineReader& lines, size_t batch_size,
+                   const std::function<void(Tree::TreeVector)>& consume,
+                   size_t thread_count);
+  // Where we are in reading the trees of a Newick file, so that we can read it a
+  // batch at a time. We skip the first burn_in_count_ trees, then keep one tree in
+  // every thinning_.
+  struct NewickCursor {
+    NewickCursor(Driver& driver, const LineReader& lines, size_t thread_count,
+                 double burn_in_fraction, size_t thinning);
+
+    LineReader lines_;
+    yy::parser parser_;
+    // Null unless we are parsing on several threads.
+    std::unique_ptr<WorkStealingPool<size_t>> thread_pool_;
+    size_t parallel_line_count_;
+    unsigned int line_number_ = 1;
+    // The number of tree lines we have read, including the ones we skipped.
+    size_t tree_line_count_ = 0;
+    size_t burn_in_count_ = 0;
+    size_t thinning_;
+  };
+  // Read the next batch of trees, which only has fewer than batch_size trees at the
+  // end of the file. The trees that we skip aren't parsed, so they aren't checked
+  // either, except that until we have the taxa we parse every tree to get them.
+  Tree::TreeVector ParseNewickBatch(NewickCursor& cursor, size_t batch_size);
+  // Parse lines of a file once the taxa are known, running the fast path on the
+  // thread pool, and return the trees in order.
+  Tree::TreeVector ParseNewickLinesInParallel(yy::parser* parser_instance,
+                                              WorkStealingPool<size_t>& thread_pool,
+                                              const std::vector<NumberedLine>& lines);
+  // Read a Nexus file up to the first tree, setting up taxa_ to parse the short
+  // taxon names and returning the TagTaxonMap with the long names.
+  TagStringMap ParseNexusTranslateBlock(LineReader& lines);
+
+  friend class TreeFileStream;
+};
+
+// Read the trees of a Newick or Nexus file in batches of at most batch_size trees,
+// one batch per call of NextBatch. In contrast to Driver::ParseNewickFileInBatches,
+// the caller pulls the batches, which is what a Python iterator needs. We can also
+// sample the trees the way one samples an MCMC run: we drop the first
+// burn_in_fraction of the trees, then keep one tree in every thinning. The trees we
+// drop only cost a line scan, and only the current batch is held in memory.
+class TreeFileStream {
+ public:
+  TreeFileStream(const std::string& fname, bool is_nexus, size_t batch_size,
+                 double burn_in_fraction = 0., size_t thinning = 1,
+                 size_t thread_count = 1);
+
+  // The number of trees that we drop as burn-in.
+  size_t BurnInCount() const { return cursor_->burn_in_count_; }
+  // Get the next batch of trees, or nullopt if the file is finished.
+  std::optional<TreeCollection> NextBatch();
+
+ private:
+  std::string fname_;
+  bool is_nexus_;
+  size_t batch_size_;
+  Driver driver_;
+  MmappedFile file_;
+  // The TagTaxonMap of the batches. For a Newick file we get it from the first batch.
+  TagStringMap tag_taxon_map_;
+  std::unique_ptr<Driver::NewickCursor> cursor_;
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
@@ -93,6 +196,30 @@ TEST_CASE("Driver") {
   auto newick_collection = driver.ParseNewickFile("data/DS1.subsampled_10.t.nwk");
   CHECK_EQ(nexus_collection, newick_collection);
   driver.Clear();
+  // Parsing in batches gives the same trees.
+  for (const auto& fname :
+       {"data/DS1.subsampled_10.t.reordered", "data/DS1.subsampled_10.t.nwk"}) {
+    Tree::TreeVector batched_trees;
+    SizeVector batch_sizes;
+    const auto consume = [&batched_trees, &batch_sizes,
+                          &newick_collection](TreeCollection batch) {
+      CHECK_EQ(batch.TagTaxonMap(), newick_collection.TagTaxonMap());
+      batch_sizes.push_back(batch.TreeCount());
+      for (auto& tree : batch.trees_) {
+        batched_trees.push_back(std::move(tree));
+      }
+    };
+    const std::string fname_string(fname);
+    if (fname_string.substr(fname_string.size() - 4) == ".nwk") {
+      driver.ParseNewickFileInBatches(fname, 4, consume);
+    } else {
+      driver.ParseNexusFileInBatches(fname, 4, consume);
+    }
+    CHECK_EQ(batch_sizes, SizeVector({4, 4, 2}));
+    CHECK_EQ(TreeCollection(std::move(batched_trees), newick_collection.TagTaxonMap()),
+             newick_collection);
+  }
+  driver.Clear();
   auto five_taxon = driver.ParseNewickFile("data/five_taxon_unrooted.nwk");
   std::vector<std::string> correct_five_taxon_names({"x0", "x1", "x2", "x3", "x4"});
   CHECK_EQ(five_taxon.TaxonNames(), correct_five_taxon_names);
@@ -113,6 +240,127 @@ TEST_CASE("Driver") {
   for (const auto& [topology, count] : beast_nexus.TopologyCounter()) {
     CHECK_EQ(topology->LeafCount(), beast_taxa.size());
   }
+  // Trees with the same topology share it.
+  auto ds1 = driver.ParseNexusFile("data/DS1.subsampled_10.t");
+  std::unordered_set<const Node*> distinct_topologies;
+  for (const auto& tree : ds1.Trees()) {
+    distinct_topologies.insert(tree.Topology().get());
+  }
+  CHECK_EQ(distinct_topologies.size(), ds1.TopologyCounter().size());
+  CHECK_LT(distinct_topologies.size(), ds1.TreeCount());
+}
+
+TEST_CASE("Driver: fast Newick parser") {
+  // The fast parser and the Bison parser should agree on everything.
+  Driver fast_driver;
+  Driver bison_driver;
+  bison_driver.use_fast_newick_ = false;
+  for (const auto& fname :
+       {"data/DS1.100_topologies.nwk", "data/DS1.subsampled_10.t.nwk",
+        "data/five_taxon_rooted.nwk", "data/five_taxon_unrooted.nwk",
+        "data/fluA.tree", "data/hello.nwk"}) {
+    CHECK_EQ(fast_driver.ParseNewickFile(fname), bison_driver.ParseNewickFile(fname));
+  }
+  for (const auto& fname : {"data/DS1.subsampled_10.t", "data/gradient_test.t",
+                            "data/test_beast_tree_parsing.nexus"}) {
+    CHECK_EQ(fast_driver.ParseNexusFile(fname), bison_driver.ParseNexusFile(fname));
+  }
+  const std::vector<std::string> newicks = {
+      "((a:1,b:2e-1):0.5,c:3);",
+      " ( a ,\t( b: [&rate=1.5,x={1,2}] 2 ,'c d' :1 ) : 0 ) : 1.5 ; ",
+      "('it''s':1,'b':2,c);",
+      // These are outside of the fast path.
+      "((a,b):1x,c);",
+  };
+  for (const auto& newick : newicks) {
+    CHECK_EQ(fast_driver.ParseString(newick), bison_driver.ParseString(newick));
+  }
+  // Both parsers reject these.
+  for (const auto& newick : {"((a,b)x,c);", "((a,b),c)", "((a,b),c);d", "((a,),c);",
+                             "((a,b:[&]1),c);"}) {
+    CHECK_THROWS(fast_driver.ParseString(newick));
+    CHECK_THROWS(bison_driver.ParseString(newick));
+  }
+}
+
+TEST_CASE("Driver: parallel parsing") {
+  Driver driver;
+  for (const auto& fname : {"data/DS1.subsampled_10.t", "data/gradient_test.t"}) {
+    CHECK_EQ(driver.ParseNexusFile(fname, 3), driver.ParseNexusFile(fname));
+  }
+  // Gzipped files are parsed as they are inflated.
+  CHECK_EQ(driver.ParseNexusFile("data/DS1.subsampled_10.t.gz", 3),
+           driver.ParseNexusFile("data/DS1.subsampled_10.t"));
+  // A file that is longer than one round of parallel parsing, in which some trees
+  // need the Bison parser.
+  const std::string fname = "_ignore/parallel_parsing.nwk";
+  {
+    std::ofstream out(fname);
+    const StringVector newicks = {"((a:1,b:2):0.5,c:3);\n", "((a:1,c:2):1x,b:3);\n",
+                                  "(b:1,(c:2,a:0.1):2);\n"};
+    for (size_t idx = 0; idx < 2000; idx++) {
+      out << newicks[idx % (idx % 17 == 0 ? 2 : 3)];
+    }
+  }
+  const auto serial_collection = driver.ParseNewickFile(fname);
+  CHECK_EQ(serial_collection.TreeCount(), 2000);
+  CHECK_EQ(driver.ParseNewickFile(fname, 4), serial_collection);
+  // Batches line up with the serial ones.
+  Tree::TreeVector batched_trees;
+  driver.ParseNewickFileInBatches(
+      fname, 300,
+      [&batched_trees](TreeCollection batch) {
+        CHECK_LE(batch.TreeCount(), 300);
+        for (auto& tree : batch.trees_) {
+          batched_trees.push_back(std::move(tree));
+        }
+      },
+      4);
+  CHECK((batched_trees == serial_collection.Trees()));
+}
+
+TEST_CASE("TreeFileStream") {
+  Driver driver;
+  const auto nexus_collection = driver.ParseNexusFile("data/DS1.subsampled_10.t");
+  const auto newick_collection = driver.ParseNewickFile("data/DS1.100_topologies.nwk");
+  // Stream the file and compare with sampling the fully parsed trees.
+  const auto check_stream = [](const TreeCollection& collection,
+                               const std::string& fname, bool is_nexus,
+                               double burn_in_fraction, size_t thinning,
+                               size_t thread_count) {
+    TreeFileStream stream(fname, is_nexus, 3, burn_in_fraction, thinning,
+                          thread_count);
+    const size_t burn_in_count =
+        static_cast<size_t>(burn_in_fraction * collection.TreeCount());
+    CHECK_EQ(stream.BurnInCount(), burn_in_count);
+    Tree::TreeVector expected_trees;
+    for (size_t idx = burn_in_count; idx < collection.TreeCount(); idx += thinning) {
+      expected_trees.push_back(collection.GetTree(idx));
+    }
+    Tree::TreeVector streamed_trees;
+    while (auto batch = stream.NextBatch()) {
+      CHECK_LE(batch->TreeCount(), 3);
+      CHECK_EQ(batch->TagTaxonMap(), collection.TagTaxonMap());
+      for (auto& tree : batch->trees_) {
+        streamed_trees.push_back(std::move(tree));
+      }
+    }
+    CHECK((streamed_trees == expected_trees));
+    CHECK_FALSE(stream.NextBatch().has_value());
+  };
+  for (const size_t thread_count : {1, 2}) {
+    check_stream(nexus_collection, "data/DS1.subsampled_10.t", true, 0., 1,
+                 thread_count);
+    check_stream(nexus_collection, "data/DS1.subsampled_10.t", true, 0.25, 2,
+                 thread_count);
+    // Here the first tree, which sets up the taxa, is burn-in.
+    check_stream(newick_collection, "data/DS1.100_topologies.nwk", false, 0.1, 7,
+                 thread_count);
+    check_stream(newick_collection, "data/DS1.100_topologies.nwk", false, 1., 1,
+                 thread_count);
+    check_stream(nexus_collection, "data/DS1.subsampled_10.t.gz", true, 0.25, 2,
+                 thread_count);
+  }
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
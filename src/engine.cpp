@@ -2,28 +2,107 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "engine.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
 #include <numeric>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include "beagle_flag_names.hpp"
 
+namespace {
+
+// The same specification, but with the BEAGLE flags in beagle_flag_vector.
+EngineSpecification WithBeagleFlagVector(
+    const EngineSpecification &engine_specification,
+    const std::vector<BeagleFlags> &beagle_flag_vector) {
+  return {engine_specification.thread_count_,
+          beagle_flag_vector,
+          engine_specification.use_tip_states_,
+          engine_specification.partial_cache_capacity_,
+          engine_specification.tree_batch_size_,
+          engine_specification.shard_site_patterns_,
+          engine_specification.operation_schedule_cache_capacity_,
+          engine_specification.site_pattern_order_,
+          engine_specification.host_transition_matrices_,
+          engine_specification.thread_pinning_,
+          engine_specification.single_precision_};
+}
+
+}  // namespace
+
 Engine::Engine(const EngineSpecification &engine_specification,
                const PhyloModelSpecification &model_specification,
                SitePattern site_pattern)
-    : site_pattern_(std::move(site_pattern)) {
+    : site_pattern_(std::move(site_pattern)),
+      tree_batch_size_(engine_specification.tree_batch_size_),
+      shard_site_patterns_(engine_specification.shard_site_patterns_),
+      beagle_flag_vector_(engine_specification.beagle_flag_vector_),
+      engine_specification_(
+          WithBeagleFlagVector(engine_specification, beagle_flag_vector_)),
+      model_specification_(model_specification) {
   if (engine_specification.thread_count_ == 0) {
     Failwith("Thread count needs to be strictly positive.");
   }  // else
-  const auto beagle_preference_flags =
+  FatBeagle::PackedBeagleFlags beagle_preference_flags =
       engine_specification.beagle_flag_vector_.empty()
           ? BEAGLE_FLAG_VECTOR_SSE  // Default flags.
           : std::accumulate(engine_specification.beagle_flag_vector_.begin(),
                             engine_specification.beagle_flag_vector_.end(), 0,
                             std::bit_or<FatBeagle::PackedBeagleFlags>());
-  for (size_t i = 0; i < engine_specification.thread_count_; i++) {
-    fat_beagles_.push_back(std::make_unique<FatBeagle>(
-        model_specification, site_pattern_, beagle_preference_flags,
-        engine_specification.use_tip_states_));
+  if (engine_specification.single_precision_) {
+    beagle_preference_flags &= ~BEAGLE_FLAG_PRECISION_DOUBLE;
+    beagle_preference_flags |= BEAGLE_FLAG_PRECISION_SINGLE;
+  }
+  // If we are sharding, each FatBeagle gets its own block of the site patterns.
+  std::vector<SitePattern> shard_site_patterns;
+  if (shard_site_patterns_) {
+    shard_site_patterns = site_pattern_.Split(engine_specification.thread_count_);
+  }
+  const size_t fat_beagle_count = shard_site_patterns_
+                                      ? shard_site_patterns.size()
+                                      : engine_specification.thread_count_;
+  auto make_fat_beagle = [&](size_t i) {
+    return std::make_unique<FatBeagle>(
+        model_specification,
+        shard_site_patterns_ ? shard_site_patterns[i] : site_pattern_,
+        beagle_preference_flags, engine_specification.use_tip_states_,
+        engine_specification.partial_cache_capacity_, tree_batch_size_,
+        engine_specification.operation_schedule_cache_capacity_,
+        engine_specification.host_transition_matrices_);
+  };
+  const auto thread_pinning = engine_specification.thread_pinning_;
+  if (thread_pinning == ThreadPinning::None) {
+    for (size_t i = 0; i < fat_beagle_count; i++) {
+      fat_beagles_.push_back(make_fat_beagle(i));
+    }
+    std::vector<FatBeagle *> fat_beagle_pointers;
+    for (const auto &fat_beagle : fat_beagles_) {
+      fat_beagle_pointers.push_back(fat_beagle.get());
+    }
+    thread_pool_ =
+        std::make_unique<WorkStealingPool<FatBeagle *>>(std::move(fat_beagle_pointers));
+  } else {
+    // Each thread pins itself and then makes its FatBeagle. We make them one at a time
+    // as we do above, because we don't rely on BEAGLE making instances concurrently.
+    fat_beagles_.resize(fat_beagle_count);
+    std::mutex make_mutex;
+    thread_pool_ = std::make_unique<WorkStealingPool<FatBeagle *>>(
+        fat_beagle_count, [&](size_t i) {
+          ThreadPinner::PinCurrentThread(thread_pinning, i, fat_beagle_count);
+          std::lock_guard<std::mutex> make_lock(make_mutex);
+          fat_beagles_[i] = make_fat_beagle(i);
+          return fat_beagles_[i].get();
+        });
+  }
+  fat_beagle_borrowed_ = std::make_unique<std::atomic<bool>[]>(fat_beagles_.size());
+  for (size_t i = 0; i < fat_beagles_.size(); i++) {
+    fat_beagle_borrowed_[i].store(false);
   }
-  if (!engine_specification.beagle_flag_vector_.empty()) {
+  if (!engine_specification.beagle_flag_vector_.empty() ||
+      engine_specification.single_precision_) {
     std::cout << "We asked BEAGLE for: "
               << BeagleFlagNames::OfBeagleFlags(beagle_preference_flags) << std::endl;
     auto beagle_flags = fat_beagles_[0]->GetBeagleFlags();
@@ -49,39 +128,639 @@ const BlockSpecification &Engine::GetPhyloModelBlockSpecification() const {
   return GetFirstFatBeagle()->GetPhyloModelBlockSpecification();
 }
 
+bool Engine::IsCompatibleWith(const EngineSpecification &engine_specification,
+                              const PhyloModelSpecification &model_specification,
+                              const SitePattern &site_pattern) const {
+  const auto &ours = engine_specification_;
+  const auto &theirs = engine_specification;
+  if (ours.thread_count_ != theirs.thread_count_ ||
+      ours.beagle_flag_vector_ != theirs.beagle_flag_vector_ ||
+      ours.use_tip_states_ != theirs.use_tip_states_ ||
+      ours.partial_cache_capacity_ != theirs.partial_cache_capacity_ ||
+      ours.tree_batch_size_ != theirs.tree_batch_size_ ||
+      ours.shard_site_patterns_ != theirs.shard_site_patterns_ ||
+      ours.operation_schedule_cache_capacity_ !=
+          theirs.operation_schedule_cache_capacity_ ||
+      ours.host_transition_matrices_ != theirs.host_transition_matrices_ ||
+      ours.thread_pinning_ != theirs.thread_pinning_ ||
+      ours.single_precision_ != theirs.single_precision_ ||
+      !(site_pattern_ == site_pattern)) {
+    return false;
+  }  // else
+  if (model_specification == model_specification_) {
+    return true;
+  }  // else
+  const auto ours_model = PhyloModel::OfSpecification(model_specification_);
+  const auto theirs_model = PhyloModel::OfSpecification(model_specification);
+  return ours_model->GetSubstitutionModel()->GetStateCount() ==
+             theirs_model->GetSubstitutionModel()->GetStateCount() &&
+         ours_model->GetSiteModel()->GetCategoryCount() ==
+             theirs_model->GetSiteModel()->GetCategoryCount();
+}
+
+void Engine::SetPhyloModelSpecification(
+    const PhyloModelSpecification &model_specification) {
+  if (model_specification == model_specification_) {
+    return;
+  }  // else
+  for (const auto &fat_beagle : fat_beagles_) {
+    fat_beagle->SetPhyloModel(model_specification);
+  }
+  model_specification_ = model_specification;
+}
+
+void Engine::SetProfiling(bool profiling) {
+  for (const auto &fat_beagle : fat_beagles_) {
+    fat_beagle->SetProfiling(profiling);
+  }
+  thread_pool_->SetQueueWaitTiming(profiling);
+}
+
+HotPathProfile Engine::GetProfile() const {
+  HotPathProfile profile;
+  for (const auto &fat_beagle : fat_beagles_) {
+    profile += fat_beagle->GetProfile();
+  }
+  profile.AddQueueWaitHistogram(thread_pool_->GetQueueWaitHistogram());
+  return profile;
+}
+
+void Engine::SetAdaptiveRescaling(bool adaptive_rescaling) {
+  for (const auto &fat_beagle : fat_beagles_) {
+    fat_beagle->SetAdaptiveRescaling(adaptive_rescaling);
+  }
+}
+
+size_t Engine::RescaledTopologyCount() const {
+  size_t rescaled_topology_count = 0;
+  for (const auto &fat_beagle : fat_beagles_) {
+    rescaled_topology_count += fat_beagle->RescaledTopologyCount();
+  }
+  return rescaled_topology_count;
+}
+
+size_t Engine::BeagleBufferByteCount() const {
+  size_t byte_count = 0;
+  for (const auto &fat_beagle : fat_beagles_) {
+    byte_count += fat_beagle->GetBufferByteCount();
+  }
+  return byte_count;
+}
+
+size_t Engine::EstimateBeagleBufferByteCount(
+    const EngineSpecification &engine_specification,
+    const PhyloModelSpecification &model_specification,
+    const SitePattern &site_pattern) {
+  const auto phylo_model = PhyloModel::OfSpecification(model_specification);
+  const size_t state_count = phylo_model->GetSubstitutionModel()->GetStateCount();
+  const size_t category_count = phylo_model->GetSiteModel()->GetCategoryCount();
+  const auto &flags = engine_specification.beagle_flag_vector_;
+  const bool single_precision =
+      engine_specification.single_precision_ ||
+      std::find(flags.begin(), flags.end(), BEAGLE_FLAG_PRECISION_SINGLE) !=
+          flags.end();
+  const auto buffer_counts = FatBeagle::BufferCountsOf(
+      site_pattern.SequenceCount(), engine_specification.use_tip_states_,
+      engine_specification.partial_cache_capacity_,
+      engine_specification.tree_batch_size_);
+  // As in the constructor, each FatBeagle gets all of the site patterns or a shard.
+  SizeVector pattern_counts(engine_specification.thread_count_,
+                            site_pattern.PatternCount());
+  if (engine_specification.shard_site_patterns_) {
+    pattern_counts.clear();
+    for (const auto &shard : site_pattern.Split(engine_specification.thread_count_)) {
+      pattern_counts.push_back(shard.PatternCount());
+    }
+  }
+  size_t byte_count = 0;
+  for (const auto pattern_count : pattern_counts) {
+    byte_count += FatBeagle::BufferByteCountOf(buffer_counts, pattern_count,
+                                               state_count, category_count,
+                                               single_precision);
+  }
+  return byte_count;
+}
+
+void Engine::ResetProfile() {
+  for (const auto &fat_beagle : fat_beagles_) {
+    fat_beagle->ResetProfile();
+  }
+  thread_pool_->ResetQueueWaitHistogram();
+}
+
+FatBeagle::PackedBeagleFlags PackBeagleFlags(const std::vector<BeagleFlags> &flags) {
+  return std::accumulate(flags.begin(), flags.end(), 0,
+                         std::bit_or<FatBeagle::PackedBeagleFlags>());
+}
+
+std::vector<BeagleConfiguration> Engine::AutoTuneCandidates() {
+  const std::vector<std::vector<BeagleFlags>> flag_vectors = {
+      {BEAGLE_FLAG_VECTOR_NONE},
+      {BEAGLE_FLAG_VECTOR_SSE},
+      {BEAGLE_FLAG_VECTOR_AVX},
+      {BEAGLE_FLAG_PROCESSOR_GPU, BEAGLE_FLAG_FRAMEWORK_CUDA},
+      {BEAGLE_FLAG_PROCESSOR_GPU, BEAGLE_FLAG_FRAMEWORK_OPENCL}};
+  std::vector<BeagleConfiguration> candidates;
+  for (const auto &flag_vector : flag_vectors) {
+    for (const bool use_tip_states : {true, false}) {
+      candidates.push_back({flag_vector, use_tip_states});
+    }
+  }
+  return candidates;
+}
+
+std::vector<BeagleConfigurationTiming> Engine::AutoTune(
+    const PhyloModelSpecification &model_specification,
+    const SitePattern &site_pattern, size_t evaluation_count,
+    const std::vector<BeagleConfiguration> &candidates) {
+  if (evaluation_count == 0) {
+    Failwith("Auto-tuning needs a positive evaluation count.");
+  }  // else
+  // The time for a likelihood evaluation depends on the number of taxa and site
+  // patterns rather than on the topology, so a ladder tree serves for all.
+  const auto topology =
+      Node::Ladder(static_cast<uint32_t>(site_pattern.SequenceCount()));
+  const FatBeagle::LikelihoodInput input = {
+      topology, std::vector<double>(topology->Id() + 1, 0.1)};
+  std::vector<BeagleConfigurationTiming> timings;
+  for (const auto &configuration : candidates) {
+    const auto beagle_preference_flags =
+        PackBeagleFlags(configuration.beagle_flag_vector_);
+    std::unique_ptr<FatBeagle> fat_beagle;
+    try {
+      fat_beagle = std::make_unique<FatBeagle>(model_specification, site_pattern,
+                                               beagle_preference_flags,
+                                               configuration.use_tip_states_);
+    } catch (const std::exception &exception) {
+      std::cout << "Skipping "
+                << BeagleFlagNames::OfBeagleFlags(beagle_preference_flags) << ": "
+                << exception.what() << std::endl;
+      continue;
+    }
+    // Warm up before timing.
+    fat_beagle->TimeLogLikelihood(input, 1);
+    timings.push_back({configuration, fat_beagle->GetBeagleFlags(),
+                       fat_beagle->TimeLogLikelihood(input, evaluation_count)});
+  }
+  if (timings.empty()) {
+    Failwith("BEAGLE couldn't make an instance for any of the auto-tune candidates.");
+  }  // else
+  std::stable_sort(timings.begin(), timings.end(),
+                   [](const auto &lhs, const auto &rhs) {
+                     return lhs.seconds_per_evaluation_ < rhs.seconds_per_evaluation_;
+                   });
+  std::cout << "Seconds per likelihood evaluation on " << site_pattern.PatternCount()
+            << " site patterns:" << std::endl;
+  for (const auto &[configuration, beagle_flags, seconds] : timings) {
+    std::cout << seconds
+              << (configuration.use_tip_states_ ? "  tip states" : "  tip partials")
+              << "  asked for: "
+              << BeagleFlagNames::OfBeagleFlags(
+                     PackBeagleFlags(configuration.beagle_flag_vector_))
+              << "  got: " << BeagleFlagNames::OfBeagleFlags(beagle_flags) << std::endl;
+  }
+  return timings;
+}
+
+// The per-block log likelihoods of a tree add up to its log likelihood.
+template <typename TTreeCollection>
+void ShardedLogLikelihoods(WorkStealingPool<FatBeagle *> &thread_pool,
+                           const TTreeCollection &tree_collection,
+                           EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                           EigenVectorXdRef log_likelihoods) {
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(tree_count == phylo_model_params.rows(),
+         "We param_matrix needs as many rows as we have trees.");
+  Assert(tree_count == log_likelihoods.size(), "We need a result slot for every tree.");
+  const auto shard_results = FatBeagleShardParallelize<EigenVectorXd>(
+      [&tree_collection, &phylo_model_params, rescaling,
+       tree_count](FatBeagle *fat_beagle) {
+        EigenVectorXd shard_log_likelihoods(tree_count);
+        FatBeagleLogLikelihoods(fat_beagle, tree_collection, phylo_model_params,
+                                rescaling, 0, tree_count, shard_log_likelihoods);
+        return shard_log_likelihoods;
+      },
+      thread_pool);
+  log_likelihoods.setZero();
+  for (const auto &shard_log_likelihoods : shard_results) {
+    log_likelihoods += shard_log_likelihoods;
+  }
+}
+
+// The branch length gradients and second derivatives are also sums over blocks.
+template <typename TTreeCollection>
+void ShardedBranchGradients(WorkStealingPool<FatBeagle *> &thread_pool,
+                            const TTreeCollection &tree_collection,
+                            EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                            EigenVectorXdRef log_likelihoods,
+                            EigenMatrixXdRef branch_gradients,
+                            std::optional<EigenMatrixXdRef> branch_hessian_diagonals,
+                            const SizeVector *edge_ids) {
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(tree_count == phylo_model_params.rows(),
+         "We param_matrix needs as many rows as we have trees.");
+  Assert(tree_count == log_likelihoods.size() && tree_count == branch_gradients.rows(),
+         "We need a result slot for every tree.");
+  const auto gradient_count = branch_gradients.cols();
+  const bool hessian = branch_hessian_diagonals.has_value();
+  using ShardResult = std::tuple<EigenVectorXd, EigenMatrixXd, EigenMatrixXd>;
+  const auto shard_results = FatBeagleShardParallelize<ShardResult>(
+      [&tree_collection, &phylo_model_params, rescaling, tree_count, gradient_count,
+       hessian, edge_ids](FatBeagle *fat_beagle) {
+        ShardResult shard_result = {
+            EigenVectorXd(tree_count), EigenMatrixXd(tree_count, gradient_count),
+            EigenMatrixXd(hessian ? tree_count : 0, hessian ? gradient_count : 0)};
+        auto &[shard_log_likelihoods, shard_branch_gradients, shard_hessians] =
+            shard_result;
+        FatBeagleBranchGradients(
+            fat_beagle, tree_collection, phylo_model_params, rescaling, 0, tree_count,
+            shard_log_likelihoods, shard_branch_gradients,
+            hessian ? std::optional<EigenMatrixXdRef>(shard_hessians) : std::nullopt,
+            edge_ids);
+        return shard_result;
+      },
+      thread_pool);
+  log_likelihoods.setZero();
+  branch_gradients.setZero();
+  if (hessian) {
+    branch_hessian_diagonals->setZero();
+  }
+  for (const auto &[shard_log_likelihoods, shard_branch_gradients, shard_hessians] :
+       shard_results) {
+    log_likelihoods += shard_log_likelihoods;
+    branch_gradients += shard_branch_gradients;
+    if (hessian) {
+      *branch_hessian_diagonals += shard_hessians;
+    }
+  }
+}
+
+template <typename TTreeCollection>
+void Engine::LogLikelihoodsInternal(const TTreeCollection &tree_collection,
+                                    EigenMatrixXdRef phylo_model_params,
+                                    const bool rescaling,
+                                    EigenVectorXdRef log_likelihoods) const {
+  if (shard_site_patterns_) {
+    ShardedLogLikelihoods(*thread_pool_, tree_collection, phylo_model_params,
+                          rescaling, log_likelihoods);
+  } else {
+    FatBeagleBatchParallelize(*thread_pool_, tree_collection, phylo_model_params,
+                              rescaling, tree_batch_size_, log_likelihoods);
+  }
+}
+
+template <typename TTreeCollection>
+void Engine::BranchGradientsInternal(
+    const TTreeCollection &tree_collection, EigenMatrixXdRef phylo_model_params,
+    const bool rescaling, EigenVectorXdRef log_likelihoods,
+    EigenMatrixXdRef branch_gradients,
+    std::optional<EigenMatrixXdRef> branch_hessian_diagonals,
+    const SizeVector *edge_ids) const {
+  const auto node_count = 2 * tree_collection.TaxonCount() - 1;
+  Assert(branch_gradients.cols() == node_count,
+         "The branch gradient matrix needs a column for every node.");
+  if (branch_hessian_diagonals.has_value()) {
+    Assert(branch_hessian_diagonals->rows() == branch_gradients.rows() &&
+               branch_hessian_diagonals->cols() == node_count,
+           "The Hessian diagonal matrix needs the shape of the branch gradients.");
+  }
+  if (shard_site_patterns_) {
+    ShardedBranchGradients(*thread_pool_, tree_collection, phylo_model_params,
+                           rescaling, log_likelihoods, branch_gradients,
+                           branch_hessian_diagonals, edge_ids);
+  } else {
+    FatBeagleBranchGradientParallelize(
+        *thread_pool_, tree_collection, phylo_model_params, rescaling,
+        log_likelihoods, branch_gradients, branch_hessian_diagonals, edge_ids);
+  }
+}
+
+// We compare against the whole site pattern, which has the same log likelihood as
+// the sum over shards.
+template <typename TTreeCollection>
+double Engine::MaxPrecisionErrorInternal(const TTreeCollection &tree_collection,
+                                         EigenMatrixXdRef phylo_model_params,
+                                         size_t sample_count) const {
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(tree_count == phylo_model_params.rows(),
+         "We param_matrix needs as many rows as we have trees.");
+  sample_count = std::min(sample_count, tree_count);
+  if (sample_count == 0) {
+    return 0.;
+  }  // else
+  FatBeagle reference(model_specification_, site_pattern_,
+                      BEAGLE_FLAG_PROCESSOR_CPU | BEAGLE_FLAG_PRECISION_DOUBLE,
+                      engine_specification_.use_tip_states_);
+  reference.SetRescaling(true);
+  const size_t fat_beagle_count = shard_site_patterns_ ? fat_beagles_.size() : 1;
+  double max_error = 0.;
+  for (size_t sample = 0; sample < sample_count; sample++) {
+    const size_t tree_number = sample * tree_count / sample_count;
+    const auto &tree = tree_collection.GetTree(tree_number);
+    double log_likelihood = 0.;
+    for (size_t i = 0; i < fat_beagle_count; i++) {
+      FatBeagle *fat_beagle = fat_beagles_[i].get();
+      fat_beagle->SetParameters(phylo_model_params.row(tree_number));
+      fat_beagle->SetRescaling(true);
+      log_likelihood += fat_beagle->LogLikelihood(tree);
+    }
+    reference.SetParameters(phylo_model_params.row(tree_number));
+    const double error = std::fabs(log_likelihood - reference.LogLikelihood(tree));
+    if (!std::isfinite(error)) {
+      return std::numeric_limits<double>::infinity();
+    }  // else
+    max_error = std::max(max_error, error);
+  }
+  return max_error;
+}
+
+double Engine::MaxPrecisionError(const UnrootedTreeCollection &tree_collection,
+                                 const EigenMatrixXdRef phylo_model_params,
+                                 size_t sample_count) const {
+  return MaxPrecisionErrorInternal(tree_collection, phylo_model_params, sample_count);
+}
+
+double Engine::MaxPrecisionError(const RootedTreeCollection &tree_collection,
+                                 const EigenMatrixXdRef phylo_model_params,
+                                 size_t sample_count) const {
+  return MaxPrecisionErrorInternal(tree_collection, phylo_model_params, sample_count);
+}
+
+template <typename TTree>
+double Engine::IncrementalLogLikelihoodInternal(
+    const TTree &tree, const EigenVectorXdRef phylo_model_params,
+    const bool rescaling) const {
+  const size_t fat_beagle_count = shard_site_patterns_ ? fat_beagles_.size() : 1;
+  double log_likelihood = 0.;
+  for (size_t i = 0; i < fat_beagle_count; i++) {
+    FatBeagle *fat_beagle = fat_beagles_[i].get();
+    fat_beagle->SetParameters(phylo_model_params);
+    fat_beagle->SetRescaling(rescaling);
+    log_likelihood += fat_beagle->IncrementalLogLikelihood(tree);
+  }
+  return log_likelihood;
+}
+
+double Engine::IncrementalLogLikelihood(const UnrootedTree &tree,
+                                        const EigenVectorXdRef phylo_model_params,
+                                        const bool rescaling) const {
+  return IncrementalLogLikelihoodInternal(tree, phylo_model_params, rescaling);
+}
+
+double Engine::IncrementalLogLikelihood(const RootedTree &tree,
+                                        const EigenVectorXdRef phylo_model_params,
+                                        const bool rescaling) const {
+  return IncrementalLogLikelihoodInternal(tree, phylo_model_params, rescaling);
+}
+
+size_t Engine::IncrementalPartialUpdateCount() const {
+  return GetFirstFatBeagle()->IncrementalPartialUpdateCount();
+}
+
+template <typename TFunction>
+void Engine::ForBorrowedFatBeagles(const EigenVectorXdRef phylo_model_params,
+                                   const bool rescaling, TFunction f) const {
+  // Borrow a free FatBeagle with an index in [first, last).
+  auto borrow = [this](size_t first, size_t last) {
+    while (true) {
+      for (size_t i = first; i < last; i++) {
+        bool borrowed = false;
+        if (fat_beagle_borrowed_[i].compare_exchange_strong(
+                borrowed, true, std::memory_order_acquire)) {
+          return i;
+        }
+      }
+      std::this_thread::yield();
+    }
+  };
+  const size_t borrow_count = shard_site_patterns_ ? fat_beagles_.size() : 1;
+  for (size_t borrow_idx = 0; borrow_idx < borrow_count; borrow_idx++) {
+    const size_t i = shard_site_patterns_ ? borrow(borrow_idx, borrow_idx + 1)
+                                          : borrow(0, fat_beagles_.size());
+    try {
+      FatBeagle *fat_beagle = fat_beagles_[i].get();
+      fat_beagle->SetParameters(phylo_model_params);
+      fat_beagle->SetRescaling(rescaling);
+      f(fat_beagle);
+    } catch (...) {
+      fat_beagle_borrowed_[i].store(false, std::memory_order_release);
+      throw;
+    }
+    fat_beagle_borrowed_[i].store(false, std::memory_order_release);
+  }
+}
+
+template <typename TTree>
+double Engine::LogLikelihoodInternal(const TTree &tree,
+                                     const EigenVectorXdRef phylo_model_params,
+                                     const bool rescaling) const {
+  double log_likelihood = 0.;
+  ForBorrowedFatBeagles(phylo_model_params, rescaling, [&](FatBeagle *fat_beagle) {
+    log_likelihood += fat_beagle->LogLikelihood(tree);
+  });
+  return log_likelihood;
+}
+
+template <typename TTree>
+std::pair<double, std::vector<double>> Engine::BranchGradientInternal(
+    const TTree &tree, const EigenVectorXdRef phylo_model_params,
+    const bool rescaling) const {
+  EigenVectorXd branch_gradient = EigenVectorXd::Zero(2 * tree.LeafCount() - 1);
+  EigenVectorXd block_branch_gradient(branch_gradient.size());
+  double log_likelihood = 0.;
+  ForBorrowedFatBeagles(phylo_model_params, rescaling, [&](FatBeagle *fat_beagle) {
+    block_branch_gradient.setZero();
+    log_likelihood += fat_beagle->BranchGradient(tree, block_branch_gradient);
+    branch_gradient += block_branch_gradient;
+  });
+  return {log_likelihood, std::vector<double>(branch_gradient.data(),
+                                              branch_gradient.data() +
+                                                  branch_gradient.size())};
+}
+
+double Engine::LogLikelihood(const UnrootedTree &tree,
+                             const EigenVectorXdRef phylo_model_params,
+                             const bool rescaling) const {
+  return LogLikelihoodInternal(tree, phylo_model_params, rescaling);
+}
+
+double Engine::LogLikelihood(const RootedTree &tree,
+                             const EigenVectorXdRef phylo_model_params,
+                             const bool rescaling) const {
+  return LogLikelihoodInternal(tree, phylo_model_params, rescaling);
+}
+
+UnrootedTreeGradient Engine::Gradient(const UnrootedTree &tree,
+                                      const EigenVectorXdRef phylo_model_params,
+                                      const bool rescaling) const {
+  if (shard_site_patterns_) {
+    auto [log_likelihood, branch_gradient] =
+        BranchGradientInternal(tree, phylo_model_params, rescaling);
+    return {log_likelihood, std::move(branch_gradient), {}, {}};
+  }  // else
+  UnrootedTreeGradient gradient;
+  ForBorrowedFatBeagles(phylo_model_params, rescaling, [&](FatBeagle *fat_beagle) {
+    gradient = fat_beagle->Gradient(tree);
+  });
+  return gradient;
+}
+
+// As for Gradients, when we shard we compute the ratio and clock gradients from the
+// summed branch gradients.
+RootedTreeGradient Engine::Gradient(const RootedTree &tree,
+                                    const EigenVectorXdRef phylo_model_params,
+                                    const bool rescaling) const {
+  if (shard_site_patterns_) {
+    const auto [log_likelihood, branch_gradient] =
+        BranchGradientInternal(tree, phylo_model_params, rescaling);
+    return FatBeagle::RootedGradientOf(tree, log_likelihood, branch_gradient);
+  }  // else
+  RootedTreeGradient gradient;
+  ForBorrowedFatBeagles(phylo_model_params, rescaling, [&](FatBeagle *fat_beagle) {
+    gradient = fat_beagle->Gradient(tree);
+  });
+  return gradient;
+}
+
 std::vector<double> Engine::LogLikelihoods(
     const UnrootedTreeCollection &tree_collection,
     const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
-  return FatBeagleParallelize<double, UnrootedTree, UnrootedTreeCollection>(
-      FatBeagle::StaticUnrootedLogLikelihood, fat_beagles_, tree_collection,
-      phylo_model_params, rescaling);
+  std::vector<double> results(tree_collection.TreeCount());
+  Eigen::Map<EigenVectorXd> results_map(results.data(), results.size());
+  LogLikelihoodsInternal(tree_collection, phylo_model_params, rescaling, results_map);
+  return results;
 }
 
 std::vector<double> Engine::LogLikelihoods(const RootedTreeCollection &tree_collection,
                                            const EigenMatrixXdRef phylo_model_params,
                                            const bool rescaling) const {
-  return FatBeagleParallelize<double, RootedTree, RootedTreeCollection>(
-      FatBeagle::StaticRootedLogLikelihood, fat_beagles_, tree_collection,
-      phylo_model_params, rescaling);
+  std::vector<double> results(tree_collection.TreeCount());
+  Eigen::Map<EigenVectorXd> results_map(results.data(), results.size());
+  LogLikelihoodsInternal(tree_collection, phylo_model_params, rescaling, results_map);
+  return results;
+}
+
+void Engine::LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                            const EigenMatrixXdRef phylo_model_params,
+                            const bool rescaling,
+                            EigenVectorXdRef log_likelihoods) const {
+  LogLikelihoodsInternal(tree_collection, phylo_model_params, rescaling,
+                         log_likelihoods);
+}
+
+void Engine::LogLikelihoods(const RootedTreeCollection &tree_collection,
+                            const EigenMatrixXdRef phylo_model_params,
+                            const bool rescaling,
+                            EigenVectorXdRef log_likelihoods) const {
+  LogLikelihoodsInternal(tree_collection, phylo_model_params, rescaling,
+                         log_likelihoods);
 }
 
 std::vector<UnrootedTreeGradient> Engine::Gradients(
     const UnrootedTreeCollection &tree_collection,
     const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  if (shard_site_patterns_) {
+    EigenVectorXd log_likelihoods(tree_collection.TreeCount());
+    EigenMatrixXd branch_gradients(tree_collection.TreeCount(),
+                                   2 * tree_collection.TaxonCount() - 1);
+    BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                            log_likelihoods, branch_gradients);
+    std::vector<UnrootedTreeGradient> gradients;
+    for (size_t tree_number = 0; tree_number < tree_collection.TreeCount();
+         tree_number++) {
+      const auto row = branch_gradients.row(tree_number);
+      gradients.push_back({log_likelihoods(tree_number),
+                           std::vector<double>(row.data(), row.data() + row.size()),
+                           {},
+                           {}});
+    }
+    return gradients;
+  }  // else
   return FatBeagleParallelize<UnrootedTreeGradient, UnrootedTree,
                               UnrootedTreeCollection>(FatBeagle::StaticUnrootedGradient,
-                                                      fat_beagles_, tree_collection,
+                                                      *thread_pool_, tree_collection,
                                                       phylo_model_params, rescaling);
 }
 
 std::vector<RootedTreeGradient> Engine::Gradients(
     const RootedTreeCollection &tree_collection,
     const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  if (shard_site_patterns_) {
+    EigenVectorXd log_likelihoods(tree_collection.TreeCount());
+    EigenMatrixXd branch_gradients(tree_collection.TreeCount(),
+                                   2 * tree_collection.TaxonCount() - 1);
+    BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                            log_likelihoods, branch_gradients);
+    // The ratio and clock gradients include terms that don't depend on the data, so
+    // rather than summing them across blocks we compute them from the summed branch
+    // gradients.
+    std::vector<RootedTreeGradient> gradients;
+    for (size_t tree_number = 0; tree_number < tree_collection.TreeCount();
+         tree_number++) {
+      const auto row = branch_gradients.row(tree_number);
+      gradients.push_back(FatBeagle::RootedGradientOf(
+          tree_collection.GetTree(tree_number), log_likelihoods(tree_number),
+          std::vector<double>(row.data(), row.data() + row.size())));
+    }
+    return gradients;
+  }  // else
   return FatBeagleParallelize<RootedTreeGradient, RootedTree, RootedTreeCollection>(
-      FatBeagle::StaticRootedGradient, fat_beagles_, tree_collection,
+      FatBeagle::StaticRootedGradient, *thread_pool_, tree_collection,
       phylo_model_params, rescaling);
 }
 
+void Engine::BranchGradients(const UnrootedTreeCollection &tree_collection,
+                             const EigenMatrixXdRef phylo_model_params,
+                             const bool rescaling, EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients);
+}
+
+void Engine::BranchGradients(const RootedTreeCollection &tree_collection,
+                             const EigenMatrixXdRef phylo_model_params,
+                             const bool rescaling, EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients);
+}
+
+void Engine::BranchGradientsAndHessianDiagonals(
+    const UnrootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    EigenMatrixXdRef branch_hessian_diagonals) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients, branch_hessian_diagonals);
+}
+
+void Engine::BranchGradientsAndHessianDiagonals(
+    const RootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    EigenMatrixXdRef branch_hessian_diagonals) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients, branch_hessian_diagonals);
+}
+
+void Engine::SubsetBranchGradients(const UnrootedTreeCollection &tree_collection,
+                                   const EigenMatrixXdRef phylo_model_params,
+                                   const bool rescaling, const SizeVector &edge_ids,
+                                   EigenVectorXdRef log_likelihoods,
+                                   EigenMatrixXdRef branch_gradients) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients, std::nullopt, &edge_ids);
+}
+
+void Engine::SubsetBranchGradients(const RootedTreeCollection &tree_collection,
+                                   const EigenMatrixXdRef phylo_model_params,
+                                   const bool rescaling, const SizeVector &edge_ids,
+                                   EigenVectorXdRef log_likelihoods,
+                                   EigenMatrixXdRef branch_gradients) const {
+  BranchGradientsInternal(tree_collection, phylo_model_params, rescaling,
+                          log_likelihoods, branch_gradients, std::nullopt, &edge_ids);
+}
+
 const FatBeagle *const Engine::GetFirstFatBeagle() const {
   Assert(!fat_beagles_.empty(), "You have no FatBeagles.");
   return fat_beagles_[0].get();
@@ -7,19 +7,63 @@
 #ifndef SRC_ENGINE_HPP_
 #define SRC_ENGINE_HPP_
 
+#include <atomic>
 #include <memory>
+#include <optional>
 #include <utility>
 #include <vector>
 #include "fat_beagle.hpp"
 #include "phylo_model.hpp"
 #include "rooted_tree_collection.hpp"
 #include "site_pattern.hpp"
+#include "task_processor.hpp"
+#include "thread_pinning.hpp"
 #include "unrooted_tree_collection.hpp"
 
 struct EngineSpecification {
   const size_t thread_count_;
   const std::vector<BeagleFlags> &beagle_flag_vector_;
   const bool use_tip_states_;
+  // The number of subtree partials each FatBeagle caches for reuse across trees.
+  // Zero turns off caching. See partial_cache.hpp.
+  const size_t partial_cache_capacity_ = 0;
+  // The number of trees each FatBeagle computes likelihoods for at once. See
+  // FatBeagle::BatchLogLikelihood.
+  const size_t tree_batch_size_ = 1;
+  // If true, split the site patterns into one contiguous block per thread, so that
+  // every thread works on every tree and the results are summed across blocks.
+  // This gives parallelism within a tree for long alignments.
+  const bool shard_site_patterns_ = false;
+  // The number of topologies for which each FatBeagle remembers its BEAGLE
+  // operations. Zero turns this off. See operation_schedule_cache.hpp.
+  const size_t operation_schedule_cache_capacity_ = 0;
+  // The order of the site patterns. See site_pattern.hpp.
+  const SitePatternOrder site_pattern_order_ = SitePatternOrder::FirstAppearance;
+  // If true, the FatBeagles compute the transition matrices of all of the edges and
+  // rate categories on the host in one batch, and upload them to BEAGLE. See
+  // transition_matrix_kernel.hpp.
+  const bool host_transition_matrices_ = false;
+  // How the threads are placed on the machine. If they are pinned, each FatBeagle is
+  // made on its thread, so that its BEAGLE buffers are allocated on the NUMA node of
+  // that thread. See thread_pinning.hpp.
+  const ThreadPinning thread_pinning_ = ThreadPinning::None;
+  // If true, ask BEAGLE for single precision instances, which are faster, most of all
+  // on GPUs. These always rescale; see FatBeagle::SetRescaling.
+  const bool single_precision_ = false;
+};
+
+// A choice of BEAGLE preference flags and tip representation for Engine::AutoTune.
+struct BeagleConfiguration {
+  std::vector<BeagleFlags> beagle_flag_vector_;
+  bool use_tip_states_;
+};
+
+struct BeagleConfigurationTiming {
+  BeagleConfiguration configuration_;
+  // The flags of the instance that BEAGLE gave us, which may differ from the ones we
+  // asked for if the requested resource isn't available.
+  FatBeagle::PackedBeagleFlags beagle_flags_;
+  double seconds_per_evaluation_;
 };
 
 class Engine {
@@ -29,6 +73,50 @@ class Engine {
 
   const BlockSpecification &GetPhyloModelBlockSpecification() const;
 
+  // Would an Engine made with these arguments have the same BEAGLE instances as this
+  // one? That is, is it the same specification for the same site patterns, with a
+  // model that has the same numbers of states and rate categories? If so we can keep
+  // this Engine and swap its model with SetPhyloModelSpecification rather than
+  // making a new one, which saves making BEAGLE instances and uploading the tips.
+  bool IsCompatibleWith(const EngineSpecification &engine_specification,
+                        const PhyloModelSpecification &model_specification,
+                        const SitePattern &site_pattern) const;
+  void SetPhyloModelSpecification(const PhyloModelSpecification &model_specification);
+
+  // Switch the hot path profiling of every FatBeagle, and the queue wait timing of
+  // the thread pool, on or off. GetProfile sums these up. Only call these while no
+  // computation is running.
+  void SetProfiling(bool profiling);
+  HotPathProfile GetProfile() const;
+  void ResetProfile();
+  // Switch adaptive rescaling on or off for every FatBeagle, forgetting the
+  // topologies that it found to need rescaling; see FatBeagle::SetAdaptiveRescaling.
+  // Only call this while no computation is running.
+  void SetAdaptiveRescaling(bool adaptive_rescaling);
+  // The number of topologies that the FatBeagles rescale adaptively. Each FatBeagle
+  // counts the topologies that it has seen underflow.
+  size_t RescaledTopologyCount() const;
+  // The total size of the buffers that the FatBeagles asked BEAGLE for.
+  size_t BeagleBufferByteCount() const;
+  // What BeagleBufferByteCount would be for an Engine of this specification, without
+  // making one. We assume double precision unless the flags ask for single precision.
+  static size_t EstimateBeagleBufferByteCount(
+      const EngineSpecification &engine_specification,
+      const PhyloModelSpecification &model_specification,
+      const SitePattern &site_pattern);
+
+  // The configurations that AutoTune tries by default: no vectorization, SSE, AVX,
+  // CUDA and OpenCL, each with and without tip states.
+  static std::vector<BeagleConfiguration> AutoTuneCandidates();
+  // Make a FatBeagle for each candidate configuration and time evaluation_count
+  // log likelihood evaluations on a ladder tree spanning the taxa of site_pattern.
+  // We print the measurements and return them sorted from fastest to slowest.
+  // Candidates for which BEAGLE can't make an instance are left out.
+  static std::vector<BeagleConfigurationTiming> AutoTune(
+      const PhyloModelSpecification &model_specification,
+      const SitePattern &site_pattern, size_t evaluation_count,
+      const std::vector<BeagleConfiguration> &candidates = AutoTuneCandidates());
+
   std::vector<double> LogLikelihoods(const UnrootedTreeCollection &tree_collection,
                                      const EigenMatrixXdRef phylo_model_params,
                                      const bool rescaling) const;
@@ -42,11 +130,151 @@ class Engine {
                                             const EigenMatrixXdRef phylo_model_params,
                                             const bool rescaling) const;
 
+  // The log likelihood of one tree from FatBeagle::IncrementalLogLikelihood on the
+  // first FatBeagle, or summed over all of them if we shard the site patterns, so
+  // that after a local edit to the tree we only recompute what it changed. The other
+  // computations of this Engine make the next call start from scratch. Don't call
+  // this while another computation is running.
+  double IncrementalLogLikelihood(const UnrootedTree &tree,
+                                  const EigenVectorXdRef phylo_model_params,
+                                  const bool rescaling) const;
+  double IncrementalLogLikelihood(const RootedTree &tree,
+                                  const EigenVectorXdRef phylo_model_params,
+                                  const bool rescaling) const;
+  // The number of partials that the last IncrementalLogLikelihood recomputed on the
+  // first FatBeagle.
+  size_t IncrementalPartialUpdateCount() const;
+
+  // The log likelihood or gradient of one tree, computed on the calling thread by a
+  // FatBeagle borrowed from a free list, rather than handed to the thread pool. This
+  // skips the scheduling and thread handoff of the tree collection methods, which
+  // dwarf the computation for a single tree. Several threads can call these at once,
+  // each borrowing its own FatBeagle and spinning while all of them are borrowed, but
+  // don't call them while a tree collection computation is running. If we shard the
+  // site patterns, the tree borrows each FatBeagle in turn and we sum over them.
+  double LogLikelihood(const UnrootedTree &tree,
+                       const EigenVectorXdRef phylo_model_params,
+                       const bool rescaling) const;
+  double LogLikelihood(const RootedTree &tree,
+                       const EigenVectorXdRef phylo_model_params,
+                       const bool rescaling) const;
+  UnrootedTreeGradient Gradient(const UnrootedTree &tree,
+                                const EigenVectorXdRef phylo_model_params,
+                                const bool rescaling) const;
+  RootedTreeGradient Gradient(const RootedTree &tree,
+                              const EigenVectorXdRef phylo_model_params,
+                              const bool rescaling) const;
+
+  // The largest absolute difference between the log likelihoods that this Engine
+  // computes for sample_count trees spread through tree_collection and those that a
+  // double precision FatBeagle on the CPU computes for them, all with rescaling. This
+  // checks whether single precision is accurate enough for these trees. It is
+  // infinite if any log likelihood isn't finite. Don't call this while another
+  // computation is running.
+  double MaxPrecisionError(const UnrootedTreeCollection &tree_collection,
+                           const EigenMatrixXdRef phylo_model_params,
+                           size_t sample_count) const;
+  double MaxPrecisionError(const RootedTreeCollection &tree_collection,
+                           const EigenMatrixXdRef phylo_model_params,
+                           size_t sample_count) const;
+
+  // These versions write their results into caller-provided storage rather than
+  // allocating it: log_likelihoods needs an entry per tree and branch_gradients
+  // needs a row per tree and a column per node id. The rows of branch_gradients
+  // are laid out like the branch_lengths_ of the corresponding TreeGradients.
+  void LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                      EigenVectorXdRef log_likelihoods) const;
+  void LogLikelihoods(const RootedTreeCollection &tree_collection,
+                      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                      EigenVectorXdRef log_likelihoods) const;
+  void BranchGradients(const UnrootedTreeCollection &tree_collection,
+                       const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                       EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients) const;
+  void BranchGradients(const RootedTreeCollection &tree_collection,
+                       const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                       EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients) const;
+  // BranchGradients, also writing the second derivatives of the log likelihoods with
+  // respect to the branch lengths into branch_hessian_diagonals, which is laid out
+  // like branch_gradients.
+  void BranchGradientsAndHessianDiagonals(
+      const UnrootedTreeCollection &tree_collection,
+      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+      EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+      EigenMatrixXdRef branch_hessian_diagonals) const;
+  void BranchGradientsAndHessianDiagonals(
+      const RootedTreeCollection &tree_collection,
+      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+      EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+      EigenMatrixXdRef branch_hessian_diagonals) const;
+  // BranchGradients along only the branches above the nodes of edge_ids, leaving the
+  // other entries of branch_gradients zero; see FatBeagle::SubsetBranchGradient.
+  void SubsetBranchGradients(const UnrootedTreeCollection &tree_collection,
+                             const EigenMatrixXdRef phylo_model_params,
+                             const bool rescaling, const SizeVector &edge_ids,
+                             EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients) const;
+  void SubsetBranchGradients(const RootedTreeCollection &tree_collection,
+                             const EigenMatrixXdRef phylo_model_params,
+                             const bool rescaling, const SizeVector &edge_ids,
+                             EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients) const;
+
  private:
   SitePattern site_pattern_;
   std::vector<std::unique_ptr<FatBeagle>> fat_beagles_;
+  // One long-lived thread per FatBeagle. This is declared after fat_beagles_ so
+  // that its threads are joined before the FatBeagles are destroyed.
+  std::unique_ptr<WorkStealingPool<FatBeagle *>> thread_pool_;
+  const size_t tree_batch_size_;
+  const bool shard_site_patterns_;
+  // What we were made with, for IsCompatibleWith. The specification refers to our
+  // copy of the BEAGLE flags.
+  const std::vector<BeagleFlags> beagle_flag_vector_;
+  const EngineSpecification engine_specification_;
+  PhyloModelSpecification model_specification_;
+  // The free list of the single tree methods: whether each FatBeagle is borrowed.
+  std::unique_ptr<std::atomic<bool>[]> fat_beagle_borrowed_;
 
   const FatBeagle *const GetFirstFatBeagle() const;
+
+  // Borrow a FatBeagle with these parameters and rescaling, or each FatBeagle in
+  // turn if we shard the site patterns, and call f on it.
+  template <typename TFunction>
+  void ForBorrowedFatBeagles(const EigenVectorXdRef phylo_model_params,
+                             const bool rescaling, TFunction f) const;
+  template <typename TTree>
+  double LogLikelihoodInternal(const TTree &tree,
+                               const EigenVectorXdRef phylo_model_params,
+                               const bool rescaling) const;
+  // The log likelihood and branch gradient of one tree, summed over the FatBeagles
+  // if we shard the site patterns.
+  template <typename TTree>
+  std::pair<double, std::vector<double>> BranchGradientInternal(
+      const TTree &tree, const EigenVectorXdRef phylo_model_params,
+      const bool rescaling) const;
+
+  template <typename TTreeCollection>
+  void LogLikelihoodsInternal(const TTreeCollection &tree_collection,
+                              EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                              EigenVectorXdRef log_likelihoods) const;
+  template <typename TTreeCollection>
+  double MaxPrecisionErrorInternal(const TTreeCollection &tree_collection,
+                                   EigenMatrixXdRef phylo_model_params,
+                                   size_t sample_count) const;
+  template <typename TTree>
+  double IncrementalLogLikelihoodInternal(const TTree &tree,
+                                          const EigenVectorXdRef phylo_model_params,
+                                          const bool rescaling) const;
+  template <typename TTreeCollection>
+  void BranchGradientsInternal(
+      const TTreeCollection &tree_collection, EigenMatrixXdRef phylo_model_params,
+      const bool rescaling, EigenVectorXdRef log_likelihoods,
+      EigenMatrixXdRef branch_gradients,
+      std::optional<EigenMatrixXdRef> branch_hessian_diagonals = std::nullopt,
+      const SizeVector *edge_ids = nullptr) const;
 };
 
 #endif  // SRC_ENGINE_HPP_
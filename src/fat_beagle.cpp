@@ -2,20 +2,52 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "fat_beagle.hpp"
+#include <chrono>
+#include <cmath>
 #include <numeric>
 #include <utility>
 #include <vector>
+#include "rooted_gradient_transforms.hpp"
 
 FatBeagle::FatBeagle(const PhyloModelSpecification &specification,
                      const SitePattern &site_pattern,
                      const FatBeagle::PackedBeagleFlags beagle_preference_flags,
-                     bool use_tip_states)
+                     bool use_tip_states, size_t partial_cache_capacity,
+                     size_t tree_batch_size, size_t operation_schedule_cache_capacity,
+                     bool host_transition_matrices)
     : phylo_model_(PhyloModel::OfSpecification(specification)),
       rescaling_(false),  // Note: rescaling_ set via the SetRescaling method.
       pattern_count_(static_cast<int>(site_pattern.PatternCount())),
-      use_tip_states_(use_tip_states) {
+      use_tip_states_(use_tip_states),
+      tree_batch_size_(tree_batch_size) {
+  if (tree_batch_size_ == 0) {
+    Failwith("The tree batch size needs to be strictly positive.");
+  }
   std::tie(beagle_instance_, beagle_flags_) =
-      CreateInstance(site_pattern, beagle_preference_flags);
+      CreateInstance(site_pattern, beagle_preference_flags, partial_cache_capacity);
+  SetRescaling(false);
+  const int node_count = static_cast<int>(2 * site_pattern.SequenceCount() - 1);
+  node_indices_ = BeagleAccessories::IotaVector(node_count - 1, 0);
+  pre_order_node_indices_ = BeagleAccessories::IotaVector(node_count - 1, node_count);
+  // BranchGradient puts the differential matrix in the matrix buffer of the root,
+  // which has no branch, and the second differential matrix in the one after it,
+  // which we don't otherwise use.
+  derivative_matrix_indices_.assign(node_count - 1, node_count - 1);
+  second_derivative_matrix_indices_.assign(node_count - 1, node_count);
+  if (partial_cache_capacity > 0) {
+    // The cache buffers come after the post-order and pre-order buffers, of which
+    // there is one per node.
+    partial_cache_ =
+        std::make_unique<PartialCache>(2 * node_count, partial_cache_capacity);
+  }
+  if (operation_schedule_cache_capacity > 0) {
+    operation_schedule_cache_ =
+        std::make_unique<OperationScheduleCache>(operation_schedule_cache_capacity);
+  }
+  if (host_transition_matrices) {
+    transition_matrix_kernel_ = std::make_unique<TransitionMatrixKernel>(
+        *phylo_model_->GetSubstitutionModel());
+  }
   if (use_tip_states_) {
     SetTipStates(site_pattern);
   } else {
@@ -36,116 +68,678 @@ const BlockSpecification &FatBeagle::GetPhyloModelBlockSpecification() const {
   return phylo_model_->GetBlockSpecification();
 }
 
-void FatBeagle::SetParameters(const EigenVectorXdRef param_vector) {
-  phylo_model_->SetParameters(param_vector);
+void FatBeagle::SetPhyloModel(const PhyloModelSpecification &specification) {
+  auto phylo_model = PhyloModel::OfSpecification(specification);
+  if (phylo_model->GetSubstitutionModel()->GetStateCount() !=
+          phylo_model_->GetSubstitutionModel()->GetStateCount() ||
+      phylo_model->GetSiteModel()->GetCategoryCount() !=
+          phylo_model_->GetSiteModel()->GetCategoryCount()) {
+    Failwith("The new phylogenetic model doesn't fit this BEAGLE instance.");
+  }
+  phylo_model_ = std::move(phylo_model);
+  uploaded_parameters_.resize(0);
+  ForgetIncrementalState();
+  if (partial_cache_ != nullptr) {
+    partial_cache_->Clear();
+  }
+  // This also rebuilds the transition matrix kernel if we have one.
   UpdatePhyloModelInBeagle();
 }
 
+// FatBeagleParallelize calls this for every tree, and typically every tree has the
+// same parameters. So we skip the parts of the model that haven't changed: this
+// avoids resending rates, weights, frequencies and eigendecompositions to BEAGLE,
+// and means that GTR only redoes its eigendecomposition when its parameters change.
+void FatBeagle::SetParameters(const EigenVectorXdRef param_vector) {
+  const bool substitution_changed =
+      ParameterSegmentChanged(param_vector, PhyloModel::entire_substitution_key_);
+  const bool site_changed =
+      ParameterSegmentChanged(param_vector, PhyloModel::entire_site_key_);
+  const bool clock_changed =
+      ParameterSegmentChanged(param_vector, PhyloModel::entire_clock_key_);
+  if (!substitution_changed && !site_changed && !clock_changed) {
+    return;
+  }  // else
+  HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::ParameterUpload);
+  if (partial_cache_ != nullptr) {
+    partial_cache_->Clear();
+  }
+  ForgetIncrementalState();
+  if (substitution_changed) {
+    phylo_model_->GetSubstitutionModel()->SetParameters(phylo_model_->ExtractSegment(
+        param_vector, PhyloModel::entire_substitution_key_));
+    UpdateSubstitutionModelInBeagle();
+  }
+  if (site_changed) {
+    phylo_model_->GetSiteModel()->SetParameters(
+        phylo_model_->ExtractSegment(param_vector, PhyloModel::entire_site_key_));
+    UpdateSiteModelInBeagle();
+  }
+  if (clock_changed) {
+    // Issue #146: the clock model isn't in BEAGLE.
+    phylo_model_->GetClockModel()->SetParameters(
+        phylo_model_->ExtractSegment(param_vector, PhyloModel::entire_clock_key_));
+  }
+  uploaded_parameters_ = param_vector;
+}
+
+bool FatBeagle::ParameterSegmentChanged(const EigenVectorXdRef param_vector,
+                                        const std::string &key) {
+  if (uploaded_parameters_.size() != param_vector.size()) {
+    return true;
+  }  // else
+  return phylo_model_->ExtractSegment(param_vector, key) !=
+         phylo_model_->ExtractSegment(uploaded_parameters_, key);
+}
+
+template <typename TEvaluate>
+double FatBeagle::AdaptivelyRescaled(const Node::NodePtr &topology,
+                                     TEvaluate evaluate) const {
+  if (rescaling_ || !adaptive_rescaling_) {
+    return evaluate();
+  }  // else
+  if (rescaled_topologies_.find(topology) == rescaled_topologies_.end()) {
+    const double log_likelihood = evaluate();
+    if (std::isfinite(log_likelihood)) {
+      return log_likelihood;
+    }  // else
+    rescaled_topologies_.insert(topology);
+  }
+  rescaling_ = true;
+  try {
+    const double log_likelihood = evaluate();
+    rescaling_ = false;
+    return log_likelihood;
+  } catch (...) {
+    rescaling_ = false;
+    throw;
+  }
+}
+
 // This is the "core" of the likelihood calculation, assuming that the tree is
 // bifurcating.
 double FatBeagle::LogLikelihoodInternals(
     const Node::NodePtr topology, const std::vector<double> &branch_lengths) const {
-  BeagleAccessories ba(beagle_instance_, rescaling_, topology);
-  BeagleOperationVector operations;
-  beagleResetScaleFactors(beagle_instance_, 0);
-  topology->BinaryIdPostOrder(
-      [&operations, &ba](int node_id, int child0_id, int child1_id) {
-        AddLowerPartialOperation(operations, ba, node_id, child0_id, child1_id);
-      });
+  ForgetIncrementalState();
+  return AdaptivelyRescaled(topology, [this, &topology, &branch_lengths]() {
+    beagleResetScaleFactors(beagle_instance_, 0);
+    if (UsePartialCache()) {
+      BeagleAccessories ba(beagle_instance_, rescaling_, topology);
+      auto &operations = scratch_.operations_;
+      operations.clear();
+      const int root_buffer =
+          AddCachedLowerPartialOperations(operations, ba, topology, branch_lengths);
+      return LogLikelihoodOfOperations(ba, operations, root_buffer, branch_lengths);
+    }  // else
+    const auto &schedule = GetOperationSchedule(topology, false);
+    return LogLikelihoodOfOperations(schedule.ba_, schedule.post_order_operations_,
+                                     schedule.ba_.root_id_, branch_lengths);
+  });
+}
+
+double FatBeagle::LogLikelihoodOfOperations(
+    const BeagleAccessories &ba, const BeagleOperationVector &operations,
+    int root_buffer, const std::vector<double> &branch_lengths) const {
   UpdateBeagleTransitionMatrices(ba, branch_lengths, nullptr);
-  beagleUpdatePartials(beagle_instance_,
-                       operations.data(),  // eigenIndex
-                       static_cast<int>(operations.size()),
-                       ba.cumulative_scale_index_[0]);
+  if (!operations.empty()) {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::Partials);
+    beagleUpdatePartials(beagle_instance_,
+                         operations.data(),  // eigenIndex
+                         static_cast<int>(operations.size()),
+                         ba.cumulative_scale_index_[0]);
+  }
   double log_like = 0.;
+  HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::RootLikelihoods);
   beagleCalculateRootLogLikelihoods(
-      beagle_instance_, &ba.root_id_, ba.category_weight_index_.data(),
+      beagle_instance_, &root_buffer, ba.category_weight_index_.data(),
       ba.state_frequency_index_.data(), ba.cumulative_scale_index_.data(),
       ba.mysterious_count_, &log_like);
   return log_like;
 }
 
-double FatBeagle::LogLikelihood(const UnrootedTree &tree) const {
+// A cached schedule stays in the cache at least until the next call, which is the
+// only one that can evict it.
+OperationSchedule &FatBeagle::GetOperationSchedule(const Node::NodePtr topology,
+                                                   bool with_pre_order) const {
+  OperationSchedule *schedule = nullptr;
+  if (operation_schedule_cache_ != nullptr) {
+    auto cached = operation_schedule_cache_->Find(topology, rescaling_);
+    if (cached == nullptr) {
+      cached = std::make_shared<OperationSchedule>(OperationSchedule{
+          BeagleAccessories(beagle_instance_, rescaling_, topology), {}, std::nullopt});
+      AddPostOrderOperations(*cached, topology);
+      operation_schedule_cache_->Insert(topology, rescaling_, cached);
+    }
+    schedule = cached.get();
+  } else {
+    // Build the schedule in the operation vectors of the previous one.
+    BeagleOperationVector post_order_operations;
+    if (scratch_.schedule_.has_value()) {
+      post_order_operations = std::move(scratch_.schedule_->post_order_operations_);
+      if (scratch_.schedule_->pre_order_operations_.has_value()) {
+        scratch_.pre_order_operations_ =
+            std::move(*scratch_.schedule_->pre_order_operations_);
+      }
+    }
+    post_order_operations.clear();
+    scratch_.schedule_.emplace(
+        OperationSchedule{BeagleAccessories(beagle_instance_, rescaling_, topology),
+                          std::move(post_order_operations), std::nullopt});
+    schedule = &*scratch_.schedule_;
+    AddPostOrderOperations(*schedule, topology);
+  }
+  if (with_pre_order && !schedule->pre_order_operations_.has_value()) {
+    const auto &ba = schedule->ba_;
+    BeagleOperationVector operations;
+    if (operation_schedule_cache_ == nullptr) {
+      operations = std::move(scratch_.pre_order_operations_);
+      operations.clear();
+    }
+    topology->TripleIdPreOrderBifurcating(
+        [&operations, &ba](int node_id, int sister_id, int parent_id) {
+          if (node_id != ba.root_id_) {
+            AddUpperPartialOperation(operations, ba, node_id, sister_id, parent_id);
+          }
+        });
+    schedule->pre_order_operations_ = std::move(operations);
+  }
+  return *schedule;
+}
+
+void FatBeagle::AddPostOrderOperations(OperationSchedule &schedule,
+                                       const Node::NodePtr topology) {
+  const auto &ba = schedule.ba_;
+  auto &operations = schedule.post_order_operations_;
+  topology->BinaryIdPostOrder(
+      [&operations, &ba](int node_id, int child0_id, int child1_id) {
+        AddLowerPartialOperation(operations, ba, node_id, child0_id, child1_id);
+      });
+}
+
+int FatBeagle::AddCachedLowerPartialOperations(
+    BeagleOperationVector &operations, const BeagleAccessories &ba,
+    const Node::NodePtr topology, const std::vector<double> &branch_lengths) const {
+  // Make sure that there is room for every internal node of this tree, so that we
+  // don't evict anything that this tree depends on.
+  if (partial_cache_->FreeCount() < static_cast<size_t>(ba.internal_count_)) {
+    partial_cache_->Clear();
+  }
+  // The buffer holding the partials for each node id. Leaves use their tip buffers.
+  auto &buffers = scratch_.buffers_;
+  buffers.resize(ba.node_count_);
+  std::iota(buffers.begin(), buffers.end(), 0);
+  topology->BinaryIdPostOrder([this, &operations, &ba, &branch_lengths, &buffers](
+                                  int node_id, int child0_id, int child1_id) {
+    const auto [buffer, is_cached] = partial_cache_->FindOrInsert(
+        {buffers[child0_id], branch_lengths[child0_id]},
+        {buffers[child1_id], branch_lengths[child1_id]});
+    buffers[node_id] = buffer;
+    if (!is_cached) {
+      operations.push_back({
+          buffer,  // destinationPartials
+          BEAGLE_OP_NONE, ba.destinationScaleRead_,
+          buffers[child0_id],  // child1Partials;
+          child0_id,           // child1TransitionMatrix;
+          buffers[child1_id],  // child2Partials;
+          child1_id            // child2TransitionMatrix;
+      });
+    }
+  });
+  return buffers[ba.root_id_];
+}
+
+FatBeagle::BatchSlot FatBeagle::BatchSlotOf(const BeagleAccessories &ba,
+                                            size_t position) const {
+  if (position == 0) {
+    return {ba.taxon_count_, 0, 0, 0};
+  }  // else
+  const int offset = static_cast<int>(position) - 1;
+  return {ba.taxon_count_,
+          batch_partial_base_ + offset * ba.internal_count_ - ba.taxon_count_,
+          batch_matrix_base_ + offset * (ba.node_count_ - 1),
+          batch_scale_base_ + offset * (ba.internal_count_ + 1)};
+}
+
+// With adaptive rescaling, we batch the trees whose topologies we don't know to need
+// rescaling, and then evaluate the rest, and any that underflow, one at a time.
+std::vector<double> FatBeagle::BatchLogLikelihood(
+    const std::vector<LikelihoodInput> &inputs) const {
+  if (rescaling_ || !adaptive_rescaling_) {
+    return BatchLogLikelihoodInternals(inputs);
+  }  // else
+  std::vector<LikelihoodInput> unscaled_inputs;
+  SizeVector unscaled_positions;
+  for (size_t position = 0; position < inputs.size(); position++) {
+    if (rescaled_topologies_.find(inputs[position].first) ==
+        rescaled_topologies_.end()) {
+      unscaled_inputs.push_back(inputs[position]);
+      unscaled_positions.push_back(position);
+    }
+  }
+  std::vector<double> log_likelihoods(inputs.size(), 0.);
+  const auto unscaled_log_likelihoods = BatchLogLikelihoodInternals(unscaled_inputs);
+  for (size_t i = 0; i < unscaled_positions.size(); i++) {
+    if (std::isfinite(unscaled_log_likelihoods[i])) {
+      log_likelihoods[unscaled_positions[i]] = unscaled_log_likelihoods[i];
+    } else {
+      rescaled_topologies_.insert(unscaled_inputs[i].first);
+    }
+  }
+  for (size_t position = 0; position < inputs.size(); position++) {
+    const auto &[topology, branch_lengths] = inputs[position];
+    if (rescaled_topologies_.find(topology) != rescaled_topologies_.end()) {
+      log_likelihoods[position] = LogLikelihoodInternals(topology, branch_lengths);
+    }
+  }
+  return log_likelihoods;
+}
+
+// We gather the transition matrix updates and the post-order operations of all of
+// the trees and send them to BEAGLE together. The root likelihoods still take one
+// call per tree, because beagleCalculateRootLogLikelihoods sums over the buffers it
+// is given.
+std::vector<double> FatBeagle::BatchLogLikelihoodInternals(
+    const std::vector<LikelihoodInput> &inputs) const {
+  Assert(inputs.size() <= tree_batch_size_,
+         "BatchLogLikelihood got more trees than the batch size.");
+  if (inputs.empty()) {
+    return {};
+  }  // else
+  ForgetIncrementalState();
+  auto &slots = scratch_.batch_slots_;
+  auto &matrix_indices = scratch_.matrix_indices_;
+  auto &branch_lengths = scratch_.branch_lengths_;
+  auto &operations = scratch_.operations_;
+  slots.clear();
+  matrix_indices.clear();
+  branch_lengths.clear();
+  operations.clear();
+  for (size_t position = 0; position < inputs.size(); position++) {
+    const auto &[topology, input_branch_lengths] = inputs[position];
+    BeagleAccessories ba(beagle_instance_, rescaling_, topology);
+    const auto slot = BatchSlotOf(ba, position);
+    slots.push_back(slot);
+    for (int node_id = 0; node_id < ba.node_count_ - 1; node_id++) {
+      matrix_indices.push_back(slot.MatrixIndex(node_id));
+      branch_lengths.push_back(input_branch_lengths[node_id]);
+    }
+    topology->BinaryIdPostOrder(
+        [&operations, &ba, &slot](int node_id, int child0_id, int child1_id) {
+          operations.push_back({
+              slot.PartialIndex(node_id),  // destinationPartials
+              ba.rescaling_ ? slot.ScaleWriteIndex(node_id) : BEAGLE_OP_NONE,
+              ba.destinationScaleRead_,
+              slot.PartialIndex(child0_id),  // child1Partials;
+              slot.MatrixIndex(child0_id),   // child1TransitionMatrix;
+              slot.PartialIndex(child1_id),  // child2Partials;
+              slot.MatrixIndex(child1_id)    // child2TransitionMatrix;
+          });
+        });
+  }
+  UpdateBeagleTransitionMatrices(matrix_indices.data(), branch_lengths.data(),
+                                 static_cast<int>(matrix_indices.size()), nullptr);
+  {
+    // The scale factors of each tree get accumulated separately below.
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::Partials);
+    beagleUpdatePartials(beagle_instance_, operations.data(),
+                         static_cast<int>(operations.size()), BEAGLE_OP_NONE);
+  }
+  std::vector<double> log_likelihoods(inputs.size(), 0.);
+  for (size_t position = 0; position < inputs.size(); position++) {
+    const BeagleAccessories ba(beagle_instance_, rescaling_, inputs[position].first);
+    const auto &slot = slots[position];
+    int cumulative_scale_index = BEAGLE_OP_NONE;
+    if (rescaling_) {
+      cumulative_scale_index = slot.cumulative_scale_index_;
+      auto &scale_indices = scratch_.scale_indices_;
+      scale_indices.resize(ba.internal_count_);
+      std::iota(scale_indices.begin(), scale_indices.end(), cumulative_scale_index + 1);
+      beagleResetScaleFactors(beagle_instance_, cumulative_scale_index);
+      beagleAccumulateScaleFactors(beagle_instance_, scale_indices.data(),
+                                   ba.internal_count_, cumulative_scale_index);
+    }
+    const int root_buffer = slot.PartialIndex(ba.root_id_);
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::RootLikelihoods);
+    beagleCalculateRootLogLikelihoods(
+        beagle_instance_, &root_buffer, ba.category_weight_index_.data(),
+        ba.state_frequency_index_.data(), &cumulative_scale_index,
+        ba.mysterious_count_, &log_likelihoods[position]);
+  }
+  return log_likelihoods;
+}
+
+FatBeagle::LikelihoodInput FatBeagle::LikelihoodInputOf(const UnrootedTree &tree) {
   auto detrifurcated_tree = tree.Detrifurcate();
-  return LogLikelihoodInternals(detrifurcated_tree.Topology(),
-                                detrifurcated_tree.BranchLengths());
+  return {detrifurcated_tree.Topology(), detrifurcated_tree.BranchLengths()};
 }
 
-double FatBeagle::LogLikelihood(const RootedTree &tree) const {
+FatBeagle::LikelihoodInput FatBeagle::LikelihoodInputOf(const RootedTree &tree) {
   std::vector<double> branch_lengths = tree.BranchLengths();
   for (size_t i = 0; i < tree.BranchLengths().size() - 1; i++) {
     branch_lengths[i] *= tree.rates_[i];
   }
-  return LogLikelihoodInternals(tree.Topology(), branch_lengths);
+  return {tree.Topology(), branch_lengths};
 }
 
-std::pair<double, std::vector<double>> FatBeagle::BranchGradientInternals(
-    const Node::NodePtr topology, const std::vector<double> &branch_lengths) const {
+double FatBeagle::LogLikelihood(const UnrootedTree &tree) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return LogLikelihoodInternals(topology, branch_lengths);
+}
+
+double FatBeagle::LogLikelihood(const RootedTree &tree) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return LogLikelihoodInternals(topology, branch_lengths);
+}
+
+double FatBeagle::LogLikelihood(const FlatTopology &topology,
+                                const std::vector<double> &branch_lengths) const {
+  Assert(topology.ChildrenOf(topology.RootId()).size() == 2,
+         "FatBeagle::LogLikelihood expects a bifurcating FlatTopology.");
+  ForgetIncrementalState();
   beagleResetScaleFactors(beagle_instance_, 0);
   BeagleAccessories ba(beagle_instance_, rescaling_, topology);
+  auto &operations = scratch_.operations_;
+  operations.clear();
+  topology.BinaryIdPostOrder(
+      [&operations, &ba](int node_id, int child0_id, int child1_id) {
+        AddLowerPartialOperation(operations, ba, node_id, child0_id, child1_id);
+      });
+  return LogLikelihoodOfOperations(ba, operations, ba.root_id_, branch_lengths);
+}
+
+double FatBeagle::IncrementalLogLikelihood(const UnrootedTree &tree) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return IncrementalLogLikelihoodInternals(topology, branch_lengths);
+}
+
+double FatBeagle::IncrementalLogLikelihood(const RootedTree &tree) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return IncrementalLogLikelihoodInternals(topology, branch_lengths);
+}
+
+// We use the same buffers as LogLikelihoodInternals without the partial cache. We
+// compare with the previous state and overwrite it as we go, so it isn't valid until
+// we are done, and if anything fails the next call starts from scratch.
+double FatBeagle::IncrementalLogLikelihoodInternals(
+    const Node::NodePtr topology, const std::vector<double> &branch_lengths) const {
+  const BeagleAccessories ba(beagle_instance_, rescaling_, topology);
+  auto &state = incremental_state_;
+  const bool have_previous =
+      state.valid_ && state.rescaling_ == rescaling_ &&
+      state.children_.size() == static_cast<size_t>(ba.node_count_);
+  state.valid_ = false;
+  if (!have_previous) {
+    state.rescaling_ = rescaling_;
+    state.children_.assign(ba.node_count_, {-1, -1});
+    state.branch_lengths_.assign(branch_lengths.begin(), branch_lengths.end());
+  }
+  // The root has no branch.
+  auto &branch_changed = scratch_.branch_changed_;
+  branch_changed.assign(ba.node_count_, false);
+  auto &matrix_indices = scratch_.matrix_indices_;
+  auto &matrix_branch_lengths = scratch_.branch_lengths_;
+  matrix_indices.clear();
+  matrix_branch_lengths.clear();
+  for (int node_id = 0; node_id < ba.node_count_ - 1; node_id++) {
+    if (!have_previous || state.branch_lengths_[node_id] != branch_lengths[node_id]) {
+      branch_changed[node_id] = true;
+      matrix_indices.push_back(node_id);
+      matrix_branch_lengths.push_back(branch_lengths[node_id]);
+      state.branch_lengths_[node_id] = branch_lengths[node_id];
+    }
+  }
+  // The partials of a node are stale if it has new children, or if the partials or
+  // the branch of either of its children changed.
+  auto &partials_changed = scratch_.partials_changed_;
+  partials_changed.assign(ba.node_count_, false);
+  auto &operations = scratch_.operations_;
+  operations.clear();
+  topology->BinaryIdPostOrder([&](int node_id, int child0_id, int child1_id) {
+    const std::pair<int, int> children = {child0_id, child1_id};
+    if (!have_previous || state.children_[node_id] != children ||
+        partials_changed[child0_id] || partials_changed[child1_id] ||
+        branch_changed[child0_id] || branch_changed[child1_id]) {
+      partials_changed[node_id] = true;
+      state.children_[node_id] = children;
+      AddLowerPartialOperation(operations, ba, node_id, child0_id, child1_id);
+    }
+  });
+  if (!matrix_indices.empty()) {
+    UpdateBeagleTransitionMatrices(matrix_indices.data(), matrix_branch_lengths.data(),
+                                   static_cast<int>(matrix_indices.size()), nullptr);
+  }
+  if (!operations.empty()) {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::Partials);
+    beagleUpdatePartials(beagle_instance_, operations.data(),
+                         static_cast<int>(operations.size()), BEAGLE_OP_NONE);
+  }
+  // The scale factors of the nodes that we didn't recompute are still in their
+  // buffers, so we accumulate them all again, which is cheap next to the partials.
+  int cumulative_scale_index = BEAGLE_OP_NONE;
+  if (rescaling_) {
+    cumulative_scale_index = ba.cumulative_scale_index_[0];
+    auto &scale_indices = scratch_.scale_indices_;
+    scale_indices.resize(ba.internal_count_);
+    std::iota(scale_indices.begin(), scale_indices.end(), cumulative_scale_index + 1);
+    beagleResetScaleFactors(beagle_instance_, cumulative_scale_index);
+    beagleAccumulateScaleFactors(beagle_instance_, scale_indices.data(),
+                                 ba.internal_count_, cumulative_scale_index);
+  }
+  double log_like = 0.;
+  {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::RootLikelihoods);
+    beagleCalculateRootLogLikelihoods(
+        beagle_instance_, &ba.root_id_, ba.category_weight_index_.data(),
+        ba.state_frequency_index_.data(), &cumulative_scale_index,
+        ba.mysterious_count_, &log_like);
+  }
+  incremental_partial_update_count_ = operations.size();
+  state.valid_ = true;
+  return log_like;
+}
+
+double FatBeagle::TimeLogLikelihood(const LikelihoodInput &input,
+                                    size_t evaluation_count) const {
+  Assert(evaluation_count > 0, "TimeLogLikelihood needs a positive evaluation count.");
+  const auto &[topology, branch_lengths] = input;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < evaluation_count; i++) {
+    LogLikelihoodInternals(topology, branch_lengths);
+  }
+  const std::chrono::duration<double> duration =
+      std::chrono::steady_clock::now() - start;
+  return duration.count() / static_cast<double>(evaluation_count);
+}
+
+double FatBeagle::BranchGradientInternals(
+    const Node::NodePtr topology, const std::vector<double> &branch_lengths,
+    EigenVectorXdRef gradient, std::optional<EigenVectorXdRef> hessian_diagonal,
+    const SizeVector *edge_ids) const {
+  return AdaptivelyRescaled(topology, [this, &topology, &branch_lengths, &gradient,
+                                       &hessian_diagonal, edge_ids]() {
+    return BranchGradientOfSchedule(topology, branch_lengths, gradient,
+                                    hessian_diagonal, edge_ids);
+  });
+}
+
+// The pre-order partial of a node needs that of its parent, so for the edges above
+// the nodes of edge_ids we need the pre-order partials of the nodes on the paths from
+// them to the root. We mark these by going through the pre-order operations
+// backwards, which visits every node before its parent.
+void FatBeagle::SelectEdges(const OperationSchedule &schedule,
+                            const SizeVector &edge_ids) const {
+  const auto &ba = schedule.ba_;
+  auto &needed = scratch_.partials_changed_;
+  needed.assign(ba.node_count_, false);
+  auto &edge_buffers = scratch_.buffers_;
+  auto &edge_pre_order_buffers = scratch_.matrix_indices_;
+  edge_buffers.clear();
+  edge_pre_order_buffers.clear();
+  for (const auto edge_id : edge_ids) {
+    if (edge_id >= static_cast<size_t>(ba.node_count_) ||
+        static_cast<int>(edge_id) == ba.root_id_) {
+      Failwith("Edge " + std::to_string(edge_id) +
+               " isn't the id of a node below the root.");
+    }
+    needed[edge_id] = true;
+    edge_buffers.push_back(static_cast<int>(edge_id));
+    edge_pre_order_buffers.push_back(static_cast<int>(edge_id) + ba.node_count_);
+  }
+  const auto &pre_order_operations = *schedule.pre_order_operations_;
+  for (auto op = pre_order_operations.rbegin(); op != pre_order_operations.rend();
+       ++op) {
+    if (needed[op->destinationPartials - ba.node_count_]) {
+      needed[op->child1Partials - ba.node_count_] = true;
+    }
+  }
+  auto &operations = scratch_.operations_;
+  operations.clear();
+  for (const auto &op : pre_order_operations) {
+    if (needed[op.destinationPartials - ba.node_count_]) {
+      operations.push_back(op);
+    }
+  }
+}
+
+double FatBeagle::BranchGradientOfSchedule(
+    const Node::NodePtr topology, const std::vector<double> &branch_lengths,
+    EigenVectorXdRef gradient, std::optional<EigenVectorXdRef> hessian_diagonal,
+    const SizeVector *edge_ids) const {
+  ForgetIncrementalState();
+  beagleResetScaleFactors(beagle_instance_, 0);
+  const auto &schedule = GetOperationSchedule(topology, true);
+  const auto &ba = schedule.ba_;
+  Assert(gradient.size() == ba.node_count_,
+         "The gradient output needs an entry for every node.");
+  // The edges that we differentiate along, by the post-order and pre-order buffers
+  // of the nodes below them.
+  const bool subset = edge_ids != nullptr;
+  if (subset) {
+    SelectEdges(schedule, *edge_ids);
+  }
+  const int edge_count =
+      subset ? static_cast<int>(edge_ids->size()) : ba.node_count_ - 1;
+  const int *edge_buffers = subset ? scratch_.buffers_.data() : node_indices_.data();
+  const int *edge_pre_order_buffers =
+      subset ? scratch_.matrix_indices_.data() : pre_order_node_indices_.data();
   UpdateBeagleTransitionMatrices(ba, branch_lengths, nullptr);
   SetRootPreorderPartialsToStateFrequencies(ba);
 
-  // Set differential matrix for each branch.
+  // Set differential matrix for each branch: Q scaled by the rate of each category,
+  // one category after another.
   size_t category_count = phylo_model_->GetSiteModel()->GetCategoryCount();
   const EigenVectorXd &rates = phylo_model_->GetSiteModel()->GetCategoryRates();
-  size_t state_count = phylo_model_->GetSubstitutionModel()->GetStateCount();
-  size_t matrix_dim = state_count * state_count;
-  EigenMatrixXd Q = phylo_model_->GetSubstitutionModel()->GetQMatrix();
-  Eigen::Map<Eigen::RowVectorXd> mapQ(Q.data(), Q.size());
-  EigenMatrixXd dQ = mapQ.replicate(category_count, 1);
+  const EigenMatrixXd &Q = phylo_model_->GetSubstitutionModel()->GetQMatrix();
+  const Eigen::Index matrix_dim = Q.size();
+  Eigen::Map<const Eigen::RowVectorXd> mapQ(Q.data(), matrix_dim);
+  auto &dQ = scratch_.differential_matrix_;
+  dQ.resize(1, category_count * matrix_dim);
   for (size_t k = 0; k < category_count; k++) {
-    dQ.block(0, k * matrix_dim, 1, matrix_dim) *= rates[k];
+    dQ.block(0, k * matrix_dim, 1, matrix_dim) = rates[k] * mapQ;
+  }
+  beagleSetDifferentialMatrix(beagle_instance_, derivative_matrix_indices_[0],
+                              dQ.data());
+  // The second derivative of exp(rQt) with respect to t is (rQ)^2 exp(rQt).
+  if (hessian_diagonal.has_value()) {
+    Assert(hessian_diagonal->size() == ba.node_count_,
+           "The Hessian diagonal output needs an entry for every node.");
+    const EigenMatrixXd Q2 = Q * Q;
+    Eigen::Map<const Eigen::RowVectorXd> mapQ2(Q2.data(), matrix_dim);
+    auto &d2Q = scratch_.second_differential_matrix_;
+    d2Q.resize(1, category_count * matrix_dim);
+    for (size_t k = 0; k < category_count; k++) {
+      d2Q.block(0, k * matrix_dim, 1, matrix_dim) = rates[k] * rates[k] * mapQ2;
+    }
+    beagleSetDifferentialMatrix(beagle_instance_,
+                                second_derivative_matrix_indices_[0], d2Q.data());
   }
-  int derivative_matrix_idx = ba.node_count_ - 1;
-  beagleSetDifferentialMatrix(beagle_instance_, derivative_matrix_idx, dQ.data());
-  const auto derivative_matrix_indices =
-      std::vector<int>(ba.node_count_ - 1, derivative_matrix_idx);
 
   // Calculate post-order partials
-  BeagleOperationVector operations;
-  topology->BinaryIdPostOrder(
-      [&operations, &ba](int node_id, int child0_id, int child1_id) {
-        AddLowerPartialOperation(operations, ba, node_id, child0_id, child1_id);
-      });
-  beagleUpdatePartials(beagle_instance_, operations.data(),
-                       static_cast<int>(operations.size()),
-                       ba.cumulative_scale_index_[0]);  // cumulative scale index
+  const auto &post_order_operations = schedule.post_order_operations_;
+  {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::Partials);
+    beagleUpdatePartials(beagle_instance_, post_order_operations.data(),
+                         static_cast<int>(post_order_operations.size()),
+                         ba.cumulative_scale_index_[0]);  // cumulative scale index
+  }
 
   // Calculate pre-order partials.
-  operations.clear();
-  topology->TripleIdPreOrderBifurcating(
-      [&operations, &ba](int node_id, int sister_id, int parent_id) {
-        if (node_id != ba.root_id_) {
-          AddUpperPartialOperation(operations, ba, node_id, sister_id, parent_id);
+  const auto &pre_order_operations =
+      subset ? scratch_.operations_ : *schedule.pre_order_operations_;
+  {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::PrePartials);
+    beagleUpdatePrePartials(beagle_instance_, pre_order_operations.data(),
+                            static_cast<int>(pre_order_operations.size()),
+                            BEAGLE_OP_NONE);  // cumulative scale index
+  }
+
+  // Actually compute the gradient. The root has no branch, so its entry stays zero,
+  // as do those of the edges that we don't differentiate along. The edges are in
+  // node id order unless we have a subset of them, in which case BEAGLE writes into
+  // our scratch vectors and we copy the results over.
+  gradient.setZero();
+  if (hessian_diagonal.has_value()) {
+    hessian_diagonal->setZero();
+  }
+  {
+    HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::EdgeDerivatives);
+    auto &derivatives = scratch_.edge_derivatives_;
+    auto &second_derivatives = scratch_.edge_second_derivatives_;
+    auto &squared_derivatives = scratch_.squared_derivatives_;
+    if (subset) {
+      derivatives.setZero(edge_count);
+      second_derivatives.setZero(edge_count);
+    }
+    if (hessian_diagonal.has_value()) {
+      squared_derivatives.setZero(edge_count);
+    }
+    beagleCalculateEdgeDerivatives(
+        beagle_instance_,
+        edge_buffers,                       // list of post order buffer indices
+        edge_pre_order_buffers,             // list of pre order buffer indices
+        derivative_matrix_indices_.data(),  // differential Q matrix indices
+        ba.category_weight_index_.data(),   // category weights indices
+        edge_count,                         // number of edges
+        nullptr,                            // derivative-per-site output array
+        subset ? derivatives.data()
+               : gradient.data(),  // sum of derivatives across sites output array
+        hessian_diagonal.has_value()
+            ? squared_derivatives.data()
+            : nullptr);  // sum of squared derivatives output array
+    if (hessian_diagonal.has_value()) {
+      // With the second differential matrices, the "derivatives" for each site are
+      // the ratios of the second derivatives of its likelihood to its likelihood, and
+      // the second derivative of its log likelihood is this ratio minus the square
+      // of the first derivative of its log likelihood.
+      beagleCalculateEdgeDerivatives(
+          beagle_instance_, edge_buffers, edge_pre_order_buffers,
+          second_derivative_matrix_indices_.data(), ba.category_weight_index_.data(),
+          edge_count, nullptr,
+          subset ? second_derivatives.data() : hessian_diagonal->data(), nullptr);
+      if (subset) {
+        second_derivatives -= squared_derivatives;
+      } else {
+        hessian_diagonal->head(edge_count) -= squared_derivatives;
+      }
+    }
+    if (subset) {
+      for (int i = 0; i < edge_count; i++) {
+        gradient((*edge_ids)[i]) = derivatives(i);
+        if (hessian_diagonal.has_value()) {
+          (*hessian_diagonal)((*edge_ids)[i]) = second_derivatives(i);
         }
-      });
-  beagleUpdatePrePartials(beagle_instance_, operations.data(),
-                          static_cast<int>(operations.size()),
-                          BEAGLE_OP_NONE);  // cumulative scale index
-
-  // Actually compute the gradient.
-  std::vector<double> gradient(ba.node_count_, 0.);
-  const auto pre_buffer_indices =
-      BeagleAccessories::IotaVector(ba.node_count_ - 1, ba.node_count_);
-  beagleCalculateEdgeDerivatives(
-      beagle_instance_,
-      ba.node_indices_.data(),           // list of post order buffer indices
-      pre_buffer_indices.data(),         // list of pre order buffer indices
-      derivative_matrix_indices.data(),  // differential Q matrix indices
-      ba.category_weight_index_.data(),  // category weights indices
-      ba.node_count_ - 1,                // number of edges
-      nullptr,                           // derivative-per-site output array
-      gradient.data(),                   // sum of derivatives across sites output array
-      nullptr);                          // sum of squared derivatives output array
+      }
+    }
+  }
 
   // Also calculate the likelihood.
   double log_like = 0.;
+  HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::RootLikelihoods);
   beagleCalculateRootLogLikelihoods(
       beagle_instance_, &ba.root_id_, ba.category_weight_index_.data(),
       ba.state_frequency_index_.data(), ba.cumulative_scale_index_.data(),
       ba.mysterious_count_, &log_like);
-  return {log_like, gradient};
+  return log_like;
 }
 
 FatBeagle *NullPtrAssert(FatBeagle *fat_beagle) {
@@ -173,20 +767,70 @@ RootedTreeGradient FatBeagle::StaticRootedGradient(FatBeagle *fat_beagle,
   return NullPtrAssert(fat_beagle)->Gradient(in_tree);
 }
 
-std::pair<FatBeagle::BeagleInstance, FatBeagle::PackedBeagleFlags>
-FatBeagle::CreateInstance(const SitePattern &site_pattern,
-                          FatBeagle::PackedBeagleFlags beagle_preference_flags) {
-  int taxon_count = static_cast<int>(site_pattern.SequenceCount());
+FatBeagle::BufferCounts FatBeagle::BufferCountsOf(size_t taxon_count,
+                                                 bool use_tip_states,
+                                                 size_t partial_cache_capacity,
+                                                 size_t tree_batch_size) {
+  const int taxa = static_cast<int>(taxon_count);
+  const int node_count = 2 * taxa - 1;
+  const int internal_count = taxa - 1;
+  BufferCounts counts;
   // Number of partial buffers to create (input):
   // taxon_count - 1 for lower partials (internal nodes only)
   // 2*taxon_count - 1 for upper partials (every node)
-  int partials_buffer_count = 3 * taxon_count - 2;
-  if (!use_tip_states_) {
-    partials_buffer_count += taxon_count;
+  counts.partials_ = 3 * taxa - 2;
+  if (!use_tip_states) {
+    counts.partials_ += taxa;
   }
+  // Plus the buffers for the partial cache.
+  counts.partials_ += static_cast<int>(partial_cache_capacity);
   // Number of compact state representation buffers to create -- for use with
   // setTipStates (input)
-  int compact_buffer_count = (use_tip_states_ ? taxon_count : 0);
+  counts.compact_ = (use_tip_states ? taxa : 0);
+  // Number of transition matrix buffers (input) -- two per edge
+  counts.matrices_ = 2 * node_count;
+  // Number of scaling buffers -- 1 buffer per partial buffer and 1 more
+  // for accumulating scale factors in position 0.
+  counts.scales_ = counts.partials_ + 1;
+  // Each tree of a batch after the first needs its own internal partials, one
+  // transition matrix per edge, and internal_count + 1 scaling buffers. We place
+  // these after all of the above. Partial buffer indices also count the compact
+  // buffers.
+  const int extra_tree_count = static_cast<int>(tree_batch_size) - 1;
+  counts.batch_partial_base_ = counts.partials_ + counts.compact_;
+  counts.batch_matrix_base_ = counts.matrices_;
+  counts.batch_scale_base_ = counts.scales_;
+  counts.partials_ += extra_tree_count * internal_count;
+  counts.matrices_ += extra_tree_count * (node_count - 1);
+  counts.scales_ += extra_tree_count * (internal_count + 1);
+  return counts;
+}
+
+size_t FatBeagle::BufferByteCountOf(const BufferCounts &buffer_counts,
+                                    size_t pattern_count, size_t state_count,
+                                    size_t category_count, bool single_precision) {
+  const size_t scalar_size = single_precision ? sizeof(float) : sizeof(double);
+  const auto count = [](int n) { return static_cast<size_t>(n); };
+  const size_t site_count = pattern_count * category_count;
+  return scalar_size *
+             (count(buffer_counts.partials_) * site_count * state_count +
+              count(buffer_counts.matrices_) * category_count * state_count *
+                  state_count +
+              count(buffer_counts.scales_) * pattern_count) +
+         sizeof(int) * count(buffer_counts.compact_) * pattern_count;
+}
+
+std::pair<FatBeagle::BeagleInstance, FatBeagle::PackedBeagleFlags>
+FatBeagle::CreateInstance(const SitePattern &site_pattern,
+                          FatBeagle::PackedBeagleFlags beagle_preference_flags,
+                          size_t partial_cache_capacity) {
+  int taxon_count = static_cast<int>(site_pattern.SequenceCount());
+  const auto buffer_counts = BufferCountsOf(site_pattern.SequenceCount(),
+                                            use_tip_states_, partial_cache_capacity,
+                                            tree_batch_size_);
+  batch_partial_base_ = buffer_counts.batch_partial_base_;
+  batch_matrix_base_ = buffer_counts.batch_matrix_base_;
+  batch_scale_base_ = buffer_counts.batch_scale_base_;
   // The number of states.
   int state_count =
       static_cast<int>(phylo_model_->GetSubstitutionModel()->GetStateCount());
@@ -194,14 +838,9 @@ FatBeagle::CreateInstance(const SitePattern &site_pattern,
   int pattern_count = pattern_count_;
   // Number of eigen-decomposition buffers to allocate (input)
   int eigen_buffer_count = 1;
-  // Number of transition matrix buffers (input) -- two per edge
-  int matrix_buffer_count = 2 * (2 * taxon_count - 1);
   // Number of rate categories
   int category_count =
       static_cast<int>(phylo_model_->GetSiteModel()->GetCategoryCount());
-  // Number of scaling buffers -- 1 buffer per partial buffer and 1 more
-  // for accumulating scale factors in position 0.
-  int scale_buffer_count = partials_buffer_count + 1;
   // List of potential resources on which this instance is allowed (input,
   // NULL implies no restriction
   int *allowed_resources = nullptr;
@@ -214,20 +853,30 @@ FatBeagle::CreateInstance(const SitePattern &site_pattern,
 
   BeagleInstanceDetails return_info;
   auto beagle_instance = beagleCreateInstance(
-      taxon_count, partials_buffer_count, compact_buffer_count, state_count,
-      pattern_count, eigen_buffer_count, matrix_buffer_count, category_count,
-      scale_buffer_count, allowed_resources, resource_count, beagle_preference_flags,
-      requirement_flags, &return_info);
+      taxon_count, buffer_counts.partials_, buffer_counts.compact_, state_count,
+      pattern_count, eigen_buffer_count, buffer_counts.matrices_, category_count,
+      buffer_counts.scales_, allowed_resources, resource_count,
+      beagle_preference_flags, requirement_flags, &return_info);
+  if (beagle_instance < 0) {
+    Failwith("BEAGLE couldn't make an instance with the requested flags.");
+  }  // else
   if (return_info.flags & (BEAGLE_FLAG_PROCESSOR_CPU | BEAGLE_FLAG_PROCESSOR_GPU)) {
+    buffer_byte_count_ = BufferByteCountOf(
+        buffer_counts, static_cast<size_t>(pattern_count),
+        static_cast<size_t>(state_count), static_cast<size_t>(category_count),
+        (return_info.flags & BEAGLE_FLAG_PRECISION_SINGLE) != 0);
     return {beagle_instance, return_info.flags};
   }  // else
   Failwith("Couldn't get a CPU or a GPU from BEAGLE.");
 }
 
 void FatBeagle::SetTipStates(const SitePattern &site_pattern) {
+  // BEAGLE copies the states, so we can unpack each sequence into the same buffer.
+  SymbolVector states;
   int taxon_number = 0;
-  for (const auto &pattern : site_pattern.GetPatterns()) {
-    beagleSetTipStates(beagle_instance_, taxon_number++, pattern.data());
+  for (const auto &pattern : site_pattern.GetPackedPatterns()) {
+    pattern.Unpack(states);
+    beagleSetTipStates(beagle_instance_, taxon_number++, states.data());
   }
   beagleSetPatternWeights(beagle_instance_, site_pattern.GetWeights().data());
 }
@@ -260,6 +909,10 @@ void FatBeagle::UpdateSubstitutionModelInBeagle() {
                               0,  // eigenIndex
                               &eigenvectors.data()[0], &inverse_eigenvectors.data()[0],
                               &eigenvalues.data()[0]);
+  if (transition_matrix_kernel_ != nullptr) {
+    transition_matrix_kernel_ =
+        std::make_unique<TransitionMatrixKernel>(*substitution_model);
+  }
 }
 
 void FatBeagle::UpdatePhyloModelInBeagle() {
@@ -273,13 +926,46 @@ void FatBeagle::UpdatePhyloModelInBeagle() {
 void FatBeagle::UpdateBeagleTransitionMatrices(
     const BeagleAccessories &ba, const std::vector<double> &branch_lengths,
     const int *const gradient_indices_ptr) const {
-  beagleUpdateTransitionMatrices(beagle_instance_,         // instance
-                                 0,                        // eigenIndex
-                                 ba.node_indices_.data(),  // probabilityIndices
-                                 gradient_indices_ptr,     // firstDerivativeIndices
-                                 nullptr,                  // secondDerivativeIndices
-                                 branch_lengths.data(),    // edgeLengths
-                                 ba.node_count_ - 1);      // count
+  UpdateBeagleTransitionMatrices(node_indices_.data(), branch_lengths.data(),
+                                 ba.node_count_ - 1, gradient_indices_ptr);
+}
+
+// On the host, we compute the matrices for all of the edges and rate categories in
+// one pass and upload them with one call. The padded value fills the extra column
+// that BEAGLE uses for gaps when it has tip states, which has probability one.
+void FatBeagle::UpdateBeagleTransitionMatrices(
+    const int *matrix_indices, const double *branch_lengths, int count,
+    const int *const gradient_indices_ptr) const {
+  HotPathProfile::PhaseScope timer(ActiveProfile(), HotPathProfile::TransitionMatrices);
+  if (transition_matrix_kernel_ == nullptr) {
+    beagleUpdateTransitionMatrices(beagle_instance_,      // instance
+                                   0,                     // eigenIndex
+                                   matrix_indices,        // probabilityIndices
+                                   gradient_indices_ptr,  // firstDerivativeIndices
+                                   nullptr,               // secondDerivativeIndices
+                                   branch_lengths,        // edgeLengths
+                                   count);                // count
+    return;
+  }  // else
+  const EigenVectorXd &rates = phylo_model_->GetSiteModel()->GetCategoryRates();
+  const size_t buffer_size = rates.size() * transition_matrix_kernel_->MatrixSize();
+  auto &matrices = scratch_.matrices_;
+  auto &derivatives = scratch_.derivatives_;
+  auto &gap_values = scratch_.gap_values_;
+  matrices.resize(count * buffer_size);
+  derivatives.resize(gradient_indices_ptr == nullptr ? 0 : matrices.size());
+  transition_matrix_kernel_->Compute(
+      branch_lengths, count, rates, matrices.data(),
+      gradient_indices_ptr == nullptr ? nullptr : derivatives.data());
+  gap_values.assign(count, 1.);
+  beagleSetTransitionMatrices(beagle_instance_, matrix_indices, matrices.data(),
+                              gap_values.data(), count);
+  if (gradient_indices_ptr != nullptr) {
+    // The derivatives of the gap column are zero.
+    gap_values.assign(count, 0.);
+    beagleSetTransitionMatrices(beagle_instance_, gradient_indices_ptr,
+                                derivatives.data(), gap_values.data(), count);
+  }
 }
 
 void FatBeagle::SetRootPreorderPartialsToStateFrequencies(
@@ -287,8 +973,8 @@ void FatBeagle::SetRootPreorderPartialsToStateFrequencies(
   const EigenVectorXd &frequencies =
       phylo_model_->GetSubstitutionModel()->GetFrequencies();
   size_t category_count = phylo_model_->GetSiteModel()->GetCategoryCount();
-  EigenVectorXd state_frequencies =
-      frequencies.replicate(pattern_count_ * category_count, 1);
+  auto &state_frequencies = scratch_.state_frequencies_;
+  state_frequencies = frequencies.replicate(pattern_count_ * category_count, 1);
   beagleSetPartials(beagle_instance_, ba.root_id_ + ba.node_count_,
                     state_frequencies.data());
 }
@@ -330,194 +1016,76 @@ void FatBeagle::AddUpperPartialOperation(BeagleOperationVector &operations,
   });
 }
 
-// Calculation of the substitution rate gradient.
-// \partial{L}/\partial{r_i} = \partial{L}/\partial{b_i} \partial{b_i}/\partial{r_i}
-// For strict clock:
-// \partial{L}/\partial{r} = \sum_i \partial{L}/\partial{r_i}
-std::vector<double> ClockGradient(const RootedTree &tree,
-                                  const std::vector<double> &branch_gradient) {
-  int root_id = static_cast<int>(tree.Topology()->Id());
-  std::vector<double> rate_gradient(root_id, 0);
-  for (size_t i = 0; i < root_id; i++) {
-    rate_gradient[i] = branch_gradient[i] * tree.branch_lengths_[i];
-  }
-
-  // Strict clock.
-  if (tree.rate_count_ == 1) {
-    return {std::accumulate(rate_gradient.cbegin(), rate_gradient.cend(), 0.0)};
-  }
-  // One rate per branch.
-  else if (tree.rate_count_ == tree.rates_.size()) {
-    return rate_gradient;
-  } else {
-    Failwith(
-        "The number of rates should be equal to 1 (i.e. strict clock) or equal to "
-        "the number of branches.");
-  }
+double FatBeagle::BranchGradient(const UnrootedTree &in_tree,
+                                 EigenVectorXdRef branch_gradient) const {
+  auto tree = in_tree.Detrifurcate();
+  tree.SlideRootPosition();
+  const double log_likelihood =
+      BranchGradientInternals(tree.Topology(), tree.BranchLengths(), branch_gradient);
+  // We want the fixed node to have a zero gradient.
+  branch_gradient(tree.Topology()->Children()[1]->Id()) = 0.;
+  return log_likelihood;
 }
 
-// Calculation of the ratio and root height gradient is adpated from BEAST.
-// https://github.com/beast-dev/beast-mcmc
-// Credit to Xiang Ji and Marc Suchard.
-
-// \partial{L}/\partial{t_k} = \sum_j \partial{L}/\partial{b_j}
-// \partial{b_j}/\partial{t_k}
-std::vector<double> HeightGradient(const RootedTree &tree,
-                                   const std::vector<double> &branch_gradient) {
-  int root_id = static_cast<int>(tree.Topology()->Id());
-  std::vector<double> height_gradient(tree.LeafCount() - 1, 0);
-
-  tree.Topology()->BinaryIdPreOrder(
-      [&root_id, &branch_gradient, &height_gradient, leaf_count = tree.LeafCount(),
-       &rates = tree.rates_](int node_id, int child0_id, int child1_id) {
-        if (node_id != root_id) {
-          height_gradient[node_id - leaf_count] =
-              -branch_gradient[node_id] * rates[node_id];
-        }
-        if (node_id >= leaf_count) {
-          height_gradient[node_id - leaf_count] +=
-              branch_gradient[child0_id] * rates[child0_id];
-          height_gradient[node_id - leaf_count] +=
-              branch_gradient[child1_id] * rates[child1_id];
-        }
-      });
-  return height_gradient;
-}
-
-double GetNodePartial(size_t node_id, size_t leaf_count,
-                      const std::vector<double> &heights,
-                      const std::vector<double> &ratios,
-                      const std::vector<double> &bounds) {
-  return (heights[node_id] - bounds[node_id]) / ratios[node_id - leaf_count];
-}
-
-// Calculate \partial{t_j}/\partial{r_k}
-double GetEpochGradientAddition(
-    size_t node_id, size_t child_id, size_t leaf_count,
-    const std::vector<double> &heights, const std::vector<double> &ratios,
-    const std::vector<double> &bounds,
-    const std::vector<double> &ratiosGradientUnweightedLogDensity) {
-  if (child_id < leaf_count) {
-    return 0.0;
-  } else if (bounds[node_id] == bounds[child_id]) {
-    // child_id and node_id are in the same epoch
-    return ratiosGradientUnweightedLogDensity[child_id - leaf_count] *
-           ratios[child_id - leaf_count] / ratios[node_id - leaf_count];
-  } else {
-    // NOT the same epoch
-    return ratiosGradientUnweightedLogDensity[child_id - leaf_count] *
-           ratios[child_id - leaf_count] / (heights[node_id] - bounds[child_id]) *
-           GetNodePartial(node_id, leaf_count, heights, ratios, bounds);
-  }
-}
-
-std::vector<double> GetLogTimeArray(const RootedTree &tree) {
-  size_t leaf_count = tree.LeafCount();
-  std::vector<double> log_time(leaf_count - 1, 0);
-  for (size_t i = 0; i < leaf_count - 2; i++) {
-    log_time[i] =
-        1.0 / (tree.node_heights_[leaf_count + i] - tree.node_bounds_[leaf_count + i]);
-  }
-  return log_time;
-}
-
-// Update ratio gradient with \partial{t_j}/\partial{r_k}
-std::vector<double> UpdateGradientUnWeightedLogDensity(
-    const RootedTree &tree, const std::vector<double> &gradient_height) {
-  size_t leaf_count = tree.LeafCount();
-  size_t root_id = tree.Topology()->Id();
-  std::vector<double> ratiosGradientUnweightedLogDensity(leaf_count - 1);
-  tree.Topology()->BinaryIdPostOrder(
-      [&gradient_height, &heights = tree.node_heights_, &ratios = tree.height_ratios_,
-       &bounds = tree.node_bounds_, &ratiosGradientUnweightedLogDensity, &leaf_count,
-       &root_id](int node_id, int child0_id, int child1_id) {
-        if (node_id >= leaf_count && node_id != root_id) {
-          ratiosGradientUnweightedLogDensity[node_id - leaf_count] +=
-              GetNodePartial(node_id, leaf_count, heights, ratios, bounds) *
-              gradient_height[node_id - leaf_count];
-          ratiosGradientUnweightedLogDensity[node_id - leaf_count] +=
-              GetEpochGradientAddition(node_id, child0_id, leaf_count, heights, ratios,
-                                       bounds, ratiosGradientUnweightedLogDensity);
-          ratiosGradientUnweightedLogDensity[node_id - leaf_count] +=
-              GetEpochGradientAddition(node_id, child1_id, leaf_count, heights, ratios,
-                                       bounds, ratiosGradientUnweightedLogDensity);
-        }
-      });
-  return ratiosGradientUnweightedLogDensity;
+double FatBeagle::BranchGradient(const RootedTree &tree,
+                                 EigenVectorXdRef branch_gradient) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return BranchGradientInternals(topology, branch_lengths, branch_gradient);
 }
 
-double UpdateHeightParameterGradientUnweightedLogDensity(
-    const RootedTree &tree, const std::vector<double> &gradient) {
-  size_t leaf_count = tree.LeafCount();
-  size_t root_id = tree.Topology()->Id();
-
-  std::vector<double> multiplierArray(leaf_count - 1);
-  multiplierArray[root_id - leaf_count] = 1.0;
-
-  tree.Topology()->BinaryIdPreOrder(
-      [&leaf_count, &ratios = tree.height_ratios_, &multiplierArray](
-          int node_id, int child0_id, int child1_id) {
-        if (child0_id >= leaf_count) {
-          double ratio = ratios[child0_id - leaf_count];
-          multiplierArray[child0_id - leaf_count] =
-              ratio * multiplierArray[node_id - leaf_count];
-        }
-        if (child1_id >= leaf_count) {
-          double ratio = ratios[child1_id - leaf_count];
-          multiplierArray[child1_id - leaf_count] =
-              ratio * multiplierArray[node_id - leaf_count];
-        }
-      });
-  double sum = 0.0;
-  for (int i = 0; i < gradient.size(); i++) {
-    sum += gradient[i] * multiplierArray[i];
-  }
-
-  return sum;
+double FatBeagle::BranchGradientAndHessianDiagonal(
+    const UnrootedTree &in_tree, EigenVectorXdRef branch_gradient,
+    EigenVectorXdRef branch_hessian_diagonal) const {
+  auto tree = in_tree.Detrifurcate();
+  tree.SlideRootPosition();
+  const double log_likelihood =
+      BranchGradientInternals(tree.Topology(), tree.BranchLengths(), branch_gradient,
+                              branch_hessian_diagonal);
+  const size_t fixed_node_id = tree.Topology()->Children()[1]->Id();
+  branch_gradient(fixed_node_id) = 0.;
+  branch_hessian_diagonal(fixed_node_id) = 0.;
+  return log_likelihood;
 }
 
-std::vector<double> RatioGradient(const RootedTree &tree,
-                                  const std::vector<double> &branch_gradient) {
-  size_t leaf_count = tree.LeafCount();
-  size_t root_id = tree.Topology()->Id();
-
-  // Calculate node height gradient
-  std::vector<double> height_gradient = HeightGradient(tree, branch_gradient);
-
-  // Calculate node ratio gradient
-  std::vector<double> gradientLogDensity =
-      UpdateGradientUnWeightedLogDensity(tree, height_gradient);
-
-  // Calculate root height gradient
-  gradientLogDensity[root_id - leaf_count] =
-      UpdateHeightParameterGradientUnweightedLogDensity(tree, height_gradient);
-
-  // Add gradient of log Jacobian determinant
-  std::vector<double> log_time = GetLogTimeArray(tree);
-
-  std::vector<double> gradientLogJacobianDeterminant =
-      UpdateGradientUnWeightedLogDensity(tree, log_time);
-  gradientLogJacobianDeterminant[root_id - leaf_count] =
-      UpdateHeightParameterGradientUnweightedLogDensity(tree, log_time);
+double FatBeagle::BranchGradientAndHessianDiagonal(
+    const RootedTree &tree, EigenVectorXdRef branch_gradient,
+    EigenVectorXdRef branch_hessian_diagonal) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return BranchGradientInternals(topology, branch_lengths, branch_gradient,
+                                 branch_hessian_diagonal);
+}
 
-  for (int i = 0; i < gradientLogDensity.size() - 1; i++) {
-    gradientLogDensity[i] +=
-        gradientLogJacobianDeterminant[i] - 1.0 / tree.height_ratios_[i];
+double FatBeagle::SubsetBranchGradient(
+    const UnrootedTree &in_tree, const SizeVector &edge_ids,
+    EigenVectorXdRef branch_gradient,
+    std::optional<EigenVectorXdRef> branch_hessian_diagonal) const {
+  auto tree = in_tree.Detrifurcate();
+  tree.SlideRootPosition();
+  const double log_likelihood =
+      BranchGradientInternals(tree.Topology(), tree.BranchLengths(), branch_gradient,
+                              branch_hessian_diagonal, &edge_ids);
+  const size_t fixed_node_id = tree.Topology()->Children()[1]->Id();
+  branch_gradient(fixed_node_id) = 0.;
+  if (branch_hessian_diagonal.has_value()) {
+    (*branch_hessian_diagonal)(fixed_node_id) = 0.;
   }
+  return log_likelihood;
+}
 
-  gradientLogDensity[root_id - leaf_count] +=
-      gradientLogJacobianDeterminant[root_id - leaf_count];
-
-  return gradientLogDensity;
+double FatBeagle::SubsetBranchGradient(
+    const RootedTree &tree, const SizeVector &edge_ids,
+    EigenVectorXdRef branch_gradient,
+    std::optional<EigenVectorXdRef> branch_hessian_diagonal) const {
+  const auto [topology, branch_lengths] = LikelihoodInputOf(tree);
+  return BranchGradientInternals(topology, branch_lengths, branch_gradient,
+                                 branch_hessian_diagonal, &edge_ids);
 }
 
 UnrootedTreeGradient FatBeagle::Gradient(const UnrootedTree &in_tree) const {
-  auto tree = in_tree.Detrifurcate();
-  tree.SlideRootPosition();
-  auto [log_likelihood, branch_length_gradient] =
-      BranchGradientInternals(tree.Topology(), tree.BranchLengths());
-  // We want the fixed node to have a zero gradient.
-  branch_length_gradient[tree.Topology()->Children()[1]->Id()] = 0.;
+  std::vector<double> branch_length_gradient(2 * in_tree.LeafCount() - 1);
+  Eigen::Map<EigenVectorXd> branch_length_gradient_map(branch_length_gradient.data(),
+                                                       branch_length_gradient.size());
+  const double log_likelihood = BranchGradient(in_tree, branch_length_gradient_map);
 
   std::vector<double> substitution_model_gradient;
   std::vector<double> site_model_gradient;
@@ -527,16 +1095,18 @@ UnrootedTreeGradient FatBeagle::Gradient(const UnrootedTree &in_tree) const {
 }
 
 RootedTreeGradient FatBeagle::Gradient(const RootedTree &tree) const {
-  // Scale time with clock rate.
-  std::vector<double> branch_lengths = tree.BranchLengths();
-  for (size_t i = 0; i < tree.BranchLengths().size() - 1; i++) {
-    branch_lengths[i] *= tree.rates_[i];
-  }
-
-  // Calculate branch length gradient and log likelihood.
-  auto [log_likelihood, branch_gradient] =
-      BranchGradientInternals(tree.Topology(), branch_lengths);
+  // Calculate branch length gradient (with time scaled by the clock rate) and log
+  // likelihood.
+  std::vector<double> branch_gradient(2 * tree.LeafCount() - 1);
+  Eigen::Map<EigenVectorXd> branch_gradient_map(branch_gradient.data(),
+                                                branch_gradient.size());
+  const double log_likelihood = BranchGradient(tree, branch_gradient_map);
+  return RootedGradientOf(tree, log_likelihood, branch_gradient);
+}
 
+RootedTreeGradient FatBeagle::RootedGradientOf(
+    const RootedTree &tree, double log_likelihood,
+    const std::vector<double> &branch_gradient) {
   std::vector<double> substitution_model_gradient;
   // Calculate substitution model parameter gradient, if needed.
   //    gradients["substmodel"] = SubstitutionModelGradient(tree, branch_gradient);
@@ -547,8 +1117,8 @@ RootedTreeGradient FatBeagle::Gradient(const RootedTree &tree) const {
 
   return {log_likelihood,
           branch_gradient,
-          RatioGradient(tree, branch_gradient),
-          ClockGradient(tree, branch_gradient),
+          RootedGradientTransforms::RatioGradient(tree, branch_gradient),
+          RootedGradientTransforms::ClockGradient(tree, branch_gradient),
           site_model_gradient,
           substitution_model_gradient};
 }
@@ -4,26 +4,60 @@
 #ifndef SRC_FAT_BEAGLE_HPP_
 #define SRC_FAT_BEAGLE_HPP_
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
-#include <queue>
+#include <optional>
+#include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include "beagle_accessories.hpp"
+#include "hot_path_profile.hpp"
+#include "operation_schedule_cache.hpp"
+#include "partial_cache.hpp"
 #include "phylo_model.hpp"
 #include "rooted_tree_collection.hpp"
 #include "site_pattern.hpp"
 #include "task_processor.hpp"
+#include "transition_matrix_kernel.hpp"
 #include "tree_gradient.hpp"
+#include "tree_scheduler.hpp"
 #include "unrooted_tree_collection.hpp"
 
 class FatBeagle {
  public:
   using PackedBeagleFlags = long;
+  // The topology and branch lengths that LogLikelihoodInternals works on.
+  using LikelihoodInput = std::pair<Node::NodePtr, std::vector<double>>;
+  // The numbers of buffers that a FatBeagle asks BEAGLE for. Partial buffer indices
+  // count the compact buffers, and the buffers of the trees of a batch after the
+  // first start at the batch bases.
+  struct BufferCounts {
+    int partials_;
+    int compact_;
+    int matrices_;
+    int scales_;
+    int batch_partial_base_;
+    int batch_matrix_base_;
+    int batch_scale_base_;
+  };
 
-  // This constructor makes the beagle_instance_;
+  // This constructor makes the beagle_instance_. If partial_cache_capacity is
+  // nonzero, we allocate that many extra partial buffers in which LogLikelihood
+  // caches the partials of subtrees so that they can be reused across trees.
+  // The instance holds the buffers for tree_batch_size trees, which is the most
+  // that BatchLogLikelihood can take at once. If operation_schedule_cache_capacity
+  // is nonzero, we remember the BEAGLE operations for that many topologies; see
+  // operation_schedule_cache.hpp. If host_transition_matrices is true, we compute
+  // the transition matrices ourselves with a TransitionMatrixKernel and upload them,
+  // rather than having BEAGLE exponentiate them edge by edge.
   FatBeagle(const PhyloModelSpecification &specification,
             const SitePattern &site_pattern,
-            const PackedBeagleFlags beagle_preference_flags, bool use_tip_states);
+            const PackedBeagleFlags beagle_preference_flags, bool use_tip_states,
+            size_t partial_cache_capacity = 0, size_t tree_batch_size = 1,
+            size_t operation_schedule_cache_capacity = 0,
+            bool host_transition_matrices = false);
   ~FatBeagle();
   // Delete (copy + move) x (constructor + assignment) because FatBeagle manages an
   // external resource (a BEAGLE instance).
@@ -33,17 +67,134 @@ class FatBeagle {
   FatBeagle &operator=(const FatBeagle &&) = delete;
 
   const BlockSpecification &GetPhyloModelBlockSpecification() const;
+  // Swap in the model of this specification, which needs to have the same numbers of
+  // states and rate categories as the current one so that it fits the BEAGLE
+  // instance. The parameters are uploaded again on the next SetParameters.
+  void SetPhyloModel(const PhyloModelSpecification &specification);
   const PackedBeagleFlags &GetBeagleFlags() const { return beagle_flags_; };
+  // Returns nullptr if we aren't using a partial cache.
+  const PartialCache *GetPartialCache() const { return partial_cache_.get(); }
+  // Returns nullptr if we aren't caching operation schedules.
+  const OperationScheduleCache *GetOperationScheduleCache() const {
+    return operation_schedule_cache_.get();
+  }
+  size_t GetTreeBatchSize() const { return tree_batch_size_; }
+  size_t GetPatternCount() const { return static_cast<size_t>(pattern_count_); }
+  // The number of bytes in the partial, tip state, transition matrix and scale
+  // buffers that we asked BEAGLE for.
+  size_t GetBufferByteCount() const { return buffer_byte_count_; }
+  bool UsesHostTransitionMatrices() const {
+    return transition_matrix_kernel_ != nullptr;
+  }
+  // When profiling is on, we time the calls to BEAGLE for each phase of the
+  // computation. Only switch profiling or read the profile while no computation is
+  // running on this FatBeagle.
+  void SetProfiling(bool profiling) { profiling_ = profiling; }
+  const HotPathProfile &GetProfile() const { return profile_; }
+  void ResetProfile() { profile_.Reset(); }
+  // The FatBeagle parallelizers record how long each FatBeagle takes for work of a
+  // given TreeScheduler::TreeCost, so that faster FatBeagles can be given more work.
+  void RecordWork(double cost, double seconds) {
+    worked_cost_ += cost;
+    worked_seconds_ += seconds;
+  }
+  // Cost per second over the work recorded so far, if any.
+  std::optional<double> GetThroughput() const {
+    if (worked_seconds_ <= 0.) {
+      return std::nullopt;
+    }  // else
+    return worked_cost_ / worked_seconds_;
+  }
 
+  // Set the phylogenetic model parameters. Only the components of the model whose
+  // parameters differ from the previous call are updated and uploaded to BEAGLE.
   void SetParameters(const EigenVectorXdRef param_vector);
-  void SetRescaling(const bool rescaling) { rescaling_ = rescaling; }
+  // Single precision partials underflow on all but the smallest trees, so a single
+  // precision FatBeagle always rescales.
+  void SetRescaling(const bool rescaling) {
+    rescaling_ = rescaling || IsSinglePrecision();
+  }
+  bool IsSinglePrecision() const {
+    return (beagle_flags_ & BEAGLE_FLAG_PRECISION_SINGLE) != 0;
+  }
+  // With adaptive rescaling, when rescaling is off we evaluate each tree without
+  // rescaling, and if its log likelihood isn't finite we evaluate it again with
+  // rescaling. We then remember its topology and always rescale it. Setting this
+  // forgets the topologies. The FlatTopology version of LogLikelihood doesn't do this.
+  void SetAdaptiveRescaling(const bool adaptive_rescaling) {
+    adaptive_rescaling_ = adaptive_rescaling;
+    rescaled_topologies_.clear();
+  }
+  // The number of topologies that adaptive rescaling has found to need rescaling.
+  size_t RescaledTopologyCount() const { return rescaled_topologies_.size(); }
 
   double LogLikelihood(const UnrootedTree &tree) const;
   double LogLikelihood(const RootedTree &tree) const;
+  // The log likelihood of a bifurcating topology from a FlatTopologyArena, with
+  // branch lengths indexed by node id as in a LikelihoodInput. This builds the
+  // operations straight from the flat topology, without the partial cache or the
+  // operation schedule cache.
+  double LogLikelihood(const FlatTopology &topology,
+                       const std::vector<double> &branch_lengths) const;
+  // Compute the log likelihoods of up to tree_batch_size trees, sharing one call to
+  // BEAGLE's transition matrix and partial updates between all of them. This
+  // doesn't use the partial cache.
+  std::vector<double> BatchLogLikelihood(
+      const std::vector<LikelihoodInput> &inputs) const;
+  // Compute the log likelihood of a tree, leaving its transition matrices and
+  // partials in BEAGLE. The next call only recomputes the matrices of the branches
+  // whose lengths changed, and the partials of the nodes that have new children or
+  // are above such a branch or node, matching nodes by id. So after changing a branch
+  // length or making a local topology move, this costs time proportional to the
+  // depth of the tree rather than its size. Any other computation on this FatBeagle,
+  // and any change of model, parameters or rescaling, makes the next call start from
+  // scratch. This doesn't use the partial cache or adaptive rescaling.
+  double IncrementalLogLikelihood(const UnrootedTree &tree) const;
+  double IncrementalLogLikelihood(const RootedTree &tree) const;
+  // The number of partials that the last IncrementalLogLikelihood recomputed.
+  size_t IncrementalPartialUpdateCount() const {
+    return incremental_partial_update_count_;
+  }
+  // Evaluate the log likelihood of input evaluation_count times and return the mean
+  // number of seconds per evaluation. Engine::AutoTune uses this to compare BEAGLE
+  // configurations.
+  double TimeLogLikelihood(const LikelihoodInput &input,
+                           size_t evaluation_count) const;
   // Compute first derivative of the log likelihood with respect to each branch
   // length, as a vector of first derivatives indexed by node id.
   UnrootedTreeGradient Gradient(const UnrootedTree &tree) const;
   RootedTreeGradient Gradient(const RootedTree &tree) const;
+  // Write the first derivatives of the log likelihood with respect to each branch
+  // length into branch_gradient, which needs one entry per node id, and return the
+  // log likelihood. For rooted trees these are the derivatives with respect to the
+  // branch lengths after scaling by the clock rates.
+  double BranchGradient(const UnrootedTree &tree,
+                        EigenVectorXdRef branch_gradient) const;
+  double BranchGradient(const RootedTree &tree, EigenVectorXdRef branch_gradient) const;
+  // BranchGradient, also writing the second derivatives of the log likelihood with
+  // respect to each branch length (the diagonal of its Hessian) into
+  // branch_hessian_diagonal, which also needs one entry per node id. These come from
+  // the same pre-order and post-order partials as the first derivatives.
+  double BranchGradientAndHessianDiagonal(
+      const UnrootedTree &tree, EigenVectorXdRef branch_gradient,
+      EigenVectorXdRef branch_hessian_diagonal) const;
+  double BranchGradientAndHessianDiagonal(
+      const RootedTree &tree, EigenVectorXdRef branch_gradient,
+      EigenVectorXdRef branch_hessian_diagonal) const;
+  // BranchGradient, or BranchGradientAndHessianDiagonal if branch_hessian_diagonal is
+  // given, for only the branches above the nodes of edge_ids. We compute the
+  // pre-order partials of just the nodes on the paths from these nodes to the root
+  // and the derivatives along just these branches, so for a handful of branches this
+  // costs little more than a log likelihood. The other entries of the outputs are
+  // zero.
+  double SubsetBranchGradient(
+      const UnrootedTree &tree, const SizeVector &edge_ids,
+      EigenVectorXdRef branch_gradient,
+      std::optional<EigenVectorXdRef> branch_hessian_diagonal = std::nullopt) const;
+  double SubsetBranchGradient(
+      const RootedTree &tree, const SizeVector &edge_ids,
+      EigenVectorXdRef branch_gradient,
+      std::optional<EigenVectorXdRef> branch_hessian_diagonal = std::nullopt) const;
 
   // We can pass these static methods to FatBeagleParallelize.
   static double StaticUnrootedLogLikelihood(FatBeagle *fat_beagle,
@@ -55,36 +206,210 @@ class FatBeagle {
   static RootedTreeGradient StaticRootedGradient(FatBeagle *fat_beagle,
                                                  const RootedTree &in_tree);
 
+  // The buffers of a FatBeagle with these settings, and how many bytes BEAGLE
+  // allocates for them. Engine::EstimateByteCounts uses these to size an Engine
+  // before making it.
+  static BufferCounts BufferCountsOf(size_t taxon_count, bool use_tip_states,
+                                     size_t partial_cache_capacity,
+                                     size_t tree_batch_size);
+  static size_t BufferByteCountOf(const BufferCounts &buffer_counts,
+                                  size_t pattern_count, size_t state_count,
+                                  size_t category_count, bool single_precision);
+
+  static LikelihoodInput LikelihoodInputOf(const UnrootedTree &tree);
+  static LikelihoodInput LikelihoodInputOf(const RootedTree &tree);
+  // Assemble the gradient of a rooted tree from the log likelihood and the
+  // derivatives with respect to each (rate-scaled) branch length.
+  static RootedTreeGradient RootedGradientOf(
+      const RootedTree &tree, double log_likelihood,
+      const std::vector<double> &branch_gradient);
+
  private:
   using BeagleInstance = int;
   using BeagleOperationVector = std::vector<BeagleOperation>;
 
   std::unique_ptr<PhyloModel> phylo_model_;
-  bool rescaling_;
+  // This is mutable so that adaptive rescaling can switch it on for a tree.
+  mutable bool rescaling_;
+  bool adaptive_rescaling_ = false;
+  // The topologies that adaptive rescaling rescales.
+  mutable std::unordered_set<Node::NodePtr> rescaled_topologies_;
   BeagleInstance beagle_instance_;
   PackedBeagleFlags beagle_flags_;
   int pattern_count_;
   bool use_tip_states_;
+  size_t buffer_byte_count_ = 0;
+  // The parameters most recently passed to SetParameters, which are the ones
+  // currently uploaded to BEAGLE. Empty before the first call.
+  EigenVectorXd uploaded_parameters_;
+  // The cache of subtree partials, which is valid for uploaded_parameters_.
+  std::unique_ptr<PartialCache> partial_cache_;
+  std::unique_ptr<OperationScheduleCache> operation_schedule_cache_;
+  // Null unless we compute the transition matrices on the host. This is rebuilt
+  // whenever the substitution model changes.
+  std::unique_ptr<TransitionMatrixKernel> transition_matrix_kernel_;
+  size_t tree_batch_size_;
+  // Trees after the first in a batch get their own internal partial buffers,
+  // transition matrices, and scale buffers, starting at these indices. See
+  // BatchSlot.
+  int batch_partial_base_;
+  int batch_matrix_base_;
+  int batch_scale_base_;
+  bool profiling_ = false;
+  // The likelihood methods are const, but they add to the profile.
+  mutable HotPathProfile profile_;
+  // See RecordWork.
+  double worked_cost_ = 0.;
+  double worked_seconds_ = 0.;
+
+  // What IncrementalLogLikelihood left in BEAGLE, if valid_: the children of each
+  // internal node id, with {-1, -1} for the leaves, and the branch lengths. We update
+  // this in place so that it doesn't allocate.
+  struct IncrementalState {
+    bool valid_ = false;
+    bool rescaling_ = false;
+    std::vector<std::pair<int, int>> children_;
+    std::vector<double> branch_lengths_;
+  };
+  mutable IncrementalState incremental_state_;
+  mutable size_t incremental_partial_update_count_ = 0;
+
+  // The buffer indices used by the tree in a given position of a batch. The tree in
+  // position 0 uses the same buffers as LogLikelihood, and all trees share the tip
+  // buffers.
+  struct BatchSlot {
+    const int taxon_count_;
+    const int partial_base_;
+    const int matrix_base_;
+    const int cumulative_scale_index_;
+
+    int PartialIndex(int node_id) const {
+      return node_id < taxon_count_ ? node_id : partial_base_ + node_id;
+    }
+    int MatrixIndex(int node_id) const { return matrix_base_ + node_id; }
+    int ScaleWriteIndex(int node_id) const {
+      return cumulative_scale_index_ + 1 + node_id - taxon_count_;
+    }
+  };
+  BatchSlot BatchSlotOf(const BeagleAccessories &ba, size_t position) const;
+
+  // The post-order buffer indices 0, ..., node_count - 2, which are also the indices
+  // of the transition matrices of the branches, the corresponding pre-order buffer
+  // indices, and the indices of the first and second differential matrices for each
+  // branch.
+  std::vector<int> node_indices_;
+  std::vector<int> pre_order_node_indices_;
+  std::vector<int> derivative_matrix_indices_;
+  std::vector<int> second_derivative_matrix_indices_;
+  // Buffers that the likelihood and gradient methods reuse from call to call rather
+  // than allocating, so that once they have grown to fit, the hot path doesn't touch
+  // the heap. Each method clears the ones it uses before filling them. A FatBeagle is
+  // only used by one thread at a time, so these are in effect thread-local.
+  struct Scratch {
+    // The schedule that GetOperationSchedule builds when we don't cache schedules,
+    // and the pre-order operations of the one before it.
+    std::optional<OperationSchedule> schedule_;
+    BeagleOperationVector pre_order_operations_;
+    BeagleOperationVector operations_;
+    std::vector<int> buffers_;
+    std::vector<BatchSlot> batch_slots_;
+    std::vector<int> matrix_indices_;
+    std::vector<double> branch_lengths_;
+    std::vector<int> scale_indices_;
+    std::vector<bool> branch_changed_;
+    std::vector<bool> partials_changed_;
+    EigenVectorXd state_frequencies_;
+    EigenMatrixXd differential_matrix_;
+    EigenMatrixXd second_differential_matrix_;
+    EigenVectorXd squared_derivatives_;
+    EigenVectorXd edge_derivatives_;
+    EigenVectorXd edge_second_derivatives_;
+    std::vector<double> matrices_;
+    std::vector<double> derivatives_;
+    std::vector<double> gap_values_;
+  };
+  mutable Scratch scratch_;
 
   std::pair<BeagleInstance, PackedBeagleFlags> CreateInstance(
-      const SitePattern &site_pattern, PackedBeagleFlags beagle_preference_flags);
+      const SitePattern &site_pattern, PackedBeagleFlags beagle_preference_flags,
+      size_t partial_cache_capacity);
   void SetTipStates(const SitePattern &site_pattern);
   void SetTipPartials(const SitePattern &site_pattern);
   void UpdateSiteModelInBeagle();
   void UpdateSubstitutionModelInBeagle();
   void UpdatePhyloModelInBeagle();
+  // Does the segment of param_vector for the given model component differ from
+  // that of uploaded_parameters_?
+  bool ParameterSegmentChanged(const EigenVectorXdRef param_vector,
+                               const std::string &key);
 
+  HotPathProfile *ActiveProfile() const { return profiling_ ? &profile_ : nullptr; }
+
+  // Return evaluate(), which computes the log likelihood of topology, rescaling as
+  // adaptive rescaling says; see SetAdaptiveRescaling.
+  template <typename TEvaluate>
+  double AdaptivelyRescaled(const Node::NodePtr &topology, TEvaluate evaluate) const;
   double LogLikelihoodInternals(const Node::NodePtr topology,
                                 const std::vector<double> &branch_lengths) const;
-  std::pair<double, std::vector<double>> BranchGradientInternals(
+  std::vector<double> BatchLogLikelihoodInternals(
+      const std::vector<LikelihoodInput> &inputs) const;
+  double IncrementalLogLikelihoodInternals(
       const Node::NodePtr topology, const std::vector<double> &branch_lengths) const;
+  // Computations other than IncrementalLogLikelihood overwrite the buffers that it
+  // keeps, so they call this.
+  void ForgetIncrementalState() const { incremental_state_.valid_ = false; }
+  double LogLikelihoodOfOperations(const BeagleAccessories &ba,
+                                   const BeagleOperationVector &operations,
+                                   int root_buffer,
+                                   const std::vector<double> &branch_lengths) const;
+  // Get the operations for a topology with the current rescaling setting, from the
+  // schedule cache if we have one and otherwise built in scratch_. If with_pre_order
+  // is true, the schedule also has its pre-order operations. The schedule is only
+  // good until the next call.
+  OperationSchedule &GetOperationSchedule(const Node::NodePtr topology,
+                                          bool with_pre_order) const;
+  // Rescaling factors are accumulated per likelihood computation, so we can only
+  // reuse cached partials when we aren't rescaling.
+  bool UsePartialCache() const { return partial_cache_ != nullptr && !rescaling_; }
+  // Add the post-order operations for the subtrees that aren't in the partial
+  // cache, and return the buffer holding the root partials.
+  int AddCachedLowerPartialOperations(BeagleOperationVector &operations,
+                                      const BeagleAccessories &ba,
+                                      const Node::NodePtr topology,
+                                      const std::vector<double> &branch_lengths) const;
+  // Returns the log likelihood. If hessian_diagonal is given, we also write the
+  // second derivatives with respect to each branch length into it. If edge_ids isn't
+  // null, we only differentiate along the branches above those nodes.
+  double BranchGradientInternals(
+      const Node::NodePtr topology, const std::vector<double> &branch_lengths,
+      EigenVectorXdRef gradient,
+      std::optional<EigenVectorXdRef> hessian_diagonal = std::nullopt,
+      const SizeVector *edge_ids = nullptr) const;
+  // BranchGradientInternals with the current rescaling setting.
+  double BranchGradientOfSchedule(const Node::NodePtr topology,
+                                  const std::vector<double> &branch_lengths,
+                                  EigenVectorXdRef gradient,
+                                  std::optional<EigenVectorXdRef> hessian_diagonal,
+                                  const SizeVector *edge_ids) const;
+  // Put the post-order and pre-order buffers of the nodes of edge_ids in
+  // scratch_.buffers_ and scratch_.matrix_indices_, and the pre-order operations that
+  // their pre-order partials need in scratch_.operations_.
+  void SelectEdges(const OperationSchedule &schedule, const SizeVector &edge_ids) const;
 
   void UpdateBeagleTransitionMatrices(
       const BeagleAccessories &baBranchGradientInternals,
       const std::vector<double> &branch_lengths,
       const int *const gradient_indices_ptr) const;
+  // Fill the count matrices of matrix_indices for the corresponding branch lengths,
+  // either with BEAGLE or with our transition_matrix_kernel_.
+  void UpdateBeagleTransitionMatrices(const int *matrix_indices,
+                                      const double *branch_lengths, int count,
+                                      const int *const gradient_indices_ptr) const;
   void SetRootPreorderPartialsToStateFrequencies(const BeagleAccessories &ba) const;
 
+  // Add the post-order operations of topology to those of schedule.
+  static void AddPostOrderOperations(OperationSchedule &schedule,
+                                     const Node::NodePtr topology);
   static inline void AddLowerPartialOperation(BeagleOperationVector &operations,
                                               const BeagleAccessories &ba, int node_id,
                                               int child0_id, int child1_id);
@@ -96,35 +421,231 @@ class FatBeagle {
       int sister_id);
 };
 
+// Run task on work items 0, ..., costs.size() - 1 using the FatBeagles of
+// thread_pool, dealing them out with TreeScheduler::Assign according to the measured
+// throughputs of the FatBeagles, and recording how long each work item took.
+template <typename Task>
+void FatBeagleScheduledRun(WorkStealingPool<FatBeagle *> &thread_pool,
+                           const std::vector<double> &costs,
+                           const SizeVector &group_keys, const Task &task) {
+  std::vector<std::optional<double>> throughputs;
+  for (size_t executor = 0; executor < thread_pool.ExecutorCount(); executor++) {
+    throughputs.push_back(thread_pool.GetExecutor(executor)->GetThroughput());
+  }
+  thread_pool.Run(
+      TreeScheduler::Assign(costs, group_keys, TreeScheduler::Speeds(throughputs)),
+      [&costs, &task](FatBeagle *fat_beagle, size_t work) {
+        const auto start_time = HotPathProfile::Clock::now();
+        task(fat_beagle, work);
+        const std::chrono::duration<double> duration =
+            HotPathProfile::Clock::now() - start_time;
+        fat_beagle->RecordWork(costs[work], duration.count());
+      });
+}
+
+// The TreeScheduler costs and topology hashes of the trees of tree_collection.
+template <typename TTreeCollection>
+void FatBeagleTreeCosts(WorkStealingPool<FatBeagle *> &thread_pool,
+                        const TTreeCollection &tree_collection,
+                        std::vector<double> &costs, SizeVector &hashes) {
+  const size_t pattern_count = thread_pool.GetExecutor(0)->GetPatternCount();
+  for (size_t tree_number = 0; tree_number < tree_collection.TreeCount();
+       tree_number++) {
+    const auto &topology = tree_collection.GetTree(tree_number).Topology();
+    costs.push_back(TreeScheduler::TreeCost(topology, pattern_count));
+    hashes.push_back(topology->Hash());
+  }
+}
+
 template <typename TOut, typename TTree, typename TTreeCollection>
 std::vector<TOut> FatBeagleParallelize(
     std::function<TOut(FatBeagle *, const TTree &)> f,
-    const std::vector<std::unique_ptr<FatBeagle>> &fat_beagles,
-    const TTreeCollection &tree_collection, EigenMatrixXdRef param_matrix,
-    const bool rescaling) {
-  if (fat_beagles.empty()) {
+    WorkStealingPool<FatBeagle *> &thread_pool, const TTreeCollection &tree_collection,
+    EigenMatrixXdRef param_matrix, const bool rescaling) {
+  if (thread_pool.ExecutorCount() == 0) {
     Failwith("Please add some FatBeagles that can be used for computation.");
   }
   std::vector<TOut> results(tree_collection.TreeCount());
-  std::queue<FatBeagle *> fat_beagle_queue;
-  for (const auto &fat_beagle : fat_beagles) {
-    Assert(fat_beagle != nullptr, "Got a fat_beagle nullptr!");
-    fat_beagle_queue.push(fat_beagle.get());
+  Assert(tree_collection.TreeCount() == param_matrix.rows(),
+         "We param_matrix needs as many rows as we have trees.");
+  std::vector<double> costs;
+  SizeVector hashes;
+  FatBeagleTreeCosts(thread_pool, tree_collection, costs, hashes);
+  FatBeagleScheduledRun(thread_pool, costs, hashes,
+                        [&results, &tree_collection, &param_matrix, &rescaling, &f](
+                            FatBeagle *fat_beagle, size_t tree_number) {
+                          fat_beagle->SetParameters(param_matrix.row(tree_number));
+                          fat_beagle->SetRescaling(rescaling);
+                          results[tree_number] =
+                              f(fat_beagle, tree_collection.GetTree(tree_number));
+                        });
+  return results;
+}
+
+// Compute the log likelihoods of trees begin, ..., end - 1 of tree_collection on one
+// FatBeagle, writing them into the corresponding entries of results. If the
+// FatBeagle takes batches of trees, we split the range into batches, and further
+// into runs of trees that have the same phylogenetic model parameters.
+template <typename TTreeCollection>
+void FatBeagleLogLikelihoods(FatBeagle *fat_beagle,
+                             const TTreeCollection &tree_collection,
+                             EigenMatrixXdRef param_matrix, const bool rescaling,
+                             size_t begin, size_t end, EigenVectorXdRef results) {
+  fat_beagle->SetRescaling(rescaling);
+  if (fat_beagle->GetTreeBatchSize() == 1) {
+    for (size_t tree_number = begin; tree_number < end; tree_number++) {
+      fat_beagle->SetParameters(param_matrix.row(tree_number));
+      results(tree_number) =
+          fat_beagle->LogLikelihood(tree_collection.GetTree(tree_number));
+    }
+    return;
+  }  // else
+  size_t run_start = begin;
+  while (run_start < end) {
+    const size_t batch_end = std::min(end, run_start + fat_beagle->GetTreeBatchSize());
+    size_t run_end = run_start + 1;
+    while (run_end < batch_end &&
+           param_matrix.row(run_end) == param_matrix.row(run_start)) {
+      run_end++;
+    }
+    std::vector<FatBeagle::LikelihoodInput> inputs;
+    for (size_t tree_number = run_start; tree_number < run_end; tree_number++) {
+      inputs.push_back(
+          FatBeagle::LikelihoodInputOf(tree_collection.GetTree(tree_number)));
+    }
+    fat_beagle->SetParameters(param_matrix.row(run_start));
+    const auto log_likelihoods = fat_beagle->BatchLogLikelihood(inputs);
+    for (size_t i = 0; i < log_likelihoods.size(); i++) {
+      results(run_start + i) = log_likelihoods[i];
+    }
+    run_start = run_end;
   }
-  std::queue<size_t> tree_number_queue;
-  for (size_t i = 0; i < tree_collection.TreeCount(); i++) {
-    tree_number_queue.push(i);
+}
+
+// Compute the log likelihoods of all of the trees, writing them into results. Each
+// thread takes batches of batch_size consecutive trees; see FatBeagleLogLikelihoods.
+// A batch costs as much as its trees together, and batches with the same sequence
+// of topologies are kept together.
+template <typename TTreeCollection>
+void FatBeagleBatchParallelize(WorkStealingPool<FatBeagle *> &thread_pool,
+                               const TTreeCollection &tree_collection,
+                               EigenMatrixXdRef param_matrix, const bool rescaling,
+                               const size_t batch_size, EigenVectorXdRef results) {
+  if (thread_pool.ExecutorCount() == 0) {
+    Failwith("Please add some FatBeagles that can be used for computation.");
   }
-  Assert(tree_collection.TreeCount() == param_matrix.rows(),
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(tree_count == param_matrix.rows(),
          "We param_matrix needs as many rows as we have trees.");
-  TaskProcessor<FatBeagle *, size_t> task_processor(
-      std::move(fat_beagle_queue), std::move(tree_number_queue),
-      [&results, &tree_collection, &param_matrix, &rescaling, &f](FatBeagle *fat_beagle,
-                                                                  size_t tree_number) {
-        fat_beagle->SetParameters(param_matrix.row(tree_number));
-        fat_beagle->SetRescaling(rescaling);
-        results[tree_number] = f(fat_beagle, tree_collection.GetTree(tree_number));
+  Assert(tree_count == results.size(), "We need a result slot for every tree.");
+  std::vector<double> tree_costs;
+  SizeVector tree_hashes;
+  FatBeagleTreeCosts(thread_pool, tree_collection, tree_costs, tree_hashes);
+  const size_t batch_count = (tree_count + batch_size - 1) / batch_size;
+  std::vector<double> costs(batch_count, 0.);
+  SizeVector hashes(batch_count, 0);
+  for (size_t tree_number = 0; tree_number < tree_count; tree_number++) {
+    auto &hash = hashes[tree_number / batch_size];
+    costs[tree_number / batch_size] += tree_costs[tree_number];
+    // As in boost::hash_combine.
+    hash ^= tree_hashes[tree_number] + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+  FatBeagleScheduledRun(
+      thread_pool, costs, hashes,
+      [&results, &tree_collection, &param_matrix, &rescaling, tree_count, batch_size](
+          FatBeagle *fat_beagle, size_t batch_number) {
+        FatBeagleLogLikelihoods(fat_beagle, tree_collection, param_matrix, rescaling,
+                                batch_number * batch_size,
+                                std::min(tree_count, (batch_number + 1) * batch_size),
+                                results);
       });
+}
+
+// Compute the log likelihoods and branch length gradients of trees begin, ...,
+// end - 1 of tree_collection on one FatBeagle, writing them into the corresponding
+// entries of log_likelihoods and rows of branch_gradients. If
+// branch_hessian_diagonals is given, we also write the second derivatives with
+// respect to the branch lengths into its rows. If edge_ids isn't null, we only
+// differentiate along the branches above those nodes; see SubsetBranchGradient.
+template <typename TTreeCollection>
+void FatBeagleBranchGradients(
+    FatBeagle *fat_beagle, const TTreeCollection &tree_collection,
+    EigenMatrixXdRef param_matrix, const bool rescaling, size_t begin, size_t end,
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    std::optional<EigenMatrixXdRef> branch_hessian_diagonals = std::nullopt,
+    const SizeVector *edge_ids = nullptr) {
+  fat_beagle->SetRescaling(rescaling);
+  for (size_t tree_number = begin; tree_number < end; tree_number++) {
+    fat_beagle->SetParameters(param_matrix.row(tree_number));
+    const auto &tree = tree_collection.GetTree(tree_number);
+    if (edge_ids != nullptr) {
+      log_likelihoods(tree_number) = fat_beagle->SubsetBranchGradient(
+          tree, *edge_ids, branch_gradients.row(tree_number),
+          branch_hessian_diagonals.has_value()
+              ? std::optional<EigenVectorXdRef>(
+                    branch_hessian_diagonals->row(tree_number))
+              : std::nullopt);
+    } else if (branch_hessian_diagonals.has_value()) {
+      log_likelihoods(tree_number) = fat_beagle->BranchGradientAndHessianDiagonal(
+          tree, branch_gradients.row(tree_number),
+          branch_hessian_diagonals->row(tree_number));
+    } else {
+      log_likelihoods(tree_number) =
+          fat_beagle->BranchGradient(tree, branch_gradients.row(tree_number));
+    }
+  }
+}
+
+// Compute the log likelihoods and branch length gradients of all of the trees, and
+// the second derivatives if branch_hessian_diagonals is given, along the branches of
+// edge_ids if that isn't null. The row of branch_gradients for a tree is laid out
+// like the branch_lengths_ of its TreeGradient, and so are those of
+// branch_hessian_diagonals.
+template <typename TTreeCollection>
+void FatBeagleBranchGradientParallelize(
+    WorkStealingPool<FatBeagle *> &thread_pool, const TTreeCollection &tree_collection,
+    EigenMatrixXdRef param_matrix, const bool rescaling,
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    std::optional<EigenMatrixXdRef> branch_hessian_diagonals = std::nullopt,
+    const SizeVector *edge_ids = nullptr) {
+  if (thread_pool.ExecutorCount() == 0) {
+    Failwith("Please add some FatBeagles that can be used for computation.");
+  }
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(tree_count == param_matrix.rows(),
+         "We param_matrix needs as many rows as we have trees.");
+  Assert(tree_count == log_likelihoods.size() && tree_count == branch_gradients.rows(),
+         "We need a result slot for every tree.");
+  Assert(!branch_hessian_diagonals.has_value() ||
+             (branch_hessian_diagonals->rows() == branch_gradients.rows() &&
+              branch_hessian_diagonals->cols() == branch_gradients.cols()),
+         "The Hessian diagonals need the shape of the branch gradients.");
+  std::vector<double> costs;
+  SizeVector hashes;
+  FatBeagleTreeCosts(thread_pool, tree_collection, costs, hashes);
+  FatBeagleScheduledRun(
+      thread_pool, costs, hashes,
+      [&tree_collection, &param_matrix, &rescaling, &log_likelihoods,
+       &branch_gradients, &branch_hessian_diagonals,
+       edge_ids](FatBeagle *fat_beagle, size_t tree_number) {
+        FatBeagleBranchGradients(fat_beagle, tree_collection, param_matrix, rescaling,
+                                 tree_number, tree_number + 1, log_likelihoods,
+                                 branch_gradients, branch_hessian_diagonals, edge_ids);
+      });
+}
+
+// When the FatBeagles of a thread pool each hold a different block of the site
+// patterns, every one of them has to see every tree. Here work item i runs f on the
+// i-th FatBeagle of the pool, and the result is the vector of outputs of f indexed
+// by FatBeagle.
+template <typename TOut>
+std::vector<TOut> FatBeagleShardParallelize(
+    std::function<TOut(FatBeagle *)> f, WorkStealingPool<FatBeagle *> &thread_pool) {
+  std::vector<TOut> results(thread_pool.ExecutorCount());
+  thread_pool.Run(thread_pool.ExecutorCount(),
+                  [&results, &f, &thread_pool](FatBeagle *, size_t shard_number) {
+                    results[shard_number] = f(thread_pool.GetExecutor(shard_number));
+                  });
   return results;
 }
 
@@ -0,0 +1,251 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A hash map with open addressing, for the lookup-heavy maps keyed by bitsets.
+//
+// The entries live contiguously in a vector in insertion order, so iteration is a
+// linear scan. The lookup table is a separate power-of-two array of slots, each of
+// which holds the index of an entry along with the entry's precomputed hash.
+// Probing is linear, and compares hashes before comparing keys, so a lookup
+// typically touches one cache line of slots and then the one entry it wants.
+//
+// The interface follows the part of std::unordered_map that we use. There is no
+// erase, because we build these maps once and then only query them.
+
+#ifndef SRC_FLAT_HASH_MAP_HPP_
+#define SRC_FLAT_HASH_MAP_HPP_
+
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "sugar.hpp"
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>>
+class FlatHashMap {
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<Key, T>;
+  using iterator = typename std::vector<value_type>::iterator;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+  FlatHashMap() = default;
+  FlatHashMap(std::initializer_list<value_type> init) {
+    reserve(init.size());
+    for (const auto &entry : init) {
+      insert(entry);
+    }
+  }
+
+  size_t size() const { return entries_.size(); }
+  // The number of bytes allocated for the entries and the lookup table, not counting
+  // anything that the keys and values allocate themselves.
+  size_t ByteCount() const {
+    return entries_.capacity() * sizeof(value_type) + slots_.capacity() * sizeof(Slot);
+  }
+  bool empty() const { return entries_.empty(); }
+  iterator begin() { return entries_.begin(); }
+  iterator end() { return entries_.end(); }
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+
+  void clear() {
+    entries_.clear();
+    slots_.clear();
+    slot_shift_ = 0;
+  }
+
+  // Make room for count entries without rehashing.
+  void reserve(size_t count) {
+    entries_.reserve(count);
+    size_t slot_count = minimum_slot_count_;
+    while (!LoadIsOk(count, slot_count)) {
+      slot_count *= 2;
+    }
+    if (slot_count > slots_.size()) {
+      Rehash(slot_count);
+    }
+  }
+
+  iterator find(const Key &key) {
+    const size_t entry_idx = FindEntry(key);
+    return entry_idx == empty_slot_ ? end() : begin() + entry_idx;
+  }
+  const_iterator find(const Key &key) const {
+    const size_t entry_idx = FindEntry(key);
+    return entry_idx == empty_slot_ ? end() : begin() + entry_idx;
+  }
+
+  size_t count(const Key &key) const { return FindEntry(key) == empty_slot_ ? 0 : 1; }
+
+  T &at(const Key &key) {
+    const size_t entry_idx = FindEntry(key);
+    if (entry_idx == empty_slot_) {
+      throw std::out_of_range("Key not found in FlatHashMap::at.");
+    }  // else
+    return entries_[entry_idx].second;
+  }
+  const T &at(const Key &key) const {
+    const size_t entry_idx = FindEntry(key);
+    if (entry_idx == empty_slot_) {
+      throw std::out_of_range("Key not found in FlatHashMap::at.");
+    }  // else
+    return entries_[entry_idx].second;
+  }
+
+  T &operator[](const Key &key) { return insert({key, T()}).first->second; }
+
+  // As for std::unordered_map, return an iterator to the entry with this key, and
+  // whether the insertion happened.
+  std::pair<iterator, bool> insert(value_type entry) {
+    if (!LoadIsOk(entries_.size() + 1, slots_.size())) {
+      Rehash(slots_.empty() ? minimum_slot_count_ : 2 * slots_.size());
+    }
+    const size_t hash = Hash{}(entry.first);
+    const size_t slot_idx = FindSlot(entry.first, hash);
+    Slot &slot = slots_[slot_idx];
+    if (slot.entry_idx_ != empty_slot_) {
+      return {begin() + slot.entry_idx_, false};
+    }  // else
+    slot = {hash, entries_.size()};
+    entries_.push_back(std::move(entry));
+    return {end() - 1, true};
+  }
+
+  bool operator==(const FlatHashMap &other) const {
+    if (size() != other.size()) {
+      return false;
+    }  // else
+    for (const auto &[key, value] : entries_) {
+      auto search = other.find(key);
+      if (search == other.end() || !(search->second == value)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator!=(const FlatHashMap &other) const { return !(*this == other); }
+
+ private:
+  struct Slot {
+    size_t hash_;
+    size_t entry_idx_;
+  };
+  static constexpr size_t empty_slot_ = std::numeric_limits<size_t>::max();
+  static constexpr size_t minimum_slot_count_ = 16;
+
+  std::vector<value_type> entries_;
+  std::vector<Slot> slots_;
+  // The number of bits to shift a mixed hash right by to get a slot index.
+  size_t slot_shift_ = 0;
+
+  // We keep the table at most 3/4 full so that probe sequences stay short.
+  static bool LoadIsOk(size_t entry_count, size_t slot_count) {
+    return 4 * entry_count <= 3 * slot_count;
+  }
+
+  // Fibonacci hashing spreads the hash over the table using its high bits, which
+  // protects us from hashes (such as std::hash<size_t>) that are poor in the low
+  // bits.
+  size_t HomeSlot(size_t hash) const {
+    return (hash * size_t(0x9e3779b97f4a7c15ULL)) >> slot_shift_;
+  }
+
+  // Find the slot holding key, or the empty slot where it would go.
+  size_t FindSlot(const Key &key, size_t hash) const {
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot_idx = HomeSlot(hash);; slot_idx = (slot_idx + 1) & mask) {
+      const Slot &slot = slots_[slot_idx];
+      if (slot.entry_idx_ == empty_slot_ ||
+          (slot.hash_ == hash && KeyEqual{}(entries_[slot.entry_idx_].first, key))) {
+        return slot_idx;
+      }
+    }
+  }
+
+  size_t FindEntry(const Key &key) const {
+    if (slots_.empty()) {
+      return empty_slot_;
+    }  // else
+    return slots_[FindSlot(key, Hash{}(key))].entry_idx_;
+  }
+
+  void Rehash(size_t slot_count) {
+    slots_.assign(slot_count, {0, empty_slot_});
+    slot_shift_ = 64;
+    for (size_t count = slot_count; count > 1; count /= 2) {
+      slot_shift_--;
+    }
+    const size_t mask = slot_count - 1;
+    for (size_t entry_idx = 0; entry_idx < entries_.size(); entry_idx++) {
+      const size_t hash = Hash{}(entries_[entry_idx].first);
+      size_t slot_idx = HomeSlot(hash);
+      while (slots_[slot_idx].entry_idx_ != empty_slot_) {
+        slot_idx = (slot_idx + 1) & mask;
+      }
+      slots_[slot_idx] = {hash, entry_idx};
+    }
+  }
+};
+
+template <class Key, class T, class Hash>
+void SafeInsert(FlatHashMap<Key, T, Hash> &map, const Key &k, const T &v) {
+  Assert(map.insert({k, v}).second, "Failed map insertion!");
+}
+
+template <class Key, class T, class Hash>
+T AtWithDefault(const FlatHashMap<Key, T, Hash> &map, const Key &key,
+                T default_value) {
+  auto search = map.find(key);
+  if (search == map.end()) {
+    return default_value;
+  }
+  return search->second;
+}
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("FlatHashMap") {
+  FlatHashMap<size_t, size_t> map;
+  CHECK(map.empty());
+  CHECK_EQ(map.find(3), map.end());
+  CHECK_EQ(map.count(3), 0);
+  CHECK_THROWS_AS(map.at(3), std::out_of_range);
+  // Insert enough entries to force several rehashes.
+  const size_t entry_count = 1000;
+  for (size_t i = 0; i < entry_count; i++) {
+    SafeInsert(map, 7 * i, i);
+  }
+  CHECK_EQ(map.size(), entry_count);
+  CHECK_THROWS(SafeInsert(map, size_t(7), size_t(0)));
+  CHECK_EQ(map.insert({7, 0}).second, false);
+  for (size_t i = 0; i < entry_count; i++) {
+    CHECK_EQ(map.at(7 * i), i);
+    CHECK_EQ(map.count(7 * i + 1), 0);
+  }
+  CHECK_EQ(AtWithDefault(map, size_t(8), size_t(42)), 42);
+  // Iteration is in insertion order.
+  size_t expected = 0;
+  for (const auto &[key, value] : map) {
+    CHECK_EQ(key, 7 * expected);
+    CHECK_EQ(value, expected);
+    expected++;
+  }
+  map[1] = 5;
+  map[1]++;
+  CHECK_EQ(map.at(1), 6);
+  FlatHashMap<size_t, size_t> copy = map;
+  CHECK_EQ(copy, map);
+  copy[2] = 0;
+  CHECK_NE(copy, map);
+  map.clear();
+  CHECK(map.empty());
+  CHECK_EQ(map.count(7), 0);
+  CHECK_EQ((FlatHashMap<size_t, size_t>{{1, 2}, {3, 4}}).at(3), 4);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_FLAT_HASH_MAP_HPP_
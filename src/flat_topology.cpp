@@ -0,0 +1,176 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "flat_topology.hpp"
+#include <algorithm>
+#include <numeric>
+
+SizeVector FlatTopology::ParentIdVector() const {
+  SizeVector parent_ids(RootId());
+  for (size_t id = 0; id < RootId(); id++) {
+    parent_ids[id] = ParentId(id);
+  }
+  return parent_ids;
+}
+
+Node::NodePtr FlatTopology::ToNode() const {
+  return Node::OfParentIdVector(ParentIdVector());
+}
+
+FlatTopologyArena::FlatTopologyArena(const Node::NodePtrVec &topologies) {
+  extents_.reserve(topologies.size());
+  for (const auto &topology : topologies) {
+    PushBack(topology);
+  }
+}
+
+FlatTopology FlatTopologyArena::operator[](size_t topology_idx) const {
+  const Extent &extent = extents_.at(topology_idx);
+  return {nodes_.data() + extent.node_begin_, child_ids_.data() + extent.child_begin_,
+          leaf_words_.data() + extent.word_begin_, extent.node_count_,
+          extent.leaf_count_};
+}
+
+void FlatTopologyArena::Reserve(size_t topology_count, size_t node_count) {
+  extents_.reserve(topology_count);
+  nodes_.reserve(node_count);
+  // Every node but the roots is the child of one node.
+  child_ids_.reserve(node_count);
+}
+
+void FlatTopologyArena::clear() {
+  extents_.clear();
+  nodes_.clear();
+  child_ids_.clear();
+  leaf_words_.clear();
+}
+
+size_t FlatTopologyArena::PushBack(const Node::NodePtr &topology) {
+  // Number the nodes in level order, so that the children of each node are
+  // contiguous in the temporary numbering.
+  std::vector<const Node *> nodes = {topology.get()};
+  SizeVector child_offsets;
+  SizeVector children;
+  SizeVector leaf_ids;
+  for (size_t idx = 0; idx < nodes.size(); idx++) {
+    const Node *node = nodes[idx];
+    child_offsets.push_back(children.size());
+    leaf_ids.push_back(node->MaxLeafID());
+    for (const auto &child : node->Children()) {
+      children.push_back(nodes.size());
+      nodes.push_back(child.get());
+    }
+  }
+  child_offsets.push_back(children.size());
+  return AppendPolished(0, child_offsets, children, leaf_ids);
+}
+
+size_t FlatTopologyArena::PushBack(const SizeVector &parent_ids) {
+  // As for Node::OfParentIdVector, the root is the id after the last one.
+  const size_t node_count = parent_ids.size() + 1;
+  SizeVector child_offsets(node_count + 1, 0);
+  for (const auto parent_id : parent_ids) {
+    Assert(parent_id < node_count, "Parent id out of range in FlatTopologyArena.");
+    child_offsets[parent_id + 1]++;
+  }
+  for (size_t id = 0; id < node_count; id++) {
+    child_offsets[id + 1] += child_offsets[id];
+  }
+  SizeVector children(parent_ids.size());
+  SizeVector next_child(child_offsets.begin(), child_offsets.end() - 1);
+  for (size_t id = 0; id < parent_ids.size(); id++) {
+    children[next_child[parent_ids[id]]++] = id;
+  }
+  SizeVector leaf_ids(node_count);
+  std::iota(leaf_ids.begin(), leaf_ids.end(), 0);
+  return AppendPolished(parent_ids.size(), child_offsets, children, leaf_ids);
+}
+
+size_t FlatTopologyArena::AppendPolished(size_t root, const SizeVector &child_offsets,
+                                         SizeVector &children,
+                                         const SizeVector &leaf_ids) {
+  const size_t node_count = child_offsets.size() - 1;
+  const auto is_leaf = [&child_offsets](size_t node) {
+    return child_offsets[node] == child_offsets[node + 1];
+  };
+  // Visit the nodes in postorder, following the current order of the children.
+  const auto post_order = [&](auto f) {
+    std::vector<std::pair<size_t, size_t>> stack = {{root, child_offsets[root]}};
+    while (!stack.empty()) {
+      auto &[node, next_child] = stack.back();
+      if (next_child == child_offsets[node + 1]) {
+        f(node);
+        stack.pop_back();
+      } else {
+        const size_t child = children[next_child];
+        next_child++;
+        stack.push_back({child, child_offsets[child]});
+      }
+    }
+  };
+  // As in the Node constructor, order the children by their max leaf ids.
+  SizeVector max_leaf_ids(node_count);
+  post_order([&](size_t node) {
+    if (is_leaf(node)) {
+      max_leaf_ids[node] = leaf_ids[node];
+      return;
+    }  // else
+    const auto begin = children.begin() + child_offsets[node];
+    const auto end = children.begin() + child_offsets[node + 1];
+    std::sort(begin, end, [&max_leaf_ids](size_t lhs, size_t rhs) {
+      return max_leaf_ids[lhs] < max_leaf_ids[rhs];
+    });
+    max_leaf_ids[node] = max_leaf_ids[*(end - 1)];
+  });
+  // As in Node::Polish, the leaves get their leaf ids, and the internal nodes get
+  // the following ids in postorder.
+  const size_t leaf_count = max_leaf_ids[root] + 1;
+  SizeVector node_of_id(node_count, node_count);
+  SizeVector id_of_node(node_count);
+  size_t next_id = leaf_count;
+  post_order([&](size_t node) {
+    const size_t id = is_leaf(node) ? leaf_ids[node] : next_id++;
+    Assert(id < node_count && node_of_id[id] == node_count,
+           "FlatTopologyArena needs leaf ids that are contiguous from zero.");
+    node_of_id[id] = node;
+    id_of_node[node] = id;
+  });
+  Assert(next_id == node_count,
+         "FlatTopologyArena needs leaf ids that are contiguous from zero.");
+  Assert(node_count < FlatTopology::no_parent_,
+         "Topology too large for a FlatTopologyArena.");
+
+  const size_t words_per_node = Bitset::PackedWordCount(leaf_count);
+  const Extent extent{nodes_.size(), child_ids_.size(), leaf_words_.size(), node_count,
+                      leaf_count};
+  nodes_.resize(extent.node_begin_ + node_count);
+  leaf_words_.resize(extent.word_begin_ + node_count * words_per_node, 0);
+  NodeRecord *records = nodes_.data() + extent.node_begin_;
+  uint64_t *words = leaf_words_.data() + extent.word_begin_;
+  records[node_count - 1].parent_id_ = FlatTopology::no_parent_;
+  // The children of a node have smaller ids than it does, so going through the ids
+  // in order gets the leaf sets of the children before those of their parents.
+  for (size_t id = 0; id < node_count; id++) {
+    const size_t node = node_of_id[id];
+    NodeRecord &record = records[id];
+    record.child_begin_ = static_cast<NodeId>(child_ids_.size() - extent.child_begin_);
+    record.child_count_ =
+        static_cast<NodeId>(child_offsets[node + 1] - child_offsets[node]);
+    uint64_t *node_words = words + id * words_per_node;
+    if (record.child_count_ == 0) {
+      node_words[id / 64] |= uint64_t(1) << (id % 64);
+    }
+    for (size_t child_idx = child_offsets[node]; child_idx < child_offsets[node + 1];
+         child_idx++) {
+      const size_t child_id = id_of_node[children[child_idx]];
+      child_ids_.push_back(static_cast<NodeId>(child_id));
+      records[child_id].parent_id_ = static_cast<NodeId>(id);
+      const uint64_t *child_words = words + child_id * words_per_node;
+      for (size_t word_idx = 0; word_idx < words_per_node; word_idx++) {
+        node_words[word_idx] |= child_words[word_idx];
+      }
+    }
+  }
+  extents_.push_back(extent);
+  return extents_.size() - 1;
+}
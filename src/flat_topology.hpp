@@ -0,0 +1,288 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A compact representation of many tree topologies, as an alternative to trees of
+// shared_ptr Nodes.
+//
+// A FlatTopologyArena holds each topology as a run of node records in one vector,
+// the child ids of all of the nodes of all of the topologies in another, and the
+// leaf bitsets of all of the nodes packed into a slab of 64-bit words. So adding a
+// topology is a few appends, there is no reference counting, and the whole
+// collection is freed at once.
+//
+// The nodes of a topology are indexed by their ids, which are assigned just as in
+// Node::Polish: leaves get their leaf ids, children are ordered by their maximum
+// leaf id, and the internal nodes are numbered in postorder. The traversals visit
+// the nodes in the same order as the Node traversals of the same name, so code
+// written against node ids gives the same result on either representation.
+//
+// A FlatTopology is a lightweight view of one topology in an arena. It is
+// invalidated when the arena is modified.
+
+#ifndef SRC_FLAT_TOPOLOGY_HPP_
+#define SRC_FLAT_TOPOLOGY_HPP_
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "bitset.hpp"
+#include "node.hpp"
+#include "sugar.hpp"
+
+class FlatTopology {
+ public:
+  using NodeId = uint32_t;
+  static constexpr NodeId no_parent_ = std::numeric_limits<NodeId>::max();
+
+  struct NodeRecord {
+    NodeId parent_id_;
+    // The children of the node are at [child_begin_, child_begin_ + child_count_)
+    // in the child ids of the topology.
+    NodeId child_begin_;
+    NodeId child_count_;
+  };
+
+  // The child ids of a node, for use in range-based for loops.
+  class Children {
+   public:
+    Children(const NodeId *begin, const NodeId *end) : begin_(begin), end_(end) {}
+
+    const NodeId *begin() const { return begin_; }
+    const NodeId *end() const { return end_; }
+    size_t size() const { return static_cast<size_t>(end_ - begin_); }
+    NodeId operator[](size_t idx) const { return begin_[idx]; }
+
+   private:
+    const NodeId *begin_;
+    const NodeId *end_;
+  };
+
+  FlatTopology(const NodeRecord *nodes, const NodeId *child_ids,
+               const uint64_t *leaf_words, size_t node_count, size_t leaf_count)
+      : nodes_(nodes),
+        child_ids_(child_ids),
+        leaf_words_(leaf_words),
+        node_count_(node_count),
+        leaf_count_(leaf_count),
+        words_per_node_(Bitset::PackedWordCount(leaf_count)) {}
+
+  size_t NodeCount() const { return node_count_; }
+  size_t LeafCount() const { return leaf_count_; }
+  size_t RootId() const { return node_count_ - 1; }
+  bool IsLeaf(size_t id) const { return nodes_[id].child_count_ == 0; }
+  NodeId ParentId(size_t id) const { return nodes_[id].parent_id_; }
+  Children ChildrenOf(size_t id) const {
+    const NodeId *begin = child_ids_ + nodes_[id].child_begin_;
+    return {begin, begin + nodes_[id].child_count_};
+  }
+  Bitset Leaves(size_t id) const {
+    return Bitset::FromWords(leaf_count_, leaf_words_ + id * words_per_node_);
+  }
+
+  // The ith entry is the id of the parent of node i, as in Node::ParentIdVector.
+  SizeVector ParentIdVector() const;
+  // Build the equivalent Node tree.
+  Node::NodePtr ToNode() const;
+
+  // These take functions of node ids and visit the nodes in the same order as the
+  // Node traversals of the same name.
+  template <typename F>
+  void PreOrder(F f) const {
+    std::vector<NodeId> stack = {static_cast<NodeId>(RootId())};
+    while (!stack.empty()) {
+      const NodeId id = stack.back();
+      stack.pop_back();
+      f(id);
+      const auto children = ChildrenOf(id);
+      for (size_t child_idx = children.size(); child_idx > 0; child_idx--) {
+        stack.push_back(children[child_idx - 1]);
+      }
+    }
+  }
+  template <typename F>
+  void PostOrder(F f) const {
+    // Each entry is a node and the number of its children that we have visited.
+    std::vector<std::pair<NodeId, size_t>> stack = {
+        {static_cast<NodeId>(RootId()), 0}};
+    while (!stack.empty()) {
+      auto &[id, visited_count] = stack.back();
+      const auto children = ChildrenOf(id);
+      if (visited_count == children.size()) {
+        f(id);
+        stack.pop_back();
+      } else {
+        const NodeId child_id = children[visited_count];
+        visited_count++;
+        stack.push_back({child_id, 0});
+      }
+    }
+  }
+  // These take functions of (node_id, child0_id, child1_id), applied to the
+  // internal nodes of a bifurcating topology.
+  template <typename F>
+  void BinaryIdPreOrder(F f) const {
+    PreOrder([this, &f](NodeId id) { ApplyBinary(f, id); });
+  }
+  template <typename F>
+  void BinaryIdPostOrder(F f) const {
+    PostOrder([this, &f](NodeId id) { ApplyBinary(f, id); });
+  }
+  // Iterate f through (node_id, sister_id, parent_id) for a bifurcating topology, in
+  // the order of Node::TripleIdPreOrderBifurcating.
+  template <typename F>
+  void TripleIdPreOrderBifurcating(F f) const {
+    if (IsLeaf(RootId())) {
+      return;
+    }  // else
+    // Here we visit each node twice, once for each orientation.
+    std::vector<std::pair<NodeId, bool>> stack = {
+        {static_cast<NodeId>(RootId()), false}};
+    while (!stack.empty()) {
+      const auto [id, visited] = stack.back();
+      stack.pop_back();
+      const auto children = ChildrenOf(id);
+      Assert(children.size() == 2,
+             "TripleIdPreOrderBifurcating expects a bifurcating topology.");
+      const int node_id = static_cast<int>(id);
+      if (visited) {
+        f(static_cast<int>(children[1]), static_cast<int>(children[0]), node_id);
+        if (!IsLeaf(children[1])) {
+          stack.push_back({children[1], false});
+        }
+      } else {
+        f(static_cast<int>(children[0]), static_cast<int>(children[1]), node_id);
+        stack.push_back({id, true});
+        if (!IsLeaf(children[0])) {
+          stack.push_back({children[0], false});
+        }
+      }
+    }
+  }
+
+ private:
+  const NodeRecord *nodes_;
+  const NodeId *child_ids_;
+  const uint64_t *leaf_words_;
+  size_t node_count_;
+  size_t leaf_count_;
+  size_t words_per_node_;
+
+  template <typename F>
+  void ApplyBinary(F &f, NodeId id) const {
+    if (!IsLeaf(id)) {
+      const auto children = ChildrenOf(id);
+      Assert(children.size() == 2, "BinaryIdInfix expects a bifurcating tree.");
+      f(static_cast<int>(id), static_cast<int>(children[0]),
+        static_cast<int>(children[1]));
+    }
+  }
+};
+
+class FlatTopologyArena {
+ public:
+  FlatTopologyArena() = default;
+  explicit FlatTopologyArena(const Node::NodePtrVec &topologies);
+
+  size_t TopologyCount() const { return extents_.size(); }
+  FlatTopology operator[](size_t topology_idx) const;
+
+  // Make room for this many topologies with this many nodes in total.
+  void Reserve(size_t topology_count, size_t node_count);
+  void clear();
+
+  // Add a topology made of Nodes, assigning ids as Node::Polish does, so the
+  // topology doesn't need to have been polished. Returns the index of the new
+  // topology.
+  size_t PushBack(const Node::NodePtr &topology);
+  // Add a topology given as a parent id vector, as for Node::OfParentIdVector, and
+  // polish it. The ids of the internal nodes may change, just as they do when
+  // polishing the result of Node::OfParentIdVector.
+  size_t PushBack(const SizeVector &parent_ids);
+
+ private:
+  using NodeId = FlatTopology::NodeId;
+  using NodeRecord = FlatTopology::NodeRecord;
+
+  struct Extent {
+    size_t node_begin_;
+    size_t child_begin_;
+    size_t word_begin_;
+    size_t node_count_;
+    size_t leaf_count_;
+  };
+
+  std::vector<Extent> extents_;
+  std::vector<NodeRecord> nodes_;
+  std::vector<NodeId> child_ids_;
+  std::vector<uint64_t> leaf_words_;
+
+  // Polish and append a topology given by the children of each of its nodes under
+  // some temporary numbering, CSR-style: the children of node i are
+  // children[child_offsets[i]], ..., children[child_offsets[i + 1] - 1]. The leaves
+  // of the topology are the nodes without children, and are numbered by their
+  // leaf_ids entry.
+  size_t AppendPolished(size_t root, const SizeVector &child_offsets,
+                        SizeVector &children, const SizeVector &leaf_ids);
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("FlatTopology") {
+  auto topologies = Node::ExampleTopologies();
+  // ((((0,1)7,2)8,(3,4)9)10,5,6)11;
+  topologies.push_back(Node::OfParentIdVector({7, 7, 8, 9, 9, 11, 11, 8, 10, 10, 11}));
+  // A bifurcating tree whose ids change on polishing.
+  topologies.push_back(Node::OfParentIdVector({5, 6, 7, 7, 5, 6, 8, 8}));
+  topologies.push_back(Node::Ladder(6));
+  FlatTopologyArena arena(topologies);
+  FlatTopologyArena parent_id_arena;
+  for (auto &topology : topologies) {
+    topology->Polish();
+    parent_id_arena.PushBack(topology->ParentIdVector());
+  }
+  CHECK_EQ(arena.TopologyCount(), topologies.size());
+  using IdVector = std::vector<size_t>;
+  using TripleVector = std::vector<std::array<int, 3>>;
+  for (size_t idx = 0; idx < topologies.size(); idx++) {
+    const auto &topology = topologies[idx];
+    for (const auto flat : {arena[idx], parent_id_arena[idx]}) {
+      CHECK_EQ(flat.NodeCount(), topology->Id() + 1);
+      CHECK_EQ(flat.LeafCount(), topology->LeafCount());
+      CHECK_EQ(flat.ParentIdVector(), topology->ParentIdVector());
+      CHECK_EQ(flat.ToNode(), topology);
+      IdVector node_pre_order, flat_pre_order, node_post_order, flat_post_order;
+      topology->PreOrder([&](const Node *node) {
+        node_pre_order.push_back(node->Id());
+        CHECK_EQ(flat.Leaves(node->Id()), node->Leaves());
+        CHECK_EQ(flat.IsLeaf(node->Id()), node->IsLeaf());
+      });
+      flat.PreOrder([&](size_t id) { flat_pre_order.push_back(id); });
+      topology->PostOrder(
+          [&](const Node *node) { node_post_order.push_back(node->Id()); });
+      flat.PostOrder([&](size_t id) { flat_post_order.push_back(id); });
+      CHECK_EQ(flat_pre_order, node_pre_order);
+      CHECK_EQ(flat_post_order, node_post_order);
+      if (topology->Children().size() != 2) {
+        continue;
+      }
+      // The binary traversals need a bifurcating topology.
+      const auto collector = [](TripleVector &triples) {
+        return [&triples](int a, int b, int c) { triples.push_back({a, b, c}); };
+      };
+      TripleVector node_triples, flat_triples;
+      topology->BinaryIdPreOrder(collector(node_triples));
+      topology->BinaryIdPostOrder(collector(node_triples));
+      topology->TripleIdPreOrderBifurcating(collector(node_triples));
+      flat.BinaryIdPreOrder(collector(flat_triples));
+      flat.BinaryIdPostOrder(collector(flat_triples));
+      flat.TripleIdPreOrderBifurcating(collector(flat_triples));
+      CHECK_EQ(flat_triples, node_triples);
+    }
+  }
+  arena.clear();
+  CHECK_EQ(arena.TopologyCount(), 0);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_FLAT_TOPOLOGY_HPP_
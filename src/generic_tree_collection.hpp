@@ -7,8 +7,14 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
+#include "flat_topology.hpp"
+#include "eigen_sugar.hpp"
+#include "newick_writer.hpp"
+#include "taxon_registry.hpp"
+#include "topology_interner.hpp"
 #include "tree.hpp"
 
 template <typename TTree>
@@ -32,7 +38,9 @@ class GenericTreeCollection {
   }
 
   GenericTreeCollection(TTreeVector trees, TagStringMap tag_taxon_map)
-      : trees_(std::move(trees)), tag_taxon_map_(std::move(tag_taxon_map)) {
+      : trees_(std::move(trees)),
+        tag_taxon_map_(std::move(tag_taxon_map)),
+        taxon_registry_(std::make_shared<const TaxonRegistry>(tag_taxon_map_)) {
     auto taxon_count = tag_taxon_map.size();
     auto different_taxon_count = [taxon_count](const auto &tree) {
       return tree.LeafCount() != taxon_count;
@@ -51,7 +59,78 @@ class GenericTreeCollection {
   const TTreeVector &Trees() const { return trees_; }
   const TTree &GetTree(size_t i) const { return trees_.at(i); }
   const TagStringMap &TagTaxonMap() const { return tag_taxon_map_; }
+  // The taxa of TagTaxonMap by id, which copies of this collection share.
+  const std::shared_ptr<const TaxonRegistry> &GetTaxonRegistry() const {
+    return taxon_registry_;
+  }
+  // Copy the topologies into a FlatTopologyArena, in the order of the trees.
+  FlatTopologyArena FlatTopologies() const {
+    FlatTopologyArena arena;
+    const size_t node_count = trees_.empty() ? 0 : trees_[0].Topology()->Id() + 1;
+    arena.Reserve(trees_.size(), trees_.size() * node_count);
+    for (const auto &tree : trees_) {
+      arena.PushBack(tree.Topology());
+    }
+    return arena;
+  }
   size_t TaxonCount() const { return tag_taxon_map_.size(); }
+  // The number of branch lengths of each tree, one per node, root included.
+  size_t BranchLengthCount() const {
+    return trees_.empty() ? 0 : trees_[0].branch_lengths_.size();
+  }
+  // The branch lengths of all of the trees in one contiguous trees x nodes matrix,
+  // with a row per tree indexed as its branch_lengths_, so that they can be read or
+  // changed in one go rather than tree by tree.
+  EigenMatrixXd BranchLengthMatrix() const {
+    const size_t branch_length_count = BranchLengthCount();
+    EigenMatrixXd branch_length_matrix(trees_.size(), branch_length_count);
+    for (size_t tree_idx = 0; tree_idx < trees_.size(); tree_idx++) {
+      const auto &branch_lengths = trees_[tree_idx].branch_lengths_;
+      Assert(branch_lengths.size() == branch_length_count,
+             "Trees have different numbers of branch lengths in BranchLengthMatrix.");
+      branch_length_matrix.row(tree_idx) = Eigen::Map<const EigenVectorXd>(
+          branch_lengths.data(), static_cast<Eigen::Index>(branch_lengths.size()));
+    }
+    return branch_length_matrix;
+  }
+  // Set the branch lengths of all of the trees from a matrix as BranchLengthMatrix
+  // gives it.
+  void SetBranchLengths(EigenConstMatrixXdRef branch_length_matrix) {
+    if (static_cast<size_t>(branch_length_matrix.rows()) != trees_.size() ||
+        static_cast<size_t>(branch_length_matrix.cols()) != BranchLengthCount()) {
+      Failwith("The branch length matrix is " +
+               std::to_string(branch_length_matrix.rows()) + " x " +
+               std::to_string(branch_length_matrix.cols()) + ", but we need " +
+               std::to_string(trees_.size()) + " x " +
+               std::to_string(BranchLengthCount()) + " in SetBranchLengths.");
+    }
+    for (size_t tree_idx = 0; tree_idx < trees_.size(); tree_idx++) {
+      auto &branch_lengths = trees_[tree_idx].branch_lengths_;
+      Assert(branch_lengths.size() == BranchLengthCount(),
+             "Trees have different numbers of branch lengths in SetBranchLengths.");
+      Eigen::Map<EigenVectorXd>(branch_lengths.data(),
+                                static_cast<Eigen::Index>(branch_lengths.size())) =
+          branch_length_matrix.row(tree_idx).transpose();
+    }
+  }
+  // An estimate of the number of bytes held by the trees: the tree objects, their
+  // branch lengths, and the nodes of each distinct topology, counted once however
+  // many trees share it. This leaves out allocator overhead and anything a derived
+  // tree type keeps besides its branch lengths.
+  size_t ApproximateByteCount() const {
+    size_t byte_count = trees_.capacity() * sizeof(TTree);
+    std::unordered_set<const Node *> topologies;
+    for (const auto &tree : trees_) {
+      byte_count += tree.branch_lengths_.capacity() * sizeof(double);
+      if (topologies.insert(tree.Topology().get()).second) {
+        tree.Topology()->PreOrder([&byte_count](const Node *node) {
+          byte_count += sizeof(Node) + node->Leaves().HeapByteCount() +
+                        node->Children().capacity() * sizeof(Node::NodePtr);
+        });
+      }
+    }
+    return byte_count;
+  }
 
   bool operator==(const GenericTreeCollection<TTree> &other) const {
     if (this->TagTaxonMap() != other.TagTaxonMap()) {
@@ -86,17 +165,34 @@ class GenericTreeCollection {
     Erase(0, end_idx);
   }
 
-  std::string Newick() const {
-    std::string str;
-    for (const auto &tree : trees_) {
-      if (tag_taxon_map_.empty()) {
-        str.append(tree.Newick());
-      } else {
-        str.append(tree.Newick(tag_taxon_map_));
-      }
-      str.push_back('\n');
+  // The Newick string of each tree, followed by a newline, written by NewickWriters
+  // on thread_count threads. See newick_writer.hpp for the precision.
+  std::string Newick(
+      size_t thread_count = 1,
+      std::optional<int> precision = NewickWriter::default_precision_) const {
+    return NewickWriter::NewickOf(*this, thread_count, precision);
+  }
+  // The same, written to a file a few blocks of trees at a time.
+  void WriteNewickFile(
+      const std::string &path, size_t thread_count = 1,
+      std::optional<int> precision = NewickWriter::default_precision_) const {
+    NewickWriter::WriteNewickFile(*this, path, thread_count, precision);
+  }
+
+  // Make the trees with equal topologies share one topology, using and extending
+  // interner, and return the topology id of each tree. Sharing an interner between
+  // collections gives their topologies common ids.
+  SizeVector InternTopologies(TopologyInterner &interner) {
+    SizeVector topology_ids;
+    topology_ids.reserve(trees_.size());
+    for (auto &tree : trees_) {
+      topology_ids.push_back(interner.Intern(tree));
     }
-    return str;
+    return topology_ids;
+  }
+  SizeVector InternTopologies() {
+    TopologyInterner interner;
+    return InternTopologies(interner);
   }
 
   Node::TopologyCounter TopologyCounter() const {
@@ -112,16 +208,7 @@ class GenericTreeCollection {
     return counter;
   }
 
-  std::vector<std::string> TaxonNames() const {
-    std::vector<std::string> names(tag_taxon_map_.size());
-    for (const auto &iter : tag_taxon_map_) {
-      size_t id = MaxLeafIDOfTag(iter.first);
-      Assert(id < names.size(),
-             "Leaf ID is out of range in TaxonNames for tree collection.");
-      names[id] = iter.second;
-    }
-    return names;
-  }
+  std::vector<std::string> TaxonNames() const { return taxon_registry_->TaxonNames(); }
 
   static TagStringMap TagStringMapOf(const std::vector<std::string> &taxon_labels) {
     TagStringMap taxon_map;
@@ -136,6 +223,8 @@ class GenericTreeCollection {
 
  protected:
   TagStringMap tag_taxon_map_;
+  std::shared_ptr<const TaxonRegistry> taxon_registry_ =
+      std::make_shared<const TaxonRegistry>();
 };
 
 // Tests appear in non-generic subclasses.
@@ -0,0 +1,179 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#ifdef LIBSBN_CUDA
+
+#include "gp_cuda_engine.hpp"
+
+#include <algorithm>
+#include <type_traits>
+
+CUDAGPEngine::CUDAGPEngine(const SitePattern& site_pattern, size_t gpcsp_count,
+                           std::optional<size_t> plv_count)
+    : pattern_count_(site_pattern.PatternCount()),
+      plv_count_(
+          plv_count.value_or(GPEngine::DefaultPLVCount(pattern_count_, gpcsp_count))),
+      gpcsp_count_(gpcsp_count),
+      branch_length_count_(gpcsp_count),
+      plvs_(plv_count_ * 4 * pattern_count_),
+      branch_lengths_(gpcsp_count),
+      log_likelihoods_(gpcsp_count),
+      q_(gpcsp_count),
+      site_pattern_weights_(pattern_count_) {
+  Assert(plv_count_ > 0, "Zero PLV count in constructor of CUDAGPEngine.");
+  // Only the leaf PLVs start out nonzero, so we only upload those, as
+  // GPEngine::InitializePLVsWithSitePatterns makes them.
+  const auto& patterns = site_pattern.GetPackedPatterns();
+  Assert(patterns.size() <= plv_count_, "Too few PLVs for the taxa in CUDAGPEngine.");
+  NucleotidePLV leaf_plvs = NucleotidePLV::Zero(4, patterns.size() * pattern_count_);
+  for (size_t taxon_idx = 0; taxon_idx < patterns.size(); taxon_idx++) {
+    const auto& pattern = patterns[taxon_idx];
+    for (size_t site_idx = 0; site_idx < pattern.size(); site_idx++) {
+      auto column = leaf_plvs.col(taxon_idx * pattern_count_ + site_idx);
+      if (pattern.IsAmbiguous(site_idx)) {  // Gap character.
+        column.setConstant(1.);
+      } else {
+        column(pattern[site_idx]) = 1.;
+      }
+    }
+  }
+  plvs_.SetZero();
+  plvs_.Upload(leaf_plvs.data(), leaf_plvs.size());
+  branch_lengths_.SetZero();
+  log_likelihoods_.SetZero();
+  SetQ(EigenVectorXd::Ones(gpcsp_count));
+  const auto& weights = site_pattern.GetWeights();
+  site_pattern_weights_.Upload(weights.data(), weights.size());
+}
+
+GPCUDAKernels::DeviceData CUDAGPEngine::Data() const {
+  return {plvs_.data(),
+          branch_lengths_.data(),
+          log_likelihoods_.data(),
+          q_.data(),
+          site_pattern_weights_.data(),
+          pattern_count_};
+}
+
+void CUDAGPEngine::AssertOperation(const GPOperation& operation) const {
+  std::visit(
+      [](const auto& op) {
+        using OperationType = std::decay_t<decltype(op)>;
+        if constexpr (std::is_same_v<OperationType, GPOperations::OptimizeLeafward> ||
+                      std::is_same_v<OperationType,
+                                     GPOperations::UpdateSBNProbabilities>) {
+          Failwith("CUDAGPEngine can't do OptimizeLeafward or UpdateSBNProbabilities.");
+        }
+      },
+      operation);
+  const auto read_write_set = GPOperations::GetReadWriteSet(operation, false);
+  for (const auto* locations : {&read_write_set.reads_, &read_write_set.writes_}) {
+    for (const auto &[kind, idx] : *locations) {
+      switch (kind) {
+        case GPOperations::PLVData:
+          Assert(idx < plv_count_, "PLV index out of range in CUDAGPEngine.");
+          break;
+        case GPOperations::BranchLengthData:
+          Assert(idx < branch_length_count_,
+                 "Branch length index out of range in CUDAGPEngine.");
+          break;
+        case GPOperations::LogLikelihoodData:
+        case GPOperations::QData:
+          Assert(idx < gpcsp_count_, "GPCSP index out of range in CUDAGPEngine.");
+          break;
+        case GPOperations::PerPatternData:
+          break;
+      }
+    }
+  }
+}
+
+void CUDAGPEngine::UploadOperations(
+    const std::vector<GPOperations::FlatOperation>& operations) {
+  if (operations.size() > operations_.size()) {
+    operations_ = GPCUDAKernels::DeviceArray<GPOperations::FlatOperation>(
+        std::max(operations.size(), 2 * operations_.size()));
+  }
+  operations_.Upload(operations.data(), operations.size());
+}
+
+void CUDAGPEngine::ProcessOperations(GPOperationVector operations) {
+  operations = GPOperations::Fuse(operations);
+  for (const auto& operation : operations) {
+    AssertOperation(operation);
+  }
+  const auto schedule = GPOperations::FlatDependencyLevels(operations);
+  UploadOperations(schedule.operations_);
+  const auto data = Data();
+  for (size_t level_idx = 0; level_idx < schedule.LevelCount(); level_idx++) {
+    const size_t offset = schedule.level_offsets_[level_idx];
+    GPCUDAKernels::LaunchLevel(data, operations_.data() + offset,
+                               schedule.level_offsets_[level_idx + 1] - offset,
+                               newton_settings_);
+  }
+  GPCUDAKernels::Synchronize();
+}
+
+NewtonOptimizationStatisticsVector CUDAGPEngine::NewtonOptimizeRootwardBatch(
+    const std::vector<GPOperations::OptimizeRootward>& operations) {
+  GPOperationVector batch(operations.begin(), operations.end());
+  for (const auto& operation : batch) {
+    AssertOperation(operation);
+  }
+  Assert(GPOperations::DependencyLevels(batch, false).size() <= 1,
+         "Edges depend on each other in CUDAGPEngine::NewtonOptimizeRootwardBatch.");
+  std::vector<GPOperations::FlatOperation> flat_operations;
+  for (const auto& operation : batch) {
+    flat_operations.push_back(GPOperations::Flatten(operation));
+  }
+  UploadOperations(flat_operations);
+  GPCUDAKernels::DeviceArray<GPCUDAKernels::NewtonResult> device_results(
+      operations.size());
+  GPCUDAKernels::LaunchNewtonOptimizeRootward(Data(), operations_.data(),
+                                              operations.size(), newton_settings_,
+                                              device_results.data());
+  std::vector<GPCUDAKernels::NewtonResult> results(operations.size());
+  device_results.Download(results.data(), results.size());
+  NewtonOptimizationStatisticsVector statistics(operations.size());
+  for (size_t op_idx = 0; op_idx < operations.size(); op_idx++) {
+    statistics[op_idx].iteration_count_ = results[op_idx].iteration_count_;
+    statistics[op_idx].converged_ = results[op_idx].converged_ != 0;
+    statistics[op_idx].branch_length_ = results[op_idx].branch_length_;
+    statistics[op_idx].log_likelihood_ = results[op_idx].log_likelihood_;
+  }
+  return statistics;
+}
+
+void CUDAGPEngine::SetBranchLengths(const EigenVectorXd& branch_lengths) {
+  Assert(static_cast<size_t>(branch_lengths.size()) <= gpcsp_count_,
+         "More branch lengths than GPCSPs in CUDAGPEngine::SetBranchLengths.");
+  branch_length_count_ = branch_lengths.size();
+  branch_lengths_.Upload(branch_lengths.data(), branch_length_count_);
+}
+
+EigenVectorXd CUDAGPEngine::GetBranchLengths() const {
+  EigenVectorXd branch_lengths(branch_length_count_);
+  branch_lengths_.Download(branch_lengths.data(), branch_length_count_);
+  return branch_lengths;
+}
+
+void CUDAGPEngine::SetQ(const EigenVectorXd& q) {
+  Assert(static_cast<size_t>(q.size()) == gpcsp_count_,
+         "Wrong number of GPCSPs in CUDAGPEngine::SetQ.");
+  q_.Upload(q.data(), gpcsp_count_);
+}
+
+EigenVectorXd CUDAGPEngine::GetLogLikelihoods() const {
+  EigenVectorXd log_likelihoods(gpcsp_count_);
+  log_likelihoods_.Download(log_likelihoods.data(), gpcsp_count_);
+  return log_likelihoods;
+}
+
+NucleotidePLV CUDAGPEngine::GetPLV(size_t plv_idx) const {
+  Assert(plv_idx < plv_count_, "PLV index out of range in CUDAGPEngine::GetPLV.");
+  NucleotidePLV plv(4, pattern_count_);
+  plvs_.Download(plv.data(), plv.size(), plv_idx * plv.size());
+  return plv;
+}
+
+#endif  // LIBSBN_CUDA
@@ -0,0 +1,72 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A CUDAGPEngine does what GPEngine does on a CUDA device. The PLVs, branch lengths,
+// log likelihoods, q and site pattern weights stay in device memory for the life of
+// the engine. Processing operations uploads their schedule (see
+// GPOperations::FlatDependencyLevels), and then each dependency level is one kernel
+// launch that runs all of its operations at once. Likelihoods and optimizations sum
+// over the patterns within a block of threads rather than in shared temporaries, so
+// they run alongside the other operations of their level. Only the log likelihoods
+// and branch lengths come back to the host, and only when asked for.
+//
+// As for GPEngine, the model is JC69, whose transition matrices the kernels compute
+// from the branch lengths as they go. OptimizeRootward takes Newton-Raphson steps as
+// in GPEngine::NewtonOptimizeRootwardBatch, on the device.
+//
+// This is only built if LIBSBN_CUDA is defined; see the --cuda option of SConstruct.
+
+#ifndef SRC_GP_CUDA_ENGINE_HPP_
+#define SRC_GP_CUDA_ENGINE_HPP_
+
+#ifdef LIBSBN_CUDA
+
+#include "gp_cuda_kernels.hpp"
+#include "gp_engine.hpp"
+
+class CUDAGPEngine {
+ public:
+  // As for GPEngine, without a plv_count we have GPEngine::DefaultPLVCount PLVs.
+  CUDAGPEngine(const SitePattern& site_pattern, size_t gpcsp_count,
+               std::optional<size_t> plv_count = std::nullopt);
+
+  // Fuse the operations as GPEngine::ProcessOperations does and run them on the
+  // device, returning when the device is done. We don't do OptimizeLeafward or
+  // UpdateSBNProbabilities, which GPEngine doesn't either.
+  void ProcessOperations(GPOperationVector operations);
+  // As for GPEngine::NewtonOptimizeRootwardBatch, with one launch for all of the
+  // edges.
+  NewtonOptimizationStatisticsVector NewtonOptimizeRootwardBatch(
+      const std::vector<GPOperations::OptimizeRootward>& operations);
+
+  void SetBranchLengths(const EigenVectorXd& branch_lengths);
+  EigenVectorXd GetBranchLengths() const;
+  EigenVectorXd GetLogLikelihoods() const;
+  void SetQ(const EigenVectorXd& q);
+  // Copy a PLV to the host, which is mostly for testing.
+  NucleotidePLV GetPLV(size_t plv_idx) const;
+
+ private:
+  size_t pattern_count_;
+  size_t plv_count_;
+  size_t gpcsp_count_;
+  size_t branch_length_count_;
+  GPCUDAKernels::NewtonSettings newton_settings_ = {1e-6, 3., 1e-8, 100};
+
+  GPCUDAKernels::DeviceArray<double> plvs_;
+  GPCUDAKernels::DeviceArray<double> branch_lengths_;
+  GPCUDAKernels::DeviceArray<double> log_likelihoods_;
+  GPCUDAKernels::DeviceArray<double> q_;
+  GPCUDAKernels::DeviceArray<double> site_pattern_weights_;
+  // The operations of the last schedule, which we grow as needed.
+  GPCUDAKernels::DeviceArray<GPOperations::FlatOperation> operations_;
+
+  GPCUDAKernels::DeviceData Data() const;
+  // Check the indices of an operation against what we have, and that we can do it.
+  void AssertOperation(const GPOperation& operation) const;
+  void UploadOperations(const std::vector<GPOperations::FlatOperation>& operations);
+};
+
+#endif  // LIBSBN_CUDA
+
+#endif  // SRC_GP_CUDA_ENGINE_HPP_
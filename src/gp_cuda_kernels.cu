@@ -0,0 +1,362 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#ifdef LIBSBN_CUDA
+
+#include "gp_cuda_kernels.hpp"
+
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <string>
+
+using GPOperations::FlatOperation;
+using GPOperations::KindOf;
+
+namespace {
+
+// The reductions below assume that this is a power of two.
+constexpr unsigned int block_size = 256;
+// The largest y dimension of a grid.
+constexpr size_t max_grid_height = 65535;
+constexpr size_t state_count = 4;
+
+constexpr uint32_t zero_kind = KindOf<GPOperations::Zero>();
+constexpr uint32_t stationary_kind =
+    KindOf<GPOperations::SetToStationaryDistribution>();
+constexpr uint32_t accumulate_kind = KindOf<GPOperations::WeightedSumAccumulate>();
+constexpr uint32_t multiply_kind = KindOf<GPOperations::Multiply>();
+constexpr uint32_t likelihood_kind = KindOf<GPOperations::Likelihood>();
+constexpr uint32_t evolve_rootward_kind = KindOf<GPOperations::EvolveRootward>();
+constexpr uint32_t evolve_leafward_kind = KindOf<GPOperations::EvolveLeafward>();
+constexpr uint32_t optimize_rootward_kind = KindOf<GPOperations::OptimizeRootward>();
+constexpr uint32_t evolve_rootward_and_multiply_kind =
+    KindOf<GPOperations::EvolveRootwardAndMultiply>();
+constexpr uint32_t evolve_leafward_and_multiply_kind =
+    KindOf<GPOperations::EvolveLeafwardAndMultiply>();
+constexpr uint32_t zero_and_accumulate_kind = KindOf<GPOperations::ZeroAndAccumulate>();
+
+void Check(cudaError_t error, const char* what) {
+  if (error != cudaSuccess) {
+    Failwith(std::string("CUDA error in ") + what + ": " + cudaGetErrorString(error));
+  }
+}
+
+// A JC69 matrix (or one of its derivatives), which has one value on the diagonal and
+// another off it. It is symmetric, so it is also its own transpose, which is what
+// leafward evolution uses.
+struct EqualRatesMatrix {
+  double diagonal_;
+  double off_diagonal_;
+};
+
+// These are the closed forms of GPEngine for four states.
+__device__ EqualRatesMatrix TransitionMatrix(double branch_length) {
+  const double decay = exp(-4. * branch_length / 3.);
+  return {0.25 + 0.75 * decay, 0.25 - 0.25 * decay};
+}
+
+__device__ EqualRatesMatrix DerivativeMatrix(double branch_length) {
+  const double decay = exp(-4. * branch_length / 3.);
+  return {-decay, decay / 3.};
+}
+
+__device__ EqualRatesMatrix SecondDerivativeMatrix(double branch_length) {
+  const double decay = exp(-4. * branch_length / 3.);
+  return {4. * decay / 3., -4. * decay / 9.};
+}
+
+__device__ double* Column(const GPCUDAKernels::DeviceData& data, uint32_t plv_idx,
+                          size_t pattern_idx) {
+  return data.plvs_ + (plv_idx * data.pattern_count_ + pattern_idx) * state_count;
+}
+
+// Put matrix times column in result, which may be column.
+__device__ void Evolve(const EqualRatesMatrix& matrix, const double* column,
+                       double* result) {
+  const double sum = column[0] + column[1] + column[2] + column[3];
+  const double difference = matrix.diagonal_ - matrix.off_diagonal_;
+  for (size_t state = 0; state < state_count; state++) {
+    result[state] = matrix.off_diagonal_ * sum + difference * column[state];
+  }
+}
+
+__device__ double Dot(const double* first, const double* second) {
+  return first[0] * second[0] + first[1] * second[1] + first[2] * second[2] +
+         first[3] * second[3];
+}
+
+// Replace the values of each thread by their sums over the block. Every thread of the
+// block has to call this.
+template <size_t Count>
+__device__ void BlockSum(double (&values)[Count]) {
+  __shared__ double partial_sums[Count][block_size];
+  for (size_t value_idx = 0; value_idx < Count; value_idx++) {
+    partial_sums[value_idx][threadIdx.x] = values[value_idx];
+  }
+  __syncthreads();
+  for (unsigned int stride = block_size / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      for (size_t value_idx = 0; value_idx < Count; value_idx++) {
+        partial_sums[value_idx][threadIdx.x] +=
+            partial_sums[value_idx][threadIdx.x + stride];
+      }
+    }
+    __syncthreads();
+  }
+  for (size_t value_idx = 0; value_idx < Count; value_idx++) {
+    values[value_idx] = partial_sums[value_idx][0];
+  }
+  // Don't let a later call overwrite the sums before everyone has them.
+  __syncthreads();
+}
+
+// The part of one pattern in a per-pattern operation.
+__device__ void ProcessPattern(const GPCUDAKernels::DeviceData& data,
+                               const FlatOperation& op, size_t pattern_idx) {
+  const uint32_t* indices = op.indices_;
+  double* dest = Column(data, indices[0], pattern_idx);
+  switch (op.kind_) {
+    case zero_kind:
+      for (size_t state = 0; state < state_count; state++) {
+        dest[state] = 0.;
+      }
+      break;
+    case stationary_kind:
+      for (size_t state = 0; state < state_count; state++) {
+        dest[state] = 1. / state_count;
+      }
+      break;
+    case accumulate_kind:
+    case zero_and_accumulate_kind: {
+      const double q = data.q_[indices[1]];
+      const double* src = Column(data, indices[2], pattern_idx);
+      const bool accumulate = op.kind_ == accumulate_kind;
+      for (size_t state = 0; state < state_count; state++) {
+        dest[state] = (accumulate ? dest[state] : 0.) + q * src[state];
+      }
+      break;
+    }
+    case multiply_kind: {
+      const double* src1 = Column(data, indices[1], pattern_idx);
+      const double* src2 = Column(data, indices[2], pattern_idx);
+      for (size_t state = 0; state < state_count; state++) {
+        dest[state] = src1[state] * src2[state];
+      }
+      break;
+    }
+    case evolve_rootward_kind:
+    case evolve_leafward_kind:
+      Evolve(TransitionMatrix(data.branch_lengths_[indices[2]]),
+             Column(data, indices[1], pattern_idx), dest);
+      break;
+    case evolve_rootward_and_multiply_kind:
+    case evolve_leafward_and_multiply_kind: {
+      double evolved[state_count];
+      Evolve(TransitionMatrix(data.branch_lengths_[indices[3]]),
+             Column(data, indices[2], pattern_idx), evolved);
+      double* evolve_dest = Column(data, indices[1], pattern_idx);
+      const double* other = Column(data, indices[4], pattern_idx);
+      for (size_t state = 0; state < state_count; state++) {
+        evolve_dest[state] = evolved[state];
+        dest[state] = evolved[state] * other[state];
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// A Likelihood, by one block.
+__device__ void BlockLikelihood(const GPCUDAKernels::DeviceData& data,
+                                const FlatOperation& op) {
+  double sums[1] = {0.};
+  for (size_t pattern_idx = threadIdx.x; pattern_idx < data.pattern_count_;
+       pattern_idx += blockDim.x) {
+    sums[0] += data.site_pattern_weights_[pattern_idx] *
+               log(Dot(Column(data, op.indices_[1], pattern_idx),
+                       Column(data, op.indices_[2], pattern_idx)));
+  }
+  BlockSum(sums);
+  if (threadIdx.x == 0) {
+    data.log_likelihoods_[op.indices_[0]] = sums[0];
+  }
+}
+
+// An OptimizeRootward by Newton-Raphson, by one block, following
+// GPEngine::NewtonOptimizeRootwardBatch. Every thread gets the same sums, so every
+// thread takes the same steps.
+__device__ void BlockNewtonOptimizeRootward(
+    const GPCUDAKernels::DeviceData& data, const FlatOperation& op,
+    const GPCUDAKernels::NewtonSettings& settings,
+    GPCUDAKernels::NewtonResult* result) {
+  const uint32_t dest_idx = op.indices_[0];
+  const uint32_t leafward_idx = op.indices_[1];
+  const uint32_t rootward_idx = op.indices_[2];
+  const uint32_t branch_length_idx = op.indices_[3];
+  double branch_length = data.branch_lengths_[branch_length_idx];
+  uint32_t iteration_count = 0;
+  bool converged = false;
+  while (iteration_count < settings.max_iteration_count_ && !converged) {
+    const auto transition_matrix = TransitionMatrix(branch_length);
+    const auto derivative_matrix = DerivativeMatrix(branch_length);
+    const auto second_derivative_matrix = SecondDerivativeMatrix(branch_length);
+    // The derivative and second derivative of the log likelihood.
+    double sums[2] = {0., 0.};
+    for (size_t pattern_idx = threadIdx.x; pattern_idx < data.pattern_count_;
+         pattern_idx += blockDim.x) {
+      const double* rootward = Column(data, rootward_idx, pattern_idx);
+      const double* leafward = Column(data, leafward_idx, pattern_idx);
+      double evolved[state_count];
+      Evolve(transition_matrix, leafward, evolved);
+      const double likelihood = Dot(rootward, evolved);
+      Evolve(derivative_matrix, leafward, evolved);
+      const double ratio = Dot(rootward, evolved) / likelihood;
+      Evolve(second_derivative_matrix, leafward, evolved);
+      const double second_ratio = Dot(rootward, evolved) / likelihood;
+      const double weight = data.site_pattern_weights_[pattern_idx];
+      sums[0] += weight * ratio;
+      sums[1] += weight * (second_ratio - ratio * ratio);
+    }
+    BlockSum(sums);
+    const double derivative = sums[0];
+    const double second_derivative = sums[1];
+    double new_branch_length;
+    if (second_derivative < 0.) {
+      new_branch_length = branch_length - derivative / second_derivative;
+    } else {
+      new_branch_length = derivative > 0. ? 2. * branch_length : 0.5 * branch_length;
+    }
+    new_branch_length = fmin(fmax(new_branch_length, settings.min_branch_length_),
+                             settings.max_branch_length_);
+    iteration_count++;
+    converged = fabs(new_branch_length - branch_length) <=
+                settings.relative_tolerance_ * branch_length;
+    branch_length = new_branch_length;
+  }
+  // Store the PLV and log likelihood for the branch length we ended up with.
+  const auto transition_matrix = TransitionMatrix(branch_length);
+  double sums[1] = {0.};
+  for (size_t pattern_idx = threadIdx.x; pattern_idx < data.pattern_count_;
+       pattern_idx += blockDim.x) {
+    double* dest = Column(data, dest_idx, pattern_idx);
+    Evolve(transition_matrix, Column(data, leafward_idx, pattern_idx), dest);
+    sums[0] += data.site_pattern_weights_[pattern_idx] *
+               log(Dot(Column(data, rootward_idx, pattern_idx), dest));
+  }
+  BlockSum(sums);
+  if (threadIdx.x == 0) {
+    data.branch_lengths_[branch_length_idx] = branch_length;
+    data.log_likelihoods_[branch_length_idx] = sums[0];
+    if (result != nullptr) {
+      *result = {branch_length, sums[0], iteration_count,
+                 static_cast<uint32_t>(converged)};
+    }
+  }
+}
+
+// The y coordinate of the grid goes over the operations, and the x coordinate over
+// blocks of patterns. The block-wide operations only run in the first block of
+// patterns. An operation is the same for all threads of a block, so either all of
+// them call BlockSum or none of them do.
+__global__ void LevelKernel(GPCUDAKernels::DeviceData data,
+                            const FlatOperation* operations, size_t operation_count,
+                            GPCUDAKernels::NewtonSettings settings) {
+  const size_t pattern_idx = blockIdx.x * blockDim.x + threadIdx.x;
+  for (size_t operation_idx = blockIdx.y; operation_idx < operation_count;
+       operation_idx += gridDim.y) {
+    const FlatOperation op = operations[operation_idx];
+    if (op.kind_ == likelihood_kind) {
+      if (blockIdx.x == 0) {
+        BlockLikelihood(data, op);
+      }
+    } else if (op.kind_ == optimize_rootward_kind) {
+      if (blockIdx.x == 0) {
+        BlockNewtonOptimizeRootward(data, op, settings, nullptr);
+      }
+    } else if (pattern_idx < data.pattern_count_) {
+      ProcessPattern(data, op, pattern_idx);
+    }
+  }
+}
+
+__global__ void NewtonKernel(GPCUDAKernels::DeviceData data,
+                             const FlatOperation* operations, size_t operation_count,
+                             GPCUDAKernels::NewtonSettings settings,
+                             GPCUDAKernels::NewtonResult* results) {
+  for (size_t operation_idx = blockIdx.y; operation_idx < operation_count;
+       operation_idx += gridDim.y) {
+    BlockNewtonOptimizeRootward(data, operations[operation_idx], settings,
+                                results + operation_idx);
+  }
+}
+
+dim3 GridOf(size_t pattern_block_count, size_t operation_count) {
+  return dim3(static_cast<unsigned int>(pattern_block_count),
+              static_cast<unsigned int>(std::min(operation_count, max_grid_height)));
+}
+
+}  // namespace
+
+void* GPCUDAKernels::Allocate(size_t byte_count) {
+  void* device_pointer = nullptr;
+  if (byte_count > 0) {
+    Check(cudaMalloc(&device_pointer, byte_count), "Allocate");
+  }
+  return device_pointer;
+}
+
+void GPCUDAKernels::Free(void* device_pointer) {
+  // We don't throw from here, as this is called from destructors.
+  cudaFree(device_pointer);
+}
+
+void GPCUDAKernels::SetZero(void* device_pointer, size_t byte_count) {
+  Check(cudaMemset(device_pointer, 0, byte_count), "SetZero");
+}
+
+void GPCUDAKernels::CopyToDevice(void* device_pointer, const void* host_pointer,
+                                 size_t byte_count) {
+  Check(cudaMemcpy(device_pointer, host_pointer, byte_count, cudaMemcpyHostToDevice),
+        "CopyToDevice");
+}
+
+void GPCUDAKernels::CopyToHost(void* host_pointer, const void* device_pointer,
+                               size_t byte_count) {
+  Check(cudaMemcpy(host_pointer, device_pointer, byte_count, cudaMemcpyDeviceToHost),
+        "CopyToHost");
+}
+
+void GPCUDAKernels::Synchronize() {
+  Check(cudaDeviceSynchronize(), "Synchronize");
+}
+
+void GPCUDAKernels::LaunchLevel(const DeviceData& data,
+                                const FlatOperation* operations,
+                                size_t operation_count,
+                                const NewtonSettings& settings) {
+  if (operation_count == 0) {
+    return;
+  }
+  const size_t pattern_block_count =
+      std::max<size_t>(1, (data.pattern_count_ + block_size - 1) / block_size);
+  LevelKernel<<<GridOf(pattern_block_count, operation_count), block_size>>>(
+      data, operations, operation_count, settings);
+  Check(cudaGetLastError(), "LaunchLevel");
+}
+
+void GPCUDAKernels::LaunchNewtonOptimizeRootward(const DeviceData& data,
+                                                 const FlatOperation* operations,
+                                                 size_t operation_count,
+                                                 const NewtonSettings& settings,
+                                                 NewtonResult* results) {
+  if (operation_count == 0) {
+    return;
+  }
+  NewtonKernel<<<GridOf(1, operation_count), block_size>>>(data, operations,
+                                                           operation_count, settings,
+                                                           results);
+  Check(cudaGetLastError(), "LaunchNewtonOptimizeRootward");
+}
+
+#endif  // LIBSBN_CUDA
@@ -0,0 +1,119 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// The device side of CUDAGPEngine. These are the only functions that need the CUDA
+// toolkit, so that the rest of the build doesn't: they are defined in
+// gp_cuda_kernels.cu, which nvcc compiles.
+//
+// The PLVs are one block of doubles on the device, in which PLV plv_idx is the
+// 4 x pattern_count column-major matrix starting at plv_idx * 4 * pattern_count, as
+// in MmappedNucleotidePLV. Launches queue their work on the default stream and
+// return; Synchronize waits for it, and reports any error that came up along the way.
+//
+// This is only built if LIBSBN_CUDA is defined; see the --cuda option of SConstruct.
+
+#ifndef SRC_GP_CUDA_KERNELS_HPP_
+#define SRC_GP_CUDA_KERNELS_HPP_
+
+#ifdef LIBSBN_CUDA
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include "gp_operation.hpp"
+
+namespace GPCUDAKernels {
+
+// The settings of Newton-Raphson branch length optimization, as in GPEngine.
+struct NewtonSettings {
+  double min_branch_length_;
+  double max_branch_length_;
+  double relative_tolerance_;
+  uint32_t max_iteration_count_;
+};
+
+// What happened to one edge, as in NewtonOptimizationStatistics.
+struct NewtonResult {
+  double branch_length_;
+  double log_likelihood_;
+  uint32_t iteration_count_;
+  uint32_t converged_;
+};
+
+// The device memory of an engine. The data are indexed as described at the top of
+// gp_operation.hpp.
+struct DeviceData {
+  double* plvs_;
+  double* branch_lengths_;
+  double* log_likelihoods_;
+  const double* q_;
+  const double* site_pattern_weights_;
+  size_t pattern_count_;
+};
+
+void* Allocate(size_t byte_count);
+void Free(void* device_pointer);
+void SetZero(void* device_pointer, size_t byte_count);
+void CopyToDevice(void* device_pointer, const void* host_pointer, size_t byte_count);
+void CopyToHost(void* host_pointer, const void* device_pointer, size_t byte_count);
+void Synchronize();
+
+// Run the operations of one dependency level (see GPOperations::FlatDependencyLevels)
+// at the same time. The operations are in device memory. Per-pattern operations use
+// a grid of threads over the patterns, and each likelihood and optimization uses one
+// block. We don't do OptimizeLeafward or UpdateSBNProbabilities.
+void LaunchLevel(const DeviceData& data, const GPOperations::FlatOperation* operations,
+                 size_t operation_count, const NewtonSettings& settings);
+// Optimize the branch lengths of independent OptimizeRootward operations, which are
+// in device memory, with one block per edge, putting what happened in results (also
+// in device memory).
+void LaunchNewtonOptimizeRootward(const DeviceData& data,
+                                  const GPOperations::FlatOperation* operations,
+                                  size_t operation_count,
+                                  const NewtonSettings& settings,
+                                  NewtonResult* results);
+
+// Device memory for count values of type T, which must be trivially copyable.
+template <typename T>
+class DeviceArray {
+ public:
+  DeviceArray() = default;
+  explicit DeviceArray(size_t count)
+      : data_(static_cast<T*>(Allocate(count * sizeof(T)))), count_(count) {}
+  ~DeviceArray() { Free(data_); }
+  DeviceArray(const DeviceArray&) = delete;
+  DeviceArray& operator=(const DeviceArray&) = delete;
+  DeviceArray(DeviceArray&& other) noexcept { Swap(other); }
+  DeviceArray& operator=(DeviceArray&& other) noexcept {
+    Swap(other);
+    return *this;
+  }
+
+  T* data() const { return data_; }
+  size_t size() const { return count_; }
+
+  void SetZero() { GPCUDAKernels::SetZero(data_, count_ * sizeof(T)); }
+  void Upload(const T* values, size_t count, size_t offset = 0) {
+    Assert(offset + count <= count_, "Upload past the end of a DeviceArray.");
+    CopyToDevice(data_ + offset, values, count * sizeof(T));
+  }
+  void Download(T* values, size_t count, size_t offset = 0) const {
+    Assert(offset + count <= count_, "Download past the end of a DeviceArray.");
+    CopyToHost(values, data_ + offset, count * sizeof(T));
+  }
+
+ private:
+  T* data_ = nullptr;
+  size_t count_ = 0;
+
+  void Swap(DeviceArray& other) {
+    std::swap(data_, other.data_);
+    std::swap(count_, other.count_);
+  }
+};
+
+}  // namespace GPCUDAKernels
+
+#endif  // LIBSBN_CUDA
+
+#endif  // SRC_GP_CUDA_KERNELS_HPP_
@@ -13,8 +13,8 @@ enum HelloGPCSP { jupiter, mars, saturn, venus, root };
 // (jupiter:0.113,(mars:0.15,saturn:0.1)venus:0.22):0.;
 // You can see a helpful diagram at
 // https://github.com/phylovi/libsbn/issues/213#issuecomment-624195267
-GPInstance MakeHelloGPInstance() {
-  GPInstance inst("_ignore/mmapped_plv.data");
+GPInstance MakeHelloGPInstance(MmapBacking mmap_backing = MmapBacking::File) {
+  GPInstance inst("_ignore/mmapped_plv.data", mmap_backing);
   inst.ReadFastaFile("data/hello.fasta");
   inst.ReadNewickFile("data/hello_rooted.nwk");
   inst.MakeEngine();
@@ -60,8 +60,144 @@ TEST_CASE("GPInstance: straightforward classical likelihood calculation") {
 
   auto inst = MakeHelloGPInstance();
   auto engine = inst.GetEngine();
+  // Both the saturn and the jupiter evolution fuse with the following Multiply.
+  CHECK_EQ(Fuse(rootward_likelihood_calculation).size(), 6);
+  CHECK_EQ(Fuse({Zero{0}, WeightedSumAccumulate{0, 1, 2}}).size(), 1);
+  // Accumulating a PLV into itself after zeroing it doesn't fuse.
+  CHECK_EQ(Fuse({Zero{0}, WeightedSumAccumulate{0, 1, 0}}).size(), 2);
+  // The stationary distribution and the three leaf evolutions are independent, and
+  // then each step needs the one before it.
+  auto levels = DependencyLevels(rootward_likelihood_calculation);
+  CHECK_EQ(levels.size(), 5);
+  CHECK_EQ(levels[0].size(), 4);
+  // Likelihoods share the per-pattern temporaries, so they can't run together.
+  CHECK_EQ(DependencyLevels({Likelihood{0, 1, 2}, Likelihood{3, 4, 5}}).size(), 2);
+  CHECK_EQ(PLVIndices(EvolveRootwardAndMultiply{3, 1, 2, 0, 1}), SizeVector({1, 2, 3}));
+  CHECK_EQ(PLVIndices(OptimizeRootward{0, 1, 2, 0}), SizeVector({0, 1, 2}));
+  // Optimizations get levels to themselves.
+  CHECK_EQ(DependencyLevels({OptimizeRootward{0, 1, 2, 0}, Zero{3},
+                             OptimizeRootward{4, 5, 6, 1}, Zero{7}})
+               .size(),
+           4);
+  // Without shared temporaries they only depend on what they touch, so here they all
+  // fit in one level, which the flat schedule keeps.
+  CHECK_EQ(DependencyLevels({Likelihood{0, 1, 2}, Likelihood{3, 4, 5}}, false).size(),
+           1);
+  const auto schedule = FlatDependencyLevels(
+      {OptimizeRootward{0, 1, 2, 0}, Zero{3}, OptimizeRootward{4, 5, 6, 1}, Zero{7}});
+  CHECK_EQ(schedule.LevelCount(), 1);
+  CHECK_EQ(schedule.operations_.size(), 4);
+  CHECK_EQ(schedule.operations_[2].kind_, KindOf<OptimizeRootward>());
+  CHECK_EQ(schedule.operations_[2].indices_[0], 4);
+  CHECK_EQ(schedule.operations_[2].indices_[3], 1);
+  CHECK_EQ(schedule.operations_[3].kind_, KindOf<Zero>());
   engine->ProcessOperations(rootward_likelihood_calculation);
   CHECK_LT(fabs(engine->GetLogLikelihoods()(HelloGPCSP::root) - -84.77961943), 1e-6);
+  // Storing PLVs as floats barely changes the likelihood.
+  CHECK_LT(inst.SinglePrecisionLogLikelihoodDeviation(rootward_likelihood_calculation),
+           1e-4);
+  // Without fusion, saturn_root lives from the second operation to the third.
+  std::vector<GPOperationVector> single_operation_steps;
+  for (const auto& operation : rootward_likelihood_calculation) {
+    single_operation_steps.push_back({operation});
+  }
+  auto live_intervals = PLVLiveIntervals(single_operation_steps);
+  CHECK_EQ(live_intervals.at(PLV::saturn_root).first_write_, 2);
+  CHECK_EQ(live_intervals.at(PLV::saturn_root).last_use_, 3);
+  CHECK(live_intervals.at(PLV::saturn_leaf).read_before_write_);
+  CHECK_FALSE(live_intervals.at(PLV::saturn_root).read_before_write_);
+  // We get the same likelihood when releasing the intermediate PLVs.
+  engine->SetTemporaryPLVs({PLV::mars_root, PLV::saturn_root, PLV::jupiter_root,
+                            PLV::ancestor_leaf, PLV::ancestor_root, PLV::root_leaf});
+  engine->ProcessOperations(rootward_likelihood_calculation);
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(HelloGPCSP::root) - -84.77961943), 1e-6);
+  // But a temporary can't hold data from before.
+  CHECK_THROWS(engine->ProcessOperations(
+      {Likelihood{HelloGPCSP::root, PLV::stationary, PLV::root_leaf}}));
+  engine->SetTemporaryPLVs({});
+  // The PLVs don't need a file.
+  for (auto backing : {MmapBacking::Anonymous, MmapBacking::AnonymousHugePages}) {
+    auto anonymous_inst = MakeHelloGPInstance(backing);
+    auto anonymous_engine = anonymous_inst.GetEngine();
+    anonymous_engine->ProcessOperations(rootward_likelihood_calculation);
+    CHECK_LT(fabs(anonymous_engine->GetLogLikelihoods()(HelloGPCSP::root) -
+                  -84.77961943),
+             1e-6);
+  }
+
+  // Now do the same with batches, after clearing out the results.
+  engine->ProcessOperations({
+      Zero{PLV::mars_root},
+      Zero{PLV::saturn_root},
+      Zero{PLV::jupiter_root},
+      Zero{PLV::ancestor_leaf},
+      Zero{PLV::ancestor_root},
+      Zero{PLV::root_leaf},
+  });
+  engine->ProcessEvolveRootwardBatch({
+      {PLV::mars_root, PLV::mars_leaf, HelloGPCSP::mars},
+      {PLV::saturn_root, PLV::saturn_leaf, HelloGPCSP::saturn},
+      {PLV::jupiter_root, PLV::jupiter_leaf, HelloGPCSP::jupiter},
+  });
+  engine->ProcessMultiplyBatch(
+      {{PLV::ancestor_leaf, PLV::mars_root, PLV::saturn_root}});
+  engine->ProcessEvolveRootwardBatch(
+      {{PLV::ancestor_root, PLV::ancestor_leaf, HelloGPCSP::venus}});
+  engine->ProcessMultiplyBatch(
+      {{PLV::root_leaf, PLV::ancestor_root, PLV::jupiter_root}});
+  engine->ProcessOperations(
+      {Likelihood{HelloGPCSP::root, PLV::stationary, PLV::root_leaf}});
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(HelloGPCSP::root) - -84.77961943), 1e-6);
+  // Batches check their indices before doing anything.
+  CHECK_THROWS(engine->ProcessMultiplyBatch(
+      {{PLV::root_leaf, PLV::ancestor_root, PLV::jupiter_root}, {1000, 0, 1}}));
+
+  // A checkpointing engine resumes from the last checkpoint.
+  const std::string checkpointed_path = "_ignore/checkpointed_plv.data";
+  std::remove(GPEngine::CheckpointPathOf(checkpointed_path).c_str());
+  const auto make_checkpointed_instance = [&checkpointed_path]() {
+    GPInstance checkpointed_inst(checkpointed_path);
+    checkpointed_inst.ReadFastaFile("data/hello.fasta");
+    checkpointed_inst.ReadNewickFile("data/hello_rooted.nwk");
+    checkpointed_inst.MakeEngine(SitePatternOrder::FirstAppearance, std::nullopt,
+                                 true);
+    return checkpointed_inst;
+  };
+  {
+    auto checkpointed_inst = make_checkpointed_instance();
+    auto checkpointed_engine = checkpointed_inst.GetEngine();
+    CHECK(checkpointed_engine->GetCheckpointResume() == GPCheckpointResume::None);
+    checkpointed_engine->SetBranchLengths(engine->GetBranchLengths());
+    checkpointed_engine->ProcessOperations(rootward_likelihood_calculation);
+    checkpointed_inst.WriteCheckpoint();
+  }
+  {
+    auto resumed_inst = make_checkpointed_instance();
+    auto resumed_engine = resumed_inst.GetEngine();
+    CHECK(resumed_engine->GetCheckpointResume() == GPCheckpointResume::Everything);
+    CHECK_EQ(resumed_engine->GetBranchLengths(), engine->GetBranchLengths());
+    CHECK_LT(fabs(resumed_engine->GetLogLikelihoods()(HelloGPCSP::root) - -84.77961943),
+             1e-6);
+    // The PLVs are as we left them, so we can compute the likelihood straight away.
+    resumed_engine->ProcessOperations(
+        {Likelihood{HelloGPCSP::root, PLV::stationary, PLV::root_leaf}});
+    CHECK_LT(fabs(resumed_engine->GetLogLikelihoods()(HelloGPCSP::root) - -84.77961943),
+             1e-6);
+    // Changing a PLV after the checkpoint means that only the parameters resume.
+    resumed_engine->ProcessOperations({Zero{PLV::root_leaf}});
+  }
+  {
+    auto resumed_inst = make_checkpointed_instance();
+    auto resumed_engine = resumed_inst.GetEngine();
+    CHECK(resumed_engine->GetCheckpointResume() == GPCheckpointResume::Parameters);
+    CHECK_EQ(resumed_engine->GetBranchLengths(), engine->GetBranchLengths());
+  }
+  // A checkpoint for another DAG doesn't count.
+  GPEngine other_engine(SitePattern::HelloSitePattern(),
+                        engine->GetBranchLengths().size() + 1, checkpointed_path,
+                        MmapBacking::File, 0);
+  CHECK(other_engine.GetCheckpointResume() == GPCheckpointResume::None);
+  CHECK_THROWS(engine->WriteCheckpoint());
 }
 
 TEST_CASE("GPInstance: two pass optimization") {
@@ -183,6 +319,36 @@ TEST_CASE("GPInstance: two pass optimization") {
   for (size_t idx = 0; idx <= root; idx++) {
     CHECK_LT(fabs(engine->GetLogLikelihoods()(idx) - -84.77961943), 1e-6);
   }
+  CHECK_LT(inst.SinglePrecisionLogLikelihoodDeviation(two_pass_likelihood_computation),
+           1e-4);
+  // We get the same thing with threads.
+  engine->SetThreadCount(4);
+  engine->ProcessOperations(two_pass_likelihood_computation);
+  for (size_t idx = 0; idx <= root; idx++) {
+    CHECK_LT(fabs(engine->GetLogLikelihoods()(idx) - -84.77961943), 1e-6);
+  }
+  // And with prefetching, with and without threads.
+  engine->SetPrefetchDistance(2);
+  for (size_t thread_count : {4, 1}) {
+    engine->SetThreadCount(thread_count);
+    engine->ProcessOperations(two_pass_likelihood_computation);
+    for (size_t idx = 0; idx <= root; idx++) {
+      CHECK_LT(fabs(engine->GetLogLikelihoods()(idx) - -84.77961943), 1e-6);
+    }
+  }
+  engine->SetPrefetchDistance(0);
+  // And a few patterns at a time, with and without threads.
+  engine->SetPatternTileWidth(2);
+  for (size_t thread_count : {4, 1}) {
+    engine->SetThreadCount(thread_count);
+    engine->ProcessOperations(two_pass_likelihood_computation);
+    for (size_t idx = 0; idx <= root; idx++) {
+      CHECK_LT(fabs(engine->GetLogLikelihoods()(idx) - -84.77961943), 1e-6);
+    }
+  }
+  CHECK_LT(inst.SinglePrecisionLogLikelihoodDeviation(two_pass_likelihood_computation),
+           1e-4);
+  engine->SetPatternTileWidth(0);
 
   // Test of our log likelihood derivative code on the jupiter branch.
   auto jupiter_optimization = OptimizeRootward{PLV::phat_ttilde, PLV::p_jupiter,
@@ -199,6 +365,70 @@ TEST_CASE("GPInstance: two pass optimization") {
       (log_likelihood - original_log_likelihood) / branch_length_difference;
   CHECK_LT(fabs(derivative_estimate - log_likelihood_derivative), 1e-6);
 
+  // Check the second derivative against a finite difference of the first.
+  double branch_length = engine->GetBranchLengths()(HelloGPCSP::jupiter);
+  auto [base_log_likelihood, first_derivative, second_derivative] =
+      engine->LogLikelihoodAndTwoDerivatives(jupiter_optimization, branch_length);
+  auto shifted_first_derivative = std::get<1>(engine->LogLikelihoodAndTwoDerivatives(
+      jupiter_optimization, branch_length + branch_length_difference));
+  CHECK_LT(fabs((shifted_first_derivative - first_derivative) /
+                    branch_length_difference -
+                second_derivative),
+           1e-4);
+  // Here the likelihood goes up as the branch gets shorter, so Newton-Raphson stops
+  // at the lower bound.
+  auto statistics = engine->NewtonOptimizeRootwardBatch({jupiter_optimization});
+  CHECK(statistics[0].converged_);
+  CHECK_GE(statistics[0].log_likelihood_, base_log_likelihood);
+  CHECK_EQ(engine->GetBranchLengths()(HelloGPCSP::jupiter),
+           statistics[0].branch_length_);
+  CHECK_LT(std::get<1>(engine->LogLikelihoodAndTwoDerivatives(
+               jupiter_optimization, statistics[0].branch_length_)),
+           0.);
+  // Optimizing all of the edges at once, each ends up where its derivative either
+  // vanishes or points out of the allowed branch lengths.
+  std::vector<OptimizeRootward> edge_optimizations = {
+      jupiter_optimization,
+      OptimizeRootward{PLV::phat_stilde, PLV::p_mars, PLV::r_stilde, HelloGPCSP::mars},
+      OptimizeRootward{PLV::phat_s, PLV::p_saturn, PLV::r_s, HelloGPCSP::saturn},
+      OptimizeRootward{PLV::phat_t, PLV::p_s, PLV::r_t, HelloGPCSP::venus}};
+  engine->SetBranchLengths(branch_lengths);
+  statistics = engine->NewtonOptimizeRootwardBatch(edge_optimizations);
+  for (size_t edge_idx = 0; edge_idx < edge_optimizations.size(); edge_idx++) {
+    CHECK(statistics[edge_idx].converged_);
+    const double optimized_branch_length = statistics[edge_idx].branch_length_;
+    const double derivative = std::get<1>(engine->LogLikelihoodAndTwoDerivatives(
+        edge_optimizations[edge_idx], optimized_branch_length));
+    const bool at_lower_bound = optimized_branch_length == 1e-6 && derivative < 0.;
+    const bool at_upper_bound = optimized_branch_length == 3. && derivative > 0.;
+    CHECK((fabs(derivative) < 1e-6 || at_lower_bound || at_upper_bound));
+  }
+  // Edges in a batch have to be independent.
+  CHECK_THROWS(engine->NewtonOptimizeRootwardBatch(
+      {jupiter_optimization, OptimizeRootward{PLV::phat_t, PLV::p_s, PLV::r_t,
+                                              HelloGPCSP::jupiter}}));
+  engine->SetBranchLengths(branch_lengths);
+#ifdef LIBSBN_CUDA
+  // The CUDA engine gets the same log likelihoods, and optimizes the edges to the same
+  // branch lengths.
+  auto cuda_engine = inst.MakeCUDAEngine();
+  engine->ProcessOperations(two_pass_likelihood_computation);
+  cuda_engine->ProcessOperations(two_pass_likelihood_computation);
+  CHECK_LT((cuda_engine->GetLogLikelihoods() - engine->GetLogLikelihoods()).norm(),
+           1e-10);
+  const auto cuda_statistics =
+      cuda_engine->NewtonOptimizeRootwardBatch(edge_optimizations);
+  statistics = engine->NewtonOptimizeRootwardBatch(edge_optimizations);
+  for (size_t edge_idx = 0; edge_idx < edge_optimizations.size(); edge_idx++) {
+    CHECK_EQ(cuda_statistics[edge_idx].converged_, statistics[edge_idx].converged_);
+    CHECK_LT(fabs(cuda_statistics[edge_idx].log_likelihood_ -
+                  statistics[edge_idx].log_likelihood_),
+             1e-8);
+  }
+  CHECK_LT((cuda_engine->GetBranchLengths() - engine->GetBranchLengths()).norm(), 1e-8);
+  engine->SetBranchLengths(branch_lengths);
+#endif
+
   // Trying out optimization.
   for (size_t pass_idx = 0; pass_idx < 8; ++pass_idx) {
     engine->ProcessOperations(two_pass_optimization);
@@ -206,3 +436,103 @@ TEST_CASE("GPInstance: two pass optimization") {
   std::cout << engine->GetBranchLengths() << std::endl;
   std::cout << engine->GetLogLikelihoods() << std::endl;
 }
+
+TEST_CASE("GPInstance: memory budget") {
+  GPInstance inst("_ignore/mmapped_plv.data", MmapBacking::Anonymous);
+  inst.ReadFastaFile("data/hello.fasta");
+  inst.ReadNewickFile("data/hello_rooted.nwk");
+  const auto byte_counts = inst.EstimateEngineByteCounts();
+  // The hello alignment has 15 site patterns, and we have 5 GPCSPs. The DAG has 5
+  // nodes, so its schedules need 6 * 5 + 2 * 5 PLVs.
+  CHECK_EQ(byte_counts.at("plvs"), (6 * 5 + 2 * 5) * 15 * 4 * sizeof(double));
+  const size_t gpcsp_byte_count = byte_counts.at("gpcsp_data");
+  CHECK_EQ(GPEngine::EstimateByteCounts(15, 5).at("gpcsp_data"), gpcsp_byte_count);
+  CHECK_EQ(SinglePrecisionGPEngine::EstimateByteCounts(15, 5).at("plvs"),
+           (15 + 5) * 15 * (4 * sizeof(float) + sizeof(int)));
+  const size_t total = MemoryBudget::TotalByteCount(byte_counts);
+  CHECK_NOTHROW(inst.MakeEngine(SitePatternOrder::FirstAppearance, total));
+  // Without room for the PLVs, they go to a file.
+  CHECK_NOTHROW(inst.MakeEngine(SitePatternOrder::FirstAppearance, gpcsp_byte_count));
+  CHECK_THROWS(inst.MakeEngine(SitePatternOrder::FirstAppearance, 0));
+  GPInstance no_file_inst("", MmapBacking::Anonymous);
+  no_file_inst.ReadFastaFile("data/hello.fasta");
+  no_file_inst.ReadNewickFile("data/hello_rooted.nwk");
+  CHECK_THROWS(
+      no_file_inst.MakeEngine(SitePatternOrder::FirstAppearance, gpcsp_byte_count));
+}
+
+TEST_CASE("GPInstance: SubsplitDAG schedules") {
+  auto inst = MakeHelloGPInstance(MmapBacking::Anonymous);
+  const auto dag = inst.GetSubsplitDAG();
+  // The rootsplit, the venus PCSS, and a leaf GPCSP for each of our three taxa.
+  CHECK_EQ(dag->GPCSPCount(), 5);
+  EigenVectorXd branch_lengths(dag->GPCSPCount());
+  branch_lengths << 0., 0.22, 0.113, 0.15, 0.1;
+  const size_t venus_gpcsp = 1;
+  GPEngine* engine = inst.GetEngine();
+  engine->SetBranchLengths(branch_lengths);
+  engine->ProcessOperations(dag->RootwardPass());
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(0) - -84.77961943), 1e-6);
+  engine->ProcessOperations(dag->LeafwardPass());
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(venus_gpcsp) - -84.77961943), 1e-6);
+  // Threads and pattern tiles don't change anything.
+  engine->SetThreadCount(2);
+  engine->SetPatternTileWidth(4);
+  engine->ProcessOperations(dag->RootwardPass());
+  engine->ProcessOperations(dag->LeafwardPass());
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(0) - -84.77961943), 1e-6);
+  CHECK_LT(fabs(engine->GetLogLikelihoods()(venus_gpcsp) - -84.77961943), 1e-6);
+  // We can save the DAG and use it again with just the alignment.
+  inst.SaveSubsplitDAG("_ignore/hello_subsplit_dag.data");
+  GPInstance loaded_inst("_ignore/mmapped_plv.data", MmapBacking::Anonymous);
+  loaded_inst.ReadFastaFile("data/hello.fasta");
+  loaded_inst.LoadSubsplitDAG("_ignore/hello_subsplit_dag.data");
+  loaded_inst.MakeEngine();
+  loaded_inst.GetEngine()->SetBranchLengths(branch_lengths);
+  loaded_inst.GetEngine()->ProcessOperations(
+      loaded_inst.GetSubsplitDAG()->RootwardPass());
+  CHECK_LT(fabs(loaded_inst.GetEngine()->GetLogLikelihoods()(0) - -84.77961943), 1e-6);
+}
+
+TEST_CASE("GPInstance: SubsplitDAG schedules with several trees") {
+  GPInstance inst("_ignore/mmapped_plv.data", MmapBacking::Anonymous);
+  inst.ReadFastaFile("data/five_taxon.fasta");
+  inst.ReadNewickFile("data/five_taxon_rooted.nwk");
+  inst.MakeEngine();
+  const auto dag = inst.GetSubsplitDAG();
+  GPEngine* engine = inst.GetEngine();
+  engine->SetBranchLengths(EigenVectorXd::Constant(dag->GPCSPCount(), 0.1));
+  // The second tree, (x0,(((x1,x3),x2),x4)).
+  const auto topology = Node::OfParentIdVector({8, 5, 6, 5, 7, 6, 7, 8});
+  const auto representation = RootedSBNMaps::RootedIndexerRepresentationOf(
+      dag->Indexer(), topology, dag->GPCSPCount());
+  // With q putting all of its weight on that tree, the DAG gives its likelihood.
+  EigenVectorXd q = EigenVectorXd::Zero(dag->GPCSPCount());
+  for (const auto gpcsp_idx : representation) {
+    q(gpcsp_idx) = 1.;
+  }
+  q.tail(dag->TaxonCount()).setOnes();
+  engine->SetQ(q);
+  engine->ProcessOperations(dag->RootwardPass());
+  engine->ProcessOperations(dag->LeafwardPass());
+  const EigenVectorXd log_likelihoods = engine->GetLogLikelihoods();
+  // With the uniform q, every rootsplit and PCSS has a likelihood.
+  engine->SetQ(dag->UniformQ());
+  engine->ProcessOperations(dag->RootwardPass());
+  engine->ProcessOperations(dag->LeafwardPass());
+  CHECK(engine->GetLogLikelihoods().head(dag->ParameterCount()).allFinite());
+  // We get the likelihood of that tree from its DAG alone, which makes a new engine.
+  Node::TopologyCounter topologies;
+  topologies[topology] = 1;
+  inst.UseSubsplitDAG(SubsplitDAG::OfRootedTopologies(dag->TaxonNames(), topologies));
+  inst.MakeEngine();
+  const auto tree_dag = inst.GetSubsplitDAG();
+  CHECK_EQ(tree_dag->ParameterCount(), 4);
+  inst.GetEngine()->SetBranchLengths(
+      EigenVectorXd::Constant(tree_dag->GPCSPCount(), 0.1));
+  inst.GetEngine()->ProcessOperations(tree_dag->RootwardPass());
+  const double tree_log_likelihood = inst.GetEngine()->GetLogLikelihoods()(0);
+  for (const auto gpcsp_idx : representation) {
+    CHECK_LT(fabs(log_likelihoods(gpcsp_idx) - tree_log_likelihood), 1e-8);
+  }
+}
@@ -2,68 +2,259 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "gp_engine.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include "optimization.hpp"
 
-GPEngine::GPEngine(SitePattern site_pattern, size_t gpcsp_count,
-                   std::string mmap_file_path)
+// A PLV has the fixed height StateCount, so Eigen evaluates the PLV operations below
+// with fixed-size SIMD code for whatever instruction set we compile for (see the
+// --native option of SConstruct). When the destination of a product isn't its
+// source, we use noalias to skip the temporary that Eigen otherwise makes.
+
+namespace {
+
+// A checkpoint file is this header followed by the branch lengths, log likelihoods
+// and q as doubles, then for engines that store floats the PLV exponents as ints. As
+// for SBNSnapshot, numbers are in the byte order of the machine that wrote the file.
+struct CheckpointHeader {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t byte_order_mark_;
+  uint64_t fingerprint_;
+  uint32_t scalar_size_;
+  uint32_t reserved_;
+  uint64_t pattern_count_;
+  uint64_t plv_count_;
+  uint64_t gpcsp_count_;
+  uint64_t branch_length_count_;
+  uint64_t plv_checksum_;
+};
+
+constexpr char checkpoint_magic[8] = {'L', 'I', 'B', 'S', 'B', 'N', 'G', 'P'};
+// Bump this whenever the layout changes.
+constexpr uint32_t checkpoint_version = 1;
+constexpr uint32_t byte_order_mark = 0x01020304;
+
+// Fold a value into a hash with the splitmix64 finalizer, as in Bitset::Hash.
+uint64_t HashCombine(uint64_t hash, uint64_t value) {
+  uint64_t x = hash ^ value;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x + 0x9e3779b97f4a7c15ULL;
+}
+
+}  // namespace
+
+template <typename PLVScalar, Eigen::Index StateCount>
+GenericGPEngine<PLVScalar, StateCount>::GenericGPEngine(
+    SitePattern site_pattern, size_t gpcsp_count, std::string mmap_file_path,
+    MmapBacking mmap_backing, std::optional<uint64_t> dag_fingerprint,
+    std::optional<size_t> plv_count)
     : site_pattern_(std::move(site_pattern)),
-      plv_count_(site_pattern_.PatternCount() + gpcsp_count),
-      mmapped_master_plv_(mmap_file_path, plv_count_ * site_pattern_.PatternCount()) {
+      plv_count_(plv_count.value_or(
+          DefaultPLVCount(site_pattern_.PatternCount(), gpcsp_count))),
+      mmap_file_path_(mmap_file_path),
+      mmapped_master_plv_(mmap_file_path, plv_count_ * site_pattern_.PatternCount(),
+                          mmap_backing) {
   Assert(plv_count_ > 0, "Zero PLV count in constructor of GPEngine.");
   plvs_ = mmapped_master_plv_.Subdivide(plv_count_);
   Assert(plvs_.size() == plv_count_,
          "Didn't get the right number of PLVs out of Subdivide.");
-  Assert(plvs_.back().rows() == MmappedNucleotidePLV::base_count_ &&
+  Assert(plvs_.back().rows() == StateCount &&
              plvs_.back().cols() == site_pattern_.PatternCount(),
          "Didn't get the right shape of PLVs out of Subdivide.");
   branch_lengths_.resize(gpcsp_count);
-  log_likelihoods_.resize(gpcsp_count);
-  q_.resize(gpcsp_count);
+  transition_matrix_cache_.resize(gpcsp_count);
+  log_likelihoods_.setZero(gpcsp_count);
+  q_.setOnes(gpcsp_count);
+  if constexpr (rescaling_) {
+    plv_exponents_.assign(plv_count_ * site_pattern_.PatternCount(), 0);
+  }
 
   auto weights = site_pattern_.GetWeights();
   site_pattern_weights_ =
       Eigen::Map<Eigen::VectorXd, Eigen::Unaligned>(weights.data(), weights.size());
 
-  InitializePLVsWithSitePatterns();
+  if (dag_fingerprint.has_value()) {
+    Assert(mmap_backing == MmapBacking::File,
+           "GPEngine can only checkpoint PLVs that are in a file.");
+    uint64_t fingerprint = HashCombine(*dag_fingerprint, site_pattern_.PatternCount());
+    for (const auto& symbols : site_pattern_.GetPatterns()) {
+      for (const auto symbol : symbols) {
+        fingerprint = HashCombine(fingerprint, static_cast<uint64_t>(symbol));
+      }
+    }
+    for (const auto weight : weights) {
+      uint64_t weight_bits;
+      std::memcpy(&weight_bits, &weight, sizeof(weight_bits));
+      fingerprint = HashCombine(fingerprint, weight_bits);
+    }
+    checkpoint_fingerprint_ = fingerprint;
+    checkpoint_resume_ = ResumeFromCheckpoint();
+  }
+  if (checkpoint_resume_ != GPCheckpointResume::Everything) {
+    InitializePLVsWithSitePatterns();
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(const GPOperations::Zero& op) {
+  AssertPLVIndex(op.dest_idx);
+  ZeroKernel(op.dest_idx, AllColumns());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::SetToStationaryDistribution& op) {
+  AssertPLVIndex(op.dest_idx);
+  StationaryDistributionKernel(op.dest_idx, AllColumns());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::WeightedSumAccumulate& op) {
+  if constexpr (rescaling_) {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.src_idx);
+    // Bring both columns to the larger of their exponents before adding them.
+    for (Eigen::Index col_idx = 0; col_idx < plvs_[op.dest_idx].cols(); col_idx++) {
+      const int dest_exponent = Exponent(op.dest_idx, col_idx);
+      const int src_exponent = Exponent(op.src_idx, col_idx);
+      const int exponent = std::max(dest_exponent, src_exponent);
+      StoreColumn(op.dest_idx, col_idx,
+                  std::ldexp(1., dest_exponent - exponent) *
+                          plvs_[op.dest_idx].col(col_idx).template cast<double>() +
+                      q_(op.q_idx) * std::ldexp(1., src_exponent - exponent) *
+                          plvs_[op.src_idx].col(col_idx).template cast<double>(),
+                  exponent);
+    }
+  } else {
+    plvs_.at(op.dest_idx) += q_(op.q_idx) * plvs_.at(op.src_idx);
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ZeroKernel(
+    size_t dest_idx, Columns columns) {
+  plvs_[dest_idx].middleCols(columns.begin_, columns.count_).setZero();
+  ZeroExponents(dest_idx, columns);
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::StationaryDistributionKernel(
+    size_t dest_idx, Columns columns) {
+  plvs_[dest_idx].middleCols(columns.begin_, columns.count_).colwise() =
+      stationary_distribution_.template cast<PLVScalar>();
+  ZeroExponents(dest_idx, columns);
 }
 
-void GPEngine::operator()(const GPOperations::Zero& op) {
-  plvs_.at(op.dest_idx).setZero();
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::MultiplyKernel(
+    const GPOperations::Multiply& op, Columns columns) {
+  if constexpr (rescaling_) {
+    for (Eigen::Index col_idx = columns.begin_;
+         col_idx < columns.begin_ + columns.count_; col_idx++) {
+      StoreColumn(op.dest_idx, col_idx,
+                  plvs_[op.src1_idx].col(col_idx).template cast<double>().cwiseProduct(
+                      plvs_[op.src2_idx].col(col_idx).template cast<double>()),
+                  Exponent(op.src1_idx, col_idx) + Exponent(op.src2_idx, col_idx));
+    }
+  } else {
+    plvs_[op.dest_idx].middleCols(columns.begin_, columns.count_).array() =
+        plvs_[op.src1_idx].middleCols(columns.begin_, columns.count_).array() *
+        plvs_[op.src2_idx].middleCols(columns.begin_, columns.count_).array();
+  }
 }
 
-void GPEngine::operator()(const GPOperations::SetToStationaryDistribution& op) {
-  auto& plv = plvs_.at(op.dest_idx);
-  for (size_t row_idx = 0; row_idx < plv.rows(); ++row_idx) {
-    plv.row(row_idx).array() = stationary_distribution_(row_idx);
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::EvolveKernel(const StateMatrix& matrix,
+                                                          size_t dest_idx,
+                                                          size_t src_idx,
+                                                          Columns columns) {
+  if constexpr (rescaling_) {
+    for (Eigen::Index col_idx = columns.begin_;
+         col_idx < columns.begin_ + columns.count_; col_idx++) {
+      StoreColumn(dest_idx, col_idx,
+                  matrix * plvs_[src_idx].col(col_idx).template cast<double>(),
+                  Exponent(src_idx, col_idx));
+    }
+  } else {
+    auto dest = plvs_[dest_idx].middleCols(columns.begin_, columns.count_);
+    const auto src = plvs_[src_idx].middleCols(columns.begin_, columns.count_);
+    if (dest_idx == src_idx) {
+      dest = matrix * src;
+    } else {
+      dest.noalias() = matrix * src;
+    }
   }
 }
 
-void GPEngine::operator()(const GPOperations::WeightedSumAccumulate& op) {
-  Failwith("Draft: this method has not been tested.");
-  plvs_.at(op.dest_idx) += q_(op.q_idx) * plvs_.at(op.src_idx);
+// We go column by column so that each column of the evolved PLV is multiplied while
+// it is still in registers. Because each column only depends on the same column of
+// the sources, this is correct whatever the overlap between the indices.
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::EvolveAndMultiplyKernel(
+    const StateMatrix& matrix, size_t dest_idx, size_t evolve_dest_idx,
+    size_t src_idx, size_t other_idx, Columns columns) {
+  auto& dest = plvs_[dest_idx];
+  auto& evolve_dest = plvs_[evolve_dest_idx];
+  const auto& src = plvs_[src_idx];
+  const auto& other = plvs_[other_idx];
+  for (Eigen::Index col_idx = columns.begin_;
+       col_idx < columns.begin_ + columns.count_; col_idx++) {
+    if constexpr (rescaling_) {
+      const StateVector evolved = matrix * src.col(col_idx).template cast<double>();
+      const StateVector product =
+          evolved.cwiseProduct(other.col(col_idx).template cast<double>());
+      const int evolved_exponent = Exponent(src_idx, col_idx);
+      const int product_exponent = evolved_exponent + Exponent(other_idx, col_idx);
+      StoreColumn(evolve_dest_idx, col_idx, evolved, evolved_exponent);
+      StoreColumn(dest_idx, col_idx, product, product_exponent);
+    } else {
+      const StateVector evolved = matrix * src.col(col_idx);
+      evolve_dest.col(col_idx) = evolved;
+      dest.col(col_idx) = evolved.cwiseProduct(other.col(col_idx));
+    }
+  }
 }
 
-void GPEngine::operator()(const GPOperations::Multiply& op) {
-  plvs_.at(op.dest_idx).array() =
-      plvs_.at(op.src1_idx).array() * plvs_.at(op.src2_idx).array();
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::Multiply& op) {
+  ProcessMultiplyBatch({op});
 }
 
-void GPEngine::operator()(const GPOperations::Likelihood& op) {
-  log_likelihoods_(op.dest_idx) = LogLikelihood(op.src1_idx, op.src2_idx);
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::Likelihood& op) {
+  log_likelihoods_(op.dest_idx) = LogLikelihood(op.src1_idx, op.src2_idx, AllColumns());
 }
 
-void GPEngine::operator()(const GPOperations::EvolveRootward& op) {
-  SetTransitionMatrixToHaveBranchLength(branch_lengths_(op.branch_length_idx));
-  plvs_.at(op.dest_idx) = transition_matrix_ * plvs_.at(op.src_idx);
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::EvolveRootward& op) {
+  ProcessEvolveRootwardBatch({op});
 }
 
-void GPEngine::operator()(const GPOperations::EvolveLeafward& op) {
-  SetTransitionMatrixToHaveBranchLengthAndTranspose(
-      branch_lengths_(op.branch_length_idx));
-  plvs_.at(op.dest_idx) = transition_matrix_ * plvs_.at(op.src_idx);
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::EvolveLeafward& op) {
+  ProcessEvolveLeafwardBatch({op});
 }
 
-void GPEngine::operator()(const GPOperations::OptimizeRootward& op) {
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::OptimizeRootward& op) {
   auto starting_branch_length = branch_lengths_(op.branch_length_idx);
   std::cout << "starting branch length: " << starting_branch_length << std::endl;
   GradientAscentOptimization(op);
@@ -76,85 +267,779 @@ void GPEngine::operator()(const GPOperations::OptimizeRootward& op) {
             << std::endl;
 }
 
-void GPEngine::operator()(const GPOperations::OptimizeLeafward& op) {
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::OptimizeLeafward& op) {
   Failwith("OptimizeRootward unimplemented for now.");
 }
 
-void GPEngine::operator()(const GPOperations::UpdateSBNProbabilities& op) {
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::UpdateSBNProbabilities& op) {
   Failwith("UpdateSBNProbabilities unimplemented for now.");
 }
 
-void GPEngine::ProcessOperations(GPOperationVector operations) {
-  for (const auto& operation : operations) {
-    std::visit(*this, operation);
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::EvolveRootwardAndMultiply& op) {
+  AssertEvolveAndMultiplyIndices(op);
+  EvolveAndMultiplyKernel(CachedTransitionMatrices(op.branch_length_idx).transition_,
+                          op.dest_idx, op.evolve_dest_idx, op.src_idx, op.other_idx,
+                          AllColumns());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::EvolveLeafwardAndMultiply& op) {
+  AssertEvolveAndMultiplyIndices(op);
+  EvolveAndMultiplyKernel(
+      CachedTransitionMatrices(op.branch_length_idx).transposed_transition_,
+      op.dest_idx, op.evolve_dest_idx, op.src_idx, op.other_idx, AllColumns());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::operator()(
+    const GPOperations::ZeroAndAccumulate& op) {
+  AssertPLVIndex(op.dest_idx);
+  AssertPLVIndex(op.src_idx);
+  ZeroAndAccumulateKernel(op, AllColumns());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ZeroAndAccumulateKernel(
+    const GPOperations::ZeroAndAccumulate& op, Columns columns) {
+  if constexpr (rescaling_) {
+    for (Eigen::Index col_idx = columns.begin_;
+         col_idx < columns.begin_ + columns.count_; col_idx++) {
+      StoreColumn(op.dest_idx, col_idx,
+                  q_(op.q_idx) * plvs_[op.src_idx].col(col_idx).template cast<double>(),
+                  Exponent(op.src_idx, col_idx));
+    }
+  } else {
+    plvs_[op.dest_idx].middleCols(columns.begin_, columns.count_) =
+        q_(op.q_idx) * plvs_[op.src_idx].middleCols(columns.begin_, columns.count_);
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessOperations(
+    GPOperationVector operations) {
+  operations = GPOperations::Fuse(operations);
+  // Compute the matrices for every branch of the sweep in one batch. Optimization
+  // changes branch lengths along the way, and later operations on those branches
+  // recompute their entries as they go.
+  PrepareTransitionMatrices(operations);
+  const bool managing_plvs = prefetch_distance_ > 0 || !temporary_plvs_.empty();
+  if (pattern_tile_width_ > 0 && !managing_plvs) {
+    ProcessTiled(operations);
+    return;
+  }  // else
+  if (thread_pool_ == nullptr && !managing_plvs) {
+    for (const auto& operation : operations) {
+      std::visit(*this, operation);
+    }
+    return;
+  }  // else
+  std::vector<GPOperationVector> steps;
+  if (thread_pool_ == nullptr) {
+    steps.reserve(operations.size());
+    for (const auto& operation : operations) {
+      steps.push_back({operation});
+    }
+  } else {
+    steps = GPOperations::DependencyLevels(operations);
+  }
+  if (!managing_plvs) {
+    for (const auto& step : steps) {
+      ProcessStep(step);
+    }
+    return;
+  }  // else
+  SizeVectorVector step_plv_indices(steps.size());
+  for (size_t step_idx = 0; step_idx < steps.size(); step_idx++) {
+    for (const auto& operation : steps[step_idx]) {
+      for (const auto plv_idx : GPOperations::PLVIndices(operation)) {
+        AssertPLVIndex(plv_idx);
+        step_plv_indices[step_idx].push_back(plv_idx);
+      }
+    }
+  }
+  const auto live_intervals = GPOperations::PLVLiveIntervals(steps);
+  for (const auto plv_idx : temporary_plvs_) {
+    auto search = live_intervals.find(plv_idx);
+    if (search != live_intervals.end() && search->second.read_before_write_) {
+      Failwith("Temporary PLV " + std::to_string(plv_idx) +
+               " is read before it is written in GPEngine::ProcessOperations.");
+    }
+  }
+  const auto advise_will_need = [this, &step_plv_indices](size_t step_idx) {
+    for (const auto plv_idx : step_plv_indices[step_idx]) {
+      mmapped_master_plv_.AdviseWillNeed(plvs_[plv_idx]);
+    }
+  };
+  // Before the first step we haven't prefetched anything, so we catch up.
+  for (size_t step_idx = 0; step_idx < std::min(prefetch_distance_, steps.size());
+       step_idx++) {
+    advise_will_need(step_idx);
+  }
+  for (size_t step_idx = 0; step_idx < steps.size(); step_idx++) {
+    if (prefetch_distance_ > 0 && step_idx + prefetch_distance_ < steps.size()) {
+      advise_will_need(step_idx + prefetch_distance_);
+    }
+    ProcessStep(steps[step_idx]);
+    // Once the last step using a PLV is done, we either free a temporary or advise
+    // that we are done with it.
+    for (const auto plv_idx : step_plv_indices[step_idx]) {
+      if (live_intervals.at(plv_idx).last_use_ != step_idx) {
+        continue;
+      }  // else
+      if (temporary_plvs_.count(plv_idx) > 0) {
+        mmapped_master_plv_.Release(plvs_[plv_idx]);
+      } else if (prefetch_distance_ > 0) {
+        mmapped_master_plv_.AdviseDone(plvs_[plv_idx]);
+      }
+    }
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::SetTemporaryPLVs(
+    const SizeVector& plv_indices) {
+  for (const auto plv_idx : plv_indices) {
+    AssertPLVIndex(plv_idx);
+  }
+  temporary_plvs_ = std::unordered_set<size_t>(plv_indices.begin(), plv_indices.end());
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessStep(
+    const GPOperationVector& step) {
+  if (step.size() == 1) {
+    std::visit(*this, step.front());
+  } else {
+    PrepareTransitionMatrices(step);
+    thread_pool_->Run(step.size(), [this, &step](size_t, size_t operation_idx) {
+      std::visit(*this, step[operation_idx]);
+    });
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+bool GenericGPEngine<PLVScalar, StateCount>::IsTileable(const GPOperation& operation) {
+  return !(std::holds_alternative<GPOperations::WeightedSumAccumulate>(operation) ||
+           std::holds_alternative<GPOperations::OptimizeRootward>(operation) ||
+           std::holds_alternative<GPOperations::OptimizeLeafward>(operation) ||
+           std::holds_alternative<GPOperations::UpdateSBNProbabilities>(operation));
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessTiled(
+    const GPOperationVector& operations) {
+  auto stretch_begin = operations.begin();
+  while (stretch_begin != operations.end()) {
+    const auto stretch_end = std::find_if_not(stretch_begin, operations.end(),
+                                              GenericGPEngine::IsTileable);
+    if (stretch_begin == stretch_end) {
+      std::visit(*this, *stretch_begin);
+      ++stretch_begin;
+    } else {
+      ProcessTiledStretch(GPOperationVector(stretch_begin, stretch_end));
+      stretch_begin = stretch_end;
+    }
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessTiledStretch(
+    const GPOperationVector& stretch) {
+  for (const auto& operation : stretch) {
+    for (const auto plv_idx : GPOperations::PLVIndices(operation)) {
+      AssertPLVIndex(plv_idx);
+    }
+  }
+  // An optimization before this stretch may have changed branch lengths, and the
+  // tiles should only read the cache.
+  PrepareTransitionMatrices(stretch);
+  const size_t pattern_count = site_pattern_.PatternCount();
+  const size_t tile_count =
+      (pattern_count + pattern_tile_width_ - 1) / pattern_tile_width_;
+  std::vector<std::vector<double>> partial_log_likelihoods(
+      tile_count, std::vector<double>(stretch.size(), 0.));
+  const auto process_tile = [this, &stretch, &partial_log_likelihoods,
+                             pattern_count](size_t tile_idx) {
+    const size_t begin = tile_idx * pattern_tile_width_;
+    const size_t count = std::min(pattern_tile_width_, pattern_count - begin);
+    ProcessTile(stretch,
+                {static_cast<Eigen::Index>(begin), static_cast<Eigen::Index>(count)},
+                partial_log_likelihoods[tile_idx]);
+  };
+  if (thread_pool_ == nullptr) {
+    for (size_t tile_idx = 0; tile_idx < tile_count; tile_idx++) {
+      process_tile(tile_idx);
+    }
+  } else {
+    thread_pool_->Run(tile_count, [&process_tile](size_t, size_t tile_idx) {
+      process_tile(tile_idx);
+    });
+  }
+  for (size_t operation_idx = 0; operation_idx < stretch.size(); operation_idx++) {
+    const auto* op = std::get_if<GPOperations::Likelihood>(&stretch[operation_idx]);
+    if (op == nullptr) {
+      continue;
+    }  // else
+    double log_likelihood = 0.;
+    for (const auto& tile_log_likelihoods : partial_log_likelihoods) {
+      log_likelihood += tile_log_likelihoods[operation_idx];
+    }
+    log_likelihoods_(op->dest_idx) = log_likelihood;
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessTile(
+    const GPOperationVector& stretch, Columns columns,
+    std::vector<double>& partial_log_likelihoods) {
+  using namespace GPOperations;
+  for (size_t operation_idx = 0; operation_idx < stretch.size(); operation_idx++) {
+    const auto process = [this, columns, &partial_log_likelihoods,
+                          operation_idx](const auto& op) {
+      using Operation = std::decay_t<decltype(op)>;
+      if constexpr (std::is_same_v<Operation, Zero>) {
+        ZeroKernel(op.dest_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, SetToStationaryDistribution>) {
+        StationaryDistributionKernel(op.dest_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, Multiply>) {
+        MultiplyKernel(op, columns);
+      } else if constexpr (std::is_same_v<Operation, Likelihood>) {
+        partial_log_likelihoods[operation_idx] =
+            LogLikelihood(op.src1_idx, op.src2_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, EvolveRootward>) {
+        EvolveKernel(CachedTransitionMatrices(op.branch_length_idx).transition_,
+                     op.dest_idx, op.src_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, EvolveLeafward>) {
+        EvolveKernel(
+            CachedTransitionMatrices(op.branch_length_idx).transposed_transition_,
+            op.dest_idx, op.src_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, EvolveRootwardAndMultiply>) {
+        EvolveAndMultiplyKernel(
+            CachedTransitionMatrices(op.branch_length_idx).transition_, op.dest_idx,
+            op.evolve_dest_idx, op.src_idx, op.other_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, EvolveLeafwardAndMultiply>) {
+        EvolveAndMultiplyKernel(
+            CachedTransitionMatrices(op.branch_length_idx).transposed_transition_,
+            op.dest_idx, op.evolve_dest_idx, op.src_idx, op.other_idx, columns);
+      } else if constexpr (std::is_same_v<Operation, ZeroAndAccumulate>) {
+        ZeroAndAccumulateKernel(op, columns);
+      } else {
+        Failwith("This operation can't be run a tile at a time in GPEngine.");
+      }
+    };
+    std::visit(process, stretch[operation_idx]);
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::SetThreadCount(size_t thread_count) {
+  Assert(thread_count > 0, "GPEngine needs at least one thread.");
+  if (thread_count == GetThreadCount()) {
+    return;
+  }  // else
+  thread_pool_.reset();
+  if (thread_count > 1) {
+    std::vector<size_t> thread_indices(thread_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    thread_pool_ = std::make_unique<WorkStealingPool<size_t>>(thread_indices);
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+size_t GenericGPEngine<PLVScalar, StateCount>::GetThreadCount() const {
+  return thread_pool_ == nullptr ? 1 : thread_pool_->ExecutorCount();
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessMultiplyBatch(
+    const std::vector<GPOperations::Multiply>& operations) {
+  for (const auto& op : operations) {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.src1_idx);
+    AssertPLVIndex(op.src2_idx);
+  }
+  for (const auto& op : operations) {
+    MultiplyKernel(op, AllColumns());
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessEvolveRootwardBatch(
+    const std::vector<GPOperations::EvolveRootward>& operations) {
+  for (const auto& op : operations) {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.src_idx);
+    AssertBranchLengthIndex(op.branch_length_idx);
+  }
+  for (const auto& op : operations) {
+    EvolveKernel(CachedTransitionMatrices(op.branch_length_idx).transition_,
+                 op.dest_idx, op.src_idx, AllColumns());
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::ProcessEvolveLeafwardBatch(
+    const std::vector<GPOperations::EvolveLeafward>& operations) {
+  for (const auto& op : operations) {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.src_idx);
+    AssertBranchLengthIndex(op.branch_length_idx);
+  }
+  for (const auto& op : operations) {
+    EvolveKernel(CachedTransitionMatrices(op.branch_length_idx).transposed_transition_,
+                 op.dest_idx, op.src_idx, AllColumns());
   }
 }
 
-void GPEngine::SetTransitionMatrixToHaveBranchLength(double branch_length) {
-  diagonal_matrix_.diagonal() = (branch_length * eigenvalues_).array().exp();
-  transition_matrix_ = eigenmatrix_ * diagonal_matrix_ * inverse_eigenmatrix_;
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::SetTransitionMatrixToHaveBranchLength(
+    double branch_length) {
+  transition_matrix_ = TransitionMatrix(branch_length);
 }
 
-void GPEngine::SetTransitionAndDerivativeMatricesToHaveBranchLength(
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<
+    PLVScalar, StateCount>::SetTransitionAndDerivativeMatricesToHaveBranchLength(
     double branch_length) {
-  Eigen::Vector4d diagonal_vector = (branch_length * eigenvalues_).array().exp();
-  diagonal_matrix_.diagonal() = diagonal_vector;
-  transition_matrix_ = eigenmatrix_ * diagonal_matrix_ * inverse_eigenmatrix_;
-  diagonal_matrix_.diagonal() = diagonal_vector.array() * eigenvalues_.array();
-  derivative_matrix_ = eigenmatrix_ * diagonal_matrix_ * inverse_eigenmatrix_;
+  transition_matrix_ = TransitionMatrix(branch_length);
+  derivative_matrix_ = DerivativeMatrix(branch_length);
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<
+    PLVScalar, StateCount>::SetTransitionMatrixToHaveBranchLengthAndTranspose(
+    double branch_length) {
+  transition_matrix_ = TransposedTransitionMatrix(branch_length);
+}
+
+// For the equal-rates model on n states, P_ii(t) = 1/n + (n-1)/n exp(-nt/(n-1)) and
+// P_ij(t) = 1/n - 1/n exp(-nt/(n-1)). For JC69, n is 4.
+template <typename PLVScalar, Eigen::Index StateCount>
+StateMatrixOf<StateCount> GenericGPEngine<PLVScalar, StateCount>::TransitionMatrix(
+    double branch_length) const {
+  if constexpr (equal_rates_) {
+    constexpr double n = StateCount;
+    const double decay = std::exp(-n / (n - 1.) * branch_length);
+    StateMatrix matrix = StateMatrix::Constant((1. - decay) / n);
+    matrix.diagonal().setConstant((1. + (n - 1.) * decay) / n);
+    return matrix;
+  } else {
+    const Eigen::DiagonalMatrix<double, StateCount> diagonal_matrix(
+        (branch_length * eigenvalues_).array().exp().matrix());
+    return eigenmatrix_ * diagonal_matrix * inverse_eigenmatrix_;
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+StateMatrixOf<StateCount>
+GenericGPEngine<PLVScalar, StateCount>::TransposedTransitionMatrix(
+    double branch_length) const {
+  return TransitionMatrix(branch_length).transpose();
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+StateMatrixOf<StateCount> GenericGPEngine<PLVScalar, StateCount>::DerivativeMatrix(
+    double branch_length) const {
+  if constexpr (equal_rates_) {
+    constexpr double n = StateCount;
+    const double decay = std::exp(-n / (n - 1.) * branch_length);
+    StateMatrix matrix = StateMatrix::Constant(decay / (n - 1.));
+    matrix.diagonal().setConstant(-decay);
+    return matrix;
+  } else {
+    const Eigen::DiagonalMatrix<double, StateCount> diagonal_matrix(
+        ((branch_length * eigenvalues_).array().exp() * eigenvalues_.array())
+            .matrix());
+    return eigenmatrix_ * diagonal_matrix * inverse_eigenmatrix_;
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+StateMatrixOf<StateCount>
+GenericGPEngine<PLVScalar, StateCount>::SecondDerivativeMatrix(
+    double branch_length) const {
+  if constexpr (equal_rates_) {
+    constexpr double n = StateCount;
+    const double decay = std::exp(-n / (n - 1.) * branch_length);
+    StateMatrix matrix = StateMatrix::Constant(-n / ((n - 1.) * (n - 1.)) * decay);
+    matrix.diagonal().setConstant(n / (n - 1.) * decay);
+    return matrix;
+  } else {
+    const Eigen::DiagonalMatrix<double, StateCount> diagonal_matrix(
+        ((branch_length * eigenvalues_).array().exp() * eigenvalues_.array().square())
+            .matrix());
+    return eigenmatrix_ * diagonal_matrix * inverse_eigenmatrix_;
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+const typename GenericGPEngine<PLVScalar, StateCount>::TransitionMatrices&
+GenericGPEngine<PLVScalar, StateCount>::CachedTransitionMatrices(
+    size_t branch_length_idx) {
+  const auto& matrices = transition_matrix_cache_[branch_length_idx];
+  if (matrices.branch_length_ != branch_lengths_(branch_length_idx)) {
+    RefreshTransitionMatrices({branch_length_idx});
+  }
+  return matrices;
+}
+
+// The kernel writes each matrix in row-major order.
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::RefreshTransitionMatrices(
+    const SizeVector& branch_length_indices) {
+  const size_t matrix_size = transition_matrix_kernel_.MatrixSize();
+  std::vector<double> branch_lengths;
+  branch_lengths.reserve(branch_length_indices.size());
+  for (const auto idx : branch_length_indices) {
+    branch_lengths.push_back(branch_lengths_(idx));
+  }
+  std::vector<double> transitions(branch_lengths.size() * matrix_size);
+  std::vector<double> derivatives(transitions.size());
+  transition_matrix_kernel_.Compute(branch_lengths.data(), branch_lengths.size(),
+                                    unit_rate_, transitions.data(), derivatives.data());
+  using RowMajorStateMatrix =
+      Eigen::Matrix<double, StateCount, StateCount, Eigen::RowMajor>;
+  for (size_t i = 0; i < branch_length_indices.size(); i++) {
+    auto& matrices = transition_matrix_cache_[branch_length_indices[i]];
+    matrices.transition_ =
+        Eigen::Map<const RowMajorStateMatrix>(transitions.data() + i * matrix_size);
+    matrices.transposed_transition_ = matrices.transition_.transpose();
+    matrices.derivative_ =
+        Eigen::Map<const RowMajorStateMatrix>(derivatives.data() + i * matrix_size);
+    matrices.branch_length_ = branch_lengths[i];
+  }
 }
 
-void GPEngine::SetTransitionMatrixToHaveBranchLengthAndTranspose(double branch_length) {
-  diagonal_matrix_.diagonal() = (branch_length * eigenvalues_).array().exp();
-  transition_matrix_ =
-      inverse_eigenmatrix_.transpose() * diagonal_matrix_ * eigenmatrix_.transpose();
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::PrepareTransitionMatrices(
+    const GPOperationVector& operations) {
+  SizeVector stale_indices;
+  std::unordered_set<size_t> seen_indices;
+  for (const auto& operation : operations) {
+    std::visit(
+        [this, &stale_indices, &seen_indices](const auto& op) {
+          for (const auto& [name, idx] : op.guts()) {
+            if (name == "branch_length_idx") {
+              AssertBranchLengthIndex(idx);
+              const bool stale =
+                  transition_matrix_cache_[idx].branch_length_ != branch_lengths_(idx);
+              if (stale && seen_indices.insert(idx).second) {
+                stale_indices.push_back(idx);
+              }
+            }
+          }
+        },
+        operation);
+  }
+  if (!stale_indices.empty()) {
+    RefreshTransitionMatrices(stale_indices);
+  }
 }
 
-void GPEngine::PrintPLV(size_t plv_idx) {
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::PrintPLV(size_t plv_idx) {
   for (auto row : plvs_[plv_idx].rowwise()) {
     std::cout << row << std::endl;
   }
   std::cout << std::endl;
 }
 
-DoublePair GPEngine::LogLikelihoodAndDerivative(
+template <typename PLVScalar, Eigen::Index StateCount>
+DoublePair GenericGPEngine<PLVScalar, StateCount>::LogLikelihoodAndDerivative(
     const GPOperations::OptimizeRootward& op) {
-  SetTransitionAndDerivativeMatricesToHaveBranchLength(
-      branch_lengths_(op.branch_length_idx));
+  AssertBranchLengthIndex(op.branch_length_idx);
+  const auto& matrices = CachedTransitionMatrices(op.branch_length_idx);
   // The per-site likelihood derivative is calculated in the same way as the per-site
   // likelihood, but using the derivative matrix instead of the transition matrix.
-  plvs_.at(op.dest_idx) = derivative_matrix_ * plvs_.at(op.leafward_idx);
+  AssertPLVIndex(op.dest_idx);
+  AssertPLVIndex(op.leafward_idx);
+  EvolveKernel(matrices.derivative_, op.dest_idx, op.leafward_idx, AllColumns());
   PreparePerPatternLikelihoodDerivatives(op.rootward_idx, op.dest_idx);
-  plvs_.at(op.dest_idx) = transition_matrix_ * plvs_.at(op.leafward_idx);
+  EvolveKernel(matrices.transition_, op.dest_idx, op.leafward_idx, AllColumns());
   PreparePerPatternLikelihoods(op.rootward_idx, op.dest_idx);
   return LogLikelihoodAndDerivativeFromPreparations();
 }
 
-void GPEngine::InitializePLVsWithSitePatterns() {
+template <typename PLVScalar, Eigen::Index StateCount>
+std::tuple<double, double, double>
+GenericGPEngine<PLVScalar, StateCount>::LogLikelihoodAndTwoDerivatives(
+    const GPOperations::OptimizeRootward& op, double branch_length) const {
+  const StateMatrix transition_matrix = TransitionMatrix(branch_length);
+  const StateMatrix derivative_matrix = DerivativeMatrix(branch_length);
+  const StateMatrix second_derivative_matrix =
+      SecondDerivativeMatrix(branch_length);
+  const auto& rootward = plvs_[op.rootward_idx];
+  const auto& leafward = plvs_[op.leafward_idx];
+  double log_likelihood = 0.;
+  double log_likelihood_derivative = 0.;
+  double log_likelihood_second_derivative = 0.;
+  for (Eigen::Index pattern_idx = 0; pattern_idx < rootward.cols(); pattern_idx++) {
+    const StateVector rootward_column =
+        rootward.col(pattern_idx).template cast<double>();
+    const StateVector leafward_column =
+        leafward.col(pattern_idx).template cast<double>();
+    // These are the per-pattern likelihood and its derivatives, up to the same power
+    // of two when rescaling, which cancels in the ratios.
+    const double likelihood = rootward_column.dot(transition_matrix * leafward_column);
+    const double ratio =
+        rootward_column.dot(derivative_matrix * leafward_column) / likelihood;
+    const double second_ratio =
+        rootward_column.dot(second_derivative_matrix * leafward_column) / likelihood;
+    const double weight = site_pattern_weights_(pattern_idx);
+    log_likelihood += weight * std::log(likelihood);
+    if constexpr (rescaling_) {
+      log_likelihood += weight * M_LN2 *
+                        (Exponent(op.rootward_idx, pattern_idx) +
+                         Exponent(op.leafward_idx, pattern_idx));
+    }
+    log_likelihood_derivative += weight * ratio;
+    // The derivative of l'/l is l''/l - (l'/l)^2.
+    log_likelihood_second_derivative += weight * (second_ratio - ratio * ratio);
+  }
+  return {log_likelihood, log_likelihood_derivative, log_likelihood_second_derivative};
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+NewtonOptimizationStatisticsVector
+GenericGPEngine<PLVScalar, StateCount>::NewtonOptimizeRootwardBatch(
+    const std::vector<GPOperations::OptimizeRootward>& operations) {
+  std::unordered_set<size_t> branch_length_indices;
+  std::unordered_set<size_t> dest_indices;
+  for (const auto& op : operations) {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.leafward_idx);
+    AssertPLVIndex(op.rootward_idx);
+    AssertBranchLengthIndex(op.branch_length_idx);
+    Assert(branch_length_indices.insert(op.branch_length_idx).second &&
+               dest_indices.insert(op.dest_idx).second,
+           "Edges share a branch length or destination in "
+           "NewtonOptimizeRootwardBatch.");
+  }
+  for (const auto& op : operations) {
+    Assert(dest_indices.count(op.leafward_idx) == 0 &&
+               dest_indices.count(op.rootward_idx) == 0,
+           "An edge reads the destination of another in NewtonOptimizeRootwardBatch.");
+  }
+  NewtonOptimizationStatisticsVector statistics(operations.size());
+  for (size_t op_idx = 0; op_idx < operations.size(); op_idx++) {
+    statistics[op_idx].branch_length_ =
+        branch_lengths_(operations[op_idx].branch_length_idx);
+  }
+  std::vector<std::tuple<double, double, double>> derivatives(operations.size());
+  SizeVector active(operations.size());
+  std::iota(active.begin(), active.end(), 0);
+  const auto take_derivatives = [this, &operations, &statistics, &derivatives,
+                                 &active](size_t, size_t active_idx) {
+    const size_t op_idx = active[active_idx];
+    derivatives[op_idx] = LogLikelihoodAndTwoDerivatives(
+        operations[op_idx], statistics[op_idx].branch_length_);
+  };
+  for (size_t iteration = 0; iteration < max_iter_for_optimization_ && !active.empty();
+       iteration++) {
+    if (thread_pool_ != nullptr && active.size() > 1) {
+      thread_pool_->Run(active.size(), take_derivatives);
+    } else {
+      for (size_t active_idx = 0; active_idx < active.size(); active_idx++) {
+        take_derivatives(0, active_idx);
+      }
+    }
+    SizeVector still_active;
+    for (const auto op_idx : active) {
+      auto& edge_statistics = statistics[op_idx];
+      const auto [log_likelihood, derivative, second_derivative] = derivatives[op_idx];
+      const double branch_length = edge_statistics.branch_length_;
+      // Away from a maximum the Newton step can go the wrong way, so there we just
+      // move in the direction of the derivative.
+      double new_branch_length;
+      if (second_derivative < 0.) {
+        new_branch_length = branch_length - derivative / second_derivative;
+      } else {
+        new_branch_length = derivative > 0. ? 2. * branch_length : 0.5 * branch_length;
+      }
+      new_branch_length =
+          std::clamp(new_branch_length, min_branch_length_, max_branch_length_);
+      edge_statistics.iteration_count_++;
+      edge_statistics.log_likelihood_ = log_likelihood;
+      edge_statistics.branch_length_ = new_branch_length;
+      if (fabs(new_branch_length - branch_length) <=
+          relative_tolerance_for_newton_ * branch_length) {
+        edge_statistics.converged_ = true;
+      } else {
+        still_active.push_back(op_idx);
+      }
+    }
+    active = std::move(still_active);
+  }
+  for (size_t op_idx = 0; op_idx < operations.size(); op_idx++) {
+    const auto& op = operations[op_idx];
+    auto& edge_statistics = statistics[op_idx];
+    branch_lengths_(op.branch_length_idx) = edge_statistics.branch_length_;
+    EvolveKernel(CachedTransitionMatrices(op.branch_length_idx).transition_,
+                 op.dest_idx, op.leafward_idx, AllColumns());
+    edge_statistics.log_likelihood_ =
+        LogLikelihood(op.rootward_idx, op.dest_idx, AllColumns());
+    log_likelihoods_(op.branch_length_idx) = edge_statistics.log_likelihood_;
+  }
+  return statistics;
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::InitializePLVsWithSitePatterns() {
   for (auto& plv : plvs_) {
     plv.setZero();
   }
   size_t taxon_idx = 0;
-  for (const auto& pattern : site_pattern_.GetPatterns()) {
-    size_t site_idx = 0;
-    for (const int symbol : pattern) {
-      Assert(symbol >= 0, "Negative symbol!");
-      if (symbol == MmappedNucleotidePLV::base_count_) {  // Gap character.
+  for (const auto& pattern : site_pattern_.GetPackedPatterns()) {
+    for (size_t site_idx = 0; site_idx < pattern.size(); site_idx++) {
+      if (pattern.IsAmbiguous(site_idx)) {  // Gap character.
         plvs_.at(taxon_idx).col(site_idx).setConstant(1.);
-      } else if (symbol < MmappedNucleotidePLV::base_count_) {
-        plvs_.at(taxon_idx)(symbol, site_idx) = 1.;
+      } else {
+        plvs_.at(taxon_idx)(pattern[site_idx], site_idx) = 1.;
       }
-      site_idx++;
     }
     taxon_idx++;
   }
 }
 
-void GPEngine::BrentOptimization(const GPOperations::OptimizeRootward& op) {
+template <typename PLVScalar, Eigen::Index StateCount>
+uint64_t GenericGPEngine<PLVScalar, StateCount>::PLVChecksum() const {
+  uint64_t checksum = plv_count_;
+  for (const auto& plv : plvs_) {
+    const auto* bytes = reinterpret_cast<const char*>(plv.data());
+    const size_t byte_count = plv.size() * sizeof(PLVScalar);
+    for (size_t offset = 0; offset < byte_count; offset += sizeof(uint64_t)) {
+      uint64_t word = 0;
+      std::memcpy(&word, bytes + offset,
+                  std::min(sizeof(uint64_t), byte_count - offset));
+      checksum = HashCombine(checksum, word);
+    }
+  }
+  return checksum;
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::WriteCheckpoint() {
+  if (!checkpoint_fingerprint_.has_value()) {
+    Failwith("Make a GPEngine with a DAG fingerprint to write checkpoints.");
+  }
+  const size_t gpcsp_count = log_likelihoods_.size();
+  mmapped_master_plv_.Sync();
+  CheckpointHeader header{};
+  std::copy(std::begin(checkpoint_magic), std::end(checkpoint_magic), header.magic_);
+  header.version_ = checkpoint_version;
+  header.byte_order_mark_ = byte_order_mark;
+  header.fingerprint_ = *checkpoint_fingerprint_;
+  header.scalar_size_ = sizeof(PLVScalar);
+  header.pattern_count_ = site_pattern_.PatternCount();
+  header.plv_count_ = plv_count_;
+  header.gpcsp_count_ = gpcsp_count;
+  header.branch_length_count_ = branch_lengths_.size();
+  header.plv_checksum_ = PLVChecksum();
+  const std::string path = CheckpointPathOf(mmap_file_path_);
+  const std::string temporary_path = path + ".tmp";
+  {
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      Failwith("GPEngine could not create a checkpoint at " + temporary_path);
+    }
+    const auto write = [&out](const void* data, size_t size) {
+      out.write(static_cast<const char*>(data), size);
+    };
+    write(&header, sizeof(header));
+    write(branch_lengths_.data(), branch_lengths_.size() * sizeof(double));
+    write(log_likelihoods_.data(), gpcsp_count * sizeof(double));
+    write(q_.data(), gpcsp_count * sizeof(double));
+    if constexpr (rescaling_) {
+      write(plv_exponents_.data(), plv_exponents_.size() * sizeof(int));
+    }
+    out.flush();
+    if (!out) {
+      Failwith("GPEngine could not write the checkpoint at " + temporary_path);
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    Failwith("GPEngine could not move its checkpoint into place at " + path);
+  }
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+GPCheckpointResume GenericGPEngine<PLVScalar, StateCount>::ResumeFromCheckpoint() {
+  const std::string path = CheckpointPathOf(mmap_file_path_);
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    return GPCheckpointResume::None;
+  }  // else
+  const auto file_size = static_cast<size_t>(in.tellg());
+  in.seekg(0);
+  CheckpointHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    return GPCheckpointResume::None;
+  }  // else
+  const size_t gpcsp_count = log_likelihoods_.size();
+  if (!std::equal(std::begin(checkpoint_magic), std::end(checkpoint_magic),
+                  header.magic_) ||
+      header.version_ != checkpoint_version ||
+      header.byte_order_mark_ != byte_order_mark ||
+      header.fingerprint_ != *checkpoint_fingerprint_ ||
+      header.scalar_size_ != sizeof(PLVScalar) ||
+      header.pattern_count_ != site_pattern_.PatternCount() ||
+      header.plv_count_ != plv_count_ || header.gpcsp_count_ != gpcsp_count) {
+    return GPCheckpointResume::None;
+  }  // else
+  const size_t expected_size =
+      sizeof(header) +
+      (header.branch_length_count_ + 2 * gpcsp_count) * sizeof(double) +
+      plv_exponents_.size() * sizeof(int);
+  if (file_size != expected_size) {
+    std::cout << "Warning: the GPEngine checkpoint at " << path
+              << " has the wrong size, so we are starting afresh." << std::endl;
+    return GPCheckpointResume::None;
+  }  // else
+  EigenVectorXd branch_lengths(header.branch_length_count_);
+  EigenVectorXd log_likelihoods(gpcsp_count);
+  EigenVectorXd q(gpcsp_count);
+  std::vector<int> plv_exponents(plv_exponents_.size());
+  const auto read = [&in](void* data, size_t size) {
+    in.read(static_cast<char*>(data), size);
+  };
+  read(branch_lengths.data(), branch_lengths.size() * sizeof(double));
+  read(log_likelihoods.data(), gpcsp_count * sizeof(double));
+  read(q.data(), gpcsp_count * sizeof(double));
+  read(plv_exponents.data(), plv_exponents.size() * sizeof(int));
+  if (!in) {
+    std::cout << "Warning: could not read the GPEngine checkpoint at " << path
+              << ", so we are starting afresh." << std::endl;
+    return GPCheckpointResume::None;
+  }  // else
+  SetBranchLengths(std::move(branch_lengths));
+  log_likelihoods_ = std::move(log_likelihoods);
+  q_ = std::move(q);
+  // The PLVs may have changed after the checkpoint, say if we were stopped partway
+  // through a sweep.
+  if (PLVChecksum() != header.plv_checksum_) {
+    return GPCheckpointResume::Parameters;
+  }  // else
+  plv_exponents_ = std::move(plv_exponents);
+  return GPCheckpointResume::Everything;
+}
+
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::BrentOptimization(
+    const GPOperations::OptimizeRootward& op) {
+  AssertPLVIndex(op.dest_idx);
+  AssertPLVIndex(op.leafward_idx);
   auto negative_log_likelihood = [this, &op](double branch_length) {
     SetTransitionMatrixToHaveBranchLength(branch_length);
-    plvs_.at(op.dest_idx) = transition_matrix_ * plvs_.at(op.leafward_idx);
-    return -LogLikelihood(op.rootward_idx, op.dest_idx);
+    EvolveKernel(transition_matrix_, op.dest_idx, op.leafward_idx, AllColumns());
+    return -LogLikelihood(op.rootward_idx, op.dest_idx, AllColumns());
   };
   auto [branch_length, neg_log_likelihood] = Optimization::BrentMinimize(
       negative_log_likelihood, min_branch_length_, max_branch_length_,
@@ -163,7 +1048,9 @@ void GPEngine::BrentOptimization(const GPOperations::OptimizeRootward& op) {
   log_likelihoods_(op.branch_length_idx) = -neg_log_likelihood;
 }
 
-void GPEngine::GradientAscentOptimization(const GPOperations::OptimizeRootward& op) {
+template <typename PLVScalar, Eigen::Index StateCount>
+void GenericGPEngine<PLVScalar, StateCount>::GradientAscentOptimization(
+    const GPOperations::OptimizeRootward& op) {
   auto log_likelihood_and_derivative = [this, &op](double branch_length) {
     branch_lengths_(op.branch_length_idx) = branch_length;
     return this->LogLikelihoodAndDerivative(op);
@@ -175,3 +1062,8 @@ void GPEngine::GradientAscentOptimization(const GPOperations::OptimizeRootward&
   branch_lengths_(op.branch_length_idx) = branch_length;
   log_likelihoods_(op.branch_length_idx) = log_likelihood;
 }
+
+template class GenericGPEngine<double, 4>;
+template class GenericGPEngine<float, 4>;
+template class GenericGPEngine<double, 20>;
+template class GenericGPEngine<float, 20>;
@@ -3,19 +3,100 @@
 //
 // A visitor for GPOperations. See
 // https://arne-mertz.de/2018/05/modern-c-features-stdvariant-and-stdvisit/
+//
+// The engine is templated on the type used to store PLVs. GPEngine stores them as
+// doubles. SinglePrecisionGPEngine stores them as floats, which halves the size of
+// the PLVs. To keep floats from underflowing, each column of a stored PLV comes with
+// a power-of-two exponent: the actual column is the stored one times two to that
+// exponent, and we rescale each column as we store it. All arithmetic is in double.
+//
+// The engine is also templated on the number of states, which fixes the height of the
+// PLVs and the size of the transition matrices at compile time, so that Eigen unrolls
+// and vectorizes the work on each column. GPEngine has the four nucleotides, with
+// JC69Model, and AminoAcidGPEngine has twenty amino acids, with the Poisson model.
 
 #ifndef SRC_GP_ENGINE_HPP_
 #define SRC_GP_ENGINE_HPP_
 
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
 #include "eigen_sugar.hpp"
 #include "gp_operation.hpp"
 #include "mmapped_plv.hpp"
 #include "site_pattern.hpp"
 #include "substitution_model.hpp"
+#include "task_processor.hpp"
+#include "transition_matrix_kernel.hpp"
+
+// What happened to one edge in NewtonOptimizeRootwardBatch.
+struct NewtonOptimizationStatistics {
+  size_t iteration_count_ = 0;
+  bool converged_ = false;
+  double branch_length_;
+  double log_likelihood_;
+};
+using NewtonOptimizationStatisticsVector = std::vector<NewtonOptimizationStatistics>;
 
-class GPEngine {
+// What a GPEngine got back from its checkpoint when we made it.
+enum class GPCheckpointResume {
+  // There was no checkpoint for the same data and DAG, so we started afresh.
+  None,
+  // We got the branch lengths, log likelihoods and q of the checkpoint, but the PLV
+  // file changed after the checkpoint, so the PLVs started afresh.
+  Parameters,
+  // We got everything as of the checkpoint, PLVs included.
+  Everything,
+};
+
+template <Eigen::Index StateCount>
+using StateMatrixOf = Eigen::Matrix<double, StateCount, StateCount>;
+template <Eigen::Index StateCount>
+using StateVectorOf = Eigen::Matrix<double, StateCount, 1>;
+
+template <typename PLVScalar, Eigen::Index StateCount = 4>
+class GenericGPEngine {
  public:
-  GPEngine(SitePattern site_pattern, size_t pcss_count, std::string mmap_file_path);
+  using StateMatrix = StateMatrixOf<StateCount>;
+  using StateVector = StateVectorOf<StateCount>;
+
+  // See MmapBacking for the ways we can store the PLVs. With a DAG fingerprint, which
+  // needs MmapBacking::File, we can write checkpoints (see WriteCheckpoint), and we
+  // resume from the checkpoint next to the PLV file if it was written for the same
+  // site patterns and DAG rather than initializing the PLVs. Without a plv_count we
+  // have DefaultPLVCount PLVs; the schedules of a SubsplitDAG need
+  // SubsplitDAG::PLVCount.
+  GenericGPEngine(SitePattern site_pattern, size_t pcss_count,
+                  std::string mmap_file_path,
+                  MmapBacking mmap_backing = MmapBacking::File,
+                  std::optional<uint64_t> dag_fingerprint = std::nullopt,
+                  std::optional<size_t> plv_count = std::nullopt);
+
+  static size_t DefaultPLVCount(size_t pattern_count, size_t gpcsp_count) {
+    return pattern_count + gpcsp_count;
+  }
+  // Estimates of the bytes that an engine for this many site patterns and GPCSPs
+  // holds: the "plvs", which live wherever the MmapBacking puts them, and the
+  // "gpcsp_data" of branch lengths, likelihoods and cached transition matrices,
+  // which are always in memory.
+  static StringSizeMap EstimateByteCounts(
+      size_t pattern_count, size_t gpcsp_count,
+      std::optional<size_t> plv_count = std::nullopt) {
+    const size_t plv_entry_count =
+        plv_count.value_or(DefaultPLVCount(pattern_count, gpcsp_count)) *
+        pattern_count;
+    return {{"plvs", plv_entry_count * (StateCount * sizeof(PLVScalar) +
+                                        (rescaling_ ? sizeof(int) : 0))},
+            {"gpcsp_data",
+             gpcsp_count * (3 * sizeof(double) + sizeof(TransitionMatrices))}};
+  }
 
   // These operators mean that we can invoke this class on each of the operations.
   void operator()(const GPOperations::Zero& op);
@@ -28,22 +109,97 @@ class GPEngine {
   void operator()(const GPOperations::OptimizeRootward& op);
   void operator()(const GPOperations::OptimizeLeafward& op);
   void operator()(const GPOperations::UpdateSBNProbabilities& op);
+  void operator()(const GPOperations::EvolveRootwardAndMultiply& op);
+  void operator()(const GPOperations::EvolveLeafwardAndMultiply& op);
+  void operator()(const GPOperations::ZeroAndAccumulate& op);
 
+  // Process the operations, after fusing them with GPOperations::Fuse. With one
+  // thread we go in order; with more, we run the operations of each dependency level
+  // (see GPOperations::DependencyLevels) at the same time.
   void ProcessOperations(GPOperationVector operations);
+  // Set the number of threads used by ProcessOperations, which starts out as 1.
+  void SetThreadCount(size_t thread_count);
+  size_t GetThreadCount() const;
+  // For PLVs that spill to disk, ProcessOperations can advise the kernel to page in
+  // the PLVs of the step this far ahead (a step is an operation, or a dependency
+  // level with threads), and to page out the PLVs that later steps don't use. It
+  // starts out as 0, which turns this off.
+  void SetPrefetchDistance(size_t prefetch_distance) {
+    prefetch_distance_ = prefetch_distance;
+  }
+  // Say which PLVs only hold intermediate results within a call to
+  // ProcessOperations. Each of these is live from the first step that writes it to
+  // the last step that uses it (see GPOperations::PLVLiveIntervals), after which we
+  // release its memory. With anonymous backing the kernel only gives it memory
+  // again on the next write, so these take memory for how many are live at once
+  // rather than how many there are. Reading one before writing it is an error.
+  void SetTemporaryPLVs(const SizeVector& plv_indices);
+  // With a nonzero tile width, ProcessOperations splits the site patterns into tiles
+  // of this many columns, and runs each stretch of operations between optimizations
+  // over one tile at a time (on threads if we have them), so that the tiles of the
+  // PLVs in a sweep stay in cache for the whole sweep. Each tile of a PLV takes
+  // 4 * width * sizeof(PLVScalar) bytes. Likelihoods sum their per-tile parts at the
+  // end of each stretch. It starts out as 0, which turns this off. We don't tile
+  // while prefetching or using temporary PLVs, which work on whole PLVs.
+  void SetPatternTileWidth(size_t pattern_tile_width) {
+    pattern_tile_width_ = pattern_tile_width;
+  }
+  size_t GetPatternTileWidth() const { return pattern_tile_width_; }
+  // The PLVs are already in the file, so a checkpoint syncs them and writes the rest
+  // of our state to a file next to it: the branch lengths, log likelihoods, q, the
+  // PLV exponents if we store floats, and a checksum of the PLVs. We replace the
+  // previous checkpoint in one rename, so being stopped partway leaves it intact. If
+  // the PLVs change after the checkpoint, we only resume the parameters.
+  void WriteCheckpoint();
+  GPCheckpointResume GetCheckpointResume() const { return checkpoint_resume_; }
+  static std::string CheckpointPathOf(const std::string& mmap_file_path) {
+    return mmap_file_path + ".checkpoint";
+  }
+  // Process many operations of the same type at once. We check all of the PLV
+  // indices up front, so that the loop over operations only runs the kernels.
+  void ProcessMultiplyBatch(const std::vector<GPOperations::Multiply>& operations);
+  void ProcessEvolveRootwardBatch(
+      const std::vector<GPOperations::EvolveRootward>& operations);
+  void ProcessEvolveLeafwardBatch(
+      const std::vector<GPOperations::EvolveLeafward>& operations);
+  // Optimize the branch lengths of independent edges (ones that don't share a branch
+  // length, and whose destination PLVs no other edge uses) by Newton-Raphson.
+  // We take a step for every edge that hasn't converged in each iteration, using
+  // threads if we have them. The results are stored as for OptimizeRootward.
+  NewtonOptimizationStatisticsVector NewtonOptimizeRootwardBatch(
+      const std::vector<GPOperations::OptimizeRootward>& operations);
 
   void SetTransitionMatrixToHaveBranchLength(double branch_length);
   void SetTransitionAndDerivativeMatricesToHaveBranchLength(double branch_length);
   void SetTransitionMatrixToHaveBranchLengthAndTranspose(double branch_length);
-  const Eigen::Matrix4d& GetTransitionMatrix() { return transition_matrix_; };
+  // These don't touch the state of the engine. For equal-rates models we use the
+  // closed form rather than the eigendecomposition.
+  StateMatrix TransitionMatrix(double branch_length) const;
+  StateMatrix TransposedTransitionMatrix(double branch_length) const;
+  StateMatrix DerivativeMatrix(double branch_length) const;
+  StateMatrix SecondDerivativeMatrix(double branch_length) const;
+  const StateMatrix& GetTransitionMatrix() { return transition_matrix_; };
   void PrintPLV(size_t plv_idx);
 
   void SetBranchLengths(EigenVectorXd branch_lengths) {
     branch_lengths_ = branch_lengths;
+    transition_matrix_cache_.resize(branch_lengths_.size());
   };
   EigenVectorXd GetBranchLengths() const { return branch_lengths_; };
   EigenVectorXd GetLogLikelihoods() const { return log_likelihoods_; };
+  // The SBN probabilities indexed by GPCSP, such as SubsplitDAG::UniformQ.
+  void SetQ(EigenVectorXd q) {
+    Assert(q.size() == q_.size(), "Wrong number of GPCSPs in GPEngine::SetQ.");
+    q_ = std::move(q);
+  }
+  EigenVectorXd GetQ() const { return q_; }
+  size_t GetPLVCount() const { return plv_count_; }
 
   DoublePair LogLikelihoodAndDerivative(const GPOperations::OptimizeRootward& op);
+  // The log likelihood for `op` at the given branch length, with its first and second
+  // derivatives. This only reads the engine, so we can call it on several threads.
+  std::tuple<double, double, double> LogLikelihoodAndTwoDerivatives(
+      const GPOperations::OptimizeRootward& op, double branch_length) const;
 
  private:
   double min_branch_length_ = 1e-6;
@@ -52,11 +208,19 @@ class GPEngine {
   double relative_tolerance_for_optimization_ = 1e-2;
   double step_size_for_optimization_ = 5e-4;
   size_t max_iter_for_optimization_ = 100;
+  // Newton-Raphson stops when a step changes the branch length by less than this
+  // fraction.
+  double relative_tolerance_for_newton_ = 1e-8;
 
   SitePattern site_pattern_;
   size_t plv_count_;
-  MmappedNucleotidePLV mmapped_master_plv_;
-  NucleotidePLVRefVector plvs_;
+  std::string mmap_file_path_;
+  GenericMmappedPLV<PLVScalar, StateCount> mmapped_master_plv_;
+  PLVRefVectorOf<PLVScalar, StateCount> plvs_;
+  // The power-of-two exponents of the PLV columns, indexed by plv_idx * pattern count
+  // + pattern index. We only have these when storing PLVs as floats.
+  constexpr static bool rescaling_ = !std::is_same_v<PLVScalar, double>;
+  std::vector<int> plv_exponents_;
   EigenVectorXd branch_lengths_;
   EigenVectorXd log_likelihoods_;
   EigenVectorXd q_;
@@ -67,37 +231,195 @@ class GPEngine {
   EigenVectorXd per_pattern_likelihood_derivatives_;
   EigenVectorXd per_pattern_likelihood_derivative_ratios_;
 
-  // When we change from JC69Model, check that we are actually doing transpose in
-  // leafward calculations.
-  JC69Model substitution_model_;
-  Eigen::Matrix4d eigenmatrix_ = substitution_model_.GetEigenvectors().reshaped(4, 4);
-  Eigen::Matrix4d inverse_eigenmatrix_ =
-      substitution_model_.GetInverseEigenvectors().reshaped(4, 4);
-  Eigen::Vector4d eigenvalues_ = substitution_model_.GetEigenvalues();
-  Eigen::DiagonalMatrix<double, 4> diagonal_matrix_;
-  Eigen::Matrix4d transition_matrix_;
-  Eigen::Matrix4d derivative_matrix_;
-  Eigen::Vector4d stationary_distribution_ = substitution_model_.GetFrequencies();
+  // When we change from equal-rates models, check that we are actually doing
+  // transpose in leafward calculations.
+  using Model =
+      std::conditional_t<StateCount == 4, JC69Model, PoissonModel<StateCount>>;
+  constexpr static bool equal_rates_ = std::is_same_v<Model, JC69Model> ||
+                                       std::is_same_v<Model, PoissonModel<StateCount>>;
+  Model substitution_model_;
+  StateMatrix eigenmatrix_ =
+      substitution_model_.GetEigenvectors().reshaped(StateCount, StateCount);
+  StateMatrix inverse_eigenmatrix_ =
+      substitution_model_.GetInverseEigenvectors().reshaped(StateCount, StateCount);
+  StateVector eigenvalues_ = substitution_model_.GetEigenvalues();
+  // The GP engine has no rate categories, so it uses the kernel with one unit rate.
+  TransitionMatrixKernel transition_matrix_kernel_{substitution_model_};
+  EigenVectorXd unit_rate_ = EigenVectorXd::Ones(1);
+  StateMatrix transition_matrix_;
+  StateMatrix derivative_matrix_;
+  StateVector stationary_distribution_ = substitution_model_.GetFrequencies();
   EigenVectorXd site_pattern_weights_;
+  // The transition matrices for each branch, along with the branch length they were
+  // computed for. An entry is stale exactly when that branch length differs from the
+  // one in branch_lengths_, so changing a branch length (whether via SetBranchLengths
+  // or an optimizer) invalidates its entry. A fresh entry has a NaN branch length,
+  // which doesn't equal anything.
+  struct TransitionMatrices {
+    double branch_length_ = std::numeric_limits<double>::quiet_NaN();
+    StateMatrix transition_;
+    StateMatrix transposed_transition_;
+    StateMatrix derivative_;
+  };
+  std::vector<TransitionMatrices> transition_matrix_cache_;
+  // The threads for ProcessOperations, which we only have with more than one thread.
+  std::unique_ptr<WorkStealingPool<size_t>> thread_pool_;
+  size_t prefetch_distance_ = 0;
+  std::unordered_set<size_t> temporary_plvs_;
+  size_t pattern_tile_width_ = 0;
+  // A checkpoint must have this fingerprint, which combines the DAG fingerprint with
+  // our site patterns, for us to resume from it. We only have it when checkpointing.
+  std::optional<uint64_t> checkpoint_fingerprint_;
+  GPCheckpointResume checkpoint_resume_ = GPCheckpointResume::None;
 
   void InitializePLVsWithSitePatterns();
+  uint64_t PLVChecksum() const;
+  // Restore what we can from the checkpoint, changing nothing if there isn't one for
+  // our fingerprint and shape.
+  GPCheckpointResume ResumeFromCheckpoint();
+  void AssertPLVIndex(size_t plv_idx) const {
+    Assert(plv_idx < plv_count_, "PLV index out of range in GPEngine.");
+  }
+  void AssertBranchLengthIndex(size_t branch_length_idx) const {
+    Assert(branch_length_idx < static_cast<size_t>(branch_lengths_.size()),
+           "Branch length index out of range in GPEngine.");
+  }
+  // A range of PLV columns, that is, of site patterns, for the kernels to work on.
+  struct Columns {
+    Eigen::Index begin_;
+    Eigen::Index count_;
+  };
+  Columns AllColumns() const {
+    return {0, static_cast<Eigen::Index>(site_pattern_.PatternCount())};
+  }
+  // The exponent of a PLV column, which we only call when rescaling_.
+  int& Exponent(size_t plv_idx, Eigen::Index col_idx) {
+    return plv_exponents_[plv_idx * site_pattern_.PatternCount() + col_idx];
+  }
+  int Exponent(size_t plv_idx, Eigen::Index col_idx) const {
+    return plv_exponents_[plv_idx * site_pattern_.PatternCount() + col_idx];
+  }
+  // Store the actual column `column * 2^exponent`, rescaling when storing floats.
+  void StoreColumn(size_t plv_idx, Eigen::Index col_idx, StateVector column,
+                   int exponent) {
+    if constexpr (rescaling_) {
+      const double max_entry = column.cwiseAbs().maxCoeff();
+      if (max_entry > 0.) {
+        int max_exponent;
+        std::frexp(max_entry, &max_exponent);
+        column *= std::ldexp(1., -max_exponent);
+        exponent += max_exponent;
+      } else {
+        exponent = 0;
+      }
+      Exponent(plv_idx, col_idx) = exponent;
+    }
+    plvs_[plv_idx].col(col_idx) = column.template cast<PLVScalar>();
+  }
+  void ZeroExponents(size_t plv_idx, Columns columns) {
+    if constexpr (rescaling_) {
+      std::fill_n(plv_exponents_.begin() + plv_idx * site_pattern_.PatternCount() +
+                      columns.begin_,
+                  columns.count_, 0);
+    }
+  }
+  // These kernels don't check their indices, and only touch the given columns.
+  void ZeroKernel(size_t dest_idx, Columns columns);
+  void StationaryDistributionKernel(size_t dest_idx, Columns columns);
+  void MultiplyKernel(const GPOperations::Multiply& op, Columns columns);
+  void EvolveKernel(const StateMatrix& matrix, size_t dest_idx, size_t src_idx,
+                    Columns columns);
+  void EvolveAndMultiplyKernel(const StateMatrix& matrix, size_t dest_idx,
+                               size_t evolve_dest_idx, size_t src_idx,
+                               size_t other_idx, Columns columns);
+  void ZeroAndAccumulateKernel(const GPOperations::ZeroAndAccumulate& op,
+                               Columns columns);
+  template <typename TOperation>
+  void AssertEvolveAndMultiplyIndices(const TOperation& op) const {
+    AssertPLVIndex(op.dest_idx);
+    AssertPLVIndex(op.evolve_dest_idx);
+    AssertPLVIndex(op.src_idx);
+    AssertPLVIndex(op.other_idx);
+    AssertBranchLengthIndex(op.branch_length_idx);
+  }
+  // Get the transition matrices for the current length of a branch, computing them if
+  // the cache entry is stale. This doesn't check its index.
+  const TransitionMatrices& CachedTransitionMatrices(size_t branch_length_idx);
+  // Recompute the cache entries of these distinct branches in one batch.
+  void RefreshTransitionMatrices(const SizeVector& branch_length_indices);
+  // Refresh the stale cache entries for the branches of these operations in one
+  // batch, so that threads running the operations only read the cache.
+  void PrepareTransitionMatrices(const GPOperationVector& operations);
+  // Run the operations of a step, at the same time if we have threads.
+  void ProcessStep(const GPOperationVector& step);
+  // Whether we can run an operation a tile at a time. Optimizations need whole PLVs,
+  // and we don't tile WeightedSumAccumulate, which Fuse mostly turns into
+  // ZeroAndAccumulate.
+  static bool IsTileable(const GPOperation& operation);
+  // Run the operations with pattern tiles, as described at SetPatternTileWidth.
+  void ProcessTiled(const GPOperationVector& operations);
+  // Run tileable operations over all of the tiles, then store the likelihoods.
+  void ProcessTiledStretch(const GPOperationVector& stretch);
+  // Run tileable operations over the given columns, putting the part of the log
+  // likelihood from these columns for each Likelihood operation at its index in
+  // partial_log_likelihoods.
+  void ProcessTile(const GPOperationVector& stretch, Columns columns,
+                   std::vector<double>& partial_log_likelihoods);
   void BrentOptimization(const GPOperations::OptimizeRootward& op);
   void GradientAscentOptimization(const GPOperations::OptimizeRootward& op);
 
-  inline double LogLikelihood(size_t src1_idx, size_t src2_idx) {
-    per_pattern_log_likelihoods_ =
-        (plvs_.at(src1_idx).transpose() * plvs_.at(src2_idx)).diagonal().array().log();
-    return per_pattern_log_likelihoods_.dot(site_pattern_weights_);
+  // The per-pattern likelihoods are the dot products of corresponding columns of
+  // two PLVs. We compute these column by column rather than as the diagonal of
+  // plv1.transpose() * plv2, which can form the whole patterns x patterns product.
+  // Because PLVs have a fixed height, Eigen unrolls each dot product.
+  inline void PreparePerPatternDotProducts(size_t src1_idx, size_t src2_idx,
+                                           EigenVectorXd& result) const {
+    const auto& plv1 = plvs_.at(src1_idx);
+    const auto& plv2 = plvs_.at(src2_idx);
+    if constexpr (rescaling_) {
+      result.resize(plv1.cols());
+      for (Eigen::Index pattern_idx = 0; pattern_idx < plv1.cols(); pattern_idx++) {
+        result(pattern_idx) = std::ldexp(
+            plv1.col(pattern_idx).template cast<double>().dot(
+                plv2.col(pattern_idx).template cast<double>()),
+            Exponent(src1_idx, pattern_idx) + Exponent(src2_idx, pattern_idx));
+      }
+    } else {
+      result = (plv1.array() * plv2.array()).colwise().sum().transpose();
+    }
+  }
+
+  // Sum the weighted log per-pattern likelihoods in a single pass over the columns.
+  inline double LogLikelihood(size_t src1_idx, size_t src2_idx, Columns columns) const {
+    const auto& plv1 = plvs_.at(src1_idx);
+    const auto& plv2 = plvs_.at(src2_idx);
+    double log_likelihood = 0.;
+    for (Eigen::Index pattern_idx = columns.begin_;
+         pattern_idx < columns.begin_ + columns.count_; pattern_idx++) {
+      if constexpr (rescaling_) {
+        // We add the log of the exponents rather than multiplying by them, so that
+        // we can go beyond the range of doubles.
+        const double dot_product = plv1.col(pattern_idx).template cast<double>().dot(
+            plv2.col(pattern_idx).template cast<double>());
+        const int exponent =
+            Exponent(src1_idx, pattern_idx) + Exponent(src2_idx, pattern_idx);
+        log_likelihood += site_pattern_weights_(pattern_idx) *
+                          (std::log(dot_product) + M_LN2 * exponent);
+      } else {
+        log_likelihood += site_pattern_weights_(pattern_idx) *
+                          std::log(plv1.col(pattern_idx).dot(plv2.col(pattern_idx)));
+      }
+    }
+    return log_likelihood;
   }
 
   inline void PreparePerPatternLikelihoodDerivatives(size_t src1_idx, size_t src2_idx) {
-    per_pattern_likelihood_derivatives_ =
-        (plvs_.at(src1_idx).transpose() * plvs_.at(src2_idx)).diagonal().array();
+    PreparePerPatternDotProducts(src1_idx, src2_idx,
+                                 per_pattern_likelihood_derivatives_);
   }
 
   inline void PreparePerPatternLikelihoods(size_t src1_idx, size_t src2_idx) {
-    per_pattern_likelihoods_ =
-        (plvs_.at(src1_idx).transpose() * plvs_.at(src2_idx)).diagonal().array();
+    PreparePerPatternDotProducts(src1_idx, src2_idx, per_pattern_likelihoods_);
   }
 
   inline DoublePair LogLikelihoodAndDerivativeFromPreparations() {
@@ -115,6 +437,11 @@ class GPEngine {
   }
 };
 
+using GPEngine = GenericGPEngine<double>;
+using SinglePrecisionGPEngine = GenericGPEngine<float>;
+using AminoAcidGPEngine = GenericGPEngine<double, 20>;
+using SinglePrecisionAminoAcidGPEngine = GenericGPEngine<float, 20>;
+
 #ifdef DOCTEST_LIBRARY_INCLUDED
 
 TEST_CASE("GPEngine") {
@@ -125,6 +452,73 @@ TEST_CASE("GPEngine") {
   // https://en.wikipedia.org/wiki/Models_of_DNA_evolution#JC69_model_%28Jukes_and_Cantor_1969%29
   CHECK(fabs(0.52590958087 - engine.GetTransitionMatrix()(0, 0)) < 1e-10);
   CHECK(fabs(0.1580301397 - engine.GetTransitionMatrix()(0, 1)) < 1e-10);
+  // The JC69 closed form agrees with the eigendecomposition.
+  JC69Model model;
+  Eigen::Matrix4d eigenmatrix = model.GetEigenvectors().reshaped(4, 4);
+  Eigen::Matrix4d inverse_eigenmatrix = model.GetInverseEigenvectors().reshaped(4, 4);
+  Eigen::Vector4d eigenvalues = model.GetEigenvalues();
+  Eigen::Vector4d diagonal = (0.75 * eigenvalues).array().exp();
+  Eigen::Matrix4d derivative = eigenmatrix *
+                               Eigen::DiagonalMatrix<double, 4>(
+                                   (diagonal.array() * eigenvalues.array()).matrix()) *
+                               inverse_eigenmatrix;
+  CHECK_LT((engine.DerivativeMatrix(0.75) - derivative).norm(), 1e-10);
+  Eigen::Matrix4d second_derivative =
+      eigenmatrix *
+      Eigen::DiagonalMatrix<double, 4>(
+          (diagonal.array() * eigenvalues.array().square()).matrix()) *
+      inverse_eigenmatrix;
+  CHECK_LT((engine.SecondDerivativeMatrix(0.75) - second_derivative).norm(), 1e-10);
+  // The cached matrices come from the batched kernel, which also agrees.
+  const TransitionMatrixKernel kernel(model);
+  const double branch_length = 0.75;
+  Eigen::Matrix<double, 4, 4, Eigen::RowMajor> kernel_transition, kernel_derivative;
+  kernel.Compute(&branch_length, 1, EigenVectorXd::Ones(1), kernel_transition.data(),
+                 kernel_derivative.data());
+  CHECK_LT((engine.TransitionMatrix(0.75) - kernel_transition).norm(), 1e-10);
+  CHECK_LT((engine.DerivativeMatrix(0.75) - kernel_derivative).norm(), 1e-10);
+}
+
+TEST_CASE("GPEngine: amino acids") {
+  const SitePattern site_pattern = SitePattern::HelloSitePattern();
+  AminoAcidGPEngine engine(site_pattern, 5, "", MmapBacking::Anonymous);
+  // The closed form of the Poisson model agrees with its eigendecomposition.
+  const TransitionMatrixKernel kernel(PoissonModel<20>{});
+  const double branch_length = 0.3;
+  Eigen::Matrix<double, 20, 20, Eigen::RowMajor> kernel_transition, kernel_derivative;
+  kernel.Compute(&branch_length, 1, EigenVectorXd::Ones(1), kernel_transition.data(),
+                 kernel_derivative.data());
+  CHECK_LT((engine.TransitionMatrix(0.3) - kernel_transition).norm(), 1e-10);
+  CHECK_LT((engine.DerivativeMatrix(0.3) - kernel_derivative).norm(), 1e-10);
+  const double step = 1e-6;
+  const auto difference_quotient =
+      (engine.DerivativeMatrix(0.3 + step) - engine.DerivativeMatrix(0.3)) / step;
+  CHECK_LT((difference_quotient - engine.SecondDerivativeMatrix(0.3)).norm(), 1e-4);
+  // The likelihood of the first two taxa joined by branches of length 0.1. Because
+  // the model is reversible, a site with states a and b has likelihood P_ab(0.2) / 20,
+  // and a site where one of them is ambiguous has likelihood 1 / 20.
+  engine.SetBranchLengths(EigenVectorXd::Constant(5, 0.1));
+  engine.ProcessOperations({GPOperations::EvolveRootward{3, 0, 0},
+                            GPOperations::EvolveRootward{4, 1, 1},
+                            GPOperations::Multiply{5, 3, 4},
+                            GPOperations::SetToStationaryDistribution{6},
+                            GPOperations::Likelihood{0, 6, 5}});
+  const auto transition = engine.TransitionMatrix(0.2);
+  const auto patterns = site_pattern.GetPatterns();
+  double log_likelihood = 0.;
+  for (size_t pattern_idx = 0; pattern_idx < site_pattern.PatternCount();
+       pattern_idx++) {
+    const int a = patterns[0][pattern_idx];
+    const int b = patterns[1][pattern_idx];
+    double likelihood = 1.;
+    if (a < 4 && b < 4) {
+      likelihood = transition(a, b) / 20.;
+    } else if (a < 4 || b < 4) {
+      likelihood = 1. / 20.;
+    }
+    log_likelihood += site_pattern.GetWeights()[pattern_idx] * std::log(likelihood);
+  }
+  CHECK_LT(fabs(engine.GetLogLikelihoods()(0) - log_likelihood), 1e-10);
 }
 
 #endif  // DOCTEST_LIBRARY_INCLUDED
@@ -12,12 +12,14 @@ void GPInstance::ReadNewickFile(std::string fname) {
   Driver driver;
   tree_collection_ =
       RootedTreeCollection::OfTreeCollection(driver.ParseNewickFile(fname));
+  dag_.reset();
 }
 
 void GPInstance::ReadNexusFile(std::string fname) {
   Driver driver;
   tree_collection_ =
       RootedTreeCollection::OfTreeCollection(driver.ParseNexusFile(fname));
+  dag_.reset();
 }
 
 void GPInstance::CheckSequencesAndTreesLoaded() const {
@@ -26,22 +28,122 @@ void GPInstance::CheckSequencesAndTreesLoaded() const {
         "Load an alignment into your GPInstance on which you wish to "
         "calculate phylogenetic likelihoods.");
   }
-  if (tree_collection_.TreeCount() == 0) {
+  if (tree_collection_.TreeCount() == 0 && dag_ == nullptr) {
     Failwith(
-        "Load some trees into your GPInstance on which you wish to "
+        "Load some trees or a SubsplitDAG into your GPInstance on which you wish to "
         "calculate phylogenetic likelihoods.");
   }
 }
 
-void GPInstance::MakeEngine() {
+void GPInstance::ProcessLoadedTrees(size_t thread_count) {
+  if (tree_collection_.TreeCount() == 0) {
+    Failwith("Load some trees into your GPInstance to make a SubsplitDAG.");
+  }
+  dag_ = SubsplitDAG::OfRootedTopologies(tree_collection_.TaxonNames(),
+                                         tree_collection_.TopologyCounter(),
+                                         thread_count);
+}
+
+void GPInstance::UseSubsplitDAG(std::shared_ptr<const SubsplitDAG> dag) {
+  Assert(dag != nullptr, "GPInstance::UseSubsplitDAG needs a DAG.");
+  if (tree_collection_.TreeCount() > 0 &&
+      tree_collection_.TaxonNames() != dag->TaxonNames()) {
+    Failwith("The taxon names of the SubsplitDAG don't match those of the trees.");
+  }
+  dag_ = std::move(dag);
+}
+
+std::shared_ptr<const SubsplitDAG> GPInstance::GetSubsplitDAG() const {
+  if (dag_ == nullptr) {
+    Failwith("Please call ProcessLoadedTrees to make a SubsplitDAG.");
+  }
+  return dag_;
+}
+
+void GPInstance::SaveSubsplitDAG(const std::string &path) const {
+  GetSubsplitDAG()->Save(path);
+}
+
+void GPInstance::LoadSubsplitDAG(const std::string &path) {
+  UseSubsplitDAG(SubsplitDAG::Load(path));
+}
+
+const SubsplitDAG &GPInstance::GetDAG() {
+  if (dag_ == nullptr) {
+    ProcessLoadedTrees();
+  }
+  return *dag_;
+}
+
+TagStringMap GPInstance::TagTaxonMap() const {
+  return RootedTreeCollection::TagStringMapOf(GetSubsplitDAG()->TaxonNames());
+}
+
+void GPInstance::MakeEngine(SitePatternOrder site_pattern_order,
+                            std::optional<size_t> max_memory, bool checkpointing) {
   CheckSequencesAndTreesLoaded();
-  ProcessLoadedTrees();
-  SitePattern site_pattern(alignment_, tree_collection_.TagTaxonMap());
-  engine_ = std::make_unique<GPEngine>(
-      // To count GPCSSs, we add the usual suspects to the number of leaves (which are
-      // the fake PCSS).
-      site_pattern, sbn_parameters_.size() + tree_collection_.TaxonCount(),
-      mmap_file_path_);
+  const auto &dag = GetDAG();
+  site_pattern_order_ = site_pattern_order;
+  SitePattern site_pattern(alignment_, TagTaxonMap(), 1, site_pattern_order_);
+  auto mmap_backing = mmap_backing_;
+  if (max_memory) {
+    auto byte_counts = GPEngine::EstimateByteCounts(site_pattern.PatternCount(),
+                                                    GPCSPCount(), dag.PLVCount());
+    const bool anonymous = mmap_backing == MmapBacking::Anonymous ||
+                           mmap_backing == MmapBacking::AnonymousHugePages;
+    if (anonymous && MemoryBudget::TotalByteCount(byte_counts) > *max_memory &&
+        !mmap_file_path_.empty()) {
+      mmap_backing = MmapBacking::EphemeralFile;
+      std::cout << "Putting the PLVs in an ephemeral file to fit in the memory budget."
+                << std::endl;
+    }
+    // File-backed PLVs can spill to disk, so they don't count against the budget.
+    if (mmap_backing == MmapBacking::File ||
+        mmap_backing == MmapBacking::EphemeralFile) {
+      byte_counts.erase("plvs");
+    }
+    MemoryBudget::CheckFits(byte_counts, *max_memory, "The GP engine");
+  }
+  std::optional<uint64_t> dag_fingerprint;
+  if (checkpointing) {
+    if (mmap_backing != MmapBacking::File) {
+      Failwith("Checkpointing a GPInstance needs MmapBacking::File.");
+    }
+    dag_fingerprint = dag.Fingerprint();
+  }
+  engine_ = std::make_unique<GPEngine>(site_pattern, GPCSPCount(), mmap_file_path_,
+                                       mmap_backing, dag_fingerprint, dag.PLVCount());
+  // A checkpoint brings its own q.
+  if (engine_->GetCheckpointResume() == GPCheckpointResume::None) {
+    engine_->SetQ(dag.UniformQ());
+  }
+}
+
+void GPInstance::WriteCheckpoint() { GetEngine()->WriteCheckpoint(); }
+
+#ifdef LIBSBN_CUDA
+std::unique_ptr<CUDAGPEngine> GPInstance::MakeCUDAEngine() const {
+  const SitePattern site_pattern(alignment_, TagTaxonMap(), 1, site_pattern_order_);
+  const auto engine = GetEngine();
+  auto cuda_engine = std::make_unique<CUDAGPEngine>(site_pattern, GPCSPCount(),
+                                                    engine->GetPLVCount());
+  cuda_engine->SetBranchLengths(engine->GetBranchLengths());
+  cuda_engine->SetQ(engine->GetQ());
+  return cuda_engine;
+}
+#endif
+
+StringSizeMap GPInstance::EstimateEngineByteCounts() {
+  CheckSequencesAndTreesLoaded();
+  const auto &dag = GetDAG();
+  const SitePattern site_pattern(alignment_, TagTaxonMap());
+  return GPEngine::EstimateByteCounts(site_pattern.PatternCount(), GPCSPCount(),
+                                      dag.PLVCount());
+}
+
+size_t GPInstance::GPCSPCount() const {
+  // The GPCSPs are the usual suspects and then the leaves (which are the fake PCSSs).
+  return GetSubsplitDAG()->GPCSPCount();
 }
 
 GPEngine *GPInstance::GetEngine() const {
@@ -54,35 +156,19 @@ GPEngine *GPInstance::GetEngine() const {
       "likelihood computation computation.");
 }
 
-void GPInstance::ClearTreeCollectionAssociatedState() {
-  sbn_parameters_.resize(0);
-  rootsplits_.clear();
-  indexer_.clear();
-  index_to_child_.clear();
-  parent_to_range_.clear();
-}
-
-void GPInstance::ProcessLoadedTrees() {
-  size_t index = 0;
-  ClearTreeCollectionAssociatedState();
-  auto topology_counter = tree_collection_.TopologyCounter();
-  // Start by adding the rootsplits.
-  for (const auto &iter : RootedSBNMaps::RootsplitCounterOf(topology_counter)) {
-    SafeInsert(indexer_, iter.first, index);
-    rootsplits_.push_back(iter.first);
-    index++;
-  }
-  // Now add the PCSSs.
-  for (const auto &[parent, child_counter] :
-       RootedSBNMaps::PCSSCounterOf(topology_counter)) {
-    SafeInsert(parent_to_range_, parent, {index, index + child_counter.size()});
-    for (const auto &child_iter : child_counter) {
-      const auto &child = child_iter.first;
-      SafeInsert(indexer_, parent + child, index);
-      SafeInsert(index_to_child_, index, Bitset::ChildSubsplit(parent, child));
-      index++;
-    }
-  }
-  sbn_parameters_.resize(index);
-  sbn_parameters_.setOnes();
+double GPInstance::SinglePrecisionLogLikelihoodDeviation(
+    const GPOperationVector &operations) {
+  auto engine = GetEngine();
+  SitePattern site_pattern(alignment_, TagTaxonMap(), 1, site_pattern_order_);
+  SinglePrecisionGPEngine single_precision_engine(
+      site_pattern, GPCSPCount(), "", MmapBacking::Anonymous, std::nullopt,
+      engine->GetPLVCount());
+  single_precision_engine.SetBranchLengths(engine->GetBranchLengths());
+  single_precision_engine.SetQ(engine->GetQ());
+  single_precision_engine.SetPatternTileWidth(engine->GetPatternTileWidth());
+  engine->ProcessOperations(operations);
+  single_precision_engine.ProcessOperations(operations);
+  return (engine->GetLogLikelihoods() - single_precision_engine.GetLogLikelihoods())
+      .cwiseAbs()
+      .maxCoeff();
 }
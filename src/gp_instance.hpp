@@ -4,47 +4,81 @@
 #ifndef SRC_GP_INSTANCE_HPP_
 #define SRC_GP_INSTANCE_HPP_
 
+#include "gp_cuda_engine.hpp"
 #include "gp_engine.hpp"
+#include "memory_budget.hpp"
 #include "rooted_tree_collection.hpp"
-#include "sbn_maps.hpp"
 #include "site_pattern.hpp"
+#include "subsplit_dag.hpp"
 #include "sugar.hpp"
 
 class GPInstance {
  public:
-  GPInstance(std::string mmap_file_path) : mmap_file_path_(mmap_file_path){};
+  GPInstance(std::string mmap_file_path, MmapBacking mmap_backing = MmapBacking::File)
+      : mmap_file_path_(mmap_file_path), mmap_backing_(mmap_backing){};
 
   void ReadFastaFile(std::string fname);
   void ReadNewickFile(std::string fname);
   void ReadNexusFile(std::string fname);
 
-  void MakeEngine();
+  // Make the SubsplitDAG of the loaded trees, counting their support with
+  // thread_count threads. MakeEngine does this if we don't have a DAG yet.
+  void ProcessLoadedTrees(size_t thread_count = 1);
+  // Use a DAG made elsewhere, such as by SBNInstance::GetSubsplitDAG, rather than
+  // making our own. If we have trees, the taxon names must match.
+  void UseSubsplitDAG(std::shared_ptr<const SubsplitDAG> dag);
+  std::shared_ptr<const SubsplitDAG> GetSubsplitDAG() const;
+  // Save our DAG with its GP schedules (see SubsplitDAG::Save), and load one back,
+  // after which we can make an engine with just an alignment.
+  void SaveSubsplitDAG(const std::string &path) const;
+  void LoadSubsplitDAG(const std::string &path);
+
+  // Make the engine, with the PLVs and q for the schedules of our SubsplitDAG (see
+  // SubsplitDAG::UniformQ), and with its PLV columns in this order of the site
+  // patterns. If we
+  // get a max_memory in bytes, we check the estimate of EstimateEngineByteCounts
+  // against it before allocating anything. PLVs in anonymous memory count against
+  // the budget; if they don't fit and we have a file path, we put them in an
+  // ephemeral file instead, from which pages can spill to disk. With checkpointing,
+  // which needs MmapBacking::File, the engine resumes from the checkpoint next to
+  // our PLV file if it is for the same alignment and DAG (see
+  // GPEngine::GetCheckpointResume), and WriteCheckpoint writes a new one.
+  void MakeEngine(
+      SitePatternOrder site_pattern_order = SitePatternOrder::FirstAppearance,
+      std::optional<size_t> max_memory = std::nullopt, bool checkpointing = false);
+  // Estimates of the bytes that MakeEngine would allocate; see
+  // GPEngine::EstimateByteCounts.
+  StringSizeMap EstimateEngineByteCounts();
   GPEngine *GetEngine() const;
+  void WriteCheckpoint();
+#ifdef LIBSBN_CUDA
+  // Make a CUDAGPEngine on the site patterns of our engine, starting from its branch
+  // lengths.
+  std::unique_ptr<CUDAGPEngine> MakeCUDAEngine() const;
+#endif
+
+  // Run the operations on our engine and on a SinglePrecisionGPEngine with the same
+  // branch lengths, and return the largest absolute difference between the resulting
+  // log likelihoods. This tells us how much we lose by storing PLVs as floats.
+  double SinglePrecisionLogLikelihoodDeviation(const GPOperationVector &operations);
 
  private:
   std::string mmap_file_path_;
+  MmapBacking mmap_backing_;
+  SitePatternOrder site_pattern_order_ = SitePatternOrder::FirstAppearance;
   Alignment alignment_;
   std::unique_ptr<GPEngine> engine_;
   RootedTreeCollection tree_collection_;
 
-  // A vector that contains all of the SBN-related probabilities.
-  EigenVectorXd sbn_parameters_;
-  // The master indexer for SBN parameters.
-  BitsetSizeMap indexer_;
-  // A map that indexes these probabilities: rootsplits are at the beginning,
-  // and PCSS bitsets are at the end.
-  // The collection of rootsplits, with the same indexing as in the indexer_.
-  BitsetVector rootsplits_;
-  // A map going from the index of a PCSS to its child.
-  SizeBitsetMap index_to_child_;
-  // A map going from a parent subsplit to the range of indices in
-  // sbn_parameters_ with its children. See the definition of Range for the indexing
-  // convention.
-  BitsetSizePairMap parent_to_range_;
-
-  void ClearTreeCollectionAssociatedState();
+  // The DAG of the loaded trees, which we may share with an SBNInstance.
+  std::shared_ptr<const SubsplitDAG> dag_;
+
   void CheckSequencesAndTreesLoaded() const;
-  void ProcessLoadedTrees();
+  // Make our DAG if we don't have one.
+  const SubsplitDAG &GetDAG();
+  size_t GPCSPCount() const;
+  // The taxa of our DAG, which are those of the trees if we have them.
+  TagStringMap TagTaxonMap() const;
 };
 
 #endif  // SRC_GP_INSTANCE_HPP_
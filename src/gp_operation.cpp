@@ -2,6 +2,276 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "gp_operation.hpp"
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <type_traits>
+
+// If `first` evolves a PLV that `second` multiplies, return the fused operation.
+template <typename TFused, typename TEvolve>
+std::optional<GPOperation> FuseEvolveAndMultiply(const TEvolve& evolve,
+                                                 const GPOperation& second) {
+  const auto* multiply = std::get_if<GPOperations::Multiply>(&second);
+  if (multiply == nullptr) {
+    return std::nullopt;
+  }  // else
+  if (multiply->src1_idx == evolve.dest_idx) {
+    return TFused{multiply->dest_idx, evolve.dest_idx, evolve.src_idx,
+                  evolve.branch_length_idx, multiply->src2_idx};
+  }  // else
+  if (multiply->src2_idx == evolve.dest_idx) {
+    return TFused{multiply->dest_idx, evolve.dest_idx, evolve.src_idx,
+                  evolve.branch_length_idx, multiply->src1_idx};
+  }  // else
+  return std::nullopt;
+}
+
+std::optional<GPOperation> FusePair(const GPOperation& first,
+                                    const GPOperation& second) {
+  if (const auto* evolve = std::get_if<GPOperations::EvolveRootward>(&first)) {
+    return FuseEvolveAndMultiply<GPOperations::EvolveRootwardAndMultiply>(*evolve,
+                                                                         second);
+  }  // else
+  if (const auto* evolve = std::get_if<GPOperations::EvolveLeafward>(&first)) {
+    return FuseEvolveAndMultiply<GPOperations::EvolveLeafwardAndMultiply>(*evolve,
+                                                                         second);
+  }  // else
+  if (const auto* zero = std::get_if<GPOperations::Zero>(&first)) {
+    const auto* accumulate = std::get_if<GPOperations::WeightedSumAccumulate>(&second);
+    // If we accumulated a PLV into itself after zeroing it, it would stay zero.
+    if (accumulate != nullptr && accumulate->dest_idx == zero->dest_idx &&
+        accumulate->src_idx != zero->dest_idx) {
+      return GPOperations::ZeroAndAccumulate{accumulate->dest_idx, accumulate->q_idx,
+                                             accumulate->src_idx};
+    }
+  }
+  return std::nullopt;
+}
+
+GPOperationVector GPOperations::Fuse(const GPOperationVector& operations) {
+  GPOperationVector fused;
+  fused.reserve(operations.size());
+  size_t idx = 0;
+  while (idx < operations.size()) {
+    if (idx + 1 < operations.size()) {
+      if (auto fused_pair = FusePair(operations[idx], operations[idx + 1])) {
+        fused.push_back(*fused_pair);
+        idx += 2;
+        continue;
+      }
+    }
+    fused.push_back(operations[idx]);
+    idx++;
+  }
+  return fused;
+}
+
+GPOperations::ReadWriteSet GPOperations::GetReadWriteSet(const GPOperation& operation,
+                                                         bool shared_temporaries) {
+  return std::visit(
+      [shared_temporaries](const auto& op) {
+        using OperationType = std::decay_t<decltype(op)>;
+        ReadWriteSet read_write_set;
+        constexpr bool is_optimization =
+            std::is_same_v<OperationType, OptimizeRootward> ||
+            std::is_same_v<OperationType, OptimizeLeafward>;
+        if constexpr (std::is_same_v<OperationType, UpdateSBNProbabilities>) {
+          read_write_set.exclusive_ = true;
+          return read_write_set;
+        }
+        // Optimizations use the engine's temporaries, but we still record what they
+        // touch so that we know which PLVs they use.
+        read_write_set.exclusive_ = is_optimization && shared_temporaries;
+        auto& reads = read_write_set.reads_;
+        auto& writes = read_write_set.writes_;
+        if constexpr (std::is_same_v<OperationType, Likelihood>) {
+          if (shared_temporaries) {
+            writes.push_back({PerPatternData, 0});
+          }
+        }
+        for (const auto& [name, idx] : op.guts()) {
+          if (name == "dest_idx") {
+            if constexpr (std::is_same_v<OperationType, Likelihood>) {
+              writes.push_back({LogLikelihoodData, idx});
+            } else {
+              writes.push_back({PLVData, idx});
+            }
+            // Accumulation also reads its destination.
+            if constexpr (std::is_same_v<OperationType, WeightedSumAccumulate>) {
+              reads.push_back({PLVData, idx});
+            }
+          } else if (name == "evolve_dest_idx") {
+            writes.push_back({PLVData, idx});
+          } else if (name == "src_idx" || name == "src1_idx" || name == "src2_idx" ||
+                     name == "other_idx") {
+            reads.push_back({PLVData, idx});
+          } else if (name == "leafward_idx" || name == "rootward_idx") {
+            reads.push_back({PLVData, idx});
+          } else if (name == "branch_length_idx") {
+            if constexpr (is_optimization) {
+              writes.push_back({BranchLengthData, idx});
+              writes.push_back({LogLikelihoodData, idx});
+            } else {
+              reads.push_back({BranchLengthData, idx});
+            }
+          } else if (name == "q_idx") {
+            reads.push_back({QData, idx});
+          } else {
+            Failwith("Don't know what the GPOperation field " + name + " refers to.");
+          }
+        }
+        return read_write_set;
+      },
+      operation);
+}
+
+SizeVector GPOperations::PLVIndices(const GPOperation& operation) {
+  const auto read_write_set = GetReadWriteSet(operation);
+  SizeVector plv_indices;
+  for (const auto* locations : {&read_write_set.reads_, &read_write_set.writes_}) {
+    for (const auto& [kind, idx] : *locations) {
+      if (kind == PLVData) {
+        plv_indices.push_back(idx);
+      }
+    }
+  }
+  std::sort(plv_indices.begin(), plv_indices.end());
+  plv_indices.erase(std::unique(plv_indices.begin(), plv_indices.end()),
+                    plv_indices.end());
+  return plv_indices;
+}
+
+std::unordered_map<size_t, GPOperations::PLVLiveInterval>
+GPOperations::PLVLiveIntervals(const std::vector<GPOperationVector>& steps) {
+  std::unordered_map<size_t, PLVLiveInterval> intervals;
+  for (size_t step_idx = 0; step_idx < steps.size(); step_idx++) {
+    for (const auto& operation : steps[step_idx]) {
+      const auto read_write_set = GetReadWriteSet(operation);
+      // An operation reads before it writes.
+      for (const auto& [kind, idx] : read_write_set.reads_) {
+        if (kind == PLVData) {
+          auto& interval = intervals[idx];
+          interval.read_before_write_ |= !interval.written_;
+          interval.last_use_ = step_idx;
+        }
+      }
+      for (const auto& [kind, idx] : read_write_set.writes_) {
+        if (kind == PLVData) {
+          auto& interval = intervals[idx];
+          if (!interval.written_) {
+            interval.written_ = true;
+            interval.first_write_ = step_idx;
+          }
+          interval.last_use_ = step_idx;
+        }
+      }
+    }
+  }
+  return intervals;
+}
+
+std::vector<GPOperationVector> GPOperations::DependencyLevels(
+    const GPOperationVector& operations, bool shared_temporaries) {
+  std::vector<GPOperationVector> levels;
+  // The level of the last operation that wrote each location, and the latest level
+  // of an operation that read it.
+  std::map<DataLocation, size_t> last_write_level;
+  std::map<DataLocation, size_t> last_read_level;
+  // No operation can go before (or alongside) the last exclusive operation.
+  size_t first_open_level = 0;
+  const auto after = [](const std::map<DataLocation, size_t>& level_map,
+                        const DataLocation& location, size_t level) {
+    auto search = level_map.find(location);
+    return search == level_map.end() ? level : std::max(level, search->second + 1);
+  };
+  for (const auto& operation : operations) {
+    const auto read_write_set = GetReadWriteSet(operation, shared_temporaries);
+    size_t level = first_open_level;
+    if (read_write_set.exclusive_) {
+      level = levels.size();
+      first_open_level = level + 1;
+    } else {
+      for (const auto& location : read_write_set.reads_) {
+        level = after(last_write_level, location, level);
+      }
+      for (const auto& location : read_write_set.writes_) {
+        level = after(last_write_level, location, level);
+        level = after(last_read_level, location, level);
+      }
+    }
+    for (const auto& location : read_write_set.reads_) {
+      auto& read_level = last_read_level[location];
+      read_level = std::max(read_level, level);
+    }
+    for (const auto& location : read_write_set.writes_) {
+      last_write_level[location] = level;
+    }
+    if (level == levels.size()) {
+      levels.emplace_back();
+    }
+    levels[level].push_back(operation);
+  }
+  return levels;
+}
+
+GPOperations::FlatOperation GPOperations::Flatten(const GPOperation& operation) {
+  FlatOperation flat{static_cast<uint32_t>(operation.index()), {0, 0, 0, 0, 0}};
+  const auto guts = std::visit([](const auto& op) { return op.guts(); }, operation);
+  Assert(guts.size() <= std::size(flat.indices_),
+         "Too many fields to flatten a GPOperation.");
+  for (size_t field_idx = 0; field_idx < guts.size(); field_idx++) {
+    const size_t idx = guts[field_idx].second;
+    Assert(idx <= std::numeric_limits<uint32_t>::max(),
+           "GPOperation index too large to flatten.");
+    flat.indices_[field_idx] = static_cast<uint32_t>(idx);
+  }
+  return flat;
+}
+
+namespace {
+
+// Every field of an operation is a size_t index, in the order of its guts().
+template <typename Operation, size_t... FieldIdx>
+GPOperation UnflattenAs(const GPOperations::FlatOperation& flat,
+                        std::index_sequence<FieldIdx...>) {
+  return Operation{static_cast<size_t>(flat.indices_[FieldIdx])...};
+}
+
+template <size_t Kind = 0>
+GPOperation UnflattenKind(const GPOperations::FlatOperation& flat) {
+  if constexpr (Kind < std::variant_size_v<GPOperation>) {
+    if (flat.kind_ == Kind) {
+      using Operation = std::variant_alternative_t<Kind, GPOperation>;
+      return UnflattenAs<Operation>(
+          flat, std::make_index_sequence<sizeof(Operation) / sizeof(size_t)>{});
+    }  // else
+    return UnflattenKind<Kind + 1>(flat);
+  } else {
+    Failwith("Unknown kind of flat GPOperation: " + std::to_string(flat.kind_));
+  }
+}
+
+}  // namespace
+
+GPOperation GPOperations::Unflatten(const FlatOperation& flat) {
+  return UnflattenKind(flat);
+}
+
+GPOperations::FlatSchedule GPOperations::FlatDependencyLevels(
+    const GPOperationVector& operations) {
+  FlatSchedule schedule;
+  schedule.operations_.reserve(operations.size());
+  schedule.level_offsets_.push_back(0);
+  for (const auto& level : DependencyLevels(operations, false)) {
+    for (const auto& operation : level) {
+      schedule.operations_.push_back(Flatten(operation));
+    }
+    schedule.level_offsets_.push_back(schedule.operations_.size());
+  }
+  return schedule;
+}
 
 std::ostream& operator<<(std::ostream& os, GPOperation const& operation) {
   std::visit(GPOperationOstream{os}, operation);
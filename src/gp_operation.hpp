@@ -6,7 +6,11 @@
 #ifndef GP_OPERATION_HPP_
 #define GP_OPERATION_HPP_
 
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 #include "sugar.hpp"
@@ -143,6 +147,54 @@ struct UpdateSBNProbabilities {
     return {{"start_idx", start_idx}, {"stop_idx", stop_idx}};
   }
 };
+
+// The following "macro-operations" are made by Fuse out of pairs of the above, so
+// that the engine can do both steps in one pass over the PLVs.
+
+// Perform `plv[evolve_dest_idx] = P(branch_lengths[branch_length_idx]) plv[src_idx]`
+// then `plv[dest_idx] = plv[evolve_dest_idx] o plv[other_idx]`.
+struct EvolveRootwardAndMultiply {
+  size_t dest_idx;
+  size_t evolve_dest_idx;
+  size_t src_idx;
+  size_t branch_length_idx;
+  size_t other_idx;
+  StringSizePairVector guts() const {
+    return {{"dest_idx", dest_idx},
+            {"evolve_dest_idx", evolve_dest_idx},
+            {"src_idx", src_idx},
+            {"branch_length_idx", branch_length_idx},
+            {"other_idx", other_idx}};
+  }
+};
+
+// Perform `plv[evolve_dest_idx] = P'(branch_lengths[branch_length_idx]) plv[src_idx]`
+// then `plv[dest_idx] = plv[evolve_dest_idx] o plv[other_idx]`.
+struct EvolveLeafwardAndMultiply {
+  size_t dest_idx;
+  size_t evolve_dest_idx;
+  size_t src_idx;
+  size_t branch_length_idx;
+  size_t other_idx;
+  StringSizePairVector guts() const {
+    return {{"dest_idx", dest_idx},
+            {"evolve_dest_idx", evolve_dest_idx},
+            {"src_idx", src_idx},
+            {"branch_length_idx", branch_length_idx},
+            {"other_idx", other_idx}};
+  }
+};
+
+// Perform `plv[dest_idx] = q[q_idx] * plv[src_idx]`, which is Zero followed by
+// WeightedSumAccumulate when `dest_idx != src_idx`.
+struct ZeroAndAccumulate {
+  size_t dest_idx;
+  size_t q_idx;
+  size_t src_idx;
+  StringSizePairVector guts() const {
+    return {{"dest_idx", dest_idx}, {"q_idx", q_idx}, {"src_idx", src_idx}};
+  }
+};
 }  // namespace GPOperations
 
 using GPOperation =
@@ -150,10 +202,93 @@ using GPOperation =
                  GPOperations::WeightedSumAccumulate, GPOperations::Multiply,
                  GPOperations::Likelihood, GPOperations::EvolveRootward,
                  GPOperations::EvolveLeafward, GPOperations::OptimizeRootward,
-                 GPOperations::OptimizeLeafward, GPOperations::UpdateSBNProbabilities>;
+                 GPOperations::OptimizeLeafward, GPOperations::UpdateSBNProbabilities,
+                 GPOperations::EvolveRootwardAndMultiply,
+                 GPOperations::EvolveLeafwardAndMultiply,
+                 GPOperations::ZeroAndAccumulate>;
 
 using GPOperationVector = std::vector<GPOperation>;
 
+namespace GPOperations {
+// Rewrite operations into an equivalent sequence in which each adjacent pair
+// * EvolveRootward (or EvolveLeafward) then a Multiply that reads its result, or
+// * Zero then a WeightedSumAccumulate into the same PLV from a different one
+// is replaced by the corresponding fused operation.
+GPOperationVector Fuse(const GPOperationVector& operations);
+
+// The kinds of data that operations read and write, each indexed as described at the
+// top of this file. PerPatternData is the engine's single set of per-pattern
+// temporaries, which likelihood computations use.
+enum DataKind { PLVData, BranchLengthData, LogLikelihoodData, QData, PerPatternData };
+using DataLocation = std::pair<DataKind, size_t>;
+
+// The locations that an operation reads and writes, which we get from the index
+// fields of its guts(). An exclusive operation (such as an optimization, which uses
+// the engine's temporaries) has to run on its own. We don't record locations for
+// UpdateSBNProbabilities, which works on a range. An engine without shared
+// temporaries (such as CUDAGPEngine, which keeps them per operation) can pass
+// shared_temporaries = false, so that likelihoods and optimizations only depend on
+// what they actually touch.
+struct ReadWriteSet {
+  std::vector<DataLocation> reads_;
+  std::vector<DataLocation> writes_;
+  bool exclusive_ = false;
+};
+ReadWriteSet GetReadWriteSet(const GPOperation& operation,
+                             bool shared_temporaries = true);
+// The indices of the PLVs that an operation reads or writes, without duplicates.
+SizeVector PLVIndices(const GPOperation& operation);
+
+// When a PLV is live in a sequence of steps (each a vector of operations): from the
+// first step that writes it to the last step that uses it. If some step reads it
+// before any step writes it, read_before_write_ is set, and first_write_ is only
+// meaningful when written_ is.
+struct PLVLiveInterval {
+  bool written_ = false;
+  bool read_before_write_ = false;
+  size_t first_write_ = 0;
+  size_t last_use_ = 0;
+};
+std::unordered_map<size_t, PLVLiveInterval> PLVLiveIntervals(
+    const std::vector<GPOperationVector>& steps);
+
+// Split operations into levels, such that each operation only depends (via a
+// read-after-write, write-after-read, or write-after-write on some location) on
+// operations in earlier levels. Thus the operations within a level can run in any
+// order, including at the same time. Operations keep their relative order within a
+// level, and an exclusive operation gets a level to itself. See GetReadWriteSet for
+// shared_temporaries.
+std::vector<GPOperationVector> DependencyLevels(const GPOperationVector& operations,
+                                                bool shared_temporaries = true);
+
+// An operation as plain data, for engines that can't visit a std::variant, such as
+// CUDAGPEngine on the device. The kind_ is the index of the operation type in
+// GPOperation (see KindOf), and the indices_ are the values of its guts() in order.
+struct FlatOperation {
+  uint32_t kind_;
+  uint32_t indices_[5];
+};
+
+template <typename Operation>
+constexpr uint32_t KindOf() {
+  return static_cast<uint32_t>(GPOperation(Operation{}).index());
+}
+
+// The dependency levels of operations, without shared temporaries, one after the
+// other. Level i is operations_[level_offsets_[i]] up to (but not including)
+// operations_[level_offsets_[i + 1]].
+struct FlatSchedule {
+  std::vector<FlatOperation> operations_;
+  SizeVector level_offsets_;
+
+  size_t LevelCount() const { return level_offsets_.size() - 1; }
+};
+FlatOperation Flatten(const GPOperation& operation);
+// The inverse of Flatten.
+GPOperation Unflatten(const FlatOperation& flat);
+FlatSchedule FlatDependencyLevels(const GPOperationVector& operations);
+}  // namespace GPOperations
+
 struct GPOperationOstream {
   std::ostream& os_;
 
@@ -189,6 +324,15 @@ struct GPOperationOstream {
   void operator()(const GPOperations::UpdateSBNProbabilities& operation) {
     os_ << "UpdateSBNProbabilities" << operation.guts();
   }
+  void operator()(const GPOperations::EvolveRootwardAndMultiply& operation) {
+    os_ << "EvolveRootwardAndMultiply" << operation.guts();
+  }
+  void operator()(const GPOperations::EvolveLeafwardAndMultiply& operation) {
+    os_ << "EvolveLeafwardAndMultiply" << operation.guts();
+  }
+  void operator()(const GPOperations::ZeroAndAccumulate& operation) {
+    os_ << "ZeroAndAccumulate" << operation.guts();
+  }
 };
 
 std::ostream& operator<<(std::ostream& os, GPOperation const& operation);
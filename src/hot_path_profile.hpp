@@ -0,0 +1,148 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A HotPathProfile accumulates the time spent in, and the number of calls to, each
+// phase of likelihood computation, along with a histogram of how long units of
+// Work wait in the WorkStealingPool before a thread picks them up.
+//
+// Each FatBeagle keeps its own profile, which it only touches when profiling is
+// switched on, and an Engine sums these together with the queue waits of its pool.
+// Time is measured with a steady clock in nanoseconds.
+
+#ifndef SRC_HOT_PATH_PROFILE_HPP_
+#define SRC_HOT_PATH_PROFILE_HPP_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class HotPathProfile {
+ public:
+  using Clock = std::chrono::steady_clock;
+  enum Phase : size_t {
+    ParameterUpload,
+    TransitionMatrices,
+    Partials,
+    PrePartials,
+    EdgeDerivatives,
+    RootLikelihoods,
+    PhaseCount
+  };
+  struct PhaseCounter {
+    uint64_t nanoseconds_ = 0;
+    uint64_t call_count_ = 0;
+  };
+  // Entry i of the queue wait histogram counts the Work that waited for between 2^i
+  // and 2^(i+1) nanoseconds (entry 0 also counts waits shorter than a nanosecond).
+  static constexpr size_t queue_wait_bucket_count_ = 64;
+  using QueueWaitHistogram = std::array<uint64_t, queue_wait_bucket_count_>;
+
+  // Time the lifetime of a PhaseScope as a call to the given phase of a profile. A
+  // null profile turns this into a no-op, which is how we skip the clock when
+  // profiling is off.
+  class PhaseScope {
+   public:
+    PhaseScope(HotPathProfile *profile, Phase phase)
+        : profile_(profile), phase_(phase) {
+      if (profile_ != nullptr) {
+        start_ = Clock::now();
+      }
+    }
+    ~PhaseScope() {
+      if (profile_ != nullptr) {
+        profile_->AddPhase(phase_, Clock::now() - start_);
+      }
+    }
+    PhaseScope(const PhaseScope &) = delete;
+    PhaseScope &operator=(const PhaseScope &) = delete;
+
+   private:
+    HotPathProfile *const profile_;
+    const Phase phase_;
+    Clock::time_point start_;
+  };
+
+  static const std::string &PhaseName(Phase phase) {
+    static const std::array<std::string, PhaseCount> phase_names = {
+        "parameter_upload", "transition_matrices", "partials",
+        "pre_partials",     "edge_derivatives",    "root_likelihoods"};
+    return phase_names.at(phase);
+  }
+
+  static size_t QueueWaitBucket(uint64_t nanoseconds) {
+    size_t bucket = 0;
+    while (nanoseconds > 1) {
+      nanoseconds >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  const PhaseCounter &GetPhaseCounter(Phase phase) const { return phases_.at(phase); }
+  const QueueWaitHistogram &GetQueueWaitHistogram() const {
+    return queue_wait_histogram_;
+  }
+
+  void AddPhase(Phase phase, Clock::duration duration) {
+    auto &counter = phases_.at(phase);
+    counter.nanoseconds_ += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    counter.call_count_++;
+  }
+  void AddQueueWaitHistogram(const QueueWaitHistogram &histogram) {
+    for (size_t i = 0; i < queue_wait_bucket_count_; i++) {
+      queue_wait_histogram_[i] += histogram[i];
+    }
+  }
+
+  HotPathProfile &operator+=(const HotPathProfile &other) {
+    for (size_t phase = 0; phase < PhaseCount; phase++) {
+      phases_[phase].nanoseconds_ += other.phases_[phase].nanoseconds_;
+      phases_[phase].call_count_ += other.phases_[phase].call_count_;
+    }
+    AddQueueWaitHistogram(other.queue_wait_histogram_);
+    return *this;
+  }
+
+  void Reset() {
+    phases_.fill(PhaseCounter());
+    queue_wait_histogram_.fill(0);
+  }
+
+ private:
+  std::array<PhaseCounter, PhaseCount> phases_;
+  QueueWaitHistogram queue_wait_histogram_ = {};
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("HotPathProfile") {
+  HotPathProfile profile;
+  { HotPathProfile::PhaseScope scope(&profile, HotPathProfile::Partials); }
+  { HotPathProfile::PhaseScope scope(nullptr, HotPathProfile::Partials); }
+  profile.AddPhase(HotPathProfile::Partials, std::chrono::nanoseconds(100));
+  CHECK_EQ(profile.GetPhaseCounter(HotPathProfile::Partials).call_count_, 2);
+  CHECK_GE(profile.GetPhaseCounter(HotPathProfile::Partials).nanoseconds_, 100);
+  CHECK_EQ(profile.GetPhaseCounter(HotPathProfile::PrePartials).call_count_, 0);
+  CHECK_EQ(HotPathProfile::PhaseName(HotPathProfile::EdgeDerivatives),
+           "edge_derivatives");
+  CHECK_EQ(HotPathProfile::QueueWaitBucket(0), 0);
+  CHECK_EQ(HotPathProfile::QueueWaitBucket(1), 0);
+  CHECK_EQ(HotPathProfile::QueueWaitBucket(2), 1);
+  CHECK_EQ(HotPathProfile::QueueWaitBucket(1000), 9);
+  HotPathProfile::QueueWaitHistogram histogram = {};
+  histogram[3] = 5;
+  HotPathProfile total;
+  total.AddQueueWaitHistogram(histogram);
+  total += profile;
+  total += profile;
+  CHECK_EQ(total.GetPhaseCounter(HotPathProfile::Partials).call_count_, 4);
+  CHECK_EQ(total.GetQueueWaitHistogram()[3], 5);
+  total.Reset();
+  CHECK_EQ(total.GetPhaseCounter(HotPathProfile::Partials).call_count_, 0);
+  CHECK_EQ(total.GetQueueWaitHistogram()[3], 0);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_HOT_PATH_PROFILE_HPP_
@@ -0,0 +1,121 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// An ImportanceSamplingAccumulator takes log importance weights log w = log p(x, y) -
+// log q(x) one at a time and keeps running sums from which we get, in constant memory,
+//
+// * the ELBO estimate, the mean of log w, with its standard error;
+// * the log marginal likelihood estimate, log of the mean of w, with its standard
+//   error by the delta method, sd(w) / (sqrt(n) mean(w));
+// * the effective sample size (sum w)^2 / sum w^2.
+//
+// The weights are summed relative to the largest log weight so far, rescaling the sums
+// when it grows, so that they neither overflow nor underflow.
+
+#ifndef SRC_IMPORTANCE_SAMPLING_HPP_
+#define SRC_IMPORTANCE_SAMPLING_HPP_
+
+#include <cmath>
+#include "numerical_utils.hpp"
+
+class ImportanceSamplingAccumulator {
+ public:
+  void Add(double log_weight) {
+    count_++;
+    // Welford's update of the mean and sum of squared deviations of log w.
+    const double delta = log_weight - log_weight_mean_;
+    log_weight_mean_ += delta / static_cast<double>(count_);
+    log_weight_m2_ += delta * (log_weight - log_weight_mean_);
+    if (log_weight > max_log_weight_) {
+      const double rescaling = std::exp(max_log_weight_ - log_weight);
+      weight_sum_ *= rescaling;
+      weight_square_sum_ *= rescaling * rescaling;
+      max_log_weight_ = log_weight;
+    }
+    const double weight = std::exp(log_weight - max_log_weight_);
+    weight_sum_ += weight;
+    weight_square_sum_ += weight * weight;
+  }
+
+  size_t Count() const { return count_; }
+  double ELBO() const { return log_weight_mean_; }
+  double ELBOStandardError() const {
+    return count_ < 2 ? DOUBLE_NAN
+                      : std::sqrt(log_weight_m2_ / static_cast<double>(count_ - 1) /
+                                  static_cast<double>(count_));
+  }
+  double LogMarginalLikelihood() const {
+    return max_log_weight_ + std::log(weight_sum_ / static_cast<double>(count_));
+  }
+  double LogMarginalLikelihoodStandardError() const {
+    if (count_ < 2) {
+      return DOUBLE_NAN;
+    }  // else
+    // With S and S2 the sums of w and w^2, var(w) / mean(w)^2 / n is this.
+    const double n = static_cast<double>(count_);
+    const double relative_variance =
+        (n * weight_square_sum_ / (weight_sum_ * weight_sum_) - 1.) / (n - 1.);
+    return std::sqrt(std::max(relative_variance, 0.));
+  }
+  double EffectiveSampleSize() const {
+    return weight_sum_ * weight_sum_ / weight_square_sum_;
+  }
+
+ private:
+  size_t count_ = 0;
+  double log_weight_mean_ = 0.;
+  double log_weight_m2_ = 0.;
+  double max_log_weight_ = DOUBLE_NEG_INF;
+  // The sums of w and w^2, each divided by the largest w (squared) so far.
+  double weight_sum_ = 0.;
+  double weight_square_sum_ = 0.;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("ImportanceSamplingAccumulator") {
+  // Log weights far below anything exp can represent.
+  const std::vector<double> log_weights{-1000., -1001., -999.5, -1003., -1000.25};
+  ImportanceSamplingAccumulator accumulator;
+  for (const double log_weight : log_weights) {
+    accumulator.Add(log_weight);
+  }
+  const double n = static_cast<double>(log_weights.size());
+  double mean = 0.;
+  double weight_sum = 0.;
+  double weight_square_sum = 0.;
+  for (const double log_weight : log_weights) {
+    mean += log_weight / n;
+    weight_sum += std::exp(log_weight + 1000.);
+    weight_square_sum += std::exp(2. * (log_weight + 1000.));
+  }
+  double variance = 0.;
+  for (const double log_weight : log_weights) {
+    variance += (log_weight - mean) * (log_weight - mean) / (n - 1.);
+  }
+  const double weight_mean = weight_sum / n;
+  const double weight_variance =
+      (weight_square_sum - weight_sum * weight_sum / n) / (n - 1.);
+  CHECK_EQ(accumulator.Count(), log_weights.size());
+  CHECK_LT(fabs(accumulator.ELBO() - mean), 1e-10);
+  CHECK_LT(fabs(accumulator.ELBOStandardError() - std::sqrt(variance / n)), 1e-10);
+  CHECK_LT(fabs(accumulator.LogMarginalLikelihood() - (std::log(weight_mean) - 1000.)),
+           1e-10);
+  CHECK_LT(fabs(accumulator.LogMarginalLikelihoodStandardError() -
+                std::sqrt(weight_variance / n) / weight_mean),
+           1e-10);
+  CHECK_LT(fabs(accumulator.EffectiveSampleSize() -
+                weight_sum * weight_sum / weight_square_sum),
+           1e-10);
+  // Equal weights have no spread.
+  ImportanceSamplingAccumulator equal_accumulator;
+  for (size_t idx = 0; idx < 4; idx++) {
+    equal_accumulator.Add(-3.);
+  }
+  CHECK_EQ(equal_accumulator.LogMarginalLikelihood(), doctest::Approx(-3.));
+  CHECK_EQ(equal_accumulator.LogMarginalLikelihoodStandardError(),
+           doctest::Approx(0.));
+  CHECK_EQ(equal_accumulator.EffectiveSampleSize(), doctest::Approx(4.));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_IMPORTANCE_SAMPLING_HPP_
@@ -0,0 +1,86 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Helpers for sizing engines to a memory budget. The footprint estimators
+// (SBNInstance::EstimatePhyloLikelihoodByteCounts and
+// GPInstance::EstimateEngineByteCounts) give their estimates as a StringSizeMap from
+// the name of each component to its bytes, like SBNInstance::MemoryByteCounts.
+
+#ifndef SRC_MEMORY_BUDGET_HPP_
+#define SRC_MEMORY_BUDGET_HPP_
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "sugar.hpp"
+
+namespace MemoryBudget {
+
+inline size_t TotalByteCount(const StringSizeMap &byte_counts) {
+  size_t total = 0;
+  for (const auto &[_, byte_count] : byte_counts) {
+    total += byte_count;
+  }
+  return total;
+}
+
+// A number of bytes in the largest binary unit that keeps it at least 1, such as
+// "1.5 GiB".
+inline std::string ByteCountString(size_t byte_count) {
+  const std::vector<std::string> units = {"bytes", "KiB", "MiB", "GiB", "TiB"};
+  double scaled = static_cast<double>(byte_count);
+  size_t unit_idx = 0;
+  while (scaled >= 1024. && unit_idx + 1 < units.size()) {
+    scaled /= 1024.;
+    unit_idx++;
+  }
+  std::ostringstream stream;
+  stream.precision(unit_idx == 0 ? 0 : 1);
+  stream << std::fixed << scaled << " " << units[unit_idx];
+  return stream.str();
+}
+
+// The components of byte_counts, largest first, and their total, one to a line.
+inline std::string ByteCountsString(const StringSizeMap &byte_counts) {
+  std::vector<std::pair<std::string, size_t>> components(byte_counts.begin(),
+                                                         byte_counts.end());
+  std::sort(components.begin(), components.end(), [](const auto &a, const auto &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  });
+  std::ostringstream stream;
+  for (const auto &[name, byte_count] : components) {
+    stream << "  " << name << ": " << ByteCountString(byte_count) << "\n";
+  }
+  stream << "  total: " << ByteCountString(TotalByteCount(byte_counts)) << "\n";
+  return stream.str();
+}
+
+// Fail if byte_counts totals more than max_memory bytes, explaining what the estimate
+// is made of.
+inline void CheckFits(const StringSizeMap &byte_counts, size_t max_memory,
+                      const std::string &what) {
+  if (TotalByteCount(byte_counts) > max_memory) {
+    Failwith(what + " would need more than the " + ByteCountString(max_memory) +
+             " allowed:\n" + ByteCountsString(byte_counts));
+  }
+}
+
+}  // namespace MemoryBudget
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("MemoryBudget") {
+  CHECK_EQ(MemoryBudget::ByteCountString(1000), "1000 bytes");
+  CHECK_EQ(MemoryBudget::ByteCountString(1536), "1.5 KiB");
+  CHECK_EQ(MemoryBudget::ByteCountString(size_t(3) << 30), "3.0 GiB");
+  const StringSizeMap byte_counts{{"small", 10}, {"large", 2048}};
+  CHECK_EQ(MemoryBudget::TotalByteCount(byte_counts), 2058);
+  CHECK_EQ(MemoryBudget::ByteCountsString(byte_counts),
+           "  large: 2.0 KiB\n  small: 10 bytes\n  total: 2.0 KiB\n");
+  CHECK_NOTHROW(MemoryBudget::CheckFits(byte_counts, 2058, "This"));
+  CHECK_THROWS(MemoryBudget::CheckFits(byte_counts, 2057, "This"));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_MEMORY_BUDGET_HPP_
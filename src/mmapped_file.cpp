@@ -0,0 +1,220 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "mmapped_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+MmappedFile::MmappedFile(const std::string &path) {
+  const int file_descriptor = open(path.c_str(), O_RDONLY);
+  if (file_descriptor == -1) {
+    Failwith("Could not open '" + path + "'");
+  }
+  struct stat file_status;
+  if (fstat(file_descriptor, &file_status) != 0) {
+    close(file_descriptor);
+    Failwith("Could not get the size of '" + path + "'");
+  }
+  if (S_ISREG(file_status.st_mode) && file_status.st_size > 0) {
+    const auto size = static_cast<size_t>(file_status.st_size);
+    void *mapped_memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    if (mapped_memory != MAP_FAILED) {
+      // The mapping keeps the file open, so we can close our descriptor.
+      close(file_descriptor);
+      // We read front to back, so ask for aggressive readahead.
+      madvise(mapped_memory, size, MADV_SEQUENTIAL);
+      mapped_memory_ = static_cast<char *>(mapped_memory);
+      mapped_size_ = size;
+      raw_contents_ = std::string_view(mapped_memory_, mapped_size_);
+    }
+  }
+  if (mapped_memory_ == nullptr) {
+    char chunk[1 << 16];
+    while (true) {
+      const ssize_t read_count = read(file_descriptor, chunk, sizeof(chunk));
+      if (read_count == 0) {
+        break;
+      }
+      if (read_count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        close(file_descriptor);
+        Failwith("Could not read '" + path + "': " + strerror(errno));
+      }
+      buffer_.append(chunk, static_cast<size_t>(read_count));
+    }
+    close(file_descriptor);
+    raw_contents_ = buffer_;
+  }
+  const auto starts_with = [this](std::string_view magic) {
+    return raw_contents_.substr(0, magic.size()) == magic;
+  };
+  if (starts_with(std::string_view("\x1f\x8b", 2))) {
+    StartInflating(path);
+  } else if (starts_with(std::string_view("\x28\xb5\x2f\xfd", 4))) {
+    Release();
+    Failwith("'" + path +
+             "' is compressed with zstd, which we can't read. Please decompress it "
+             "or recompress it with gzip.");
+  } else {
+    available_.data_ = raw_contents_.data();
+    available_.size_ = raw_contents_.size();
+  }
+}
+
+MmappedFile::~MmappedFile() { Release(); }
+
+void MmappedFile::Release() {
+  if (inflater_.joinable()) {
+    stopping_ = true;
+    inflater_.join();
+  }
+  if (inflated_memory_ != nullptr &&
+      munmap(inflated_memory_, inflated_capacity_) != 0) {
+    std::cout << "Warning: munmap did not succeed in MmappedFile: " << strerror(errno)
+              << std::endl;
+  }
+  inflated_memory_ = nullptr;
+  if (mapped_memory_ != nullptr && munmap(mapped_memory_, mapped_size_) != 0) {
+    std::cout << "Warning: munmap did not succeed in MmappedFile: " << strerror(errno)
+              << std::endl;
+  }
+  mapped_memory_ = nullptr;
+}
+
+std::string_view MmappedFile::Contents() const {
+  std::unique_lock<std::mutex> lock(lock_);
+  more_available_.wait(lock, [this] { return available_.complete_; });
+  if (!available_.error_.empty()) {
+    Failwith(available_.error_);
+  }
+  return std::string_view(available_.data_, available_.size_);
+}
+
+std::string_view MmappedFile::WaitForMoreThan(size_t size) const {
+  std::unique_lock<std::mutex> lock(lock_);
+  more_available_.wait(
+      lock, [this, size] { return available_.complete_ || available_.size_ > size; });
+  if (!available_.error_.empty()) {
+    Failwith(available_.error_);
+  }
+  return std::string_view(available_.data_, available_.size_);
+}
+
+void MmappedFile::StartInflating(const std::string &path) {
+  // Deflate can't compress by more than a factor of about 1032, so this is enough
+  // memory for any gzip file. We only reserve address space here, and pages only
+  // get backed as the inflater writes to them.
+  const size_t capacity = 1032 * raw_contents_.size() + (1 << 10);
+  void *memory = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory != MAP_FAILED) {
+    inflated_memory_ = static_cast<char *>(memory);
+    inflated_capacity_ = capacity;
+    available_.data_ = inflated_memory_;
+    available_.complete_ = false;
+    inflater_ = std::thread([this, path] {
+      const std::string error =
+          Inflate(inflated_memory_, inflated_capacity_, [this](size_t size) {
+            {
+              std::lock_guard<std::mutex> lock(lock_);
+              available_.size_ = size;
+            }
+            more_available_.notify_all();
+          });
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        available_.complete_ = true;
+        if (!error.empty()) {
+          available_.error_ = "Could not inflate '" + path + "': " + error;
+        }
+      }
+      more_available_.notify_all();
+    });
+    return;
+  }  // else
+  // We can't reserve the memory, so we find out how big the inflated file is and
+  // then inflate it into a buffer of that size before returning.
+  size_t inflated_size = 0;
+  std::string error =
+      Inflate(nullptr, 0, [&inflated_size](size_t size) { inflated_size = size; });
+  if (error.empty()) {
+    inflated_buffer_.resize(inflated_size + 1);
+    error = Inflate(inflated_buffer_.data(), inflated_buffer_.size(), [](size_t) {});
+    inflated_buffer_.resize(inflated_size);
+  }
+  if (!error.empty()) {
+    Release();
+    Failwith("Could not inflate '" + path + "': " + error);
+  }
+  available_.data_ = inflated_buffer_.data();
+  available_.size_ = inflated_buffer_.size();
+}
+
+std::string MmappedFile::Inflate(char *output, size_t capacity,
+                                 const std::function<void(size_t)> &publish) {
+  // We publish the inflated contents a chunk at a time.
+  constexpr size_t chunk_size = 1 << 20;
+  // zlib counts bytes with unsigned ints, so we give it the input in pieces.
+  constexpr size_t max_input_size = 1 << 30;
+  // Without output, we just count the inflated bytes.
+  std::vector<char> scratch(output == nullptr ? chunk_size : 0);
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  // This window size asks for a gzip header.
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    return "zlib could not start.";
+  }
+  size_t input_position = 0;
+  size_t output_size = 0;
+  std::string error;
+  while (!stopping_) {
+    if (stream.avail_in == 0 && input_position < raw_contents_.size()) {
+      const size_t input_size =
+          std::min(raw_contents_.size() - input_position, max_input_size);
+      stream.next_in = reinterpret_cast<Bytef *>(
+          const_cast<char *>(raw_contents_.data() + input_position));
+      stream.avail_in = static_cast<uInt>(input_size);
+      input_position += input_size;
+    }
+    char *chunk = output == nullptr ? scratch.data() : output + output_size;
+    const size_t output_chunk_size = output == nullptr
+                                         ? scratch.size()
+                                         : std::min(capacity - output_size, chunk_size);
+    if (output_chunk_size == 0) {
+      error = "the inflated contents are bigger than we expected.";
+      break;
+    }
+    stream.next_out = reinterpret_cast<Bytef *>(chunk);
+    stream.avail_out = static_cast<uInt>(output_chunk_size);
+    const int status = inflate(&stream, Z_NO_FLUSH);
+    output_size += output_chunk_size - stream.avail_out;
+    publish(output_size);
+    const bool input_done =
+        stream.avail_in == 0 && input_position == raw_contents_.size();
+    if (status == Z_STREAM_END) {
+      if (input_done) {
+        break;
+      }  // else
+      // A gzip file can be several gzip streams one after another.
+      inflateReset(&stream);
+    } else if (status == Z_BUF_ERROR && input_done) {
+      error = "the file ends in the middle of a gzip stream.";
+      break;
+    } else if (status != Z_OK && status != Z_BUF_ERROR) {
+      error = stream.msg != nullptr ? std::string(stream.msg)
+                                    : "zlib error " + std::to_string(status);
+      break;
+    }
+  }
+  inflateEnd(&stream);
+  return error;
+}
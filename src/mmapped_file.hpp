@@ -0,0 +1,195 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Read-only input files as string_views, for the tree and alignment readers.
+//
+// An MmappedFile maps a regular file into memory, so reading it doesn't copy it
+// through a stream buffer and then again into a string for each line: the readers
+// tokenize string_view slices of the mapped pages directly. Files that we can't map,
+// such as pipes or files in /proc that claim to be empty, are read into a buffer.
+//
+// Gzipped files, which we recognize by their magic bytes, are inflated on a thread
+// of their own into memory that we reserve up front and never move. Views of the
+// inflated text so far stay valid as it grows, so a LineReader of the file can hand
+// out lines while the rest is still being inflated, and parsing overlaps inflating.
+// We recognize zstd files but can't read them.
+//
+// A LineReader iterates over the lines of a string_view, or of an MmappedFile as
+// it becomes available.
+
+#ifndef SRC_MMAPPED_FILE_HPP_
+#define SRC_MMAPPED_FILE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "sugar.hpp"
+
+class MmappedFile {
+ public:
+  explicit MmappedFile(const std::string &path);
+  ~MmappedFile();
+
+  MmappedFile(const MmappedFile &) = delete;
+  MmappedFile &operator=(const MmappedFile &) = delete;
+
+  // The contents of the file, inflated if it is gzipped, which are valid for the
+  // lifetime of this object. This waits for inflating to finish.
+  std::string_view Contents() const;
+  // Wait until more than size bytes of the contents are available, or all of them
+  // are, and return the contents so far. Returning size bytes means that there are no
+  // more.
+  std::string_view WaitForMoreThan(size_t size) const;
+
+ private:
+  // Null unless the file is mapped.
+  char *mapped_memory_ = nullptr;
+  size_t mapped_size_ = 0;
+  // The contents of a file that we couldn't map.
+  std::string buffer_;
+  // The file as it is on disk.
+  std::string_view raw_contents_;
+
+  // For gzipped files, the reserved memory if we got it, and otherwise the result of
+  // inflating all of the file before returning from the constructor.
+  char *inflated_memory_ = nullptr;
+  size_t inflated_capacity_ = 0;
+  std::string inflated_buffer_;
+  std::thread inflater_;
+  std::atomic<bool> stopping_{false};
+
+  // The contents so far, which the inflater thread grows under lock_.
+  struct Available {
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    bool complete_ = true;
+    // Why inflating failed, if it did.
+    std::string error_;
+  };
+  Available available_;
+  mutable std::mutex lock_;
+  mutable std::condition_variable more_available_;
+
+  void StartInflating(const std::string &path);
+  // Stop the inflater and unmap the memory.
+  void Release();
+  // Inflate raw_contents_ into output, calling publish with the number of bytes
+  // inflated so far. Returns an error message, or the empty string on success.
+  std::string Inflate(char *output, size_t capacity,
+                      const std::function<void(size_t)> &publish);
+};
+
+class LineReader {
+ public:
+  explicit LineReader(std::string_view text) : text_(text) {}
+  // Read the lines of the file as they become available.
+  explicit LineReader(const MmappedFile &file)
+      : text_(file.WaitForMoreThan(0)), file_(&file) {}
+
+  // Get the next line, without its '\n', as std::getline does. Returns false at the
+  // end of the text.
+  bool NextLine(std::string_view &line) {
+    size_t line_end = text_.find('\n', position_);
+    while (line_end == std::string_view::npos && file_ != nullptr) {
+      const size_t searched_size = text_.size();
+      text_ = file_->WaitForMoreThan(searched_size);
+      if (text_.size() == searched_size) {
+        // We have all of the file.
+        file_ = nullptr;
+      } else {
+        line_end = text_.find('\n', searched_size);
+      }
+    }
+    if (position_ >= text_.size()) {
+      return false;
+    }  // else
+    line_end = std::min(line_end, text_.size());
+    line = text_.substr(position_, line_end - position_);
+    position_ = line_end + 1;
+    return true;
+  }
+  // The offset of the start of the next line, which we can return to with
+  // SetPosition.
+  size_t Position() const { return position_; }
+  void SetPosition(size_t position) { position_ = position; }
+
+ private:
+  std::string_view text_;
+  // The file that text_ is the start of, until we have all of it.
+  const MmappedFile *file_ = nullptr;
+  size_t position_ = 0;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("MmappedFile") {
+  const std::string path = "_ignore/mmapped_file.txt";
+  const std::string text = "first\n\nthird line\r\nlast";
+  {
+    std::ofstream out(path);
+    out << text;
+  }
+  MmappedFile file(path);
+  CHECK_EQ(file.Contents(), text);
+  LineReader reader(file.Contents());
+  StringVector lines;
+  std::string_view line;
+  const size_t start = reader.Position();
+  while (reader.NextLine(line)) {
+    lines.emplace_back(line);
+  }
+  CHECK_EQ(lines, StringVector({"first", "", "third line\r", "last"}));
+  reader.SetPosition(start);
+  CHECK(reader.NextLine(line));
+  CHECK_EQ(line, "first");
+  // A trailing newline doesn't make another line.
+  LineReader trailing_reader("a\nb\n");
+  size_t line_count = 0;
+  while (trailing_reader.NextLine(line)) {
+    line_count++;
+  }
+  CHECK_EQ(line_count, 2);
+  {
+    std::ofstream out(path, std::ios::trunc);
+  }
+  CHECK(MmappedFile(path).Contents().empty());
+  // This claims to be empty, so we read it.
+  CHECK_FALSE(MmappedFile("/proc/self/status").Contents().empty());
+  CHECK_THROWS(MmappedFile("_ignore/no_such_file.txt"));
+  // Reading a gzipped file as it is inflated gives the same lines.
+  const MmappedFile plain_file("data/DS1.subsampled_10.t");
+  const MmappedFile gzipped_file("data/DS1.subsampled_10.t.gz");
+  LineReader plain_reader(plain_file);
+  LineReader gzipped_reader(gzipped_file);
+  std::string_view gzipped_line;
+  while (plain_reader.NextLine(line)) {
+    REQUIRE(gzipped_reader.NextLine(gzipped_line));
+    CHECK_EQ(gzipped_line, line);
+  }
+  CHECK_FALSE(gzipped_reader.NextLine(gzipped_line));
+  CHECK_EQ(gzipped_file.Contents(), plain_file.Contents());
+  // A truncated gzip file fails once we get to where it stops.
+  {
+    std::ifstream in("data/DS1.subsampled_10.t.gz", std::ios::binary);
+    std::string gzipped((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << gzipped.substr(0, gzipped.size() / 2);
+  }
+  CHECK_THROWS(MmappedFile(path).Contents());
+  // We recognize zstd files, but can't read them.
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "\x28\xb5\x2f\xfd and then some";
+  }
+  CHECK_THROWS(MmappedFile{path});
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_MMAPPED_FILE_HPP_
@@ -15,30 +15,90 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <string>
 #include "sugar.hpp"
 
+// How an MmappedMatrix gets its memory.
+enum class MmapBacking {
+  // A shared mapping of the file, which we sync at destruction. Use this to keep the
+  // data, or when it doesn't fit in memory.
+  File,
+  // A shared mapping of a file that we unlink right away. Pages can still spill to
+  // disk, but nobody else sees the file and we don't sync at destruction.
+  EphemeralFile,
+  // Private anonymous memory, with no file at all.
+  Anonymous,
+  // Anonymous memory on huge pages: MAP_HUGETLB if the system has huge pages
+  // reserved, and otherwise transparent huge pages via madvise.
+  AnonymousHugePages,
+  // A POSIX shared memory object, named by the file path, such as "/libsbn", so that
+  // other processes can map it too. We make it, failing if the name is taken, and
+  // unlink the name at destruction.
+  SharedMemory,
+  // The shared memory object of this name that another process made, which must have
+  // the size of this matrix. We leave it be at destruction.
+  AttachedSharedMemory,
+};
+
 template <typename EigenDenseMatrixBaseT>
 class MmappedMatrix {
   using Scalar = typename Eigen::DenseBase<EigenDenseMatrixBaseT>::Scalar;
 
  public:
-  MmappedMatrix(std::string file_path, Eigen::Index rows, Eigen::Index cols)
-      : rows_(rows), cols_(cols), mmap_len_(rows * cols * sizeof(Scalar)) {
-    file_descriptor_ = open(
-        file_path.c_str(),
-        O_RDWR | O_CREAT,  // Open for reading and writing; create if it doesn't exit.
-        S_IRUSR | S_IWUSR  // Make the file readable and writable by the user.
-    );
-    if (file_descriptor_ == -1) {
-      Failwith("MmappedMatrix could not create a file at " + file_path);
+  // The file path is ignored for the anonymous backings.
+  MmappedMatrix(std::string file_path, Eigen::Index rows, Eigen::Index cols,
+                MmapBacking backing = MmapBacking::File)
+      : rows_(rows),
+        cols_(cols),
+        mmap_len_(rows * cols * sizeof(Scalar)),
+        backing_(backing) {
+    if (backing_ == MmapBacking::Anonymous ||
+        backing_ == MmapBacking::AnonymousHugePages) {
+      MapAnonymous();
+      return;
+    }  // else
+    if (backing_ == MmapBacking::SharedMemory) {
+      file_descriptor_ =
+          shm_open(file_path.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+      if (file_descriptor_ == -1) {
+        Failwith("MmappedMatrix could not create the shared memory " + file_path);
+      }
+      shared_memory_name_ = file_path;
+    } else if (backing_ == MmapBacking::AttachedSharedMemory) {
+      file_descriptor_ = shm_open(file_path.c_str(), O_RDWR, 0);
+      if (file_descriptor_ == -1) {
+        Failwith("MmappedMatrix could not open the shared memory " + file_path);
+      }
+    } else {
+      file_descriptor_ = open(
+          file_path.c_str(),
+          O_RDWR | O_CREAT,  // Open for reading and writing; create if it doesn't exit.
+          S_IRUSR | S_IWUSR  // Make the file readable and writable by the user.
+      );
+      if (file_descriptor_ == -1) {
+        Failwith("MmappedMatrix could not create a file at " + file_path);
+      }
     }
-    // Resizes file so it's just right for our vector.
-    auto ftruncate_status = ftruncate(file_descriptor_, mmap_len_);
-    if (ftruncate_status != 0) {
-      Failwith("MmappedMatrix could not resize the file at " + file_path);
+    if (backing_ == MmapBacking::AttachedSharedMemory) {
+      struct stat file_status;
+      if (fstat(file_descriptor_, &file_status) != 0 ||
+          static_cast<size_t>(file_status.st_size) != mmap_len_) {
+        close(file_descriptor_);
+        Failwith("The shared memory " + file_path +
+                 " doesn't have the size of its MmappedMatrix.");
+      }
+    } else {
+      // Resizes file so it's just right for our vector.
+      auto ftruncate_status = ftruncate(file_descriptor_, mmap_len_);
+      if (ftruncate_status != 0) {
+        Failwith("MmappedMatrix could not resize the file at " + file_path);
+      }
     }
     mmapped_memory_ = (Scalar *)mmap(  //
         NULL,                    // This address is ignored as we are using MAP_SHARED.
@@ -48,6 +108,12 @@ class MmappedMatrix {
         file_descriptor_,        // File descriptor.
         0                        // Offset.
     );
+    if (mmapped_memory_ == MAP_FAILED) {
+      Failwith("MmappedMatrix could not mmap the file at " + file_path);
+    }
+    if (backing_ == MmapBacking::EphemeralFile && unlink(file_path.c_str()) != 0) {
+      Failwith("MmappedMatrix could not unlink the file at " + file_path);
+    }
   }
 
   ~MmappedMatrix() {
@@ -58,14 +124,23 @@ class MmappedMatrix {
                   << std::endl;
       }
     };
-    // Synchronize memory with physical storage.
-    auto msync_status = msync(mmapped_memory_, mmap_len_, MS_SYNC);
-    CheckStatus(msync_status, "msync");
+    if (backing_ == MmapBacking::File) {
+      // Synchronize memory with physical storage.
+      auto msync_status = msync(mmapped_memory_, mmap_len_, MS_SYNC);
+      CheckStatus(msync_status, "msync");
+    }
     // Unmap memory mapped with mmap.
     auto munmap_status = munmap(mmapped_memory_, mmap_len_);
     CheckStatus(munmap_status, "munmap");
-    auto close_status = close(file_descriptor_);
-    CheckStatus(close_status, "close");
+    if (file_descriptor_ != -1) {
+      auto close_status = close(file_descriptor_);
+      CheckStatus(close_status, "close");
+    }
+    if (!shared_memory_name_.empty()) {
+      // Processes that have it mapped keep it until they unmap it.
+      auto shm_unlink_status = shm_unlink(shared_memory_name_.c_str());
+      CheckStatus(shm_unlink_status, "shm_unlink");
+    }
   }
 
   MmappedMatrix(const MmappedMatrix &) = delete;
@@ -77,12 +152,114 @@ class MmappedMatrix {
     return Eigen::Map<EigenDenseMatrixBaseT>(mmapped_memory_, rows_, cols_);
   }
 
+  MmapBacking GetBacking() const { return backing_; }
+
+  // Write the memory out to the file and wait until it is there. This only does
+  // something for MmapBacking::File, which is also the only backing that we sync at
+  // destruction.
+  void Sync() const {
+    if (backing_ != MmapBacking::File) {
+      return;
+    }  // else
+    if (msync(mmapped_memory_, mmap_len_, MS_SYNC) != 0) {
+      Failwith("MmappedMatrix could not sync its file: " +
+               std::string(strerror(errno)));
+    }
+  }
+
+  // Tell the kernel that we will soon use the `length` scalars starting at `data`,
+  // which must be part of this mapping.
+  void AdviseWillNeed(const Scalar *data, size_t length) const {
+    Advise(data, length, MADV_WILLNEED);
+  }
+  // Tell the kernel that we are done with these scalars for now, so it can reclaim
+  // their pages first. MADV_COLD keeps the contents wherever we are.
+  // MADV_DONTNEED would drop anonymous private memory on the floor, so without
+  // MADV_COLD we only use it for file-backed mappings, which get their pages back
+  // from the file.
+  // Give the pages that lie entirely within these scalars back to the kernel. We
+  // only do this for anonymous memory, which then reads as zero and only takes up
+  // memory again once written. Other mappings just get AdviseDone.
+  void Release(const Scalar *data, size_t length) const {
+    if (backing_ != MmapBacking::Anonymous &&
+        backing_ != MmapBacking::AnonymousHugePages) {
+      AdviseDone(data, length);
+      return;
+    }  // else
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    const auto base = reinterpret_cast<uintptr_t>(mmapped_memory_);
+    auto start = reinterpret_cast<uintptr_t>(data);
+    auto end = reinterpret_cast<uintptr_t>(data + length);
+    start = base + (start - base + page_size - 1) / page_size * page_size;
+    end = base + (end - base) / page_size * page_size;
+    if (start < end) {
+      madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+    }
+  }
+  void AdviseDone(const Scalar *data, size_t length) const {
+#ifdef MADV_COLD
+    Advise(data, length, MADV_COLD);
+#else
+    if (backing_ == MmapBacking::File || backing_ == MmapBacking::EphemeralFile) {
+      Advise(data, length, MADV_DONTNEED);
+    }
+#endif
+  }
+
  private:
   Eigen::Index rows_;
   Eigen::Index cols_;
   size_t mmap_len_;
-  int file_descriptor_;
+  MmapBacking backing_;
+  int file_descriptor_ = -1;
   Scalar *mmapped_memory_;
+  // The name of the shared memory object we made, if we did.
+  std::string shared_memory_name_;
+
+  // madvise needs a page-aligned start, so we widen to whole pages within the
+  // mapping. This is only advice, so we don't mind if it fails.
+  void Advise(const Scalar *data, size_t length, int advice) const {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    const auto base = reinterpret_cast<uintptr_t>(mmapped_memory_);
+    auto start = reinterpret_cast<uintptr_t>(data);
+    auto end = reinterpret_cast<uintptr_t>(data + length);
+    start = base + (start - base) / page_size * page_size;
+    end = std::min(base + mmap_len_, end);
+    if (start < end) {
+      madvise(reinterpret_cast<void *>(start), end - start, advice);
+    }
+  }
+
+  void MapAnonymous() {
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+    if (backing_ == MmapBacking::AnonymousHugePages) {
+      // Huge page mappings need a length that is a multiple of the huge page size,
+      // which is 2MB on the usual systems.
+      const size_t huge_page_size = 2 << 20;
+      const size_t huge_mmap_len =
+          (mmap_len_ + huge_page_size - 1) / huge_page_size * huge_page_size;
+      void *memory =
+          mmap(NULL, huge_mmap_len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+      if (memory != MAP_FAILED) {
+        mmap_len_ = huge_mmap_len;
+        mmapped_memory_ = static_cast<Scalar *>(memory);
+        return;
+      }  // else there are no huge pages reserved, so we try THP below.
+    }
+#endif
+    void *memory = mmap(NULL, mmap_len_, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (memory == MAP_FAILED) {
+      Failwith("MmappedMatrix could not mmap anonymous memory.");
+    }
+    mmapped_memory_ = static_cast<Scalar *>(memory);
+#ifdef MADV_HUGEPAGE
+    // This is only advice, so we don't mind if it fails.
+    if (backing_ == MmapBacking::AnonymousHugePages) {
+      madvise(mmapped_memory_, mmap_len_, MADV_HUGEPAGE);
+    }
+#endif
+  }
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
@@ -96,6 +273,50 @@ TEST_CASE("MmappedMatrix") {
   }  // End of scope, so our mmap is destroyed and file written.
   MmappedMatrixXd mmapped_matrix("_ignore/mmapped_matrix.data", rows, cols);
   CHECK_EQ(mmapped_matrix.Get()(rows - 1, cols - 1), 5.);
+  // An ephemeral file doesn't stick around.
+  {
+    MmappedMatrixXd ephemeral_matrix("_ignore/mmapped_ephemeral_matrix.data", rows,
+                                     cols, MmapBacking::EphemeralFile);
+    ephemeral_matrix.Get()(rows - 1, cols - 1) = 5.;
+    CHECK_EQ(ephemeral_matrix.Get()(rows - 1, cols - 1), 5.);
+    CHECK_EQ(access("_ignore/mmapped_ephemeral_matrix.data", F_OK), -1);
+  }
+  // Anonymous memory starts out zeroed, with or without huge pages.
+  for (auto backing : {MmapBacking::Anonymous, MmapBacking::AnonymousHugePages}) {
+    MmappedMatrixXd anonymous_matrix("", rows, cols, backing);
+    CHECK_EQ(anonymous_matrix.Get()(rows - 1, cols - 1), 0.);
+    anonymous_matrix.Get()(rows - 1, cols - 1) = 5.;
+    CHECK_EQ(anonymous_matrix.Get()(rows - 1, cols - 1), 5.);
+    // Advice doesn't change the contents.
+    anonymous_matrix.AdviseWillNeed(anonymous_matrix.Get().data(), rows * cols);
+    anonymous_matrix.AdviseDone(anonymous_matrix.Get().data(), rows * cols);
+    CHECK_EQ(anonymous_matrix.Get()(rows - 1, cols - 1), 5.);
+  }
+  // Another mapping of shared memory sees our writes, and the name goes away with the
+  // matrix that made it.
+  const std::string shared_memory_name =
+      "/libsbn_mmapped_matrix_" + std::to_string(getpid());
+  {
+    MmappedMatrixXd shared_matrix(shared_memory_name, rows, cols,
+                                  MmapBacking::SharedMemory);
+    CHECK_THROWS(MmappedMatrixXd(shared_memory_name, rows, cols,
+                                 MmapBacking::SharedMemory));
+    CHECK_THROWS(MmappedMatrixXd(shared_memory_name, rows + 1, cols,
+                                 MmapBacking::AttachedSharedMemory));
+    MmappedMatrixXd attached_matrix(shared_memory_name, rows, cols,
+                                    MmapBacking::AttachedSharedMemory);
+    shared_matrix.Get()(rows - 1, cols - 1) = 5.;
+    CHECK_EQ(attached_matrix.Get()(rows - 1, cols - 1), 5.);
+  }
+  CHECK_THROWS(MmappedMatrixXd(shared_memory_name, rows, cols,
+                               MmapBacking::AttachedSharedMemory));
+  // Released anonymous pages read as zero, but we keep the partial pages at the ends.
+  MmappedMatrixXd big_matrix("", 1, 4096, MmapBacking::Anonymous);
+  big_matrix.Get().setOnes();
+  big_matrix.Release(big_matrix.Get().data() + 1, 4094);
+  CHECK_EQ(big_matrix.Get()(0, 0), 1.);
+  CHECK_EQ(big_matrix.Get()(0, 2048), 0.);
+  CHECK_EQ(big_matrix.Get()(0, 4095), 1.);
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
@@ -12,45 +12,85 @@
 #include "eigen_sugar.hpp"
 #include "mmapped_matrix.hpp"
 
-using NucleotidePLV = Eigen::Matrix<double, 4, Eigen::Dynamic, Eigen::ColMajor>;
+// A PLV has a row for each state, which is a compile-time constant so that Eigen
+// can use fixed-size code for each column.
+template <typename Scalar, Eigen::Index StateCount>
+using PLVOf = Eigen::Matrix<Scalar, StateCount, Eigen::Dynamic, Eigen::ColMajor>;
+template <typename Scalar, Eigen::Index StateCount>
+using PLVRefVectorOf = std::vector<Eigen::Ref<PLVOf<Scalar, StateCount>>>;
+template <typename Scalar>
+using NucleotidePLVOf = PLVOf<Scalar, 4>;
+template <typename Scalar>
+using NucleotidePLVRefVectorOf = PLVRefVectorOf<Scalar, 4>;
+using NucleotidePLV = NucleotidePLVOf<double>;
 using NucleotidePLVRef = Eigen::Ref<NucleotidePLV>;
-using NucleotidePLVRefVector = std::vector<NucleotidePLVRef>;
+using NucleotidePLVRefVector = NucleotidePLVRefVectorOf<double>;
 
-class MmappedNucleotidePLV {
+// We can store PLVs as doubles or, to halve their size, as floats.
+template <typename Scalar, Eigen::Index StateCount = 4>
+class GenericMmappedPLV {
  public:
-  constexpr static Eigen::Index base_count_ = 4;
+  constexpr static Eigen::Index state_count_ = StateCount;
 
-  MmappedNucleotidePLV(std::string file_path, Eigen::Index total_plv_length)
-      : mmapped_matrix_(file_path, base_count_, total_plv_length){};
+  GenericMmappedPLV(std::string file_path, Eigen::Index total_plv_length,
+                    MmapBacking backing = MmapBacking::File)
+      : mmapped_matrix_(file_path, state_count_, total_plv_length, backing){};
 
-  NucleotidePLVRefVector Subdivide(size_t into_count) {
+  PLVRefVectorOf<Scalar, StateCount> Subdivide(size_t into_count) {
     auto entire_plv = mmapped_matrix_.Get();
     const auto total_plv_length = entire_plv.cols();
     Assert(total_plv_length % into_count == 0,
            "into_count isn't a multiple of total PLV length in "
            "MmappedNucleotidePLV::Subdivide.");
     const size_t block_length = total_plv_length / into_count;
-    NucleotidePLVRefVector sub_plvs;
+    PLVRefVectorOf<Scalar, StateCount> sub_plvs;
     sub_plvs.reserve(into_count);
     for (size_t idx = 0; idx < into_count; ++idx) {
       sub_plvs.push_back(
-          entire_plv.block(0, idx * block_length, base_count_, block_length));
+          entire_plv.block(0, idx * block_length, state_count_, block_length));
     }
     return sub_plvs;
   }
 
+  // Pass advice about one of the PLVs from Subdivide on to the kernel; see
+  // MmappedMatrix.
+  void AdviseWillNeed(const Eigen::Ref<PLVOf<Scalar, StateCount>> &plv) const {
+    mmapped_matrix_.AdviseWillNeed(plv.data(), plv.size());
+  }
+  void AdviseDone(const Eigen::Ref<PLVOf<Scalar, StateCount>> &plv) const {
+    mmapped_matrix_.AdviseDone(plv.data(), plv.size());
+  }
+  void Release(const Eigen::Ref<PLVOf<Scalar, StateCount>> &plv) const {
+    mmapped_matrix_.Release(plv.data(), plv.size());
+  }
+  MmapBacking GetBacking() const { return mmapped_matrix_.GetBacking(); }
+  void Sync() const { mmapped_matrix_.Sync(); }
+
  private:
-  MmappedMatrix<NucleotidePLV> mmapped_matrix_;
+  MmappedMatrix<PLVOf<Scalar, StateCount>> mmapped_matrix_;
 };
 
+template <typename Scalar>
+using GenericMmappedNucleotidePLV = GenericMmappedPLV<Scalar, 4>;
+using MmappedNucleotidePLV = GenericMmappedNucleotidePLV<double>;
+using SinglePrecisionMmappedNucleotidePLV = GenericMmappedNucleotidePLV<float>;
+using MmappedAminoAcidPLV = GenericMmappedPLV<double, 20>;
+
 #ifdef DOCTEST_LIBRARY_INCLUDED
 TEST_CASE("MmappedNucleotidePLV") {
   MmappedNucleotidePLV mmapped_plv("_ignore/mmapped_plv.data", 10);
   auto plvs = mmapped_plv.Subdivide(2);
   for (const auto &plv : plvs) {
-    CHECK_EQ(plv.rows(), MmappedNucleotidePLV::base_count_);
+    CHECK_EQ(plv.rows(), MmappedNucleotidePLV::state_count_);
     CHECK_EQ(plv.cols(), 5);
   }
+  SinglePrecisionMmappedNucleotidePLV single_precision_plv("", 10,
+                                                           MmapBacking::Anonymous);
+  auto single_precision_plvs = single_precision_plv.Subdivide(5);
+  CHECK_EQ(single_precision_plvs.size(), 5);
+  CHECK_EQ(single_precision_plvs.back().cols(), 2);
+  MmappedAminoAcidPLV amino_acid_plv("", 10, MmapBacking::Anonymous);
+  CHECK_EQ(amino_acid_plv.Subdivide(2).front().rows(), 20);
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
@@ -0,0 +1,465 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "mpi_engine.hpp"
+
+#ifdef LIBSBN_MPI
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+namespace {
+
+// The bytes of the Prepare command, which the driver fills and broadcasts, and which
+// each worker then reads in the same order.
+class Message {
+ public:
+  template <typename T>
+  void Put(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Message can only hold trivially copyable values.");
+    bytes_.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+  void PutString(const std::string &str) {
+    Put<uint64_t>(str.size());
+    bytes_.append(str);
+  }
+
+  template <typename T>
+  T Get() {
+    T value;
+    Read(&value, sizeof(T));
+    return value;
+  }
+  std::string GetString() {
+    std::string str(Get<uint64_t>(), '\0');
+    Read(str.data(), str.size());
+    return str;
+  }
+
+  // Send the bytes of the driver of comm to every process of comm.
+  void Broadcast(MPI_Comm comm) {
+    uint64_t size = bytes_.size();
+    MPI_Bcast(&size, 1, MPI_UINT64_T, 0, comm);
+    Assert(size <= INT_MAX, "MPIEngine can't send a message of 2GB or more.");
+    bytes_.resize(size);
+    MPI_Bcast(bytes_.data(), static_cast<int>(size), MPI_CHAR, 0, comm);
+    position_ = 0;
+  }
+
+ private:
+  std::string bytes_;
+  size_t position_ = 0;
+
+  void Read(void *destination, size_t size) {
+    if (position_ + size > bytes_.size()) {
+      Failwith("MPIEngine got a message that was too short.");
+    }
+    std::memcpy(destination, bytes_.data() + position_, size);
+    position_ += size;
+  }
+};
+
+// Make the Engine that the driver asks for in the message of a Prepare command,
+// setting tag_taxon_map to the driver's.
+std::unique_ptr<Engine> EngineOfMessage(Message &message, TagStringMap &tag_taxon_map) {
+  PhyloModelSpecification model_specification;
+  model_specification.substitution_ = message.GetString();
+  model_specification.site_ = message.GetString();
+  model_specification.clock_ = message.GetString();
+  const auto thread_count = message.Get<uint64_t>();
+  std::vector<BeagleFlags> beagle_flag_vector(message.Get<uint64_t>());
+  for (auto &flag : beagle_flag_vector) {
+    flag = static_cast<BeagleFlags>(message.Get<int64_t>());
+  }
+  const auto use_tip_states = message.Get<bool>();
+  const auto partial_cache_capacity = message.Get<uint64_t>();
+  const auto tree_batch_size = message.Get<uint64_t>();
+  const auto shard_site_patterns = message.Get<bool>();
+  const auto operation_schedule_cache_capacity = message.Get<uint64_t>();
+  const auto site_pattern_order = message.Get<SitePatternOrder>();
+  const auto host_transition_matrices = message.Get<bool>();
+  const auto thread_pinning = message.Get<ThreadPinning>();
+  StringStringMap data;
+  for (auto count = message.Get<uint64_t>(); count > 0; count--) {
+    auto taxon = message.GetString();
+    data[taxon] = message.GetString();
+  }
+  tag_taxon_map.clear();
+  for (auto count = message.Get<uint64_t>(); count > 0; count--) {
+    const auto tag = message.Get<Tag>();
+    tag_taxon_map[tag] = message.GetString();
+  }
+  const EngineSpecification engine_specification{thread_count,
+                                                 beagle_flag_vector,
+                                                 use_tip_states,
+                                                 partial_cache_capacity,
+                                                 tree_batch_size,
+                                                 shard_site_patterns,
+                                                 operation_schedule_cache_capacity,
+                                                 site_pattern_order,
+                                                 host_transition_matrices,
+                                                 thread_pinning};
+  // This is the SitePattern that SBNInstance::MakeEngine makes on the driver.
+  SitePattern site_pattern(Alignment(std::move(data)), tag_taxon_map, thread_count,
+                           site_pattern_order);
+  return std::make_unique<Engine>(engine_specification, model_specification,
+                                  std::move(site_pattern));
+}
+
+// Every process of comm calls this with the message of the error it hit in the task
+// it just did, or an empty string if there wasn't one. If any process failed, the
+// driver throws, and the workers print their messages, as their exceptions would
+// otherwise have nowhere to go.
+void CheckForErrors(MPI_Comm comm, const std::string &error, const std::string &task) {
+  int failed = error.empty() ? 0 : 1;
+  MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, comm);
+  if (!failed) {
+    return;
+  }  // else
+  if (MPIEngine::Rank(comm) != 0) {
+    if (!error.empty()) {
+      std::cerr << "MPIEngine worker " << MPIEngine::Rank(comm) << " couldn't " << task
+                << ": " << error << std::endl;
+    }
+    return;
+  }  // else
+  if (!error.empty()) {
+    Failwith("MPIEngine couldn't " + task + ": " + error);
+  }  // else
+  Failwith("An MPIEngine worker couldn't " + task + "; see its output.");
+}
+
+// The number of parent ids of tree_count trees with node_count nodes between them,
+// as the roots have none.
+size_t ParentIdCountOf(size_t node_count, size_t tree_count) {
+  return node_count - tree_count;
+}
+
+int IntCountOf(size_t count) {
+  Assert(count <= INT_MAX, "MPIEngine can't send 2^31 or more values at once.");
+  return static_cast<int>(count);
+}
+
+}  // namespace
+
+MPIEngine::MPIEngine(MPI_Comm comm, const Engine &local_engine,
+                     const EngineSpecification &engine_specification,
+                     const PhyloModelSpecification &model_specification,
+                     const Alignment &alignment, const TagStringMap &tag_taxon_map)
+    : comm_(comm), local_engine_(local_engine), tag_taxon_map_(tag_taxon_map) {
+  Assert(Rank(comm_) == 0,
+         "The process of rank 0 makes an MPIEngine; the others call ServeWorker.");
+  Message message;
+  message.PutString(model_specification.substitution_);
+  message.PutString(model_specification.site_);
+  message.PutString(model_specification.clock_);
+  message.Put<uint64_t>(engine_specification.thread_count_);
+  message.Put<uint64_t>(engine_specification.beagle_flag_vector_.size());
+  for (const auto flag : engine_specification.beagle_flag_vector_) {
+    message.Put<int64_t>(flag);
+  }
+  message.Put<bool>(engine_specification.use_tip_states_);
+  message.Put<uint64_t>(engine_specification.partial_cache_capacity_);
+  message.Put<uint64_t>(engine_specification.tree_batch_size_);
+  message.Put<bool>(engine_specification.shard_site_patterns_);
+  message.Put<uint64_t>(engine_specification.operation_schedule_cache_capacity_);
+  message.Put<SitePatternOrder>(engine_specification.site_pattern_order_);
+  message.Put<bool>(engine_specification.host_transition_matrices_);
+  message.Put<ThreadPinning>(engine_specification.thread_pinning_);
+  const auto data = alignment.Data();
+  message.Put<uint64_t>(data.size());
+  for (const auto &[taxon, sequence] : data) {
+    message.PutString(taxon);
+    message.PutString(sequence);
+  }
+  message.Put<uint64_t>(tag_taxon_map.size());
+  for (const auto &[tag, taxon] : tag_taxon_map) {
+    message.Put<Tag>(tag);
+    message.PutString(taxon);
+  }
+  BroadcastCommand(comm_, Command::Prepare);
+  message.Broadcast(comm_);
+  CheckForErrors(comm_, "", "prepare an engine");
+}
+
+MPIEngine::~MPIEngine() {
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (!finalized) {
+    BroadcastCommand(comm_, Command::Release);
+  }
+}
+
+void MPIEngine::Initialize() {
+  int initialized;
+  MPI_Initialized(&initialized);
+  if (initialized) {
+    return;
+  }  // else
+  // Only the thread that calls the MPIEngine talks to MPI, not the threads of the
+  // Engines.
+  int provided;
+  MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &provided);
+  std::atexit([] {
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (!finalized) {
+      MPI_Finalize();
+    }
+  });
+}
+
+int MPIEngine::Rank(MPI_Comm comm) {
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  return rank;
+}
+
+int MPIEngine::Size(MPI_Comm comm) {
+  int size;
+  MPI_Comm_size(comm, &size);
+  return size;
+}
+
+void MPIEngine::ServeWorker(MPI_Comm comm) {
+  Assert(Rank(comm) != 0, "The process of rank 0 drives rather than serving.");
+  std::unique_ptr<Engine> engine;
+  TagStringMap tag_taxon_map;
+  while (true) {
+    int command;
+    MPI_Bcast(&command, 1, MPI_INT, 0, comm);
+    switch (static_cast<Command>(command)) {
+      case Command::Prepare: {
+        Message message;
+        message.Broadcast(comm);
+        std::string error;
+        engine.reset();
+        try {
+          engine = EngineOfMessage(message, tag_taxon_map);
+        } catch (const std::exception &exception) {
+          error = exception.what();
+        }
+        CheckForErrors(comm, error, "prepare an engine");
+        break;
+      }
+      case Command::LogLikelihoods:
+      case Command::BranchGradients: {
+        CallHeader header;
+        MPI_Bcast(&header, sizeof(CallHeader), MPI_BYTE, 0, comm);
+        Distribute(comm, engine.get(), tag_taxon_map, header, nullptr, nullptr, nullptr,
+                   nullptr);
+        break;
+      }
+      case Command::Release:
+        engine.reset();
+        break;
+      case Command::Stop:
+        return;
+      default:
+        Failwith("MPIEngine worker got an unknown command.");
+    }
+  }
+}
+
+void MPIEngine::StopWorkers(MPI_Comm comm) { BroadcastCommand(comm, Command::Stop); }
+
+void MPIEngine::BroadcastCommand(MPI_Comm comm, Command command) {
+  int command_int = static_cast<int>(command);
+  MPI_Bcast(&command_int, 1, MPI_INT, 0, comm);
+}
+
+void MPIEngine::Distribute(MPI_Comm comm, const Engine *engine,
+                           const TagStringMap &tag_taxon_map, const CallHeader &header,
+                           const TreeCollectionCache::TreeSections *sections,
+                           const double *phylo_model_params, double *log_likelihoods,
+                           double *branch_gradients) {
+  const int rank = Rank(comm);
+  const int process_count = Size(comm);
+  const bool is_driver = (rank == 0);
+  const size_t param_count = header.param_count_;
+  const size_t column_count = header.gradient_column_count_;
+  // Process p gets the trees numbered tree_begins[p], ..., tree_begins[p + 1] - 1.
+  SizeVector tree_begins(process_count + 1);
+  for (int process = 0; process <= process_count; process++) {
+    tree_begins[process] = header.tree_count_ * process / process_count;
+  }
+  // The counts and displacements of what the driver sends to or gets from each
+  // process, in units of trees, nodes, parent ids, parameters and gradients.
+  std::vector<int> tree_counts(process_count), tree_displacements(process_count),
+      node_counts(process_count), node_displacements(process_count),
+      parent_id_counts(process_count), parent_id_displacements(process_count),
+      param_counts(process_count), param_displacements(process_count),
+      gradient_counts(process_count), gradient_displacements(process_count);
+  std::vector<uint64_t> tree_node_counts;
+  for (int process = 0; process < process_count; process++) {
+    const size_t tree_begin = tree_begins[process];
+    const size_t tree_end = tree_begins[process + 1];
+    tree_counts[process] = IntCountOf(tree_end - tree_begin);
+    tree_displacements[process] = IntCountOf(tree_begin);
+    param_counts[process] = IntCountOf((tree_end - tree_begin) * param_count);
+    param_displacements[process] = IntCountOf(tree_begin * param_count);
+    gradient_counts[process] = IntCountOf((tree_end - tree_begin) * column_count);
+    gradient_displacements[process] = IntCountOf(tree_begin * column_count);
+    if (is_driver) {
+      const auto &node_offsets = sections->node_offsets_;
+      const size_t node_begin = node_offsets[tree_begin];
+      const size_t node_end = node_offsets[tree_end];
+      node_counts[process] = IntCountOf(node_end - node_begin);
+      node_displacements[process] = IntCountOf(node_begin);
+      const size_t parent_id_begin = ParentIdCountOf(node_begin, tree_begin);
+      parent_id_counts[process] =
+          IntCountOf(ParentIdCountOf(node_end, tree_end) - parent_id_begin);
+      parent_id_displacements[process] = IntCountOf(parent_id_begin);
+    }
+  }
+  if (is_driver) {
+    const auto &node_offsets = sections->node_offsets_;
+    for (size_t tree_idx = 0; tree_idx < header.tree_count_; tree_idx++) {
+      tree_node_counts.push_back(node_offsets[tree_idx + 1] - node_offsets[tree_idx]);
+    }
+  }
+
+  // Send each process its block of the trees and parameters.
+  const int tree_count = tree_counts[rank];
+  TreeCollectionCache::TreeSections local_sections;
+  std::vector<uint64_t> local_node_counts(tree_count);
+  MPI_Scatterv(tree_node_counts.data(), tree_counts.data(), tree_displacements.data(),
+               MPI_UINT64_T, local_node_counts.data(), tree_count, MPI_UINT64_T, 0,
+               comm);
+  for (const auto node_count : local_node_counts) {
+    local_sections.node_offsets_.push_back(local_sections.node_offsets_.back() +
+                                           node_count);
+  }
+  const size_t local_node_count = local_sections.node_offsets_.back();
+  local_sections.parent_ids_.resize(ParentIdCountOf(local_node_count, tree_count));
+  local_sections.branch_lengths_.resize(local_node_count);
+  MPI_Scatterv(is_driver ? sections->parent_ids_.data() : nullptr,
+               parent_id_counts.data(), parent_id_displacements.data(), MPI_UINT32_T,
+               local_sections.parent_ids_.data(),
+               IntCountOf(local_sections.parent_ids_.size()), MPI_UINT32_T, 0, comm);
+  MPI_Scatterv(is_driver ? sections->branch_lengths_.data() : nullptr,
+               node_counts.data(), node_displacements.data(), MPI_DOUBLE,
+               local_sections.branch_lengths_.data(), IntCountOf(local_node_count),
+               MPI_DOUBLE, 0, comm);
+  EigenMatrixXd local_phylo_model_params(tree_count, param_count);
+  MPI_Scatterv(phylo_model_params, param_counts.data(), param_displacements.data(),
+               MPI_DOUBLE, local_phylo_model_params.data(), param_counts[rank],
+               MPI_DOUBLE, 0, comm);
+
+  // Compute, and gather the results on the driver.
+  EigenVectorXd local_log_likelihoods =
+      EigenVectorXd::Constant(tree_count, std::numeric_limits<double>::quiet_NaN());
+  EigenMatrixXd local_branch_gradients = EigenMatrixXd::Zero(tree_count, column_count);
+  std::string error;
+  try {
+    if (engine == nullptr) {
+      Failwith("No engine; preparing it failed.");
+    }
+    if (tree_count > 0) {
+      const UnrootedTreeCollection tree_collection(
+          TreeCollectionCache::UnrootedTreesOf(local_sections, tag_taxon_map.size()),
+          tag_taxon_map);
+      if (column_count == 0) {
+        engine->LogLikelihoods(tree_collection, local_phylo_model_params,
+                               header.rescaling_, local_log_likelihoods);
+      } else {
+        engine->BranchGradients(tree_collection, local_phylo_model_params,
+                                header.rescaling_, local_log_likelihoods,
+                                local_branch_gradients);
+      }
+    }
+  } catch (const std::exception &exception) {
+    error = exception.what();
+  }
+  MPI_Gatherv(local_log_likelihoods.data(), tree_count, MPI_DOUBLE, log_likelihoods,
+              tree_counts.data(), tree_displacements.data(), MPI_DOUBLE, 0, comm);
+  if (column_count > 0) {
+    MPI_Gatherv(local_branch_gradients.data(), gradient_counts[rank], MPI_DOUBLE,
+                branch_gradients, gradient_counts.data(),
+                gradient_displacements.data(), MPI_DOUBLE, 0, comm);
+  }
+  CheckForErrors(comm, error, "compute its trees");
+}
+
+void MPIEngine::Call(const UnrootedTreeCollection &tree_collection,
+                     const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                     EigenVectorXdRef log_likelihoods,
+                     EigenMatrixXd *branch_gradients) const {
+  const size_t tree_count = tree_collection.TreeCount();
+  Assert(static_cast<size_t>(log_likelihoods.size()) == tree_count,
+         "MPIEngine needs a log likelihood entry for every tree.");
+  Assert(static_cast<size_t>(phylo_model_params.rows()) >= tree_count,
+         "MPIEngine needs a row of phylogenetic model parameters for every tree.");
+  // The parameters of the trees, in contiguous rows.
+  const EigenMatrixXd params = phylo_model_params.topRows(tree_count);
+  const auto sections = TreeCollectionCache::SectionsOf(tree_collection);
+  CallHeader header{tree_count, static_cast<uint64_t>(params.cols()),
+                    branch_gradients == nullptr
+                        ? 0
+                        : static_cast<uint64_t>(branch_gradients->cols()),
+                    rescaling};
+  BroadcastCommand(comm_, branch_gradients == nullptr ? Command::LogLikelihoods
+                                                      : Command::BranchGradients);
+  MPI_Bcast(&header, sizeof(CallHeader), MPI_BYTE, 0, comm_);
+  Distribute(comm_, &local_engine_, tag_taxon_map_, header, &sections, params.data(),
+             log_likelihoods.data(),
+             branch_gradients == nullptr ? nullptr : branch_gradients->data());
+}
+
+std::vector<double> MPIEngine::LogLikelihoods(
+    const UnrootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  std::vector<double> results(tree_collection.TreeCount());
+  Eigen::Map<EigenVectorXd> results_map(results.data(), results.size());
+  Call(tree_collection, phylo_model_params, rescaling, results_map, nullptr);
+  return results;
+}
+
+std::vector<UnrootedTreeGradient> MPIEngine::Gradients(
+    const UnrootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  EigenVectorXd log_likelihoods(tree_collection.TreeCount());
+  EigenMatrixXd branch_gradients(tree_collection.TreeCount(),
+                                 2 * tree_collection.TaxonCount() - 1);
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods,
+       &branch_gradients);
+  std::vector<UnrootedTreeGradient> gradients;
+  for (size_t tree_number = 0; tree_number < tree_collection.TreeCount();
+       tree_number++) {
+    const auto row = branch_gradients.row(tree_number);
+    gradients.push_back({log_likelihoods(tree_number),
+                         std::vector<double>(row.data(), row.data() + row.size()),
+                         {},
+                         {}});
+  }
+  return gradients;
+}
+
+void MPIEngine::LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                               const EigenMatrixXdRef phylo_model_params,
+                               const bool rescaling,
+                               EigenVectorXdRef log_likelihoods) const {
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods, nullptr);
+}
+
+void MPIEngine::BranchGradients(const UnrootedTreeCollection &tree_collection,
+                                const EigenMatrixXdRef phylo_model_params,
+                                const bool rescaling, EigenVectorXdRef log_likelihoods,
+                                EigenMatrixXdRef branch_gradients) const {
+  Assert(branch_gradients.rows() == log_likelihoods.size(),
+         "MPIEngine needs a row of branch gradients for every tree.");
+  EigenMatrixXd contiguous_branch_gradients(branch_gradients.rows(),
+                                            branch_gradients.cols());
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods,
+       &contiguous_branch_gradients);
+  branch_gradients = contiguous_branch_gradients;
+}
+
+#endif  // LIBSBN_MPI
@@ -0,0 +1,144 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// An MPIEngine spreads likelihood and gradient computation for batches of unrooted
+// trees across the processes of an MPI communicator, each of which computes its
+// share with its own Engine, that is, its own pool of FatBeagles.
+//
+// The process of rank 0 drives: it makes the MPIEngine, while every other process
+// sits in ServeWorker. Making the MPIEngine broadcasts the model and engine
+// specifications along with the alignment, from which each worker makes its site
+// patterns and Engine once. After that, each call splits the trees into contiguous
+// blocks, one per process, and sends each process only the parent ids and branch
+// lengths of its block, as in the tree sections of tree_collection_cache.hpp, with
+// the matching rows of the phylogenetic model parameters. The log likelihoods and
+// branch gradients are gathered back on the driver in tree order. The driver
+// computes its own block with the local Engine it was given.
+//
+// This is only built if LIBSBN_MPI is defined; see the --mpi option of SConstruct.
+
+#ifndef SRC_MPI_ENGINE_HPP_
+#define SRC_MPI_ENGINE_HPP_
+
+#ifdef LIBSBN_MPI
+
+#include <mpi.h>
+#include <vector>
+#include "alignment.hpp"
+#include "driver.hpp"
+#include "engine.hpp"
+#include "tree_collection_cache.hpp"
+
+class MPIEngine {
+ public:
+  // Make the workers of comm ready for computation by making each of them an Engine
+  // with these specifications on the site patterns of the alignment. This is
+  // collective, so every other process of comm has to be in ServeWorker. The
+  // local_engine computes the driver's share of the trees, so it should have the same
+  // specifications, and has to outlive this MPIEngine.
+  MPIEngine(MPI_Comm comm, const Engine &local_engine,
+            const EngineSpecification &engine_specification,
+            const PhyloModelSpecification &model_specification,
+            const Alignment &alignment, const TagStringMap &tag_taxon_map);
+  // Tell the workers to let go of their Engines.
+  ~MPIEngine();
+  MPIEngine(const MPIEngine &) = delete;
+  MPIEngine &operator=(const MPIEngine &) = delete;
+
+  // Start MPI if nobody has, such as mpi4py, and finalize it at exit in that case.
+  static void Initialize();
+  static int Rank(MPI_Comm comm);
+  static int Size(MPI_Comm comm);
+  // Follow the commands of the driver of comm until it calls StopWorkers.
+  static void ServeWorker(MPI_Comm comm);
+  static void StopWorkers(MPI_Comm comm);
+
+  int ProcessCount() const { return Size(comm_); }
+
+  // These are as for the Engine methods of the same names.
+  std::vector<double> LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                                     const EigenMatrixXdRef phylo_model_params,
+                                     const bool rescaling) const;
+  std::vector<UnrootedTreeGradient> Gradients(
+      const UnrootedTreeCollection &tree_collection,
+      const EigenMatrixXdRef phylo_model_params, const bool rescaling) const;
+  void LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                      EigenVectorXdRef log_likelihoods) const;
+  void BranchGradients(const UnrootedTreeCollection &tree_collection,
+                       const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                       EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients) const;
+
+ private:
+  enum class Command : int { Prepare, LogLikelihoods, BranchGradients, Release, Stop };
+  // What the driver broadcasts at the start of each call.
+  struct CallHeader {
+    uint64_t tree_count_;
+    uint64_t param_count_;
+    // The number of columns of the branch gradients, or zero for log likelihoods.
+    uint64_t gradient_column_count_;
+    uint64_t rescaling_;
+  };
+
+  MPI_Comm comm_;
+  const Engine &local_engine_;
+  TagStringMap tag_taxon_map_;
+
+  static void BroadcastCommand(MPI_Comm comm, Command command);
+  // The part of a call that the driver and the workers share. Each process computes
+  // its block of the trees with its engine, which is null on a worker if preparing
+  // it failed. The results go to log_likelihoods and branch_gradients, which are only
+  // used on the driver, where they are the size of the whole batch. Likewise sections
+  // and phylo_model_params are only read on the driver.
+  static void Distribute(MPI_Comm comm, const Engine *engine,
+                         const TagStringMap &tag_taxon_map, const CallHeader &header,
+                         const TreeCollectionCache::TreeSections *sections,
+                         const double *phylo_model_params, double *log_likelihoods,
+                         double *branch_gradients);
+  void Call(const UnrootedTreeCollection &tree_collection,
+            const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+            EigenVectorXdRef log_likelihoods, EigenMatrixXd *branch_gradients) const;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("MPIEngine") {
+  // With a single process the driver computes everything, which should agree with
+  // its Engine.
+  MPIEngine::Initialize();
+  const auto trees = UnrootedTreeCollection::OfTreeCollection(
+      Driver().ParseNexusFile("data/DS1.subsampled_10.t"));
+  const Alignment alignment = Alignment::ReadFasta("data/DS1.fasta");
+  const PhyloModelSpecification model_specification{"JC69", "constant", "strict"};
+  const std::vector<BeagleFlags> beagle_flag_vector;
+  const EngineSpecification engine_specification{2, beagle_flag_vector, false};
+  const Engine engine(engine_specification, model_specification,
+                      SitePattern(alignment, trees.TagTaxonMap()));
+  EigenMatrixXd phylo_model_params(
+      trees.TreeCount(), engine.GetPhyloModelBlockSpecification().ParameterCount());
+  phylo_model_params.setZero();
+  const MPIEngine mpi_engine(MPI_COMM_SELF, engine, engine_specification,
+                             model_specification, alignment, trees.TagTaxonMap());
+  CHECK_EQ(mpi_engine.ProcessCount(), 1);
+  const auto expected = engine.LogLikelihoods(trees, phylo_model_params, false);
+  CHECK_EQ(mpi_engine.LogLikelihoods(trees, phylo_model_params, false), expected);
+  const size_t node_count = 2 * trees.TaxonCount() - 1;
+  EigenVectorXd log_likelihoods(trees.TreeCount());
+  EigenMatrixXd expected_gradients(trees.TreeCount(), node_count);
+  engine.BranchGradients(trees, phylo_model_params, false, log_likelihoods,
+                         expected_gradients);
+  const auto gradients = mpi_engine.Gradients(trees, phylo_model_params, false);
+  REQUIRE_EQ(gradients.size(), trees.TreeCount());
+  for (size_t tree_idx = 0; tree_idx < trees.TreeCount(); tree_idx++) {
+    CHECK_EQ(gradients[tree_idx].log_likelihood_, log_likelihoods(tree_idx));
+    for (size_t node_id = 0; node_id < node_count; node_id++) {
+      CHECK_EQ(gradients[tree_idx].branch_lengths_[node_id],
+               expected_gradients(tree_idx, node_id));
+    }
+  }
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // LIBSBN_MPI
+
+#endif  // SRC_MPI_ENGINE_HPP_
@@ -0,0 +1,151 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "newick_writer.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+NewickWriter::NewickWriter(const TagStringMap &tag_taxon_map,
+                           std::optional<int> precision)
+    : precision_(precision) {
+  if (precision_.has_value() && (*precision_ < 1 || *precision_ > 17)) {
+    Failwith("NewickWriter needs a precision between 1 and 17 digits.");
+  }
+  for (const auto &[tag, label] : tag_taxon_map) {
+    if (LeafCountOfTag(tag) != 1) {
+      continue;
+    }
+    const size_t leaf_id = MaxLeafIDOfTag(tag);
+    if (leaf_id >= leaf_labels_.size()) {
+      leaf_labels_.resize(leaf_id + 1);
+    }
+    leaf_labels_[leaf_id] = label;
+  }
+}
+
+void NewickWriter::Append(const Node &topology,
+                          const std::vector<double> &branch_lengths) {
+  Assert(topology.Id() < branch_lengths.size(),
+         "branch_lengths vector is of insufficient length in NewickWriter.");
+  AppendNode(topology, branch_lengths);
+  buffer_.append(";\n");
+}
+
+void NewickWriter::WriteTo(int file_descriptor) {
+  const char *data = buffer_.data();
+  size_t remaining = buffer_.size();
+  while (remaining > 0) {
+    const ssize_t written = write(file_descriptor, data, remaining);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Failwith(std::string("Couldn't write Newick strings: ") + std::strerror(errno));
+    }
+    data += written;
+    remaining -= static_cast<size_t>(written);
+  }
+  buffer_.clear();
+}
+
+void NewickWriter::AppendNode(const Node &node,
+                              const std::vector<double> &branch_lengths) {
+  if (node.IsLeaf()) {
+    const size_t leaf_id = node.MaxLeafID();
+    if (leaf_labels_.empty()) {
+      char digits[16];
+      const auto result = std::to_chars(digits, digits + sizeof(digits), leaf_id);
+      buffer_.append(digits, result.ptr);
+    } else if (leaf_id < leaf_labels_.size() && leaf_labels_[leaf_id].has_value()) {
+      buffer_.append(*leaf_labels_[leaf_id]);
+    } else {
+      Failwith("NewickWriter has no label for leaf " + std::to_string(leaf_id) + ".");
+    }
+  } else {
+    buffer_.push_back('(');
+    bool first = true;
+    for (const auto &child : node.Children()) {
+      if (!first) {
+        buffer_.push_back(',');
+      }
+      first = false;
+      AppendNode(*child, branch_lengths);
+    }
+    buffer_.push_back(')');
+  }
+  AppendBranchLength(branch_lengths[node.Id()]);
+}
+
+void NewickWriter::AppendBranchLength(double branch_length) {
+  // Enough for any double with up to 17 significant digits.
+  char digits[32];
+  const auto result =
+      precision_.has_value()
+          ? std::to_chars(digits, digits + sizeof(digits), branch_length,
+                          std::chars_format::general, *precision_)
+          : std::to_chars(digits, digits + sizeof(digits), branch_length);
+  Assert(result.ec == std::errc(), "Couldn't format a branch length.");
+  buffer_.push_back(':');
+  buffer_.append(digits, result.ptr);
+}
+
+void NewickWriter::WriteBlocks(
+    size_t tree_count, size_t block_size, size_t thread_count,
+    const TagStringMap &tag_taxon_map, std::optional<int> precision,
+    const std::function<void(NewickWriter &, size_t, size_t)> &write_block,
+    const std::function<void(NewickWriter &)> &flush) {
+  const size_t block_count = (tree_count + block_size - 1) / block_size;
+  const size_t writer_count = std::max<size_t>(1, std::min(thread_count, block_count));
+  std::vector<NewickWriter> writers(writer_count,
+                                    NewickWriter(tag_taxon_map, precision));
+  std::unique_ptr<WorkStealingPool<size_t>> thread_pool;
+  if (writer_count > 1) {
+    SizeVector thread_indices(writer_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    thread_pool = std::make_unique<WorkStealingPool<size_t>>(thread_indices);
+  }
+  // Each round gives a block to each writer.
+  for (size_t first_block = 0; first_block < block_count; first_block += writer_count) {
+    const size_t round_count = std::min(writer_count, block_count - first_block);
+    const auto write_round_block = [&](size_t writer_idx) {
+      const size_t begin = (first_block + writer_idx) * block_size;
+      write_block(writers[writer_idx], begin, std::min(begin + block_size, tree_count));
+    };
+    if (thread_pool != nullptr) {
+      thread_pool->Run(round_count, [&](size_t, size_t writer_idx) {
+        write_round_block(writer_idx);
+      });
+    } else {
+      write_round_block(0);
+    }
+    for (size_t writer_idx = 0; writer_idx < round_count; writer_idx++) {
+      flush(writers[writer_idx]);
+      writers[writer_idx].Clear();
+    }
+  }
+}
+
+void NewickWriter::WriteBlocksToFile(
+    const std::string &path, size_t tree_count, size_t thread_count,
+    const TagStringMap &tag_taxon_map, std::optional<int> precision,
+    const std::function<void(NewickWriter &, size_t, size_t)> &write_block) {
+  const int file_descriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file_descriptor == -1) {
+    Failwith("Could not open '" + path + "' for writing.");
+  }
+  try {
+    WriteBlocks(tree_count, block_size_, thread_count, tag_taxon_map, precision,
+                write_block, [file_descriptor](NewickWriter &writer) {
+                  writer.WriteTo(file_descriptor);
+                });
+  } catch (...) {
+    close(file_descriptor);
+    throw;
+  }
+  if (close(file_descriptor) != 0) {
+    Failwith("Could not close '" + path + "'.");
+  }
+}
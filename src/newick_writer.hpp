@@ -0,0 +1,159 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A NewickWriter writes trees in Newick format into a buffer that it keeps between
+// trees, formatting numbers with std::to_chars. This avoids the labeler functions,
+// string concatenation and string streams of Node::Newick, which add up when writing
+// tens of thousands of trees. The output is that of Tree::Newick: leaves are labeled
+// with their taxon names if we have them and their ids otherwise, internal nodes
+// aren't labeled, and every node, the root included, gets its branch length.
+//
+// By default branch lengths get 6 significant digits, as printf's %g gives them
+// (which is what Node::Newick does). With no precision they get the shortest
+// representation that reads back as the same double.
+//
+// NewickOf and WriteNewickFile split the trees into contiguous blocks that threads
+// write in parallel, and put the blocks together in order, so the output doesn't
+// depend on the thread count. WriteNewickFile writes a few blocks at a time so that
+// only those are in memory.
+
+#ifndef SRC_NEWICK_WRITER_HPP_
+#define SRC_NEWICK_WRITER_HPP_
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+#include "node.hpp"
+#include "sugar.hpp"
+#include "task_processor.hpp"
+
+class NewickWriter {
+ public:
+  static constexpr int default_precision_ = 6;
+  // The number of trees in a block of WriteNewickFile.
+  static constexpr size_t block_size_ = 1024;
+
+  // Label the leaves with the taxon names of tag_taxon_map, if it isn't empty.
+  explicit NewickWriter(const TagStringMap &tag_taxon_map = {},
+                        std::optional<int> precision = default_precision_);
+
+  // Append the Newick string of a tree, followed by a newline.
+  void Append(const Node &topology, const std::vector<double> &branch_lengths);
+  template <typename TTree>
+  void Append(const TTree &tree) {
+    Append(*tree.Topology(), tree.branch_lengths_);
+  }
+  const std::string &Buffer() const { return buffer_; }
+  void Clear() { buffer_.clear(); }
+  // Write the buffer to a file descriptor and clear it.
+  void WriteTo(int file_descriptor);
+
+  // The Newick strings of the trees of a collection, each followed by a newline.
+  template <typename TTreeCollection>
+  static std::string NewickOf(const TTreeCollection &tree_collection,
+                              size_t thread_count = 1,
+                              std::optional<int> precision = default_precision_);
+  // Write the Newick strings of the trees of a collection to a file.
+  template <typename TTreeCollection>
+  static void WriteNewickFile(const TTreeCollection &tree_collection,
+                              const std::string &path, size_t thread_count = 1,
+                              std::optional<int> precision = default_precision_);
+
+ private:
+  // The label of each leaf id, if we have one.
+  std::vector<std::optional<std::string>> leaf_labels_;
+  std::optional<int> precision_;
+  std::string buffer_;
+
+  void AppendNode(const Node &node, const std::vector<double> &branch_lengths);
+  void AppendBranchLength(double branch_length);
+
+  // Call write_block(writer, tree_idx_begin, tree_idx_end) for consecutive blocks of
+  // at most block_size trees, in parallel on up to thread_count threads, each with
+  // its own writer. Between rounds of blocks, call flush on the writers of the round
+  // in order.
+  static void WriteBlocks(
+      size_t tree_count, size_t block_size, size_t thread_count,
+      const TagStringMap &tag_taxon_map, std::optional<int> precision,
+      const std::function<void(NewickWriter &, size_t, size_t)> &write_block,
+      const std::function<void(NewickWriter &)> &flush);
+  // WriteBlocks, writing the round of blocks to a file at path.
+  static void WriteBlocksToFile(
+      const std::string &path, size_t tree_count, size_t thread_count,
+      const TagStringMap &tag_taxon_map, std::optional<int> precision,
+      const std::function<void(NewickWriter &, size_t, size_t)> &write_block);
+};
+
+template <typename TTreeCollection>
+std::string NewickWriter::NewickOf(const TTreeCollection &tree_collection,
+                                   size_t thread_count, std::optional<int> precision) {
+  const size_t tree_count = tree_collection.TreeCount();
+  // One block per thread.
+  thread_count = std::max<size_t>(1, thread_count);
+  const size_t block_size =
+      std::max<size_t>(1, (tree_count + thread_count - 1) / thread_count);
+  std::string result;
+  WriteBlocks(
+      tree_count, block_size, thread_count, tree_collection.TagTaxonMap(), precision,
+      [&tree_collection](NewickWriter &writer, size_t begin, size_t end) {
+        for (size_t tree_idx = begin; tree_idx < end; tree_idx++) {
+          writer.Append(tree_collection.GetTree(tree_idx));
+        }
+      },
+      [&result](NewickWriter &writer) { result.append(writer.Buffer()); });
+  return result;
+}
+
+template <typename TTreeCollection>
+void NewickWriter::WriteNewickFile(const TTreeCollection &tree_collection,
+                                   const std::string &path, size_t thread_count,
+                                   std::optional<int> precision) {
+  WriteBlocksToFile(path, tree_collection.TreeCount(), thread_count,
+                    tree_collection.TagTaxonMap(), precision,
+                    [&tree_collection](NewickWriter &writer, size_t begin, size_t end) {
+                      for (size_t tree_idx = begin; tree_idx < end; tree_idx++) {
+                        writer.Append(tree_collection.GetTree(tree_idx));
+                      }
+                    });
+}
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("NewickWriter") {
+  TagStringMap tag_taxon_map;
+  for (uint32_t leaf_id = 0; leaf_id < 4; leaf_id++) {
+    tag_taxon_map[PackInts(leaf_id, 1)] = "taxon" + std::to_string(leaf_id);
+  }
+  NewickWriter unlabeled_writer;
+  NewickWriter labeled_writer(tag_taxon_map);
+  NewickWriter exact_writer(TagStringMap(), std::nullopt);
+  std::string unlabeled_newick;
+  std::string labeled_newick;
+  for (const auto &topology : Node::ExampleTopologies()) {
+    // Branch lengths that need all of their digits, and one that needs an exponent.
+    std::vector<double> branch_lengths(topology->Id() + 1);
+    for (size_t idx = 0; idx < branch_lengths.size(); idx++) {
+      branch_lengths[idx] = 1. / 3. + static_cast<double>(idx) * 1e-9;
+    }
+    branch_lengths[0] = 1e-20;
+    // By default we agree with Node::Newick.
+    unlabeled_writer.Append(*topology, branch_lengths);
+    unlabeled_newick.append(topology->Newick(branch_lengths) + "\n");
+    labeled_writer.Append(*topology, branch_lengths);
+    labeled_newick.append(topology->Newick(branch_lengths, tag_taxon_map) + "\n");
+    exact_writer.Append(*topology, branch_lengths);
+  }
+  CHECK_EQ(unlabeled_writer.Buffer(), unlabeled_newick);
+  CHECK_EQ(labeled_writer.Buffer(), labeled_newick);
+  // Without a precision, the branch lengths read back exactly.
+  CHECK_NE(exact_writer.Buffer().find(":0.3333333343333333"), std::string::npos);
+  CHECK_NE(exact_writer.Buffer().find(":1e-20"), std::string::npos);
+  unlabeled_writer.Clear();
+  CHECK(unlabeled_writer.Buffer().empty());
+  CHECK_THROWS(NewickWriter(TagStringMap(), 0));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_NEWICK_WRITER_HPP_
@@ -4,12 +4,10 @@
 #include "node.hpp"
 #include <limits.h>
 #include <algorithm>
-#include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <sstream>
-#include <stack>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -58,6 +56,10 @@ Node::Node(NodePtrVec children, size_t id, Bitset leaves)
 }
 
 bool Node::operator==(const Node& other) const {
+  // Interned topologies are shared, so this saves walking them.
+  if (this == &other) {
+    return true;
+  }
   if (this->Hash() != other.Hash()) {
     return false;
   }
@@ -73,248 +75,85 @@ bool Node::operator==(const Node& other) const {
   return true;
 }
 
+// The std::function traversals forward to the template overloads in node.hpp.
+
 void Node::PreOrder(std::function<void(const Node*)> f) const {
-  std::stack<const Node*> stack;
-  stack.push(this);
-  const Node* node;
-  while (stack.size()) {
-    node = stack.top();
-    stack.pop();
-    f(node);
-    const auto& children = node->Children();
-    for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
-      stack.push((*iter).get());
-    }
-  }
+  PreOrder([&f](const Node* node) { f(node); });
 }
 
 void Node::ConditionalPreOrder(std::function<bool(const Node*)> f) const {
-  std::stack<const Node*> stack;
-  stack.push(this);
-  const Node* node;
-  while (stack.size()) {
-    node = stack.top();
-    stack.pop();
-    if (f(node)) {
-      const auto& children = node->Children();
-      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
-        stack.push((*iter).get());
-      }
-    }
-  }
+  ConditionalPreOrder([&f](const Node* node) { return f(node); });
 }
 
 void Node::MutablePostOrder(std::function<void(Node*)> f) {
-  // The stack records the nodes and whether they have been visited or not.
-  std::stack<std::pair<Node*, bool>> stack;
-  stack.push({this, false});
-  Node* node;
-  bool visited;
-  while (stack.size()) {
-    std::tie(node, visited) = stack.top();
-    stack.pop();
-    if (visited) {
-      // If we've already visited this node then we are on our way back.
-      f(node);
-    } else {
-      // If not then we need to push ourself back on the stack (noting that
-      // we've been visited)...
-      stack.push({node, true});
-      // And all of our children, which have not.
-      const auto& children = node->Children();
-      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
-        stack.push({(*iter).get(), false});
-      }
-    }
-  }
+  MutablePostOrder([&f](Node* node) { f(node); });
 }
 
 void Node::PostOrder(std::function<void(const Node*)> f) const {
-  // https://stackoverflow.com/a/56603436/467327
-  Node* mutable_this = const_cast<Node*>(this);
-  mutable_this->MutablePostOrder(f);
+  PostOrder([&f](const Node* node) { f(node); });
 }
 
 void Node::PrePostOrder(std::function<void(const Node*)> pre,
                         std::function<void(const Node*)> post) const {
-  // The stack records the nodes and whether they have been visited or not.
-  std::stack<std::pair<const Node*, bool>> stack;
-  stack.push({this, false});
-  const Node* node;
-  bool visited;
-  while (stack.size()) {
-    std::tie(node, visited) = stack.top();
-    stack.pop();
-    if (visited) {
-      // If we've already visited this node then we are on our way back.
-      post(node);
-    } else {
-      pre(node);
-      // If not then we need to push ourself back on the stack (noting that
-      // we've been visited)...
-      stack.push({node, true});
-      // And all of our children, which have not.
-      const auto& children = node->Children();
-      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
-        stack.push({(*iter).get(), false});
-      }
-    }
-  }
+  PrePostOrder([&pre](const Node* node) { pre(node); },
+               [&post](const Node* node) { post(node); });
 }
 
 void Node::LevelOrder(std::function<void(const Node*)> f) const {
-  std::deque<const Node*> deque = {this};
-  while (deque.size()) {
-    auto n = deque.front();
-    deque.pop_front();
-    f(n);
-    for (const auto& child : n->children_) {
-      deque.push_back(child.get());
-    }
-  }
-}
-
-static std::function<void(const Node*, const Node*, const Node*)> const TripletIdInfix(
-    std::function<void(int, int, int)> f) {
-  return [&f](const Node* node0, const Node* node1, const Node* node2) {
-    f(static_cast<int>(node0->Id()), static_cast<int>(node1->Id()),
-      static_cast<int>(node2->Id()));
-  };
+  LevelOrder([&f](const Node* node) { f(node); });
 }
 
 void Node::TripleIdPreOrderBifurcating(std::function<void(int, int, int)> f) const {
-  TriplePreOrderBifurcating(TripletIdInfix(f));
-}
-
-static std::function<void(const Node*)> const BinaryIdInfix(
-    std::function<void(int, int, int)> f) {
-  return [&f](const Node* node) {
-    if (!node->IsLeaf()) {
-      Assert(node->Children().size() == 2, "BinaryIdInfix expects a bifurcating tree.");
-      f(static_cast<int>(node->Id()), static_cast<int>(node->Children()[0]->Id()),
-        static_cast<int>(node->Children()[1]->Id()));
-    }
-  };
+  TripleIdPreOrderBifurcating([&f](int id0, int id1, int id2) { f(id0, id1, id2); });
 }
 
 void Node::BinaryIdPreOrder(const std::function<void(int, int, int)> f) const {
-  PreOrder(BinaryIdInfix(f));
+  BinaryIdPreOrder([&f](int id, int child0_id, int child1_id) {
+    f(id, child0_id, child1_id);
+  });
 }
 
 void Node::BinaryIdPostOrder(const std::function<void(int, int, int)> f) const {
-  PostOrder(BinaryIdInfix(f));
+  BinaryIdPostOrder([&f](int id, int child0_id, int child1_id) {
+    f(id, child0_id, child1_id);
+  });
 }
 
 void Node::TriplePreOrder(
     std::function<void(const Node*, const Node*, const Node*)> f_root,
     std::function<void(const Node*, const Node*, const Node*)> f_internal) const {
-  Assert(children_.size() == 3,
-         "TriplePreOrder expects a tree with a trifurcation at the root.");
-  f_root(children_[0].get(), children_[1].get(), children_[2].get());
-  children_[0]->TriplePreOrderBifurcating(f_internal);
-  f_root(children_[1].get(), children_[2].get(), children_[0].get());
-  children_[1]->TriplePreOrderBifurcating(f_internal);
-  f_root(children_[2].get(), children_[0].get(), children_[1].get());
-  children_[2]->TriplePreOrderBifurcating(f_internal);
+  TriplePreOrder(
+      [&f_root](const Node* node0, const Node* node1, const Node* node2) {
+        f_root(node0, node1, node2);
+      },
+      [&f_internal](const Node* node, const Node* sister, const Node* parent) {
+        f_internal(node, sister, parent);
+      });
 }
 
 void Node::TriplePreOrderBifurcating(
     std::function<void(const Node*, const Node*, const Node*)> f) const {
-  if (IsLeaf()) {
-    return;
-  }  // else
-  std::stack<std::pair<const Node*, bool>> stack;
-  stack.push({this, false});
-  const Node* node;
-  bool visited;
-  while (stack.size()) {
-    // Here we visit each node twice, once for each orientation.
-    std::tie(node, visited) = stack.top();
-    stack.pop();
-    const auto& children = node->Children();
-    Assert(children.size() == 2,
-           "TriplePreOrderBifurcating expects a bifurcating tree.");
-    if (visited) {
-      // We've already visited this node once, so do the second orientation.
-      f(children[1].get(), children[0].get(), node);
-      // Next traverse the right child.
-      if (!children[1]->IsLeaf()) {
-        stack.push({children[1].get(), false});
-      }
-    } else {
-      // We are visiting this node for the first time.
-      // Apply f in the first orientation.
-      f(children[0].get(), children[1].get(), node);
-      // Then set it up so it gets executed in the second orientation...
-      stack.push({node, true});
-      // ... after first traversing the left child.
-      if (!children[0]->IsLeaf()) {
-        stack.push({children[0].get(), false});
-      }
-    }
-  }
+  TriplePreOrderBifurcating(
+      [&f](const Node* node, const Node* sister, const Node* parent) {
+        f(node, sister, parent);
+      });
 }
 
-// See the typedef of UnrootedPCSSFun to understand the argument type to this
-// function, and `doc/pcss.svg` for a diagram that will greatly help you
-// understand the implementation.
 void Node::UnrootedPCSSPreOrder(UnrootedPCSSFun f) const {
-  this->TriplePreOrder(
-      // f_root
-      [&f](const Node* node0, const Node* node1, const Node* node2) {
-        // Virtual root on node2's edge, with subsplit pointing up.
-        f(node2, false, node2, true, node0, false, node1, false, nullptr);
-        if (!node2->IsLeaf()) {
-          Assert(node2->Children().size() == 2,
-                 "PCSSPreOrder expects a bifurcating tree.");
-          auto child0 = node2->Children()[0].get();
-          auto child1 = node2->Children()[1].get();
-          // Virtual root in node1.
-          f(node0, false, node2, false, child0, false, child1, false, node1);
-          // Virtual root in node0.
-          f(node1, false, node2, false, child0, false, child1, false, node0);
-          // Virtual root on node2's edge, with subsplit pointing down.
-          f(node2, true, node2, false, child0, false, child1, false, nullptr);
-          // Virtual root in child0.
-          f(child1, false, node2, true, node0, false, node1, false, child0);
-          // Virtual root in child1.
-          f(child0, false, node2, true, node0, false, node1, false, child1);
-        }
-      },
-      // f_internal
-      [&f, this](const Node* node, const Node* sister, const Node* parent) {
-        // Virtual root on node's edge, with subsplit pointing up.
-        f(node, false, node, true, parent, true, sister, false, nullptr);
-        if (!node->IsLeaf()) {
-          Assert(node->Children().size() == 2,
-                 "PCSSPreOrder expects a bifurcating tree.");
-          auto child0 = node->Children()[0].get();
-          auto child1 = node->Children()[1].get();
-          // Virtual root up the tree.
-          f(sister, false, node, false, child0, false, child1, false, this);
-          // Virtual root in sister.
-          f(parent, true, node, false, child0, false, child1, false, sister);
-          // Virtual root on node's edge, with subsplit pointing down.
-          f(node, true, node, false, child0, false, child1, false, nullptr);
-          // Virtual root in child0.
-          f(child1, false, node, true, sister, false, parent, true, child0);
-          // Virtual root in child1.
-          f(child0, false, node, true, sister, false, parent, true, child1);
-        }
-      });
+  UnrootedPCSSPreOrder([&f](const Node* sister, bool sister_direction,
+                            const Node* focal, bool focal_direction,
+                            const Node* child0, bool child0_direction,
+                            const Node* child1, bool child1_direction,
+                            const Node* virtual_root_clade) {
+    f(sister, sister_direction, focal, focal_direction, child0, child0_direction,
+      child1, child1_direction, virtual_root_clade);
+  });
 }
 
 void Node::RootedPCSSPreOrder(RootedPCSSFun f) const {
-  this->TriplePreOrderBifurcating(
-      [&f](const Node* node, const Node* sister, const Node* parent) {
-        if (!node->IsLeaf()) {
-          Assert(node->Children().size() == 2,
-                 "RootedPCSSPreOrder expects a bifurcating tree.");
-          auto child0 = node->Children()[0].get();
-          auto child1 = node->Children()[1].get();
-          f(sister, node, child0, child1);
-        }
-      });
+  RootedPCSSPreOrder(
+      [&f](const Node* sister, const Node* focal, const Node* child0,
+           const Node* child1) { f(sister, focal, child0, child1); });
 }
 
 // This function assigns ids to the nodes of the topology: the leaves get
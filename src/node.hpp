@@ -32,6 +32,8 @@
 #define SRC_NODE_HPP_
 
 #include <limits.h>
+#include <array>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <string>
@@ -125,6 +127,35 @@ class Node {
   void UnrootedPCSSPreOrder(UnrootedPCSSFun f) const;
   void RootedPCSSPreOrder(RootedPCSSFun f) const;
 
+  // Each traversal above also has a template overload that takes any callable,
+  // defined below the class. Calls with a lambda pick the template, so the compiler
+  // can inline the visit rather than calling through a std::function. The
+  // std::function versions forward to the templates.
+  template <typename F>
+  void PreOrder(F f) const;
+  template <typename F>
+  void ConditionalPreOrder(F f) const;
+  template <typename F>
+  void PostOrder(F f) const;
+  template <typename F>
+  void LevelOrder(F f) const;
+  template <typename Pre, typename Post>
+  void PrePostOrder(Pre pre, Post post) const;
+  template <typename FRoot, typename FInternal>
+  void TriplePreOrder(FRoot f_root, FInternal f_internal) const;
+  template <typename F>
+  void TriplePreOrderBifurcating(F f) const;
+  template <typename F>
+  void TripleIdPreOrderBifurcating(F f) const;
+  template <typename F>
+  void BinaryIdPreOrder(F f) const;
+  template <typename F>
+  void BinaryIdPostOrder(F f) const;
+  template <typename F>
+  void UnrootedPCSSPreOrder(F f) const;
+  template <typename F>
+  void RootedPCSSPreOrder(F f) const;
+
   // This function prepares the id_ and leaves_ member variables as described at
   // the start of this document. It returns a map that maps the tags to their
   // indices. It's the verb, not the nationality.
@@ -197,6 +228,11 @@ class Node {
 
   // This is a private PostOrder that can change the Node.
   void MutablePostOrder(std::function<void(Node*)> f);
+  template <typename F>
+  void MutablePostOrder(F f);
+  // Apply f to (node_id, child0_id, child1_id) if node is internal.
+  template <typename F>
+  static void ApplyToBinaryIds(F& f, const Node* node);
 
   std::string NewickAux(std::function<std::string(const Node*)> node_labeler,
                         const DoubleVectorOption& branch_lengths) const;
@@ -206,6 +242,246 @@ class Node {
   static Bitset LeavesOf(const NodePtrVec& children);
 };
 
+// ** Template traversals
+//
+// These use explicit stacks rather than recursion, so that deep ladder trees can't
+// overflow the call stack.
+
+template <typename F>
+void Node::PreOrder(F f) const {
+  std::vector<const Node*> stack = {this};
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    f(node);
+    const auto& children = node->Children();
+    for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
+      stack.push_back(iter->get());
+    }
+  }
+}
+
+template <typename F>
+void Node::ConditionalPreOrder(F f) const {
+  std::vector<const Node*> stack = {this};
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    if (f(node)) {
+      const auto& children = node->Children();
+      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
+        stack.push_back(iter->get());
+      }
+    }
+  }
+}
+
+template <typename F>
+void Node::MutablePostOrder(F f) {
+  // The stack records the nodes and whether they have been visited or not.
+  std::vector<std::pair<Node*, bool>> stack = {{this, false}};
+  while (!stack.empty()) {
+    const auto [node, visited] = stack.back();
+    stack.pop_back();
+    if (visited) {
+      // If we've already visited this node then we are on our way back.
+      f(node);
+    } else {
+      // If not then we need to push ourself back on the stack (noting that
+      // we've been visited)...
+      stack.push_back({node, true});
+      // And all of our children, which have not.
+      const auto& children = node->Children();
+      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
+        stack.push_back({iter->get(), false});
+      }
+    }
+  }
+}
+
+template <typename F>
+void Node::PostOrder(F f) const {
+  // https://stackoverflow.com/a/56603436/467327
+  Node* mutable_this = const_cast<Node*>(this);
+  mutable_this->MutablePostOrder([&f](const Node* node) { f(node); });
+}
+
+template <typename F>
+void Node::LevelOrder(F f) const {
+  std::deque<const Node*> deque = {this};
+  while (!deque.empty()) {
+    const Node* node = deque.front();
+    deque.pop_front();
+    f(node);
+    for (const auto& child : node->children_) {
+      deque.push_back(child.get());
+    }
+  }
+}
+
+template <typename Pre, typename Post>
+void Node::PrePostOrder(Pre pre, Post post) const {
+  // The stack records the nodes and whether they have been visited or not.
+  std::vector<std::pair<const Node*, bool>> stack = {{this, false}};
+  while (!stack.empty()) {
+    const auto [node, visited] = stack.back();
+    stack.pop_back();
+    if (visited) {
+      // If we've already visited this node then we are on our way back.
+      post(node);
+    } else {
+      pre(node);
+      stack.push_back({node, true});
+      const auto& children = node->Children();
+      for (auto iter = children.rbegin(); iter != children.rend(); ++iter) {
+        stack.push_back({iter->get(), false});
+      }
+    }
+  }
+}
+
+template <typename FRoot, typename FInternal>
+void Node::TriplePreOrder(FRoot f_root, FInternal f_internal) const {
+  Assert(children_.size() == 3,
+         "TriplePreOrder expects a tree with a trifurcation at the root.");
+  const auto internal = [&f_internal](const Node* node, const Node* sister,
+                                      const Node* parent) {
+    f_internal(node, sister, parent);
+  };
+  f_root(children_[0].get(), children_[1].get(), children_[2].get());
+  children_[0]->TriplePreOrderBifurcating(internal);
+  f_root(children_[1].get(), children_[2].get(), children_[0].get());
+  children_[1]->TriplePreOrderBifurcating(internal);
+  f_root(children_[2].get(), children_[0].get(), children_[1].get());
+  children_[2]->TriplePreOrderBifurcating(internal);
+}
+
+template <typename F>
+void Node::TriplePreOrderBifurcating(F f) const {
+  if (IsLeaf()) {
+    return;
+  }  // else
+  // Here we visit each node twice, once for each orientation.
+  std::vector<std::pair<const Node*, bool>> stack = {{this, false}};
+  while (!stack.empty()) {
+    const auto [node, visited] = stack.back();
+    stack.pop_back();
+    const auto& children = node->Children();
+    Assert(children.size() == 2,
+           "TriplePreOrderBifurcating expects a bifurcating tree.");
+    if (visited) {
+      // We've already visited this node once, so do the second orientation.
+      f(children[1].get(), children[0].get(), node);
+      // Next traverse the right child.
+      if (!children[1]->IsLeaf()) {
+        stack.push_back({children[1].get(), false});
+      }
+    } else {
+      // We are visiting this node for the first time.
+      // Apply f in the first orientation.
+      f(children[0].get(), children[1].get(), node);
+      // Then set it up so it gets executed in the second orientation...
+      stack.push_back({node, true});
+      // ... after first traversing the left child.
+      if (!children[0]->IsLeaf()) {
+        stack.push_back({children[0].get(), false});
+      }
+    }
+  }
+}
+
+template <typename F>
+void Node::TripleIdPreOrderBifurcating(F f) const {
+  TriplePreOrderBifurcating(
+      [&f](const Node* node0, const Node* node1, const Node* node2) {
+        f(static_cast<int>(node0->Id()), static_cast<int>(node1->Id()),
+          static_cast<int>(node2->Id()));
+      });
+}
+
+template <typename F>
+void Node::ApplyToBinaryIds(F& f, const Node* node) {
+  if (!node->IsLeaf()) {
+    Assert(node->Children().size() == 2, "BinaryIdInfix expects a bifurcating tree.");
+    f(static_cast<int>(node->Id()), static_cast<int>(node->Children()[0]->Id()),
+      static_cast<int>(node->Children()[1]->Id()));
+  }
+}
+
+template <typename F>
+void Node::BinaryIdPreOrder(F f) const {
+  PreOrder([&f](const Node* node) { ApplyToBinaryIds(f, node); });
+}
+
+template <typename F>
+void Node::BinaryIdPostOrder(F f) const {
+  PostOrder([&f](const Node* node) { ApplyToBinaryIds(f, node); });
+}
+
+// See the typedef of UnrootedPCSSFun to understand the argument type to this
+// function, and `doc/pcss.svg` for a diagram that will greatly help you
+// understand the implementation.
+template <typename F>
+void Node::UnrootedPCSSPreOrder(F f) const {
+  TriplePreOrder(
+      // f_root
+      [&f](const Node* node0, const Node* node1, const Node* node2) {
+        // Virtual root on node2's edge, with subsplit pointing up.
+        f(node2, false, node2, true, node0, false, node1, false, nullptr);
+        if (!node2->IsLeaf()) {
+          Assert(node2->Children().size() == 2,
+                 "PCSSPreOrder expects a bifurcating tree.");
+          auto child0 = node2->Children()[0].get();
+          auto child1 = node2->Children()[1].get();
+          // Virtual root in node1.
+          f(node0, false, node2, false, child0, false, child1, false, node1);
+          // Virtual root in node0.
+          f(node1, false, node2, false, child0, false, child1, false, node0);
+          // Virtual root on node2's edge, with subsplit pointing down.
+          f(node2, true, node2, false, child0, false, child1, false, nullptr);
+          // Virtual root in child0.
+          f(child1, false, node2, true, node0, false, node1, false, child0);
+          // Virtual root in child1.
+          f(child0, false, node2, true, node0, false, node1, false, child1);
+        }
+      },
+      // f_internal
+      [&f, this](const Node* node, const Node* sister, const Node* parent) {
+        // Virtual root on node's edge, with subsplit pointing up.
+        f(node, false, node, true, parent, true, sister, false, nullptr);
+        if (!node->IsLeaf()) {
+          Assert(node->Children().size() == 2,
+                 "PCSSPreOrder expects a bifurcating tree.");
+          auto child0 = node->Children()[0].get();
+          auto child1 = node->Children()[1].get();
+          // Virtual root up the tree.
+          f(sister, false, node, false, child0, false, child1, false, this);
+          // Virtual root in sister.
+          f(parent, true, node, false, child0, false, child1, false, sister);
+          // Virtual root on node's edge, with subsplit pointing down.
+          f(node, true, node, false, child0, false, child1, false, nullptr);
+          // Virtual root in child0.
+          f(child1, false, node, true, sister, false, parent, true, child0);
+          // Virtual root in child1.
+          f(child0, false, node, true, sister, false, parent, true, child1);
+        }
+      });
+}
+
+template <typename F>
+void Node::RootedPCSSPreOrder(F f) const {
+  TriplePreOrderBifurcating(
+      [&f](const Node* node, const Node* sister, const Node* parent) {
+        if (!node->IsLeaf()) {
+          Assert(node->Children().size() == 2,
+                 "RootedPCSSPreOrder expects a bifurcating tree.");
+          auto child0 = node->Children()[0].get();
+          auto child1 = node->Children()[1].get();
+          f(sister, node, child0, child1);
+        }
+      });
+}
+
 // Compare NodePtrs by their Nodes.
 inline bool operator==(const Node::NodePtr& lhs, const Node::NodePtr& rhs) {
   return *lhs == *rhs;
@@ -304,5 +580,44 @@ TEST_CASE("Node") {
 
   CHECK_EQ(Node::OfParentIdVector({4, 4, 5, 6, 5, 6}), Node::Ladder(4));
 }
+
+TEST_CASE("Node: template and std::function traversals") {
+  // A deep ladder checks that the traversals don't recur.
+  Node::NodePtrVec topologies = {
+      Node::OfParentIdVector({7, 7, 8, 9, 9, 11, 11, 8, 10, 10, 11}),
+      Node::ExampleTopologies()[3], Node::Ladder(5000)};
+  for (const auto& topology : topologies) {
+    using IdVector = std::vector<size_t>;
+    const auto collect = [](IdVector& ids) {
+      return [&ids](const Node* node) { ids.push_back(node->Id()); };
+    };
+    IdVector template_ids, function_ids;
+    topology->PreOrder(collect(template_ids));
+    topology->PostOrder(collect(template_ids));
+    topology->LevelOrder(collect(template_ids));
+    topology->PrePostOrder(collect(template_ids), collect(template_ids));
+    using NodeFun = std::function<void(const Node*)>;
+    topology->PreOrder(NodeFun(collect(function_ids)));
+    topology->PostOrder(NodeFun(collect(function_ids)));
+    topology->LevelOrder(NodeFun(collect(function_ids)));
+    topology->PrePostOrder(NodeFun(collect(function_ids)),
+                           NodeFun(collect(function_ids)));
+    CHECK_EQ(template_ids, function_ids);
+    if (topology->Children().size() != 2) {
+      continue;
+    }  // else
+    using TripleVector = std::vector<std::array<int, 3>>;
+    const auto collect_triple = [](TripleVector& triples) {
+      return [&triples](int a, int b, int c) { triples.push_back({a, b, c}); };
+    };
+    TripleVector template_triples, function_triples;
+    topology->BinaryIdPostOrder(collect_triple(template_triples));
+    topology->TripleIdPreOrderBifurcating(collect_triple(template_triples));
+    using TripleFun = std::function<void(int, int, int)>;
+    topology->BinaryIdPostOrder(TripleFun(collect_triple(function_triples)));
+    topology->TripleIdPreOrderBifurcating(TripleFun(collect_triple(function_triples)));
+    CHECK_EQ(template_triples, function_triples);
+  }
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_NODE_HPP_
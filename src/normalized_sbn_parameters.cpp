@@ -0,0 +1,60 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "normalized_sbn_parameters.hpp"
+#include <algorithm>
+#include "numerical_utils.hpp"
+
+NormalizedSBNParameters::NormalizedSBNParameters(
+    size_t parameter_count, size_t rootsplit_count,
+    const BitsetSizePairMap& parent_to_range)
+    : seen_(EigenVectorXd::Constant(parameter_count, DOUBLE_NAN)),
+      normalized_in_log_(EigenVectorXd::Constant(parameter_count, DOUBLE_NAN)),
+      probabilities_(EigenVectorXd::Constant(parameter_count, DOUBLE_NAN)),
+      alias_table_(parameter_count) {
+  ranges_.reserve(1 + parent_to_range.size());
+  ranges_.emplace_back(0, rootsplit_count);
+  for (const auto& [_, range] : parent_to_range) {
+    ranges_.push_back(range);
+  }
+  // Going through the ranges in order is kinder to the cache.
+  std::sort(ranges_.begin() + 1, ranges_.end());
+  alias_table_stale_.assign(ranges_.size(), true);
+}
+
+size_t NormalizedSBNParameters::Update(EigenConstVectorXdRef sbn_parameters) {
+  Assert(static_cast<size_t>(sbn_parameters.size()) == size(),
+         "NormalizedSBNParameters::Update got a vector of the wrong size.");
+  size_t updated_range_count = 0;
+  for (size_t range_idx = 0; range_idx < ranges_.size(); range_idx++) {
+    const auto& [start, end] = ranges_[range_idx];
+    const auto range_size = static_cast<Eigen::Index>(end - start);
+    const auto parameters = sbn_parameters.segment(start, range_size);
+    auto seen = seen_.segment(start, range_size);
+    if ((parameters.array() == seen.array()).all()) {
+      continue;
+    }
+    seen = parameters;
+    auto normalized_in_log = normalized_in_log_.segment(start, range_size);
+    normalized_in_log = parameters;
+    NumericalUtils::ProbabilityNormalizeInLog(normalized_in_log);
+    probabilities_.segment(start, range_size) = normalized_in_log.array().exp();
+    alias_table_stale_[range_idx] = true;
+    updated_range_count++;
+  }
+  return updated_range_count;
+}
+
+size_t NormalizedSBNParameters::UpdateWithAliasTable(
+    EigenConstVectorXdRef sbn_parameters) {
+  const size_t updated_range_count = Update(sbn_parameters);
+  for (size_t range_idx = 0; range_idx < ranges_.size(); range_idx++) {
+    if (alias_table_stale_[range_idx]) {
+      const auto& [start, end] = ranges_[range_idx];
+      alias_table_.SetRangeFromLogWeights(ranges_[range_idx],
+                                          seen_.segment(start, end - start));
+      alias_table_stale_[range_idx] = false;
+    }
+  }
+  return updated_range_count;
+}
@@ -0,0 +1,99 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A NormalizedSBNParameters caches a vector laid out like sbn_parameters_ (see
+// sbn_probability.hpp) normalized within each of its ranges: in log space, as
+// probabilities, and as an AliasTable for sampling. Each Update compares the vector
+// with the one it last saw, range by range, and re-normalizes only the ranges that
+// changed. So after a sparse update, such as a gradient step that touched a few
+// parents, bringing the cache up to date costs a comparison of the vector rather than
+// a log-sum-exp over all of it. The vector can be changed in any way, including from
+// Python, because we look for the changes rather than being told about them.
+
+#ifndef SRC_NORMALIZED_SBN_PARAMETERS_HPP_
+#define SRC_NORMALIZED_SBN_PARAMETERS_HPP_
+
+#include <utility>
+#include <vector>
+#include "alias_table.hpp"
+#include "eigen_sugar.hpp"
+#include "sbn_maps.hpp"
+
+class NormalizedSBNParameters {
+ public:
+  using Range = std::pair<size_t, size_t>;
+
+  NormalizedSBNParameters() = default;
+  // The ranges are the rootsplits, [0, rootsplit_count), and those of the parents.
+  NormalizedSBNParameters(size_t parameter_count, size_t rootsplit_count,
+                          const BitsetSizePairMap& parent_to_range);
+
+  size_t size() const { return static_cast<size_t>(seen_.size()); }
+  size_t RangeCount() const { return ranges_.size(); }
+  // The bytes of the cache, for SBNInstance::MemoryByteCounts.
+  size_t ByteCount() const {
+    return 3 * size() * sizeof(double) +
+           alias_table_.size() * (sizeof(double) + sizeof(size_t)) +
+           ranges_.capacity() * sizeof(Range) + alias_table_stale_.capacity() / 8;
+  }
+
+  // Bring the normalized parameters up to date with sbn_parameters, returning the
+  // number of ranges that we normalized.
+  size_t Update(EigenConstVectorXdRef sbn_parameters);
+  // Update, and then bring the alias table up to date as well.
+  size_t UpdateWithAliasTable(EigenConstVectorXdRef sbn_parameters);
+
+  // These are as of the last Update.
+  const EigenVectorXd& InLog() const { return normalized_in_log_; }
+  const EigenVectorXd& Probabilities() const { return probabilities_; }
+  // This is as of the last UpdateWithAliasTable.
+  const AliasTable& GetAliasTable() const { return alias_table_; }
+
+ private:
+  std::vector<Range> ranges_;
+  // The vector as of the last Update, which starts out as NaN so that every range
+  // differs from it.
+  EigenVectorXd seen_;
+  EigenVectorXd normalized_in_log_;
+  EigenVectorXd probabilities_;
+  AliasTable alias_table_;
+  // Whether each range changed since we last set it up in the alias table.
+  std::vector<bool> alias_table_stale_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("NormalizedSBNParameters") {
+  // Two rootsplits, and two parents with ranges of two and three children.
+  BitsetSizePairMap parent_to_range;
+  parent_to_range[Bitset("1100")] = {2, 4};
+  parent_to_range[Bitset("0011")] = {4, 7};
+  NormalizedSBNParameters normalized(7, 2, parent_to_range);
+  CHECK_EQ(normalized.RangeCount(), 3);
+  EigenVectorXd sbn_parameters(7);
+  sbn_parameters << 0., 0., log(1.), log(3.), log(2.), log(2.), log(4.);
+  CHECK_EQ(normalized.Update(sbn_parameters), 3);
+  EigenVectorXd expected(7);
+  expected << 0.5, 0.5, 0.25, 0.75, 0.25, 0.25, 0.5;
+  CheckVectorXdEquality(normalized.Probabilities(), expected, 1e-12);
+  CheckVectorXdEquality(normalized.InLog(), expected.array().log().matrix(), 1e-12);
+  // Nothing changed, so there's nothing to do.
+  CHECK_EQ(normalized.Update(sbn_parameters), 0);
+  // Changing one entry re-normalizes only its range.
+  sbn_parameters[5] = log(6.);
+  CHECK_EQ(normalized.UpdateWithAliasTable(sbn_parameters), 1);
+  expected.segment(4, 3) << 2. / 12., 6. / 12., 4. / 12.;
+  CheckVectorXdEquality(normalized.Probabilities(), expected, 1e-12);
+  CheckVectorXdEquality(normalized.InLog(), expected.array().log().matrix(), 1e-12);
+  // The alias table samples from the normalized parameters.
+  std::mt19937 generator(42);
+  size_t middle_count = 0;
+  const size_t sample_count = 100000;
+  for (size_t i = 0; i < sample_count; i++) {
+    middle_count += (normalized.GetAliasTable().Sample({4, 7}, generator) == 5);
+  }
+  CHECK_LT(fabs(static_cast<double>(middle_count) / sample_count - 0.5), 5e-3);
+  CHECK_THROWS(normalized.Update(EigenVectorXd::Zero(6)));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_NORMALIZED_SBN_PARAMETERS_HPP_
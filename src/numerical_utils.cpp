@@ -4,7 +4,7 @@
 #include "numerical_utils.hpp"
 #include <iostream>
 
-double NumericalUtils::LogSum(const EigenVectorXdRef vec) { return vec.redux(LogAdd); }
+double NumericalUtils::LogSum(EigenConstVectorXdRef vec) { return vec.redux(LogAdd); }
 
 EigenVectorXd NumericalUtils::LogAddVectors(const EigenVectorXdRef vec1,
                                             const EigenVectorXdRef vec2) {
@@ -15,6 +15,50 @@ EigenVectorXd NumericalUtils::LogAddVectors(const EigenVectorXdRef vec1,
   return result;
 }
 
+EigenVectorXd NumericalUtils::LeaveOneOutLogSums(EigenConstVectorXdRef vec) {
+  const Eigen::Index size = vec.size();
+  // First fill result(j) with the log sum of the entries before j, then log-add in
+  // the log sum of the entries after j.
+  EigenVectorXd result(size);
+  double log_sum = DOUBLE_NEG_INF;
+  for (Eigen::Index j = 0; j < size; j++) {
+    result[j] = log_sum;
+    log_sum = LogAdd(log_sum, vec[j]);
+  }
+  log_sum = DOUBLE_NEG_INF;
+  for (Eigen::Index j = size - 1; j >= 0; j--) {
+    result[j] = LogAdd(result[j], log_sum);
+    log_sum = LogAdd(log_sum, vec[j]);
+  }
+  return result;
+}
+
+void NumericalUtils::LogAddAtIndices(EigenVectorXdRef vec, const SizeVector &indices,
+                                     double value, EigenVectorXd &scratch) {
+  if (value == DOUBLE_NEG_INF) {
+    return;
+  }  // else
+  const auto count = static_cast<Eigen::Index>(indices.size());
+  if (scratch.size() < count) {
+    scratch.resize(count);
+  }
+  auto entries = scratch.head(count).array();
+  for (Eigen::Index i = 0; i < count; i++) {
+    entries[i] = vec[indices[i]];
+  }
+  // As in LogAdd, we add the exponentiated difference to the larger of the two, and
+  // skip differences below LOG_EPS. Clamping the difference before exponentiating
+  // keeps exp from underflowing, which would raise FE_UNDERFLOW.
+  // These are expressions, so the assignment below is a single coefficient-wise pass.
+  const auto larger = entries.max(value);
+  const auto neg_diff = -(entries - value).abs();
+  entries = (neg_diff < LOG_EPS)
+                .select(larger, larger + neg_diff.max(LOG_EPS).exp().log1p());
+  for (Eigen::Index i = 0; i < count; i++) {
+    vec[indices[i]] = entries[i];
+  }
+}
+
 void NumericalUtils::ProbabilityNormalizeInLog(EigenVectorXdRef vec) {
   vec = vec.array() - LogSum(vec);
 }
@@ -52,9 +52,18 @@ inline double LogAdd(double x, double y) {
 }
 
 // Return log(sum_i exp(vec(i))).
-double LogSum(const EigenVectorXdRef vec);
+double LogSum(EigenConstVectorXdRef vec);
+// Returns a vector with the j-th entry given by the LogSum of every entry of vec
+// except the j-th. This takes linear time, using prefix and suffix log sums rather
+// than subtraction so that it is accurate when one entry dominates.
+EigenVectorXd LeaveOneOutLogSums(EigenConstVectorXdRef vec);
 // Returns a vector with the i-th entry given by LogAdd(vec1(i), vec2(i))
 EigenVectorXd LogAddVectors(const EigenVectorXdRef vec1, const EigenVectorXdRef vec2);
+// Set vec(i) = LogAdd(vec(i), value) for each i in indices, which must be distinct.
+// The entries are gathered into scratch so that the log-adds happen as one
+// vectorized operation.
+void LogAddAtIndices(EigenVectorXdRef vec, const SizeVector &indices, double value,
+                     EigenVectorXd &scratch);
 // Normalize the entries of vec such that they become logs of probabilities:
 // vec(i) = vec(i) - LogSum(vec).
 void ProbabilityNormalizeInLog(EigenVectorXdRef vec);
@@ -91,11 +100,38 @@ TEST_CASE("NumericalUtils") {
   CHECK_LT(fabs(log_sum - 4.007333), 1e-5);
   CHECK_LT(fabs(log_sum2 - 4.007333), 1e-5);
 
+  const EigenVectorXd leave_one_out_log_sums =
+      NumericalUtils::LeaveOneOutLogSums(log_vec);
+  for (Eigen::Index j = 0; j < log_vec.size(); j++) {
+    // log(55 - (j + 1)), as the sum of 1 through 10 is 55.
+    CHECK_LT(fabs(leave_one_out_log_sums[j] - log(54. - j)), 1e-12);
+  }
+  // One dominant entry leaves nothing to cancel against.
+  EigenVectorXd dominated(3);
+  dominated << 0., -800., -801.;
+  CHECK_LT(fabs(NumericalUtils::LeaveOneOutLogSums(dominated)[0] -
+                NumericalUtils::LogAdd(-800., -801.)),
+           1e-12);
+
   NumericalUtils::ProbabilityNormalizeInLog(log_vec);
   for (size_t i = 0; i < log_vec.size(); i++) {
     CHECK_LT(fabs(log_vec(i) - (log(i + 1) - log_sum)), 1e-5);
   }
 
+  EigenVectorXd log_add_at_indices = log_vec;
+  log_add_at_indices[3] = DOUBLE_NEG_INF;
+  EigenVectorXd expected_log_add_at_indices = log_add_at_indices;
+  const SizeVector indices({1, 3, 4, 9});
+  for (const auto idx : indices) {
+    expected_log_add_at_indices[idx] =
+        NumericalUtils::LogAdd(expected_log_add_at_indices[idx], -1.5);
+  }
+  EigenVectorXd scratch;
+  NumericalUtils::LogAddAtIndices(log_add_at_indices, indices, -1.5, scratch);
+  for (Eigen::Index i = 0; i < log_vec.size(); i++) {
+    CHECK_LT(fabs(log_add_at_indices[i] - expected_log_add_at_indices[i]), 1e-12);
+  }
+
   NumericalUtils::Exponentiate(log_vec);
   double sum = 0.0;
   for (size_t i = 0; i < log_vec.size(); i++) {
@@ -0,0 +1,128 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// An OperationScheduleCache remembers the BEAGLE operations that FatBeagle builds
+// for a topology, so that topologies that come up again and again (as they do when
+// sampling from an SBN or reading MCMC output) skip the traversals that build them.
+//
+// The operations depend on the topology (including its node ids) and on whether we
+// rescale, but not on branch lengths or model parameters, so that is the key. When
+// the cache is full we evict the least recently used schedule.
+
+#ifndef SRC_OPERATION_SCHEDULE_CACHE_HPP_
+#define SRC_OPERATION_SCHEDULE_CACHE_HPP_
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "beagle_accessories.hpp"
+#include "sugar.hpp"
+
+struct OperationSchedule {
+  using BeagleOperationVector = std::vector<BeagleOperation>;
+
+  BeagleAccessories ba_;
+  BeagleOperationVector post_order_operations_;
+  // The pre-order operations are only needed for gradients, so they are filled in
+  // the first time that a gradient asks for them.
+  std::optional<BeagleOperationVector> pre_order_operations_;
+};
+
+class OperationScheduleCache {
+ public:
+  using SchedulePtr = std::shared_ptr<OperationSchedule>;
+  using Key = std::pair<Node::NodePtr, bool>;
+
+  struct KeyHasher {
+    size_t operator()(const Key &key) const {
+      return std::hash<Node::NodePtr>()(key.first) ^ static_cast<size_t>(key.second);
+    }
+  };
+
+  explicit OperationScheduleCache(size_t capacity) : capacity_(capacity) {
+    Assert(capacity_ > 0, "OperationScheduleCache needs a positive capacity.");
+  }
+
+  size_t Capacity() const { return capacity_; }
+  size_t Size() const { return map_.size(); }
+  size_t HitCount() const { return hit_count_; }
+  size_t MissCount() const { return miss_count_; }
+
+  // Find the schedule for a topology, marking it as the most recently used, or
+  // return nullptr if we don't have it.
+  SchedulePtr Find(const Node::NodePtr &topology, bool rescaling) {
+    auto search = map_.find({topology, rescaling});
+    if (search == map_.end()) {
+      miss_count_++;
+      return nullptr;
+    }  // else
+    hit_count_++;
+    recency_.splice(recency_.begin(), recency_, search->second);
+    return search->second->second;
+  }
+
+  // Insert a schedule that Find didn't have, evicting the least recently used
+  // schedule if we are full.
+  void Insert(const Node::NodePtr &topology, bool rescaling, SchedulePtr schedule) {
+    Key key = {topology, rescaling};
+    Assert(map_.find(key) == map_.end(), "Schedule is already in the cache.");
+    if (map_.size() == capacity_) {
+      map_.erase(recency_.back().first);
+      recency_.pop_back();
+    }
+    recency_.emplace_front(key, std::move(schedule));
+    map_.emplace(std::move(key), recency_.begin());
+  }
+
+  void Clear() {
+    map_.clear();
+    recency_.clear();
+  }
+
+ private:
+  using Entry = std::pair<Key, SchedulePtr>;
+
+  const size_t capacity_;
+  // The entries, from most to least recently used.
+  std::list<Entry> recency_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHasher> map_;
+  size_t hit_count_ = 0;
+  size_t miss_count_ = 0;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("OperationScheduleCache") {
+  const auto make_schedule = [](const Node::NodePtr &topology) {
+    return std::make_shared<OperationSchedule>(
+        OperationSchedule{BeagleAccessories(0, false, topology), {}, std::nullopt});
+  };
+  const auto ladder = Node::Ladder(4);
+  const auto other_ladder = Node::Ladder(5);
+  OperationScheduleCache cache(2);
+  CHECK_EQ(cache.Find(ladder, false), nullptr);
+  const auto ladder_schedule = make_schedule(ladder);
+  cache.Insert(ladder, false, ladder_schedule);
+  // Lookup is by topology, not by pointer.
+  CHECK_EQ(cache.Find(Node::Ladder(4), false), ladder_schedule);
+  // Rescaling changes the operations.
+  CHECK_EQ(cache.Find(ladder, true), nullptr);
+  cache.Insert(ladder, true, make_schedule(ladder));
+  // Touch the non-rescaling ladder so that the rescaling one gets evicted.
+  CHECK_EQ(cache.Find(ladder, false), ladder_schedule);
+  cache.Insert(other_ladder, false, make_schedule(other_ladder));
+  CHECK_EQ(cache.Size(), 2);
+  CHECK_EQ(cache.Find(ladder, true), nullptr);
+  CHECK_EQ(cache.Find(ladder, false), ladder_schedule);
+  CHECK_NE(cache.Find(other_ladder, false), nullptr);
+  CHECK_EQ(cache.HitCount(), 4);
+  CHECK_EQ(cache.MissCount(), 3);
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.Find(ladder, false), nullptr);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_OPERATION_SCHEDULE_CACHE_HPP_
@@ -0,0 +1,142 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// PackedSymbols stores a sequence of the DNA symbols of SitePattern::GetSymbolTable
+// in three bits per symbol rather than an int: two bits for the base A, C, G or T,
+// and one bit in a side bitmap that marks gaps and ambiguity codes, which all have
+// symbol 4. The bases of marked symbols are zero.
+//
+// The storage is a run of 64-bit words, with the bases 32 to a word followed by the
+// bitmap 64 to a word. The static functions work on such a run of words wherever it
+// lives, so that SitePattern::Compress can keep all of its columns in one buffer.
+// Because unused bits are always zero, two runs of the same size hold the same
+// symbols exactly when their words are equal.
+
+#ifndef SRC_PACKED_SYMBOLS_HPP_
+#define SRC_PACKED_SYMBOLS_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "sugar.hpp"
+
+class PackedSymbols {
+ public:
+  // The symbol of gaps and ambiguity codes.
+  static constexpr int ambiguous_symbol_ = 4;
+
+  PackedSymbols() = default;
+  // A sequence of size A's.
+  explicit PackedSymbols(size_t size) : size_(size), words_(WordCountOf(size)) {}
+
+  static PackedSymbols OfSymbolVector(const SymbolVector &symbols) {
+    PackedSymbols packed(symbols.size());
+    for (size_t idx = 0; idx < symbols.size(); idx++) {
+      packed.Set(idx, symbols[idx]);
+    }
+    return packed;
+  }
+
+  // The size symbols packed in these words, as laid out by Words.
+  static PackedSymbols OfWords(size_t size, const uint64_t *words) {
+    PackedSymbols packed(size);
+    std::copy(words, words + packed.words_.size(), packed.words_.begin());
+    return packed;
+  }
+
+  size_t size() const { return size_; }
+  int operator[](size_t idx) const { return SymbolAt(words_.data(), size_, idx); }
+  bool IsAmbiguous(size_t idx) const {
+    return IsAmbiguousAt(words_.data(), size_, idx);
+  }
+  void Set(size_t idx, int symbol) { SetSymbolAt(words_.data(), size_, idx, symbol); }
+  const std::vector<uint64_t> &Words() const { return words_; }
+
+  // Unpack into symbols, reusing its memory.
+  void Unpack(SymbolVector &symbols) const {
+    symbols.resize(size_);
+    for (size_t idx = 0; idx < size_; idx++) {
+      symbols[idx] = (*this)[idx];
+    }
+  }
+  SymbolVector Unpacked() const {
+    SymbolVector symbols;
+    Unpack(symbols);
+    return symbols;
+  }
+  // The symbols numbered begin, ..., end - 1.
+  PackedSymbols Slice(size_t begin, size_t end) const {
+    Assert(begin <= end && end <= size_, "Invalid packed symbol slice.");
+    PackedSymbols slice(end - begin);
+    for (size_t idx = begin; idx < end; idx++) {
+      slice.Set(idx - begin, (*this)[idx]);
+    }
+    return slice;
+  }
+
+  bool operator==(const PackedSymbols &other) const {
+    return size_ == other.size_ && words_ == other.words_;
+  }
+
+  // The number of words for size symbols.
+  static size_t BaseWordCountOf(size_t size) { return (size + 31) / 32; }
+  static size_t WordCountOf(size_t size) {
+    return BaseWordCountOf(size) + (size + 63) / 64;
+  }
+
+  static bool IsAmbiguousAt(const uint64_t *words, size_t size, size_t idx) {
+    const uint64_t *bitmap = words + BaseWordCountOf(size);
+    return (bitmap[idx / 64] >> (idx % 64)) & 1;
+  }
+  static int SymbolAt(const uint64_t *words, size_t size, size_t idx) {
+    if (IsAmbiguousAt(words, size, idx)) {
+      return ambiguous_symbol_;
+    }  // else
+    return static_cast<int>((words[idx / 32] >> (2 * (idx % 32))) & 3);
+  }
+  static void SetSymbolAt(uint64_t *words, size_t size, size_t idx, int symbol) {
+    Assert(symbol >= 0 && symbol <= ambiguous_symbol_, "Symbol out of range.");
+    uint64_t *bitmap = words + BaseWordCountOf(size);
+    const uint64_t base_shift = 2 * (idx % 32);
+    words[idx / 32] &= ~(uint64_t(3) << base_shift);
+    bitmap[idx / 64] &= ~(uint64_t(1) << (idx % 64));
+    if (symbol == ambiguous_symbol_) {
+      bitmap[idx / 64] |= uint64_t(1) << (idx % 64);
+    } else {
+      words[idx / 32] |= static_cast<uint64_t>(symbol) << base_shift;
+    }
+  }
+
+ private:
+  size_t size_ = 0;
+  std::vector<uint64_t> words_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("PackedSymbols") {
+  // Long enough to use several words of bases and of the bitmap.
+  SymbolVector symbols;
+  for (size_t idx = 0; idx < 150; idx++) {
+    symbols.push_back(static_cast<int>((idx * 7) % 5));
+  }
+  auto packed = PackedSymbols::OfSymbolVector(symbols);
+  CHECK_EQ(packed.size(), symbols.size());
+  CHECK_EQ(packed.Words().size(), 5 + 3);
+  CHECK_EQ(packed.Unpacked(), symbols);
+  CHECK(packed.IsAmbiguous(2));
+  CHECK_FALSE(packed.IsAmbiguous(3));
+  CHECK_EQ(packed.Slice(60, 70).Unpacked(),
+           SymbolVector(symbols.begin() + 60, symbols.begin() + 70));
+  // Overwriting a symbol clears its old bits, so the words are canonical.
+  packed.Set(2, 3);
+  packed.Set(2, 4);
+  CHECK_EQ(packed, PackedSymbols::OfSymbolVector(symbols));
+  packed.Set(3, 4);
+  packed.Set(3, symbols[3]);
+  CHECK_EQ(packed, PackedSymbols::OfSymbolVector(symbols));
+  CHECK_EQ(PackedSymbols(3).Unpacked(), SymbolVector({0, 0, 0}));
+  CHECK_EQ(PackedSymbols::OfWords(packed.size(), packed.Words().data()), packed);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_PACKED_SYMBOLS_HPP_
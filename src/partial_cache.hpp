@@ -0,0 +1,115 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A PartialCache remembers which BEAGLE partial buffers hold the partial likelihood
+// vector for a given subtree, so that trees sharing subtrees can share partials.
+//
+// A subtree is identified by its clade (Node::Leaves()) together with its topology
+// and branch lengths. Rather than storing all of that, we key on the buffers of the
+// two children and the lengths of the branches above them: because each child
+// buffer already stands for an entire subtree with its branch lengths, this key is
+// exact and has constant size. Leaves are represented by their tip buffers.
+//
+// The cached partials are only valid for a fixed phylogenetic model, so the cache
+// needs to be cleared whenever the model parameters change.
+
+#ifndef SRC_PARTIAL_CACHE_HPP_
+#define SRC_PARTIAL_CACHE_HPP_
+
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include "sugar.hpp"
+
+class PartialCache {
+ public:
+  // A child of a node, described by its partial buffer and its branch length.
+  using Child = std::pair<int, double>;
+
+  struct Key {
+    Child first_;
+    Child second_;
+
+    bool operator==(const Key &other) const {
+      return first_ == other.first_ && second_ == other.second_;
+    }
+  };
+
+  struct KeyHasher {
+    size_t operator()(const Key &key) const {
+      size_t hash = std::hash<int>()(key.first_.first);
+      for (const size_t value :
+           {std::hash<double>()(key.first_.second), std::hash<int>()(key.second_.first),
+            std::hash<double>()(key.second_.second)}) {
+        hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+      }
+      return hash;
+    }
+  };
+
+  // The cache hands out the buffers first_buffer, ..., first_buffer + capacity - 1.
+  PartialCache(int first_buffer, size_t capacity)
+      : first_buffer_(first_buffer), capacity_(capacity) {}
+
+  size_t Capacity() const { return capacity_; }
+  size_t Size() const { return map_.size(); }
+  size_t FreeCount() const { return capacity_ - map_.size(); }
+  size_t HitCount() const { return hit_count_; }
+  size_t MissCount() const { return miss_count_; }
+
+  static Key KeyOf(Child child0, Child child1) {
+    // The partials don't depend on the order of the children.
+    if (child1 < child0) {
+      std::swap(child0, child1);
+    }
+    return {child0, child1};
+  }
+
+  // Find the buffer for the given children. If they aren't in the cache, assign them
+  // a fresh buffer. The second component of the return value is true if the buffer
+  // already holds the partials for this key.
+  std::pair<int, bool> FindOrInsert(const Child &child0, const Child &child1) {
+    const auto key = KeyOf(child0, child1);
+    auto search = map_.find(key);
+    if (search != map_.end()) {
+      hit_count_++;
+      return {search->second, true};
+    }  // else
+    Assert(FreeCount() > 0, "PartialCache is full.");
+    miss_count_++;
+    const int buffer = first_buffer_ + static_cast<int>(map_.size());
+    SafeInsert(map_, key, buffer);
+    return {buffer, false};
+  }
+
+  void Clear() { map_.clear(); }
+
+ private:
+  const int first_buffer_;
+  const size_t capacity_;
+  std::unordered_map<Key, int, KeyHasher> map_;
+  size_t hit_count_ = 0;
+  size_t miss_count_ = 0;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("PartialCache") {
+  PartialCache cache(10, 3);
+  CHECK_EQ(cache.FindOrInsert({0, 0.1}, {1, 0.2}), std::make_pair(10, false));
+  // Child order doesn't matter.
+  CHECK_EQ(cache.FindOrInsert({1, 0.2}, {0, 0.1}), std::make_pair(10, true));
+  // Different branch lengths are different keys.
+  CHECK_EQ(cache.FindOrInsert({0, 0.1}, {1, 0.3}), std::make_pair(11, false));
+  // Cached buffers can be children.
+  CHECK_EQ(cache.FindOrInsert({10, 0.5}, {2, 0.2}), std::make_pair(12, false));
+  CHECK_EQ(cache.FreeCount(), 0);
+  CHECK_EQ(cache.HitCount(), 1);
+  CHECK_EQ(cache.MissCount(), 3);
+  CHECK_THROWS(cache.FindOrInsert({3, 0.1}, {4, 0.1}));
+  cache.Clear();
+  CHECK_EQ(cache.FreeCount(), 3);
+  CHECK_EQ(cache.FindOrInsert({3, 0.1}, {4, 0.1}), std::make_pair(10, false));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_PARTIAL_CACHE_HPP_
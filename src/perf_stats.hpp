@@ -0,0 +1,185 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// PerfStats accumulates the time an SBNInstance spends in each of its coarse phases
+// (parsing, building the SBN maps, EM, sampling, making likelihood engines, and
+// likelihood and gradient calls)
+// along with running counts of the trees evaluated and sampled. Where HotPathProfile
+// looks inside a likelihood computation, this looks at a whole run, so it is always
+// on: each phase is one call to the clock per call of an SBNInstance method.
+//
+// If tracing is switched on we also keep every timed call as an event, and
+// WriteChromeTrace writes them in the Chrome trace event format, which chrome://tracing
+// and Perfetto show on a timeline. The events are only for the calls made while
+// tracing, so tracing a long run costs memory in proportion to the number of calls.
+//
+// Like the rest of SBNInstance, this isn't thread safe: the methods of an instance
+// are called from one thread at a time.
+
+#ifndef SRC_PERF_STATS_HPP_
+#define SRC_PERF_STATS_HPP_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sugar.hpp"
+
+class PerfStats {
+ public:
+  using Clock = std::chrono::steady_clock;
+  enum Phase : size_t {
+    Parsing,
+    ProcessLoadedTrees,
+    ExpectationMaximization,
+    Sampling,
+    MakingEngines,
+    LogLikelihoods,
+    Gradients,
+    PhaseCount
+  };
+  struct PhaseCounter {
+    uint64_t nanoseconds_ = 0;
+    uint64_t call_count_ = 0;
+  };
+  // A timed call, in nanoseconds since the PerfStats was made or last reset.
+  struct TraceEvent {
+    Phase phase_;
+    uint64_t start_;
+    uint64_t duration_;
+    size_t thread_id_;
+  };
+
+  // Time the lifetime of a PhaseScope as a call to the given phase.
+  class PhaseScope {
+   public:
+    PhaseScope(PerfStats &stats, Phase phase)
+        : stats_(stats), phase_(phase), start_(Clock::now()) {}
+    ~PhaseScope() { stats_.AddPhase(phase_, start_, Clock::now()); }
+    PhaseScope(const PhaseScope &) = delete;
+    PhaseScope &operator=(const PhaseScope &) = delete;
+
+   private:
+    PerfStats &stats_;
+    const Phase phase_;
+    const Clock::time_point start_;
+  };
+
+  static const std::string &PhaseName(Phase phase) {
+    static const std::array<std::string, PhaseCount> phase_names = {
+        "parsing",         "process_loaded_trees", "expectation_maximization",
+        "sampling",        "making_engines",       "log_likelihoods",
+        "gradients"};
+    return phase_names.at(phase);
+  }
+
+  const PhaseCounter &GetPhaseCounter(Phase phase) const { return phases_.at(phase); }
+  uint64_t GetTreesEvaluated() const { return trees_evaluated_; }
+  uint64_t GetTreesSampled() const { return trees_sampled_; }
+  uint64_t GetEMIterations() const { return em_iterations_; }
+  const std::vector<TraceEvent> &GetTraceEvents() const { return trace_events_; }
+
+  void AddPhase(Phase phase, Clock::time_point start, Clock::time_point end) {
+    auto &counter = phases_.at(phase);
+    const uint64_t duration = NanosecondsBetween(start, end);
+    counter.nanoseconds_ += duration;
+    counter.call_count_++;
+    if (tracing_) {
+      const size_t thread_id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+      trace_events_.push_back(
+          {phase, NanosecondsBetween(origin_, start), duration, thread_id});
+    }
+  }
+  void AddTreesEvaluated(size_t count) { trees_evaluated_ += count; }
+  void AddTreesSampled(size_t count) { trees_sampled_ += count; }
+  void AddEMIterations(size_t count) { em_iterations_ += count; }
+
+  bool IsTracing() const { return tracing_; }
+  void SetTracing(bool tracing) { tracing_ = tracing; }
+
+  void Reset() {
+    phases_.fill(PhaseCounter());
+    trees_evaluated_ = 0;
+    trees_sampled_ = 0;
+    em_iterations_ = 0;
+    trace_events_.clear();
+    origin_ = Clock::now();
+  }
+
+  // Write the trace events as "complete" events of the Chrome trace event format,
+  // which counts time in microseconds.
+  void WriteChromeTrace(std::ostream &os) const {
+    os << "{\"traceEvents\": [";
+    std::string separator = "\n";
+    for (const auto &event : trace_events_) {
+      os << separator << "{\"name\": \"" << PhaseName(event.phase_)
+         << "\", \"cat\": \"libsbn\", \"ph\": \"X\", \"ts\": "
+         << static_cast<double>(event.start_) / 1000.
+         << ", \"dur\": " << static_cast<double>(event.duration_) / 1000.
+         << ", \"pid\": 1, \"tid\": " << event.thread_id_ << "}";
+      separator = ",\n";
+    }
+    os << "\n], \"displayTimeUnit\": \"ms\"}\n";
+  }
+  void WriteChromeTrace(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out) {
+      Failwith("Couldn't open " + path + " to write a trace.");
+    }
+    WriteChromeTrace(out);
+  }
+
+ private:
+  std::array<PhaseCounter, PhaseCount> phases_;
+  uint64_t trees_evaluated_ = 0;
+  uint64_t trees_sampled_ = 0;
+  uint64_t em_iterations_ = 0;
+  bool tracing_ = false;
+  Clock::time_point origin_ = Clock::now();
+  std::vector<TraceEvent> trace_events_;
+
+  static uint64_t NanosecondsBetween(Clock::time_point start, Clock::time_point end) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  }
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("PerfStats") {
+  PerfStats stats;
+  { PerfStats::PhaseScope scope(stats, PerfStats::Sampling); }
+  const auto start = PerfStats::Clock::now();
+  stats.AddPhase(PerfStats::Sampling, start, start + std::chrono::nanoseconds(2500));
+  stats.AddTreesSampled(10);
+  CHECK_EQ(stats.GetPhaseCounter(PerfStats::Sampling).call_count_, 2);
+  CHECK_GE(stats.GetPhaseCounter(PerfStats::Sampling).nanoseconds_, 2500);
+  CHECK_EQ(stats.GetPhaseCounter(PerfStats::Parsing).call_count_, 0);
+  CHECK_EQ(stats.GetTreesSampled(), 10);
+  CHECK_EQ(PerfStats::PhaseName(PerfStats::ExpectationMaximization),
+           "expectation_maximization");
+  // Without tracing, no events are kept.
+  CHECK(stats.GetTraceEvents().empty());
+  stats.SetTracing(true);
+  stats.AddPhase(PerfStats::Gradients, start, start + std::chrono::nanoseconds(2500));
+  REQUIRE_EQ(stats.GetTraceEvents().size(), 1);
+  CHECK_EQ(stats.GetTraceEvents()[0].phase_, PerfStats::Gradients);
+  CHECK_EQ(stats.GetTraceEvents()[0].duration_, 2500);
+  std::stringstream trace;
+  stats.WriteChromeTrace(trace);
+  CHECK_NE(trace.str().find("\"name\": \"gradients\""), std::string::npos);
+  CHECK_NE(trace.str().find("\"dur\": 2.5"), std::string::npos);
+  stats.Reset();
+  CHECK_EQ(stats.GetPhaseCounter(PerfStats::Sampling).call_count_, 0);
+  CHECK_EQ(stats.GetTreesSampled(), 0);
+  CHECK(stats.GetTraceEvents().empty());
+  // Reset doesn't switch tracing off.
+  CHECK(stats.IsTracing());
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_PERF_STATS_HPP_
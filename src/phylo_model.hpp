@@ -14,6 +14,11 @@ struct PhyloModelSpecification {
   std::string substitution_;
   std::string site_;
   std::string clock_;
+
+  bool operator==(const PhyloModelSpecification &other) const {
+    return substitution_ == other.substitution_ && site_ == other.site_ &&
+           clock_ == other.clock_;
+  }
 };
 
 class PhyloModel : public BlockModel {
@@ -3,7 +3,9 @@
 
 #include "psp_indexer.hpp"
 #include <algorithm>
+#include <numeric>
 #include "sugar.hpp"
+#include "task_processor.hpp"
 
 PSPIndexer::PSPIndexer(BitsetVector rootsplits, BitsetSizeMap in_indexer) {
   size_t index = 0;
@@ -88,6 +90,22 @@ SizeVectorVector PSPIndexer::RepresentationOf(const Node::NodePtr& topology) con
   return {rootsplit_result, psp_result_down, psp_result_up};
 }
 
+SizeVector PSPIndexer::SplitIndicesOf(const Node::NodePtr& topology) const {
+  Assert(first_empty_index_ > 0, "This PSPIndexer is uninitialized.");
+  SizeVector result(topology->Id(), first_empty_index_);
+  Bitset rootsplit_bitset(topology->LeafCount());
+  const Node* root = topology.get();
+  topology->PreOrder([&](const Node* node) {
+    if (node != root) {
+      rootsplit_bitset.Zero();
+      rootsplit_bitset.CopyFrom(node->Leaves(), 0, false);
+      rootsplit_bitset.Minorize();
+      result[node->Id()] = indexer_.at(rootsplit_bitset);
+    }
+  });
+  return result;
+}
+
 StringVectorVector PSPIndexer::StringRepresentationOf(
     const Node::NodePtr& topology) const {
   StringVector reversed_indexer = ToStringVector();
@@ -109,8 +127,7 @@ DoubleVectorVector PSPIndexer::SplitLengths(
   auto tree_count = tree_collection.TreeCount();
   for (size_t tree_index = 0; tree_index < tree_count; tree_index++) {
     const auto& tree = tree_collection.GetTree(tree_index);
-    // The 0th part of the PSP representation is the rootsplit vector.
-    auto split_indices = RepresentationOf(tree.Topology())[0];
+    const auto split_indices = SplitIndicesOf(tree.Topology());
     const auto branch_lengths = tree.BranchLengths();
     for (size_t edge_index = 0; edge_index < split_indices.size(); edge_index++) {
       result[split_indices[edge_index]].push_back(branch_lengths[edge_index]);
@@ -118,3 +135,70 @@ DoubleVectorVector PSPIndexer::SplitLengths(
   }
   return result;
 }
+
+FlatSplitLengths PSPIndexer::MakeFlatSplitLengths(
+    const UnrootedTreeCollection& tree_collection, size_t thread_count) const {
+  const size_t tree_count = tree_collection.TreeCount();
+  // The trees are split into contiguous chunks, one per thread. The first pass finds
+  // the split indices of each tree and counts the splits of each chunk. From the
+  // counts we know where each chunk's lengths go among the lengths of each split, so
+  // in the second pass the chunks fill their parts of the buffer independently, and
+  // the lengths end up in tree order whatever the thread count.
+  const size_t chunk_count = std::max<size_t>(1, std::min(thread_count, tree_count));
+  std::vector<SizeVectorVector> chunk_split_indices(chunk_count);
+  SizeVectorVector chunk_positions(chunk_count, SizeVector(after_rootsplits_index_));
+  const auto chunk_begin = [tree_count, chunk_count](size_t chunk_idx) {
+    return chunk_idx * tree_count / chunk_count;
+  };
+  const auto count_chunk = [&](size_t chunk_idx) {
+    auto& split_indices = chunk_split_indices[chunk_idx];
+    auto& counts = chunk_positions[chunk_idx];
+    const size_t end = chunk_begin(chunk_idx + 1);
+    for (size_t tree_idx = chunk_begin(chunk_idx); tree_idx < end; tree_idx++) {
+      const auto& tree = tree_collection.GetTree(tree_idx);
+      split_indices.push_back(SplitIndicesOf(tree.Topology()));
+      for (const auto split_idx : split_indices.back()) {
+        counts[split_idx]++;
+      }
+    }
+  };
+  FlatSplitLengths result;
+  const auto fill_chunk = [&](size_t chunk_idx) {
+    auto& positions = chunk_positions[chunk_idx];
+    const size_t begin = chunk_begin(chunk_idx);
+    for (size_t tree_idx = begin; tree_idx < chunk_begin(chunk_idx + 1); tree_idx++) {
+      const auto& split_indices = chunk_split_indices[chunk_idx][tree_idx - begin];
+      const auto& branch_lengths = tree_collection.GetTree(tree_idx).branch_lengths_;
+      for (size_t edge_idx = 0; edge_idx < split_indices.size(); edge_idx++) {
+        const size_t position = positions[split_indices[edge_idx]]++;
+        result.lengths_[position] = branch_lengths[edge_idx];
+      }
+    }
+  };
+  const auto run_chunks = [chunk_count](const std::function<void(size_t)>& f) {
+    if (chunk_count > 1) {
+      SizeVector thread_indices(chunk_count);
+      std::iota(thread_indices.begin(), thread_indices.end(), 0);
+      WorkStealingPool<size_t> thread_pool(thread_indices);
+      thread_pool.Run(chunk_count, [&f](size_t, size_t chunk_idx) { f(chunk_idx); });
+    } else {
+      f(0);
+    }
+  };
+  run_chunks(count_chunk);
+  // Turn the counts into the position of each chunk's first length for each split.
+  result.offsets_.resize(after_rootsplits_index_ + 1);
+  size_t position = 0;
+  for (size_t split_idx = 0; split_idx < after_rootsplits_index_; split_idx++) {
+    result.offsets_[split_idx] = position;
+    for (auto& positions : chunk_positions) {
+      const size_t count = positions[split_idx];
+      positions[split_idx] = position;
+      position += count;
+    }
+  }
+  result.offsets_[after_rootsplits_index_] = position;
+  result.lengths_.resize(position);
+  run_chunks(fill_chunk);
+  return result;
+}
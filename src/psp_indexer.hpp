@@ -22,6 +22,14 @@
 #include "sugar.hpp"
 #include "unrooted_tree_collection.hpp"
 
+// The branch lengths of each split over a tree collection, packed as in CSR
+// storage: the lengths of split i are lengths_[offsets_[i]], ...,
+// lengths_[offsets_[i + 1] - 1], in the order of the trees.
+struct FlatSplitLengths {
+  SizeVector offsets_;
+  std::vector<double> lengths_;
+};
+
 class PSPIndexer {
  public:
   PSPIndexer() : after_rootsplits_index_(0), first_empty_index_(0) {}
@@ -52,6 +60,9 @@ class PSPIndexer {
 
   // Get the PSP representation of a given topology.
   SizeVectorVector RepresentationOf(const Node::NodePtr& topology) const;
+  // Get the index of the split of each edge of a topology, which is the rootsplit
+  // part of the PSP representation, without building the rest of it.
+  SizeVector SplitIndicesOf(const Node::NodePtr& topology) const;
   // Get the string version of the representation.
   // Inefficiently implemented, so for testing only.
   StringVectorVector StringRepresentationOf(const Node::NodePtr& topology) const;
@@ -59,6 +70,10 @@ class PSPIndexer {
   // Return a ragged vector of vectors such that the ith vector is the
   // collection of branch lengths in the tree collection for the ith split.
   DoubleVectorVector SplitLengths(const UnrootedTreeCollection& tree_collection) const;
+  // The same thing packed into a FlatSplitLengths, splitting the trees between
+  // thread_count threads.
+  FlatSplitLengths MakeFlatSplitLengths(const UnrootedTreeCollection& tree_collection,
+                                        size_t thread_count = 1) const;
 
  private:
   BitsetSizeMap indexer_;
@@ -2,12 +2,17 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include <pybind11/eigen.h>
+#include <pybind11/functional.h>
 #include <pybind11/iostream.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <chrono>
+#include <future>
 #include <string>
+#include "beagle_flag_names.hpp"
 #include "rooted_sbn_instance.hpp"
+#include "stochastic_optimizer.hpp"
 #include "unrooted_sbn_instance.hpp"
 
 namespace py = pybind11;
@@ -21,6 +26,23 @@ void def_read_write_mutable(PyClass &cls, const char *name, D C::*pm) {
                    [pm](C &self, const D &value) { self.*pm = value; });
 }
 
+// Expose a future that is returned by one of the submit_* methods. Waiting for the
+// result releases the GIL so that other Python threads can run in the meantime.
+template <typename T>
+void def_future(py::module &m, const char *name) {
+  py::class_<std::shared_future<T>>(m, name, "The future result of a computation.")
+      .def(
+          "done",
+          [](const std::shared_future<T> &future) {
+            return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+          },
+          "Return True if the result is available.")
+      .def(
+          "result", [](const std::shared_future<T> &future) { return future.get(); },
+          "Wait for the computation to finish and return its result.",
+          py::call_guard<py::gil_scoped_release>());
+}
+
 // In order to make vector<double>s available to numpy, we take two steps.
 // First, we make them opaque to pybind11, so that it doesn't do its default
 // conversion of STL types.
@@ -43,6 +65,54 @@ PYBIND11_MODULE(libsbn, m) {
                                {sizeof(double)});  // Stride
       });
 
+  // CLASS
+  // CSRRepresentation
+  // The arrays are views into the representation, which they keep alive.
+  py::class_<CSRRepresentation>(m, "CSRRepresentation", R"raw(
+  Per-tree representations packed in compressed sparse row form.
+
+  The rows of tree ``i`` are ``tree_offsets[i]:tree_offsets[i + 1]``, and the
+  indices of row ``j`` are ``indices[row_offsets[j]:row_offsets[j + 1]]``. These
+  are NumPy arrays that share memory with the representation.
+  )raw")
+      .def("tree_count", &CSRRepresentation::TreeCount)
+      .def_property_readonly(
+          "tree_offsets",
+          [](py::object self) {
+            const auto &offsets = self.cast<const CSRRepresentation &>().TreeOffsets();
+            return py::array_t<size_t>(offsets.size(), offsets.data(), self);
+          })
+      .def_property_readonly(
+          "row_offsets",
+          [](py::object self) {
+            const auto &offsets = self.cast<const CSRRepresentation &>().RowOffsets();
+            return py::array_t<size_t>(offsets.size(), offsets.data(), self);
+          })
+      .def_property_readonly("indices", [](py::object self) {
+        const auto &indices = self.cast<const CSRRepresentation &>().Indices();
+        return py::array_t<CSRRepresentation::Index>(indices.size(), indices.data(),
+                                                     self);
+      });
+
+  // CLASS
+  // FlatSplitLengths
+  py::class_<FlatSplitLengths>(m, "FlatSplitLengths", R"raw(
+  The branch lengths of each split, packed in compressed sparse row form.
+
+  The lengths of split ``i`` are ``lengths[offsets[i]:offsets[i + 1]]``, in tree
+  order. These are NumPy arrays that share memory with the FlatSplitLengths.
+  )raw")
+      .def_property_readonly(
+          "offsets",
+          [](py::object self) {
+            const auto &offsets = self.cast<const FlatSplitLengths &>().offsets_;
+            return py::array_t<size_t>(offsets.size(), offsets.data(), self);
+          })
+      .def_property_readonly("lengths", [](py::object self) {
+        const auto &lengths = self.cast<const FlatSplitLengths &>().lengths_;
+        return py::array_t<double>(lengths.size(), lengths.data(), self);
+      });
+
   // CLASS
   // RootedTree
   py::class_<RootedTree>(m, "RootedTree", "A rooted tree with branch lengths.",
@@ -69,8 +139,51 @@ PYBIND11_MODULE(libsbn, m) {
       .def("drop_first", &RootedTreeCollection::DropFirst,
            "Drop the first ``fraction`` trees from the tree collection.",
            py::arg("fraction"))
+      .def(
+          "intern_topologies",
+          [](RootedTreeCollection &self) { return self.InternTopologies(); },
+          "Make trees with equal topologies share one topology, and return the "
+          "topology id of each tree.")
       .def("newick", &RootedTreeCollection::Newick,
-           "Get the current set of trees as a big Newick string.")
+           "Get the current set of trees as a big Newick string. Branch lengths get "
+           "``precision`` significant digits, or as many as they need to read back "
+           "exactly if ``precision`` is None.",
+           py::arg("thread_count") = 1, py::arg("precision") = 6)
+      .def("branch_length_matrix", &RootedTreeCollection::BranchLengthMatrix,
+           "Get the branch lengths of all of the trees as a trees x nodes array, with "
+           "a row per tree indexed as its ``branch_lengths``.")
+      .def("set_branch_lengths", &RootedTreeCollection::SetBranchLengths,
+           "Set the branch lengths of all of the trees from an array as "
+           "``branch_length_matrix`` gives it.",
+           py::arg("branch_length_matrix"))
+      .def("write_newick_file", &RootedTreeCollection::WriteNewickFile,
+           "Write the current set of trees to a Newick file, as for ``newick``.",
+           py::arg("path"), py::arg("thread_count") = 1, py::arg("precision") = 6)
+      .def("height_ratios", &RootedTreeCollection::HeightRatios,
+           "Get the height ratios and root heights of the trees, with a row per tree.")
+      .def("set_height_ratios", &RootedTreeCollection::SetHeightRatios,
+           R"raw(
+           Set the height ratios and root heights of the trees from a matrix with a row
+           per tree, updating their node heights and branch lengths.
+           )raw",
+           py::arg("height_ratios"), py::arg("thread_count") = 1,
+           py::call_guard<py::gil_scoped_release>())
+      .def("ratio_gradients_into", &RootedTreeCollection::RatioGradients,
+           R"raw(
+           Given branch gradients as from ``branch_gradients_into``, write the gradients
+           with respect to the height ratios and root heights into ``ratio_gradients``,
+           a C-contiguous float64 matrix with a row per tree.
+           )raw",
+           py::arg("branch_gradients"), py::arg("ratio_gradients"),
+           py::arg("thread_count") = 1, py::call_guard<py::gil_scoped_release>())
+      .def("clock_gradients_into", &RootedTreeCollection::ClockGradients,
+           R"raw(
+           Given branch gradients as from ``branch_gradients_into``, write the gradients
+           with respect to the clock rates into ``clock_gradients``, a C-contiguous
+           float64 matrix with a row per tree.
+           )raw",
+           py::arg("branch_gradients"), py::arg("clock_gradients"),
+           py::arg("thread_count") = 1, py::call_guard<py::gil_scoped_release>())
       .def_readwrite("trees", &RootedTreeCollection::trees_);
 
   // CLASS
@@ -83,6 +196,12 @@ PYBIND11_MODULE(libsbn, m) {
       .def_readonly("clock_model", &RootedTreeGradient::clock_model_)
       .def_readonly("ratios_root_height", &RootedTreeGradient::ratios_root_height_);
 
+  // CLASS
+  // Futures for the submit_* methods of the instances.
+  def_future<std::vector<double>>(m, "log_likelihoods_future");
+  def_future<std::vector<RootedTreeGradient>>(m, "rooted_gradients_future");
+  def_future<std::vector<UnrootedTreeGradient>>(m, "unrooted_gradients_future");
+
   // CLASS
   // UnrootedTree
   py::class_<UnrootedTree>(m, "UnrootedTree", "An unrooted tree with branch lengths.",
@@ -110,15 +229,79 @@ PYBIND11_MODULE(libsbn, m) {
       .def("drop_first", &UnrootedTreeCollection::DropFirst,
            "Drop the first ``fraction`` trees from the tree collection.",
            py::arg("fraction"))
+      .def(
+          "intern_topologies",
+          [](UnrootedTreeCollection &self) { return self.InternTopologies(); },
+          "Make trees with equal topologies share one topology, and return the "
+          "topology id of each tree.")
       .def("newick", &UnrootedTreeCollection::Newick,
-           "Get the current set of trees as a big Newick string.")
+           "Get the current set of trees as a big Newick string. Branch lengths get "
+           "``precision`` significant digits, or as many as they need to read back "
+           "exactly if ``precision`` is None.",
+           py::arg("thread_count") = 1, py::arg("precision") = 6)
+      .def("branch_length_matrix", &UnrootedTreeCollection::BranchLengthMatrix,
+           "Get the branch lengths of all of the trees as a trees x nodes array, with "
+           "a row per tree indexed as its ``branch_lengths``.")
+      .def("set_branch_lengths", &UnrootedTreeCollection::SetBranchLengths,
+           "Set the branch lengths of all of the trees from an array as "
+           "``branch_length_matrix`` gives it.",
+           py::arg("branch_length_matrix"))
+      .def("write_newick_file", &UnrootedTreeCollection::WriteNewickFile,
+           "Write the current set of trees to a Newick file, as for ``newick``.",
+           py::arg("path"), py::arg("thread_count") = 1, py::arg("precision") = 6)
       .def_readwrite("trees", &UnrootedTreeCollection::trees_);
 
+  // CLASS
+  // TreeFileStream
+  py::class_<TreeFileStream>(m, "TreeFileStream", R"raw(
+  Read a Newick or Nexus file of unrooted trees in batches.
+
+  Iterating gives an UnrootedTreeCollection for each batch of at most ``batch_size``
+  trees, so only one batch is in memory at a time. The first ``burn_in_fraction`` of
+  the trees are dropped, and then one tree in every ``thinning`` is kept. The trees
+  that are dropped aren't parsed.
+  )raw")
+      .def(py::init<const std::string &, bool, size_t, double, size_t, size_t>(),
+           py::arg("fname"), py::arg("is_nexus"), py::arg("batch_size"),
+           py::arg("burn_in_fraction") = 0., py::arg("thinning") = 1,
+           py::arg("thread_count") = 1)
+      .def("burn_in_count", &TreeFileStream::BurnInCount,
+           "The number of trees that are dropped as burn-in.")
+      .def(
+          "__iter__", [](TreeFileStream &self) -> TreeFileStream & { return self; },
+          py::return_value_policy::reference_internal)
+      .def("__next__", [](TreeFileStream &self) {
+        auto batch = self.NextBatch();
+        if (!batch.has_value()) {
+          throw py::stop_iteration();
+        }
+        return UnrootedTreeCollection::OfTreeCollection(*batch);
+      });
+
   // CLASS
   // PSPIndexer
   py::class_<PSPIndexer>(m, "PSPIndexer", "The primary split pair indexer.")
       .def("details", &PSPIndexer::Details);
 
+  // ENUM
+  // SitePatternOrder
+  py::enum_<SitePatternOrder>(m, "site_pattern_order",
+                              "The order of the compressed site patterns.")
+      .value("FIRST_APPEARANCE", SitePatternOrder::FirstAppearance,
+             "The order in which the patterns first appear in the alignment")
+      .value("LEXICOGRAPHIC", SitePatternOrder::Lexicographic,
+             "Lexicographic order, comparing taxa in taxon number order")
+      .value("BY_CLASS", SitePatternOrder::ByClass,
+             "Constant patterns first, then by the number of distinct states and of "
+             "ambiguous symbols");
+  // ThreadPinning
+  py::enum_<ThreadPinning>(m, "thread_pinning",
+                           "How the likelihood threads are placed on the machine.")
+      .value("NONE", ThreadPinning::None, "Leave it to the operating system")
+      .value("CORE", ThreadPinning::Core, "Pin each thread to its own core")
+      .value("NUMA_NODE", ThreadPinning::NumaNode,
+             "Split the threads between the NUMA nodes, keeping each on its node");
+
   // CLASS
   // PhyloModelSpecification
   py::class_<PhyloModelSpecification>(m, "PhyloModelSpecification",
@@ -131,6 +314,96 @@ PYBIND11_MODULE(libsbn, m) {
       .def(py::init<const std::string &, const std::string &, const std::string &>(),
            py::arg("substitution"), py::arg("site"), py::arg("clock"));
 
+  // CLASS
+  // TreeScoreBatch
+  py::class_<TreeScoreBatch>(m, "TreeScoreBatch",
+                             "The scores of a batch of trees from ``score_tree_file``.")
+      .def_readonly("first_tree_index", &TreeScoreBatch::first_tree_idx_)
+      .def_readonly("log_likelihoods", &TreeScoreBatch::log_likelihoods_)
+      .def_readonly("gradients", &TreeScoreBatch::gradients_);
+
+  // CLASS
+  // MarginalLikelihoodEstimate
+  py::class_<MarginalLikelihoodEstimate>(
+      m, "MarginalLikelihoodEstimate",
+      "Importance sampling estimates from ``estimate_marginal_likelihood``.")
+      .def_readonly("particle_count", &MarginalLikelihoodEstimate::particle_count_)
+      .def_readonly("log_marginal_likelihood",
+                    &MarginalLikelihoodEstimate::log_marginal_likelihood_)
+      .def_readonly("log_marginal_likelihood_standard_error",
+                    &MarginalLikelihoodEstimate::log_marginal_likelihood_standard_error_)
+      .def_readonly("elbo", &MarginalLikelihoodEstimate::elbo_)
+      .def_readonly("elbo_standard_error",
+                    &MarginalLikelihoodEstimate::elbo_standard_error_)
+      .def_readonly("effective_sample_size",
+                    &MarginalLikelihoodEstimate::effective_sample_size_);
+
+  // CLASS
+  // VariationalStepResult
+  py::class_<VariationalStepResult>(m, "VariationalStepResult",
+                                    "The result of a variational step.")
+      .def_readonly("elbo", &VariationalStepResult::elbo_)
+      .def_readonly("log_likelihoods", &VariationalStepResult::log_likelihoods_)
+      .def_readonly("log_f", &VariationalStepResult::log_f_)
+      .def_readonly("scalar_gradient", &VariationalStepResult::scalar_gradient_)
+      .def_readonly("sbn_gradient", &VariationalStepResult::sbn_gradient_);
+
+  // CLASS
+  // StochasticOptimizer
+  py::class_<StochasticOptimizer>(m, "StochasticOptimizer", R"raw(
+    Gradient ascent with the methods of vip.sgd_server.SGD_Server.
+
+    Steps update float64 NumPy arrays in place, keeping the moment estimates of each
+    named variable on the C++ side.
+      )raw")
+      .def(py::init([](const std::string &method, double beta_0, double beta_1,
+                       double beta_1_ams, double gamma, double epsilon, double decay,
+                       double momentum) {
+             return StochasticOptimizer(
+                 StochasticOptimizer::MethodOfName(method),
+                 {beta_0, beta_1, beta_1_ams, gamma, epsilon, decay, momentum});
+           }),
+           "Make an optimizer using one of sgd, adam, amsgrad, rmsprop, adagrad or "
+           "adadelta.",
+           py::arg("method"), py::arg("beta_0") = 0.9, py::arg("beta_1") = 0.999,
+           py::arg("beta_1_ams") = 0.99, py::arg("gamma") = 0.9,
+           py::arg("epsilon") = 1e-8, py::arg("decay") = 0.,
+           py::arg("momentum") = 0.9)
+      .def("step_vector", &StochasticOptimizer::StepVector,
+           "Take a step on the named vector variable, in place.", py::arg("name"),
+           py::arg("step_size"), py::arg("parameters"), py::arg("gradient"))
+      .def("step_matrix", &StochasticOptimizer::StepMatrix,
+           R"raw(
+           Take a step on the named matrix variable, in place. The parameters can be a
+           block of ``get_phylo_model_param_block_map``.
+           )raw",
+           py::arg("name"), py::arg("step_size"), py::arg("parameters"),
+           py::arg("gradient"))
+      .def("step_count", &StochasticOptimizer::StepCount,
+           "The number of steps taken on the named variable.", py::arg("name"))
+      .def("reset", py::overload_cast<>(&StochasticOptimizer::Reset),
+           "Forget the state of all of the variables.");
+
+  // CLASS
+  // BeagleConfigurationTiming
+  py::class_<BeagleConfigurationTiming>(
+      m, "BeagleConfigurationTiming", "The result of auto-tuning a BEAGLE configuration.")
+      .def_property_readonly("beagle_flags",
+                             [](const BeagleConfigurationTiming &timing) {
+                               return timing.configuration_.beagle_flag_vector_;
+                             })
+      .def_property_readonly("use_tip_states",
+                             [](const BeagleConfigurationTiming &timing) {
+                               return timing.configuration_.use_tip_states_;
+                             })
+      .def_property_readonly("obtained_beagle_flags",
+                             [](const BeagleConfigurationTiming &timing) {
+                               return BeagleFlagNames::OfBeagleFlags(
+                                   timing.beagle_flags_);
+                             })
+      .def_readonly("seconds_per_evaluation",
+                    &BeagleConfigurationTiming::seconds_per_evaluation_);
+
   // CLASS
   // SBNInstance
   // So, we'd like to have functionality be shared here between RootedSBNInstance and
@@ -161,15 +434,188 @@ PYBIND11_MODULE(libsbn, m) {
             parameter matrices, and it's up to the user to set those model parameters after calling
             this function.
             Note that this tree count need not be the same as the number of threads (and is typically bigger).
+
+            ``partial_cache_capacity`` is the number of subtree partial likelihood vectors that each
+            thread keeps around so that trees sharing subtrees (with the same branch lengths) can
+            share their computation. The default of 0 turns this cache off. It is not used when
+            rescaling is on.
+
+            ``tree_batch_size`` is the number of trees for which each thread hands the likelihood
+            computation to BEAGLE at once. Values above 1 reduce the per-tree overhead of calling
+            BEAGLE, which matters most on GPUs. Gradients are still computed one tree at a time.
+
+            If ``shard_site_patterns`` is true, each thread gets a contiguous block of the site
+            patterns and works on every tree, rather than each thread working on a subset of the
+            trees. This helps when there are few trees and many site patterns.
+
+            ``operation_schedule_cache_capacity`` is the number of recently seen topologies for which
+            each thread remembers the BEAGLE operations, so that repeated topologies (as from SBN
+            sampling or MCMC output) skip building them. The default of 0 turns this off.
+
+            ``site_pattern_order`` is the order of the compressed site patterns: the order in which
+            they first appear in the alignment, lexicographic, or grouped by class, with constant
+            patterns first.
+
+            If ``host_transition_matrices`` is true, each thread computes the transition matrices
+            for all of the edges and rate categories of a tree in one vectorized pass and uploads
+            them to BEAGLE, rather than having BEAGLE compute them edge by edge.
+
+            ``thread_pinning`` pins each thread to a core, or to the cores of a NUMA node, and
+            then has it make its BEAGLE instance, so that its buffers are allocated on its own
+            node. This is only available on Linux.
+
+            If ``max_memory`` is given in bytes and ``estimate_phylo_likelihood_bytes`` says that
+            the engine won't fit in it, we switch to tip states, then use fewer threads, and then
+            ask BEAGLE for single precision until it does. If it still doesn't fit, we raise an
+            exception before allocating anything.
+
+            If ``single_precision`` is true, we ask BEAGLE for single precision, which is faster,
+            most of all on GPUs, and always rescale. If ``single_precision_tolerance`` is also
+            given, we compare the log likelihoods of a sample of the loaded trees with the current
+            model parameters against double precision on the CPU, and switch back to double
+            precision if they differ by more than the tolerance.
+
+            Calling this again keeps the BEAGLE instances if all that changes is
+            ``tree_count_option``, or the model for one with the same numbers of states and rate
+            categories.
            )raw",
            py::arg("model_specification"), py::arg("thread_count"),
            py::arg("beagle_flags") = std::vector<BeagleFlags>(),
            py::arg("use_tip_states") = true,
-           py::arg("tree_count_option") = std::nullopt)
+           py::arg("tree_count_option") = std::nullopt,
+           py::arg("partial_cache_capacity") = 0, py::arg("tree_batch_size") = 1,
+           py::arg("shard_site_patterns") = false,
+           py::arg("operation_schedule_cache_capacity") = 0,
+           py::arg("site_pattern_order") = SitePatternOrder::FirstAppearance,
+           py::arg("host_transition_matrices") = false,
+           py::arg("thread_pinning") = ThreadPinning::None,
+           py::arg("max_memory") = std::nullopt, py::arg("single_precision") = false,
+           py::arg("single_precision_tolerance") = std::nullopt)
+      .def("estimate_phylo_likelihood_bytes",
+           &SBNInstance::EstimatePhyloLikelihoodByteCounts,
+           R"raw(
+            Estimate the bytes that ``prepare_for_phylo_likelihood`` with these arguments would
+            allocate.
+
+            The result is a dictionary with the ``beagle_buffers`` of all of the threads, the
+            compressed ``site_patterns`` and the ``phylo_model_params``. BEAGLE buffers are
+            assumed to be in double precision unless ``beagle_flags`` asks for single precision.
+           )raw",
+           py::arg("model_specification"), py::arg("thread_count"),
+           py::arg("beagle_flags") = std::vector<BeagleFlags>(),
+           py::arg("use_tip_states") = true,
+           py::arg("tree_count_option") = std::nullopt,
+           py::arg("partial_cache_capacity") = 0, py::arg("tree_batch_size") = 1,
+           py::arg("shard_site_patterns") = false)
+      .def("auto_tune_phylo_likelihood", &SBNInstance::AutoTunePhyloLikelihood,
+           R"raw(
+            Time each candidate BEAGLE configuration on the loaded alignment, then prepare for
+            phylogenetic likelihood computation with the fastest one.
+
+            The candidates are no vectorization, SSE, AVX, CUDA and OpenCL, each with and without
+            tip states. Those that BEAGLE can't provide are skipped. Each is timed on
+            ``evaluation_count`` likelihood evaluations of a ladder tree. The measurements are
+            printed and returned, fastest first. ``thread_count`` and ``tree_count_option`` are as
+            for ``prepare_for_phylo_likelihood``.
+           )raw",
+           py::arg("model_specification"), py::arg("thread_count"),
+           py::arg("tree_count_option") = std::nullopt, py::arg("evaluation_count") = 10)
       .def("resize_phylo_model_params", &UnrootedSBNInstance::ResizePhyloModelParams,
            "Resize phylo_model_params.", py::arg("tree_count_option") = std::nullopt)
+      .def("set_profiling", &SBNInstance::SetProfiling,
+           "Switch on or off the timing of the phases of likelihood computation.",
+           py::arg("profiling"))
+      .def("reset_profile", &SBNInstance::ResetProfile,
+           "Zero the timings gathered while profiling.")
+      .def(
+          "profile",
+          [](const SBNInstance &self) {
+            const auto profile = self.GetProfile();
+            py::dict result;
+            for (size_t phase = 0; phase < HotPathProfile::PhaseCount; phase++) {
+              const auto &counter =
+                  profile.GetPhaseCounter(static_cast<HotPathProfile::Phase>(phase));
+              py::dict phase_result;
+              phase_result["nanoseconds"] = counter.nanoseconds_;
+              phase_result["call_count"] = counter.call_count_;
+              result[py::str(HotPathProfile::PhaseName(
+                  static_cast<HotPathProfile::Phase>(phase)))] = phase_result;
+            }
+            result["queue_wait_histogram"] = profile.GetQueueWaitHistogram();
+            return result;
+          },
+          R"raw(
+           Return the timings gathered while profiling.
+
+           For each phase of likelihood computation there is a dictionary of the total
+           ``nanoseconds`` spent in it and its ``call_count``. Entry i of the
+           ``queue_wait_histogram`` is the number of units of work (trees, batches of trees,
+           or site pattern blocks) that waited between 2^i and 2^(i+1) nanoseconds for a
+           thread to pick them up.
+          )raw")
+      .def(
+          "perf_stats",
+          [](const SBNInstance &self) {
+            const PerfStats &stats = self.GetPerfStats();
+            py::dict seconds;
+            py::dict calls;
+            for (size_t phase_idx = 0; phase_idx < PerfStats::PhaseCount; phase_idx++) {
+              const auto phase = static_cast<PerfStats::Phase>(phase_idx);
+              const auto &counter = stats.GetPhaseCounter(phase);
+              const py::str name(PerfStats::PhaseName(phase));
+              seconds[name] = static_cast<double>(counter.nanoseconds_) * 1e-9;
+              calls[name] = counter.call_count_;
+            }
+            py::dict result;
+            result["seconds"] = seconds;
+            result["calls"] = calls;
+            result["bytes"] = self.MemoryByteCounts();
+            result["trees_evaluated"] = stats.GetTreesEvaluated();
+            result["trees_sampled"] = stats.GetTreesSampled();
+            result["em_iterations"] = stats.GetEMIterations();
+            return result;
+          },
+          R"raw(
+           Return statistics on the work of this instance.
+
+           ``seconds`` and ``calls`` give the time spent in and the number of calls to each of
+           parsing, ``process_loaded_trees``, EM, sampling, making likelihood engines, and
+           likelihood and gradient computation. ``bytes`` has estimates of the memory held by
+           the SBN parameters, the SBN maps, the loaded trees, the phylogenetic model parameters
+           and the BEAGLE buffers.
+           ``trees_evaluated``, ``trees_sampled`` and ``em_iterations`` are running counts.
+          )raw")
+      .def("reset_perf_stats", &SBNInstance::ResetPerfStats,
+           "Zero the statistics of perf_stats and drop any traced events.")
+      .def("set_perf_tracing", &SBNInstance::SetPerfTracing,
+           "Switch on or off keeping each timed call as an event for write_perf_trace.",
+           py::arg("tracing"))
+      .def("write_perf_trace", &SBNInstance::WritePerfTrace,
+           R"raw(
+           Write the events kept while tracing as a Chrome trace (JSON), which
+           chrome://tracing or Perfetto show on a timeline.
+          )raw",
+           py::arg("fname"))
       .def("read_fasta_file", &SBNInstance::ReadFastaFile,
            "Read a sequence alignment from a FASTA file.")
+      .def("save_sbn_snapshot", &SBNInstance::SaveSBNSnapshot,
+           "Save the SBN maps and parameters to a binary snapshot file.",
+           py::arg("fname"))
+      .def("load_sbn_snapshot", &SBNInstance::LoadSBNSnapshot,
+           "Load the SBN maps and parameters from a binary snapshot file, without "
+           "reading any trees.",
+           py::arg("fname"))
+      .def(
+          "get_sbn_probabilities",
+          [](const SBNInstance &self) -> EigenVectorXd {
+            return self.GetNormalizedSBNParameters().Probabilities();
+          },
+          R"raw(
+          Return sbn_parameters normalized into probabilities within each range.
+
+          The normalization is cached, and only the ranges of sbn_parameters that
+          changed since the last call are normalized again.
+          )raw")
       // Member Variables
       .def_readonly("psp_indexer", &SBNInstance::psp_indexer_)
       .def_readonly("taxon_names", &SBNInstance::taxon_names_);
@@ -190,19 +636,145 @@ PYBIND11_MODULE(libsbn, m) {
            "Return the number of trees that are currently stored in the "
            "instance.")
 
+      // ** SBN-related items
+      .def("process_loaded_trees", &RootedSBNInstance::ProcessLoadedTrees,
+           R"raw(
+           Process the trees currently stored in the instance, building the indexers and
+           the ``sbn_parameters`` vector for their rooted subsplit support.
+           ``thread_count`` is the number of threads used to find the support. The
+           indexing is the same for any thread count.
+           )raw",
+           py::arg("thread_count") = 1)
+      .def("train_simple_average", &RootedSBNInstance::TrainSimpleAverage,
+           R"raw(
+           Train the SBN using the "simple average" estimator on the rooted trees, on
+           ``thread_count`` threads.
+           )raw",
+           py::arg("thread_count") = 1)
+
       // ** Phylogenetic likelihood
-      .def("log_likelihoods", &RootedSBNInstance::LogLikelihoods,
-           "Calculate log likelihoods for the current set of trees.")
+      .def("log_likelihoods",
+           static_cast<std::vector<double> (RootedSBNInstance::*)()>(&RootedSBNInstance::LogLikelihoods),
+           "Calculate log likelihoods for the current set of trees.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("log_likelihoods_into",
+           static_cast<void (RootedSBNInstance::*)(EigenVectorXdRef)>(&RootedSBNInstance::LogLikelihoods),
+           R"raw(
+           Calculate log likelihoods for the current set of trees, writing them in place
+           into ``log_likelihoods``, a float64 NumPy vector with an entry per tree.
+           )raw",
+           py::arg("log_likelihoods"), py::call_guard<py::gil_scoped_release>())
       .def("set_rescaling", &RootedSBNInstance::SetRescaling,
            "Set whether BEAGLE's likelihood rescaling is used.")
+      .def("set_adaptive_rescaling", &RootedSBNInstance::SetAdaptiveRescaling,
+           R"raw(
+           Set whether trees are rescaled only when they need it.
+
+           With this on and rescaling off, each tree is evaluated without rescaling first, and
+           the trees whose log likelihood underflows are evaluated again with rescaling. Their
+           topologies are then always rescaled. ``rescaled_topology_count`` says how many there
+           are.
+           )raw",
+           py::arg("adaptive_rescaling"))
+      .def("rescaled_topology_count", &RootedSBNInstance::RescaledTopologyCount,
+           "The number of topologies that adaptive rescaling has found to need rescaling.")
+      .def("incremental_log_likelihood", &RootedSBNInstance::IncrementalLogLikelihood,
+           R"raw(
+           Calculate the log likelihood of one tree, recomputing only what changed since
+           the last call.
+
+           The transition matrices and partials of the last tree passed to this are kept, so
+           after changing a branch length or making a local topology move, only the
+           matrices of the changed branches and the partials above them are recomputed.
+           Other likelihood or gradient calculations, and changes to the model parameters
+           or rescaling, make the next call start from scratch.
+           ``incremental_partial_update_count`` says how many partials the last call
+           recomputed.
+           )raw",
+           py::arg("tree_number"), py::call_guard<py::gil_scoped_release>())
+      .def("incremental_partial_update_count",
+           &RootedSBNInstance::IncrementalPartialUpdateCount,
+           "The number of partials that the last ``incremental_log_likelihood`` recomputed.")
+      .def("log_likelihood_of", &RootedSBNInstance::LogLikelihoodOf,
+           R"raw(
+           Calculate the log likelihood of a tree, which needn't be one of the loaded
+           trees, with the given phylogenetic model parameters.
+
+           This runs on the calling thread using a FatBeagle that no other call is using,
+           so it avoids the scheduling overhead of ``log_likelihoods``, and several Python
+           threads can call it at once. Don't call it while another likelihood or gradient
+           calculation is running.
+           )raw",
+           py::arg("tree"), py::arg("phylo_model_params"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("gradient_of", &RootedSBNInstance::GradientOf,
+           "Calculate the gradient of a tree as ``log_likelihood_of`` does its log "
+           "likelihood.",
+           py::arg("tree"), py::arg("phylo_model_params"),
+           py::call_guard<py::gil_scoped_release>())
       .def("gradients", &RootedSBNInstance::Gradients,
-           "Calculate gradients of parameters for the current set of trees.")
+           "Calculate gradients of parameters for the current set of trees.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("branch_gradients_into", &RootedSBNInstance::BranchGradients,
+           R"raw(
+           Calculate log likelihoods and branch length gradients for the current set of
+           trees, writing them in place into NumPy arrays.
+
+           ``log_likelihoods`` is a float64 vector with an entry per tree, and
+           ``branch_gradients`` is a C-contiguous float64 matrix with a row per tree and
+           ``2 * taxon_count - 1`` columns, where each row is laid out like the
+           ``branch_lengths`` of the corresponding tree.
+           )raw",
+           py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("branch_gradients_and_hessian_diagonals_into",
+           &RootedSBNInstance::BranchGradientsAndHessianDiagonals,
+           R"raw(
+           Like ``branch_gradients_into``, but also write the second derivatives of the
+           log likelihoods with respect to each branch length (the diagonals of their
+           Hessians) into ``branch_hessian_diagonals``, which has the shape of
+           ``branch_gradients``. These come from the same tree traversals as the first
+           derivatives, so they cost little extra, and can be used for Newton steps on the
+           branch lengths.
+           )raw",
+           py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::arg("branch_hessian_diagonals"), py::call_guard<py::gil_scoped_release>())
+      .def("subset_branch_gradients_into", &RootedSBNInstance::SubsetBranchGradients,
+           R"raw(
+           Like ``branch_gradients_into``, but only differentiate along the branches above
+           the nodes whose ids are in ``edge_ids``, leaving the other entries of
+           ``branch_gradients`` zero. Only the pre-order partials on the paths from these
+           nodes to the root are computed, so for a few branches (as in coordinate-wise
+           optimization) this costs little more than a log likelihood.
+           )raw",
+           py::arg("edge_ids"), py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("submit_log_likelihoods", &RootedSBNInstance::SubmitLogLikelihoods,
+           R"raw(
+           Start calculating log likelihoods for the current set of trees in the
+           background, and return a future whose ``result()`` gives them.
+
+           The trees and the phylogenetic model parameters are copied when this is called,
+           so they can be modified (e.g. by sampling the next batch) while the computation
+           runs. Don't call ``prepare_for_phylo_likelihood`` while a computation is pending.
+           )raw")
+      .def("submit_gradients", &RootedSBNInstance::SubmitGradients,
+           R"raw(
+           Start calculating gradients for the current set of trees in the background, and
+           return a future whose ``result()`` gives them. See ``submit_log_likelihoods``.
+           )raw")
 
       // ** I/O
       .def("read_newick_file", &RootedSBNInstance::ReadNewickFile,
-           "Read trees from a Newick file.")
+           "Read trees from a Newick file, parsing on ``thread_count`` threads. With "
+           "``use_cache``, keep the parsed trees in a binary sidecar file and read "
+           "them from it when it is newer than the Newick file.",
+           py::arg("fname"), py::arg("thread_count") = 1, py::arg("use_cache") = false)
       .def("read_nexus_file", &RootedSBNInstance::ReadNexusFile,
-           "Read trees from a Nexus file.")
+           "Read trees from a Nexus file, parsing on ``thread_count`` threads. With "
+           "``use_cache``, keep the parsed trees in a binary sidecar file and read "
+           "them from it when it is newer than the Nexus file.",
+           py::arg("fname"), py::arg("thread_count") = 1, py::arg("use_cache") = false)
 
       // ** Member variables
       .def_readwrite("tree_collection", &RootedSBNInstance::tree_collection_);
@@ -226,7 +798,10 @@ PYBIND11_MODULE(libsbn, m) {
           Process the trees currently stored in the instance.
 
           Specifically, parse them and build the indexers and the ``sbn_parameters`` vector.
-      )raw")
+          ``thread_count`` is the number of threads used to find the subsplit support. The
+          indexing is the same for any thread count.
+      )raw",
+           py::arg("thread_count") = 1)
       .def("get_indexers", &UnrootedSBNInstance::GetIndexers,
            "Return the indexer and parent_to_range as string-keyed maps.")
       .def("train_simple_average", &UnrootedSBNInstance::TrainSimpleAverage,
@@ -246,14 +821,59 @@ PYBIND11_MODULE(libsbn, m) {
 
            Here we can supply alpha, the absolute maxiumum number of iterations, and
            a score-based termination criterion for EM. EM will stop if the scaled
-           score increase is less than the provided ``score_epsilon``.
+           score increase is less than the provided ``score_epsilon``, or if the score
+           increase is no more than ``relative_score_epsilon`` times the total score
+           increase so far. The E-step is split between ``thread_count`` threads.
+           With ``squarem``, each iteration is a SQUAREM extrapolation of EM steps,
+           which usually converges in far fewer iterations.
            )raw",
-           py::arg("alpha"), py::arg("max_iter"), py::arg("score_epsilon") = 0.)
+           py::arg("alpha"), py::arg("max_iter"), py::arg("score_epsilon") = 0.,
+           py::arg("thread_count") = 1, py::arg("relative_score_epsilon") = 0.,
+           py::arg("squarem") = false)
+      .def("reset_online_simple_average",
+           &UnrootedSBNInstance::ResetOnlineSimpleAverage,
+           "Forget the trees added to the online SimpleAverage.")
+      .def("add_to_online_simple_average",
+           &UnrootedSBNInstance::AddToOnlineSimpleAverage,
+           "Add the rootsplit and PCSS counts of a batch of trees to the online "
+           "SimpleAverage.",
+           py::arg("trees"))
+      .def("update_sbn_from_online_simple_average",
+           &UnrootedSBNInstance::UpdateSBNFromOnlineSimpleAverage,
+           R"raw(
+           Build the SBN maps and SimpleAverage parameters for the trees added so far.
+
+           This gives the same result as loading these trees, then calling
+           ``process_loaded_trees`` and ``train_simple_average``.
+           )raw")
+      .def("train_online_simple_average_on_newick_file",
+           &UnrootedSBNInstance::TrainOnlineSimpleAverageOnNewickFile,
+           "Stream a Newick file through the online SimpleAverage in batches, then "
+           "update the SBN.",
+           py::arg("fname"), py::arg("batch_size"))
+      .def("train_online_simple_average_on_nexus_file",
+           &UnrootedSBNInstance::TrainOnlineSimpleAverageOnNexusFile,
+           "Stream a Nexus file through the online SimpleAverage in batches, then "
+           "update the SBN.",
+           py::arg("fname"), py::arg("batch_size"))
       .def("calculate_sbn_probabilities",
            &UnrootedSBNInstance::CalculateSBNProbabilities,
-           R"raw(Get the SBN probabilities of the currently loaded trees.)raw")
+           R"raw(
+           Get the SBN probabilities of the currently loaded trees.
+
+           The evaluation is split between ``thread_count`` threads.
+           )raw",
+           py::arg("thread_count") = 1)
       .def("sample_trees", &UnrootedSBNInstance::SampleTrees,
-           "Sample trees from the SBN and store them internally.", py::arg("count"))
+           R"raw(
+           Sample trees from the SBN and store them internally.
+
+           The sampling is split between ``thread_count`` threads. For a given seed the
+           sample is the same for any thread count.
+           )raw",
+           py::arg("count"), py::arg("thread_count") = 1)
+      .def("set_seed", &UnrootedSBNInstance::SetSeed,
+           "Seed the random number generator used for sampling.", py::arg("seed"))
       .def("make_indexer_representations",
            &UnrootedSBNInstance::MakeIndexerRepresentations,
            R"raw(
@@ -270,31 +890,277 @@ PYBIND11_MODULE(libsbn, m) {
 
             See the comments in ``psp_indexer.hpp`` to understand the layout.
            )raw")
+      .def("make_flat_indexer_representations",
+           &UnrootedSBNInstance::MakeFlatIndexerRepresentations,
+           "Make the indexer representations as a CSRRepresentation, with one row "
+           "per rooting.")
+      .def("make_flat_psp_indexer_representations",
+           &UnrootedSBNInstance::MakeFlatPSPIndexerRepresentations,
+           "Make the PSP indexer representations as a CSRRepresentation.")
+      .def("set_representation_cache_capacity",
+           &UnrootedSBNInstance::SetRepresentationCacheCapacity,
+           "Remember the indexer and PSP indexer representations of up to this many "
+           "topologies between calls, or turn this off with zero.",
+           py::arg("capacity"))
       .def("split_lengths", &UnrootedSBNInstance::SplitLengths,
            "Get the lengths of the current set of trees, indexed by splits.")
+      .def("make_flat_split_lengths", &UnrootedSBNInstance::MakeFlatSplitLengths,
+           "Get the split lengths packed into a FlatSplitLengths, splitting the "
+           "trees between ``thread_count`` threads.",
+           py::arg("thread_count") = 1)
       .def("split_counters", &UnrootedSBNInstance::SplitCounters,
            "A testing method to count splits.")
 
       // ** Phylogenetic likelihood
-      .def("log_likelihoods", &UnrootedSBNInstance::LogLikelihoods,
-           "Calculate log likelihoods for the current set of trees.")
+      .def("log_likelihoods",
+           static_cast<std::vector<double> (UnrootedSBNInstance::*)()>(&UnrootedSBNInstance::LogLikelihoods),
+           "Calculate log likelihoods for the current set of trees.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("log_likelihoods_into",
+           static_cast<void (UnrootedSBNInstance::*)(EigenVectorXdRef)>(&UnrootedSBNInstance::LogLikelihoods),
+           R"raw(
+           Calculate log likelihoods for the current set of trees, writing them in place
+           into ``log_likelihoods``, a float64 NumPy vector with an entry per tree.
+           )raw",
+           py::arg("log_likelihoods"), py::call_guard<py::gil_scoped_release>())
       .def("set_rescaling", &UnrootedSBNInstance::SetRescaling,
            "Set whether BEAGLE's likelihood rescaling is used.")
+      .def("set_adaptive_rescaling", &UnrootedSBNInstance::SetAdaptiveRescaling,
+           R"raw(
+           Set whether trees are rescaled only when they need it.
+
+           With this on and rescaling off, each tree is evaluated without rescaling first, and
+           the trees whose log likelihood underflows are evaluated again with rescaling. Their
+           topologies are then always rescaled. ``rescaled_topology_count`` says how many there
+           are.
+           )raw",
+           py::arg("adaptive_rescaling"))
+      .def("rescaled_topology_count", &UnrootedSBNInstance::RescaledTopologyCount,
+           "The number of topologies that adaptive rescaling has found to need rescaling.")
+      .def("incremental_log_likelihood", &UnrootedSBNInstance::IncrementalLogLikelihood,
+           R"raw(
+           Calculate the log likelihood of one tree, recomputing only what changed since
+           the last call.
+
+           The transition matrices and partials of the last tree passed to this are kept, so
+           after changing a branch length or making a local topology move, only the
+           matrices of the changed branches and the partials above them are recomputed.
+           Other likelihood or gradient calculations, and changes to the model parameters
+           or rescaling, make the next call start from scratch.
+           ``incremental_partial_update_count`` says how many partials the last call
+           recomputed.
+           )raw",
+           py::arg("tree_number"), py::call_guard<py::gil_scoped_release>())
+      .def("incremental_partial_update_count",
+           &UnrootedSBNInstance::IncrementalPartialUpdateCount,
+           "The number of partials that the last ``incremental_log_likelihood`` recomputed.")
+      .def("log_likelihood_of", &UnrootedSBNInstance::LogLikelihoodOf,
+           R"raw(
+           Calculate the log likelihood of a tree, which needn't be one of the loaded
+           trees, with the given phylogenetic model parameters.
+
+           This runs on the calling thread using a FatBeagle that no other call is using,
+           so it avoids the scheduling overhead of ``log_likelihoods``, and several Python
+           threads can call it at once. Don't call it while another likelihood or gradient
+           calculation is running.
+           )raw",
+           py::arg("tree"), py::arg("phylo_model_params"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("gradient_of", &UnrootedSBNInstance::GradientOf,
+           "Calculate the gradient of a tree as ``log_likelihood_of`` does its log "
+           "likelihood.",
+           py::arg("tree"), py::arg("phylo_model_params"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("score_tree_file", &UnrootedSBNInstance::ScoreTreeFile,
+           R"raw(
+           Score the trees of a Newick or Nexus file without loading them all.
+
+           A reader thread parses batches of ``batch_size`` trees, dropping the burn-in
+           and thinning as ``TreeFileStream`` does, this thread computes their log
+           likelihoods (and gradients, if asked) on the engine, and a writer thread calls
+           ``callback`` with a ``TreeScoreBatch`` for each batch, in file order. At most
+           ``queue_capacity`` batches wait between stages. The trees need the taxa of the
+           loaded trees, and all use the first row of the phylogenetic model parameters.
+           Returns the number of trees scored.
+           )raw",
+           py::arg("fname"), py::arg("is_nexus"), py::arg("batch_size"),
+           py::arg("callback"), py::arg("gradients") = false,
+           py::arg("burn_in_fraction") = 0., py::arg("thinning") = 1,
+           py::arg("queue_capacity") = 2, py::call_guard<py::gil_scoped_release>())
+      .def("score_tree_file_to_path", &UnrootedSBNInstance::ScoreTreeFileToPath,
+           R"raw(
+           Score the trees of a file as ``score_tree_file`` does, writing a tab-separated
+           line per tree to ``out_path``: its index, its log likelihood, and then its
+           branch length gradient if ``gradients`` is true.
+           )raw",
+           py::arg("fname"), py::arg("is_nexus"), py::arg("batch_size"),
+           py::arg("out_path"), py::arg("gradients") = false,
+           py::arg("burn_in_fraction") = 0., py::arg("thinning") = 1,
+           py::arg("queue_capacity") = 2, py::call_guard<py::gil_scoped_release>())
       .def("gradients", &UnrootedSBNInstance::Gradients,
-           "Calculate gradients of parameters for the current set of trees.")
+           "Calculate gradients of parameters for the current set of trees.",
+           py::call_guard<py::gil_scoped_release>())
+      .def("branch_gradients_into", &UnrootedSBNInstance::BranchGradients,
+           R"raw(
+           Calculate log likelihoods and branch length gradients for the current set of
+           trees, writing them in place into NumPy arrays.
+
+           ``log_likelihoods`` is a float64 vector with an entry per tree, and
+           ``branch_gradients`` is a C-contiguous float64 matrix with a row per tree and
+           ``2 * taxon_count - 1`` columns, where each row is laid out like the
+           ``branch_lengths`` of the corresponding tree.
+           )raw",
+           py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("branch_gradients_and_hessian_diagonals_into",
+           &UnrootedSBNInstance::BranchGradientsAndHessianDiagonals,
+           R"raw(
+           Like ``branch_gradients_into``, but also write the second derivatives of the
+           log likelihoods with respect to each branch length (the diagonals of their
+           Hessians) into ``branch_hessian_diagonals``, which has the shape of
+           ``branch_gradients``. These come from the same tree traversals as the first
+           derivatives, so they cost little extra, and can be used for Newton steps on the
+           branch lengths.
+           )raw",
+           py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::arg("branch_hessian_diagonals"), py::call_guard<py::gil_scoped_release>())
+      .def("subset_branch_gradients_into", &UnrootedSBNInstance::SubsetBranchGradients,
+           R"raw(
+           Like ``branch_gradients_into``, but only differentiate along the branches above
+           the nodes whose ids are in ``edge_ids``, leaving the other entries of
+           ``branch_gradients`` zero. Only the pre-order partials on the paths from these
+           nodes to the root are computed, so for a few branches (as in coordinate-wise
+           optimization) this costs little more than a log likelihood.
+           )raw",
+           py::arg("edge_ids"), py::arg("log_likelihoods"), py::arg("branch_gradients"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("submit_log_likelihoods", &UnrootedSBNInstance::SubmitLogLikelihoods,
+           R"raw(
+           Start calculating log likelihoods for the current set of trees in the
+           background, and return a future whose ``result()`` gives them.
+
+           The trees and the phylogenetic model parameters are copied when this is called,
+           so they can be modified (e.g. by sampling the next batch) while the computation
+           runs. Don't call ``prepare_for_phylo_likelihood`` while a computation is pending.
+           )raw")
+      .def("submit_gradients", &UnrootedSBNInstance::SubmitGradients,
+           R"raw(
+           Start calculating gradients for the current set of trees in the background, and
+           return a future whose ``result()`` gives them. See ``submit_log_likelihoods``.
+           )raw")
+      .def("variational_step", &UnrootedSBNInstance::VariationalStep,
+           R"raw(
+           Take one stochastic gradient step of split-based variational inference with
+           a LogNormal branch length model, in C++.
+
+           This samples ``particle_count`` trees and their branch lengths, where row
+           ``i`` of ``lognormal_params`` holds the ``(mu, sigma)`` of split ``i``, and
+           returns the ELBO estimate along with the gradients with respect to
+           ``lognormal_params`` and ``sbn_parameters``. See ``Burrito.gradient_step``.
+           )raw",
+           py::arg("particle_count"), py::arg("lognormal_params"), py::arg("beta") = 1.,
+           py::arg("use_vimco") = true, py::arg("prior_rate") = 10.,
+           py::arg("thread_count") = 1, py::call_guard<py::gil_scoped_release>())
+      .def("estimate_marginal_likelihood",
+           &UnrootedSBNInstance::EstimateMarginalLikelihood,
+           R"raw(
+           Estimate the log marginal likelihood and the ELBO by importance sampling,
+           in C++.
+
+           This draws ``particle_count`` trees and branch lengths as
+           ``variational_step`` does, ``batch_size`` at a time, keeping only running
+           sums of the importance weights. The estimates come with their Monte Carlo
+           standard errors and the effective sample size.
+           )raw",
+           py::arg("particle_count"), py::arg("lognormal_params"),
+           py::arg("batch_size") = 1000, py::arg("prior_rate") = 10.,
+           py::arg("thread_count") = 1, py::call_guard<py::gil_scoped_release>())
       .def("topology_gradients", &UnrootedSBNInstance::TopologyGradients,
            R"raw(Calculate gradients of SBN parameters for the current set of trees.
-           Should be called after sampling trees and setting branch lengths.)raw")
+           Should be called after sampling trees and setting branch lengths. The trees
+           are split between ``thread_count`` threads.)raw",
+           py::arg("log_f"), py::arg("use_vimco") = true, py::arg("thread_count") = 1)
 
       // ** I/O
       .def("read_newick_file", &UnrootedSBNInstance::ReadNewickFile,
-           "Read trees from a Newick file.")
+           "Read trees from a Newick file, parsing on ``thread_count`` threads. With "
+           "``use_cache``, keep the parsed trees in a binary sidecar file and read "
+           "them from it when it is newer than the Newick file.",
+           py::arg("fname"), py::arg("thread_count") = 1, py::arg("use_cache") = false)
       .def("read_nexus_file", &UnrootedSBNInstance::ReadNexusFile,
-           "Read trees from a Nexus file.")
+           "Read trees from a Nexus file, parsing on ``thread_count`` threads. With "
+           "``use_cache``, keep the parsed trees in a binary sidecar file and read "
+           "them from it when it is newer than the Nexus file.",
+           py::arg("fname"), py::arg("thread_count") = 1, py::arg("use_cache") = false)
 
       // ** Member variables
       .def_readwrite("tree_collection", &UnrootedSBNInstance::tree_collection_);
 
+  unrooted_sbn_instance_class
+      .def("prepare_for_shared_memory_phylo_likelihood",
+           &UnrootedSBNInstance::PrepareForSharedMemoryPhyloLikelihood,
+           R"raw(
+           Instead of making an engine, hand the trees of ``log_likelihoods``,
+           ``gradients`` and their in-place versions to worker processes that call
+           ``libsbn.shared_memory_serve`` with this shared memory ``name``, such as
+           "/libsbn". Batches can have up to as many trees as are loaded now, or
+           ``tree_count_option``.
+           )raw",
+           py::arg("model_specification"), py::arg("name"),
+           py::arg("tree_count_option") = std::nullopt)
+      .def("wait_for_shared_memory_workers",
+           &UnrootedSBNInstance::WaitForSharedMemoryWorkers,
+           "Wait until at least ``worker_count`` workers serve our shared memory.",
+           py::arg("worker_count"), py::call_guard<py::gil_scoped_release>());
+
+  m.def("shared_memory_serve", &SharedMemoryEngine::ServeWorker,
+        R"raw(
+        Compute likelihoods and gradients for the instance that prepared the shared memory
+        of this ``name``, with ``thread_count`` threads, until it lets go of it. Start a
+        worker on a NUMA node with ``numactl --cpunodebind=N --membind=N`` to keep its
+        memory local.
+        )raw",
+        py::arg("name"), py::arg("thread_count"),
+        py::arg("beagle_flags") = std::vector<BeagleFlags>(),
+        py::arg("use_tip_states") = true, py::call_guard<py::gil_scoped_release>());
+
+#ifdef LIBSBN_MPI
+  unrooted_sbn_instance_class.def(
+      "prepare_for_distributed_phylo_likelihood",
+      &UnrootedSBNInstance::PrepareForDistributedPhyloLikelihood,
+      R"raw(
+      Prepare as ``prepare_for_phylo_likelihood`` does, then share the trees of
+      ``log_likelihoods``, ``gradients`` and their in-place versions between this process and
+      the other processes of MPI_COMM_WORLD, each of which computes its share with
+      ``thread_count`` threads. This process has to be of rank 0, and the others should be in
+      ``libsbn.mpi_serve()``.
+      )raw",
+      py::arg("model_specification"), py::arg("thread_count"),
+      py::arg("beagle_flags") = std::vector<BeagleFlags>(),
+      py::arg("use_tip_states") = true, py::arg("tree_count_option") = std::nullopt);
+  m.def(
+      "mpi_rank",
+      []() {
+        MPIEngine::Initialize();
+        return MPIEngine::Rank(MPI_COMM_WORLD);
+      },
+      "The rank of this process in MPI_COMM_WORLD, starting MPI if need be.");
+  m.def(
+      "mpi_serve",
+      []() {
+        MPIEngine::Initialize();
+        MPIEngine::ServeWorker(MPI_COMM_WORLD);
+      },
+      R"raw(
+      Compute likelihoods and gradients for the process of rank 0 of MPI_COMM_WORLD until it
+      calls ``mpi_stop_workers``.
+      )raw",
+      py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "mpi_stop_workers", []() { MPIEngine::StopWorkers(MPI_COMM_WORLD); },
+      "From the process of rank 0, let the other processes return from ``mpi_serve``.");
+#endif
+
   // If you want to be sure to get all of the stdout and cerr messages, put your
   // Python code in a context like so:
   // `with libsbn.ostream_redirect(stdout=True, stderr=True):`
@@ -0,0 +1,113 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A RepresentationCache remembers the indexer and PSP indexer representations of
+// topologies, so that a topology that comes up again and again (as sampled topologies
+// do once an SBN concentrates) is only digested into its PCSS bitsets once.
+//
+// The representations depend only on the topology and on the indexers, so the key is
+// the topology, and the cache must be cleared whenever the indexers are rebuilt. When
+// the cache is full we evict the least recently used representations.
+
+#ifndef SRC_REPRESENTATION_CACHE_HPP_
+#define SRC_REPRESENTATION_CACHE_HPP_
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include "sbn_maps.hpp"
+#include "sugar.hpp"
+
+struct TopologyRepresentations {
+  UnrootedIndexerRepresentation indexer_representation_;
+  SizeVectorVector psp_representation_;
+};
+
+class RepresentationCache {
+ public:
+  using RepresentationsPtr = std::shared_ptr<const TopologyRepresentations>;
+
+  explicit RepresentationCache(size_t capacity) : capacity_(capacity) {
+    Assert(capacity_ > 0, "RepresentationCache needs a positive capacity.");
+  }
+
+  size_t Capacity() const { return capacity_; }
+  size_t Size() const { return map_.size(); }
+  size_t HitCount() const { return hit_count_; }
+  size_t MissCount() const { return miss_count_; }
+
+  // Find the representations of a topology, marking them as the most recently used,
+  // or return nullptr if we don't have them.
+  RepresentationsPtr Find(const Node::NodePtr &topology) {
+    auto search = map_.find(topology);
+    if (search == map_.end()) {
+      miss_count_++;
+      return nullptr;
+    }  // else
+    hit_count_++;
+    recency_.splice(recency_.begin(), recency_, search->second);
+    return search->second->second;
+  }
+
+  // Insert representations that Find didn't have, evicting the least recently used
+  // ones if we are full.
+  void Insert(const Node::NodePtr &topology, RepresentationsPtr representations) {
+    Assert(map_.find(topology) == map_.end(),
+           "Representations are already in the cache.");
+    if (map_.size() == capacity_) {
+      map_.erase(recency_.back().first);
+      recency_.pop_back();
+    }
+    recency_.emplace_front(topology, std::move(representations));
+    map_.emplace(topology, recency_.begin());
+  }
+
+  void Clear() {
+    map_.clear();
+    recency_.clear();
+  }
+
+ private:
+  using Entry = std::pair<Node::NodePtr, RepresentationsPtr>;
+
+  const size_t capacity_;
+  // The entries, from most to least recently used.
+  std::list<Entry> recency_;
+  std::unordered_map<Node::NodePtr, std::list<Entry>::iterator> map_;
+  size_t hit_count_ = 0;
+  size_t miss_count_ = 0;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("RepresentationCache") {
+  const auto make_representations = [](size_t value) {
+    return std::make_shared<const TopologyRepresentations>(
+        TopologyRepresentations{{{value}}, {{value}}});
+  };
+  const auto ladder = Node::Ladder(4);
+  const auto other_ladder = Node::Ladder(5);
+  const auto third_ladder = Node::Ladder(6);
+  RepresentationCache cache(2);
+  CHECK_EQ(cache.Find(ladder), nullptr);
+  const auto ladder_representations = make_representations(4);
+  cache.Insert(ladder, ladder_representations);
+  // Lookup is by topology, not by pointer.
+  CHECK_EQ(cache.Find(Node::Ladder(4)), ladder_representations);
+  cache.Insert(other_ladder, make_representations(5));
+  // Touch the first ladder so that the second one gets evicted.
+  CHECK_EQ(cache.Find(ladder), ladder_representations);
+  cache.Insert(third_ladder, make_representations(6));
+  CHECK_EQ(cache.Size(), 2);
+  CHECK_EQ(cache.Find(other_ladder), nullptr);
+  CHECK_EQ(cache.Find(ladder), ladder_representations);
+  CHECK_EQ(cache.Find(third_ladder)->psp_representation_[0][0], 6);
+  CHECK_EQ(cache.HitCount(), 4);
+  CHECK_EQ(cache.MissCount(), 2);
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.Find(ladder), nullptr);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_REPRESENTATION_CACHE_HPP_
@@ -0,0 +1,165 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "rooted_gradient_transforms.hpp"
+#include <numeric>
+
+void RootedGradientTransforms::SetHeightRatios(RootedTree &tree,
+                                               const double *height_ratios) {
+  const size_t leaf_count = tree.LeafCount();
+  const size_t root_id = tree.Topology()->Id();
+  Assert(tree.height_ratios_.size() == leaf_count - 1,
+         "RootedGradientTransforms::SetHeightRatios needs a tree whose parameters "
+         "have been initialized.");
+  std::copy(height_ratios, height_ratios + leaf_count - 1,
+            tree.height_ratios_.begin());
+  auto &heights = tree.node_heights_;
+  const auto &bounds = tree.node_bounds_;
+  heights[root_id] = height_ratios[root_id - leaf_count];
+  // The pre-order visits each parent before its children, and the bounds only depend
+  // on the tip dates.
+  for (const auto &[node_id, child0_id, child1_id] :
+       tree.GetTraversals().binary_pre_order_) {
+    for (const size_t child_id :
+         {static_cast<size_t>(child0_id), static_cast<size_t>(child1_id)}) {
+      if (child_id >= leaf_count) {
+        const double ratio = height_ratios[child_id - leaf_count];
+        heights[child_id] =
+            bounds[child_id] + ratio * (heights[node_id] - bounds[child_id]);
+      }
+      tree.branch_lengths_[child_id] = heights[node_id] - heights[child_id];
+    }
+  }
+}
+
+size_t RootedGradientTransforms::ClockGradientSize(const RootedTree &tree) {
+  if (tree.rate_count_ == 1) {
+    return 1;
+  } else if (tree.rate_count_ == tree.rates_.size()) {
+    return tree.rates_.size();
+  }  // else
+  Failwith(
+      "The number of rates should be equal to 1 (i.e. strict clock) or equal to "
+      "the number of branches.");
+}
+
+// Calculation of the substitution rate gradient.
+// \partial{L}/\partial{r_i} = \partial{L}/\partial{b_i} \partial{b_i}/\partial{r_i}
+// For strict clock:
+// \partial{L}/\partial{r} = \sum_i \partial{L}/\partial{r_i}
+void RootedGradientTransforms::ClockGradient(const RootedTree &tree,
+                                             const double *branch_gradient,
+                                             double *clock_gradient) {
+  const size_t root_id = tree.Topology()->Id();
+  if (ClockGradientSize(tree) == 1) {
+    double sum = 0.;
+    for (size_t i = 0; i < root_id; i++) {
+      sum += branch_gradient[i] * tree.branch_lengths_[i];
+    }
+    clock_gradient[0] = sum;
+    return;
+  }  // else one rate per branch.
+  for (size_t i = 0; i < root_id; i++) {
+    clock_gradient[i] = branch_gradient[i] * tree.branch_lengths_[i];
+  }
+}
+
+// Calculation of the ratio and root height gradient is adpated from BEAST.
+// https://github.com/beast-dev/beast-mcmc
+// Credit to Xiang Ji and Marc Suchard.
+//
+// The ratio gradient is the sum of the gradient of the log likelihood and that of the
+// log determinant of the Jacobian, each pulled back from the heights to the ratios.
+// That pull-back is linear, so we add the two height gradients first and pull back
+// once.
+void RootedGradientTransforms::RatioGradient(const RootedTree &tree,
+                                             const double *branch_gradient,
+                                             double *ratio_gradient) {
+  const size_t leaf_count = tree.LeafCount();
+  const size_t root_id = tree.Topology()->Id();
+  const auto &traversals = tree.GetTraversals();
+  const auto &heights = tree.node_heights_;
+  const auto &ratios = tree.height_ratios_;
+  const auto &bounds = tree.node_bounds_;
+  const auto &rates = tree.rates_;
+  // Index internal nodes from zero.
+  auto internal = [leaf_count](size_t node_id) { return node_id - leaf_count; };
+
+  // \partial{L}/\partial{t_k} = \sum_j \partial{L}/\partial{b_j}
+  // \partial{b_j}/\partial{t_k}, plus the derivative of the log Jacobian
+  // determinant with respect to the height of each non-root internal node.
+  std::vector<double> height_gradient(leaf_count - 1, 0.);
+  for (const auto &[signed_node_id, child0_id, child1_id] :
+       traversals.binary_pre_order_) {
+    const size_t node_id = static_cast<size_t>(signed_node_id);
+    double &gradient = height_gradient[internal(node_id)];
+    if (node_id != root_id) {
+      gradient = -branch_gradient[node_id] * rates[node_id] +
+                 1. / (heights[node_id] - bounds[node_id]);
+    }
+    gradient += branch_gradient[child0_id] * rates[child0_id];
+    gradient += branch_gradient[child1_id] * rates[child1_id];
+  }
+
+  // Calculate \partial{t_j}/\partial{r_k} for the non-root internal nodes, from the
+  // leaves up.
+  auto node_partial = [&](size_t node_id) {
+    return (heights[node_id] - bounds[node_id]) / ratios[internal(node_id)];
+  };
+  auto epoch_addition = [&](size_t node_id, size_t child_id) {
+    if (child_id < leaf_count) {
+      return 0.;
+    } else if (bounds[node_id] == bounds[child_id]) {
+      // child_id and node_id are in the same epoch
+      return ratio_gradient[internal(child_id)] * ratios[internal(child_id)] /
+             ratios[internal(node_id)];
+    }  // else NOT the same epoch
+    return ratio_gradient[internal(child_id)] * ratios[internal(child_id)] /
+           (heights[node_id] - bounds[child_id]) * node_partial(node_id);
+  };
+  std::fill(ratio_gradient, ratio_gradient + leaf_count - 1, 0.);
+  for (const auto &[signed_node_id, child0_id, child1_id] :
+       traversals.binary_post_order_) {
+    const size_t node_id = static_cast<size_t>(signed_node_id);
+    if (node_id >= leaf_count && node_id != root_id) {
+      ratio_gradient[internal(node_id)] =
+          node_partial(node_id) * height_gradient[internal(node_id)] +
+          epoch_addition(node_id, child0_id) + epoch_addition(node_id, child1_id);
+    }
+  }
+  // The -1/ratio comes from writing the log Jacobian determinant in terms of the
+  // node heights.
+  for (size_t i = 0; i < internal(root_id); i++) {
+    ratio_gradient[i] -= 1. / ratios[i];
+  }
+
+  // The root height gradient: each height is the root height times the product of
+  // the ratios on the path up to the root, plus terms that don't depend on it.
+  std::vector<double> multipliers(leaf_count - 1);
+  multipliers[internal(root_id)] = 1.;
+  for (const auto &[node_id, child0_id, child1_id] : traversals.binary_pre_order_) {
+    for (const size_t child_id :
+         {static_cast<size_t>(child0_id), static_cast<size_t>(child1_id)}) {
+      if (child_id >= leaf_count) {
+        multipliers[internal(child_id)] =
+            ratios[internal(child_id)] * multipliers[internal(node_id)];
+      }
+    }
+  }
+  ratio_gradient[internal(root_id)] = std::inner_product(
+      height_gradient.cbegin(), height_gradient.cend(), multipliers.cbegin(), 0.);
+}
+
+std::vector<double> RootedGradientTransforms::ClockGradient(
+    const RootedTree &tree, const std::vector<double> &branch_gradient) {
+  std::vector<double> clock_gradient(ClockGradientSize(tree));
+  ClockGradient(tree, branch_gradient.data(), clock_gradient.data());
+  return clock_gradient;
+}
+
+std::vector<double> RootedGradientTransforms::RatioGradient(
+    const RootedTree &tree, const std::vector<double> &branch_gradient) {
+  std::vector<double> ratio_gradient(tree.LeafCount() - 1);
+  RatioGradient(tree, branch_gradient.data(), ratio_gradient.data());
+  return ratio_gradient;
+}
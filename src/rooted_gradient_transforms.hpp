@@ -0,0 +1,50 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// The node height ratio transform of a RootedTree, and the chain rule that takes
+// gradients with respect to (rate-scaled) branch lengths to gradients with respect to
+// the height ratios and root height, and to the clock rates. See rooted_tree.hpp for
+// the parameterization.
+//
+// These write into caller-provided storage so that RootedTreeCollection can run them
+// over rows of a matrix, one row per tree.
+
+#ifndef SRC_ROOTED_GRADIENT_TRANSFORMS_HPP_
+#define SRC_ROOTED_GRADIENT_TRANSFORMS_HPP_
+
+#include <vector>
+#include "rooted_tree.hpp"
+
+namespace RootedGradientTransforms {
+
+// Set the height ratios of a tree whose parameters have been initialized, and with
+// them its node heights and branch lengths. The ratios are laid out as in
+// RootedTree::height_ratios_.
+void SetHeightRatios(RootedTree &tree, const double *height_ratios);
+
+// The number of entries of the clock gradient: 1 for a strict clock, or one per
+// branch.
+size_t ClockGradientSize(const RootedTree &tree);
+
+// The following take the gradient of the log likelihood with respect to the branch
+// lengths times their rates, laid out like the branch lengths of the tree.
+
+// Write the gradient with respect to the clock rates.
+void ClockGradient(const RootedTree &tree, const double *branch_gradient,
+                   double *clock_gradient);
+// Write the gradient with respect to the height ratios and the root height, laid out
+// like RootedTree::height_ratios_. This includes the gradient of the log determinant
+// of the Jacobian of the transform from ratios to heights.
+void RatioGradient(const RootedTree &tree, const double *branch_gradient,
+                   double *ratio_gradient);
+
+std::vector<double> ClockGradient(const RootedTree &tree,
+                                  const std::vector<double> &branch_gradient);
+std::vector<double> RatioGradient(const RootedTree &tree,
+                                  const std::vector<double> &branch_gradient);
+
+}  // namespace RootedGradientTransforms
+
+// Tests live in rooted_tree_collection.hpp.
+
+#endif  // SRC_ROOTED_GRADIENT_TRANSFORMS_HPP_
@@ -2,27 +2,132 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "rooted_sbn_instance.hpp"
+#include <functional>
+#include "tree_collection_cache.hpp"
 
-void RootedSBNInstance::ReadNewickFile(std::string fname) {
-  Driver driver;
+void RootedSBNInstance::ReadNewickFile(std::string fname, size_t thread_count,
+                                      bool use_cache) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Parsing);
+  const std::function<RootedTreeCollection()> parse = [&fname, thread_count]() {
+    Driver driver;
+    auto trees = RootedTreeCollection::OfTreeCollection(
+        driver.ParseNewickFile(fname, thread_count));
+    trees.ParseDatesFromTaxonNames();
+    trees.InitializeParameters();
+    return trees;
+  };
   tree_collection_ =
-      RootedTreeCollection::OfTreeCollection(driver.ParseNewickFile(fname));
-  tree_collection_.ParseDatesFromTaxonNames();
-  tree_collection_.InitializeParameters();
+      use_cache ? TreeCollectionCache::ReadThrough(fname, parse) : parse();
 }
 
-void RootedSBNInstance::ReadNexusFile(std::string fname) {
-  Driver driver;
+void RootedSBNInstance::ReadNexusFile(std::string fname, size_t thread_count,
+                                      bool use_cache) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Parsing);
+  const std::function<RootedTreeCollection()> parse = [&fname, thread_count]() {
+    Driver driver;
+    auto trees = RootedTreeCollection::OfTreeCollection(
+        driver.ParseNexusFile(fname, thread_count));
+    trees.ParseDatesFromTaxonNames();
+    trees.InitializeParameters();
+    return trees;
+  };
   tree_collection_ =
-      RootedTreeCollection::OfTreeCollection(driver.ParseNexusFile(fname));
-  tree_collection_.ParseDatesFromTaxonNames();
-  tree_collection_.InitializeParameters();
+      use_cache ? TreeCollectionCache::ReadThrough(fname, parse) : parse();
+}
+
+void RootedSBNInstance::TrainSimpleAverage(size_t thread_count) {
+  CheckTopologyCounter();
+  const auto indexer_representation_counter =
+      RootedSBNMaps::IndexerRepresentationCounterOf(
+          indexer_, topology_counter_, sbn_parameters_.size(), thread_count);
+  SBNProbability::SimpleAverage(sbn_parameters_, indexer_representation_counter,
+                                thread_count);
 }
 
 std::vector<double> RootedSBNInstance::LogLikelihoods() {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(TreeCount());
   return GetEngine()->LogLikelihoods(tree_collection_, phylo_model_params_, rescaling_);
 }
 
+double RootedSBNInstance::IncrementalLogLikelihood(size_t tree_number) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(1);
+  if (tree_number >= TreeCount()) {
+    Failwith("IncrementalLogLikelihood: tree number out of range.");
+  }
+  return GetEngine()->IncrementalLogLikelihood(tree_collection_.GetTree(tree_number),
+                                               phylo_model_params_.row(tree_number),
+                                               rescaling_);
+}
+
+double RootedSBNInstance::LogLikelihoodOf(const RootedTree &tree,
+                                          EigenVectorXd phylo_model_params) const {
+  return GetEngine()->LogLikelihood(tree, phylo_model_params, rescaling_);
+}
+
+RootedTreeGradient RootedSBNInstance::GradientOf(
+    const RootedTree &tree, EigenVectorXd phylo_model_params) const {
+  return GetEngine()->Gradient(tree, phylo_model_params, rescaling_);
+}
+
 std::vector<RootedTreeGradient> RootedSBNInstance::Gradients() {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
   return GetEngine()->Gradients(tree_collection_, phylo_model_params_, rescaling_);
 }
+
+void RootedSBNInstance::LogLikelihoods(EigenVectorXdRef log_likelihoods) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->LogLikelihoods(tree_collection_, phylo_model_params_, rescaling_,
+                              log_likelihoods);
+}
+
+void RootedSBNInstance::BranchGradients(EigenVectorXdRef log_likelihoods,
+                                       EigenMatrixXdRef branch_gradients) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->BranchGradients(tree_collection_, phylo_model_params_, rescaling_,
+                               log_likelihoods, branch_gradients);
+}
+
+void RootedSBNInstance::BranchGradientsAndHessianDiagonals(
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    EigenMatrixXdRef branch_hessian_diagonals) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->BranchGradientsAndHessianDiagonals(tree_collection_,
+                                                  phylo_model_params_, rescaling_,
+                                                  log_likelihoods, branch_gradients,
+                                                  branch_hessian_diagonals);
+}
+
+void RootedSBNInstance::SubsetBranchGradients(const SizeVector &edge_ids,
+                                              EigenVectorXdRef log_likelihoods,
+                                              EigenMatrixXdRef branch_gradients) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->SubsetBranchGradients(tree_collection_, phylo_model_params_, rescaling_,
+                                     edge_ids, log_likelihoods, branch_gradients);
+}
+
+std::shared_future<std::vector<double>> RootedSBNInstance::SubmitLogLikelihoods()
+    const {
+  auto task = [engine = GetEngine(), tree_collection = tree_collection_,
+               phylo_model_params = phylo_model_params_,
+               rescaling = rescaling_]() mutable {
+    return engine->LogLikelihoods(tree_collection, phylo_model_params, rescaling);
+  };
+  return std::async(std::launch::async, std::move(task)).share();
+}
+
+std::shared_future<std::vector<RootedTreeGradient>>
+RootedSBNInstance::SubmitGradients() const {
+  auto task = [engine = GetEngine(), tree_collection = tree_collection_,
+               phylo_model_params = phylo_model_params_,
+               rescaling = rescaling_]() mutable {
+    return engine->Gradients(tree_collection, phylo_model_params, rescaling);
+  };
+  return std::async(std::launch::async, std::move(task)).share();
+}
@@ -4,7 +4,13 @@
 #ifndef SRC_ROOTED_SBN_INSTANCE_HPP_
 #define SRC_ROOTED_SBN_INSTANCE_HPP_
 
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <vector>
 #include "sbn_instance.hpp"
+#include "tree_collection_cache.hpp"
 
 class RootedSBNInstance : public SBNInstance {
  public:
@@ -13,7 +19,17 @@ class RootedSBNInstance : public SBNInstance {
   size_t TaxonCount() const override { return tree_collection_.TaxonCount(); }
   StringVector TaxonNames() const override { return tree_collection_.TaxonNames(); }
   size_t TreeCount() const override { return tree_collection_.TreeCount(); }
+  size_t TreeCollectionByteCount() const override {
+    return tree_collection_.ApproximateByteCount();
+  }
+  double MaxPrecisionError(size_t sample_count) override {
+    return GetEngine()->MaxPrecisionError(tree_collection_, phylo_model_params_,
+                                          sample_count);
+  }
   TagStringMap TagTaxonMap() const override { return tree_collection_.TagTaxonMap(); }
+  std::shared_ptr<const TaxonRegistry> GetTaxonRegistry() const override {
+    return tree_collection_.GetTaxonRegistry();
+  }
   Node::TopologyCounter TopologyCounter() const override {
     return tree_collection_.TopologyCounter();
   }
@@ -25,16 +41,63 @@ class RootedSBNInstance : public SBNInstance {
     return RootedSBNMaps::PCSSCounterOf(topologies);
   }
 
+  // ** SBN-related items
+
+  // Train the SBN with the rooted SimpleAverage on the rooted topologies of the loaded
+  // trees, deduplicated by ProcessLoadedTrees. Both making the indexer representations
+  // and counting them are split between thread_count threads, and the result doesn't
+  // depend on the thread count.
+  void TrainSimpleAverage(size_t thread_count = 1);
+
   // ** Phylogenetic likelihood
 
   std::vector<double> LogLikelihoods();
   // For each loaded tree, returns a pair of (likelihood, gradient).
   std::vector<RootedTreeGradient> Gradients();
+  // These write into caller-provided storage; see the corresponding Engine methods.
+  void LogLikelihoods(EigenVectorXdRef log_likelihoods);
+  void BranchGradients(EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients);
+  // BranchGradients, also writing the second derivatives of the log likelihoods with
+  // respect to the branch lengths into branch_hessian_diagonals, which is laid out
+  // like branch_gradients. This uses the engine of this process.
+  void BranchGradientsAndHessianDiagonals(EigenVectorXdRef log_likelihoods,
+                                          EigenMatrixXdRef branch_gradients,
+                                          EigenMatrixXdRef branch_hessian_diagonals);
+  // BranchGradients along only the branches above the nodes of edge_ids; see
+  // Engine::SubsetBranchGradients. This uses the engine of this process.
+  void SubsetBranchGradients(const SizeVector &edge_ids,
+                             EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients);
+  // The log likelihood of the tree_number-th tree, computed incrementally from the
+  // last call; see Engine::IncrementalLogLikelihood. After editing the branch lengths
+  // or topology of a tree, call this again to recompute only what the edit changed.
+  // This uses the engine of this process.
+  double IncrementalLogLikelihood(size_t tree_number);
+  // The log likelihood or gradient of a tree, which needn't be one of ours, with
+  // these phylogenetic model parameters, computed on the calling thread; see
+  // Engine::LogLikelihood. These leave the perf stats alone so that several threads
+  // can call them at once. This uses the engine of this process.
+  double LogLikelihoodOf(const RootedTree &tree,
+                         EigenVectorXd phylo_model_params) const;
+  RootedTreeGradient GradientOf(const RootedTree &tree,
+                                EigenVectorXd phylo_model_params) const;
+  // Start computing log likelihoods or gradients on another thread, returning a
+  // future for the result. We take a copy of the trees and the phylogenetic model
+  // parameters, so these can be changed while the computation runs. Don't prepare a
+  // new engine while there are computations pending.
+  std::shared_future<std::vector<double>> SubmitLogLikelihoods() const;
+  std::shared_future<std::vector<RootedTreeGradient>> SubmitGradients() const;
 
   // ** I/O
 
-  void ReadNewickFile(std::string fname);
-  void ReadNexusFile(std::string fname);
+  // With more than one thread, see Driver::ParseNewickFile. With use_cache, we keep
+  // the parsed trees in a sidecar file and read them from it when it is newer than
+  // fname. See tree_collection_cache.hpp.
+  void ReadNewickFile(std::string fname, size_t thread_count = 1,
+                      bool use_cache = false);
+  void ReadNexusFile(std::string fname, size_t thread_count = 1,
+                     bool use_cache = false);
 
   RootedTreeCollection tree_collection_;
 };
@@ -141,6 +204,45 @@ TEST_CASE("RootedSBNInstance: subsplit support") {
   CHECK_EQ(pretty_indexer_set, correct_pretty_indexer_set);
 }
 
+TEST_CASE("RootedSBNInstance: SBN training") {
+  RootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/five_taxon_rooted.nwk");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  const EigenVectorXd sbn_parameters = inst.sbn_parameters_;
+  // The log counts of the rooted subsplits, one for each of the trees.
+  const auto tree_count = static_cast<double>(inst.TreeCount());
+  const auto dag = inst.GetSubsplitDAG();
+  CHECK_LT(
+      fabs(sbn_parameters.segment(0, dag->RootsplitCount()).array().exp().sum() -
+           tree_count),
+      1e-10);
+  for (const auto &[parent, range] : dag->ParentToRange()) {
+    CHECK(sbn_parameters.segment(range.first, range.second - range.first)
+              .array()
+              .isFinite()
+              .all());
+  }
+  for (const size_t thread_count : {2, 3, 8}) {
+    inst.ProcessLoadedTrees(thread_count);
+    inst.TrainSimpleAverage(thread_count);
+    CHECK_EQ(inst.sbn_parameters_, sbn_parameters);
+  }
+  // The representations come in the order of the topology counter.
+  const auto topology_counter = inst.TopologyCounter();
+  const auto counter = RootedSBNMaps::IndexerRepresentationCounterOf(
+      inst.indexer_, topology_counter, inst.sbn_parameters_.size(), 3);
+  REQUIRE_EQ(counter.size(), topology_counter.size());
+  auto topology_iter = topology_counter.begin();
+  for (const auto &[representation, count] : counter) {
+    CHECK_EQ(representation, RootedSBNMaps::RootedIndexerRepresentationOf(
+                                 inst.indexer_, topology_iter->first,
+                                 inst.sbn_parameters_.size()));
+    CHECK_EQ(count, topology_iter->second);
+    ++topology_iter;
+  }
+}
+
 TEST_CASE("RootedSBNInstance: gradients") {
   RootedSBNInstance inst("charlie");
   inst.ReadNewickFile("data/fluA.tree");
@@ -171,6 +273,26 @@ TEST_CASE("RootedSBNInstance: gradients") {
     CHECK_LT(fabs(gradients[0].ratios_root_height_[i] - physher_gradients[i]), 0.0001);
   }
   CHECK_LT(fabs(gradients[0].log_likelihood_ - physher_ll), 0.0001);
+
+  // Splitting the site patterns between threads gives the same answers.
+  inst.PrepareForPhyloLikelihood(simple_specification, 3, {}, true, std::nullopt, 0, 1,
+                                 true);
+  CHECK_LT(fabs(inst.LogLikelihoods()[0] - physher_ll), 0.0001);
+  const auto sharded_gradients = inst.Gradients();
+  for (size_t i = 0; i < physher_gradients.size(); i++) {
+    CHECK_LT(fabs(sharded_gradients[0].ratios_root_height_[i] - physher_gradients[i]),
+             0.0001);
+  }
+  CHECK_LT(fabs(sharded_gradients[0].log_likelihood_ - physher_ll), 0.0001);
+  // So does the single tree path, borrowing each FatBeagle in turn.
+  const auto& tree = inst.tree_collection_.trees_[0];
+  const EigenVectorXd phylo_model_params = inst.GetPhyloModelParams().row(0);
+  CHECK_LT(fabs(inst.LogLikelihoodOf(tree, phylo_model_params) - physher_ll), 0.0001);
+  const auto single_gradient = inst.GradientOf(tree, phylo_model_params);
+  for (size_t i = 0; i < physher_gradients.size(); i++) {
+    CHECK_LT(fabs(single_gradient.ratios_root_height_[i] - physher_gradients[i]),
+             0.0001);
+  }
 }
 
 TEST_CASE("RootedSBNInstance: clock gradients") {
@@ -225,5 +347,46 @@ TEST_CASE("RootedSBNInstance: parsing dates") {
   CHECK_EQ(dates.back(), 80.0);
 }
 
+TEST_CASE("RootedSBNInstance: tree cache") {
+  const std::string fname = "_ignore/rooted_tree_cache.nexus";
+  std::filesystem::copy_file("data/test_beast_tree_parsing.nexus", fname,
+                             std::filesystem::copy_options::overwrite_existing);
+  // File times are coarse, so we make sure that the cache will be newer.
+  std::filesystem::last_write_time(
+      fname, std::filesystem::last_write_time(fname) - std::chrono::seconds(1));
+  const std::string cache_path = TreeCollectionCache::SidecarPathOf(fname, true);
+  std::remove(cache_path.c_str());
+  RootedSBNInstance parsed("parsed");
+  parsed.ReadNexusFile(fname);
+  // The first read writes the cache, and the second reads it.
+  RootedSBNInstance cached("cached");
+  cached.ReadNexusFile(fname, 1, true);
+  CHECK(TreeCollectionCache::IsFresh(cache_path, fname));
+  cached.ReadNexusFile(fname, 1, true);
+  const auto& parsed_trees = parsed.tree_collection_;
+  const auto& cached_trees = cached.tree_collection_;
+  CHECK_EQ(cached_trees, parsed_trees);
+  CHECK_EQ(cached_trees.tag_date_map_, parsed_trees.tag_date_map_);
+  for (size_t tree_idx = 0; tree_idx < parsed_trees.TreeCount(); tree_idx++) {
+    const auto& parsed_tree = parsed_trees.GetTree(tree_idx);
+    const auto& cached_tree = cached_trees.GetTree(tree_idx);
+    CHECK_EQ(cached_tree.node_heights_, parsed_tree.node_heights_);
+    CHECK_EQ(cached_tree.node_bounds_, parsed_tree.node_bounds_);
+    CHECK_EQ(cached_tree.rates_, parsed_tree.rates_);
+    CHECK_EQ(cached_tree.height_ratios_, parsed_tree.height_ratios_);
+    CHECK_EQ(cached_tree.rate_count_, parsed_tree.rate_count_);
+  }
+  // Reading really does use a fresh cache ...
+  RootedTreeCollection one_tree({parsed_trees.GetTree(0)}, parsed_trees.TaxonNames());
+  TreeCollectionCache::Write(cache_path, one_tree);
+  cached.ReadNexusFile(fname, 1, true);
+  CHECK_EQ(cached.tree_collection_.TreeCount(), 1);
+  // ... but not a stale one.
+  std::filesystem::last_write_time(
+      fname, std::filesystem::last_write_time(cache_path) + std::chrono::seconds(1));
+  cached.ReadNexusFile(fname, 1, true);
+  CHECK_EQ(cached.tree_collection_, parsed_trees);
+}
+
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_ROOTED_SBN_INSTANCE_HPP_
@@ -30,36 +30,33 @@ void RootedTree::InitializeParameters(
   }
 
   // Initialize the internal heights and bounds.
-  Topology()->BinaryIdPostOrder([&leaf_count, this](int node_id, int child0_id,
-                                                    int child1_id) {
-    if (node_id >= leaf_count) {
-      node_bounds_[node_id] =
-          std::max(node_bounds_[child0_id], node_bounds_[child1_id]);
-      node_heights_[node_id] = node_heights_[child0_id] + branch_lengths_[child0_id];
-      const auto height_difference =
-          fabs(node_heights_[child1_id] + branch_lengths_[child1_id] -
-               node_heights_[node_id]);
-      if (height_difference > BRANCH_LENGTH_TOLERANCE) {
-        Failwith(
-            "Tree isn't time-calibrated in RootedTree::InitializeParameters. Height "
-            "difference: " +
-            std::to_string(height_difference));
-      }
+  const auto& traversals = GetTraversals();
+  Assert(!traversals.binary_post_order_.empty(),
+         "RootedTree::InitializeParameters expects a bifurcating tree.");
+  for (const auto& [node_id, child0_id, child1_id] : traversals.binary_post_order_) {
+    node_bounds_[node_id] = std::max(node_bounds_[child0_id], node_bounds_[child1_id]);
+    node_heights_[node_id] = node_heights_[child0_id] + branch_lengths_[child0_id];
+    const auto height_difference = fabs(
+        node_heights_[child1_id] + branch_lengths_[child1_id] - node_heights_[node_id]);
+    if (height_difference > BRANCH_LENGTH_TOLERANCE) {
+      Failwith(
+          "Tree isn't time-calibrated in RootedTree::InitializeParameters. Height "
+          "difference: " +
+          std::to_string(height_difference));
     }
-  });
+  }
 
   // Initialize ratios.
   // The "height ratio" for the root is the root height.
   height_ratios_[root_id - leaf_count] = node_heights_[root_id];
-  Topology()->TripleIdPreOrderBifurcating(
-      [&leaf_count, this](int node_id, int, int parent_id) {
-        if (node_id >= leaf_count) {
-          // See the beginning of the header file for an explanation.
-          height_ratios_[node_id - leaf_count] =
-              (node_heights_[node_id] - node_bounds_[node_id]) /
-              (node_heights_[parent_id] - node_bounds_[node_id]);
-        }
-      });
+  // The other internal nodes have the ids from leaf_count up to the root id.
+  for (size_t node_id = leaf_count; node_id < static_cast<size_t>(root_id); node_id++) {
+    const size_t parent_id = traversals.parent_ids_[node_id];
+    // See the beginning of the header file for an explanation.
+    height_ratios_[node_id - leaf_count] =
+        (node_heights_[node_id] - node_bounds_[node_id]) /
+        (node_heights_[parent_id] - node_bounds_[node_id]);
+  }
 }
 
 TagDoubleMap RootedTree::TagDateMapOfDateVector(std::vector<double> leaf_date_vector) {
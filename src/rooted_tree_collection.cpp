@@ -2,6 +2,8 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "rooted_tree_collection.hpp"
+#include <numeric>
+#include "task_processor.hpp"
 #include "taxon_name_munging.hpp"
 
 RootedTreeCollection RootedTreeCollection::OfTreeCollection(
@@ -23,3 +25,88 @@ void RootedTreeCollection::InitializeParameters() {
     tree.InitializeParameters(tag_date_map_);
   }
 }
+
+EigenMatrixXd RootedTreeCollection::HeightRatios() const {
+  EigenMatrixXd height_ratios(TreeCount(), TaxonCount() - 1);
+  for (size_t tree_idx = 0; tree_idx < TreeCount(); tree_idx++) {
+    const auto &ratios = trees_[tree_idx].height_ratios_;
+    Assert(ratios.size() == TaxonCount() - 1,
+           "RootedTreeCollection::HeightRatios needs initialized parameters.");
+    std::copy(ratios.cbegin(), ratios.cend(), height_ratios.row(tree_idx).data());
+  }
+  return height_ratios;
+}
+
+// The rows of an EigenMatrixXd are contiguous, so each tree can work directly on the
+// storage of its row.
+void RootedTreeCollection::SetHeightRatios(EigenConstMatrixXdRef height_ratios,
+                                           size_t thread_count) {
+  CheckRowCount(height_ratios.rows());
+  Assert(static_cast<size_t>(height_ratios.cols()) == TaxonCount() - 1,
+         "The height ratio matrix should have a column per internal node.");
+  ForEachTreeIndex(thread_count, [this, &height_ratios](size_t tree_idx) {
+    RootedGradientTransforms::SetHeightRatios(trees_[tree_idx],
+                                              height_ratios.row(tree_idx).data());
+  });
+}
+
+void RootedTreeCollection::RatioGradients(EigenConstMatrixXdRef branch_gradients,
+                                          EigenMatrixXdRef ratio_gradients,
+                                          size_t thread_count) const {
+  CheckRowCount(branch_gradients.rows());
+  CheckRowCount(ratio_gradients.rows());
+  Assert(static_cast<size_t>(branch_gradients.cols()) == 2 * TaxonCount() - 1 &&
+             static_cast<size_t>(ratio_gradients.cols()) == TaxonCount() - 1,
+         "RootedTreeCollection::RatioGradients got matrices with the wrong number of "
+         "columns.");
+  ForEachTreeIndex(thread_count, [&](size_t tree_idx) {
+    RootedGradientTransforms::RatioGradient(trees_[tree_idx],
+                                            branch_gradients.row(tree_idx).data(),
+                                            ratio_gradients.row(tree_idx).data());
+  });
+}
+
+void RootedTreeCollection::ClockGradients(EigenConstMatrixXdRef branch_gradients,
+                                          EigenMatrixXdRef clock_gradients,
+                                          size_t thread_count) const {
+  CheckRowCount(branch_gradients.rows());
+  CheckRowCount(clock_gradients.rows());
+  Assert(static_cast<size_t>(branch_gradients.cols()) == 2 * TaxonCount() - 1,
+         "The branch gradient matrix should have a column per node.");
+  for (const auto &tree : trees_) {
+    if (RootedGradientTransforms::ClockGradientSize(tree) !=
+        static_cast<size_t>(clock_gradients.cols())) {
+      Failwith(
+          "RootedTreeCollection::ClockGradients needs every tree to have as many "
+          "rates as the clock gradient matrix has columns.");
+    }
+  }
+  ForEachTreeIndex(thread_count, [&](size_t tree_idx) {
+    RootedGradientTransforms::ClockGradient(trees_[tree_idx],
+                                            branch_gradients.row(tree_idx).data(),
+                                            clock_gradients.row(tree_idx).data());
+  });
+}
+
+void RootedTreeCollection::ForEachTreeIndex(
+    size_t thread_count, const std::function<void(size_t)> &f) const {
+  Assert(thread_count > 0, "Thread count must be positive.");
+  if (thread_count == 1 || TreeCount() < 2) {
+    for (size_t tree_idx = 0; tree_idx < TreeCount(); tree_idx++) {
+      f(tree_idx);
+    }
+    return;
+  }  // else
+  SizeVector thread_indices(std::min(thread_count, TreeCount()));
+  std::iota(thread_indices.begin(), thread_indices.end(), 0);
+  WorkStealingPool<size_t> thread_pool(thread_indices);
+  thread_pool.Run(TreeCount(), [&f](size_t, size_t tree_idx) { f(tree_idx); });
+}
+
+void RootedTreeCollection::CheckRowCount(Eigen::Index row_count) const {
+  if (static_cast<size_t>(row_count) != TreeCount()) {
+    Failwith("Expected a matrix with a row per tree, but got " +
+             std::to_string(row_count) + " rows for " + std::to_string(TreeCount()) +
+             " trees.");
+  }
+}
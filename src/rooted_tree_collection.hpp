@@ -4,7 +4,9 @@
 #ifndef SRC_ROOTED_TREE_COLLECTION_HPP_
 #define SRC_ROOTED_TREE_COLLECTION_HPP_
 
+#include "eigen_sugar.hpp"
 #include "generic_tree_collection.hpp"
+#include "rooted_gradient_transforms.hpp"
 #include "rooted_tree.hpp"
 #include "tree_collection.hpp"
 
@@ -24,12 +26,110 @@ class RootedTreeCollection : public PreRootedTreeCollection {
 
   void InitializeParameters();
 
+  // The following work on matrices with one row per tree, and with thread_count
+  // threads spread the trees between threads. See rooted_gradient_transforms.hpp.
+
+  // The height ratios of the trees, laid out as in RootedTree::height_ratios_.
+  EigenMatrixXd HeightRatios() const;
+  // Set the height ratios of the trees, and with them the node heights and branch
+  // lengths.
+  void SetHeightRatios(EigenConstMatrixXdRef height_ratios, size_t thread_count = 1);
+  // Given the gradients of the log likelihood with respect to the rate-scaled branch
+  // lengths, such as Engine::BranchGradients gives, write the gradients with respect
+  // to the height ratios and root height, and with respect to the clock rates.
+  void RatioGradients(EigenConstMatrixXdRef branch_gradients,
+                      EigenMatrixXdRef ratio_gradients, size_t thread_count = 1) const;
+  void ClockGradients(EigenConstMatrixXdRef branch_gradients,
+                      EigenMatrixXdRef clock_gradients, size_t thread_count = 1) const;
+
   TagDateMap tag_date_map_;
+
+ private:
+  // Run f on each tree index, spreading them over thread_count threads.
+  void ForEachTreeIndex(size_t thread_count,
+                        const std::function<void(size_t)> &f) const;
+  void CheckRowCount(Eigen::Index row_count) const;
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
 // Test of ParseDatesFromTaxonNames appears in rooted_sbn_instance.hpp.
-TEST_CASE("RootedTreeCollection") {}
+TEST_CASE("RootedTreeCollection") {
+  // The tree of the RootedTree test, with two sets of rates.
+  auto topology = Node::ExampleTopologies()[3];
+  RootedTree tree(Tree(topology, {2., 1.5, 2., 1., 2.5, 2.5, 0.}));
+  RootedTreeCollection trees({tree, tree}, StringVector({"x0", "x1", "x2", "x3"}));
+  trees.tag_date_map_ = tree.TagDateMapOfDateVector({5., 3., 0., 1.});
+  trees.InitializeParameters();
+  trees.trees_[1].rates_ = {0.5, 1.5, 1., 2., 0.25, 0.75};
+  trees.trees_[1].rate_count_ = 6;
+  const size_t branch_count = 7;
+
+  // Setting the ratios that we have gives back the same tree.
+  EigenMatrixXd ratios = trees.HeightRatios();
+  trees.SetHeightRatios(ratios);
+  CHECK(trees.trees_[0].branch_lengths_ == tree.branch_lengths_);
+  CHECK_EQ(trees.trees_[0].node_heights_,
+           std::vector<double>({5., 3., 0., 1., 2., 4.5, 7.}));
+  ratios.row(1) << 0.5, 0.4, 8.;
+  trees.SetHeightRatios(ratios, 2);
+  CHECK_EQ(trees.trees_[1].node_heights_,
+           std::vector<double>({5., 3., 0., 1., 3., 5., 8.}));
+  CHECK_EQ(trees.trees_[1].branch_lengths_,
+           std::vector<double>({3., 2., 3., 2., 2., 3., 0.}));
+
+  // Take the "log likelihood" to be linear in the rate-scaled branch lengths, so
+  // that its branch gradient is constant. The ratio gradients should agree with
+  // finite differences of this plus the log Jacobian determinant, which is the sum of
+  // log(parent height - bound) over the non-root internal nodes.
+  EigenMatrixXd branch_gradients(2, branch_count);
+  branch_gradients << 0.3, -1.2, 0.7, 2., -0.4, 1.1, 0., -0.8, 0.5, 1.9, -0.3, 0.6,
+      -1.5, 0.;
+  auto objective = [&](const RootedTree &tree, Eigen::Index row) {
+    double value = 0.;
+    for (size_t i = 0; i < branch_count - 1; i++) {
+      value += branch_gradients(row, i) * tree.rates_[i] * tree.branch_lengths_[i];
+    }
+    const auto &parent_ids = tree.GetTraversals().parent_ids_;
+    for (size_t node_id = tree.LeafCount(); node_id < tree.Topology()->Id();
+         node_id++) {
+      value += std::log(tree.node_heights_[parent_ids[node_id]] -
+                        tree.node_bounds_[node_id]);
+    }
+    return value;
+  };
+  EigenMatrixXd ratio_gradients(2, 3);
+  trees.RatioGradients(branch_gradients, ratio_gradients);
+  EigenMatrixXd threaded_ratio_gradients(2, 3);
+  trees.RatioGradients(branch_gradients, threaded_ratio_gradients, 2);
+  CHECK_EQ((ratio_gradients - threaded_ratio_gradients).norm(), 0.);
+  const double step = 1e-6;
+  for (Eigen::Index row = 0; row < 2; row++) {
+    RootedTree perturbed = trees.GetTree(row);
+    for (Eigen::Index i = 0; i < 3; i++) {
+      std::vector<double> perturbed_ratios = trees.GetTree(row).height_ratios_;
+      perturbed_ratios[i] += step;
+      RootedGradientTransforms::SetHeightRatios(perturbed, perturbed_ratios.data());
+      const double above = objective(perturbed, row);
+      perturbed_ratios[i] -= 2. * step;
+      RootedGradientTransforms::SetHeightRatios(perturbed, perturbed_ratios.data());
+      const double below = objective(perturbed, row);
+      CHECK_LT(fabs(ratio_gradients(row, i) - (above - below) / (2. * step)), 1e-6);
+    }
+  }
+
+  // Clock gradients: the strict clock sums over branches.
+  EigenMatrixXd strict_clock_gradients(1, 1);
+  RootedTreeCollection strict_trees({trees.GetTree(0)}, trees.TagTaxonMap());
+  strict_trees.ClockGradients(branch_gradients.topRows(1), strict_clock_gradients);
+  double expected = 0.;
+  for (size_t i = 0; i < branch_count - 1; i++) {
+    expected += branch_gradients(0, i) * tree.branch_lengths_[i];
+  }
+  CHECK_LT(fabs(strict_clock_gradients(0, 0) - expected), 1e-12);
+  // With mixed clocks the rows don't line up.
+  EigenMatrixXd clock_gradients(2, 6);
+  CHECK_THROWS(trees.ClockGradients(branch_gradients, clock_gradients));
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
 #endif  // SRC_ROOTED_TREE_COLLECTION_HPP_
@@ -2,12 +2,15 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "sbn_instance.hpp"
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <unordered_set>
 
 #include "eigen_sugar.hpp"
 #include "numerical_utils.hpp"
+#include "sbn_snapshot.hpp"
 
 void SBNInstance::PrintStatus() {
   std::cout << "Status for instance '" << name_ << "':\n";
@@ -22,30 +25,43 @@ void SBNInstance::PrintStatus() {
 
 // ** Building SBN-related items
 
-void SBNInstance::ProcessLoadedTrees() {
-  size_t index = 0;
+void SBNInstance::ProcessLoadedTrees(size_t thread_count) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::ProcessLoadedTrees);
   ClearTreeCollectionAssociatedState();
   topology_counter_ = TopologyCounter();
-  // Start by adding the rootsplits.
-  for (const auto &iter : RootsplitCounterOf(topology_counter_)) {
-    SafeInsert(indexer_, iter.first, index);
-    rootsplits_.push_back(iter.first);
-    index++;
-  }
-  // Now add the PCSSs.
-  for (const auto &[parent, child_counter] : PCSSCounterOf(topology_counter_)) {
-    SafeInsert(parent_to_range_, parent, {index, index + child_counter.size()});
-    for (const auto &child_iter : child_counter) {
-      const auto &child = child_iter.first;
-      SafeInsert(indexer_, parent + child, index);
-      SafeInsert(index_to_child_, index, Bitset::ChildSubsplit(parent, child));
-      index++;
-    }
-  }
-  sbn_parameters_.resize(index);
+  auto [rootsplit_counter, pcss_counter] = SubsplitDAG::SupportOf(
+      topology_counter_, thread_count,
+      [this](const Node::TopologyCounter &topologies) {
+        return RootsplitCounterOf(topologies);
+      },
+      [this](const Node::TopologyCounter &topologies) {
+        return PCSSCounterOf(topologies);
+      });
+  IndexSupport(TaxonNames(), rootsplit_counter, pcss_counter);
+  taxon_names_ = TaxonNames();
+}
+
+void SBNInstance::IndexSupport(StringVector taxon_names,
+                               const BitsetSizeDict &rootsplit_counter,
+                               const PCSSDict &pcss_counter) {
+  subsplit_dag_ = std::make_shared<const SubsplitDAG>(std::move(taxon_names),
+                                                      rootsplit_counter, pcss_counter);
+  // We keep our own copies of the SBN maps, which training and snapshots change.
+  indexer_ = subsplit_dag_->Indexer();
+  rootsplits_ = subsplit_dag_->Rootsplits();
+  index_to_child_ = subsplit_dag_->IndexToChild();
+  parent_to_range_ = subsplit_dag_->ParentToRange();
+  sbn_parameters_.resize(subsplit_dag_->ParameterCount());
   sbn_parameters_.setOnes();
   psp_indexer_ = PSPIndexer(rootsplits_, indexer_);
-  taxon_names_ = TaxonNames();
+  BuildSubsplitRangeTable();
+}
+
+std::shared_ptr<const SubsplitDAG> SBNInstance::GetSubsplitDAG() const {
+  if (subsplit_dag_ == nullptr) {
+    Failwith("Please call ProcessLoadedTrees to make a SubsplitDAG.");
+  }
+  return subsplit_dag_;
 }
 
 void SBNInstance::CheckTopologyCounter() {
@@ -112,8 +128,7 @@ Eigen::Ref<EigenMatrixXd> SBNInstance::GetPhyloModelParams() {
 }
 
 BlockSpecification::ParameterBlockMap SBNInstance::GetPhyloModelParamBlockMap() {
-  return GetEngine()->GetPhyloModelBlockSpecification().ParameterBlockMapOf(
-      phylo_model_params_);
+  return GetPhyloModelBlockSpecification().ParameterBlockMapOf(phylo_model_params_);
 }
 
 void SBNInstance::CheckSequencesAndTreesLoaded() const {
@@ -132,11 +147,119 @@ void SBNInstance::CheckSequencesAndTreesLoaded() const {
 void SBNInstance::PrepareForPhyloLikelihood(
     const PhyloModelSpecification &model_specification, size_t thread_count,
     const std::vector<BeagleFlags> &beagle_flag_vector, const bool use_tip_states,
-    std::optional<size_t> tree_count_option) {
-  const EngineSpecification engine_specification{thread_count, beagle_flag_vector,
-                                                 use_tip_states};
-  MakeEngine(engine_specification, model_specification);
+    std::optional<size_t> tree_count_option, size_t partial_cache_capacity,
+    size_t tree_batch_size, bool shard_site_patterns,
+    size_t operation_schedule_cache_capacity, SitePatternOrder site_pattern_order,
+    bool host_transition_matrices, ThreadPinning thread_pinning,
+    std::optional<size_t> max_memory, bool single_precision,
+    std::optional<double> single_precision_tolerance) {
+  auto fitted_flag_vector = beagle_flag_vector;
+  bool fitted_use_tip_states = use_tip_states;
+  if (max_memory) {
+    CheckSequencesAndTreesLoaded();
+    const SitePattern site_pattern(alignment_, *GetTaxonRegistry(), thread_count,
+                                   site_pattern_order);
+    const size_t tree_count = tree_count_option ? *tree_count_option : TreeCount();
+    const auto byte_counts = [&]() {
+      const EngineSpecification engine_specification{thread_count,
+                                                     fitted_flag_vector,
+                                                     fitted_use_tip_states,
+                                                     partial_cache_capacity,
+                                                     tree_batch_size,
+                                                     shard_site_patterns,
+                                                     operation_schedule_cache_capacity,
+                                                     site_pattern_order,
+                                                     host_transition_matrices,
+                                                     thread_pinning,
+                                                     single_precision};
+      return PhyloLikelihoodByteCountsOf(engine_specification, model_specification,
+                                         site_pattern, tree_count);
+    };
+    const auto fits = [&]() {
+      return MemoryBudget::TotalByteCount(byte_counts()) <= *max_memory;
+    };
+    if (!fits() && !fitted_use_tip_states) {
+      fitted_use_tip_states = true;
+      std::cout << "Using tip states to fit in the memory budget." << std::endl;
+    }
+    if (!fits() && thread_count > 1) {
+      do {
+        thread_count--;
+      } while (!fits() && thread_count > 1);
+      std::cout << "Using " << thread_count
+                << " thread(s) to fit in the memory budget." << std::endl;
+    }
+    const bool flags_single_precision =
+        std::find(fitted_flag_vector.begin(), fitted_flag_vector.end(),
+                  BEAGLE_FLAG_PRECISION_SINGLE) != fitted_flag_vector.end();
+    if (!fits() && !single_precision && !flags_single_precision) {
+      fitted_flag_vector.push_back(BEAGLE_FLAG_PRECISION_SINGLE);
+      std::cout << "Asking BEAGLE for single precision to fit in the memory budget."
+                << std::endl;
+    }
+    MemoryBudget::CheckFits(byte_counts(), *max_memory,
+                            "Phylogenetic likelihood computation");
+  }
+  const auto engine_specification_of = [&](bool engine_single_precision) {
+    return EngineSpecification{thread_count,
+                               fitted_flag_vector,
+                               fitted_use_tip_states,
+                               partial_cache_capacity,
+                               tree_batch_size,
+                               shard_site_patterns,
+                               operation_schedule_cache_capacity,
+                               site_pattern_order,
+                               host_transition_matrices,
+                               thread_pinning,
+                               engine_single_precision};
+  };
+  MakeEngine(engine_specification_of(single_precision), model_specification);
   ResizePhyloModelParams(tree_count_option);
+  if (single_precision && single_precision_tolerance) {
+    const double error = MaxPrecisionError(precision_check_tree_count_);
+    if (!(error <= *single_precision_tolerance)) {
+      std::cout << "Single precision log likelihoods differ from double precision ones "
+                   "by up to "
+                << error << ", so we're using double precision." << std::endl;
+      MakeEngine(engine_specification_of(false), model_specification);
+    }
+  }
+}
+
+void SBNInstance::SetAdaptiveRescaling(bool adaptive_rescaling) {
+  adaptive_rescaling_ = adaptive_rescaling;
+  if (engine_ != nullptr) {
+    engine_->SetAdaptiveRescaling(adaptive_rescaling_);
+  }
+}
+
+StringSizeMap SBNInstance::EstimatePhyloLikelihoodByteCounts(
+    const PhyloModelSpecification &model_specification, size_t thread_count,
+    const std::vector<BeagleFlags> &beagle_flag_vector, const bool use_tip_states,
+    std::optional<size_t> tree_count_option, size_t partial_cache_capacity,
+    size_t tree_batch_size, bool shard_site_patterns) const {
+  CheckSequencesAndTreesLoaded();
+  const EngineSpecification engine_specification{
+      thread_count,           beagle_flag_vector, use_tip_states,
+      partial_cache_capacity, tree_batch_size,    shard_site_patterns};
+  return PhyloLikelihoodByteCountsOf(
+      engine_specification, model_specification,
+      SitePattern(alignment_, *GetTaxonRegistry(), thread_count),
+      tree_count_option ? *tree_count_option : TreeCount());
+}
+
+std::vector<BeagleConfigurationTiming> SBNInstance::AutoTunePhyloLikelihood(
+    const PhyloModelSpecification &model_specification, size_t thread_count,
+    std::optional<size_t> tree_count_option, size_t evaluation_count) {
+  CheckSequencesAndTreesLoaded();
+  const auto timings = Engine::AutoTune(
+      model_specification, SitePattern(alignment_, *GetTaxonRegistry()),
+      evaluation_count);
+  const auto &fastest = timings.front().configuration_;
+  PrepareForPhyloLikelihood(model_specification, thread_count,
+                            fastest.beagle_flag_vector_, fastest.use_tip_states_,
+                            tree_count_option);
+  return timings;
 }
 
 void SBNInstance::ResizePhyloModelParams(std::optional<size_t> tree_count_option) {
@@ -146,24 +269,153 @@ void SBNInstance::ResizePhyloModelParams(std::optional<size_t> tree_count_option
         "Please add trees to your instance by sampling or loading before "
         "preparing for phylogenetic likelihood calculation.");
   }
-  phylo_model_params_.resize(
-      tree_count, GetEngine()->GetPhyloModelBlockSpecification().ParameterCount());
+  phylo_model_params_.resize(tree_count,
+                             GetPhyloModelBlockSpecification().ParameterCount());
 }
 
 // ** I/O
 
 void SBNInstance::ReadFastaFile(std::string fname) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Parsing);
   alignment_ = Alignment::ReadFasta(fname);
 }
 
+void SBNInstance::SaveSBNSnapshot(const std::string &fname) const {
+  if (indexer_.empty() || taxon_names_.empty()) {
+    Failwith("Please prepare your SBN maps before saving an SBN snapshot.");
+  }
+  SBNSnapshot::Write(fname, taxon_names_, rootsplits_, parent_to_range_, indexer_,
+                     sbn_parameters_);
+}
+
+void SBNInstance::LoadSBNSnapshot(const std::string &fname) {
+  const SBNSnapshot snapshot(fname);
+  auto taxon_names = snapshot.TaxonNames();
+  if (TaxonCount() > 0 && TaxonNames() != taxon_names) {
+    Failwith("The taxon names of the SBN snapshot " + fname +
+             " don't match those of the loaded trees.");
+  }
+  ClearTreeCollectionAssociatedState();
+  const size_t rootsplit_count = snapshot.RootsplitCount();
+  indexer_.reserve(snapshot.ParameterCount());
+  parent_to_range_.reserve(snapshot.ParentCount());
+  rootsplits_.reserve(rootsplit_count);
+  index_to_child_.reserve(snapshot.ParameterCount());
+  for (size_t idx = 0; idx < rootsplit_count; idx++) {
+    rootsplits_.push_back(snapshot.Rootsplit(idx));
+    SafeInsert(indexer_, rootsplits_.back(), idx);
+  }
+  index_to_child_.resize(rootsplit_count, Bitset(0));
+  // The parents are in the order of their ranges, which tile the rest of
+  // sbn_parameters_.
+  for (size_t parent_idx = 0; parent_idx < snapshot.ParentCount(); parent_idx++) {
+    const auto parent = snapshot.Parent(parent_idx);
+    const auto range = snapshot.ParentRange(parent_idx);
+    Assert(range.first == index_to_child_.size() && range.first <= range.second &&
+               range.second <= snapshot.ParameterCount(),
+           "The parent ranges of SBN snapshot " + fname + " are corrupt.");
+    SafeInsert(parent_to_range_, parent, range);
+    for (size_t idx = range.first; idx < range.second; idx++) {
+      const auto child = snapshot.ChildChunk(idx);
+      SafeInsert(indexer_, parent + child, idx);
+      index_to_child_.push_back(Bitset::ChildSubsplit(parent, child));
+    }
+  }
+  Assert(index_to_child_.size() == snapshot.ParameterCount(),
+         "The parent ranges of SBN snapshot " + fname + " are corrupt.");
+  sbn_parameters_ = snapshot.SBNParameters();
+  psp_indexer_ = PSPIndexer(rootsplits_, indexer_);
+  BuildSubsplitRangeTable();
+  taxon_names_ = std::move(taxon_names);
+}
+
+// ** Run statistics
+
+StringSizeMap SBNInstance::MemoryByteCounts() const {
+  const auto bitset_bytes = [](const BitsetVector &bitsets) {
+    size_t byte_count = bitsets.capacity() * sizeof(Bitset);
+    for (const auto &bitset : bitsets) {
+      byte_count += bitset.HeapByteCount();
+    }
+    return byte_count;
+  };
+  const auto map_bytes = [](const auto &map) {
+    size_t byte_count = map.ByteCount();
+    for (const auto &[bitset, _] : map) {
+      byte_count += bitset.HeapByteCount();
+    }
+    return byte_count;
+  };
+  return {
+      {"sbn_parameters",
+       static_cast<size_t>(sbn_parameters_.size()) * sizeof(double)},
+      {"normalized_sbn_parameters", normalized_sbn_parameters_.ByteCount()},
+      {"sbn_maps",
+       map_bytes(indexer_) + map_bytes(parent_to_range_) + bitset_bytes(rootsplits_) +
+           bitset_bytes(index_to_child_) +
+           subsplit_range_offsets_.capacity() * sizeof(size_t) +
+           subsplit_range_table_.capacity() * sizeof(Range)},
+      {"tree_collection", TreeCollectionByteCount()},
+      {"phylo_model_params",
+       static_cast<size_t>(phylo_model_params_.size()) * sizeof(double)},
+      {"beagle_buffers", engine_ == nullptr ? 0 : engine_->BeagleBufferByteCount()}};
+}
+
 // ** Protected methods
 
 void SBNInstance::MakeEngine(const EngineSpecification &engine_specification,
                              const PhyloModelSpecification &model_specification) {
   CheckSequencesAndTreesLoaded();
-  SitePattern site_pattern(alignment_, TagTaxonMap());
+  SitePattern site_pattern(alignment_, *GetTaxonRegistry(),
+                           engine_specification.thread_count_,
+                           engine_specification.site_pattern_order_);
+  if (engine_ != nullptr &&
+      engine_->IsCompatibleWith(engine_specification, model_specification,
+                                site_pattern)) {
+    // Keep the BEAGLE instances, but otherwise start afresh as with a new engine.
+#ifdef LIBSBN_MPI
+    mpi_engine_.reset();
+#endif
+    engine_->SetPhyloModelSpecification(model_specification);
+    engine_->SetProfiling(false);
+    engine_->ResetProfile();
+    engine_->SetAdaptiveRescaling(adaptive_rescaling_);
+    return;
+  }  // else
+  ResetEngines();
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::MakingEngines);
   engine_ =
       std::make_unique<Engine>(engine_specification, model_specification, site_pattern);
+  engine_->SetAdaptiveRescaling(adaptive_rescaling_);
+}
+
+StringSizeMap SBNInstance::PhyloLikelihoodByteCountsOf(
+    const EngineSpecification &engine_specification,
+    const PhyloModelSpecification &model_specification,
+    const SitePattern &site_pattern, size_t tree_count) {
+  // The engine keeps the site patterns, and with sharding each FatBeagle keeps its
+  // own block of them as well.
+  const size_t site_pattern_byte_count =
+      site_pattern.SequenceCount() *
+          PackedSymbols::WordCountOf(site_pattern.PatternCount()) * sizeof(uint64_t) +
+      site_pattern.PatternCount() * sizeof(double);
+  const size_t parameter_count = PhyloModel::OfSpecification(model_specification)
+                                     ->GetBlockSpecification()
+                                     .ParameterCount();
+  return {{"beagle_buffers",
+           Engine::EstimateBeagleBufferByteCount(engine_specification,
+                                                 model_specification, site_pattern)},
+          {"site_patterns", (engine_specification.shard_site_patterns_ ? 2 : 1) *
+                                site_pattern_byte_count},
+          {"phylo_model_params", tree_count * parameter_count * sizeof(double)}};
+}
+
+void SBNInstance::ResetEngines() {
+#ifdef LIBSBN_MPI
+  mpi_engine_.reset();
+#endif
+  shared_memory_engine_.reset();
+  engine_.reset();
 }
 
 Engine *SBNInstance::GetEngine() const {
@@ -176,47 +428,62 @@ Engine *SBNInstance::GetEngine() const {
       "engine for phylogenetic likelihood computation computation.");
 }
 
-size_t SBNInstance::SampleIndex(std::pair<size_t, size_t> range) const {
-  const auto &[start, end] = range;
-  Assert(start < end && end <= sbn_parameters_.size(),
-         "SampleIndex given an invalid range.");
-  // We do not want to overwrite sbn_parameters so we make a copy.
-  EigenVectorXd sbn_parameters_subrange = sbn_parameters_.segment(start, end - start);
-  NumericalUtils::ProbabilityNormalizeInLog(sbn_parameters_subrange);
-  NumericalUtils::Exponentiate(sbn_parameters_subrange);
-  std::discrete_distribution<> distribution(sbn_parameters_subrange.begin(),
-                                            sbn_parameters_subrange.end());
-  // We have to add on range.first because we have taken a slice of the full
-  // array, and the sampler treats the beginning of this slice as zero.
-  auto result = start + static_cast<size_t>(distribution(random_generator_));
-  Assert(result < end, "SampleIndex sampled a value out of range.");
-  return result;
+const BlockSpecification &SBNInstance::GetPhyloModelBlockSpecification() const {
+  if (shared_memory_engine_ != nullptr) {
+    return shared_memory_engine_->GetPhyloModelBlockSpecification();
+  }  // else
+  return GetEngine()->GetPhyloModelBlockSpecification();
+}
+
+const NormalizedSBNParameters &SBNInstance::GetNormalizedSBNParameters() const {
+  normalized_sbn_parameters_.Update(sbn_parameters_);
+  return normalized_sbn_parameters_;
+}
+
+const AliasTable &SBNInstance::UpToDateAliasTable() const {
+  normalized_sbn_parameters_.UpdateWithAliasTable(sbn_parameters_);
+  return normalized_sbn_parameters_.GetAliasTable();
 }
 
+AliasTable SBNInstance::MakeAliasTable() const { return UpToDateAliasTable(); }
+
 // This function samples a tree by first sampling the rootsplit, and then
 // calling the recursive form of SampleTopology.
-Node::NodePtr SBNInstance::SampleTopology(bool rooted) const {
+Node::NodePtr SBNInstance::SampleTopology(const AliasTable &alias_table, bool rooted,
+                                          std::mt19937 &generator) const {
   // Start by sampling a rootsplit.
-  size_t rootsplit_index =
-      SampleIndex(std::pair<size_t, size_t>(0, rootsplits_.size()));
+  size_t rootsplit_index = alias_table.Sample(Range(0, rootsplits_.size()), generator);
   const Bitset &rootsplit = rootsplits_.at(rootsplit_index);
   // The addition below turns the rootsplit into a subsplit.
-  auto topology = rooted
-                      ? SBNInstance::SampleTopology(rootsplit + ~rootsplit)
-                      : SBNInstance::SampleTopology(rootsplit + ~rootsplit)->Deroot();
+  auto topology =
+      SBNInstance::SampleTopology(alias_table, rootsplit + ~rootsplit, generator);
+  if (!rooted) {
+    topology = topology->Deroot();
+  }
   topology->Polish();
   return topology;
 }
 
+Node::NodePtr SBNInstance::SampleTopology(const AliasTable &alias_table,
+                                          bool rooted) const {
+  return SampleTopology(alias_table, rooted, random_generator_);
+}
+
+Node::NodePtr SBNInstance::SampleTopology(bool rooted) const {
+  return SampleTopology(UpToDateAliasTable(), rooted);
+}
+
 // The input to this function is a parent subsplit (of length 2n).
-Node::NodePtr SBNInstance::SampleTopology(const Bitset &parent_subsplit) const {
-  auto process_subsplit = [this](const Bitset &parent) {
+Node::NodePtr SBNInstance::SampleTopology(const AliasTable &alias_table,
+                                          const Bitset &parent_subsplit,
+                                          std::mt19937 &generator) const {
+  auto process_subsplit = [this, &alias_table, &generator](const Bitset &parent) {
     auto singleton_option = parent.SplitChunk(1).SingletonOption();
     if (singleton_option) {
       return Node::Leaf(*singleton_option);
     }  // else
-    auto child_index = SampleIndex(parent_to_range_.at(parent));
-    return SampleTopology(index_to_child_.at(child_index));
+    auto child_index = alias_table.Sample(parent_to_range_.at(parent), generator);
+    return SampleTopology(alias_table, index_to_child_.at(child_index), generator);
   };
   return Node::Join(process_subsplit(parent_subsplit),
                     process_subsplit(parent_subsplit.RotateSubsplit()));
@@ -228,33 +495,39 @@ void SBNInstance::ClearTreeCollectionAssociatedState() {
   indexer_.clear();
   index_to_child_.clear();
   parent_to_range_.clear();
+  subsplit_dag_.reset();
+  subsplit_range_offsets_.clear();
+  subsplit_range_table_.clear();
+  normalized_sbn_parameters_ = NormalizedSBNParameters();
   topology_counter_.clear();
 }
 
 void SBNInstance::PushBackRangeForParentIfAvailable(
     const Bitset &parent, SBNInstance::RangeVector &range_vector) {
-  if (parent_to_range_.count(parent) > 0) {
-    range_vector.push_back(parent_to_range_.at(parent));
+  auto search = parent_to_range_.find(parent);
+  if (search != parent_to_range_.end()) {
+    range_vector.push_back(search->second);
   }
 }
 
-// Retrieves range of subsplits for each s|t that appears in the tree
-// given by rooted_representation.
-SBNInstance::RangeVector SBNInstance::GetSubsplitRanges(
-    const SizeVector &rooted_representation) {
-  RangeVector subsplit_ranges;
-  // PROFILE: should we be reserving here?
-  subsplit_ranges.emplace_back(0, rootsplits_.size());
-  Bitset root = rootsplits_.at(rooted_representation[0]);
-  PushBackRangeForParentIfAvailable(root + ~root, subsplit_ranges);
-  PushBackRangeForParentIfAvailable(~root + root, subsplit_ranges);
-  // Starting at 1 here because we took care of the rootsplit above (the 0th element).
-  for (size_t i = 1; i < rooted_representation.size(); i++) {
-    Bitset child = index_to_child_.at(rooted_representation[i]);
-    PushBackRangeForParentIfAvailable(child, subsplit_ranges);
-    PushBackRangeForParentIfAvailable(child.RotateSubsplit(), subsplit_ranges);
+void SBNInstance::BuildSubsplitRangeTable() {
+  subsplit_range_offsets_.clear();
+  subsplit_range_table_.clear();
+  subsplit_range_offsets_.reserve(index_to_child_.size() + 1);
+  subsplit_range_offsets_.push_back(0);
+  for (const auto &root : rootsplits_) {
+    PushBackRangeForParentIfAvailable(root + ~root, subsplit_range_table_);
+    PushBackRangeForParentIfAvailable(~root + root, subsplit_range_table_);
+    subsplit_range_offsets_.push_back(subsplit_range_table_.size());
+  }
+  for (size_t idx = rootsplits_.size(); idx < index_to_child_.size(); idx++) {
+    const Bitset &child = index_to_child_[idx];
+    PushBackRangeForParentIfAvailable(child, subsplit_range_table_);
+    PushBackRangeForParentIfAvailable(child.RotateSubsplit(), subsplit_range_table_);
+    subsplit_range_offsets_.push_back(subsplit_range_table_.size());
   }
-  return subsplit_ranges;
+  normalized_sbn_parameters_ = NormalizedSBNParameters(
+      index_to_child_.size(), rootsplits_.size(), parent_to_range_);
 }
 
 // This multiplicative factor is the quantity inside the parentheses in eq:nabla in the
@@ -281,22 +554,22 @@ EigenVectorXd SBNInstance::CalculateVIMCOMultiplicativeFactors(
   // This has jth entry \hat{f}_{\bm{\phi},{\bm{\psi}}}(\tau^{-j},\bm{\theta}^{-j}),
   // i.e. the log of the geometric mean of each item other than j.
   EigenVectorXd log_geometric_mean = (sum_of_log_f - log_f.array()) / (tree_count - 1);
+  // The jth entry of per_sample_signal is the parenthetical expression in
+  // eq:perSampleLearning: the log of the mean of f with the jth entry replaced by its
+  // geometric mean estimate. We get it in linear time from the log sums of f that
+  // leave out each entry.
+  const EigenVectorXd leave_one_out_log_sums =
+      NumericalUtils::LeaveOneOutLogSums(log_f);
   EigenVectorXd per_sample_signal(tree_count);
-  // This is a vector of entries that when summed become the parenthetical expression
-  // in eq:perSampleLearning.
-  EigenVectorXd log_f_perturbed = log_f;
   for (size_t j = 0; j < tree_count; j++) {
-    log_f_perturbed(j) = log_geometric_mean(j);
     per_sample_signal(j) =
-        log_f_perturbed.redux(NumericalUtils::LogAdd) - log_tree_count;
-    // Reset the value.
-    log_f_perturbed(j) = log_f(j);
+        NumericalUtils::LogAdd(leave_one_out_log_sums(j), log_geometric_mean(j)) -
+        log_tree_count;
   }
   EigenVectorXd multiplicative_factors = CalculateMultiplicativeFactors(log_f);
   multiplicative_factors -= per_sample_signal;
   return multiplicative_factors;
 }
 
-// Here we initialize our static random number generator.
+// Here we initialize our static random device.
 std::random_device SBNInstance::random_device_;
-std::mt19937 SBNInstance::random_generator_(SBNInstance::random_device_());
@@ -16,12 +16,19 @@
 
 #include <random>
 #include "ProgressBar.hpp"
+#include "alias_table.hpp"
 #include "alignment.hpp"
 #include "engine.hpp"
+#include "memory_budget.hpp"
+#include "mpi_engine.hpp"
+#include "normalized_sbn_parameters.hpp"
+#include "shared_memory_engine.hpp"
 #include "numerical_utils.hpp"
+#include "perf_stats.hpp"
 #include "psp_indexer.hpp"
 #include "sbn_maps.hpp"
 #include "sbn_probability.hpp"
+#include "subsplit_dag.hpp"
 
 class SBNInstance {
  public:
@@ -50,7 +57,14 @@ class SBNInstance {
   virtual size_t TaxonCount() const { return 0; }
   virtual StringVector TaxonNames() const { return {}; }
   virtual size_t TreeCount() const { return 0; }
+  virtual size_t TreeCollectionByteCount() const { return 0; }
+  // See Engine::MaxPrecisionError.
+  virtual double MaxPrecisionError(size_t sample_count) { return 0.; }
   virtual TagStringMap TagTaxonMap() const { return {}; }
+  // The taxa of the loaded trees by id, which we compress alignments through.
+  virtual std::shared_ptr<const TaxonRegistry> GetTaxonRegistry() const {
+    return std::make_shared<const TaxonRegistry>();
+  }
   virtual Node::TopologyCounter TopologyCounter() const { return {}; }
   virtual BitsetSizeDict RootsplitCounterOf(
       const Node::TopologyCounter &topologies) const {
@@ -63,8 +77,14 @@ class SBNInstance {
   // ** SBN-related items
 
   // Use the loaded trees to get the SBN maps, set taxon_names_, and prepare the
-  // sbn_parameters_ vector.
-  void ProcessLoadedTrees();
+  // sbn_parameters_ vector. With a thread_count above 1 the topologies are split
+  // between that many threads to find the subsplit support. The rootsplits and
+  // PCSSs are indexed in sorted order, so the indexing doesn't depend on the
+  // thread count.
+  void ProcessLoadedTrees(size_t thread_count = 1);
+  // The SubsplitDAG that ProcessLoadedTrees indexed the support with, which a
+  // GPInstance can share (see GPInstance::UseSubsplitDAG).
+  std::shared_ptr<const SubsplitDAG> GetSubsplitDAG() const;
 
   void CheckTopologyCounter();
 
@@ -84,6 +104,18 @@ class SBNInstance {
   StringVector StringReversedIndexer() const;
 
   void NormalizeSBNParametersInLog(EigenVectorXdRef sbn_parameters);
+  // sbn_parameters_ normalized within each range, which we cache and bring up to date
+  // here, re-normalizing only the ranges that changed since the last call (see
+  // normalized_sbn_parameters.hpp).
+  const NormalizedSBNParameters &GetNormalizedSBNParameters() const;
+
+  // Alias tables for the rootsplit distribution and for the child distribution of
+  // each parent subsplit from the current sbn_parameters_. This is a copy of our
+  // cached table, which we bring up to date first.
+  AliasTable MakeAliasTable() const;
+
+  // Seed the random number generator used for sampling.
+  void SetSeed(uint32_t seed) { random_generator_.seed(seed); }
 
   // ** Phylogenetic likelihood
 
@@ -96,78 +128,246 @@ class SBNInstance {
 
   // Set whether we use rescaling for phylogenetic likelihood computation.
   void SetRescaling(bool use_rescaling) { rescaling_ = use_rescaling; }
+  // With adaptive rescaling on and rescaling off, each tree is first evaluated without
+  // rescaling, and only the trees whose log likelihood underflows are evaluated again
+  // with rescaling. Their topologies are then always rescaled, until this is set again
+  // or PrepareForPhyloLikelihood is called. This applies to the engine of this
+  // process, and not to MPI or shared memory workers.
+  void SetAdaptiveRescaling(bool adaptive_rescaling);
+  // The number of topologies that adaptive rescaling has found to need rescaling.
+  size_t RescaledTopologyCount() const { return GetEngine()->RescaledTopologyCount(); }
+  // The number of partials that the last IncrementalLogLikelihood recomputed.
+  size_t IncrementalPartialUpdateCount() const {
+    return GetEngine()->IncrementalPartialUpdateCount();
+  }
 
   void CheckSequencesAndTreesLoaded() const;
 
   // Prepare for phylogenetic likelihood calculation. If we get a nullopt
   // argument, it just uses the number of trees currently in the SBNInstance.
+  // A nonzero partial_cache_capacity turns on caching of subtree partials across
+  // trees in each thread; see partial_cache.hpp. A tree_batch_size above 1 has
+  // each thread send that many trees to BEAGLE at once when computing likelihoods.
+  // If shard_site_patterns is true, the threads split the site patterns between
+  // them rather than splitting the trees. A nonzero
+  // operation_schedule_cache_capacity has each thread remember the BEAGLE
+  // operations for that many recently seen topologies. The site patterns are put in
+  // site_pattern_order. If host_transition_matrices is true, we compute the
+  // transition matrices in batches and upload them rather than leaving that to
+  // BEAGLE. The threads are placed according to thread_pinning.
+  // If we get a max_memory in bytes and the estimate of
+  // EstimatePhyloLikelihoodByteCounts doesn't fit in it, we first switch to tip
+  // states, then use fewer threads, and then ask BEAGLE for single precision,
+  // printing each change. If even that doesn't fit, we fail before allocating.
+  // If single_precision is true, we ask BEAGLE for single precision, which always
+  // rescales. If we also get a single_precision_tolerance, we compare the log
+  // likelihoods of a sample of the loaded trees with the current parameters against
+  // double precision, and if they are further apart than the tolerance, we print
+  // that and switch back to double precision.
+  // If the engine we have would do for these arguments, we keep its BEAGLE instances,
+  // so calling this again to change only the tree count or a model with the same
+  // numbers of states and rate categories is cheap.
   void PrepareForPhyloLikelihood(
       const PhyloModelSpecification &model_specification, size_t thread_count,
       const std::vector<BeagleFlags> &beagle_flag_vector = {},
       const bool use_tip_states = true,
-      std::optional<size_t> tree_count_option = std::nullopt);
+      std::optional<size_t> tree_count_option = std::nullopt,
+      size_t partial_cache_capacity = 0, size_t tree_batch_size = 1,
+      bool shard_site_patterns = false, size_t operation_schedule_cache_capacity = 0,
+      SitePatternOrder site_pattern_order = SitePatternOrder::FirstAppearance,
+      bool host_transition_matrices = false,
+      ThreadPinning thread_pinning = ThreadPinning::None,
+      std::optional<size_t> max_memory = std::nullopt, bool single_precision = false,
+      std::optional<double> single_precision_tolerance = std::nullopt);
+  // The number of trees on which PrepareForPhyloLikelihood checks single precision.
+  static constexpr size_t precision_check_tree_count_ = 10;
+
+  // Estimates of the bytes that PrepareForPhyloLikelihood with these arguments would
+  // allocate for the BEAGLE buffers of every thread, the compressed site patterns,
+  // and the phylogenetic model parameters.
+  StringSizeMap EstimatePhyloLikelihoodByteCounts(
+      const PhyloModelSpecification &model_specification, size_t thread_count,
+      const std::vector<BeagleFlags> &beagle_flag_vector = {},
+      const bool use_tip_states = true,
+      std::optional<size_t> tree_count_option = std::nullopt,
+      size_t partial_cache_capacity = 0, size_t tree_batch_size = 1,
+      bool shard_site_patterns = false) const;
+
+  // Time the candidate configurations of Engine::AutoTune on the loaded alignment,
+  // then PrepareForPhyloLikelihood with the fastest one. Returns the timings,
+  // fastest first.
+  std::vector<BeagleConfigurationTiming> AutoTunePhyloLikelihood(
+      const PhyloModelSpecification &model_specification, size_t thread_count,
+      std::optional<size_t> tree_count_option = std::nullopt,
+      size_t evaluation_count = 10);
 
   // Make the number of phylogentic model parameters fit the number of trees and
   // the speficied model. If we get a nullopt argument, it just uses the number
   // of trees currently in the SBNInstance.
   void ResizePhyloModelParams(std::optional<size_t> tree_count_option);
 
+  // Switch on or off the timing of the phases of likelihood computation and of the
+  // waits in the thread pool; see hot_path_profile.hpp. The profile accumulates
+  // until it is reset or PrepareForPhyloLikelihood is called again. Don't call
+  // these while a submitted computation is pending.
+  void SetProfiling(bool profiling) { GetEngine()->SetProfiling(profiling); }
+  HotPathProfile GetProfile() const { return GetEngine()->GetProfile(); }
+  void ResetProfile() { GetEngine()->ResetProfile(); }
+
+  // ** Run statistics
+
+  // The time this instance spent parsing, building SBN maps, training by EM, sampling,
+  // making likelihood engines, and computing likelihoods and gradients, with counts of
+  // the trees evaluated and sampled; see perf_stats.hpp. With tracing on we also keep
+  // each of these calls, so that WritePerfTrace can write them as a Chrome trace.
+  const PerfStats &GetPerfStats() const { return perf_stats_; }
+  void ResetPerfStats() { perf_stats_.Reset(); }
+  void SetPerfTracing(bool tracing) { perf_stats_.SetTracing(tracing); }
+  void WritePerfTrace(const std::string &fname) const {
+    perf_stats_.WriteChromeTrace(fname);
+  }
+  // Estimates of the bytes held by sbn_parameters_ and its cached normalization (see
+  // GetNormalizedSBNParameters), the SBN maps, the loaded trees, the phylogenetic
+  // model parameters, and the BEAGLE buffers of the engine (zero if there is no
+  // engine).
+  StringSizeMap MemoryByteCounts() const;
+
   // ** I/O
 
   void ReadFastaFile(std::string fname);
 
+  // Save the SBN maps, taxon names, and sbn_parameters_ to a binary snapshot (see
+  // sbn_snapshot.hpp), and load them back without reading any trees. Loading
+  // replaces the current SBN maps and parameters; if trees are loaded then their
+  // taxon names must match those of the snapshot.
+  void SaveSBNSnapshot(const std::string &fname) const;
+  void LoadSBNSnapshot(const std::string &fname);
+
  protected:
   // The name of our libsbn instance.
   std::string name_;
   // Our phylogenetic likelihood computation engine.
   std::unique_ptr<Engine> engine_;
+#ifdef LIBSBN_MPI
+  // If we have distributed likelihood computation, this shares it out between engine_
+  // and the other MPI processes. Making a new engine_ lets go of it.
+  std::unique_ptr<MPIEngine> mpi_engine_;
+#endif
+  // If we hand likelihood computation to worker processes, this is what does it, and
+  // we have no engine_. See shared_memory_engine.hpp.
+  std::unique_ptr<SharedMemoryEngine> shared_memory_engine_;
   // Whether we use likelihood vector rescaling.
   bool rescaling_;
+  // Whether we rescale the trees that underflow; see SetAdaptiveRescaling.
+  bool adaptive_rescaling_ = false;
   // The multiple sequence alignment.
   Alignment alignment_;
   // A map that indexes these probabilities: rootsplits are at the beginning,
   // and PCSS bitsets are at the end.
   // The collection of rootsplits, with the same indexing as in the indexer_.
   BitsetVector rootsplits_;
-  // A map going from the index of a PCSS to its child.
-  SizeBitsetMap index_to_child_;
+  // A vector going from the index of a PCSS to its child. The entries at rootsplit
+  // indices are empty placeholders.
+  BitsetVector index_to_child_;
   // A map going from a parent subsplit to the range of indices in
   // sbn_parameters_ with its children. See the definition of Range for the indexing
   // convention.
   BitsetSizePairMap parent_to_range_;
+  // The DAG that the SBN maps above were copied from, which we don't have after
+  // loading an SBN snapshot.
+  std::shared_ptr<const SubsplitDAG> subsplit_dag_;
+  // The ranges of the parent subsplits that each entry of sbn_parameters_ leads to,
+  // packed as in CSR storage: the ranges for index i are subsplit_range_table_[j]
+  // for subsplit_range_offsets_[i] <= j < subsplit_range_offsets_[i + 1]. For a
+  // rootsplit these are the ranges of its two orientations as a subsplit, and for a
+  // PCSS they are the ranges of the two orientations of its child subsplit.
+  SizeVector subsplit_range_offsets_;
+  RangeVector subsplit_range_table_;
+  // The cache of GetNormalizedSBNParameters, which is set up along with the SBN maps.
+  mutable NormalizedSBNParameters normalized_sbn_parameters_;
   // The phylogenetic model parameterization. This has as many rows as there are
   // trees, and holds the parameters before likelihood computation, where they
   // will be processed across threads.
   EigenMatrixXd phylo_model_params_;
   // A counter for the currently loaded set of topologies.
   Node::TopologyCounter topology_counter_;
+  PerfStats perf_stats_;
 
-  // Random bits.
+  // Random bits. Each instance has its own generator, which is seeded from the
+  // random device unless SetSeed is called.
   static std::random_device random_device_;
-  static std::mt19937 random_generator_;
-  inline void SetSeed(unsigned long seed) { random_generator_.seed(seed); }
+  mutable std::mt19937 random_generator_{random_device_()};
 
-  // Make a likelihood engine with the given specification.
+  // Make a likelihood engine with the given specification, unless the engine we have
+  // is compatible with it (see Engine::IsCompatibleWith), in which case we keep its
+  // BEAGLE instances and only swap in the model.
   void MakeEngine(const EngineSpecification &engine_specification,
                   const PhyloModelSpecification &model_specification);
 
+  // Let go of all of our engines.
+  void ResetEngines();
+
+  // The estimates of EstimatePhyloLikelihoodByteCounts for an engine of this
+  // specification on these site patterns, with tree_count rows of parameters.
+  static StringSizeMap PhyloLikelihoodByteCountsOf(
+      const EngineSpecification &engine_specification,
+      const PhyloModelSpecification &model_specification,
+      const SitePattern &site_pattern, size_t tree_count);
+
   // Return a raw pointer to the engine if it's available.
   Engine *GetEngine() const;
-
-  // Sample an integer index in [range.first, range.second) according to
-  // sbn_parameters_.
-  size_t SampleIndex(Range range) const;
+  // The block specification of whichever engine we have.
+  const BlockSpecification &GetPhyloModelBlockSpecification() const;
+
+  // Our cached alias table, brought up to date with sbn_parameters_.
+  const AliasTable &UpToDateAliasTable() const;
+
+  // Sample a topology using an alias table from MakeAliasTable, drawing from the
+  // given generator or else from random_generator_. The version without an alias
+  // table builds one, so use the others when sampling many topologies.
+  Node::NodePtr SampleTopology(const AliasTable &alias_table, bool rooted,
+                               std::mt19937 &generator) const;
+  Node::NodePtr SampleTopology(const AliasTable &alias_table, bool rooted) const;
   Node::NodePtr SampleTopology(bool rooted) const;
 
   // The input to this function is a parent subsplit (of length 2n).
-  Node::NodePtr SampleTopology(const Bitset &parent_subsplit) const;
-
-  // Clear all of the state that depends on the current tree collection.
-  void ClearTreeCollectionAssociatedState();
+  Node::NodePtr SampleTopology(const AliasTable &alias_table,
+                               const Bitset &parent_subsplit,
+                               std::mt19937 &generator) const;
+
+  // Clear all of the state that depends on the current tree collection. This is the
+  // only place the SBN maps are thrown away, so subclasses that keep state derived
+  // from them clear it here too.
+  virtual void ClearTreeCollectionAssociatedState();
+  // Make the SubsplitDAG of the support given by the keys of the counters, copy
+  // indexer_, rootsplits_, index_to_child_ and parent_to_range_ from it, build
+  // psp_indexer_, and size sbn_parameters_ to match. This expects the SBN maps to be
+  // empty.
+  void IndexSupport(StringVector taxon_names, const BitsetSizeDict &rootsplit_counter,
+                    const PCSSDict &pcss_counter);
 
   void PushBackRangeForParentIfAvailable(const Bitset &parent,
                                          SBNInstance::RangeVector &range_vector);
-  RangeVector GetSubsplitRanges(const SizeVector &rooted_representation);
+  // Fill subsplit_range_offsets_ and subsplit_range_table_ from the SBN maps, and
+  // set up normalized_sbn_parameters_ for them.
+  void BuildSubsplitRangeTable();
+  // Retrieves range of subsplits for each s|t that appears in the tree given by
+  // rooted_representation, which can be a RootedIndexerRepresentation or a
+  // CSRRepresentation::Row.
+  template <typename Indices>
+  RangeVector GetSubsplitRanges(const Indices &rooted_representation) const {
+    RangeVector subsplit_ranges;
+    // Each subsplit leads to at most two parents.
+    subsplit_ranges.reserve(1 + 2 * rooted_representation.size());
+    subsplit_ranges.emplace_back(0, rootsplits_.size());
+    const auto table_begin = subsplit_range_table_.begin();
+    for (const auto idx : rooted_representation) {
+      subsplit_ranges.insert(subsplit_ranges.end(),
+                             table_begin + subsplit_range_offsets_[idx],
+                             table_begin + subsplit_range_offsets_[idx + 1]);
+    }
+    return subsplit_ranges;
+  }
 
   static EigenVectorXd CalculateMultiplicativeFactors(const EigenVectorXdRef log_f);
   static EigenVectorXd CalculateVIMCOMultiplicativeFactors(
@@ -4,10 +4,12 @@
 #include "sbn_maps.hpp"
 #include <algorithm>
 #include <memory>
+#include <numeric>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include "task_processor.hpp"
 
 SizeBitsetMap SBNMaps::IdIdSetMapOf(const Node::NodePtr& topology) {
   SizeBitsetMap map;
@@ -48,6 +50,23 @@ StringPCSSMap SBNMaps::StringPCSSMapOf(PCSSDict d) {
   return d_str;
 }
 
+void SBNMaps::IncrementBy(BitsetSizeDict& counter, const BitsetSizeDict& other) {
+  for (const auto& [bitset, count] : other) {
+    counter.increment(bitset, count);
+  }
+}
+
+void SBNMaps::IncrementBy(PCSSDict& counter, const PCSSDict& other) {
+  for (const auto& [parent, child_counter] : other) {
+    auto search = counter.find(parent);
+    if (search == counter.end()) {
+      SafeInsert(counter, parent, child_counter);
+    } else {
+      IncrementBy(search->second, child_counter);
+    }
+  }
+}
+
 BitsetSizeDict UnrootedSBNMaps::RootsplitCounterOf(
     const Node::TopologyCounter& topologies) {
   BitsetSizeDict rootsplit_counter(0);
@@ -272,6 +291,40 @@ SizeVector RootedSBNMaps::RootedIndexerRepresentationOf(const BitsetSizeMap& ind
   return result;
 }
 
+RootedIndexerRepresentationCounter RootedSBNMaps::IndexerRepresentationCounterOf(
+    const BitsetSizeMap& indexer, const Node::TopologyCounter& topology_counter,
+    const size_t default_index, size_t thread_count) {
+  RootedIndexerRepresentationCounter counter;
+  counter.reserve(topology_counter.size());
+  std::vector<const Node::NodePtr*> topologies;
+  topologies.reserve(topology_counter.size());
+  for (const auto& [topology, topology_count] : topology_counter) {
+    counter.push_back({{}, topology_count});
+    topologies.push_back(&topology);
+  }
+  const size_t topology_count = topologies.size();
+  const auto representations_of_chunk = [&](size_t begin, size_t end) {
+    for (size_t topology_idx = begin; topology_idx < end; topology_idx++) {
+      counter[topology_idx].first = RootedIndexerRepresentationOf(
+          indexer, *topologies[topology_idx], default_index);
+    }
+  };
+  const size_t chunk_count =
+      std::max<size_t>(1, std::min(thread_count, topology_count));
+  if (chunk_count > 1) {
+    SizeVector thread_indices(chunk_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, [&](size_t, size_t chunk_idx) {
+      representations_of_chunk(chunk_idx * topology_count / chunk_count,
+                               (chunk_idx + 1) * topology_count / chunk_count);
+    });
+  } else {
+    representations_of_chunk(0, topology_count);
+  }
+  return counter;
+}
+
 void RootedSBNMaps::IncrementRootedIndexerRepresentationSizeDict(
     RootedIndexerRepresentationSizeDict& dict,
     SizeVector rooted_indexer_representation) {
@@ -13,12 +13,15 @@
 #include "bitset.hpp"
 #include "default_dict.hpp"
 #include "driver.hpp"
+#include "flat_hash_map.hpp"
 #include "node.hpp"
 
 using BitsetVector = std::vector<Bitset>;
 using SizeBitsetMap = std::unordered_map<size_t, Bitset>;
-using BitsetSizeMap = std::unordered_map<Bitset, size_t>;
-using BitsetSizePairMap = std::unordered_map<Bitset, std::pair<size_t, size_t>>;
+// The indexer-style maps are built once and then queried in the inner loops of
+// sampling and indexer representation construction, so they are flat.
+using BitsetSizeMap = FlatHashMap<Bitset, size_t>;
+using BitsetSizePairMap = FlatHashMap<Bitset, std::pair<size_t, size_t>>;
 using BitsetSizeDict = DefaultDict<Bitset, size_t>;
 using RootedIndexerRepresentation = SizeVector;
 using RootedIndexerRepresentationCounter =
@@ -44,6 +47,10 @@ SizeBitsetMap IdIdSetMapOf(const Node::NodePtr& topology);
 SizeVector SplitIndicesOf(const BitsetSizeMap& indexer, const Node::NodePtr& topology);
 // Make a string version of a PCSSDict.
 StringPCSSMap StringPCSSMapOf(PCSSDict d);
+// Add the counts in other to those in counter, such as when merging the counters
+// built by several threads.
+void IncrementBy(BitsetSizeDict& counter, const BitsetSizeDict& other);
+void IncrementBy(PCSSDict& counter, const PCSSDict& other);
 }  // namespace SBNMaps
 
 namespace UnrootedSBNMaps {
@@ -80,6 +87,13 @@ PCSSDict PCSSCounterOf(const Node::TopologyCounter& topologies);
 RootedIndexerRepresentation RootedIndexerRepresentationOf(const BitsetSizeMap& indexer,
                                                           const Node::NodePtr& topology,
                                                           const size_t default_index);
+// Turn a TopologyCounter of rooted topologies into a
+// RootedIndexerRepresentationCounter, with an entry per distinct topology in the
+// order of the TopologyCounter. The topologies are split into contiguous chunks, one
+// per thread.
+RootedIndexerRepresentationCounter IndexerRepresentationCounterOf(
+    const BitsetSizeMap& indexer, const Node::TopologyCounter& topology_counter,
+    const size_t default_index, size_t thread_count = 1);
 // For counting standardized (i.e. PCSS index sorted) rooted indexer representations.
 void IncrementRootedIndexerRepresentationSizeDict(
     RootedIndexerRepresentationSizeDict& dict,
@@ -93,9 +107,9 @@ void IncrementRootedIndexerRepresentationSizeDict(
 
 // Turn a <Key, T> map into a <std::string, T> map for any Key type that has
 // a ToString method.
-template <class Key, class T>
-std::unordered_map<std::string, T> StringifyMap(std::unordered_map<Key, T> m) {
-  std::unordered_map<std::string, T> m_str;
+template <class Map>
+std::unordered_map<std::string, typename Map::mapped_type> StringifyMap(const Map& m) {
+  std::unordered_map<std::string, typename Map::mapped_type> m_str;
   for (const auto& iter : m) {
     m_str[iter.first.ToString()] = iter.second;
   }
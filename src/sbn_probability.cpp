@@ -5,12 +5,14 @@
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <numeric>
 #include <utility>
 #include <vector>
 #include "ProgressBar.hpp"
 #include "numerical_utils.hpp"
 #include "sbn_maps.hpp"
+#include "task_processor.hpp"
 
 // Increment all entries from an index vector by a log(value).
 void IncrementByInLog(EigenVectorXdRef vec, const SizeVector& indices, double value) {
@@ -97,15 +99,6 @@ double ProductOf(const EigenConstVectorXdRef vec, const SizeVector& indices,
 }
 
 // Take the sum of the entries of vec in indices plus starting_value.
-double SBNProbability::SumOf(const EigenConstVectorXdRef vec, const SizeVector& indices,
-                             const double starting_value) {
-  double result = starting_value;
-  for (const auto& idx : indices) {
-    result += vec[idx];
-  }
-  return result;
-}
-
 // Probability-normalize a range of values in a vector.
 void ProbabilityNormalizeRange(EigenVectorXdRef vec, std::pair<size_t, size_t> range) {
   auto [start_idx, end_idx] = range;
@@ -176,6 +169,100 @@ void SBNProbability::SimpleAverage(
                parent_to_range);
 }
 
+void SBNProbability::SimpleAverage(
+    EigenVectorXdRef sbn_parameters,
+    const RootedIndexerRepresentationCounter& indexer_representation_counter,
+    size_t thread_count) {
+  const size_t topology_count = indexer_representation_counter.size();
+  const size_t chunk_count =
+      std::max<size_t>(1, std::min(thread_count, topology_count));
+  std::vector<EigenVectorXd> chunk_counts(
+      chunk_count, EigenVectorXd::Zero(sbn_parameters.size()));
+  const auto count_chunk = [&](size_t chunk_idx) {
+    auto& counts = chunk_counts[chunk_idx];
+    const size_t end = (chunk_idx + 1) * topology_count / chunk_count;
+    for (size_t topology_idx = chunk_idx * topology_count / chunk_count;
+         topology_idx < end; topology_idx++) {
+      const auto& [rooted_representation, int_topology_count] =
+          indexer_representation_counter[topology_idx];
+      IncrementBy(counts, rooted_representation,
+                  static_cast<double>(int_topology_count));
+    }
+  };
+  if (chunk_count > 1) {
+    SizeVector thread_indices(chunk_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, [&count_chunk](size_t, size_t chunk_idx) {
+      count_chunk(chunk_idx);
+    });
+  } else {
+    count_chunk(0);
+  }
+  // The counts are whole numbers, so adding them up is exact in any order.
+  for (size_t chunk_idx = 1; chunk_idx < chunk_count; chunk_idx++) {
+    chunk_counts[0] += chunk_counts[chunk_idx];
+  }
+  sbn_parameters = chunk_counts[0].array().log();
+}
+
+// The E-step of Algorithm 1 for the topologies in [begin, end) of the counter:
+// log-add their q-weighted counts into log_m_bar, and return their contribution to
+// the score. The caller provides log_q_weights and scratch so that this doesn't
+// allocate.
+double AccumulateQWeightedCounts(
+    EigenVectorXdRef log_m_bar, const EigenConstVectorXdRef sbn_parameters,
+    const UnrootedIndexerRepresentationCounter& indexer_representation_counter,
+    size_t begin, size_t end, EigenVectorXd& log_q_weights, EigenVectorXd& scratch) {
+  const auto edge_count = static_cast<size_t>(log_q_weights.size());
+  double score = 0.;
+  // Loop over topologies (as manifested by their indexer representations).
+  for (size_t topology_idx = begin; topology_idx < end; ++topology_idx) {
+    const auto& [indexer_representation, int_topology_count] =
+        indexer_representation_counter[topology_idx];
+    // The number of times this topology was seen in the counter.
+    const auto topology_count = static_cast<double>(int_topology_count);
+    // Calculate the q weights for this topology.
+    log_q_weights.setConstant(DOUBLE_NEG_INF);
+    Assert(indexer_representation.size() == edge_count,
+           "Indexer representation length is not constant.");
+    // Loop over the various rooting positions of this topology, using log_q_weights
+    // to store the probability of the tree in the various rootings (we will normalize
+    // it later).
+    for (size_t rooting_position = 0; rooting_position < edge_count;
+         ++rooting_position) {
+      const RootedIndexerRepresentation& rooted_representation =
+          indexer_representation[rooting_position];
+      // Calculate the SBN probability of this topology rooted at this position.
+      double log_p_rooted_topology =
+          SBNProbability::SumOf(sbn_parameters, rooted_representation, 0.);
+      // SHJ: Sometimes overflow is reported, sometimes it's underflow...
+      if (fetestexcept(FE_OVER_AND_UNDER_FLOW_EXCEPT)) {
+        log_q_weights[rooting_position] = DOUBLE_MINIMUM;
+        feclearexcept(FE_OVER_AND_UNDER_FLOW_EXCEPT);
+      } else {
+        log_q_weights[rooting_position] = log_p_rooted_topology;
+      }
+    }  // End of looping over rooting positions.
+    double log_p_unrooted_topology = NumericalUtils::LogSum(log_q_weights);
+    score += topology_count * log_p_unrooted_topology;
+    // Normalize q_weights to achieve the E-step of Algorithm 1.
+    // For the increment step (M-step of Algorithm 1) we want a full topology
+    // count rather than just the unique count. So we multiply the q_weights by the
+    // topology count (in log space, it becomes summation rather than multiplication).
+    log_q_weights =
+        log_q_weights.array() + (-log_p_unrooted_topology + log(topology_count));
+    // Increment the SBN-parameters-to-be by the q-weighted counts.
+    for (size_t rooting_position = 0; rooting_position < edge_count;
+         ++rooting_position) {
+      NumericalUtils::LogAddAtIndices(log_m_bar,
+                                      indexer_representation[rooting_position],
+                                      log_q_weights[rooting_position], scratch);
+    }
+  }  // End of looping over topologies.
+  return score;
+}
+
 // All references to equations, etc, are to the 2018 NeurIPS paper.
 // However, if you are doing a detailed read see doc/tex, because our definition of
 // score differs from that in the NeurIPS paper, and also for details of how the prior
@@ -184,16 +271,63 @@ EigenVectorXd SBNProbability::ExpectationMaximization(
     EigenVectorXdRef sbn_parameters,
     const UnrootedIndexerRepresentationCounter& indexer_representation_counter,
     size_t rootsplit_count, const BitsetSizePairMap& parent_to_range, double alpha,
-    size_t max_iter, double score_epsilon) {
+    size_t max_iter, double score_epsilon, size_t thread_count,
+    double relative_score_epsilon, bool squarem) {
   Assert(!indexer_representation_counter.empty(),
          "Empty indexer_representation_counter.");
   auto edge_count = indexer_representation_counter[0].first.size();
-  // The \bar{m} vectors (Algorithm 1) in log space.
+  // The E-step is split into contiguous chunks of topologies, one per thread, each
+  // with its own accumulators. The chunks are combined in order, so the result
+  // doesn't depend on how the threads get scheduled.
+  const size_t chunk_count = std::max<size_t>(
+      1, std::min(thread_count, indexer_representation_counter.size()));
+  std::unique_ptr<WorkStealingPool<size_t>> thread_pool;
+  if (chunk_count > 1) {
+    SizeVector thread_indices(chunk_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    thread_pool = std::make_unique<WorkStealingPool<size_t>>(thread_indices);
+  }
+  // The \bar{m} vectors (Algorithm 1) in log space, for each chunk.
   // They are packed into a single vector as sbn_parameters is.
-  EigenVectorXd log_m_bar(sbn_parameters.size());
+  std::vector<EigenVectorXd> chunk_log_m_bars(chunk_count,
+                                              EigenVectorXd(sbn_parameters.size()));
+  EigenVectorXd& log_m_bar = chunk_log_m_bars[0];
   // The q weight of a rootsplit is the probability of each rooting given the current
   // SBN parameters.
-  EigenVectorXd log_q_weights(edge_count);
+  std::vector<EigenVectorXd> chunk_log_q_weights(chunk_count,
+                                                 EigenVectorXd(edge_count));
+  std::vector<EigenVectorXd> chunk_scratch(chunk_count);
+  std::vector<double> chunk_scores(chunk_count);
+  const auto e_step_for_chunk = [&](size_t chunk_idx,
+                                    EigenConstVectorXdRef parameters) {
+    const size_t topology_count = indexer_representation_counter.size();
+    chunk_log_m_bars[chunk_idx].setConstant(DOUBLE_NEG_INF);
+    chunk_scores[chunk_idx] = AccumulateQWeightedCounts(
+        chunk_log_m_bars[chunk_idx], parameters, indexer_representation_counter,
+        chunk_idx * topology_count / chunk_count,
+        (chunk_idx + 1) * topology_count / chunk_count, chunk_log_q_weights[chunk_idx],
+        chunk_scratch[chunk_idx]);
+  };
+  // The E-step at the given parameters, which leaves log_m_bar for the M-step and
+  // returns the unregularized score of the parameters.
+  const auto e_step = [&](EigenConstVectorXdRef parameters) {
+    if (thread_pool == nullptr) {
+      e_step_for_chunk(0, parameters);
+    } else {
+      thread_pool->Run(chunk_count,
+                       [&e_step_for_chunk, &parameters](size_t, size_t chunk_idx) {
+                         e_step_for_chunk(chunk_idx, parameters);
+                       });
+    }
+    for (size_t chunk_idx = 1; chunk_idx < chunk_count; chunk_idx++) {
+      log_m_bar = NumericalUtils::LogAddVectors(log_m_bar, chunk_log_m_bars[chunk_idx]);
+    }
+    double score = 0.;
+    for (const auto chunk_score : chunk_scores) {
+      score += chunk_score;
+    }
+    return score;
+  };
   // The \tilde{m} vectors (p.6): the counts vector before normalization to get the
   // SimpleAverage estimate. If alpha is nonzero log_m_tilde gets scaled by it below.
   EigenVectorXd log_m_tilde(sbn_parameters.size());
@@ -218,115 +352,143 @@ EigenVectorXd SBNProbability::ExpectationMaximization(
     // algorithm.
     m_tilde_for_positive_alpha = log_m_tilde.array().exp();
   }
+  // The M-step, which puts the parameters that maximize the expected complete-data
+  // log posterior (given log_m_bar from the E-step) in parameters.
+  const auto m_step = [&](EigenVectorXdRef parameters) {
+    parameters = (alpha > 0.) ? NumericalUtils::LogAddVectors(log_m_bar, log_m_tilde)
+                              : log_m_bar;
+    // We normalize right away to ensure that the parameters are always normalized.
+    ProbabilityNormalizeParamsInLog(parameters, rootsplit_count, parent_to_range);
+  };
+  // Last line of the section on EM in doc/tex.
+  const auto regularization_score = [&](EigenConstVectorXdRef parameters) {
+    return (alpha > 0.) ? m_tilde_for_positive_alpha.dot(parameters) : 0.;
+  };
   // Our score is the marginal log likelihood of the training collection of trees (see
   // doc/tex).
   EigenVectorXd score_history = EigenVectorXd::Zero(max_iter);
-  // Do the specified number of EM loops.
+  // Check the score of iteration em_idx against the earlier ones, returning true if
+  // we've converged.
+  const auto has_converged = [&](size_t em_idx) {
+    if (em_idx == 0) {
+      return false;
+    }
+    const double score_improvement =
+        score_history[em_idx] - score_history[em_idx - 1];
+    const double scaled_score_improvement =
+        score_improvement / fabs(score_history[em_idx - 1]);
+    // To monitor correctness of EM, we check to ensure that the score is
+    // monotonically increasing (modulo numerical instability).
+    // SHJ: -EPS is too small, I noticed the assertion failure for
+    // scaled_score_improvement of -6e-16. Using ERR_TOLERANCE.
+    Assert(scaled_score_improvement > -ERR_TOLERANCE, "Score function decreased.");
+    if (fabs(scaled_score_improvement) < score_epsilon) {
+      std::cout << "EM converged according to normalized score improvement < "
+                << score_epsilon << "." << std::endl;
+      return true;
+    }
+    if (relative_score_epsilon > 0. &&
+        score_improvement <=
+            relative_score_epsilon * (score_history[em_idx] - score_history[0])) {
+      std::cout << "EM converged according to score improvement <= "
+                << relative_score_epsilon << " of the total improvement." << std::endl;
+      return true;
+    }
+    return false;
+  };
   ProgressBar progress_bar(max_iter);
-  for (size_t em_idx = 0; em_idx < max_iter; ++em_idx) {
-    log_m_bar.setConstant(DOUBLE_NEG_INF);
-    // Loop over topologies (as manifested by their indexer representations).
-    for (const auto& [indexer_representation, int_topology_count] :
-         indexer_representation_counter) {
-      // The number of times this topology was seen in the counter.
-      const auto topology_count = static_cast<double>(int_topology_count);
-      // Calculate the q weights for this topology.
-      log_q_weights.setConstant(DOUBLE_NEG_INF);
-      Assert(indexer_representation.size() == edge_count,
-             "Indexer representation length is not constant.");
-      // Loop over the various rooting positions of this topology, using log_q_weights
-      // to store the probability of the tree in the various rootings (we will normalize
-      // it later).
-      for (size_t rooting_position = 0; rooting_position < edge_count;
-           ++rooting_position) {
-        const RootedIndexerRepresentation& rooted_representation =
-            indexer_representation[rooting_position];
-        // Calculate the SBN probability of this topology rooted at this position.
-        double log_p_rooted_topology = SumOf(sbn_parameters, rooted_representation, 0.);
-        // SHJ: Sometimes overflow is reported, sometimes it's underflow...
-        if (fetestexcept(FE_OVER_AND_UNDER_FLOW_EXCEPT)) {
-          log_q_weights[rooting_position] = DOUBLE_MINIMUM;
-          feclearexcept(FE_OVER_AND_UNDER_FLOW_EXCEPT);
-        } else {
-          log_q_weights[rooting_position] = log_p_rooted_topology;
+  if (!squarem) {
+    // Do the specified number of EM loops.
+    for (size_t em_idx = 0; em_idx < max_iter; ++em_idx) {
+      score_history[em_idx] = e_step(sbn_parameters);
+      m_step(sbn_parameters);
+      score_history[em_idx] += regularization_score(sbn_parameters);
+      if (has_converged(em_idx)) {
+        score_history.conservativeResize(em_idx + 1);
+        break;
+      }
+      ++progress_bar;
+      progress_bar.display();
+    }  // End of EM loop.
+  } else {
+    // SQUAREM (scheme S3 of Varadhan and Roland, 2008) on the normalized log
+    // parameters: two EM steps from the parameters, which we extrapolate along, and
+    // then an EM step from the extrapolated parameters to stabilize them. Here the
+    // score of an iteration is that of the best parameters it scored, and it is the
+    // score of parameters rather than the mix of the plain EM loop.
+    const auto parameter_count = sbn_parameters.size();
+    EigenVectorXd parameters_1(parameter_count);
+    EigenVectorXd parameters_2(parameter_count);
+    EigenVectorXd extrapolated(parameter_count);
+    // The longest extrapolation we will try, which grows while we keep taking it and
+    // goes back to a plain EM step when an extrapolation lowers the score.
+    double max_step_length = 1.;
+    for (size_t em_idx = 0; em_idx < max_iter; ++em_idx) {
+      const double score_0 =
+          e_step(sbn_parameters) + regularization_score(sbn_parameters);
+      m_step(parameters_1);
+      const double score_1 = e_step(parameters_1) + regularization_score(parameters_1);
+      m_step(parameters_2);
+      const EigenVectorXd r = parameters_1 - sbn_parameters;
+      const EigenVectorXd v = parameters_2 - parameters_1 - r;
+      const double v_norm = v.norm();
+      const double step_length =
+          (v_norm > 0.) ? std::clamp(r.norm() / v_norm, 1., max_step_length) : 1.;
+      extrapolated =
+          sbn_parameters + 2. * step_length * r + step_length * step_length * v;
+      ProbabilityNormalizeParamsInLog(extrapolated, rootsplit_count, parent_to_range);
+      const double extrapolated_score =
+          extrapolated.allFinite()
+              ? e_step(extrapolated) + regularization_score(extrapolated)
+              : DOUBLE_NEG_INF;
+      if (std::isfinite(extrapolated_score) && extrapolated_score >= score_0) {
+        m_step(sbn_parameters);
+        score_history[em_idx] = extrapolated_score;
+        if (step_length == max_step_length) {
+          max_step_length *= 4.;
         }
-      }  // End of looping over rooting positions.
-      double log_p_unrooted_topology = NumericalUtils::LogSum(log_q_weights);
-      score_history[em_idx] += topology_count * log_p_unrooted_topology;
-      // Normalize q_weights to achieve the E-step of Algorithm 1.
-      // For the increment step (M-step of Algorithm 1) we want a full topology
-      // count rather than just the unique count. So we multiply the q_weights by the
-      // topology count (in log space, it becomes summation rather than multiplication).
-      log_q_weights =
-          log_q_weights.array() + (-log_p_unrooted_topology + log(topology_count));
-      // Increment the SBN-parameters-to-be by the q-weighted counts.
-      IncrementByInLog(log_m_bar, indexer_representation, log_q_weights);
-    }  // End of looping over topologies.
-    // Store the proper value in sbn_parameters.
-    sbn_parameters = (alpha > 0.)
-                         ? NumericalUtils::LogAddVectors(log_m_bar, log_m_tilde)
-                         : log_m_bar;
-    // We normalize sbn_parameters right away to ensure that it is always normalized.
-    ProbabilityNormalizeParamsInLog(sbn_parameters, rootsplit_count, parent_to_range);
-    if (alpha > 0.) {
-      // Last line of the section on EM in doc/tex.
-      score_history[em_idx] += m_tilde_for_positive_alpha.dot(sbn_parameters);
-    }
-    // Return if we've converged according to score.
-    if (em_idx > 0) {
-      double scaled_score_improvement =
-          (score_history[em_idx] - score_history[em_idx - 1]) /
-          fabs(score_history[em_idx - 1]);
-      // To monitor correctness of EM, we check to ensure that the score is
-      // monotonically increasing (modulo numerical instability).
-      // SHJ: -EPS is too small, I noticed the assertion failure for
-      // scaled_score_improvement of -6e-16. Using ERR_TOLERANCE.
-      Assert(scaled_score_improvement > -ERR_TOLERANCE, "Score function decreased.");
-      if (fabs(scaled_score_improvement) < score_epsilon) {
-        std::cout << "EM converged according to normalized score improvement < "
-                  << score_epsilon << "." << std::endl;
-        score_history.resize(em_idx + 1);
+      } else {
+        sbn_parameters = parameters_2;
+        score_history[em_idx] = score_1;
+        max_step_length = 1.;
+      }
+      if (has_converged(em_idx)) {
+        score_history.conservativeResize(em_idx + 1);
         break;
       }
-    }
-    ++progress_bar;
-    progress_bar.display();
-  }  // End of EM loop.
+      ++progress_bar;
+      progress_bar.display();
+    }  // End of SQUAREM loop.
+  }
   progress_bar.done();
   NumericalUtils::ReportFloatingPointEnvironmentExceptions("|After EM|");
   return score_history;
 }
 
-bool SBNProbability::IsInSBNSupport(
-    const RootedIndexerRepresentation& rooted_representation,
-    size_t out_of_support_sentinel_value) {
-  for (size_t idx : rooted_representation) {
-    // Our convention is that out_of_support_sentinel_value is one more than the maximum
-    // allowed PCSS index, so here we check the index is reasonable.
-    Assert(idx <= out_of_support_sentinel_value,
-           "Rooted tree index is greater than maximum permitted.");
-    if (idx == out_of_support_sentinel_value) {
-      return false;
-    }
-  }
-  return true;
-};
-
-double SBNProbability::ProbabilityOf(
-    const EigenConstVectorXdRef sbn_parameters,
-    const UnrootedIndexerRepresentation& indexer_representation) {
+// The probability of an unrooted topology given the rooted indexer representations of
+// its rootings, which can be any range of RootedIndexerRepresentations or
+// CSRRepresentation::Rows.
+template <typename RootedRepresentations>
+double ProbabilityOfRootings(const EigenConstVectorXdRef sbn_parameters,
+                             const RootedRepresentations& rooted_representations) {
   size_t sbn_parameter_count = sbn_parameters.size();
   double log_total_probability = DOUBLE_NEG_INF;
-  for (const auto& rooted_representation : indexer_representation) {
+  for (const auto& rooted_representation : rooted_representations) {
     log_total_probability = NumericalUtils::LogAdd(
         log_total_probability,
-        IsInSBNSupport(rooted_representation, sbn_parameter_count)
-            ? SumOf(sbn_parameters, rooted_representation, 0.)
+        SBNProbability::IsInSBNSupport(rooted_representation, sbn_parameter_count)
+            ? SBNProbability::SumOf(sbn_parameters, rooted_representation, 0.)
             : DOUBLE_NEG_INF);
   }
   return exp(log_total_probability);
 }
 
+double SBNProbability::ProbabilityOf(
+    const EigenConstVectorXdRef sbn_parameters,
+    const UnrootedIndexerRepresentation& indexer_representation) {
+  return ProbabilityOfRootings(sbn_parameters, indexer_representation);
+}
+
 EigenVectorXd SBNProbability::ProbabilityOf(
     const EigenConstVectorXdRef sbn_parameters,
     const std::vector<UnrootedIndexerRepresentation>& indexer_representations) {
@@ -338,3 +500,81 @@ EigenVectorXd SBNProbability::ProbabilityOf(
   }
   return results;
 }
+
+// The sum of values at the indices. The four partial sums are independent, so that
+// the compiler can turn the loop into vector gathers (such as those of AVX2, which
+// --native turns on).
+double GatherSum(const double* values, const CSRRepresentation::Index* indices,
+                 size_t count) {
+  double sums[4] = {0., 0., 0., 0.};
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sums[0] += values[indices[i]];
+    sums[1] += values[indices[i + 1]];
+    sums[2] += values[indices[i + 2]];
+    sums[3] += values[indices[i + 3]];
+  }
+  for (; i < count; i++) {
+    sums[0] += values[indices[i]];
+  }
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+// The largest of the indices, or 0 if there are none.
+CSRRepresentation::Index MaxIndex(const CSRRepresentation::Index* indices,
+                                  size_t count) {
+  CSRRepresentation::Index max_idx = 0;
+  for (size_t i = 0; i < count; i++) {
+    max_idx = std::max(max_idx, indices[i]);
+  }
+  return max_idx;
+}
+
+EigenVectorXd SBNProbability::ProbabilityOf(
+    const EigenConstVectorXdRef sbn_parameters,
+    const CSRRepresentation& indexer_representations, size_t thread_count) {
+  const size_t topology_count = indexer_representations.TreeCount();
+  const auto sbn_parameter_count = static_cast<size_t>(sbn_parameters.size());
+  const double* values = sbn_parameters.data();
+  const auto* indices = indexer_representations.Indices().data();
+  const auto& tree_offsets = indexer_representations.TreeOffsets();
+  const auto& row_offsets = indexer_representations.RowOffsets();
+  EigenVectorXd results(topology_count);
+  // As ProbabilityOfRootings, working on the rows of the CSR representation directly.
+  const auto probabilities_of_chunk = [&](size_t begin, size_t end) {
+    for (size_t topology_idx = begin; topology_idx < end; ++topology_idx) {
+      double log_total_probability = DOUBLE_NEG_INF;
+      for (size_t row_idx = tree_offsets[topology_idx];
+           row_idx < tree_offsets[topology_idx + 1]; ++row_idx) {
+        const auto* row = indices + row_offsets[row_idx];
+        const size_t row_size = row_offsets[row_idx + 1] - row_offsets[row_idx];
+        // Our convention is that sbn_parameter_count is the index of PCSSs that
+        // aren't in the support, so we check for it before gathering.
+        const size_t max_idx = MaxIndex(row, row_size);
+        Assert(max_idx <= sbn_parameter_count,
+               "Rooted tree index is greater than maximum permitted.");
+        if (max_idx < sbn_parameter_count) {
+          log_total_probability = NumericalUtils::LogAdd(
+              log_total_probability, GatherSum(values, row, row_size));
+        }
+      }
+      results[topology_idx] = exp(log_total_probability);
+    }
+  };
+  // The trees are split into contiguous chunks, one per thread, each of which
+  // writes its own entries of the results.
+  const size_t chunk_count =
+      std::max<size_t>(1, std::min(thread_count, topology_count));
+  if (chunk_count > 1) {
+    SizeVector thread_indices(chunk_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, [&](size_t, size_t chunk_idx) {
+      probabilities_of_chunk(chunk_idx * topology_count / chunk_count,
+                             (chunk_idx + 1) * topology_count / chunk_count);
+    });
+  } else {
+    probabilities_of_chunk(0, topology_count);
+  }
+  return results;
+}
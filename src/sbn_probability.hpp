@@ -9,6 +9,7 @@
 #ifndef SRC_SBN_PROBABILITY_HPP_
 #define SRC_SBN_PROBABILITY_HPP_
 
+#include "csr_representation.hpp"
 #include "eigen_sugar.hpp"
 #include "sbn_maps.hpp"
 
@@ -21,14 +22,28 @@ void SimpleAverage(
     const UnrootedIndexerRepresentationCounter& indexer_representation_counter,
     size_t rootsplit_count, const BitsetSizePairMap& parent_to_range);
 
+// The same for rooted trees, which each have one rooting. Each chunk of the counter
+// counts into its own vector, one chunk per thread, and we add these up, so the result
+// doesn't depend on the thread count.
+void SimpleAverage(
+    EigenVectorXdRef sbn_parameters,
+    const RootedIndexerRepresentationCounter& indexer_representation_counter,
+    size_t thread_count = 1);
+
 // The "SBN-EM" estimator described in the "Expectation Maximization" section of
 // the 2018 NeurIPS paper. Returns the sequence of scores (defined in the paper)
-// obtained by the EM iterations.
+// obtained by the EM iterations. The E-step is split between thread_count threads.
+// We stop after max_iter iterations, when the score improves by less than
+// score_epsilon times its absolute value, or when it improves by no more than
+// relative_score_epsilon times its total improvement since the first iteration.
+// If squarem is set, each iteration is a SQUAREM extrapolation of EM steps, which
+// takes three E-steps but usually gets there in far fewer iterations.
 EigenVectorXd ExpectationMaximization(
     EigenVectorXdRef sbn_parameters,
     const UnrootedIndexerRepresentationCounter& indexer_representation_counter,
     size_t rootsplit_count, const BitsetSizePairMap& parent_to_range, double alpha,
-    size_t max_iter, double score_epsilon);
+    size_t max_iter, double score_epsilon, size_t thread_count = 1,
+    double relative_score_epsilon = 0., bool squarem = false);
 
 // Calculate the probability of an indexer_representation of a topology.
 double ProbabilityOf(const EigenConstVectorXdRef,
@@ -38,6 +53,13 @@ double ProbabilityOf(const EigenConstVectorXdRef,
 EigenVectorXd ProbabilityOf(
     const EigenConstVectorXdRef sbn_parameters,
     const std::vector<UnrootedIndexerRepresentation>& indexer_representations);
+// The same, for indexer representations packed into a CSRRepresentation. This reads
+// the indices in place, summing each rooting with a gather loop that the compiler can
+// vectorize, and splits the trees between thread_count threads. The results don't
+// depend on the thread count.
+EigenVectorXd ProbabilityOf(const EigenConstVectorXdRef sbn_parameters,
+                            const CSRRepresentation& indexer_representations,
+                            size_t thread_count = 1);
 
 // This function performs in-place normalization of vec given by range when its values
 // are in log space.
@@ -47,12 +69,32 @@ void ProbabilityNormalizeRangeInLog(EigenVectorXdRef vec,
 // We assume that vec is laid out like sbn_parameters (see top).
 void ProbabilityNormalizeParamsInLog(EigenVectorXdRef vec, size_t rootsplit_count,
                                      const BitsetSizePairMap& parent_to_range);
-bool IsInSBNSupport(const SizeVector& rooted_representation,
-                    size_t out_of_support_sentinel_value);
+// These two take a RootedIndexerRepresentation or a row of a CSRRepresentation.
+template <typename Indices>
+bool IsInSBNSupport(const Indices& rooted_representation,
+                    size_t out_of_support_sentinel_value) {
+  for (size_t idx : rooted_representation) {
+    // Our convention is that out_of_support_sentinel_value is one more than the maximum
+    // allowed PCSS index, so here we check the index is reasonable.
+    Assert(idx <= out_of_support_sentinel_value,
+           "Rooted tree index is greater than maximum permitted.");
+    if (idx == out_of_support_sentinel_value) {
+      return false;
+    }
+  }
+  return true;
+}
 
 // Take the sum of the entries of vec in indices plus starting_value.
-double SumOf(const EigenConstVectorXdRef vec, const SizeVector& indices,
-             const double starting_value);
+template <typename Indices>
+double SumOf(const EigenConstVectorXdRef vec, const Indices& indices,
+             const double starting_value) {
+  double result = starting_value;
+  for (const auto& idx : indices) {
+    result += vec[idx];
+  }
+  return result;
+}
 
 }  // namespace SBNProbability
 
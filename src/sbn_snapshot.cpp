@@ -0,0 +1,235 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "sbn_snapshot.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+constexpr char snapshot_magic[8] = {'L', 'I', 'B', 'S', 'B', 'N', 'S', 'S'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr size_t section_alignment = 64;
+
+size_t AlignedOffset(size_t offset) {
+  return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+}  // namespace
+
+SBNSnapshot::Layout SBNSnapshot::LayoutOf(const Header &header) {
+  const size_t taxon_words = Bitset::PackedWordCount(header.taxon_count_);
+  const size_t subsplit_words = Bitset::PackedWordCount(2 * header.taxon_count_);
+  const size_t pcss_count = header.parameter_count_ - header.rootsplit_count_;
+  Layout layout;
+  layout.parameters_ = AlignedOffset(sizeof(Header));
+  layout.rootsplits_ =
+      AlignedOffset(layout.parameters_ + header.parameter_count_ * sizeof(double));
+  layout.parents_ = AlignedOffset(
+      layout.rootsplits_ + header.rootsplit_count_ * taxon_words * sizeof(uint64_t));
+  layout.parent_ranges_ = AlignedOffset(
+      layout.parents_ + header.parent_count_ * subsplit_words * sizeof(uint64_t));
+  layout.children_ = AlignedOffset(layout.parent_ranges_ +
+                                   2 * header.parent_count_ * sizeof(uint64_t));
+  layout.taxon_names_ =
+      AlignedOffset(layout.children_ + pcss_count * taxon_words * sizeof(uint64_t));
+  layout.file_size_ = layout.taxon_names_ + header.taxon_names_size_;
+  return layout;
+}
+
+void SBNSnapshot::Write(const std::string &path, const StringVector &taxon_names,
+                        const BitsetVector &rootsplits,
+                        const BitsetSizePairMap &parent_to_range,
+                        const BitsetSizeMap &indexer,
+                        EigenConstVectorXdRef sbn_parameters) {
+  const size_t taxon_count = taxon_names.size();
+  Assert(!rootsplits.empty() && rootsplits[0].size() == taxon_count,
+         "SBNSnapshot::Write needs SBN maps that match the taxon names.");
+  Assert(indexer.size() == static_cast<size_t>(sbn_parameters.size()),
+         "SBNSnapshot::Write needs as many SBN parameters as indexer entries.");
+  Header header{};
+  std::copy(std::begin(snapshot_magic), std::end(snapshot_magic), header.magic_);
+  header.version_ = version_;
+  header.byte_order_mark_ = byte_order_mark;
+  header.taxon_count_ = taxon_count;
+  header.rootsplit_count_ = rootsplits.size();
+  header.parent_count_ = parent_to_range.size();
+  header.parameter_count_ = sbn_parameters.size();
+  std::string taxon_name_block;
+  for (const auto &name : taxon_names) {
+    taxon_name_block += name;
+    taxon_name_block.push_back('\0');
+  }
+  header.taxon_names_size_ = taxon_name_block.size();
+  const Layout layout = LayoutOf(header);
+
+  const size_t taxon_words = Bitset::PackedWordCount(taxon_count);
+  const size_t subsplit_words = Bitset::PackedWordCount(2 * taxon_count);
+  std::vector<uint64_t> rootsplit_words(rootsplits.size() * taxon_words);
+  for (size_t idx = 0; idx < rootsplits.size(); idx++) {
+    rootsplits[idx].CopyWordsTo(rootsplit_words.data() + idx * taxon_words);
+  }
+  // We write the parents in the order of their ranges, which is the order of
+  // sbn_parameters_.
+  std::vector<std::pair<Range, Bitset>> parents;
+  parents.reserve(parent_to_range.size());
+  for (const auto &[parent, range] : parent_to_range) {
+    parents.push_back({range, parent});
+  }
+  std::sort(parents.begin(), parents.end(),
+            [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+  std::vector<uint64_t> parent_words(parents.size() * subsplit_words);
+  std::vector<uint64_t> parent_ranges;
+  parent_ranges.reserve(2 * parents.size());
+  for (size_t idx = 0; idx < parents.size(); idx++) {
+    parents[idx].second.CopyWordsTo(parent_words.data() + idx * subsplit_words);
+    parent_ranges.push_back(parents[idx].first.first);
+    parent_ranges.push_back(parents[idx].first.second);
+  }
+  std::vector<uint64_t> child_words((header.parameter_count_ - rootsplits.size()) *
+                                    taxon_words);
+  for (const auto &[key, idx] : indexer) {
+    if (idx >= rootsplits.size()) {
+      key.PCSSChunk(2).CopyWordsTo(child_words.data() +
+                                   (idx - rootsplits.size()) * taxon_words);
+    }
+  }
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    Failwith("SBNSnapshot could not create a file at " + path);
+  }
+  const auto write_section = [&out](size_t offset, const void *data, size_t size) {
+    const auto position = static_cast<size_t>(out.tellp());
+    Assert(position <= offset, "SBNSnapshot sections overlap.");
+    const std::string padding(offset - position, '\0');
+    out.write(padding.data(), padding.size());
+    out.write(static_cast<const char *>(data), size);
+  };
+  write_section(0, &header, sizeof(Header));
+  write_section(layout.parameters_, sbn_parameters.data(),
+                header.parameter_count_ * sizeof(double));
+  write_section(layout.rootsplits_, rootsplit_words.data(),
+                rootsplit_words.size() * sizeof(uint64_t));
+  write_section(layout.parents_, parent_words.data(),
+                parent_words.size() * sizeof(uint64_t));
+  write_section(layout.parent_ranges_, parent_ranges.data(),
+                parent_ranges.size() * sizeof(uint64_t));
+  write_section(layout.children_, child_words.data(),
+                child_words.size() * sizeof(uint64_t));
+  write_section(layout.taxon_names_, taxon_name_block.data(), taxon_name_block.size());
+  if (!out) {
+    Failwith("SBNSnapshot could not write to " + path);
+  }
+}
+
+SBNSnapshot::SBNSnapshot(const std::string &path) {
+  const int file_descriptor = open(path.c_str(), O_RDONLY);
+  if (file_descriptor == -1) {
+    Failwith("SBNSnapshot could not open " + path);
+  }
+  struct stat file_status;
+  if (fstat(file_descriptor, &file_status) != 0) {
+    close(file_descriptor);
+    Failwith("SBNSnapshot could not get the size of " + path);
+  }
+  mapped_size_ = static_cast<size_t>(file_status.st_size);
+  if (mapped_size_ < sizeof(Header)) {
+    close(file_descriptor);
+    Failwith(path + " is too short to be an SBN snapshot.");
+  }
+  void *mapped_memory =
+      mmap(NULL, mapped_size_, PROT_READ, MAP_SHARED, file_descriptor, 0);
+  // The mapping keeps the file open, so we can close our descriptor.
+  close(file_descriptor);
+  if (mapped_memory == MAP_FAILED) {
+    Failwith("SBNSnapshot could not mmap " + path);
+  }
+  mapped_memory_ = static_cast<const char *>(mapped_memory);
+  header_ = reinterpret_cast<const Header *>(mapped_memory_);
+  const auto fail = [this](const std::string &message) {
+    munmap(const_cast<char *>(mapped_memory_), mapped_size_);
+    Failwith(message);
+  };
+  if (!std::equal(std::begin(snapshot_magic), std::end(snapshot_magic),
+                  header_->magic_)) {
+    fail(path + " is not an SBN snapshot.");
+  }
+  if (header_->byte_order_mark_ != byte_order_mark) {
+    fail(path + " was written on a machine with a different byte order.");
+  }
+  if (header_->version_ != version_) {
+    fail(path + " is an SBN snapshot of version " +
+         std::to_string(header_->version_) + ", but we can only read version " +
+         std::to_string(version_) + ".");
+  }
+  if (header_->rootsplit_count_ > header_->parameter_count_) {
+    fail(path + " has more rootsplits than SBN parameters.");
+  }
+  layout_ = LayoutOf(*header_);
+  if (layout_.file_size_ != mapped_size_) {
+    fail(path + " does not have the size given by its SBN snapshot header.");
+  }
+}
+
+SBNSnapshot::~SBNSnapshot() {
+  if (munmap(const_cast<char *>(mapped_memory_), mapped_size_) != 0) {
+    std::cout << "Warning: munmap did not succeed in SBNSnapshot: " << strerror(errno)
+              << std::endl;
+  }
+}
+
+StringVector SBNSnapshot::TaxonNames() const {
+  StringVector taxon_names;
+  taxon_names.reserve(TaxonCount());
+  const char *name = mapped_memory_ + layout_.taxon_names_;
+  const char *end = mapped_memory_ + layout_.file_size_;
+  while (name < end) {
+    const char *name_end = std::find(name, end, '\0');
+    taxon_names.emplace_back(name, name_end);
+    name = name_end + 1;
+  }
+  Assert(taxon_names.size() == TaxonCount(),
+         "SBN snapshot doesn't have the right number of taxon names.");
+  return taxon_names;
+}
+
+Bitset SBNSnapshot::Rootsplit(size_t rootsplit_idx) const {
+  Assert(rootsplit_idx < RootsplitCount(), "Rootsplit index out of range.");
+  const size_t taxon_words = Bitset::PackedWordCount(TaxonCount());
+  return Bitset::FromWords(TaxonCount(),
+                           WordsAt(layout_.rootsplits_) + rootsplit_idx * taxon_words);
+}
+
+Bitset SBNSnapshot::Parent(size_t parent_idx) const {
+  Assert(parent_idx < ParentCount(), "Parent index out of range.");
+  const size_t subsplit_words = Bitset::PackedWordCount(2 * TaxonCount());
+  return Bitset::FromWords(2 * TaxonCount(),
+                           WordsAt(layout_.parents_) + parent_idx * subsplit_words);
+}
+
+SBNSnapshot::Range SBNSnapshot::ParentRange(size_t parent_idx) const {
+  Assert(parent_idx < ParentCount(), "Parent index out of range.");
+  const uint64_t *range = WordsAt(layout_.parent_ranges_) + 2 * parent_idx;
+  return {range[0], range[1]};
+}
+
+Bitset SBNSnapshot::ChildChunk(size_t pcss_idx) const {
+  Assert(RootsplitCount() <= pcss_idx && pcss_idx < ParameterCount(),
+         "PCSS index out of range.");
+  const size_t taxon_words = Bitset::PackedWordCount(TaxonCount());
+  return Bitset::FromWords(
+      TaxonCount(),
+      WordsAt(layout_.children_) + (pcss_idx - RootsplitCount()) * taxon_words);
+}
+
+Eigen::Map<const EigenVectorXd> SBNSnapshot::SBNParameters() const {
+  return {reinterpret_cast<const double *>(mapped_memory_ + layout_.parameters_),
+          static_cast<Eigen::Index>(ParameterCount())};
+}
@@ -0,0 +1,107 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A versioned binary file format for a trained SBN: the taxon names, the
+// rootsplits, each parent subsplit with its range of children, the child of each
+// PCSS, and the SBN parameters. That is enough to rebuild indexer_ and the other
+// SBN maps of an SBNInstance without reading any trees.
+//
+// The file is a 64-byte header followed by these sections, each of which starts at
+// a multiple of 64 bytes:
+//
+// * the SBN parameters, as doubles;
+// * the rootsplits, with their bits packed into 64-bit words as in Bitset;
+// * the parent subsplits, packed in the same way;
+// * the [begin, end) range of each parent, as pairs of 64-bit integers;
+// * the child of each PCSS in sbn_parameters_ order, as the packed third chunk of
+//   the PCSS;
+// * the taxon names, each terminated by a null character.
+//
+// All numbers are in the byte order of the machine that wrote the file, and we
+// check that it matches on reading. Because the sections are aligned arrays, an
+// SBNSnapshot can read them in place from a read-only shared mapping of the file,
+// and processes that map the same snapshot share its pages.
+
+#ifndef SRC_SBN_SNAPSHOT_HPP_
+#define SRC_SBN_SNAPSHOT_HPP_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include "eigen_sugar.hpp"
+#include "sbn_maps.hpp"
+#include "sugar.hpp"
+
+class SBNSnapshot {
+ public:
+  using Range = std::pair<size_t, size_t>;
+
+  // Bump this whenever the layout changes.
+  static constexpr uint32_t version_ = 1;
+
+  // Map the snapshot at path read-only, checking its header and size.
+  explicit SBNSnapshot(const std::string &path);
+  ~SBNSnapshot();
+
+  SBNSnapshot(const SBNSnapshot &) = delete;
+  SBNSnapshot &operator=(const SBNSnapshot &) = delete;
+
+  // Write a snapshot of these SBN maps and parameters to path. The PCSS keys of
+  // the indexer give the children.
+  static void Write(const std::string &path, const StringVector &taxon_names,
+                    const BitsetVector &rootsplits,
+                    const BitsetSizePairMap &parent_to_range,
+                    const BitsetSizeMap &indexer, EigenConstVectorXdRef sbn_parameters);
+
+  size_t TaxonCount() const { return header_->taxon_count_; }
+  size_t RootsplitCount() const { return header_->rootsplit_count_; }
+  size_t ParentCount() const { return header_->parent_count_; }
+  size_t ParameterCount() const { return header_->parameter_count_; }
+
+  StringVector TaxonNames() const;
+  Bitset Rootsplit(size_t rootsplit_idx) const;
+  Bitset Parent(size_t parent_idx) const;
+  Range ParentRange(size_t parent_idx) const;
+  // The child chunk of the PCSS at this index of sbn_parameters_, which must be past
+  // the rootsplits.
+  Bitset ChildChunk(size_t pcss_idx) const;
+  // The parameters, read in place from the mapping.
+  Eigen::Map<const EigenVectorXd> SBNParameters() const;
+
+ private:
+  struct Header {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t byte_order_mark_;
+    uint64_t taxon_count_;
+    uint64_t rootsplit_count_;
+    uint64_t parent_count_;
+    uint64_t parameter_count_;
+    uint64_t taxon_names_size_;
+    uint64_t reserved_;
+  };
+  static_assert(sizeof(Header) == 64, "SBNSnapshot::Header should be 64 bytes.");
+
+  // The byte offsets of the sections in the file, along with the file size.
+  struct Layout {
+    size_t parameters_;
+    size_t rootsplits_;
+    size_t parents_;
+    size_t parent_ranges_;
+    size_t children_;
+    size_t taxon_names_;
+    size_t file_size_;
+  };
+  static Layout LayoutOf(const Header &header);
+
+  const char *mapped_memory_ = nullptr;
+  size_t mapped_size_ = 0;
+  const Header *header_ = nullptr;
+  Layout layout_;
+
+  const uint64_t *WordsAt(size_t offset) const {
+    return reinterpret_cast<const uint64_t *>(mapped_memory_ + offset);
+  }
+};
+
+#endif  // SRC_SBN_SNAPSHOT_HPP_
@@ -0,0 +1,447 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "shared_memory_engine.hpp"
+
+#include <pthread.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "tree_collection_cache.hpp"
+
+// The control block, which lives in its own shared memory object. The driver fills
+// the sizes and names, initializes the synchronization, and sets the magic number
+// last, so a worker that sees the magic number sees the rest. Everything after that
+// is guarded by mutex_.
+struct SharedMemoryEngine::Control {
+  // Arbitrary, so that a stray shared memory object doesn't pass for a control block.
+  static constexpr uint64_t magic_number_ = 0x6c696273626e0001;
+  static constexpr size_t name_capacity_ = 64;
+  static constexpr size_t error_capacity_ = 1024;
+
+  uint64_t magic_;
+  uint64_t taxon_count_;
+  uint64_t pattern_count_;
+  // The number of words of each packed pattern.
+  uint64_t word_count_;
+  uint64_t tree_capacity_;
+  uint64_t param_count_;
+  char substitution_[name_capacity_];
+  char site_[name_capacity_];
+  char clock_[name_capacity_];
+
+  pthread_mutex_t mutex_;
+  // Signalled when the driver posts a request or stops.
+  pthread_cond_t request_;
+  // Signalled when a worker comes or goes, or the trees of a request are done.
+  pthread_cond_t progress_;
+  uint64_t worker_count_;
+  bool stopping_;
+  // The request: compute trees [0, tree_count_), handing them out chunk_size_ at a
+  // time from next_tree_.
+  bool computing_gradients_;
+  bool rescaling_;
+  uint64_t tree_count_;
+  uint64_t chunk_size_;
+  uint64_t next_tree_;
+  uint64_t finished_tree_count_;
+  // The first error that a worker hit in this request, if any.
+  char error_[error_capacity_];
+};
+
+// The shared buffers. Trees have a row in each of the tree buffers, of which only
+// the first entries are used by trees with fewer nodes than the maximum.
+struct SharedMemoryEngine::Buffers {
+  using PatternMatrix =
+      Eigen::Matrix<uint64_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+  using NodeCountVector = Eigen::Matrix<uint64_t, Eigen::Dynamic, 1>;
+  using ParentIdMatrix =
+      Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+  MmappedMatrix<PatternMatrix> patterns_;
+  MmappedMatrix<EigenVectorXd> weights_;
+  MmappedMatrix<NodeCountVector> node_counts_;
+  MmappedMatrix<ParentIdMatrix> parent_ids_;
+  MmappedMatrix<EigenMatrixXd> branch_lengths_;
+  MmappedMatrix<EigenMatrixXd> params_;
+  MmappedMatrix<EigenVectorXd> log_likelihoods_;
+  MmappedMatrix<EigenMatrixXd> branch_gradients_;
+
+  // We give the parameters at least one column, as we can't map zero bytes.
+  Buffers(const std::string &name, const Control &control, MmapBacking backing)
+      : patterns_(name + "_p", control.taxon_count_, control.word_count_, backing),
+        weights_(name + "_w", control.pattern_count_, 1, backing),
+        node_counts_(name + "_n", control.tree_capacity_, 1, backing),
+        parent_ids_(name + "_t", control.tree_capacity_,
+                    MaxNodeCountOf(control.taxon_count_) - 1, backing),
+        branch_lengths_(name + "_b", control.tree_capacity_,
+                        MaxNodeCountOf(control.taxon_count_), backing),
+        params_(name + "_m", control.tree_capacity_,
+                std::max<uint64_t>(control.param_count_, 1), backing),
+        log_likelihoods_(name + "_l", control.tree_capacity_, 1, backing),
+        branch_gradients_(name + "_g", control.tree_capacity_,
+                          MaxNodeCountOf(control.taxon_count_), backing) {}
+
+  // The node count of a rooted tree, which is one more than that of an unrooted one,
+  // and the number of columns of the branch gradients.
+  static size_t MaxNodeCountOf(size_t taxon_count) { return 2 * taxon_count - 1; }
+};
+
+namespace {
+
+// Hold the mutex of a Control for the lifetime of this object.
+class ControlLock {
+ public:
+  explicit ControlLock(pthread_mutex_t *mutex) : mutex_(mutex) {
+    pthread_mutex_lock(mutex_);
+  }
+  ~ControlLock() { pthread_mutex_unlock(mutex_); }
+  ControlLock(const ControlLock &) = delete;
+  ControlLock &operator=(const ControlLock &) = delete;
+
+  void Wait(pthread_cond_t *condition) { pthread_cond_wait(condition, mutex_); }
+
+ private:
+  pthread_mutex_t *mutex_;
+};
+
+void CopyName(const std::string &name, char *destination, size_t capacity) {
+  if (name.size() >= capacity) {
+    Failwith("SharedMemoryEngine can't take the model name " + name + ".");
+  }
+  std::memcpy(destination, name.c_str(), name.size() + 1);
+}
+
+// Copy as much of the message as fits.
+void CopyError(const std::string &message, char *destination, size_t capacity) {
+  const size_t length = std::min(message.size(), capacity - 1);
+  std::memcpy(destination, message.data(), length);
+  destination[length] = '\0';
+}
+
+std::string ControlNameOf(const std::string &name) { return name + "_c"; }
+
+// The number of 64-bit words of the control block.
+size_t ControlWordCount(size_t control_size) { return (control_size + 7) / 8; }
+
+}  // namespace
+
+SharedMemoryEngine::SharedMemoryEngine(
+    const std::string &name, const PhyloModelSpecification &model_specification,
+    const SitePattern &site_pattern, size_t tree_capacity)
+    : name_(name), phylo_model_(PhyloModel::OfSpecification(model_specification)) {
+  Assert(tree_capacity > 0, "A SharedMemoryEngine needs room for at least one tree.");
+  const auto &patterns = site_pattern.GetPackedPatterns();
+  // The sizes go in a Control on the stack first, so that we can size the buffers
+  // before we have the shared control block.
+  Control sizes;
+  sizes.taxon_count_ = site_pattern.SequenceCount();
+  sizes.pattern_count_ = site_pattern.PatternCount();
+  sizes.word_count_ = patterns.at(0).Words().size();
+  sizes.tree_capacity_ = tree_capacity;
+  sizes.param_count_ = GetPhyloModelBlockSpecification().ParameterCount();
+  buffers_ = std::make_unique<Buffers>(name_, sizes, MmapBacking::SharedMemory);
+  auto patterns_matrix = buffers_->patterns_.Get();
+  for (size_t taxon_idx = 0; taxon_idx < patterns.size(); taxon_idx++) {
+    const auto &words = patterns[taxon_idx].Words();
+    std::copy(words.begin(), words.end(), patterns_matrix.row(taxon_idx).data());
+  }
+  const auto &weights = site_pattern.GetWeights();
+  std::copy(weights.begin(), weights.end(), buffers_->weights_.Get().data());
+
+  control_matrix_ = std::make_unique<ControlMatrix>(
+      ControlNameOf(name_), ControlWordCount(sizeof(Control)), 1,
+      MmapBacking::SharedMemory);
+  control_ = ControlOf(*control_matrix_);
+  *control_ = sizes;
+  CopyName(model_specification.substitution_, control_->substitution_,
+           Control::name_capacity_);
+  CopyName(model_specification.site_, control_->site_, Control::name_capacity_);
+  CopyName(model_specification.clock_, control_->clock_, Control::name_capacity_);
+  pthread_mutexattr_t mutex_attributes;
+  pthread_mutexattr_init(&mutex_attributes);
+  pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&control_->mutex_, &mutex_attributes);
+  pthread_mutexattr_destroy(&mutex_attributes);
+  pthread_condattr_t condition_attributes;
+  pthread_condattr_init(&condition_attributes);
+  pthread_condattr_setpshared(&condition_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&control_->request_, &condition_attributes);
+  pthread_cond_init(&control_->progress_, &condition_attributes);
+  pthread_condattr_destroy(&condition_attributes);
+  control_->worker_count_ = 0;
+  control_->stopping_ = false;
+  control_->tree_count_ = 0;
+  control_->next_tree_ = 0;
+  control_->finished_tree_count_ = 0;
+  control_->error_[0] = '\0';
+  __atomic_store_n(&control_->magic_, Control::magic_number_, __ATOMIC_RELEASE);
+}
+
+SharedMemoryEngine::~SharedMemoryEngine() {
+  // We leave the mutex and condition variables be, as workers may still be using
+  // them on their way out. The shared memory goes away once they have unmapped it.
+  ControlLock lock(&control_->mutex_);
+  control_->stopping_ = true;
+  pthread_cond_broadcast(&control_->request_);
+}
+
+SharedMemoryEngine::Control *SharedMemoryEngine::ControlOf(
+    ControlMatrix &control_matrix) {
+  return reinterpret_cast<Control *>(control_matrix.Get().data());
+}
+
+size_t SharedMemoryEngine::TreeCapacity() const { return control_->tree_capacity_; }
+
+size_t SharedMemoryEngine::WorkerCount() const {
+  ControlLock lock(&control_->mutex_);
+  return control_->worker_count_;
+}
+
+void SharedMemoryEngine::WaitForWorkers(size_t worker_count) const {
+  ControlLock lock(&control_->mutex_);
+  while (control_->worker_count_ < worker_count) {
+    lock.Wait(&control_->progress_);
+  }
+}
+
+void SharedMemoryEngine::ServeWorker(const std::string &name, size_t thread_count,
+                                     const std::vector<BeagleFlags> &beagle_flag_vector,
+                                     bool use_tip_states) {
+  ControlMatrix control_matrix(ControlNameOf(name), ControlWordCount(sizeof(Control)),
+                               1, MmapBacking::AttachedSharedMemory);
+  Control *control = ControlOf(control_matrix);
+  if (__atomic_load_n(&control->magic_, __ATOMIC_ACQUIRE) != Control::magic_number_) {
+    Failwith("The SharedMemoryEngine " + name + " isn't ready for workers.");
+  }
+  Buffers buffers(name, *control, MmapBacking::AttachedSharedMemory);
+  const size_t taxon_count = control->taxon_count_;
+  const size_t param_count = control->param_count_;
+
+  std::vector<PackedSymbols> patterns;
+  const auto patterns_matrix = buffers.patterns_.Get();
+  for (size_t taxon_idx = 0; taxon_idx < taxon_count; taxon_idx++) {
+    patterns.push_back(PackedSymbols::OfWords(control->pattern_count_,
+                                              patterns_matrix.row(taxon_idx).data()));
+  }
+  const auto weights_vector = buffers.weights_.Get();
+  std::vector<double> weights(weights_vector.data(),
+                              weights_vector.data() + weights_vector.size());
+  PhyloModelSpecification model_specification;
+  model_specification.substitution_ = control->substitution_;
+  model_specification.site_ = control->site_;
+  model_specification.clock_ = control->clock_;
+  const Engine engine({thread_count, beagle_flag_vector, use_tip_states},
+                      model_specification,
+                      SitePattern::OfPackedPatterns(std::move(patterns), weights));
+  // The trees only need names for their taxon count.
+  std::vector<std::string> taxon_names;
+  for (size_t taxon_idx = 0; taxon_idx < taxon_count; taxon_idx++) {
+    taxon_names.push_back(std::to_string(taxon_idx));
+  }
+  const auto tag_taxon_map = UnrootedTreeCollection::TagStringMapOf(taxon_names);
+
+  {
+    ControlLock lock(&control->mutex_);
+    control->worker_count_++;
+    pthread_cond_broadcast(&control->progress_);
+  }
+  size_t done_tree_count = 0;
+  std::string error;
+  while (true) {
+    size_t tree_begin, tree_end;
+    bool computing_gradients, rescaling;
+    {
+      ControlLock lock(&control->mutex_);
+      if (done_tree_count > 0) {
+        if (!error.empty() && control->error_[0] == '\0') {
+          CopyError(error, control->error_, Control::error_capacity_);
+        }
+        control->finished_tree_count_ += done_tree_count;
+        if (control->finished_tree_count_ == control->tree_count_) {
+          pthread_cond_broadcast(&control->progress_);
+        }
+      }
+      while (!control->stopping_ && control->next_tree_ >= control->tree_count_) {
+        lock.Wait(&control->request_);
+      }
+      if (control->stopping_) {
+        control->worker_count_--;
+        pthread_cond_broadcast(&control->progress_);
+        return;
+      }  // else
+      tree_begin = control->next_tree_;
+      tree_end = std::min(tree_begin + control->chunk_size_, control->tree_count_);
+      control->next_tree_ = tree_end;
+      computing_gradients = control->computing_gradients_;
+      rescaling = control->rescaling_;
+    }
+    const size_t tree_count = tree_end - tree_begin;
+    done_tree_count = tree_count;
+    error.clear();
+    try {
+      TreeCollectionCache::TreeSections sections;
+      const auto node_counts = buffers.node_counts_.Get();
+      const auto parent_ids = buffers.parent_ids_.Get();
+      const auto branch_lengths = buffers.branch_lengths_.Get();
+      const auto params = buffers.params_.Get();
+      auto all_log_likelihoods = buffers.log_likelihoods_.Get();
+      auto all_branch_gradients = buffers.branch_gradients_.Get();
+      for (size_t tree_idx = tree_begin; tree_idx < tree_end; tree_idx++) {
+        const size_t node_count = node_counts(tree_idx);
+        const uint32_t *tree_parent_ids = parent_ids.row(tree_idx).data();
+        const double *tree_branch_lengths = branch_lengths.row(tree_idx).data();
+        sections.node_offsets_.push_back(sections.node_offsets_.back() + node_count);
+        sections.parent_ids_.insert(sections.parent_ids_.end(), tree_parent_ids,
+                                    tree_parent_ids + node_count - 1);
+        sections.branch_lengths_.insert(sections.branch_lengths_.end(),
+                                        tree_branch_lengths,
+                                        tree_branch_lengths + node_count);
+      }
+      const UnrootedTreeCollection tree_collection(
+          TreeCollectionCache::UnrootedTreesOf(sections, taxon_count), tag_taxon_map);
+      EigenMatrixXd phylo_model_params =
+          params.middleRows(tree_begin, tree_count).leftCols(param_count);
+      auto log_likelihoods = all_log_likelihoods.segment(tree_begin, tree_count);
+      if (computing_gradients) {
+        engine.BranchGradients(tree_collection, phylo_model_params, rescaling,
+                               log_likelihoods,
+                               all_branch_gradients.middleRows(tree_begin, tree_count));
+      } else {
+        engine.LogLikelihoods(tree_collection, phylo_model_params, rescaling,
+                              log_likelihoods);
+      }
+    } catch (const std::exception &exception) {
+      error = exception.what();
+    }
+  }
+}
+
+void SharedMemoryEngine::Call(const UnrootedTreeCollection &tree_collection,
+                              const EigenMatrixXdRef phylo_model_params,
+                              const bool rescaling, EigenVectorXdRef log_likelihoods,
+                              EigenMatrixXdRef *branch_gradients) const {
+  std::lock_guard<std::mutex> call_lock(call_mutex_);
+  const size_t tree_count = tree_collection.TreeCount();
+  const size_t param_count = control_->param_count_;
+  Assert(static_cast<size_t>(log_likelihoods.size()) == tree_count,
+         "SharedMemoryEngine needs a log likelihood entry for every tree.");
+  Assert(static_cast<size_t>(phylo_model_params.rows()) >= tree_count &&
+             static_cast<size_t>(phylo_model_params.cols()) == param_count,
+         "SharedMemoryEngine needs a row of phylogenetic model parameters for every "
+         "tree.");
+  Assert(tree_collection.TaxonCount() == control_->taxon_count_,
+         "SharedMemoryEngine got trees with the wrong number of taxa.");
+  const size_t max_node_count = Buffers::MaxNodeCountOf(control_->taxon_count_);
+  if (branch_gradients != nullptr) {
+    Assert(static_cast<size_t>(branch_gradients->cols()) == max_node_count,
+           "The branch gradient matrix needs a column for every node.");
+  }
+  if (tree_count > control_->tree_capacity_) {
+    Failwith("This SharedMemoryEngine can take at most " +
+             std::to_string(control_->tree_capacity_) + " trees at once.");
+  }
+  if (tree_count == 0) {
+    return;
+  }  // else
+  const auto sections = TreeCollectionCache::SectionsOf(tree_collection);
+  auto node_counts = buffers_->node_counts_.Get();
+  auto parent_ids = buffers_->parent_ids_.Get();
+  auto branch_lengths = buffers_->branch_lengths_.Get();
+  for (size_t tree_idx = 0; tree_idx < tree_count; tree_idx++) {
+    const size_t node_begin = sections.node_offsets_[tree_idx];
+    const size_t node_count = sections.node_offsets_[tree_idx + 1] - node_begin;
+    Assert(node_count <= max_node_count,
+           "SharedMemoryEngine got a tree with too many nodes.");
+    node_counts(tree_idx) = node_count;
+    // The roots have no parent ids.
+    const auto parent_id_begin = sections.parent_ids_.begin() + node_begin - tree_idx;
+    std::copy(parent_id_begin, parent_id_begin + node_count - 1,
+              parent_ids.row(tree_idx).data());
+    const auto branch_length_begin = sections.branch_lengths_.begin() + node_begin;
+    std::copy(branch_length_begin, branch_length_begin + node_count,
+              branch_lengths.row(tree_idx).data());
+  }
+  buffers_->params_.Get().topRows(tree_count).leftCols(param_count) =
+      phylo_model_params.topRows(tree_count);
+
+  std::string error;
+  {
+    ControlLock lock(&control_->mutex_);
+    if (control_->worker_count_ == 0) {
+      Failwith("The SharedMemoryEngine " + name_ + " has no workers.");
+    }
+    control_->computing_gradients_ = (branch_gradients != nullptr);
+    control_->rescaling_ = rescaling;
+    control_->error_[0] = '\0';
+    control_->finished_tree_count_ = 0;
+    control_->next_tree_ = 0;
+    // Two chunks per worker lets faster workers take more trees.
+    control_->chunk_size_ = std::max<size_t>(
+        1, (tree_count + 2 * control_->worker_count_ - 1) /
+               (2 * control_->worker_count_));
+    control_->tree_count_ = tree_count;
+    pthread_cond_broadcast(&control_->request_);
+    while (control_->finished_tree_count_ < tree_count) {
+      lock.Wait(&control_->progress_);
+    }
+    control_->tree_count_ = 0;
+    control_->next_tree_ = 0;
+    error = control_->error_;
+  }
+  if (!error.empty()) {
+    Failwith("A SharedMemoryEngine worker couldn't compute its trees: " + error);
+  }
+  log_likelihoods = buffers_->log_likelihoods_.Get().head(tree_count);
+  if (branch_gradients != nullptr) {
+    *branch_gradients = buffers_->branch_gradients_.Get().topRows(tree_count);
+  }
+}
+
+std::vector<double> SharedMemoryEngine::LogLikelihoods(
+    const UnrootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  std::vector<double> results(tree_collection.TreeCount());
+  Eigen::Map<EigenVectorXd> results_map(results.data(), results.size());
+  Call(tree_collection, phylo_model_params, rescaling, results_map, nullptr);
+  return results;
+}
+
+std::vector<UnrootedTreeGradient> SharedMemoryEngine::Gradients(
+    const UnrootedTreeCollection &tree_collection,
+    const EigenMatrixXdRef phylo_model_params, const bool rescaling) const {
+  EigenVectorXd log_likelihoods(tree_collection.TreeCount());
+  EigenMatrixXd branch_gradients(tree_collection.TreeCount(),
+                                 2 * tree_collection.TaxonCount() - 1);
+  EigenMatrixXdRef branch_gradients_ref(branch_gradients);
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods,
+       &branch_gradients_ref);
+  std::vector<UnrootedTreeGradient> gradients;
+  for (size_t tree_number = 0; tree_number < tree_collection.TreeCount();
+       tree_number++) {
+    const auto row = branch_gradients.row(tree_number);
+    gradients.push_back({log_likelihoods(tree_number),
+                         std::vector<double>(row.data(), row.data() + row.size()),
+                         {},
+                         {}});
+  }
+  return gradients;
+}
+
+void SharedMemoryEngine::LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                                        const EigenMatrixXdRef phylo_model_params,
+                                        const bool rescaling,
+                                        EigenVectorXdRef log_likelihoods) const {
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods, nullptr);
+}
+
+void SharedMemoryEngine::BranchGradients(const UnrootedTreeCollection &tree_collection,
+                                         const EigenMatrixXdRef phylo_model_params,
+                                         const bool rescaling,
+                                         EigenVectorXdRef log_likelihoods,
+                                         EigenMatrixXdRef branch_gradients) const {
+  Assert(branch_gradients.rows() == log_likelihoods.size(),
+         "SharedMemoryEngine needs a row of branch gradients for every tree.");
+  Call(tree_collection, phylo_model_params, rescaling, log_likelihoods,
+       &branch_gradients);
+}
@@ -0,0 +1,163 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A SharedMemoryEngine hands likelihood and gradient computation for batches of
+// unrooted trees to worker processes on the same machine, through POSIX shared memory
+// rather than pipes and pickles.
+//
+// The driver process makes the SharedMemoryEngine, which makes shared memory objects
+// named after it, each mapped as an MmappedMatrix:
+//
+// * the compressed site patterns, packed as in PackedSymbols, and their weights;
+// * for up to the tree capacity of trees, the node count, parent ids and branch lengths
+//   of each tree, as in the tree sections of tree_collection_cache.hpp, and its row of
+//   phylogenetic model parameters;
+// * the log likelihood and branch gradients of each tree;
+// * a control block with the sizes, the phylogenetic model specification, and a
+//   process-shared mutex and condition variables for requests.
+//
+// Workers are other processes, started separately, that call ServeWorker with the
+// name. Each makes its SitePattern from the shared patterns, so nobody compresses the
+// alignment again, and makes its own Engine with the threads and BEAGLE flags that it
+// is given. The memory of an Engine is allocated by the worker that uses it, so a
+// worker started on a NUMA node with `numactl --cpunodebind=N --membind=N` keeps its
+// BEAGLE buffers local. The driver has no Engine.
+//
+// For each call the driver writes the trees and parameters into the shared buffers
+// and posts a request. The workers then take chunks of the trees until there are none
+// left, compute them, and write the results into the shared buffers, so faster
+// workers take more trees. The driver waits for all of the trees to be done.
+// A worker that dies in the middle of a request leaves the driver waiting.
+
+#ifndef SRC_SHARED_MEMORY_ENGINE_HPP_
+#define SRC_SHARED_MEMORY_ENGINE_HPP_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "driver.hpp"
+#include "engine.hpp"
+#include "mmapped_matrix.hpp"
+
+class SharedMemoryEngine {
+ public:
+  // Make the shared memory for these site patterns, with room for batches of up to
+  // tree_capacity trees. The name is a POSIX shared memory name, such as "/libsbn". It
+  // has to be free, and macOS allows at most 31 characters for the name together with
+  // a two-character suffix.
+  SharedMemoryEngine(const std::string &name,
+                     const PhyloModelSpecification &model_specification,
+                     const SitePattern &site_pattern, size_t tree_capacity);
+  // Tell the workers to return from ServeWorker, and unlink the shared memory.
+  ~SharedMemoryEngine();
+  SharedMemoryEngine(const SharedMemoryEngine &) = delete;
+  SharedMemoryEngine &operator=(const SharedMemoryEngine &) = delete;
+
+  const BlockSpecification &GetPhyloModelBlockSpecification() const {
+    return phylo_model_->GetBlockSpecification();
+  }
+  const std::string &GetName() const { return name_; }
+  size_t TreeCapacity() const;
+  // The number of workers serving us right now.
+  size_t WorkerCount() const;
+  // Wait until at least worker_count workers are serving us.
+  void WaitForWorkers(size_t worker_count) const;
+
+  // Attach to the shared memory of this name and compute for its driver with an
+  // Engine of thread_count threads, until the driver goes away.
+  static void ServeWorker(const std::string &name, size_t thread_count,
+                          const std::vector<BeagleFlags> &beagle_flag_vector = {},
+                          bool use_tip_states = true);
+
+  // These are as for the Engine methods of the same names. We fail if there are no
+  // workers.
+  std::vector<double> LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                                     const EigenMatrixXdRef phylo_model_params,
+                                     const bool rescaling) const;
+  std::vector<UnrootedTreeGradient> Gradients(
+      const UnrootedTreeCollection &tree_collection,
+      const EigenMatrixXdRef phylo_model_params, const bool rescaling) const;
+  void LogLikelihoods(const UnrootedTreeCollection &tree_collection,
+                      const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                      EigenVectorXdRef log_likelihoods) const;
+  void BranchGradients(const UnrootedTreeCollection &tree_collection,
+                       const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+                       EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients) const;
+
+ private:
+  struct Control;
+  struct Buffers;
+  // Mapping the control block; see Control.
+  using ControlMatrix = MmappedMatrix<Eigen::Matrix<uint64_t, Eigen::Dynamic, 1>>;
+
+  const std::string name_;
+  const std::unique_ptr<PhyloModel> phylo_model_;
+  std::unique_ptr<Buffers> buffers_;
+  std::unique_ptr<ControlMatrix> control_matrix_;
+  Control *control_;
+  // The driver makes one call at a time.
+  mutable std::mutex call_mutex_;
+
+  static Control *ControlOf(ControlMatrix &control_matrix);
+  void Call(const UnrootedTreeCollection &tree_collection,
+            const EigenMatrixXdRef phylo_model_params, const bool rescaling,
+            EigenVectorXdRef log_likelihoods, EigenMatrixXdRef *branch_gradients) const;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("SharedMemoryEngine") {
+  // A worker thread stands in for a worker process here.
+  const auto trees = UnrootedTreeCollection::OfTreeCollection(
+      Driver().ParseNexusFile("data/DS1.subsampled_10.t"));
+  const SitePattern site_pattern(Alignment::ReadFasta("data/DS1.fasta"),
+                                 trees.TagTaxonMap());
+  const PhyloModelSpecification model_specification{"JC69", "constant", "strict"};
+  const std::vector<BeagleFlags> beagle_flag_vector;
+  const Engine engine({2, beagle_flag_vector, true}, model_specification,
+                      site_pattern);
+  const std::string name = "/libsbn_test_" + std::to_string(getpid());
+  CHECK_THROWS(SharedMemoryEngine::ServeWorker(name, 1));
+  auto shared_memory_engine = std::make_unique<SharedMemoryEngine>(
+      name, model_specification, site_pattern, trees.TreeCount());
+  CHECK_THROWS(SharedMemoryEngine(name, model_specification, site_pattern, 1));
+  EigenMatrixXd phylo_model_params(
+      trees.TreeCount(), engine.GetPhyloModelBlockSpecification().ParameterCount());
+  phylo_model_params.setZero();
+  CHECK_EQ(shared_memory_engine->WorkerCount(), 0);
+  CHECK_THROWS(shared_memory_engine->LogLikelihoods(trees, phylo_model_params, false));
+  std::thread worker([&name] { SharedMemoryEngine::ServeWorker(name, 2); });
+  shared_memory_engine->WaitForWorkers(1);
+  CHECK_EQ(shared_memory_engine->LogLikelihoods(trees, phylo_model_params, false),
+           engine.LogLikelihoods(trees, phylo_model_params, false));
+  const size_t node_count = 2 * trees.TaxonCount() - 1;
+  EigenVectorXd log_likelihoods(trees.TreeCount());
+  EigenMatrixXd expected_gradients(trees.TreeCount(), node_count);
+  engine.BranchGradients(trees, phylo_model_params, false, log_likelihoods,
+                         expected_gradients);
+  const auto gradients =
+      shared_memory_engine->Gradients(trees, phylo_model_params, false);
+  REQUIRE_EQ(gradients.size(), trees.TreeCount());
+  for (size_t tree_idx = 0; tree_idx < trees.TreeCount(); tree_idx++) {
+    CHECK_EQ(gradients[tree_idx].log_likelihood_, log_likelihoods(tree_idx));
+    for (size_t node_id = 0; node_id < node_count; node_id++) {
+      CHECK_EQ(gradients[tree_idx].branch_lengths_[node_id],
+               expected_gradients(tree_idx, node_id));
+    }
+  }
+  // Batches beyond the capacity don't fit.
+  auto too_many_trees = trees.Trees();
+  too_many_trees.push_back(trees.GetTree(0));
+  EigenMatrixXd too_many_params(too_many_trees.size(), phylo_model_params.cols());
+  CHECK_THROWS(shared_memory_engine->LogLikelihoods(
+      UnrootedTreeCollection(too_many_trees, trees.TagTaxonMap()), too_many_params,
+      false));
+  // Letting go of the engine stops the worker.
+  shared_memory_engine.reset();
+  worker.join();
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_SHARED_MEMORY_ENGINE_HPP_
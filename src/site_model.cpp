@@ -26,6 +26,9 @@ std::unique_ptr<SiteModel> SiteModel::OfSpecification(
 void WeibullSiteModel::SetParameters(const EigenVectorXdRef param_vector) {
   GetBlockSpecification().CheckParameterVectorSize(param_vector);
   EigenVectorXd shape = ExtractSegment(param_vector, shape_key_);
+  if (shape[0] == shape_) {
+    return;
+  }  // else
   shape_ = shape[0];
   UpdateRates();
 }
@@ -34,16 +37,33 @@ void WeibullSiteModel::SetParameters(const EigenVectorXdRef param_vector) {
 // Equivalent to the discretized gamma method in Yang 1994.
 // The scale (lambda) is fixed to 1
 void WeibullSiteModel::UpdateRates() {
-  double mean = 0;
-  for (size_t i = 0; i < category_count_; i++) {
-    double quantile = (2.0 * i + 1.0) / (2.0 * category_count_);
-    // Set rate to inverse CDF at quantile.
-    category_rates_[i] = pow(-std::log(1.0 - quantile), 1.0 / shape_);
-    mean += category_rates_[i];
-  }
-  mean /= category_count_;
-  for (int i = 0; i < category_count_; i++) {
-    category_rates_[i] /= mean;
+  EigenVectorXd shapes(1);
+  shapes << shape_;
+  EigenMatrixXd rates;
+  RatesOfShapes(shapes, rates);
+  category_rates_ = rates.row(0).transpose();
+}
+
+// The unnormalized rate of category i is the inverse CDF at its median quantile,
+// r_i = exp(l_i / k) where l_i is log(-log(1 - quantile)) and k is the shape, and we
+// divide by the mean. Differentiating, the derivative of rate i with respect to k is
+// -rate_i (l_i - sum_j rate_j l_j / n) / k^2.
+void WeibullSiteModel::RatesOfShapes(const EigenVectorXd& shapes,
+                                     EigenMatrixXd& rates,
+                                     EigenMatrixXd* rate_derivatives) const {
+  const Eigen::ArrayXd inverse_shapes = shapes.array().inverse();
+  rates = (inverse_shapes.matrix() * log_quantile_terms_).array().exp().matrix();
+  const Eigen::ArrayXd means = rates.rowwise().mean().array();
+  rates.array().colwise() /= means;
+  if (rate_derivatives != nullptr) {
+    const Eigen::ArrayXd weighted_means =
+        (rates * log_quantile_terms_.transpose()).array() /
+        static_cast<double>(category_count_);
+    Eigen::ArrayXXd centered =
+        (-weighted_means).replicate(1, category_count_).rowwise() +
+        log_quantile_terms_.array();
+    centered.colwise() *= -inverse_shapes.square();
+    *rate_derivatives = (rates.array() * centered).matrix();
   }
 }
 
@@ -53,8 +53,11 @@ class WeibullSiteModel : public SiteModel {
         shape_(shape) {
     category_rates_.resize(category_count);
     category_proportions_.resize(category_count);
+    log_quantile_terms_.resize(category_count);
     for (int i = 0; i < category_count; i++) {
       category_proportions_[i] = 1.0 / category_count;
+      double quantile = (2.0 * i + 1.0) / (2.0 * category_count);
+      log_quantile_terms_[i] = std::log(-std::log(1.0 - quantile));
     }
     UpdateRates();
   }
@@ -63,8 +66,16 @@ class WeibullSiteModel : public SiteModel {
   const EigenVectorXd& GetCategoryRates() const override;
   const EigenVectorXd& GetCategoryProportions() const override;
 
+  // Setting the shape that we already have doesn't recompute the rates.
   void SetParameters(const EigenVectorXdRef param_vector) override;
 
+  // The category rates for a batch of shapes, with one row per shape, computed
+  // together. If rate_derivatives isn't null, it gets the derivatives of the rates
+  // with respect to the shape. This doesn't touch the state of the model, so we can
+  // use it for per-tree shapes.
+  void RatesOfShapes(const EigenVectorXd& shapes, EigenMatrixXd& rates,
+                     EigenMatrixXd* rate_derivatives = nullptr) const;
+
   inline const static std::string rates_key_ = "Weibull category rates";
   inline const static std::string proportions_key_ = "Weibull category proportions";
   inline const static std::string shape_key_ = "Weibull shape";
@@ -74,6 +85,9 @@ class WeibullSiteModel : public SiteModel {
 
   size_t category_count_;
   double shape_;  // shape of the Weibull distribution
+  // log(-log(1 - quantile)) for the median quantile of each category, which doesn't
+  // depend on the shape.
+  Eigen::RowVectorXd log_quantile_terms_;
   EigenVectorXd category_rates_;
   EigenVectorXd category_proportions_;
 };
@@ -104,6 +118,31 @@ TEST_CASE("SiteModel") {
   // Test 4: Check sum rates[i]*proportions[i]==1.
   CHECK_LT(fabs(rates.dot(proportions) - 1.), 0.0001);
   CHECK_LT(fabs(rates2.dot(proportions) - 1.), 0.0001);
+
+  // Test 5: A batch of shapes gives the rates of each shape, and the derivatives
+  // agree with finite differences.
+  EigenVectorXd shapes(3);
+  shapes << 0.1, 1.0, 2.5;
+  EigenMatrixXd batch_rates, batch_derivatives;
+  weibull_model->RatesOfShapes(shapes, batch_rates, &batch_derivatives);
+  REQUIRE_EQ(batch_rates.rows(), 3);
+  REQUIRE_EQ(batch_rates.cols(), 4);
+  const double step = 1e-6;
+  for (Eigen::Index row = 0; row < shapes.size(); row++) {
+    param_vector << shapes[row];
+    weibull_model->SetParameters(param_vector);
+    CheckVectorXdEquality(batch_rates.row(row).transpose(),
+                          weibull_model->GetCategoryRates(), 1e-12);
+    param_vector << shapes[row] + step;
+    weibull_model->SetParameters(param_vector);
+    const EigenVectorXd rates_above = weibull_model->GetCategoryRates();
+    param_vector << shapes[row] - step;
+    weibull_model->SetParameters(param_vector);
+    const EigenVectorXd finite_difference =
+        (rates_above - weibull_model->GetCategoryRates()) / (2. * step);
+    CheckVectorXdEquality(batch_derivatives.row(row).transpose(), finite_difference,
+                          1e-5);
+  }
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
@@ -2,13 +2,19 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "site_pattern.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 #include "intpack.hpp"
 #include "sugar.hpp"
+#include "task_processor.hpp"
 
 // DNA assumption here.
 CharIntMap SitePattern::GetSymbolTable() {
@@ -35,6 +41,28 @@ CharIntMap SitePattern::GetSymbolTable() {
   return table;
 }
 
+namespace {
+
+// The same table as GetSymbolTable, indexed by the character as an unsigned byte,
+// with -1 for characters that aren't symbols.
+constexpr std::array<int8_t, 256> symbol_decode_table = [] {
+  std::array<int8_t, 256> table{};
+  for (size_t c = 0; c < table.size(); c++) {
+    table[c] = -1;
+  }
+  const char *nucleotides = "ACGT";
+  for (int8_t symbol = 0; symbol < 4; symbol++) {
+    table[static_cast<unsigned char>(nucleotides[symbol])] = symbol;
+    table[static_cast<unsigned char>(nucleotides[symbol] - 'A' + 'a')] = symbol;
+  }
+  for (const char *gap = "-NX?KMRUWY"; *gap != '\0'; gap++) {
+    table[static_cast<unsigned char>(*gap)] = 4;
+  }
+  return table;
+}();
+
+}  // namespace
+
 int SitePattern::SymbolTableAt(const CharIntMap &symbol_table, char c) {
   auto search = symbol_table.find(c);
   if (search == symbol_table.end()) {
@@ -54,58 +82,221 @@ SymbolVector SitePattern::SymbolVectorOf(const CharIntMap &symbol_table,
   return v;
 }
 
-struct IntVectorHasher {
-  int operator()(const std::vector<int> &values) const {
-    int hash = values[0];
-    for (size_t i = 1; i < values.size(); i++) {
-      hash ^= values[i] + 0x9e3779b9 + (hash << 6) + (hash >> 2);
-    }
-    return hash;
+int SitePattern::DecodeSymbol(char c) {
+  const int symbol = symbol_decode_table[static_cast<unsigned char>(c)];
+  if (symbol < 0) {
+    char error[50];
+    std::snprintf(error, sizeof(error), "Symbol '%c' not known.", c);
+    Failwith(error);
   }
+  return symbol;
+}
+
+namespace {
+
+// The murmur3 finalizer, which mixes every bit of the input into every bit of the
+// output.
+uint64_t Mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Hash a packed column a word at a time.
+uint64_t ColumnHash(const uint64_t *column, size_t word_count) {
+  uint64_t hash = Mix64(word_count);
+  for (size_t word_idx = 0; word_idx < word_count; word_idx++) {
+    hash = Mix64(hash ^ column[word_idx]);
+  }
+  return hash;
+}
+
+// The distinct columns of a range of sites, in order of first appearance, as the
+// first site having each one and the number of sites having it.
+struct PatternCounts {
+  SizeVector first_sites_;
+  std::vector<double> counts_;
 };
 
-void SitePattern::Compress() {
-  CharIntMap symbol_table = GetSymbolTable();
-  size_t sequence_length = alignment_.Length();
-  std::unordered_map<SymbolVector, double, IntVectorHasher> patterns;
-
-  for (size_t pos = 0; pos < sequence_length; pos++) {
-    SymbolVector pattern(alignment_.SequenceCount());
-    for (const auto &iter : tag_taxon_map_) {
-      auto taxon_number = static_cast<size_t>(MaxLeafIDOfTag(iter.first));
-      auto symbol_to_find = alignment_.at(iter.second)[pos];
-      pattern[taxon_number] = SymbolTableAt(symbol_table, symbol_to_find);
+}  // namespace
+
+void SitePattern::Compress(const Alignment &alignment,
+                           const TaxonRegistry &taxon_registry, size_t thread_count,
+                           SitePatternOrder order) {
+  Assert(thread_count > 0, "Thread count must be positive.");
+  const size_t sequence_count = alignment.SequenceCount();
+  const size_t site_count = alignment.Length();
+  Assert(taxon_registry.TaxonCount() <= sequence_count,
+         "There are more taxa than sequences in the alignment.");
+  patterns_.assign(sequence_count, PackedSymbols());
+  // The sequence of each taxon number, which is null for the sequences of the
+  // alignment that aren't those of taxa.
+  std::vector<const std::string *> sequences = taxon_registry.SequencesOf(alignment);
+  Assert(sequences.empty() || sequences[0]->size() == site_count,
+         "Sequences have different lengths in the alignment.");
+  sequences.resize(sequence_count, nullptr);
+  // The alignment transposed, so that site i is the PackedSymbols words starting at
+  // columns[i * column_word_count].
+  const size_t column_word_count = PackedSymbols::WordCountOf(sequence_count);
+  std::vector<uint64_t> columns(site_count * column_word_count);
+  const auto column_of = [&columns, column_word_count](size_t site) {
+    return &columns[site * column_word_count];
+  };
+  const auto symbol_at = [&column_of, sequence_count](size_t site,
+                                                     size_t taxon_number) {
+    return PackedSymbols::SymbolAt(column_of(site), sequence_count, taxon_number);
+  };
+  std::vector<uint64_t> hashes(site_count);
+  auto column_hasher = [&hashes](size_t site) { return hashes[site]; };
+  auto column_equal = [&column_of, column_word_count](size_t site, size_t other_site) {
+    return std::memcmp(column_of(site), column_of(other_site),
+                       column_word_count * sizeof(uint64_t)) == 0;
+  };
+  using ColumnMap = std::unordered_map<size_t, size_t, decltype(column_hasher),
+                                       decltype(column_equal)>;
+
+  // Each unit of work decodes, transposes and counts a contiguous range of sites.
+  const size_t chunk_count = std::max<size_t>(
+      1, std::min(site_count, thread_count == 1 ? 1 : 4 * thread_count));
+  std::vector<PatternCounts> chunk_counts(chunk_count);
+  auto compress_chunk = [&](size_t, size_t chunk_idx) {
+    const size_t begin = chunk_idx * site_count / chunk_count;
+    const size_t end = (chunk_idx + 1) * site_count / chunk_count;
+    for (size_t site = begin; site < end; site++) {
+      uint64_t *column = column_of(site);
+      for (size_t taxon_number = 0; taxon_number < sequence_count; taxon_number++) {
+        if (sequences[taxon_number] != nullptr) {
+          PackedSymbols::SetSymbolAt(column, sequence_count, taxon_number,
+                                     DecodeSymbol((*sequences[taxon_number])[site]));
+        }
+      }
+      hashes[site] = ColumnHash(column, column_word_count);
+    }
+    ColumnMap patterns(end - begin, column_hasher, column_equal);
+    auto &counts = chunk_counts[chunk_idx];
+    for (size_t site = begin; site < end; site++) {
+      const auto [iter, inserted] = patterns.emplace(site, counts.counts_.size());
+      if (inserted) {
+        counts.first_sites_.push_back(site);
+        counts.counts_.push_back(1.);
+      } else {
+        counts.counts_[iter->second]++;
+      }
+    }
+  };
+  if (chunk_count == 1) {
+    compress_chunk(0, 0);
+  } else {
+    SizeVector thread_indices(thread_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, compress_chunk);
+  }
+
+  // Merge the counts of the ranges in site order, so that the result doesn't depend
+  // on the number of threads.
+  SizeVector first_sites;
+  if (chunk_count == 1) {
+    first_sites = std::move(chunk_counts[0].first_sites_);
+    weights_ = std::move(chunk_counts[0].counts_);
+  } else {
+    ColumnMap patterns(chunk_counts[0].counts_.size(), column_hasher, column_equal);
+    for (const auto &counts : chunk_counts) {
+      for (size_t idx = 0; idx < counts.first_sites_.size(); idx++) {
+        const auto [iter, inserted] =
+            patterns.emplace(counts.first_sites_[idx], weights_.size());
+        if (inserted) {
+          first_sites.push_back(counts.first_sites_[idx]);
+          weights_.push_back(counts.counts_[idx]);
+        } else {
+          weights_[iter->second] += counts.counts_[idx];
+        }
+      }
     }
-    if (patterns.find(pattern) == patterns.end()) {
-      SafeInsert(patterns, pattern, 1.);
-    } else {
-      patterns[pattern]++;
+  }
+
+  if (order != SitePatternOrder::FirstAppearance) {
+    const auto column_less = [&symbol_at, sequence_count](size_t site,
+                                                          size_t other_site) {
+      for (size_t taxon_number = 0; taxon_number < sequence_count; taxon_number++) {
+        const int symbol = symbol_at(site, taxon_number);
+        const int other_symbol = symbol_at(other_site, taxon_number);
+        if (symbol != other_symbol) {
+          return symbol < other_symbol;
+        }
+      }
+      return false;
+    };
+    // The class of each pattern, as its number of distinct states and then its
+    // number of ambiguous symbols.
+    std::vector<std::pair<size_t, size_t>> classes(first_sites.size());
+    if (order == SitePatternOrder::ByClass) {
+      for (size_t pattern_idx = 0; pattern_idx < first_sites.size(); pattern_idx++) {
+        std::array<bool, 4> seen_states = {};
+        size_t ambiguous_count = 0;
+        for (size_t taxon_number = 0; taxon_number < sequence_count; taxon_number++) {
+          const int symbol = symbol_at(first_sites[pattern_idx], taxon_number);
+          if (symbol < PackedSymbols::ambiguous_symbol_) {
+            seen_states[symbol] = true;
+          } else {
+            ambiguous_count++;
+          }
+        }
+        classes[pattern_idx] = {static_cast<size_t>(std::count(
+                                    seen_states.begin(), seen_states.end(), true)),
+                                ambiguous_count};
+      }
     }
+    SizeVector permutation(first_sites.size());
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::sort(permutation.begin(), permutation.end(),
+              [&classes, &first_sites, &column_less](size_t lhs, size_t rhs) {
+                if (classes[lhs] != classes[rhs]) {
+                  return classes[lhs] < classes[rhs];
+                }  // else
+                return column_less(first_sites[lhs], first_sites[rhs]);
+              });
+    SizeVector sorted_first_sites(first_sites.size());
+    std::vector<double> sorted_weights(weights_.size());
+    for (size_t pattern_idx = 0; pattern_idx < permutation.size(); pattern_idx++) {
+      sorted_first_sites[pattern_idx] = first_sites[permutation[pattern_idx]];
+      sorted_weights[pattern_idx] = weights_[permutation[pattern_idx]];
+    }
+    first_sites = std::move(sorted_first_sites);
+    weights_ = std::move(sorted_weights);
   }
 
   // Collect the site patterns per taxon.
-  for (const auto &iter_tag_taxon : tag_taxon_map_) {
-    SymbolVector compressed_sequence;
-    auto taxon_number = static_cast<size_t>(MaxLeafIDOfTag(iter_tag_taxon.first));
-    for (const auto &iter_patterns : patterns) {
-      compressed_sequence.push_back(iter_patterns.first[taxon_number]);
+  for (size_t taxon_number = 0; taxon_number < taxon_registry.TaxonCount();
+       taxon_number++) {
+    PackedSymbols compressed_sequence(first_sites.size());
+    for (size_t pattern_idx = 0; pattern_idx < first_sites.size(); pattern_idx++) {
+      compressed_sequence.Set(pattern_idx,
+                              symbol_at(first_sites[pattern_idx], taxon_number));
     }
-    patterns_[taxon_number] = compressed_sequence;
+    patterns_[taxon_number] = std::move(compressed_sequence);
   }
+}
 
-  // Collect the site weights.
-  for (const auto &iter : patterns) {
-    weights_.push_back(iter.second);
+std::vector<SymbolVector> SitePattern::GetPatterns() const {
+  std::vector<SymbolVector> patterns;
+  for (const auto &pattern : patterns_) {
+    patterns.push_back(pattern.Unpacked());
   }
+  return patterns;
 }
 
 const std::vector<double> SitePattern::GetPartials(size_t sequence_idx) const {
   // DNA assumption here.
   size_t state_count = 4;
   std::vector<double> partials(state_count * PatternCount(), 0.);
+  const PackedSymbols &pattern = patterns_.at(sequence_idx);
   for (int pattern_idx = 0; pattern_idx < PatternCount(); pattern_idx++) {
-    if (patterns_[sequence_idx][pattern_idx] < state_count) {
-      partials[pattern_idx * state_count + patterns_[sequence_idx][pattern_idx]] = 1.0;
+    if (!pattern.IsAmbiguous(pattern_idx)) {
+      partials[pattern_idx * state_count + pattern[pattern_idx]] = 1.0;
     } else {
       for (int state_idx = 0; state_idx < state_count; state_idx++) {
         partials[pattern_idx * state_count + state_idx] = 1.0;
@@ -114,3 +305,37 @@ const std::vector<double> SitePattern::GetPartials(size_t sequence_idx) const {
   }
   return partials;
 }
+
+SitePattern SitePattern::OfPackedPatterns(std::vector<PackedSymbols> patterns,
+                                          std::vector<double> weights) {
+  Assert(!patterns.empty(), "Site patterns need at least one sequence.");
+  for (const auto &pattern : patterns) {
+    Assert(pattern.size() == weights.size(),
+           "Packed site patterns need a weight for each pattern.");
+  }
+  SitePattern site_pattern;
+  site_pattern.patterns_ = std::move(patterns);
+  site_pattern.weights_ = std::move(weights);
+  return site_pattern;
+}
+
+SitePattern SitePattern::Slice(size_t begin, size_t end) const {
+  Assert(begin < end && end <= PatternCount(), "Invalid site pattern slice.");
+  SitePattern slice;
+  for (const auto &pattern : patterns_) {
+    slice.patterns_.push_back(pattern.Slice(begin, end));
+  }
+  slice.weights_.assign(weights_.begin() + begin, weights_.begin() + end);
+  return slice;
+}
+
+std::vector<SitePattern> SitePattern::Split(size_t block_count) const {
+  Assert(block_count > 0, "Need a positive number of site pattern blocks.");
+  block_count = std::min(block_count, PatternCount());
+  std::vector<SitePattern> blocks;
+  for (size_t block_idx = 0; block_idx < block_count; block_idx++) {
+    blocks.push_back(Slice(block_idx * PatternCount() / block_count,
+                           (block_idx + 1) * PatternCount() / block_count));
+  }
+  return blocks;
+}
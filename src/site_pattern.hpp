@@ -2,51 +2,101 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 //
 // A class for an alignment that has been compressed into site patterns.
+//
+// Compression decodes each symbol through a 256-entry table, transposes the
+// alignment once so that every site is a contiguous column of PackedSymbols words,
+// and then counts the distinct columns by a 64-bit hash of their words. With more
+// than one thread, contiguous ranges of sites are decoded and counted in parallel,
+// and the counts are merged in site order. Either way the site patterns are in
+// order of their first appearance in the alignment, unless we ask for a
+// SitePatternOrder that sorts them. The site patterns are also kept packed.
 
 #ifndef SRC_SITE_PATTERN_HPP_
 #define SRC_SITE_PATTERN_HPP_
 
+#include <map>
 #include <string>
 #include <vector>
 #include "alignment.hpp"
+#include "packed_symbols.hpp"
 #include "sugar.hpp"
+#include "taxon_registry.hpp"
+
+// The order of the compressed site patterns, which is the order of the partials,
+// BEAGLE tip states and GP PLV columns. All of these are reproducible.
+enum class SitePatternOrder {
+  // The order in which the patterns first appear in the alignment.
+  FirstAppearance,
+  // Lexicographic order of the patterns, comparing taxa in taxon number order.
+  Lexicographic,
+  // Constant patterns first, then by the number of distinct states and then the
+  // number of ambiguous symbols in the pattern, with ties broken lexicographically.
+  // Similar patterns are next to each other, and Split gives blocks with similar
+  // mixes of patterns to the extent that contiguous blocks can.
+  ByClass,
+};
 
 class SitePattern {
  public:
   SitePattern() = default;
-  explicit SitePattern(const Alignment& alignment, const TagStringMap& tag_taxon_map)
-      : alignment_(alignment), tag_taxon_map_(tag_taxon_map) {
-    patterns_.resize(alignment.SequenceCount());
-    Compress();
+  // The site patterns of the taxa of taxon_registry, in order of their ids. We read
+  // the sequences in place and don't keep the alignment.
+  SitePattern(const Alignment& alignment, const TaxonRegistry& taxon_registry,
+              size_t thread_count = 1,
+              SitePatternOrder order = SitePatternOrder::FirstAppearance) {
+    Compress(alignment, taxon_registry, thread_count, order);
   }
+  explicit SitePattern(const Alignment& alignment, const TagStringMap& tag_taxon_map,
+                       size_t thread_count = 1,
+                       SitePatternOrder order = SitePatternOrder::FirstAppearance)
+      : SitePattern(alignment, TaxonRegistry(tag_taxon_map), thread_count, order) {}
+
+  // The site patterns with these packed patterns, one per sequence in taxon number
+  // order, and weights, as made by another SitePattern.
+  static SitePattern OfPackedPatterns(std::vector<PackedSymbols> patterns,
+                                      std::vector<double> weights);
 
   static CharIntMap GetSymbolTable();
+  // The symbol of this character in GetSymbolTable, looked up in a table.
+  static int DecodeSymbol(char c);
   static SymbolVector SymbolVectorOf(const CharIntMap& symbol_table,
                                      const std::string& str);
 
-  const std::vector<SymbolVector>& GetPatterns() const { return patterns_; }
+  // The site patterns of each sequence, unpacked.
+  std::vector<SymbolVector> GetPatterns() const;
+  const std::vector<PackedSymbols>& GetPackedPatterns() const { return patterns_; }
   size_t PatternCount() const { return patterns_.at(0).size(); }
   size_t SequenceCount() const { return patterns_.size(); }
   const std::vector<double>& GetWeights() const { return weights_; }
   // Make a flattened partial likelihood vector for a given sequence, where anything
   // above 4 is given a uniform distribution.
   const std::vector<double> GetPartials(size_t sequence_idx) const;
+  // The site patterns numbered begin, ..., end - 1, with their weights.
+  SitePattern Slice(size_t begin, size_t end) const;
+  // Split the site patterns into at most block_count contiguous blocks of nearly
+  // equal size. Every block has at least one pattern.
+  std::vector<SitePattern> Split(size_t block_count) const;
+
+  // Do these have the same patterns in the same order, with the same weights?
+  bool operator==(const SitePattern& other) const {
+    return patterns_ == other.patterns_ && weights_ == other.weights_;
+  }
 
   static SitePattern HelloSitePattern() {
-    return SitePattern(Alignment::HelloAlignment(),
-                       {{0, "mars"}, {1, "saturn"}, {2, "jupiter"}});
+    return SitePattern(Alignment::HelloAlignment(), {{PackInts(0, 1), "mars"},
+                                                     {PackInts(1, 1), "saturn"},
+                                                     {PackInts(2, 1), "jupiter"}});
   }
 
  private:
-  Alignment alignment_;
-  TagStringMap tag_taxon_map_;
   // The first index of patterns_ is across sequences, and the second is across site
   // patterns.
-  std::vector<SymbolVector> patterns_;
+  std::vector<PackedSymbols> patterns_;
   // The number of times each site pattern was seen in the alignment.
   std::vector<double> weights_;
 
-  void Compress();
+  void Compress(const Alignment& alignment, const TaxonRegistry& taxon_registry,
+                size_t thread_count, SitePatternOrder order);
   static int SymbolTableAt(const CharIntMap& symbol_table, char c);
 };
 
@@ -56,6 +106,101 @@ TEST_CASE("SitePattern") {
   SymbolVector symbol_vector = SitePattern::SymbolVectorOf(symbol_table, "-tgcaTGCA?");
   SymbolVector correct_symbol_vector = {4, 3, 2, 1, 0, 3, 2, 1, 0, 4};
   CHECK_EQ(symbol_vector, correct_symbol_vector);
+  for (int c = 0; c < 256; c++) {
+    const auto search = symbol_table.find(static_cast<char>(c));
+    if (search == symbol_table.end()) {
+      CHECK_THROWS(SitePattern::DecodeSymbol(static_cast<char>(c)));
+    } else {
+      CHECK_EQ(SitePattern::DecodeSymbol(static_cast<char>(c)), search->second);
+    }
+  }
+  const SitePattern site_pattern(
+      Alignment::HelloAlignment(),
+      {{PackInts(0, 1), "mars"}, {PackInts(1, 1), "saturn"},
+       {PackInts(2, 1), "jupiter"}});
+  const auto blocks = site_pattern.Split(2);
+  REQUIRE_EQ(blocks.size(), 2);
+  CHECK_EQ(blocks[0].PatternCount() + blocks[1].PatternCount(),
+           site_pattern.PatternCount());
+  CHECK_EQ(blocks[1].GetPatterns()[2].back(), site_pattern.GetPatterns()[2].back());
+  CHECK_EQ(blocks[1].GetWeights().back(), site_pattern.GetWeights().back());
+  CHECK_EQ(site_pattern.Split(100).size(), site_pattern.PatternCount());
+  CHECK(blocks[0] == site_pattern.Slice(0, blocks[0].PatternCount()));
+  CHECK_FALSE(blocks[0] == blocks[1]);
+  const auto rebuilt = SitePattern::OfPackedPatterns(site_pattern.GetPackedPatterns(),
+                                                     site_pattern.GetWeights());
+  CHECK_EQ(rebuilt.GetPatterns(), site_pattern.GetPatterns());
+  CHECK_EQ(rebuilt.GetWeights(), site_pattern.GetWeights());
+  CHECK_THROWS(SitePattern::OfPackedPatterns(site_pattern.GetPackedPatterns(), {1.}));
+}
+
+TEST_CASE("SitePattern: compression") {
+  // Sites 0 and 3 are the same, as are sites 4 and 5, because gaps and N are both
+  // decoded as 4.
+  const Alignment alignment({{"x", "ACGANN"}, {"y", "AT-A-N"}, {"z", "GGTGGG"}});
+  const TagStringMap tag_taxon_map = {
+      {PackInts(0, 1), "x"}, {PackInts(1, 1), "y"}, {PackInts(2, 1), "z"}};
+  const SitePattern site_pattern(alignment, tag_taxon_map);
+  const std::vector<SymbolVector> correct_patterns = {
+      {0, 1, 2, 4}, {0, 3, 4, 4}, {2, 2, 3, 2}};
+  CHECK_EQ(site_pattern.GetPatterns(), correct_patterns);
+  CHECK_EQ(site_pattern.GetWeights(), std::vector<double>({2., 1., 1., 2.}));
+  // Compressing in parallel gives the same patterns in the same order.
+  const auto long_alignment = Alignment::ReadFasta("data/DS1.fasta");
+  const auto long_tag_taxon_map = [&long_alignment]() {
+    TagStringMap tag_taxon_map;
+    uint32_t taxon_number = 0;
+    for (const auto& [taxon, sequence] : long_alignment.Data()) {
+      tag_taxon_map[PackInts(taxon_number++, 1)] = taxon;
+    }
+    return tag_taxon_map;
+  }();
+  const SitePattern serial(long_alignment, long_tag_taxon_map);
+  const SitePattern parallel(long_alignment, long_tag_taxon_map, 3);
+  CHECK_EQ(serial.GetPatterns(), parallel.GetPatterns());
+  CHECK_EQ(serial.GetWeights(), parallel.GetWeights());
+  double total_weight = 0.;
+  for (const auto weight : serial.GetWeights()) {
+    total_weight += weight;
+  }
+  CHECK_EQ(total_weight, long_alignment.Length());
+  // Sorting gives the same patterns and weights in another order.
+  const auto weight_map_of = [](const SitePattern& site_pattern) {
+    std::map<SymbolVector, double> weight_map;
+    for (size_t pattern_idx = 0; pattern_idx < site_pattern.PatternCount();
+         pattern_idx++) {
+      SymbolVector pattern;
+      for (const auto& sequence : site_pattern.GetPatterns()) {
+        pattern.push_back(sequence[pattern_idx]);
+      }
+      weight_map[pattern] = site_pattern.GetWeights()[pattern_idx];
+    }
+    return weight_map;
+  };
+  const SitePattern lexicographic(long_alignment, long_tag_taxon_map, 3,
+                                  SitePatternOrder::Lexicographic);
+  CHECK_EQ(weight_map_of(lexicographic), weight_map_of(serial));
+  const auto first_pattern = [](const SitePattern& site_pattern) {
+    SymbolVector pattern;
+    for (const auto& sequence : site_pattern.GetPatterns()) {
+      pattern.push_back(sequence.front());
+    }
+    return pattern;
+  };
+  CHECK_EQ(first_pattern(lexicographic), weight_map_of(serial).begin()->first);
+  const SitePattern by_class(long_alignment, long_tag_taxon_map, 1,
+                             SitePatternOrder::ByClass);
+  CHECK_EQ(weight_map_of(by_class), weight_map_of(serial));
+  // The pattern with one state and two ambiguous symbols comes first, then the two
+  // with two states, and then the one with three states.
+  const SitePattern small_by_class(alignment, tag_taxon_map, 1,
+                                   SitePatternOrder::ByClass);
+  const std::vector<SymbolVector> correct_patterns_by_class = {
+      {4, 0, 2, 1}, {4, 0, 4, 3}, {2, 2, 3, 2}};
+  CHECK_EQ(small_by_class.GetPatterns(), correct_patterns_by_class);
+  CHECK_EQ(small_by_class.GetWeights(), std::vector<double>({2., 2., 1., 1.}));
+  CHECK_THROWS(SitePattern(Alignment({{"x", "AC"}, {"y", "AZ"}}),
+                           {{PackInts(0, 1), "x"}, {PackInts(1, 1), "y"}}));
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_SITE_PATTERN_HPP_
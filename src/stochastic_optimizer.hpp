@@ -0,0 +1,220 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A StochasticOptimizer takes gradient ascent steps in place on parameter vectors and
+// matrices, such as the sbn_parameters_ of an SBNInstance or the blocks of a
+// BlockSpecification::ParameterBlockMap. The methods are those of vip/sgd_server.py:
+// SGD with momentum, Adam, AMSGrad, RMSProp, AdaGrad and AdaDelta.
+//
+// The moment estimates for each variable live here, keyed by a name that the caller
+// gives for the variable, and are sized on the first step. Each step is a handful of
+// coefficient-wise Eigen expressions over the whole variable, with no temporaries
+// handed back to the caller. The step count used for Adam's bias correction is also
+// kept per variable, which agrees with SGD_Server as long as every variable takes
+// one step per iteration.
+
+#ifndef SRC_STOCHASTIC_OPTIMIZER_HPP_
+#define SRC_STOCHASTIC_OPTIMIZER_HPP_
+
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include "eigen_sugar.hpp"
+#include "sugar.hpp"
+
+class StochasticOptimizer {
+ public:
+  enum class Method { SGD, Adam, AMSGrad, RMSProp, AdaGrad, AdaDelta };
+
+  struct Settings {
+    double beta_0_ = 0.9;
+    double beta_1_ = 0.999;
+    // AMSGrad's decay rate for the second moment.
+    double beta_1_ams_ = 0.99;
+    // The decay rate of RMSProp and AdaDelta.
+    double gamma_ = 0.9;
+    double epsilon_ = 1e-8;
+    // Weight decay: we step along the gradient minus decay_ times the parameters.
+    double decay_ = 0.;
+    double momentum_ = 0.9;
+  };
+
+  explicit StochasticOptimizer(Method method) : StochasticOptimizer(method, {}) {}
+  StochasticOptimizer(Method method, Settings settings)
+      : method_(method), settings_(settings) {}
+
+  // The names are those of the SGD_Server methods.
+  static Method MethodOfName(const std::string &name) {
+    static const std::unordered_map<std::string, Method> methods = {
+        {"sgd", Method::SGD},         {"adam", Method::Adam},
+        {"amsgrad", Method::AMSGrad}, {"rmsprop", Method::RMSProp},
+        {"adagrad", Method::AdaGrad}, {"adadelta", Method::AdaDelta}};
+    const auto search = methods.find(name);
+    if (search == methods.end()) {
+      Failwith("Unknown optimization method: " + name);
+    }
+    return search->second;
+  }
+
+  Method GetMethod() const { return method_; }
+  const Settings &GetSettings() const { return settings_; }
+
+  // Add the step that the method takes for this gradient to the parameters of the
+  // named variable. The step size is not part of the state, so it can change from
+  // one step to the next.
+  void StepVector(const std::string &name, double step_size,
+                  EigenVectorXdRef parameters, EigenConstVectorXdRef gradient) {
+    StepInternal(name, step_size, parameters.array(), gradient.array());
+  }
+  void StepMatrix(const std::string &name, double step_size,
+                  EigenMatrixXdRef parameters, EigenConstMatrixXdRef gradient) {
+    StepInternal(name, step_size, parameters.array(), gradient.array());
+  }
+
+  // Forget the state of one or all of the variables.
+  void Reset(const std::string &name) { states_.erase(name); }
+  void Reset() { states_.clear(); }
+
+  size_t StepCount(const std::string &name) const {
+    const auto search = states_.find(name);
+    return search == states_.end() ? 0 : search->second.step_count_;
+  }
+
+ private:
+  using Array = Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+  struct State {
+    size_t step_count_ = 0;
+    Array mean_grad_;
+    Array var_grad_;
+    Array var_delta_;
+    Array var_grad_max_;
+  };
+
+  Method method_;
+  Settings settings_;
+  std::unordered_map<std::string, State> states_;
+
+  State &StateOf(const std::string &name, Eigen::Index rows, Eigen::Index cols) {
+    State &state = states_[name];
+    if (state.step_count_ == 0) {
+      for (Array *moment : {&state.mean_grad_, &state.var_grad_, &state.var_delta_,
+                            &state.var_grad_max_}) {
+        moment->setZero(rows, cols);
+      }
+    } else if (state.mean_grad_.rows() != rows || state.mean_grad_.cols() != cols) {
+      Failwith("The shape of variable " + name +
+               " changed between optimization steps.");
+    }
+    return state;
+  }
+
+  template <typename Parameters, typename Gradient>
+  void StepInternal(const std::string &name, double step_size, Parameters parameters,
+                    const Gradient &raw_gradient) {
+    if (parameters.rows() != raw_gradient.rows() ||
+        parameters.cols() != raw_gradient.cols()) {
+      Failwith("The gradient of variable " + name +
+               " doesn't have the shape of its parameters.");
+    }
+    State &state = StateOf(name, parameters.rows(), parameters.cols());
+    state.step_count_++;
+    const Settings &s = settings_;
+    const Array gradient = raw_gradient - s.decay_ * parameters;
+    switch (method_) {
+      case Method::SGD:
+        state.mean_grad_ = s.momentum_ * state.mean_grad_ + step_size * gradient;
+        parameters += state.mean_grad_;
+        break;
+      case Method::Adam:
+      case Method::AMSGrad: {
+        const bool ams = (method_ == Method::AMSGrad);
+        const double beta_1 = ams ? s.beta_1_ams_ : s.beta_1_;
+        const double t = static_cast<double>(state.step_count_);
+        state.mean_grad_ = s.beta_0_ * state.mean_grad_ + (1. - s.beta_0_) * gradient;
+        state.var_grad_ = beta_1 * state.var_grad_ + (1. - beta_1) * gradient.square();
+        if (ams) {
+          state.var_grad_max_ = state.var_grad_max_.max(state.var_grad_);
+        }
+        const Array &var_grad = ams ? state.var_grad_max_ : state.var_grad_;
+        const double mean_correction = 1. / (1. - std::pow(s.beta_0_, t));
+        const double var_correction = 1. / (1. - std::pow(beta_1, t));
+        parameters += step_size * mean_correction * state.mean_grad_ /
+                      ((var_correction * var_grad).sqrt() + s.epsilon_);
+        break;
+      }
+      case Method::RMSProp:
+        state.var_grad_ =
+            s.gamma_ * state.var_grad_ + (1. - s.gamma_) * gradient.square();
+        parameters += step_size * gradient / (state.var_grad_ + s.epsilon_).sqrt();
+        break;
+      case Method::AdaGrad:
+        state.var_grad_ += gradient.square();
+        parameters += step_size * gradient / (state.var_grad_ + s.epsilon_).sqrt();
+        break;
+      case Method::AdaDelta: {
+        // As in SGD_Server, AdaDelta has no step size.
+        state.var_grad_ =
+            s.gamma_ * state.var_grad_ + (1. - s.gamma_) * gradient.square();
+        const Array update =
+            ((state.var_delta_ + s.epsilon_) / (state.var_grad_ + s.epsilon_)).sqrt() *
+            gradient;
+        state.var_delta_ =
+            s.gamma_ * state.var_delta_ + (1. - s.gamma_) * update.square();
+        parameters += update;
+        break;
+      }
+    }
+  }
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("StochasticOptimizer") {
+  // Every method should climb to the maximum of a concave quadratic, -|x - c|^2/2,
+  // whose gradient is c - x.
+  EigenVectorXd center(3);
+  center << 1., -2., 0.5;
+  for (const auto &name_and_step_size :
+       std::vector<std::pair<std::string, double>>{{"sgd", 0.01},
+                                                   {"adam", 0.05},
+                                                   {"amsgrad", 0.05},
+                                                   {"rmsprop", 0.01},
+                                                   {"adagrad", 0.5},
+                                                   {"adadelta", 0.}}) {
+    const std::string name = name_and_step_size.first;
+    const double step_size = name_and_step_size.second;
+    StochasticOptimizer optimizer(StochasticOptimizer::MethodOfName(name));
+    EigenVectorXd x = EigenVectorXd::Zero(3);
+    for (size_t step = 0; step < 5000; step++) {
+      EigenVectorXd gradient = center - x;
+      optimizer.StepVector("x", step_size, x, gradient);
+    }
+    INFO(name);
+    CHECK_LT((x - center).norm(), 1e-2);
+    CHECK_EQ(optimizer.StepCount("x"), 5000);
+  }
+
+  // One Adam step by hand, on a matrix variable whose state is kept separately from
+  // that of a vector variable with a different shape.
+  StochasticOptimizer optimizer(StochasticOptimizer::Method::Adam);
+  EigenMatrixXd matrix(2, 2);
+  matrix << 1., 2., 3., 4.;
+  EigenMatrixXd matrix_gradient(2, 2);
+  matrix_gradient << 0.5, -1., 2., 0.;
+  EigenVectorXd vector = EigenVectorXd::Zero(5);
+  EigenVectorXd vector_gradient = EigenVectorXd::Ones(5);
+  optimizer.StepVector("vector", 0.1, vector, vector_gradient);
+  optimizer.StepMatrix("matrix", 0.1, matrix, matrix_gradient);
+  // After bias correction the first Adam step is the step size times the sign of the
+  // gradient, up to epsilon.
+  EigenMatrixXd expected(2, 2);
+  expected << 1.1, 1.9, 3.1, 4.;
+  CHECK_LT((matrix - expected).cwiseAbs().maxCoeff(), 1e-6);
+  CHECK_LT((vector.array() - 0.1).abs().maxCoeff(), 1e-6);
+  EigenMatrixXd wrong_gradient(3, 3);
+  CHECK_THROWS(optimizer.StepMatrix("matrix", 0.1, matrix, wrong_gradient));
+  CHECK_THROWS(StochasticOptimizer::MethodOfName("newton"));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_STOCHASTIC_OPTIMIZER_HPP_
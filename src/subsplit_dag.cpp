@@ -0,0 +1,528 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "subsplit_dag.hpp"
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <queue>
+#include "task_processor.hpp"
+
+using namespace GPOperations;  // NOLINT
+
+namespace {
+
+// The file is this header followed by
+// * the rootsplits, with their bits packed into 64-bit words as in Bitset;
+// * the parent subsplits in the order of their ranges, packed in the same way;
+// * the [begin, end) range of each parent, as pairs of 64-bit integers;
+// * the child of each PCSS, as the packed third chunk of the PCSS;
+// * the taxon names, each terminated by a null character;
+// * the rootward and then the leafward pass, as FlatOperations.
+struct DAGFileHeader {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t byte_order_mark_;
+  uint64_t taxon_count_;
+  uint64_t rootsplit_count_;
+  uint64_t parent_count_;
+  uint64_t parameter_count_;
+  uint64_t taxon_names_size_;
+  uint64_t node_count_;
+  uint64_t rootward_count_;
+  uint64_t leafward_count_;
+};
+
+constexpr char dag_magic[8] = {'L', 'I', 'B', 'S', 'B', 'N', 'D', 'G'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+
+BitsetVector SortedKeys(const BitsetSizeDict& counter) {
+  BitsetVector keys;
+  keys.reserve(counter.size());
+  for (const auto& iter : counter) {
+    keys.push_back(iter.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// Write a subsplit with its smaller clade second.
+Bitset SortedSubsplit(const Bitset& subsplit) {
+  return subsplit.SplitChunk(1) < subsplit.SplitChunk(0) ? subsplit
+                                                         : subsplit.RotateSubsplit();
+}
+
+}  // namespace
+
+SubsplitDAG::SubsplitDAG(StringVector taxon_names,
+                         const BitsetSizeDict& rootsplit_counter,
+                         const PCSSDict& pcss_counter)
+    : taxon_names_(std::move(taxon_names)) {
+  size_t index = 0;
+  // The counters are hash maps, so we sort their keys to get an indexing that
+  // doesn't depend on the order in which the subsplits were found.
+  for (const auto& rootsplit : SortedKeys(rootsplit_counter)) {
+    Assert(rootsplit.size() == TaxonCount(),
+           "The rootsplits of a SubsplitDAG don't match its taxa.");
+    SafeInsert(indexer_, rootsplit, index);
+    rootsplits_.push_back(rootsplit);
+    index++;
+  }
+  // Rootsplits don't have a child, so they get placeholders in index_to_child_.
+  index_to_child_.resize(index, Bitset(0));
+  BitsetVector parents;
+  parents.reserve(pcss_counter.size());
+  for (const auto& iter : pcss_counter) {
+    parents.push_back(iter.first);
+  }
+  std::sort(parents.begin(), parents.end());
+  for (const auto& parent : parents) {
+    const auto children = SortedKeys(pcss_counter.at(parent));
+    SafeInsert(parent_to_range_, parent, {index, index + children.size()});
+    for (const auto& child : children) {
+      SafeInsert(indexer_, parent + child, index);
+      index_to_child_.push_back(Bitset::ChildSubsplit(parent, child));
+      index++;
+    }
+  }
+}
+
+std::pair<BitsetSizeDict, PCSSDict> SubsplitDAG::SupportOf(
+    const Node::TopologyCounter& topologies, size_t thread_count,
+    const RootsplitCounterFunction& rootsplit_counter_of,
+    const PCSSCounterFunction& pcss_counter_of) {
+  const size_t shard_count =
+      std::max<size_t>(1, std::min(thread_count, topologies.size()));
+  if (shard_count == 1) {
+    return {rootsplit_counter_of(topologies), pcss_counter_of(topologies)};
+  }  // else
+  // Deal the topologies out to the shards, and count each shard in its own thread.
+  std::vector<Node::TopologyCounter> shards(shard_count);
+  size_t topology_idx = 0;
+  for (const auto& iter : topologies) {
+    shards[topology_idx % shard_count].insert(iter);
+    topology_idx++;
+  }
+  // DefaultDicts aren't assignable, so we emplace each shard's counter.
+  std::vector<std::optional<BitsetSizeDict>> rootsplit_counters(shard_count);
+  std::vector<PCSSDict> pcss_counters(shard_count);
+  std::queue<size_t> executor_queue;
+  std::queue<size_t> work_queue;
+  for (size_t shard_idx = 0; shard_idx < shard_count; shard_idx++) {
+    executor_queue.push(shard_idx);
+    work_queue.push(shard_idx);
+  }
+  TaskProcessor<size_t, size_t> task_processor(
+      std::move(executor_queue), std::move(work_queue),
+      [&](size_t, size_t shard_idx) {
+        rootsplit_counters[shard_idx].emplace(rootsplit_counter_of(shards[shard_idx]));
+        pcss_counters[shard_idx] = pcss_counter_of(shards[shard_idx]);
+      });
+  task_processor.Wait();
+  // Merge in shard order.
+  for (size_t shard_idx = 1; shard_idx < shard_count; shard_idx++) {
+    SBNMaps::IncrementBy(*rootsplit_counters[0], *rootsplit_counters[shard_idx]);
+    SBNMaps::IncrementBy(pcss_counters[0], pcss_counters[shard_idx]);
+  }
+  return {std::move(*rootsplit_counters[0]), std::move(pcss_counters[0])};
+}
+
+std::shared_ptr<const SubsplitDAG> SubsplitDAG::OfRootedTopologies(
+    StringVector taxon_names, const Node::TopologyCounter& topologies,
+    size_t thread_count) {
+  const auto [rootsplit_counter, pcss_counter] =
+      SupportOf(topologies, thread_count, RootedSBNMaps::RootsplitCounterOf,
+                RootedSBNMaps::PCSSCounterOf);
+  return std::make_shared<const SubsplitDAG>(std::move(taxon_names),
+                                             rootsplit_counter, pcss_counter);
+}
+
+uint64_t SubsplitDAG::Fingerprint() const {
+  // The indexer is unordered, so we add up a hash of each entry.
+  uint64_t fingerprint = GPCSPCount();
+  for (const auto& [key, idx] : indexer_) {
+    fingerprint += key.Hash() ^ (idx * 0x9e3779b97f4a7c15ULL);
+  }
+  return fingerprint;
+}
+
+EigenVectorXd SubsplitDAG::UniformQ() const {
+  EigenVectorXd q = EigenVectorXd::Ones(GPCSPCount());
+  q.head(RootsplitCount()).setConstant(1. / static_cast<double>(RootsplitCount()));
+  for (const auto& [parent, range] : parent_to_range_) {
+    const auto [begin, end] = range;
+    q.segment(begin, end - begin).setConstant(1. / static_cast<double>(end - begin));
+  }
+  return q;
+}
+
+void SubsplitDAG::EnsureSchedules() const {
+  std::call_once(schedules_flag_, [this] { MakeSchedules(); });
+}
+
+size_t SubsplitDAG::NodeCount() const {
+  EnsureSchedules();
+  return node_count_;
+}
+
+size_t SubsplitDAG::PLVCount() const {
+  return plv_type_count_ * NodeCount() + 2 * GPCSPCount();
+}
+
+size_t SubsplitDAG::PLVIndex(PLVType plv_type, size_t node_idx) const {
+  Assert(node_idx < NodeCount(), "Node index out of range in SubsplitDAG::PLVIndex.");
+  return static_cast<size_t>(plv_type) * node_count_ + node_idx;
+}
+
+size_t SubsplitDAG::RootwardMessagePLVIndex(size_t gpcsp_idx) const {
+  Assert(gpcsp_idx < GPCSPCount(), "GPCSP index out of range in SubsplitDAG.");
+  return plv_type_count_ * NodeCount() + gpcsp_idx;
+}
+
+size_t SubsplitDAG::LeafwardMessagePLVIndex(size_t gpcsp_idx) const {
+  Assert(gpcsp_idx < GPCSPCount(), "GPCSP index out of range in SubsplitDAG.");
+  return plv_type_count_ * NodeCount() + GPCSPCount() + gpcsp_idx;
+}
+
+const GPOperationVector& SubsplitDAG::RootwardPass() const {
+  EnsureSchedules();
+  return rootward_pass_;
+}
+
+const GPOperationVector& SubsplitDAG::LeafwardPass() const {
+  EnsureSchedules();
+  return leafward_pass_;
+}
+
+void SubsplitDAG::MakeSchedules() const {
+  const size_t taxon_count = TaxonCount();
+  // The subsplit of each internal node, and for each side of it either the leaf or
+  // the range of PCSSs below it.
+  struct InternalNode {
+    Bitset subsplit_;
+    std::optional<size_t> leaf_[2];
+    Range children_[2];
+  };
+  std::vector<InternalNode> internal_nodes;
+  BitsetSizeMap node_indexer;
+  SizeVector root_nodes;
+  // The node above and below each PCSS, indexed by sbn_parameters_ index.
+  SizeVector pcss_parents(ParameterCount());
+  SizeVector pcss_sides(ParameterCount());
+  SizeVector pcss_children(ParameterCount());
+  // We number the internal nodes in a depth-first postorder from the rootsplits, so
+  // that children come before their parents. The depth is at most the taxon count.
+  std::function<size_t(const Bitset&)> visit = [&](const Bitset& subsplit) {
+    const auto search = node_indexer.find(subsplit);
+    if (search != node_indexer.end()) {
+      return search->second;
+    }  // else
+    InternalNode node{subsplit, {}, {}};
+    for (const size_t side : {0, 1}) {
+      node.leaf_[side] = subsplit.SplitChunk(side).SingletonOption();
+      if (!node.leaf_[side].has_value()) {
+        const auto parent = side == 1 ? subsplit : subsplit.RotateSubsplit();
+        const auto range = parent_to_range_.find(parent);
+        Assert(range != parent_to_range_.end(),
+               "A clade of a SubsplitDAG has no children: " +
+                   parent.SubsplitToString());
+        node.children_[side] = range->second;
+        for (size_t idx = range->second.first; idx < range->second.second; idx++) {
+          pcss_children[idx] = visit(SortedSubsplit(index_to_child_[idx]));
+          pcss_sides[idx] = side;
+        }
+      }
+    }
+    const size_t node_idx = taxon_count + internal_nodes.size();
+    for (const size_t side : {0, 1}) {
+      if (!node.leaf_[side].has_value()) {
+        for (size_t idx = node.children_[side].first;
+             idx < node.children_[side].second; idx++) {
+          pcss_parents[idx] = node_idx;
+        }
+      }
+    }
+    internal_nodes.push_back(std::move(node));
+    SafeInsert(node_indexer, subsplit, node_idx);
+    return node_idx;
+  };
+  for (const auto& rootsplit : rootsplits_) {
+    root_nodes.push_back(visit(SortedSubsplit(rootsplit + ~rootsplit)));
+  }
+  node_count_ = taxon_count + internal_nodes.size();
+  const auto& internal_node_of = [&](size_t node_idx) -> const InternalNode& {
+    return internal_nodes[node_idx - taxon_count];
+  };
+  // As PLVIndex and so on, which we can't call until we're done.
+  const size_t gpcsp_count = GPCSPCount();
+  const auto plv = [this](PLVType plv_type, size_t node_idx) {
+    return static_cast<size_t>(plv_type) * node_count_ + node_idx;
+  };
+  const auto rootward_message = [this](size_t gpcsp_idx) {
+    return plv_type_count_ * node_count_ + gpcsp_idx;
+  };
+  const auto leafward_message = [this, gpcsp_count](size_t gpcsp_idx) {
+    return plv_type_count_ * node_count_ + gpcsp_count + gpcsp_idx;
+  };
+  const auto phat = [](size_t side) {
+    return side == 0 ? PLVType::PHat0 : PLVType::PHat1;
+  };
+  const auto r = [](size_t side) { return side == 0 ? PLVType::R0 : PLVType::R1; };
+  // The PLV that holds phat for a side, which for a leaf is the message from it.
+  const auto phat_source = [&](size_t node_idx, size_t side) {
+    const auto& leaf = internal_node_of(node_idx).leaf_[side];
+    return leaf.has_value() ? rootward_message(LeafGPCSP(*leaf))
+                            : plv(phat(side), node_idx);
+  };
+
+  GPOperationVector rootward;
+  for (size_t taxon_idx = 0; taxon_idx < taxon_count; taxon_idx++) {
+    const size_t gpcsp_idx = LeafGPCSP(taxon_idx);
+    rootward.push_back(EvolveRootward{rootward_message(gpcsp_idx),
+                                      plv(PLVType::P, taxon_idx), gpcsp_idx});
+  }
+  for (size_t node_idx = taxon_count; node_idx < node_count_; node_idx++) {
+    const auto& node = internal_node_of(node_idx);
+    for (const size_t side : {0, 1}) {
+      if (node.leaf_[side].has_value()) {
+        continue;
+      }
+      const auto [begin, end] = node.children_[side];
+      for (size_t idx = begin; idx < end; idx++) {
+        rootward.push_back(EvolveRootward{rootward_message(idx),
+                                          plv(PLVType::P, pcss_children[idx]), idx});
+      }
+      // Zeroing right before the first accumulation lets them fuse.
+      rootward.push_back(Zero{plv(phat(side), node_idx)});
+      for (size_t idx = begin; idx < end; idx++) {
+        rootward.push_back(WeightedSumAccumulate{plv(phat(side), node_idx), idx,
+                                                 rootward_message(idx)});
+      }
+    }
+    rootward.push_back(Multiply{plv(PLVType::P, node_idx), phat_source(node_idx, 0),
+                                phat_source(node_idx, 1)});
+  }
+  for (size_t rootsplit_idx = 0; rootsplit_idx < RootsplitCount(); rootsplit_idx++) {
+    const size_t root_idx = root_nodes[rootsplit_idx];
+    rootward.push_back(SetToStationaryDistribution{plv(PLVType::RHat, root_idx)});
+    rootward.push_back(Likelihood{rootsplit_idx, plv(PLVType::RHat, root_idx),
+                                  plv(PLVType::P, root_idx)});
+  }
+
+  // The PCSSs into each node, for accumulating rhat.
+  SizeVectorVector parent_pcsss(node_count_);
+  for (size_t idx = RootsplitCount(); idx < ParameterCount(); idx++) {
+    parent_pcsss[pcss_children[idx]].push_back(idx);
+  }
+  GPOperationVector leafward;
+  for (size_t node_idx = node_count_; node_idx-- > taxon_count;) {
+    const auto& node = internal_node_of(node_idx);
+    const auto& parents = parent_pcsss[node_idx];
+    // The rhat of a root node is the stationary distribution from the rootward pass.
+    if (!parents.empty()) {
+      for (const auto idx : parents) {
+        leafward.push_back(EvolveLeafward{leafward_message(idx),
+                                          plv(r(pcss_sides[idx]), pcss_parents[idx]),
+                                          idx});
+      }
+      leafward.push_back(Zero{plv(PLVType::RHat, node_idx)});
+      for (const auto idx : parents) {
+        leafward.push_back(WeightedSumAccumulate{plv(PLVType::RHat, node_idx), idx,
+                                                 leafward_message(idx)});
+      }
+    }
+    for (const size_t side : {0, 1}) {
+      if (node.leaf_[side].has_value()) {
+        continue;
+      }
+      leafward.push_back(Multiply{plv(r(side), node_idx), plv(PLVType::RHat, node_idx),
+                                  phat_source(node_idx, 1 - side)});
+      const auto [begin, end] = node.children_[side];
+      for (size_t idx = begin; idx < end; idx++) {
+        leafward.push_back(
+            Likelihood{idx, plv(r(side), node_idx), rootward_message(idx)});
+      }
+    }
+  }
+  rootward_pass_ = std::move(rootward);
+  leafward_pass_ = std::move(leafward);
+}
+
+void SubsplitDAG::Save(const std::string& path) const {
+  const size_t taxon_words = Bitset::PackedWordCount(TaxonCount());
+  const size_t subsplit_words = Bitset::PackedWordCount(2 * TaxonCount());
+  DAGFileHeader header{};
+  std::copy(std::begin(dag_magic), std::end(dag_magic), header.magic_);
+  header.version_ = version_;
+  header.byte_order_mark_ = byte_order_mark;
+  header.taxon_count_ = TaxonCount();
+  header.rootsplit_count_ = RootsplitCount();
+  header.parent_count_ = parent_to_range_.size();
+  header.parameter_count_ = ParameterCount();
+  header.node_count_ = NodeCount();
+  header.rootward_count_ = RootwardPass().size();
+  header.leafward_count_ = LeafwardPass().size();
+  std::string taxon_name_block;
+  for (const auto& name : taxon_names_) {
+    taxon_name_block += name;
+    taxon_name_block.push_back('\0');
+  }
+  header.taxon_names_size_ = taxon_name_block.size();
+
+  std::vector<uint64_t> rootsplit_words(RootsplitCount() * taxon_words);
+  for (size_t idx = 0; idx < RootsplitCount(); idx++) {
+    rootsplits_[idx].CopyWordsTo(rootsplit_words.data() + idx * taxon_words);
+  }
+  std::vector<std::pair<Range, Bitset>> parents;
+  parents.reserve(parent_to_range_.size());
+  for (const auto& [parent, range] : parent_to_range_) {
+    parents.push_back({range, parent});
+  }
+  std::sort(parents.begin(), parents.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+  std::vector<uint64_t> parent_words(parents.size() * subsplit_words);
+  std::vector<uint64_t> parent_ranges;
+  parent_ranges.reserve(2 * parents.size());
+  for (size_t idx = 0; idx < parents.size(); idx++) {
+    parents[idx].second.CopyWordsTo(parent_words.data() + idx * subsplit_words);
+    parent_ranges.push_back(parents[idx].first.first);
+    parent_ranges.push_back(parents[idx].first.second);
+  }
+  std::vector<uint64_t> child_words((ParameterCount() - RootsplitCount()) *
+                                    taxon_words);
+  for (const auto& [key, idx] : indexer_) {
+    if (idx >= RootsplitCount()) {
+      key.PCSSChunk(2).CopyWordsTo(child_words.data() +
+                                   (idx - RootsplitCount()) * taxon_words);
+    }
+  }
+  const auto flatten = [](const GPOperationVector& operations) {
+    std::vector<FlatOperation> flat_operations;
+    flat_operations.reserve(operations.size());
+    for (const auto& operation : operations) {
+      flat_operations.push_back(Flatten(operation));
+    }
+    return flat_operations;
+  };
+  const auto rootward = flatten(RootwardPass());
+  const auto leafward = flatten(LeafwardPass());
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    Failwith("SubsplitDAG could not create a file at " + path);
+  }
+  const auto write = [&out](const void* data, size_t size) {
+    out.write(static_cast<const char*>(data), size);
+  };
+  write(&header, sizeof(header));
+  write(rootsplit_words.data(), rootsplit_words.size() * sizeof(uint64_t));
+  write(parent_words.data(), parent_words.size() * sizeof(uint64_t));
+  write(parent_ranges.data(), parent_ranges.size() * sizeof(uint64_t));
+  write(child_words.data(), child_words.size() * sizeof(uint64_t));
+  write(taxon_name_block.data(), taxon_name_block.size());
+  write(rootward.data(), rootward.size() * sizeof(FlatOperation));
+  write(leafward.data(), leafward.size() * sizeof(FlatOperation));
+  if (!out) {
+    Failwith("SubsplitDAG could not write to " + path);
+  }
+}
+
+std::shared_ptr<const SubsplitDAG> SubsplitDAG::Load(const std::string& path) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    Failwith("SubsplitDAG could not open " + path);
+  }
+  const auto file_size = static_cast<size_t>(in.tellg());
+  in.seekg(0);
+  DAGFileHeader header{};
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!in || !std::equal(std::begin(dag_magic), std::end(dag_magic), header.magic_)) {
+    Failwith(path + " is not a SubsplitDAG file.");
+  }
+  if (header.version_ != version_ || header.byte_order_mark_ != byte_order_mark) {
+    Failwith("The SubsplitDAG file " + path +
+             " is from another version of libsbn or another kind of machine.");
+  }
+  const size_t taxon_words = Bitset::PackedWordCount(header.taxon_count_);
+  const size_t subsplit_words = Bitset::PackedWordCount(2 * header.taxon_count_);
+  const size_t pcss_count = header.parameter_count_ - header.rootsplit_count_;
+  const size_t expected_size =
+      sizeof(header) +
+      (header.rootsplit_count_ * taxon_words + header.parent_count_ * subsplit_words +
+       2 * header.parent_count_ + pcss_count * taxon_words) *
+          sizeof(uint64_t) +
+      header.taxon_names_size_ +
+      (header.rootward_count_ + header.leafward_count_) * sizeof(FlatOperation);
+  if (header.rootsplit_count_ > header.parameter_count_ || file_size != expected_size) {
+    Failwith("The SubsplitDAG file " + path + " is corrupt.");
+  }
+  const auto read_words = [&in](size_t count) {
+    std::vector<uint64_t> words(count);
+    in.read(reinterpret_cast<char*>(words.data()), count * sizeof(uint64_t));
+    return words;
+  };
+  const auto rootsplit_words = read_words(header.rootsplit_count_ * taxon_words);
+  const auto parent_words = read_words(header.parent_count_ * subsplit_words);
+  const auto parent_ranges = read_words(2 * header.parent_count_);
+  const auto child_words = read_words(pcss_count * taxon_words);
+  std::string taxon_name_block(header.taxon_names_size_, '\0');
+  in.read(taxon_name_block.data(), taxon_name_block.size());
+  const auto read_operations = [&in](size_t count) {
+    std::vector<FlatOperation> flat_operations(count);
+    in.read(reinterpret_cast<char*>(flat_operations.data()),
+            count * sizeof(FlatOperation));
+    GPOperationVector operations;
+    operations.reserve(count);
+    for (const auto& flat : flat_operations) {
+      operations.push_back(Unflatten(flat));
+    }
+    return operations;
+  };
+  auto rootward = read_operations(header.rootward_count_);
+  auto leafward = read_operations(header.leafward_count_);
+  if (!in) {
+    Failwith("SubsplitDAG could not read " + path);
+  }
+
+  std::shared_ptr<SubsplitDAG> dag(new SubsplitDAG());
+  for (size_t begin = 0; begin < taxon_name_block.size();) {
+    const size_t end = taxon_name_block.find('\0', begin);
+    Assert(end != std::string::npos,
+           "The taxon names of SubsplitDAG file " + path + " are corrupt.");
+    dag->taxon_names_.push_back(taxon_name_block.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  Assert(dag->TaxonCount() == header.taxon_count_,
+         "The taxon names of SubsplitDAG file " + path + " are corrupt.");
+  for (size_t idx = 0; idx < header.rootsplit_count_; idx++) {
+    dag->rootsplits_.push_back(Bitset::FromWords(
+        header.taxon_count_, rootsplit_words.data() + idx * taxon_words));
+    SafeInsert(dag->indexer_, dag->rootsplits_.back(), idx);
+  }
+  dag->index_to_child_.resize(header.rootsplit_count_, Bitset(0));
+  // The parents are in the order of their ranges, which tile the PCSSs.
+  for (size_t parent_idx = 0; parent_idx < header.parent_count_; parent_idx++) {
+    const auto parent = Bitset::FromWords(
+        2 * header.taxon_count_, parent_words.data() + parent_idx * subsplit_words);
+    const Range range{parent_ranges[2 * parent_idx], parent_ranges[2 * parent_idx + 1]};
+    Assert(range.first == dag->index_to_child_.size() && range.first <= range.second &&
+               range.second <= header.parameter_count_,
+           "The parent ranges of SubsplitDAG file " + path + " are corrupt.");
+    SafeInsert(dag->parent_to_range_, parent, range);
+    for (size_t idx = range.first; idx < range.second; idx++) {
+      const auto child = Bitset::FromWords(
+          header.taxon_count_,
+          child_words.data() + (idx - header.rootsplit_count_) * taxon_words);
+      SafeInsert(dag->indexer_, parent + child, idx);
+      dag->index_to_child_.push_back(Bitset::ChildSubsplit(parent, child));
+    }
+  }
+  Assert(dag->index_to_child_.size() == header.parameter_count_,
+         "The parent ranges of SubsplitDAG file " + path + " are corrupt.");
+  std::call_once(dag->schedules_flag_, [&] {
+    dag->node_count_ = header.node_count_;
+    dag->rootward_pass_ = std::move(rootward);
+    dag->leafward_pass_ = std::move(leafward);
+  });
+  return dag;
+}
@@ -0,0 +1,187 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A SubsplitDAG is the subsplit support of a collection of trees, indexed once and
+// then shared read-only (as a std::shared_ptr<const SubsplitDAG>) by the
+// SBNInstances and GPInstances that need it. The indexing is that of
+// SBNInstance::ProcessLoadedTrees: the rootsplits in sorted order, then for each
+// parent subsplit in sorted order the range of its children in sorted order. The
+// GPCSPs are these, followed by one for the branch above each leaf (see LeafGPCSP).
+//
+// The nodes of the DAG are subsplits. Node i < TaxonCount() is the leaf of taxon i,
+// and after those come the subsplits of the rootsplits and of the children of the
+// PCSSs, each after all of its children. We write a subsplit with its smaller clade
+// second, as Bitset::ChildSubsplit does, and call that clade side 1 and the other
+// side 0. The children of side 1 of subsplit s are the children of parent s in the
+// SBN maps, and those of side 0 are the children of parent s.RotateSubsplit(). A side
+// with one taxon has that leaf as its only child, along the branch of its LeafGPCSP.
+//
+// RootwardPass and LeafwardPass are GP operation schedules over the whole DAG, which
+// we make the first time one is asked for and then keep. They work on PLVCount()
+// PLVs: each node has a PLV of each PLVType, and each GPCSP has the PLV of the
+// rootward message along its branch, P(branch) p(child), and that of the leafward
+// message, P'(branch) r(parent side). With q the SBN probabilities indexed by GPCSP
+// (see UniformQ), in which the leaf GPCSPs are 1,
+//
+// * p(node) = phat(node, 0) o phat(node, 1), where phat(node, side) is the sum over
+//   the children of the side of q(child) P(branch) p(child), and p(leaf) is the leaf
+//   PLV that GPEngine sets up;
+// * rhat(node) is the stationary distribution at the subsplit of a rootsplit, and
+//   otherwise the sum over its parents of q(node) P'(branch) r(parent side);
+// * r(node, side) = rhat(node) o phat(node, other side).
+//
+// The rootward pass computes p and phat, and the log likelihood of each rootsplit
+// from p and the stationary distribution. The leafward pass, which needs the PLVs
+// of the rootward pass, computes rhat and r, and the log likelihood of each PCSS
+// from r(parent side) and the rootward message along its branch. We don't compute
+// likelihoods for the leaf GPCSPs, whose branches many parents share.
+//
+// Save writes the SBN maps and schedules to a binary file, which Load reads back
+// without counting or indexing anything. As for SBNSnapshot, numbers are in the byte
+// order of the machine that wrote the file.
+
+#ifndef SRC_SUBSPLIT_DAG_HPP_
+#define SRC_SUBSPLIT_DAG_HPP_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "eigen_sugar.hpp"
+#include "gp_operation.hpp"
+#include "node.hpp"
+#include "sbn_maps.hpp"
+#include "sugar.hpp"
+
+class SubsplitDAG {
+ public:
+  using Range = std::pair<size_t, size_t>;
+  using RootsplitCounterFunction =
+      std::function<BitsetSizeDict(const Node::TopologyCounter&)>;
+  using PCSSCounterFunction = std::function<PCSSDict(const Node::TopologyCounter&)>;
+  enum class PLVType : size_t { P, PHat0, PHat1, RHat, R0, R1 };
+  static constexpr size_t plv_type_count_ = 6;
+  // Bump this whenever the layout of Save changes.
+  static constexpr uint32_t version_ = 1;
+
+  // Index the support given by the keys of the counters, which are on these taxa.
+  SubsplitDAG(StringVector taxon_names, const BitsetSizeDict& rootsplit_counter,
+              const PCSSDict& pcss_counter);
+  SubsplitDAG(const SubsplitDAG&) = delete;
+  SubsplitDAG& operator=(const SubsplitDAG&) = delete;
+
+  // Count the rootsplits and PCSSs of the topologies with the given functions (such
+  // as those of RootedSBNMaps), splitting the work between thread_count threads.
+  static std::pair<BitsetSizeDict, PCSSDict> SupportOf(
+      const Node::TopologyCounter& topologies, size_t thread_count,
+      const RootsplitCounterFunction& rootsplit_counter_of,
+      const PCSSCounterFunction& pcss_counter_of);
+  // The DAG of the rooted support of these topologies.
+  static std::shared_ptr<const SubsplitDAG> OfRootedTopologies(
+      StringVector taxon_names, const Node::TopologyCounter& topologies,
+      size_t thread_count = 1);
+  static std::shared_ptr<const SubsplitDAG> Load(const std::string& path);
+  void Save(const std::string& path) const;
+
+  size_t TaxonCount() const { return taxon_names_.size(); }
+  const StringVector& TaxonNames() const { return taxon_names_; }
+  size_t RootsplitCount() const { return rootsplits_.size(); }
+  // The number of SBN parameters, that is, of rootsplits and PCSSs.
+  size_t ParameterCount() const { return index_to_child_.size(); }
+  size_t GPCSPCount() const { return ParameterCount() + TaxonCount(); }
+  size_t LeafGPCSP(size_t taxon_idx) const { return ParameterCount() + taxon_idx; }
+  const BitsetSizeMap& Indexer() const { return indexer_; }
+  const BitsetVector& Rootsplits() const { return rootsplits_; }
+  // As for SBNInstance, the entries at rootsplit indices are empty placeholders.
+  const BitsetVector& IndexToChild() const { return index_to_child_; }
+  const BitsetSizePairMap& ParentToRange() const { return parent_to_range_; }
+  // A fingerprint of the indexing, for GPEngine checkpoints.
+  uint64_t Fingerprint() const;
+  // The q in which each rootsplit, and each child of a parent, is equally likely.
+  EigenVectorXd UniformQ() const;
+
+  size_t NodeCount() const;
+  size_t PLVCount() const;
+  size_t PLVIndex(PLVType plv_type, size_t node_idx) const;
+  size_t RootwardMessagePLVIndex(size_t gpcsp_idx) const;
+  size_t LeafwardMessagePLVIndex(size_t gpcsp_idx) const;
+  const GPOperationVector& RootwardPass() const;
+  const GPOperationVector& LeafwardPass() const;
+
+ private:
+  StringVector taxon_names_;
+  BitsetSizeMap indexer_;
+  BitsetVector rootsplits_;
+  BitsetVector index_to_child_;
+  BitsetSizePairMap parent_to_range_;
+
+  // These are made by MakeSchedules, or read by Load.
+  mutable std::once_flag schedules_flag_;
+  mutable size_t node_count_ = 0;
+  mutable GPOperationVector rootward_pass_;
+  mutable GPOperationVector leafward_pass_;
+
+  SubsplitDAG() = default;
+  void EnsureSchedules() const;
+  void MakeSchedules() const;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("SubsplitDAG") {
+  // The rooted trees (0,(1,(2,3))) and (0,(3,(1,2))).
+  Node::TopologyCounter topologies;
+  topologies[Node::OfParentIdVector({6, 5, 4, 4, 5, 6})] = 2;
+  topologies[Node::OfParentIdVector({6, 4, 4, 5, 5, 6})] = 1;
+  const StringVector taxon_names{"a", "b", "c", "d"};
+  const auto dag = SubsplitDAG::OfRootedTopologies(taxon_names, topologies);
+  // One rootsplit, and for 0|123 the children 1|23 and 3|12, each with a cherry.
+  CHECK_EQ(dag->RootsplitCount(), 1);
+  CHECK_EQ(dag->ParameterCount(), 5);
+  CHECK_EQ(dag->GPCSPCount(), 9);
+  // Four leaves, the root, two children, and two cherries.
+  CHECK_EQ(dag->NodeCount(), 9);
+  CHECK_EQ(dag->PLVCount(), 6 * 9 + 2 * 9);
+  // The indexing doesn't depend on the number of threads.
+  const auto threaded_dag = SubsplitDAG::OfRootedTopologies(taxon_names, topologies, 2);
+  CHECK((threaded_dag->Indexer() == dag->Indexer()));
+  CHECK_EQ(threaded_dag->Fingerprint(), dag->Fingerprint());
+  const auto q = dag->UniformQ();
+  CHECK_EQ(q.size(), 9);
+  CHECK_EQ(q(0), 1.);
+  for (const auto& [parent, range] : dag->ParentToRange()) {
+    for (size_t idx = range.first; idx < range.second; idx++) {
+      CHECK_EQ(q(idx), 1. / static_cast<double>(range.second - range.first));
+    }
+  }
+  CHECK_EQ(q(dag->LeafGPCSP(3)), 1.);
+  // The root's side 1 has two children, so its phat sums two messages.
+  size_t accumulate_count = 0;
+  for (const auto& operation : dag->RootwardPass()) {
+    accumulate_count +=
+        std::holds_alternative<GPOperations::WeightedSumAccumulate>(operation);
+  }
+  CHECK_EQ(accumulate_count, 4);
+  // Saving and loading gets the same DAG and schedules.
+  dag->Save("_ignore/subsplit_dag.data");
+  const auto loaded_dag = SubsplitDAG::Load("_ignore/subsplit_dag.data");
+  CHECK_EQ(loaded_dag->TaxonNames(), taxon_names);
+  CHECK((loaded_dag->Indexer() == dag->Indexer()));
+  CHECK((loaded_dag->IndexToChild() == dag->IndexToChild()));
+  CHECK((loaded_dag->ParentToRange() == dag->ParentToRange()));
+  CHECK_EQ(loaded_dag->PLVCount(), dag->PLVCount());
+  for (const auto& [loaded, original] :
+       {std::make_pair(&loaded_dag->RootwardPass(), &dag->RootwardPass()),
+        std::make_pair(&loaded_dag->LeafwardPass(), &dag->LeafwardPass())}) {
+    CHECK_EQ(loaded->size(), original->size());
+    for (size_t op_idx = 0; op_idx < loaded->size(); op_idx++) {
+      CHECK_EQ((*loaded)[op_idx].index(), (*original)[op_idx].index());
+      CHECK_EQ(GPOperations::PLVIndices((*loaded)[op_idx]),
+               GPOperations::PLVIndices((*original)[op_idx]));
+    }
+  }
+  CHECK_THROWS(SubsplitDAG::Load("data/hello.fasta"));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_SUBSPLIT_DAG_HPP_
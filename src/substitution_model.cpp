@@ -2,6 +2,7 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "substitution_model.hpp"
+#include <algorithm>
 
 std::unique_ptr<SubstitutionModel> SubstitutionModel::OfSpecification(
     const std::string &specification) {
@@ -11,6 +12,9 @@ std::unique_ptr<SubstitutionModel> SubstitutionModel::OfSpecification(
   if (specification == "GTR") {
     return std::make_unique<GTRModel>();
   }  // else
+  if (specification == "GTR+direct") {
+    return std::make_unique<GTRModel>(GTRModel::EigenSolver::Direct);
+  }  // else
   Failwith("Substitution model not known: " + specification);
 }
 
@@ -51,18 +55,76 @@ void GTRModel::UpdateQMatrix() {
 }
 
 void GTRModel::Update() {
+  DecompositionKey key;
+  std::copy(rates_.begin(), rates_.end(), key.begin());
+  std::copy(frequencies_.begin(), frequencies_.end(), key.begin() + rates_.size());
+  if (decomposition_cache_capacity_ > 0) {
+    auto search = decomposition_cache_.find(key);
+    if (search != decomposition_cache_.end()) {
+      cache_hit_count_++;
+      recency_.splice(recency_.begin(), recency_, search->second);
+      const Decomposition &decomposition = search->second->second;
+      Q_ = decomposition.Q_;
+      eigenvectors_ = decomposition.eigenvectors_;
+      inverse_eigenvectors_ = decomposition.inverse_eigenvectors_;
+      eigenvalues_ = decomposition.eigenvalues_;
+      return;
+    }
+  }  // else
+  cache_miss_count_++;
+  UpdateQMatrix();
+  UpdateEigendecomposition();
+  if (decomposition_cache_capacity_ == 0) {
+    return;
+  }  // else
+  if (decomposition_cache_.size() == decomposition_cache_capacity_) {
+    decomposition_cache_.erase(recency_.back().first);
+    recency_.pop_back();
+  }
+  recency_.emplace_front(
+      key, Decomposition{Q_, eigenvectors_, inverse_eigenvectors_, eigenvalues_});
+  decomposition_cache_.emplace(key, recency_.begin());
+}
+
+void GTRModel::UpdateEigendecomposition() {
   Eigen::Map<const Eigen::Array4d> tmp(&frequencies_[0]);
   EigenMatrixXd sqrt_frequencies = EigenMatrixXd(tmp.sqrt().matrix().asDiagonal());
   EigenMatrixXd sqrt_frequencies_inv = EigenMatrixXd(sqrt_frequencies.inverse());
+  const Eigen::Matrix4d S = sqrt_frequencies * Q_ * sqrt_frequencies_inv;
 
-  UpdateQMatrix();
-  EigenMatrixXd S = EigenMatrixXd(sqrt_frequencies * Q_ * sqrt_frequencies_inv);
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> solver(S);
+  // The orthogonal eigenvectors of S, as columns, and their eigenvalues.
+  Eigen::Matrix4d U;
+  Eigen::Vector4d lambda;
+  if (eigen_solver_ == EigenSolver::Iterative) {
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> solver(S);
+    U = solver.eigenvectors();
+    lambda = solver.eigenvalues();
+  } else {
+    // Because the rows of Q sum to zero, S u = 0 for u the square root of the
+    // frequencies. The Householder reflection H that takes u to -e_0 is symmetric and
+    // orthogonal, so its last three columns B are an orthonormal basis of the
+    // complement of u. The rest of the eigenvectors are B times those of the 3x3
+    // matrix B^T S B, which Eigen diagonalizes in closed form.
+    const Eigen::Vector4d u = tmp.sqrt().matrix().normalized();
+    Eigen::Vector4d v = u;
+    v(0) += 1.;
+    const Eigen::Matrix4d H =
+        Eigen::Matrix4d::Identity() - 2. * v * v.transpose() / v.squaredNorm();
+    const Eigen::Matrix<double, 4, 3> B = H.rightCols<3>();
+    const Eigen::Matrix3d T = B.transpose() * S * B;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+    solver.computeDirect(T);
+    // We follow the iterative solver in putting the eigenvalues in increasing
+    // order, so the zero goes last.
+    U.leftCols<3>() = B * solver.eigenvectors();
+    U.col(3) = u;
+    lambda << solver.eigenvalues(), 0.;
+  }
 
   // See p.206 of Felsenstein's book. We can get the eigendecomposition of a GTR
   // model by first getting the eigendecomposition of an associated diagonal
   // matrix and then doing this transformation.
-  eigenvectors_ = sqrt_frequencies_inv * solver.eigenvectors();
-  inverse_eigenvectors_ = solver.eigenvectors().transpose() * sqrt_frequencies;
-  eigenvalues_ = solver.eigenvalues();
+  eigenvectors_ = sqrt_frequencies_inv * U;
+  inverse_eigenvectors_ = U.transpose() * sqrt_frequencies;
+  eigenvalues_ = lambda;
 }
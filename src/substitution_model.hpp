@@ -4,8 +4,11 @@
 #ifndef SRC_SUBSTITUTION_MODEL_HPP_
 #define SRC_SUBSTITUTION_MODEL_HPP_
 #include <Eigen/Dense>
+#include <array>
+#include <list>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "block_model.hpp"
 #include "sugar.hpp"
@@ -70,9 +73,43 @@ class JC69Model : public DNAModel {
   void SetParameters(const EigenVectorXdRef param_vector){};
 };
 
+// The equal-rates model on any number of states, which for four states is JC69Model
+// and for twenty is the Poisson model of protein evolution. Q is symmetric, so its
+// eigenvectors are orthonormal and their inverse is their transpose.
+template <size_t StateCount>
+class PoissonModel : public SubstitutionModel {
+ public:
+  PoissonModel() : SubstitutionModel({}) {
+    static_assert(StateCount > 1, "PoissonModel needs at least two states.");
+    frequencies_ = EigenVectorXd::Constant(StateCount, 1. / StateCount);
+    Q_ = EigenMatrixXd::Constant(StateCount, StateCount, 1. / (StateCount - 1));
+    Q_.diagonal().setConstant(-1.);
+    const Eigen::SelfAdjointEigenSolver<EigenMatrixXd> solver(Q_);
+    eigenvectors_ = solver.eigenvectors();
+    inverse_eigenvectors_ = eigenvectors_.transpose();
+    eigenvalues_ = solver.eigenvalues();
+  }
+
+  void SetParameters(const EigenVectorXdRef param_vector) override{};
+};
+
+// GTRModel keeps the decompositions for its most recently used parameters, so that
+// going back to earlier parameters (as when each tree has its own parameters) skips
+// the eigendecomposition. The key is the parameters themselves, so a hit gives
+// exactly what we would have computed.
 class GTRModel : public DNAModel {
  public:
-  GTRModel() : DNAModel({{rates_key_, 6}, {frequencies_key_, 4}}) {
+  // How we diagonalize the symmetric matrix S that is similar to Q. Iterative uses
+  // Eigen's general SelfAdjointEigenSolver. Direct uses that the square root of the
+  // frequencies is an eigenvector of S with eigenvalue zero, and solves the 3x3
+  // problem on its orthogonal complement in closed form.
+  enum class EigenSolver { Iterative, Direct };
+
+  explicit GTRModel(EigenSolver eigen_solver = EigenSolver::Iterative,
+                    size_t decomposition_cache_capacity = 8)
+      : DNAModel({{rates_key_, 6}, {frequencies_key_, 4}}),
+        eigen_solver_(eigen_solver),
+        decomposition_cache_capacity_(decomposition_cache_capacity) {
     rates_.resize(6);
     rates_ << 1.0, 1.0, 1.0, 1.0, 1.0, 1.0;
     frequencies_ << 0.25, 0.25, 0.25, 0.25;
@@ -81,16 +118,49 @@ class GTRModel : public DNAModel {
 
   void SetParameters(const EigenVectorXdRef param_vector) override;
 
+  EigenSolver GetEigenSolver() const { return eigen_solver_; }
+  size_t DecompositionCacheHitCount() const { return cache_hit_count_; }
+  size_t DecompositionCacheMissCount() const { return cache_miss_count_; }
+
   inline const static std::string rates_key_ = "GTR rates";
   inline const static std::string frequencies_key_ = "frequencies";
 
  protected:
   void UpdateQMatrix();
-  // Update the Q matrix _and_ the eigendecomposition.
+  // Update the Q matrix _and_ the eigendecomposition, from the cache if we can.
   void Update();
+  void UpdateEigendecomposition();
 
  private:
+  // The rates followed by the frequencies.
+  using DecompositionKey = std::array<double, 10>;
+  struct DecompositionKeyHasher {
+    size_t operator()(const DecompositionKey &key) const {
+      size_t hash = 0;
+      for (const double value : key) {
+        hash = hash * 31 + std::hash<double>()(value);
+      }
+      return hash;
+    }
+  };
+  struct Decomposition {
+    EigenMatrixXd Q_;
+    EigenMatrixXd eigenvectors_;
+    EigenMatrixXd inverse_eigenvectors_;
+    EigenVectorXd eigenvalues_;
+  };
+  using CacheEntry = std::pair<DecompositionKey, Decomposition>;
+
   EigenVectorXd rates_;
+  EigenSolver eigen_solver_;
+  size_t decomposition_cache_capacity_;
+  // The cached decompositions, from most to least recently used.
+  std::list<CacheEntry> recency_;
+  std::unordered_map<DecompositionKey, std::list<CacheEntry>::iterator,
+                     DecompositionKeyHasher>
+      decomposition_cache_;
+  size_t cache_hit_count_ = 0;
+  size_t cache_miss_count_ = 0;
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
@@ -129,6 +199,62 @@ TEST_CASE("SubstitutionModel") {
   EigenVectorXd eigen_values_r(4);
   eigen_values_r << -2.567992e+00, -1.760838e+00, -4.214918e-01, 1.665335e-16;
   CheckEigenvalueEquality(eigen_values_r, gtr_model->GetEigenvalues());
+  // The Poisson model on four states is JC69.
+  PoissonModel<4> poisson_model;
+  CHECK_LT((poisson_model.GetQMatrix() - jc_model->GetQMatrix()).norm(), 1e-12);
+  CheckEigenvalueEquality(jc_model->GetEigenvalues(), poisson_model.GetEigenvalues());
+  PoissonModel<20> amino_acid_model;
+  const EigenMatrixXd Q = amino_acid_model.GetEigenvectors() *
+                          amino_acid_model.GetEigenvalues().asDiagonal() *
+                          amino_acid_model.GetInverseEigenvectors();
+  CHECK_LT((Q - amino_acid_model.GetQMatrix()).norm(), 1e-10);
+}
+
+TEST_CASE("SubstitutionModel: GTR eigensolvers and decomposition cache") {
+  EigenVectorXd param_vector(10);
+  param_vector << 0.060602, 0.402732, 0.028230, 0.047910, 0.407249, 0.053277, 0.479367,
+      0.172572, 0.140933, 0.207128;
+  EigenVectorXd other_param_vector(10);
+  other_param_vector << 1., 2., 1., 1., 2., 1., 0.25, 0.25, 0.25, 0.25;
+  GTRModel iterative_model;
+  GTRModel direct_model(GTRModel::EigenSolver::Direct);
+  for (EigenVectorXd params : {param_vector, other_param_vector}) {
+    iterative_model.SetParameters(params);
+    direct_model.SetParameters(params);
+    CHECK_LT((direct_model.GetQMatrix() - iterative_model.GetQMatrix()).norm(), 1e-12);
+    // Both decompositions give back Q, though the eigenvalues may come in a
+    // different order.
+    const EigenMatrixXd Q =
+        direct_model.GetEigenvectors() *
+        direct_model.GetEigenvalues().asDiagonal() *
+        direct_model.GetInverseEigenvectors();
+    CHECK_LT((Q - direct_model.GetQMatrix()).norm(), 1e-10);
+    const EigenMatrixXd identity =
+        direct_model.GetEigenvectors() * direct_model.GetInverseEigenvectors();
+    CHECK_LT((identity - EigenMatrixXd::Identity(4, 4)).norm(), 1e-10);
+    EigenVectorXd direct_eigenvalues = direct_model.GetEigenvalues();
+    EigenVectorXd iterative_eigenvalues = iterative_model.GetEigenvalues();
+    std::sort(direct_eigenvalues.begin(), direct_eigenvalues.end());
+    std::sort(iterative_eigenvalues.begin(), iterative_eigenvalues.end());
+    CheckVectorXdEquality(direct_eigenvalues, iterative_eigenvalues, 1e-10);
+  }
+  // Going back to earlier parameters hits the cache and gives the same answer as
+  // computing it afresh.
+  GTRModel model(GTRModel::EigenSolver::Iterative, 2);
+  const size_t initial_miss_count = model.DecompositionCacheMissCount();
+  model.SetParameters(param_vector);
+  const EigenMatrixXd eigenvectors = model.GetEigenvectors();
+  model.SetParameters(other_param_vector);
+  model.SetParameters(param_vector);
+  CHECK_EQ(model.DecompositionCacheHitCount(), 1);
+  CHECK_EQ(model.DecompositionCacheMissCount(), initial_miss_count + 2);
+  CHECK_EQ((model.GetEigenvectors() - eigenvectors).norm(), 0.);
+  // With a capacity of zero we don't cache anything.
+  GTRModel uncached_model(GTRModel::EigenSolver::Iterative, 0);
+  uncached_model.SetParameters(param_vector);
+  uncached_model.SetParameters(param_vector);
+  CHECK_EQ(uncached_model.DecompositionCacheHitCount(), 0);
+  CHECK_EQ((uncached_model.GetEigenvectors() - eigenvectors).norm(), 0.);
 }
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
@@ -29,16 +29,40 @@
 // However, here the tasks are few and big, the time required during locking is
 // small (put an integer in a dequeue). The overhead of including a true
 // threading library wouldn't be worth it for this example.
+//
+// TaskProcessor spawns and joins its threads every time it is constructed. For
+// callers that dispatch many small batches in a row (such as the likelihood and
+// gradient calls of an Engine during VIP) use the WorkStealingPool below, which
+// keeps one long-lived thread per Executor. Each thread is pinned to its Executor
+// and has its own deque of Work; when a deque runs dry its thread steals from the
+// back of the others, so there is no single lock that all Work has to go through.
+// A WorkStealingPool can also make each Executor on its own thread, so that memory
+// that the Executor allocates and fills is first touched by the thread that uses it,
+// which puts it on that thread's NUMA node.
+//
+// A BoundedQueue connects the stages of a pipeline, each on its own thread. Push
+// blocks while the queue is full, so a fast stage can't run ahead of a slow one by
+// more than the capacity of the queue between them.
 
 #ifndef SRC_TASK_PROCESSOR_HPP_
 #define SRC_TASK_PROCESSOR_HPP_
 
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <numeric>
+#include <optional>
 #include <queue>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
+#include "hot_path_profile.hpp"
 
 template <class Executor, class Work>
 class TaskProcessor {
@@ -111,6 +135,344 @@ class TaskProcessor {
   }
 };
 
+template <class Executor>
+class WorkStealingPool {
+ public:
+  typedef std::function<void(Executor, size_t)> Task;
+  typedef std::function<Executor(size_t)> ExecutorMaker;
+  typedef std::vector<Executor> ExecutorVector;
+
+  // Start one thread per executor. These threads live as long as the pool.
+  explicit WorkStealingPool(ExecutorVector executors)
+      : executors_(std::move(executors)) {
+    StartThreads(nullptr);
+  }
+  // Start executor_count threads, each of which first makes its executor by calling
+  // make_executor with its index. We return once all of the executors are made, and
+  // rethrow the first exception that a call to make_executor threw.
+  WorkStealingPool(size_t executor_count, const ExecutorMaker &make_executor)
+      : executors_(executor_count) {
+    StartThreads(&make_executor);
+    std::exception_ptr exception;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_done_.wait(lock, [this] { return made_count_ == executors_.size(); });
+      exception = exception_;
+      exception_ = nullptr;
+    }
+    if (exception != nullptr) {
+      StopThreads();
+      std::rethrow_exception(exception);
+    }
+  }
+
+  // Delete (copy + move) x (constructor + assignment)
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool(const WorkStealingPool &&) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &&) = delete;
+
+  ~WorkStealingPool() { StopThreads(); }
+
+  size_t ExecutorCount() const { return executors_.size(); }
+  Executor GetExecutor(size_t executor_idx) const {
+    return executors_.at(executor_idx);
+  }
+
+  // When queue wait timing is on, each thread records how long every unit of Work
+  // it picks up waited since Run dealt it out. Only read or reset the histogram
+  // between calls to Run.
+  void SetQueueWaitTiming(bool queue_wait_timing) {
+    queue_wait_timing_ = queue_wait_timing;
+  }
+  HotPathProfile::QueueWaitHistogram GetQueueWaitHistogram() const {
+    HotPathProfile::QueueWaitHistogram histogram = {};
+    for (const auto &worker : workers_) {
+      for (size_t i = 0; i < histogram.size(); i++) {
+        histogram[i] += worker->queue_wait_histogram_[i];
+      }
+    }
+    return histogram;
+  }
+  void ResetQueueWaitHistogram() {
+    for (auto &worker : workers_) {
+      worker->queue_wait_histogram_.fill(0);
+    }
+  }
+
+  // Run the task on the Work items 0, ..., work_count - 1, returning once all of
+  // them are done. If a task throws, the first exception is rethrown here after
+  // the remaining Work has been processed.
+  void Run(size_t work_count, const Task &task) {
+    // Deal the Work out round-robin so that each deque starts with a fair share.
+    RunDealt(work_count, task, [this, work_count] {
+      for (size_t i = 0; i < work_count; i++) {
+        Deal(i % workers_.size(), i);
+      }
+    });
+  }
+
+  // Run the task as above, but with assignment[i] listing the Work that starts in the
+  // deque of the i-th thread, in the order that the thread takes it. Every Work item
+  // 0, ..., work_count - 1 needs to appear exactly once. Threads that run dry still
+  // steal from the backs of the other deques.
+  void Run(const std::vector<std::vector<size_t>> &assignment, const Task &task) {
+    if (assignment.size() != workers_.size()) {
+      throw std::invalid_argument("We need an assignment for every thread.");
+    }
+    std::vector<size_t> owners;
+    for (size_t worker_idx = 0; worker_idx < assignment.size(); worker_idx++) {
+      for (const auto work : assignment[worker_idx]) {
+        if (work >= owners.size()) {
+          owners.resize(work + 1, workers_.size());
+        }
+        if (owners[work] != workers_.size()) {
+          throw std::invalid_argument("Work " + std::to_string(work) +
+                                      " is assigned twice.");
+        }
+        owners[work] = worker_idx;
+      }
+    }
+    for (size_t work = 0; work < owners.size(); work++) {
+      if (owners[work] == workers_.size()) {
+        throw std::invalid_argument("Work " + std::to_string(work) +
+                                    " isn't assigned.");
+      }
+    }
+    RunDealt(owners.size(), task, [this, &assignment] {
+      for (size_t worker_idx = 0; worker_idx < assignment.size(); worker_idx++) {
+        for (const auto work : assignment[worker_idx]) {
+          Deal(worker_idx, work);
+        }
+      }
+    });
+  }
+
+ private:
+  // A Worker's deque is pushed to by Run, popped from the front by its own
+  // thread, and stolen from the back by the other threads. Only the Worker's own
+  // thread writes to its histogram.
+  struct Worker {
+    std::mutex lock_;
+    std::deque<size_t> deque_;
+    HotPathProfile::QueueWaitHistogram queue_wait_histogram_ = {};
+  };
+
+  ExecutorVector executors_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::mutex run_lock_;
+  std::atomic<bool> queue_wait_timing_ = false;
+  // The following are guarded by lock_.
+  std::mutex lock_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  const Task *task_ = nullptr;
+  HotPathProfile::Clock::time_point dealt_time_;
+  size_t generation_ = 0;
+  size_t remaining_count_ = 0;
+  size_t busy_count_ = 0;
+  size_t made_count_ = 0;
+  bool stopping_ = false;
+  std::exception_ptr exception_;
+
+  void Deal(size_t worker_idx, size_t work) {
+    auto &worker = *workers_[worker_idx];
+    std::lock_guard<std::mutex> worker_lock(worker.lock_);
+    worker.deque_.push_back(work);
+  }
+
+  // Run the task on Work items 0, ..., work_count - 1 once deal has dealt them out
+  // to the deques.
+  template <typename DealAll>
+  void RunDealt(size_t work_count, const Task &task, DealAll deal) {
+    if (work_count == 0) {
+      return;
+    }
+    // Only one batch is in flight at a time.
+    std::lock_guard<std::mutex> run_lock(run_lock_);
+    std::unique_lock<std::mutex> lock(lock_);
+    // Wait for any thread that woke up late for the previous batch to go idle so
+    // that it can't pick up this batch's Work with the previous batch's Task.
+    work_done_.wait(lock, [this] { return busy_count_ == 0; });
+    deal();
+    task_ = &task;
+    dealt_time_ = HotPathProfile::Clock::now();
+    remaining_count_ = work_count;
+    exception_ = nullptr;
+    generation_++;
+    work_available_.notify_all();
+    work_done_.wait(lock, [this] { return remaining_count_ == 0 && busy_count_ == 0; });
+    task_ = nullptr;
+    if (exception_ != nullptr) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+  // Start the threads, which make their executors first if make_executor isn't null.
+  void StartThreads(const ExecutorMaker *make_executor) {
+    for (size_t i = 0; i < executors_.size(); i++) {
+      workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < executors_.size(); i++) {
+      threads_.emplace_back(&WorkStealingPool::thread_handler, this, i, make_executor);
+    }
+  }
+
+  void StopThreads() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (auto &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+  bool PopOrSteal(size_t worker_idx, size_t &work) {
+    {
+      auto &worker = *workers_[worker_idx];
+      std::lock_guard<std::mutex> worker_lock(worker.lock_);
+      if (!worker.deque_.empty()) {
+        work = worker.deque_.front();
+        worker.deque_.pop_front();
+        return true;
+      }
+    }
+    for (size_t offset = 1; offset < workers_.size(); offset++) {
+      auto &victim = *workers_[(worker_idx + offset) % workers_.size()];
+      std::lock_guard<std::mutex> victim_lock(victim.lock_);
+      if (!victim.deque_.empty()) {
+        work = victim.deque_.back();
+        victim.deque_.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The make_executor pointer is only used before the constructor returns.
+  void thread_handler(size_t worker_idx, const ExecutorMaker *make_executor) {
+    if (make_executor != nullptr) {
+      std::exception_ptr exception = nullptr;
+      try {
+        executors_[worker_idx] = (*make_executor)(worker_idx);
+      } catch (...) {
+        exception = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        made_count_++;
+        if (exception != nullptr && exception_ == nullptr) {
+          exception_ = exception;
+        }
+      }
+      work_done_.notify_all();
+    }
+    size_t seen_generation = 0;
+    while (true) {
+      const Task *task;
+      HotPathProfile::Clock::time_point dealt_time;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        work_available_.wait(lock, [this, seen_generation] {
+          return stopping_ || generation_ != seen_generation;
+        });
+        if (stopping_) {
+          return;
+        }
+        seen_generation = generation_;
+        task = task_;
+        dealt_time = dealt_time_;
+        busy_count_++;
+      }
+      size_t work;
+      size_t completed_count = 0;
+      std::exception_ptr exception = nullptr;
+      auto &queue_wait_histogram = workers_[worker_idx]->queue_wait_histogram_;
+      while (PopOrSteal(worker_idx, work)) {
+        if (queue_wait_timing_) {
+          const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              HotPathProfile::Clock::now() - dealt_time);
+          queue_wait_histogram[HotPathProfile::QueueWaitBucket(
+              static_cast<uint64_t>(wait.count()))]++;
+        }
+        try {
+          (*task)(executors_[worker_idx], work);
+        } catch (...) {
+          if (exception == nullptr) {
+            exception = std::current_exception();
+          }
+        }
+        completed_count++;
+      }
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        remaining_count_ -= completed_count;
+        busy_count_--;
+        if (exception != nullptr && exception_ == nullptr) {
+          exception_ = exception;
+        }
+      }
+      work_done_.notify_all();
+    }
+  }
+};
+
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {
+    if (capacity_ == 0) {
+      throw std::invalid_argument("BoundedQueue needs a positive capacity.");
+    }
+  }
+
+  // Add an item, waiting while the queue is full. Returns false, dropping the item,
+  // if the queue is closed.
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(lock_);
+    not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }  // else
+    items_.push(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+  // Take the oldest item, waiting while the queue is empty, or return nullopt once the
+  // queue is closed and empty.
+  std::optional<T> Pop() {
+    std::unique_lock<std::mutex> lock(lock_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return std::nullopt;
+    }  // else
+    T item = std::move(items_.front());
+    items_.pop();
+    not_full_.notify_one();
+    return item;
+  }
+  // Stop taking items. Items already in the queue can still be popped.
+  void Close() {
+    std::lock_guard<std::mutex> lock(lock_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  std::queue<T> items_;
+  bool closed_ = false;
+  std::mutex lock_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
 #ifdef DOCTEST_LIBRARY_INCLUDED
 TEST_CASE("TaskProcessor") {
   std::queue<int> executor_queue;
@@ -135,5 +497,96 @@ TEST_CASE("TaskProcessor") {
   std::vector<float> correct_results({0, 1, 2, 3, 4, 5, 6, 7});
   CHECK_EQ(results, correct_results);
 }
+
+TEST_CASE("WorkStealingPool") {
+  std::vector<size_t> results(100);
+  WorkStealingPool<int> pool({0, 1, 2, 3});
+  CHECK_EQ(pool.ExecutorCount(), 4);
+  // Run several batches through the same pool, keeping track of which executor
+  // did the work (to make sure that each thread sticks to its own executor).
+  for (size_t batch = 1; batch <= 3; batch++) {
+    std::vector<int> executor_used(results.size(), -1);
+    pool.Run(results.size(),
+             [&results, &executor_used, batch](int executor, size_t work) {
+               results[work] = batch * work;
+               executor_used[work] = executor;
+             });
+    for (size_t i = 0; i < results.size(); i++) {
+      CHECK_EQ(results[i], batch * i);
+      CHECK_GE(executor_used[i], 0);
+      CHECK_LT(executor_used[i], 4);
+    }
+  }
+  CHECK_THROWS(pool.Run(10, [](int, size_t work) {
+    if (work == 7) {
+      throw std::runtime_error("Problem with work 7.");
+    }
+  }));
+  // The pool is still usable after an exception.
+  pool.Run(results.size(), [&results](int, size_t work) { results[work] = 0; });
+  CHECK_EQ(results, std::vector<size_t>(results.size(), 0));
+  // Every unit of Work lands in the queue wait histogram while timing is on.
+  const auto histogram_total = [&pool] {
+    const auto histogram = pool.GetQueueWaitHistogram();
+    return std::accumulate(histogram.begin(), histogram.end(), uint64_t(0));
+  };
+  CHECK_EQ(histogram_total(), 0);
+  pool.SetQueueWaitTiming(true);
+  pool.Run(results.size(), [](int, size_t) {});
+  CHECK_EQ(histogram_total(), results.size());
+  pool.SetQueueWaitTiming(false);
+  pool.Run(results.size(), [](int, size_t) {});
+  CHECK_EQ(histogram_total(), results.size());
+  pool.ResetQueueWaitHistogram();
+  CHECK_EQ(histogram_total(), 0);
+  // With an assignment, every Work item is done once, whoever ends up doing it.
+  std::vector<int> done_count(10, 0);
+  pool.Run({{9, 0, 1}, {}, {5, 4, 3, 2}, {8, 7, 6}},
+           [&done_count](int, size_t work) { done_count[work]++; });
+  CHECK_EQ(done_count, std::vector<int>(10, 1));
+  CHECK_THROWS(pool.Run({{0, 1}, {1}, {}, {}}, [](int, size_t) {}));
+  CHECK_THROWS(pool.Run({{0, 2}, {}, {}, {}}, [](int, size_t) {}));
+  CHECK_THROWS(pool.Run({{0, 1}}, [](int, size_t) {}));
+  // Executors made by the pool are made on the threads that use them.
+  WorkStealingPool<std::thread::id> made_pool(
+      4, [](size_t) { return std::this_thread::get_id(); });
+  std::vector<int> on_own_thread(results.size());
+  made_pool.Run(results.size(),
+                [&on_own_thread](std::thread::id executor, size_t work) {
+                  on_own_thread[work] = (executor == std::this_thread::get_id());
+                });
+  CHECK_EQ(on_own_thread, std::vector<int>(results.size(), 1));
+  CHECK_THROWS(WorkStealingPool<int>(4, [](size_t executor_idx) {
+    if (executor_idx == 2) {
+      throw std::runtime_error("Problem making executor 2.");
+    }
+    return static_cast<int>(executor_idx);
+  }));
+}
+
+TEST_CASE("BoundedQueue") {
+  BoundedQueue<int> queue(2);
+  std::atomic<int> pushed_count = 0;
+  std::thread producer([&queue, &pushed_count] {
+    for (int item = 0; item < 100; item++) {
+      queue.Push(item);
+      pushed_count++;
+    }
+    queue.Close();
+  });
+  std::vector<int> items;
+  while (auto item = queue.Pop()) {
+    // The producer can't get more than the capacity ahead of us, plus the item that
+    // it has in hand.
+    CHECK_LE(pushed_count.load(), static_cast<int>(items.size()) + 3);
+    items.push_back(*item);
+  }
+  producer.join();
+  std::vector<int> correct_items(100);
+  std::iota(correct_items.begin(), correct_items.end(), 0);
+  CHECK_EQ(items, correct_items);
+  CHECK_FALSE(queue.Push(100));
+  CHECK_FALSE(queue.Pop().has_value());
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_TASK_PROCESSOR_HPP_
@@ -0,0 +1,60 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "taxon_registry.hpp"
+
+TaxonRegistry::TaxonRegistry(const TagStringMap &tag_taxon_map)
+    : taxon_names_(tag_taxon_map.size()) {
+  std::vector<bool> seen(tag_taxon_map.size(), false);
+  for (const auto &[tag, taxon_name] : tag_taxon_map) {
+    const size_t taxon_id = MaxLeafIDOfTag(tag);
+    if (LeafCountOfTag(tag) != 1 || taxon_id >= taxon_names_.size() ||
+        seen[taxon_id]) {
+      Failwith("The tags of a TaxonRegistry must be the leaf tags of ids 0 to " +
+               std::to_string(tag_taxon_map.size()) + " - 1, but we have the tag of " +
+               std::to_string(LeafCountOfTag(tag)) + " leaves with maximum id " +
+               std::to_string(taxon_id) + " for '" + taxon_name + "'.");
+    }
+    seen[taxon_id] = true;
+    taxon_names_[taxon_id] = taxon_name;
+    if (!name_to_id_.emplace(taxon_name, taxon_id).second) {
+      Failwith("Taxon '" + taxon_name + "' appears twice in a TaxonRegistry.");
+    }
+  }
+}
+
+size_t TaxonRegistry::IdOfTag(Tag tag) const {
+  const size_t taxon_id = MaxLeafIDOfTag(tag);
+  Assert(LeafCountOfTag(tag) == 1 && taxon_id < TaxonCount(),
+         "Tag isn't that of a leaf in this TaxonRegistry.");
+  return taxon_id;
+}
+
+size_t TaxonRegistry::IdOfName(const std::string &taxon_name) const {
+  const auto search = name_to_id_.find(taxon_name);
+  if (search == name_to_id_.end()) {
+    Failwith("Taxon '" + taxon_name + "' not found in TaxonRegistry.");
+  }
+  return search->second;
+}
+
+TagStringMap TaxonRegistry::TagTaxonMap() const {
+  TagStringMap tag_taxon_map;
+  for (size_t taxon_id = 0; taxon_id < TaxonCount(); taxon_id++) {
+    SafeInsert(tag_taxon_map, PackInts(static_cast<uint32_t>(taxon_id), 1),
+               taxon_names_[taxon_id]);
+  }
+  return tag_taxon_map;
+}
+
+std::vector<const std::string *> TaxonRegistry::SequencesOf(
+    const Alignment &alignment) const {
+  std::vector<const std::string *> sequences(TaxonCount());
+  for (size_t taxon_id = 0; taxon_id < TaxonCount(); taxon_id++) {
+    sequences[taxon_id] = &alignment.at(taxon_names_[taxon_id]);
+    if (sequences[taxon_id]->size() != sequences[0]->size()) {
+      Failwith("Sequence for '" + taxon_names_[taxon_id] + "' has the wrong length.");
+    }
+  }
+  return sequences;
+}
@@ -0,0 +1,75 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A TaxonRegistry is the taxa of a tag-taxon map, looked up once. The taxa get the
+// dense ids 0, ..., TaxonCount() - 1 that are the leaf ids of their tags, so that code
+// working with taxa can index vectors by id rather than going between tags and
+// taxon name strings: the name of each id, the id of each leaf tag and name, and the
+// sequence of each id in an alignment are all precomputed or a single lookup.
+//
+// Tree collections make theirs when they are built and share it between copies, and
+// SitePattern compresses an alignment through one.
+
+#ifndef SRC_TAXON_REGISTRY_HPP_
+#define SRC_TAXON_REGISTRY_HPP_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "alignment.hpp"
+#include "sugar.hpp"
+
+class TaxonRegistry {
+ public:
+  TaxonRegistry() = default;
+  // The tags must be the leaf tags of ids 0, ..., tag_taxon_map.size() - 1.
+  explicit TaxonRegistry(const TagStringMap &tag_taxon_map);
+
+  size_t TaxonCount() const { return taxon_names_.size(); }
+  bool Empty() const { return taxon_names_.empty(); }
+  const StringVector &TaxonNames() const { return taxon_names_; }
+  const std::string &NameOf(size_t taxon_id) const { return taxon_names_.at(taxon_id); }
+  // The id of a leaf tag, checking that we have it.
+  size_t IdOfTag(Tag tag) const;
+  // The id of a taxon name, failing if we don't have it.
+  size_t IdOfName(const std::string &taxon_name) const;
+  TagStringMap TagTaxonMap() const;
+
+  // The sequence of each taxon in an alignment, indexed by id. These point into the
+  // alignment, so they are good for as long as it is. We fail if a taxon is missing
+  // from the alignment or the sequences have different lengths.
+  std::vector<const std::string *> SequencesOf(const Alignment &alignment) const;
+
+ private:
+  StringVector taxon_names_;
+  std::unordered_map<std::string, size_t> name_to_id_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("TaxonRegistry") {
+  const TagStringMap tag_taxon_map = {{PackInts(1, 1), "saturn"},
+                                      {PackInts(0, 1), "mars"},
+                                      {PackInts(2, 1), "jupiter"}};
+  const TaxonRegistry registry(tag_taxon_map);
+  CHECK_EQ(registry.TaxonCount(), 3);
+  CHECK_EQ(registry.TaxonNames(), StringVector({"mars", "saturn", "jupiter"}));
+  CHECK_EQ(registry.IdOfTag(PackInts(2, 1)), 2);
+  CHECK_EQ(registry.IdOfName("saturn"), 1);
+  CHECK_EQ(registry.TagTaxonMap(), tag_taxon_map);
+  const auto alignment = Alignment::HelloAlignment();
+  const auto sequences = registry.SequencesOf(alignment);
+  REQUIRE_EQ(sequences.size(), 3);
+  CHECK_EQ(*sequences[1], alignment.at("saturn"));
+  // The sequences are those of the alignment, not copies.
+  CHECK_EQ(sequences[0], &alignment.at("mars"));
+  CHECK_THROWS(registry.IdOfTag(PackInts(3, 1)));
+  CHECK_THROWS(registry.IdOfName("pluto"));
+  // Ids must be dense, and tags must be those of leaves.
+  CHECK_THROWS(TaxonRegistry({{PackInts(0, 1), "mars"}, {PackInts(2, 1), "saturn"}}));
+  CHECK_THROWS(TaxonRegistry({{PackInts(0, 2), "mars"}}));
+  CHECK_THROWS(TaxonRegistry({{PackInts(0, 1), "mars"}, {PackInts(1, 1), "mars"}}));
+  CHECK_THROWS(TaxonRegistry({{PackInts(0, 1), "pluto"}}).SequencesOf(alignment));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_TAXON_REGISTRY_HPP_
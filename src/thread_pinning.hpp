@@ -0,0 +1,200 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Pinning the threads of an Engine to cores or NUMA nodes.
+//
+// Linux allocates a page on the NUMA node of the thread that first touches it. When
+// the threads of an Engine float between sockets, the BEAGLE buffers of a FatBeagle
+// can end up on the other socket from the thread that uses them, and every partial
+// likelihood then crosses the interconnect. If the Engine pins its threads, it also
+// makes each FatBeagle on the thread that will use it, so that BEAGLE allocates and
+// fills its buffers on the right node. See WorkStealingPool.
+//
+// We find the NUMA nodes in /sys/devices/system/node rather than with libnuma. Only
+// the CPUs that the process is allowed to run on are used, so pinning works within
+// the limits set by taskset, numactl or a cgroup. Pinning is only available on Linux.
+
+#ifndef SRC_THREAD_PINNING_HPP_
+#define SRC_THREAD_PINNING_HPP_
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sugar.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// How an Engine places its threads.
+enum class ThreadPinning {
+  // Leave it to the operating system.
+  None,
+  // Pin thread i to the i-th CPU that the process may run on, wrapping around.
+  Core,
+  // Split the threads into contiguous blocks, one per NUMA node, and let each
+  // thread run on any of the CPUs of its node.
+  NumaNode,
+};
+
+namespace ThreadPinner {
+
+using CpuVector = std::vector<int>;
+
+// The CPUs of a Linux CPU list such as "0-3,8,10-11".
+inline CpuVector ParseCpuList(const std::string &cpu_list) {
+  CpuVector cpus;
+  std::stringstream stream(cpu_list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.find_first_not_of(" \n") == std::string::npos) {
+      continue;
+    }
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+#ifdef __linux__
+
+// The CPUs that this thread may run on, in increasing order.
+inline CpuVector AllowedCpus() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    Failwith("Couldn't get the CPUs that we may run on.");
+  }
+  CpuVector cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// The allowed CPUs of each NUMA node that has any, in node order. Without NUMA
+// information, all of the allowed CPUs make one node.
+inline std::vector<CpuVector> NumaNodeCpus() {
+  const CpuVector allowed_cpus = AllowedCpus();
+  std::vector<CpuVector> nodes;
+  // Node numbers can have gaps, so we look a little past the last node we find.
+  for (int node = 0, missing_count = 0; missing_count < 64; node++) {
+    std::ifstream cpu_list_file("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist");
+    if (!cpu_list_file) {
+      missing_count++;
+      continue;
+    }
+    missing_count = 0;
+    std::string cpu_list;
+    std::getline(cpu_list_file, cpu_list);
+    CpuVector node_cpus;
+    for (const int cpu : ParseCpuList(cpu_list)) {
+      if (std::binary_search(allowed_cpus.begin(), allowed_cpus.end(), cpu)) {
+        node_cpus.push_back(cpu);
+      }
+    }
+    if (!node_cpus.empty()) {
+      nodes.push_back(std::move(node_cpus));
+    }
+  }
+  if (nodes.empty()) {
+    nodes.push_back(allowed_cpus);
+  }
+  return nodes;
+}
+
+// The CPUs that thread thread_idx of thread_count threads should run on.
+inline CpuVector CpusOfThread(ThreadPinning pinning, size_t thread_idx,
+                              size_t thread_count) {
+  switch (pinning) {
+    case ThreadPinning::None:
+      return AllowedCpus();
+    case ThreadPinning::Core: {
+      const auto cpus = AllowedCpus();
+      return {cpus.at(thread_idx % cpus.size())};
+    }
+    case ThreadPinning::NumaNode: {
+      const auto nodes = NumaNodeCpus();
+      return nodes.at(thread_idx * nodes.size() / thread_count);
+    }
+  }
+  Failwith("Unknown thread pinning.");
+}
+
+// Pin the calling thread as thread thread_idx of thread_count threads.
+inline void PinCurrentThread(ThreadPinning pinning, size_t thread_idx,
+                             size_t thread_count) {
+  if (pinning == ThreadPinning::None) {
+    return;
+  }  // else
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int cpu : CpusOfThread(pinning, thread_idx, thread_count)) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+    Failwith("Couldn't pin thread " + std::to_string(thread_idx) + ".");
+  }
+}
+
+#else
+
+inline void PinCurrentThread(ThreadPinning pinning, size_t, size_t) {
+  if (pinning != ThreadPinning::None) {
+    Failwith("Thread pinning is only available on Linux.");
+  }
+}
+
+#endif  // __linux__
+
+}  // namespace ThreadPinner
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("ThreadPinner") {
+  CHECK_EQ(ThreadPinner::ParseCpuList("0-3,8,10-11\n"),
+           ThreadPinner::CpuVector({0, 1, 2, 3, 8, 10, 11}));
+  CHECK(ThreadPinner::ParseCpuList("").empty());
+#ifdef __linux__
+  const auto allowed_cpus = ThreadPinner::AllowedCpus();
+  REQUIRE_FALSE(allowed_cpus.empty());
+  // Every allowed CPU is on exactly one node.
+  ThreadPinner::CpuVector node_cpus;
+  for (const auto &node : ThreadPinner::NumaNodeCpus()) {
+    node_cpus.insert(node_cpus.end(), node.begin(), node.end());
+  }
+  std::sort(node_cpus.begin(), node_cpus.end());
+  CHECK_EQ(node_cpus, allowed_cpus);
+  const size_t thread_count = allowed_cpus.size() + 1;
+  CHECK_EQ(ThreadPinner::CpusOfThread(ThreadPinning::Core, thread_count - 1,
+                                      thread_count),
+           ThreadPinner::CpuVector({allowed_cpus[0]}));
+  CHECK_EQ(ThreadPinner::CpusOfThread(ThreadPinning::NumaNode, 0, thread_count),
+           ThreadPinner::NumaNodeCpus()[0]);
+  // Pinning a thread keeps it on its CPU.
+  ThreadPinner::CpuVector pinned_cpus;
+  int running_cpu = -1;
+  std::thread thread([&pinned_cpus, &running_cpu] {
+    ThreadPinner::PinCurrentThread(ThreadPinning::Core, 0, 1);
+    pinned_cpus = ThreadPinner::AllowedCpus();
+    running_cpu = sched_getcpu();
+  });
+  thread.join();
+  CHECK_EQ(pinned_cpus, ThreadPinner::CpuVector({allowed_cpus[0]}));
+  CHECK_EQ(running_cpu, allowed_cpus[0]);
+#endif  // __linux__
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_THREAD_PINNING_HPP_
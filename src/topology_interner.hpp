@@ -0,0 +1,80 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A TopologyInterner hash-conses tree topologies: it keeps one canonical Node graph
+// for each distinct topology it has seen, and numbers the distinct topologies
+// contiguously in order of first appearance. Trees whose topologies have been
+// interned point at the canonical graph, so a collection of many trees on a few
+// topologies stores each topology once. Because equal interned topologies are the
+// same object, comparing them is a pointer comparison (see Node::operator==), so
+// TopologyCounter and the other maps keyed on topologies don't walk the trees.
+//
+// We intern whole topologies rather than subtrees. Node ids come from a postorder
+// traversal of the whole tree, so equal subtrees of different topologies generally
+// have different ids and can't share Nodes.
+
+#ifndef SRC_TOPOLOGY_INTERNER_HPP_
+#define SRC_TOPOLOGY_INTERNER_HPP_
+
+#include <unordered_map>
+#include "node.hpp"
+#include "sugar.hpp"
+#include "tree.hpp"
+
+class TopologyInterner {
+ public:
+  size_t TopologyCount() const { return topologies_.size(); }
+  const Node::NodePtrVec &Topologies() const { return topologies_; }
+  const Node::NodePtr &GetTopology(size_t topology_id) const {
+    return topologies_.at(topology_id);
+  }
+
+  // Return the id of this polished topology, adding it if we haven't seen it.
+  size_t Intern(const Node::NodePtr &topology) {
+    const auto [iter, inserted] = ids_.emplace(topology, topologies_.size());
+    if (inserted) {
+      topologies_.push_back(topology);
+    }
+    return iter->second;
+  }
+  // Intern the topology of the tree and point the tree at the canonical topology.
+  size_t Intern(Tree &tree) {
+    const size_t topology_id = Intern(tree.Topology());
+    tree.ShareTopology(topologies_[topology_id]);
+    return topology_id;
+  }
+
+  void clear() {
+    ids_.clear();
+    topologies_.clear();
+  }
+
+ private:
+  std::unordered_map<Node::NodePtr, size_t> ids_;
+  Node::NodePtrVec topologies_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("TopologyInterner") {
+  // Topologies 0 and 1 are equal, but are different objects.
+  auto trees = Tree::ExampleTrees();
+  trees.push_back(Tree::UnitBranchLengthTreeOf(Node::ExampleTopologies()[2]));
+  CHECK_NE(trees[0].Topology().get(), trees[1].Topology().get());
+  TopologyInterner interner;
+  SizeVector topology_ids;
+  for (auto &tree : trees) {
+    topology_ids.push_back(interner.Intern(tree));
+  }
+  CHECK_EQ(topology_ids, SizeVector({0, 0, 1, 2, 1}));
+  CHECK_EQ(interner.TopologyCount(), 3);
+  CHECK_EQ(trees[0].Topology().get(), trees[1].Topology().get());
+  CHECK_EQ(trees[2].Topology().get(), trees[4].Topology().get());
+  CHECK_EQ(interner.GetTopology(2), Node::ExampleTopologies()[3]);
+  // Interning a topology again gives back its id.
+  CHECK_EQ(interner.Intern(Node::ExampleTopologies()[0]), 0);
+  interner.clear();
+  CHECK_EQ(interner.TopologyCount(), 0);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_TOPOLOGY_INTERNER_HPP_
@@ -0,0 +1,130 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A TransitionMatrixKernel computes the transition matrices P(t) = V diag(exp(L t))
+// V^-1 of a substitution model for many branches and rate categories at once.
+//
+// Writing the eigendecomposition as a sum of rank-one terms, entry ij of P(t) is
+// sum_k V_ik V^-1_kj exp(L_k t). So if W is the n^2 x n matrix with W(ij, k) =
+// V_ik V^-1_kj, which we compute once per eigendecomposition, and E is the n x m
+// matrix of exp(L_k t) for m times t, then the columns of W E are all m transition
+// matrices. That is one pass of exponentials over E followed by one matrix product,
+// both of which Eigen vectorizes, rather than m separate triple products.
+//
+// The matrices come out one after another, each in row-major order, with the rate
+// categories of a branch next to each other. This is the layout of BEAGLE's
+// transition matrix buffers, so we can hand them to beagleSetTransitionMatrices.
+
+#ifndef SRC_TRANSITION_MATRIX_KERNEL_HPP_
+#define SRC_TRANSITION_MATRIX_KERNEL_HPP_
+
+#include <vector>
+#include "eigen_sugar.hpp"
+#include "substitution_model.hpp"
+
+class TransitionMatrixKernel {
+ public:
+  explicit TransitionMatrixKernel(const SubstitutionModel &substitution_model)
+      : state_count_(substitution_model.GetStateCount()),
+        eigenvalues_(substitution_model.GetEigenvalues()),
+        weights_(state_count_ * state_count_, state_count_) {
+    const EigenMatrixXd &eigenvectors = substitution_model.GetEigenvectors();
+    const EigenMatrixXd &inverse_eigenvectors =
+        substitution_model.GetInverseEigenvectors();
+    for (size_t i = 0; i < state_count_; i++) {
+      for (size_t j = 0; j < state_count_; j++) {
+        for (size_t k = 0; k < state_count_; k++) {
+          weights_(i * state_count_ + j, k) =
+              eigenvectors(i, k) * inverse_eigenvectors(k, j);
+        }
+      }
+    }
+  }
+
+  size_t GetStateCount() const { return state_count_; }
+  size_t MatrixSize() const { return state_count_ * state_count_; }
+
+  // Write P(branch length * rate) for each of the branch_count branch lengths and
+  // each rate into matrices, which needs room for branch_count * rates.size()
+  // matrices of MatrixSize() entries. If derivatives isn't null, also write the
+  // derivatives of these matrices with respect to the branch length there, which
+  // includes the factor of the rate.
+  void Compute(const double *branch_lengths, size_t branch_count,
+               const EigenVectorXd &rates, double *matrices,
+               double *derivatives = nullptr) const {
+    const Eigen::Index category_count = rates.size();
+    const Eigen::Index matrix_count = branch_count * category_count;
+    Eigen::RowVectorXd times(matrix_count);
+    for (size_t branch = 0; branch < branch_count; branch++) {
+      times.segment(branch * category_count, category_count) =
+          branch_lengths[branch] * rates.transpose();
+    }
+    const Eigen::MatrixXd exponentials = (eigenvalues_ * times).array().exp().matrix();
+    Eigen::Map<Eigen::MatrixXd>(matrices, MatrixSize(), matrix_count).noalias() =
+        weights_ * exponentials;
+    if (derivatives != nullptr) {
+      // The time derivative of exp(L_k t) is L_k exp(L_k t), and t is the branch
+      // length times the rate.
+      const Eigen::RowVectorXd rate_of_matrix = rates.transpose().replicate(
+          1, static_cast<Eigen::Index>(branch_count));
+      const Eigen::MatrixXd derivative_exponentials =
+          ((exponentials.array().colwise() * eigenvalues_.array()).rowwise() *
+           rate_of_matrix.array())
+              .matrix();
+      Eigen::Map<Eigen::MatrixXd>(derivatives, MatrixSize(), matrix_count).noalias() =
+          weights_ * derivative_exponentials;
+    }
+  }
+
+ private:
+  size_t state_count_;
+  EigenVectorXd eigenvalues_;
+  // W(ij, k) = V_ik V^-1_kj, with ij = i * state_count_ + j so that each column of
+  // W E is a row-major matrix.
+  Eigen::MatrixXd weights_;
+};
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("TransitionMatrixKernel") {
+  GTRModel model;
+  EigenVectorXd param_vector(10);
+  param_vector << 0.060602, 0.402732, 0.028230, 0.047910, 0.407249, 0.053277, 0.479367,
+      0.172572, 0.140933, 0.207128;
+  model.SetParameters(param_vector);
+  const TransitionMatrixKernel kernel(model);
+  const std::vector<double> branch_lengths = {0., 0.1, 0.75};
+  EigenVectorXd rates(2);
+  rates << 0.5, 1.5;
+  const size_t matrix_count = branch_lengths.size() * rates.size();
+  std::vector<double> matrices(matrix_count * kernel.MatrixSize());
+  std::vector<double> derivatives(matrices.size());
+  kernel.Compute(branch_lengths.data(), branch_lengths.size(), rates, matrices.data(),
+                 derivatives.data());
+  const EigenMatrixXd &V = model.GetEigenvectors();
+  const EigenMatrixXd &V_inverse = model.GetInverseEigenvectors();
+  const EigenVectorXd &L = model.GetEigenvalues();
+  for (size_t branch = 0; branch < branch_lengths.size(); branch++) {
+    for (Eigen::Index category = 0; category < rates.size(); category++) {
+      const double time = branch_lengths[branch] * rates[category];
+      const EigenMatrixXd expected =
+          V * (time * L).array().exp().matrix().asDiagonal() * V_inverse;
+      const EigenMatrixXd expected_derivative =
+          rates[category] * V *
+          ((time * L).array().exp() * L.array()).matrix().asDiagonal() * V_inverse;
+      const size_t offset = (branch * rates.size() + category) * kernel.MatrixSize();
+      const Eigen::Map<const EigenMatrixXd> matrix(matrices.data() + offset, 4, 4);
+      const Eigen::Map<const EigenMatrixXd> derivative(derivatives.data() + offset, 4,
+                                                       4);
+      CHECK_LT((matrix - expected).cwiseAbs().maxCoeff(), 1e-12);
+      CHECK_LT((derivative - expected_derivative).cwiseAbs().maxCoeff(), 1e-12);
+      // Rows of a transition matrix sum to one.
+      CHECK_LT((matrix.rowwise().sum().array() - 1.).abs().maxCoeff(), 1e-12);
+    }
+  }
+  // A branch of length zero doesn't go anywhere.
+  const Eigen::Map<const EigenMatrixXd> identity(matrices.data(), 4, 4);
+  CHECK_LT((identity - EigenMatrixXd::Identity(4, 4)).cwiseAbs().maxCoeff(), 1e-12);
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_TRANSITION_MATRIX_KERNEL_HPP_
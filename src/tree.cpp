@@ -67,6 +67,59 @@ Tree::TreeVector Tree::ExampleTrees() {
   return v;
 }
 
+void Tree::ShareTopology(const Node::NodePtr& topology) {
+  Assert(topology == topology_ && topology->Id() == topology_->Id(),
+         "Tree::ShareTopology needs an equal topology.");
+  topology_ = topology;
+}
+
+const Tree::Traversals& Tree::GetTraversals() const {
+  auto traversals = std::atomic_load(&traversals_);
+  if (traversals == nullptr) {
+    auto computed = std::make_shared<const Traversals>(TraversalsOf(*topology_));
+    // If another thread got there first, this leaves its arrays in place and puts
+    // them in traversals.
+    if (std::atomic_compare_exchange_strong(&traversals_, &traversals, computed)) {
+      traversals = std::move(computed);
+    }
+  }
+  // traversals_ never changes once set, so it keeps this alive.
+  return *traversals;
+}
+
+Tree::Traversals Tree::TraversalsOf(const Node& topology) {
+  Traversals traversals;
+  const size_t node_count = topology.Id() + 1;
+  traversals.pre_order_ids_.reserve(node_count);
+  traversals.post_order_ids_.reserve(node_count);
+  traversals.sister_ids_.assign(node_count, Traversals::no_id_);
+  bool bifurcating = true;
+  topology.PreOrder([&traversals, &bifurcating](const Node* node) {
+    traversals.pre_order_ids_.push_back(node->Id());
+    const auto& children = node->Children();
+    if (children.size() == 2) {
+      traversals.sister_ids_[children[0]->Id()] = children[1]->Id();
+      traversals.sister_ids_[children[1]->Id()] = children[0]->Id();
+    } else if (!children.empty()) {
+      bifurcating = false;
+    }
+  });
+  topology.PostOrder([&traversals](const Node* node) {
+    traversals.post_order_ids_.push_back(node->Id());
+  });
+  traversals.parent_ids_ = topology.ParentIdVector();
+  if (bifurcating) {
+    const auto collect = [](std::vector<std::array<int, 3>>& triples) {
+      return [&triples](int node_id, int child0_id, int child1_id) {
+        triples.push_back({node_id, child0_id, child1_id});
+      };
+    };
+    topology.BinaryIdPreOrder(collect(traversals.binary_pre_order_));
+    topology.BinaryIdPostOrder(collect(traversals.binary_post_order_));
+  }
+  return traversals;
+}
+
 void Tree::SlideRootPosition() {
   size_t fixed_node_id = Children()[1]->Id();
   size_t root_child_id = Children()[0]->Id();
@@ -4,6 +4,7 @@
 #ifndef SRC_TREE_HPP_
 #define SRC_TREE_HPP_
 
+#include <array>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -17,6 +18,26 @@ class Tree {
   typedef std::vector<Tree> TreeVector;
   typedef std::vector<double> BranchLengthVector;
 
+  // Integer arrays describing the topology, so that loops over the nodes don't have
+  // to walk the Node graph. Sisters and binary triples are only defined where
+  // nodes are bifurcating.
+  struct Traversals {
+    static constexpr size_t no_id_ = SIZE_MAX;
+    // The node ids in the order of Node::PreOrder and Node::PostOrder.
+    SizeVector pre_order_ids_;
+    SizeVector post_order_ids_;
+    // As in Node::ParentIdVector: the id of the parent of each node but the root.
+    SizeVector parent_ids_;
+    // The id of the sister of each node whose parent has two children, and no_id_
+    // for the others.
+    SizeVector sister_ids_;
+    // The (node_id, child0_id, child1_id) triples that Node::BinaryIdPreOrder and
+    // Node::BinaryIdPostOrder give, if the whole topology is bifurcating. Otherwise
+    // these are empty.
+    std::vector<std::array<int, 3>> binary_pre_order_;
+    std::vector<std::array<int, 3>> binary_post_order_;
+  };
+
   Tree() {}
 
   // This is the primary constructor.
@@ -32,7 +53,11 @@ class Tree {
   uint32_t LeafCount() const { return Topology()->LeafCount(); }
   Node::NodePtrVec Children() const { return Topology()->Children(); }
   size_t Id() const { return Topology()->Id(); }
-  std::vector<size_t> ParentIdVector() const { return Topology()->ParentIdVector(); }
+  std::vector<size_t> ParentIdVector() const { return GetTraversals().parent_ids_; }
+  // The traversal arrays of the topology, computed the first time they are needed
+  // and then shared with copies of this tree. This is safe to call from several
+  // threads at once.
+  const Traversals& GetTraversals() const;
 
   bool operator==(const Tree& other) const;
 
@@ -41,6 +66,10 @@ class Tree {
 
   double BranchLength(const Node* node) const;
 
+  // Replace the topology with an equal one, such as its canonical copy in a
+  // TopologyInterner, so that trees can share topologies. Both must be polished.
+  void ShareTopology(const Node::NodePtr& topology);
+
   // Take a bifurcating tree and move the root position so that the left hand
   // branch has zero branch length. Modifies tree in place.
   void SlideRootPosition();
@@ -54,12 +83,53 @@ class Tree {
 
  protected:
   Node::NodePtr topology_;
+
+ private:
+  // Set once, on first use. Topologies don't change after construction except
+  // through ShareTopology, which keeps the node ids.
+  mutable std::shared_ptr<const Traversals> traversals_;
+
+  static Traversals TraversalsOf(const Node& topology);
 };
 
 inline bool operator!=(const Tree& lhs, const Tree& rhs) { return !(lhs == rhs); }
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
 // Lots of tests in UnrootedTree and RootedTree.
-TEST_CASE("Tree") {}
+TEST_CASE("Tree") {
+  // ((((0,1)7,2)8,(3,4)9)10,5,6)11; is multifurcating at the root.
+  for (const auto& tree :
+       {Tree::OfParentIdVector({7, 7, 8, 9, 9, 11, 11, 8, 10, 10, 11}),
+        Tree::UnitBranchLengthTreeOf(Node::Ladder(6))}) {
+    const auto& topology = tree.Topology();
+    const auto& traversals = tree.GetTraversals();
+    SizeVector pre_order_ids, post_order_ids;
+    topology->PreOrder([&](const Node* node) { pre_order_ids.push_back(node->Id()); });
+    topology->PostOrder(
+        [&](const Node* node) { post_order_ids.push_back(node->Id()); });
+    CHECK_EQ(traversals.pre_order_ids_, pre_order_ids);
+    CHECK_EQ(traversals.post_order_ids_, post_order_ids);
+    CHECK_EQ(traversals.parent_ids_, topology->ParentIdVector());
+    // Copies share the arrays.
+    const Tree copy = tree;
+    CHECK_EQ(&copy.GetTraversals(), &traversals);
+    std::vector<std::array<int, 3>> binary_pre_order, binary_post_order;
+    if (topology->Children().size() == 2) {
+      topology->BinaryIdPreOrder(
+          [&](int a, int b, int c) { binary_pre_order.push_back({a, b, c}); });
+      topology->BinaryIdPostOrder(
+          [&](int a, int b, int c) { binary_post_order.push_back({a, b, c}); });
+      topology->TripleIdPreOrderBifurcating([&](int node_id, int sister_id, int) {
+        CHECK_EQ(traversals.sister_ids_[node_id], sister_id);
+      });
+    } else {
+      CHECK_EQ(traversals.sister_ids_[5], Tree::Traversals::no_id_);
+      CHECK_EQ(traversals.sister_ids_[8], 9);
+    }
+    CHECK_EQ(traversals.binary_pre_order_, binary_pre_order);
+    CHECK_EQ(traversals.binary_post_order_, binary_post_order);
+    CHECK_EQ(traversals.sister_ids_[topology->Id()], Tree::Traversals::no_id_);
+  }
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_TREE_HPP_
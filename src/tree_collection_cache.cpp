@@ -0,0 +1,434 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+
+#include "tree_collection_cache.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include "mmapped_file.hpp"
+
+namespace {
+
+constexpr char cache_magic[8] = {'L', 'I', 'B', 'S', 'B', 'N', 'T', 'C'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr size_t section_alignment = 64;
+
+size_t AlignedOffset(size_t offset) {
+  return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+// Build the topology with these parent ids, as Node::OfParentIdVector does. Ids
+// from Polish are postorder, so that every node comes before its parent, and then we
+// can build the topology from the leaves up in one pass.
+Node::NodePtr TopologyOfParentIds(const uint32_t *parent_ids, size_t parent_id_count,
+                                  size_t leaf_count) {
+  const size_t node_count = parent_id_count + 1;
+  bool postorder = true;
+  size_t min_parent_id = node_count;
+  for (size_t id = 0; id < parent_id_count; id++) {
+    if (parent_ids[id] >= node_count || parent_ids[id] == id) {
+      Failwith("Tree cache has a parent id out of range.");
+    }
+    postorder &= parent_ids[id] > id;
+    min_parent_id = std::min(min_parent_id, static_cast<size_t>(parent_ids[id]));
+  }
+  if (min_parent_id != leaf_count) {
+    Failwith("Tree cache has a tree that isn't on all of the taxa.");
+  }
+  if (!postorder) {
+    return Node::OfParentIdVector(
+        SizeVector(parent_ids, parent_ids + parent_id_count));
+  }  // else
+  std::vector<Node::NodePtrVec> children(node_count);
+  Node::NodePtr node;
+  for (uint32_t id = 0; id < node_count; id++) {
+    if (id < leaf_count) {
+      node = Node::Leaf(id, Bitset::Singleton(leaf_count, id));
+    } else if (children[id].empty()) {
+      Failwith("Tree cache has an internal node without children.");
+    } else {
+      node = Node::Join(std::move(children[id]), id);
+    }
+    if (id < parent_id_count) {
+      children[parent_ids[id]].push_back(node);
+    }
+  }
+  return node;
+}
+
+}  // namespace
+
+TreeCollectionCache::Layout TreeCollectionCache::LayoutOf(const Header &header) {
+  // The root of each tree has no parent and no rate.
+  const size_t non_root_count = header.node_count_ - header.tree_count_;
+  const size_t parameter_node_count = header.has_parameters_ ? header.node_count_ : 0;
+  const size_t parameter_tree_count = header.has_parameters_ ? header.tree_count_ : 0;
+  const size_t height_ratio_count =
+      header.has_parameters_ ? header.tree_count_ * (header.taxon_count_ - 1) : 0;
+  Layout layout;
+  layout.node_offsets_ = AlignedOffset(sizeof(Header));
+  layout.parent_ids_ = AlignedOffset(layout.node_offsets_ +
+                                     (header.tree_count_ + 1) * sizeof(uint64_t));
+  layout.branch_lengths_ =
+      AlignedOffset(layout.parent_ids_ + non_root_count * sizeof(uint32_t));
+  layout.date_leaf_ids_ =
+      AlignedOffset(layout.branch_lengths_ + header.node_count_ * sizeof(double));
+  layout.dates_ =
+      AlignedOffset(layout.date_leaf_ids_ + header.date_count_ * sizeof(uint64_t));
+  layout.node_heights_ =
+      AlignedOffset(layout.dates_ + header.date_count_ * sizeof(double));
+  layout.node_bounds_ =
+      AlignedOffset(layout.node_heights_ + parameter_node_count * sizeof(double));
+  layout.rates_ =
+      AlignedOffset(layout.node_bounds_ + parameter_node_count * sizeof(double));
+  layout.height_ratios_ = AlignedOffset(
+      layout.rates_ + (header.has_parameters_ ? non_root_count : 0) * sizeof(double));
+  layout.rate_counts_ =
+      AlignedOffset(layout.height_ratios_ + height_ratio_count * sizeof(double));
+  layout.taxon_names_ =
+      AlignedOffset(layout.rate_counts_ + parameter_tree_count * sizeof(uint64_t));
+  layout.file_size_ = layout.taxon_names_ + header.taxon_names_size_;
+  return layout;
+}
+
+template <typename TCollection>
+TreeCollectionCache::TreeSections TreeCollectionCache::SectionsOf(
+    const TCollection &trees) {
+  TreeSections sections;
+  for (const auto &tree : trees.Trees()) {
+    const size_t node_count = tree.Topology()->Id() + 1;
+    Assert(tree.LeafCount() == trees.TaxonCount(),
+           "TreeCollectionCache needs trees on all of the taxa.");
+    Assert(tree.branch_lengths_.size() == node_count,
+           "TreeCollectionCache needs a branch length for each node.");
+    const SizeVector tree_parent_ids = tree.ParentIdVector();
+    Assert(tree_parent_ids.size() + 1 == node_count,
+           "TreeCollectionCache needs trees with contiguous node ids.");
+    sections.parent_ids_.insert(sections.parent_ids_.end(), tree_parent_ids.begin(),
+                                tree_parent_ids.end());
+    sections.branch_lengths_.insert(sections.branch_lengths_.end(),
+                                    tree.branch_lengths_.begin(),
+                                    tree.branch_lengths_.end());
+    sections.node_offsets_.push_back(sections.branch_lengths_.size());
+  }
+  return sections;
+}
+
+template TreeCollectionCache::TreeSections TreeCollectionCache::SectionsOf(
+    const UnrootedTreeCollection &trees);
+template TreeCollectionCache::TreeSections TreeCollectionCache::SectionsOf(
+    const RootedTreeCollection &trees);
+
+UnrootedTree::UnrootedTreeVector TreeCollectionCache::UnrootedTreesOf(
+    const TreeSections &sections, size_t taxon_count) {
+  if (sections.node_offsets_.empty() ||
+      sections.node_offsets_.back() != sections.branch_lengths_.size() ||
+      sections.parent_ids_.size() + sections.TreeCount() !=
+          sections.branch_lengths_.size()) {
+    Failwith("Tree sections with inconsistent sizes.");
+  }
+  Contents contents;
+  AppendTrees("Tree sections", taxon_count, sections.TreeCount(),
+              sections.branch_lengths_.size(), sections.node_offsets_.data(),
+              sections.parent_ids_.data(), sections.branch_lengths_.data(), contents);
+  UnrootedTree::UnrootedTreeVector trees;
+  trees.reserve(contents.topologies_.size());
+  for (size_t tree_idx = 0; tree_idx < contents.topologies_.size(); tree_idx++) {
+    trees.emplace_back(contents.topologies_[tree_idx],
+                       std::move(contents.branch_lengths_[tree_idx]));
+  }
+  return trees;
+}
+
+template <typename TCollection>
+void TreeCollectionCache::WriteCollection(const std::string &path,
+                                          const TCollection &trees) {
+  constexpr bool rooted = std::is_same_v<TCollection, RootedTreeCollection>;
+  const StringVector taxon_names = trees.TaxonNames();
+  Header header{};
+  std::copy(std::begin(cache_magic), std::end(cache_magic), header.magic_);
+  header.version_ = version_;
+  header.byte_order_mark_ = byte_order_mark;
+  header.is_rooted_ = rooted;
+  header.taxon_count_ = taxon_names.size();
+  header.tree_count_ = trees.TreeCount();
+
+  const TreeSections sections = SectionsOf(trees);
+  header.node_count_ = sections.branch_lengths_.size();
+
+  std::vector<uint64_t> date_leaf_ids;
+  std::vector<double> dates;
+  std::vector<double> node_heights, node_bounds, rates, height_ratios;
+  std::vector<uint64_t> rate_counts;
+  if constexpr (rooted) {
+    for (const auto &[tag, date] : trees.tag_date_map_) {
+      date_leaf_ids.push_back(MaxLeafIDOfTag(tag));
+      dates.push_back(date);
+    }
+    // We only keep the parameters if all of the trees have them.
+    header.has_parameters_ =
+        trees.TreeCount() > 0 &&
+        std::all_of(trees.Trees().begin(), trees.Trees().end(), [](const auto &tree) {
+          return tree.node_heights_.size() == tree.branch_lengths_.size();
+        });
+    if (header.has_parameters_) {
+      for (const auto &tree : trees.Trees()) {
+        Assert(tree.node_bounds_.size() == tree.branch_lengths_.size() &&
+                   tree.rates_.size() + 1 == tree.branch_lengths_.size() &&
+                   tree.height_ratios_.size() + 1 == taxon_names.size(),
+               "TreeCollectionCache::Write found rooted tree parameters of the wrong "
+               "size.");
+        const auto append = [](std::vector<double> &to, const auto &from) {
+          to.insert(to.end(), from.begin(), from.end());
+        };
+        append(node_heights, tree.node_heights_);
+        append(node_bounds, tree.node_bounds_);
+        append(rates, tree.rates_);
+        append(height_ratios, tree.height_ratios_);
+        rate_counts.push_back(tree.rate_count_);
+      }
+    }
+  }
+  header.date_count_ = dates.size();
+  std::string taxon_name_block;
+  for (const auto &name : taxon_names) {
+    taxon_name_block += name;
+    taxon_name_block.push_back('\0');
+  }
+  header.taxon_names_size_ = taxon_name_block.size();
+  const Layout layout = LayoutOf(header);
+
+  // We write to a temporary file and then rename it, so that nobody reads a
+  // partly-written file.
+  const std::string temporary_path = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      Failwith("TreeCollectionCache could not create a file at " + temporary_path);
+    }
+    const auto write_section = [&out](size_t offset, const auto &data) {
+      const auto position = static_cast<size_t>(out.tellp());
+      Assert(position <= offset, "TreeCollectionCache sections overlap.");
+      const std::string padding(offset - position, '\0');
+      out.write(padding.data(), padding.size());
+      out.write(reinterpret_cast<const char *>(data.data()),
+                data.size() * sizeof(data[0]));
+    };
+    write_section(0, std::string_view(reinterpret_cast<const char *>(&header),
+                                      sizeof(Header)));
+    write_section(layout.node_offsets_, sections.node_offsets_);
+    write_section(layout.parent_ids_, sections.parent_ids_);
+    write_section(layout.branch_lengths_, sections.branch_lengths_);
+    write_section(layout.date_leaf_ids_, date_leaf_ids);
+    write_section(layout.dates_, dates);
+    write_section(layout.node_heights_, node_heights);
+    write_section(layout.node_bounds_, node_bounds);
+    write_section(layout.rates_, rates);
+    write_section(layout.height_ratios_, height_ratios);
+    write_section(layout.rate_counts_, rate_counts);
+    write_section(layout.taxon_names_, taxon_name_block);
+    if (!out) {
+      Failwith("TreeCollectionCache could not write to " + temporary_path);
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    Failwith("TreeCollectionCache could not move its file to " + path);
+  }
+}
+
+void TreeCollectionCache::Write(const std::string &path,
+                                const UnrootedTreeCollection &trees) {
+  WriteCollection(path, trees);
+}
+
+void TreeCollectionCache::Write(const std::string &path,
+                                const RootedTreeCollection &trees) {
+  WriteCollection(path, trees);
+}
+
+TreeCollectionCache::Contents TreeCollectionCache::ReadContents(
+    const std::string &path, bool rooted,
+    const std::function<void(const Header &, const Layout &, const char *)>
+        &read_rooted) {
+  const MmappedFile file(path);
+  const std::string_view file_contents = file.Contents();
+  if (file_contents.size() < sizeof(Header)) {
+    Failwith(path + " is too short to be a tree cache.");
+  }
+  const char *data = file_contents.data();
+  const auto &header = *reinterpret_cast<const Header *>(data);
+  if (!std::equal(std::begin(cache_magic), std::end(cache_magic), header.magic_)) {
+    Failwith(path + " is not a tree cache.");
+  }
+  if (header.byte_order_mark_ != byte_order_mark) {
+    Failwith(path + " was written on a machine with a different byte order.");
+  }
+  if (header.version_ != version_) {
+    Failwith(path + " is a tree cache of version " + std::to_string(header.version_) +
+             ", but we can only read version " + std::to_string(version_) + ".");
+  }
+  if (header.is_rooted_ != rooted) {
+    Failwith(path + " is a cache of " + (rooted ? "unrooted" : "rooted") +
+             " trees.");
+  }
+  if (header.node_count_ < header.tree_count_ ||
+      (header.has_parameters_ && header.taxon_count_ == 0)) {
+    Failwith(path + " has an inconsistent tree cache header.");
+  }
+  const Layout layout = LayoutOf(header);
+  if (layout.file_size_ != file_contents.size()) {
+    Failwith(path + " does not have the size given by its tree cache header.");
+  }
+
+  Contents contents;
+  const char *name = data + layout.taxon_names_;
+  const char *names_end = name + header.taxon_names_size_;
+  while (name < names_end) {
+    const char *name_end = std::find(name, names_end, '\0');
+    contents.taxon_names_.emplace_back(name, name_end);
+    name = name_end + 1;
+  }
+  if (contents.taxon_names_.size() != header.taxon_count_) {
+    Failwith(path + " doesn't have the right number of taxon names.");
+  }
+
+  AppendTrees(path, header.taxon_count_, header.tree_count_, header.node_count_,
+              reinterpret_cast<const uint64_t *>(data + layout.node_offsets_),
+              reinterpret_cast<const uint32_t *>(data + layout.parent_ids_),
+              reinterpret_cast<const double *>(data + layout.branch_lengths_),
+              contents);
+  read_rooted(header, layout, data);
+  return contents;
+}
+
+void TreeCollectionCache::AppendTrees(const std::string &source, size_t taxon_count,
+                                      size_t tree_count, size_t node_count,
+                                      const uint64_t *node_offsets,
+                                      const uint32_t *parent_ids,
+                                      const double *branch_lengths,
+                                      Contents &contents) {
+  if (node_offsets[0] != 0 || node_offsets[tree_count] != node_count) {
+    Failwith(source + " has node offsets that don't match its node count.");
+  }
+  contents.topologies_.reserve(contents.topologies_.size() + tree_count);
+  contents.branch_lengths_.reserve(contents.branch_lengths_.size() + tree_count);
+  // Trees with the same parent ids share a topology, which we find by the bytes of
+  // their parent ids.
+  std::unordered_map<std::string_view, Node::NodePtr> topologies;
+  for (size_t tree_idx = 0; tree_idx < tree_count; tree_idx++) {
+    const uint64_t node_begin = node_offsets[tree_idx];
+    const uint64_t node_end = node_offsets[tree_idx + 1];
+    if (node_end < node_begin + 2 || node_end > node_count) {
+      Failwith(source + " has node offsets out of order.");
+    }
+    // The parent ids of tree i start after those of the trees before it, each of
+    // which has one fewer parent id than nodes.
+    const uint32_t *tree_parent_ids = parent_ids + node_begin - tree_idx;
+    const size_t parent_id_count = node_end - node_begin - 1;
+    auto &topology = topologies[std::string_view(
+        reinterpret_cast<const char *>(tree_parent_ids),
+        parent_id_count * sizeof(uint32_t))];
+    if (topology == nullptr) {
+      topology = TopologyOfParentIds(tree_parent_ids, parent_id_count, taxon_count);
+    }
+    contents.topologies_.push_back(topology);
+    contents.branch_lengths_.emplace_back(branch_lengths + node_begin,
+                                          branch_lengths + node_end);
+  }
+}
+
+template <>
+UnrootedTreeCollection TreeCollectionCache::Read(const std::string &path) {
+  auto contents =
+      ReadContents(path, false, [](const Header &, const Layout &, const char *) {});
+  UnrootedTree::UnrootedTreeVector trees;
+  trees.reserve(contents.topologies_.size());
+  for (size_t tree_idx = 0; tree_idx < contents.topologies_.size(); tree_idx++) {
+    trees.emplace_back(contents.topologies_[tree_idx],
+                       std::move(contents.branch_lengths_[tree_idx]));
+  }
+  return UnrootedTreeCollection(std::move(trees), contents.taxon_names_);
+}
+
+template <>
+RootedTreeCollection TreeCollectionCache::Read(const std::string &path) {
+  TagDoubleMap tag_date_map;
+  bool has_parameters = false;
+  std::vector<double> node_heights, node_bounds, rates, height_ratios;
+  std::vector<uint64_t> rate_counts;
+  auto contents = ReadContents(path, true, [&](const Header &header,
+                                               const Layout &layout, const char *data) {
+    const auto *date_leaf_ids =
+        reinterpret_cast<const uint64_t *>(data + layout.date_leaf_ids_);
+    const auto *dates = reinterpret_cast<const double *>(data + layout.dates_);
+    for (size_t date_idx = 0; date_idx < header.date_count_; date_idx++) {
+      SafeInsert(tag_date_map,
+                 PackInts(static_cast<uint32_t>(date_leaf_ids[date_idx]), 1),
+                 dates[date_idx]);
+    }
+    has_parameters = header.has_parameters_;
+    if (has_parameters) {
+      const auto copy_doubles = [data](size_t offset, size_t count) {
+        const auto *begin = reinterpret_cast<const double *>(data + offset);
+        return std::vector<double>(begin, begin + count);
+      };
+      node_heights = copy_doubles(layout.node_heights_, header.node_count_);
+      node_bounds = copy_doubles(layout.node_bounds_, header.node_count_);
+      rates = copy_doubles(layout.rates_, header.node_count_ - header.tree_count_);
+      height_ratios = copy_doubles(layout.height_ratios_,
+                                   header.tree_count_ * (header.taxon_count_ - 1));
+      const auto *rate_count_begin =
+          reinterpret_cast<const uint64_t *>(data + layout.rate_counts_);
+      rate_counts.assign(rate_count_begin, rate_count_begin + header.tree_count_);
+    }
+  });
+  RootedTree::RootedTreeVector trees;
+  trees.reserve(contents.topologies_.size());
+  size_t node_offset = 0;
+  const size_t height_ratio_count = contents.taxon_names_.size() - 1;
+  for (size_t tree_idx = 0; tree_idx < contents.topologies_.size(); tree_idx++) {
+    const size_t node_count = contents.branch_lengths_[tree_idx].size();
+    trees.emplace_back(Tree(contents.topologies_[tree_idx],
+                            std::move(contents.branch_lengths_[tree_idx])));
+    if (has_parameters) {
+      auto &tree = trees.back();
+      const auto segment = [](const std::vector<double> &values, size_t begin,
+                              size_t count) {
+        return std::vector<double>(values.begin() + begin,
+                                   values.begin() + begin + count);
+      };
+      tree.node_heights_ = segment(node_heights, node_offset, node_count);
+      tree.node_bounds_ = segment(node_bounds, node_offset, node_count);
+      tree.rates_ = segment(rates, node_offset - tree_idx, node_count - 1);
+      tree.height_ratios_ =
+          segment(height_ratios, tree_idx * height_ratio_count, height_ratio_count);
+      tree.rate_count_ = rate_counts[tree_idx];
+    }
+    node_offset += node_count;
+  }
+  RootedTreeCollection collection(std::move(trees), contents.taxon_names_);
+  collection.tag_date_map_ = std::move(tag_date_map);
+  return collection;
+}
+
+std::string TreeCollectionCache::SidecarPathOf(const std::string &source_path,
+                                               bool rooted) {
+  return source_path + (rooted ? ".rooted_cache" : ".unrooted_cache");
+}
+
+bool TreeCollectionCache::IsFresh(const std::string &cache_path,
+                                  const std::string &source_path) {
+  std::error_code error;
+  const auto cache_time = std::filesystem::last_write_time(cache_path, error);
+  if (error) {
+    return false;
+  }  // else
+  const auto source_time = std::filesystem::last_write_time(source_path, error);
+  return !error && cache_time > source_time;
+}
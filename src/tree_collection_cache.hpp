@@ -0,0 +1,207 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// A binary file format for parsed tree collections, so that we can reload the trees
+// of a big posterior sample without parsing it again.
+//
+// The file is a 128-byte header followed by these sections, each of which starts at
+// a multiple of 64 bytes:
+//
+// * the offset of the first node of each tree in the node arrays, and then the total
+//   node count, as 64-bit integers;
+// * the parent ids of all of the trees, as in Tree::ParentIdVector, as 32-bit
+//   integers (tree i has node_offsets[i + 1] - node_offsets[i] - 1 of these);
+// * the branch lengths of all of the trees, as doubles;
+// * for rooted trees, the tag_date_map_ as leaf ids and dates, then if the trees
+//   have been through InitializeParameters, their node heights, node bounds, rates,
+//   height ratios and rate counts;
+// * the taxon names in leaf id order, each terminated by a null character.
+//
+// As for SBNSnapshot, numbers are in the byte order of the machine that wrote the
+// file. Reading maps the file, and trees with the same parent ids share one
+// topology, as they do after reading a tree file.
+//
+// ReadThrough uses these files as a cache of the trees of a tree file, kept in a
+// sidecar file next to it.
+
+#ifndef SRC_TREE_COLLECTION_CACHE_HPP_
+#define SRC_TREE_COLLECTION_CACHE_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "rooted_tree_collection.hpp"
+#include "sugar.hpp"
+#include "unrooted_tree_collection.hpp"
+
+class TreeCollectionCache {
+ public:
+  // Bump this whenever the layout changes.
+  static constexpr uint32_t version_ = 1;
+
+  static void Write(const std::string &path, const UnrootedTreeCollection &trees);
+  static void Write(const std::string &path, const RootedTreeCollection &trees);
+  template <typename TCollection>
+  static TCollection Read(const std::string &path);
+
+  // The node offsets, parent ids and branch lengths sections of the file, in memory.
+  // MPIEngine sends trees to other processes in this form.
+  struct TreeSections {
+    std::vector<uint64_t> node_offsets_ = {0};
+    std::vector<uint32_t> parent_ids_;
+    std::vector<double> branch_lengths_;
+
+    size_t TreeCount() const { return node_offsets_.size() - 1; }
+  };
+  template <typename TCollection>
+  static TreeSections SectionsOf(const TCollection &trees);
+  // The trees of these sections, on taxon_count taxa. As for Read, trees with the
+  // same parent ids share a topology.
+  static UnrootedTree::UnrootedTreeVector UnrootedTreesOf(const TreeSections &sections,
+                                                          size_t taxon_count);
+
+  // The path of the cache of the trees of source_path.
+  static std::string SidecarPathOf(const std::string &source_path, bool rooted);
+  // Is there a file at cache_path that was modified after source_path?
+  static bool IsFresh(const std::string &cache_path, const std::string &source_path);
+
+  // If the sidecar of source_path is fresh, read the trees from it. Otherwise get
+  // them from parse and try to write them to the sidecar for next time. Problems
+  // with the sidecar are warnings, because we can always parse.
+  template <typename TCollection>
+  static TCollection ReadThrough(const std::string &source_path,
+                                 const std::function<TCollection()> &parse) {
+    constexpr bool rooted = std::is_same_v<TCollection, RootedTreeCollection>;
+    const std::string cache_path = SidecarPathOf(source_path, rooted);
+    if (IsFresh(cache_path, source_path)) {
+      try {
+        return Read<TCollection>(cache_path);
+      } catch (const std::exception &exception) {
+        std::cout << "Warning: ignoring the tree cache at " << cache_path << ": "
+                  << exception.what() << std::endl;
+      }
+    }
+    TCollection trees = parse();
+    try {
+      Write(cache_path, trees);
+    } catch (const std::exception &exception) {
+      std::cout << "Warning: could not write the tree cache at " << cache_path << ": "
+                << exception.what() << std::endl;
+    }
+    return trees;
+  }
+
+ private:
+  struct Header {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t byte_order_mark_;
+    uint64_t is_rooted_;
+    // Whether the rooted trees have their parameters from InitializeParameters.
+    uint64_t has_parameters_;
+    uint64_t taxon_count_;
+    uint64_t tree_count_;
+    uint64_t node_count_;
+    uint64_t date_count_;
+    uint64_t taxon_names_size_;
+    uint64_t reserved_[7];
+  };
+  static_assert(sizeof(Header) == 128, "The tree cache header should be 128 bytes.");
+
+  // The byte offsets of the sections.
+  struct Layout {
+    size_t node_offsets_;
+    size_t parent_ids_;
+    size_t branch_lengths_;
+    size_t date_leaf_ids_;
+    size_t dates_;
+    size_t node_heights_;
+    size_t node_bounds_;
+    size_t rates_;
+    size_t height_ratios_;
+    size_t rate_counts_;
+    size_t taxon_names_;
+    size_t file_size_;
+  };
+  static Layout LayoutOf(const Header &header);
+
+  // The parts of a tree collection that are stored the same way for both kinds.
+  struct Contents {
+    StringVector taxon_names_;
+    std::vector<Node::NodePtr> topologies_;
+    std::vector<Tree::BranchLengthVector> branch_lengths_;
+  };
+  template <typename TCollection>
+  static void WriteCollection(const std::string &path, const TCollection &trees);
+  // Check the tree sections that start at these pointers, with the given total
+  // counts, and append their topologies and branch lengths to contents. The source
+  // is for error messages.
+  static void AppendTrees(const std::string &source, size_t taxon_count,
+                          size_t tree_count, size_t node_count,
+                          const uint64_t *node_offsets, const uint32_t *parent_ids,
+                          const double *branch_lengths, Contents &contents);
+  // Read the file, checking it, and call read_rooted with the header, the layout
+  // and the file's contents before they go away.
+  static Contents ReadContents(
+      const std::string &path, bool rooted,
+      const std::function<void(const Header &, const Layout &, const char *)>
+          &read_rooted);
+};
+
+template <>
+UnrootedTreeCollection TreeCollectionCache::Read(const std::string &path);
+template <>
+RootedTreeCollection TreeCollectionCache::Read(const std::string &path);
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+// Tests of rooted trees and of ReadThrough appear in rooted_sbn_instance.hpp.
+TEST_CASE("TreeCollectionCache") {
+  const std::string path = "_ignore/tree_collection_cache.bin";
+  // The first two topologies are equal, but are different objects.
+  Node::NodePtrVec topologies = {Node::ExampleTopologies()[0],
+                                 Node::ExampleTopologies()[1],
+                                 Node::ExampleTopologies()[2]};
+  UnrootedTree::UnrootedTreeVector tree_vector;
+  for (const auto &topology : topologies) {
+    tree_vector.push_back(UnrootedTree::UnitBranchLengthTreeOf(topology));
+  }
+  tree_vector[1].branch_lengths_ = {0.5, 1., 1.5, 2., 2.5, 0.};
+  // ((0,1),2),3,4, in which node 6 is a child of node 5.
+  UnrootedTreeCollection five_taxon_trees(
+      {UnrootedTree(Node::OfParentIdVector({6, 6, 5, 7, 7, 7, 5}),
+                    Tree::BranchLengthVector({0., 1., 2., 3., 4., 5., 6., 0.})),
+       UnrootedTree::OfParentIdVector({5, 5, 6, 6, 7, 7, 7})},
+      StringVector({"a", "b", "c", "d", "e"}));
+  for (const auto &trees :
+       {UnrootedTreeCollection(tree_vector, StringVector({"w", "x", "y", "z"})),
+        five_taxon_trees}) {
+    TreeCollectionCache::Write(path, trees);
+    CHECK_EQ(TreeCollectionCache::Read<UnrootedTreeCollection>(path), trees);
+  }
+  TreeCollectionCache::Write(
+      path, UnrootedTreeCollection(tree_vector, StringVector({"w", "x", "y", "z"})));
+  const auto cached_trees = TreeCollectionCache::Read<UnrootedTreeCollection>(path);
+  // As after parsing, trees with equal topologies share them.
+  CHECK_EQ(cached_trees.GetTree(0).Topology().get(),
+           cached_trees.GetTree(1).Topology().get());
+  CHECK_NE(cached_trees.GetTree(0).Topology().get(),
+           cached_trees.GetTree(2).Topology().get());
+  // The same goes for trees made from the sections in memory.
+  const auto sections = TreeCollectionCache::SectionsOf(cached_trees);
+  CHECK_EQ(sections.TreeCount(), cached_trees.TreeCount());
+  const auto section_trees = TreeCollectionCache::UnrootedTreesOf(sections, 4);
+  CHECK_EQ(UnrootedTreeCollection(section_trees, StringVector({"w", "x", "y", "z"})),
+           cached_trees);
+  CHECK_EQ(section_trees[0].Topology().get(), section_trees[1].Topology().get());
+  CHECK_THROWS(TreeCollectionCache::UnrootedTreesOf(sections, 5));
+  // An unrooted cache isn't a rooted one.
+  CHECK_THROWS(TreeCollectionCache::Read<RootedTreeCollection>(path));
+  CHECK_THROWS(TreeCollectionCache::Read<UnrootedTreeCollection>(
+      "data/DS1.subsampled_10.t"));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_TREE_COLLECTION_CACHE_HPP_
@@ -0,0 +1,123 @@
+// Copyright 2019-2020 libsbn project contributors.
+// libsbn is free software under the GPLv3; see LICENSE file for details.
+//
+// Deciding which FatBeagle of a thread pool starts out with which trees. The cost of
+// a tree is proportional to the number of partials that we compute for it times the
+// number of site patterns, and each FatBeagle runs at its own measured speed. We
+// keep trees of the same topology together, because the partial cache and the
+// operation schedule cache of a FatBeagle only help with topologies that it has seen,
+// and then hand out the groups longest first, each to the FatBeagle that would
+// finish it soonest. Because threads that run dry steal from the backs of the other
+// deques, it is the cheapest work that gets stolen.
+
+#ifndef SRC_TREE_SCHEDULER_HPP_
+#define SRC_TREE_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "node.hpp"
+#include "sugar.hpp"
+
+namespace TreeScheduler {
+
+inline double TreeCost(const Node::NodePtr &topology, size_t pattern_count) {
+  return static_cast<double>(topology->LeafCount()) *
+         static_cast<double>(pattern_count);
+}
+
+// The relative speeds of executors from their measured throughputs. Executors that
+// haven't been measured yet get the mean speed of those that have, and if none have
+// been measured they are all equally fast.
+inline std::vector<double> Speeds(
+    const std::vector<std::optional<double>> &throughputs) {
+  double total = 0.;
+  size_t measured_count = 0;
+  for (const auto &throughput : throughputs) {
+    if (throughput.has_value() && *throughput > 0.) {
+      total += *throughput;
+      measured_count++;
+    }
+  }
+  const double mean = measured_count == 0 ? 1. : total / measured_count;
+  std::vector<double> speeds;
+  for (const auto &throughput : throughputs) {
+    speeds.push_back(throughput.has_value() && *throughput > 0. ? *throughput / mean
+                                                                : 1.);
+  }
+  return speeds;
+}
+
+// Assign work items 0, ..., costs.size() - 1 to executors of the given speeds, giving
+// entry i of the result the work items of executor i in the order that it should
+// take them. Items with the same group key go to the same executor, one after the
+// other. We hand out the groups in order of decreasing total cost, each to the
+// executor that would finish its work soonest.
+inline SizeVectorVector Assign(const std::vector<double> &costs,
+                               const SizeVector &group_keys,
+                               const std::vector<double> &speeds) {
+  Assert(costs.size() == group_keys.size(), "We need a group key for every cost.");
+  Assert(!speeds.empty(), "We need some executors to assign work to.");
+  SizeVectorVector groups;
+  std::vector<double> group_costs;
+  std::unordered_map<size_t, size_t> group_of_key;
+  for (size_t work = 0; work < costs.size(); work++) {
+    const auto [iter, inserted] = group_of_key.emplace(group_keys[work], groups.size());
+    if (inserted) {
+      groups.emplace_back();
+      group_costs.push_back(0.);
+    }
+    groups[iter->second].push_back(work);
+    group_costs[iter->second] += costs[work];
+  }
+  SizeVector group_order(groups.size());
+  std::iota(group_order.begin(), group_order.end(), 0);
+  std::stable_sort(group_order.begin(), group_order.end(),
+                   [&group_costs](size_t a, size_t b) {
+                     return group_costs[a] > group_costs[b];
+                   });
+  SizeVectorVector assignment(speeds.size());
+  std::vector<double> finish_times(speeds.size(), 0.);
+  for (const auto group_idx : group_order) {
+    size_t best_executor = 0;
+    double best_finish_time = 0.;
+    for (size_t executor = 0; executor < speeds.size(); executor++) {
+      const double finish_time =
+          finish_times[executor] + group_costs[group_idx] / speeds[executor];
+      if (executor == 0 || finish_time < best_finish_time) {
+        best_executor = executor;
+        best_finish_time = finish_time;
+      }
+    }
+    finish_times[best_executor] = best_finish_time;
+    auto &executor_work = assignment[best_executor];
+    executor_work.insert(executor_work.end(), groups[group_idx].begin(),
+                         groups[group_idx].end());
+  }
+  return assignment;
+}
+
+}  // namespace TreeScheduler
+
+#ifdef DOCTEST_LIBRARY_INCLUDED
+TEST_CASE("TreeScheduler") {
+  CHECK_EQ(TreeScheduler::Speeds({std::nullopt, std::nullopt}),
+           std::vector<double>({1., 1.}));
+  CHECK_EQ(TreeScheduler::Speeds({2., 6., std::nullopt}),
+           std::vector<double>({0.5, 1.5, 1.}));
+  // Longest first, each to the executor that is free soonest.
+  CHECK_EQ(TreeScheduler::Assign({1., 5., 2., 4.}, {0, 1, 2, 3}, {1., 1.}),
+           SizeVectorVector({{1, 0}, {3, 2}}));
+  // Work items 0 and 2 share a group, which costs as much as the other two together.
+  CHECK_EQ(TreeScheduler::Assign({3., 2., 3., 4.}, {7, 8, 7, 9}, {1., 1.}),
+           SizeVectorVector({{0, 2}, {3, 1}}));
+  // A three times faster executor gets three times the work.
+  CHECK_EQ(TreeScheduler::Assign({1., 1., 1., 1.}, {0, 1, 2, 3}, {3., 1.}),
+           SizeVectorVector({{0, 1, 2}, {3}}));
+  CHECK_EQ(TreeScheduler::Assign({}, {}, {1.}), SizeVectorVector(1));
+}
+#endif  // DOCTEST_LIBRARY_INCLUDED
+
+#endif  // SRC_TREE_SCHEDULER_HPP_
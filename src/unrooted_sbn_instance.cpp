@@ -2,12 +2,19 @@
 // libsbn is free software under the GPLv3; see LICENSE file for details.
 
 #include "unrooted_sbn_instance.hpp"
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
-#include <unordered_set>
+#include <numeric>
+#include <thread>
 
 #include "eigen_sugar.hpp"
 #include "numerical_utils.hpp"
+#include "task_processor.hpp"
+#include "tree_collection_cache.hpp"
 
 // ** Building SBN-related items
 
@@ -19,40 +26,161 @@ void UnrootedSBNInstance::TrainSimpleAverage() {
                                 rootsplits_.size(), parent_to_range_);
 }
 
-EigenVectorXd UnrootedSBNInstance::TrainExpectationMaximization(double alpha,
-                                                                size_t max_iter,
-                                                                double score_epsilon) {
+void UnrootedSBNInstance::ResetOnlineSimpleAverage() {
+  online_rootsplit_counts_.clear();
+  online_pcss_counts_.clear();
+  online_taxon_names_.clear();
+}
+
+void UnrootedSBNInstance::AddToOnlineSimpleAverage(
+    const UnrootedTreeCollection &trees) {
+  if (trees.TreeCount() == 0) {
+    return;
+  }  // else
+  if (online_taxon_names_.empty()) {
+    online_taxon_names_ = trees.TaxonNames();
+  } else if (trees.TaxonNames() != online_taxon_names_) {
+    Failwith("The taxa of this batch differ from those of the trees seen so far.");
+  }
+  const auto topology_counter = trees.TopologyCounter();
+  // SimpleAverage counts each rootsplit and PCSS once for every rooting that it
+  // appears in. To get the same counts, we index the support of this batch, count
+  // the indices in the indexer representations, and map the counts back to bitsets.
+  BitsetVector batch_support;
+  BitsetSizeMap batch_indexer;
+  for (const auto &[rootsplit, _] : RootsplitCounterOf(topology_counter)) {
+    SafeInsert(batch_indexer, rootsplit, batch_support.size());
+    batch_support.push_back(rootsplit);
+  }
+  const size_t rootsplit_count = batch_support.size();
+  for (const auto &[parent, child_counter] : PCSSCounterOf(topology_counter)) {
+    for (const auto &[child, _] : child_counter) {
+      SafeInsert(batch_indexer, parent + child, batch_support.size());
+      batch_support.push_back(parent + child);
+    }
+  }
+  SizeVector counts(batch_support.size(), 0);
+  for (const auto &[topology, topology_count] : topology_counter) {
+    for (const auto &rooted_representation : UnrootedSBNMaps::IndexerRepresentationOf(
+             batch_indexer, topology, batch_support.size())) {
+      for (const auto idx : rooted_representation) {
+        counts[idx] += topology_count;
+      }
+    }
+  }
+  for (size_t idx = 0; idx < rootsplit_count; idx++) {
+    online_rootsplit_counts_.increment(batch_support[idx], counts[idx]);
+  }
+  for (size_t idx = rootsplit_count; idx < batch_support.size(); idx++) {
+    const Bitset &pcss = batch_support[idx];
+    auto search = online_pcss_counts_.find(pcss.PCSSParent());
+    if (search == online_pcss_counts_.end()) {
+      search = online_pcss_counts_.emplace(pcss.PCSSParent(), BitsetSizeDict(0)).first;
+    }
+    search->second.increment(pcss.PCSSChunk(2), counts[idx]);
+  }
+}
+
+void UnrootedSBNInstance::UpdateSBNFromOnlineSimpleAverage() {
+  if (online_taxon_names_.empty()) {
+    Failwith("Please add some trees to the online SimpleAverage.");
+  }
+  ClearTreeCollectionAssociatedState();
+  IndexSupport(online_taxon_names_, online_rootsplit_counts_, online_pcss_counts_);
+  taxon_names_ = online_taxon_names_;
+  // As in SimpleAverage, the parameters are the unnormalized log counts.
+  for (size_t idx = 0; idx < rootsplits_.size(); idx++) {
+    sbn_parameters_[idx] =
+        log(static_cast<double>(online_rootsplit_counts_.at(rootsplits_[idx])));
+  }
+  for (const auto &[parent, child_counts] : online_pcss_counts_) {
+    for (const auto &[child, count] : child_counts) {
+      sbn_parameters_[indexer_.at(parent + child)] = log(static_cast<double>(count));
+    }
+  }
+}
+
+void UnrootedSBNInstance::TrainOnlineSimpleAverageOnNewickFile(const std::string &fname,
+                                                               size_t batch_size) {
+  Driver driver;
+  driver.ParseNewickFileInBatches(fname, batch_size, [this](TreeCollection batch) {
+    AddToOnlineSimpleAverage(UnrootedTreeCollection::OfTreeCollection(batch));
+  });
+  UpdateSBNFromOnlineSimpleAverage();
+}
+
+void UnrootedSBNInstance::TrainOnlineSimpleAverageOnNexusFile(const std::string &fname,
+                                                              size_t batch_size) {
+  Driver driver;
+  driver.ParseNexusFileInBatches(fname, batch_size, [this](TreeCollection batch) {
+    AddToOnlineSimpleAverage(UnrootedTreeCollection::OfTreeCollection(batch));
+  });
+  UpdateSBNFromOnlineSimpleAverage();
+}
+
+EigenVectorXd UnrootedSBNInstance::TrainExpectationMaximization(
+    double alpha, size_t max_iter, double score_epsilon, size_t thread_count,
+    double relative_score_epsilon, bool squarem) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::ExpectationMaximization);
   CheckTopologyCounter();
   auto indexer_representation_counter = UnrootedSBNMaps::IndexerRepresentationCounterOf(
       indexer_, topology_counter_, sbn_parameters_.size());
-  return SBNProbability::ExpectationMaximization(
+  EigenVectorXd score_history = SBNProbability::ExpectationMaximization(
       sbn_parameters_, indexer_representation_counter, rootsplits_.size(),
-      parent_to_range_, alpha, max_iter, score_epsilon);
+      parent_to_range_, alpha, max_iter, score_epsilon, thread_count,
+      relative_score_epsilon, squarem);
+  perf_stats_.AddEMIterations(static_cast<size_t>(score_history.size()));
+  return score_history;
 }
 
-EigenVectorXd UnrootedSBNInstance::CalculateSBNProbabilities() {
-  EigenVectorXd sbn_parameters_copy = sbn_parameters_;
-  SBNProbability::ProbabilityNormalizeParamsInLog(sbn_parameters_copy,
-                                                  rootsplits_.size(), parent_to_range_);
-  return SBNProbability::ProbabilityOf(sbn_parameters_copy,
-                                       MakeIndexerRepresentations());
+EigenVectorXd UnrootedSBNInstance::CalculateSBNProbabilities(size_t thread_count) {
+  return SBNProbability::ProbabilityOf(GetNormalizedSBNParameters().InLog(),
+                                       MakeFlatIndexerRepresentations(), thread_count);
 }
 
 Node::NodePtr UnrootedSBNInstance::SampleTopology() const {
   return SampleTopology(false);
 }
 
-void UnrootedSBNInstance::SampleTrees(size_t count) {
+void UnrootedSBNInstance::SampleTrees(size_t count, size_t thread_count) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Sampling);
   CheckSBNMapsAvailable();
   auto leaf_count = rootsplits_[0].size();
   // 2n-2 because trees are unrooted.
   auto edge_count = 2 * static_cast<int>(leaf_count) - 2;
+  const auto &alias_table = UpToDateAliasTable();
+  const auto stream_seed = static_cast<uint32_t>(random_generator_());
+  const size_t chunk_count = (count + sample_chunk_size_ - 1) / sample_chunk_size_;
+  Node::NodePtrVec topologies(count);
+  const auto sample_chunk = [&](size_t chunk_idx) {
+    std::seed_seq chunk_seed{stream_seed, static_cast<uint32_t>(chunk_idx)};
+    std::mt19937 generator(chunk_seed);
+    const size_t end = std::min(count, (chunk_idx + 1) * sample_chunk_size_);
+    for (size_t i = chunk_idx * sample_chunk_size_; i < end; i++) {
+      topologies[i] = SampleTopology(alias_table, false, generator);
+    }
+  };
+  thread_count = std::min(thread_count, chunk_count);
+  if (thread_count > 1) {
+    SizeVector thread_indices(thread_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, [&sample_chunk](size_t, size_t chunk_idx) {
+      sample_chunk(chunk_idx);
+    });
+  } else {
+    for (size_t chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+      sample_chunk(chunk_idx);
+    }
+  }
   tree_collection_.trees_.clear();
-  for (size_t i = 0; i < count; i++) {
+  tree_collection_.trees_.reserve(count);
+  for (auto &topology : topologies) {
     std::vector<double> branch_lengths(static_cast<size_t>(edge_count));
     tree_collection_.trees_.emplace_back(
-        UnrootedTree(SampleTopology(), std::move(branch_lengths)));
+        UnrootedTree(std::move(topology), std::move(branch_lengths)));
   }
+  perf_stats_.AddTreesSampled(count);
 }
 
 std::vector<UnrootedIndexerRepresentation>
@@ -60,8 +188,7 @@ UnrootedSBNInstance::MakeIndexerRepresentations() const {
   std::vector<UnrootedIndexerRepresentation> representations;
   representations.reserve(tree_collection_.trees_.size());
   for (const auto &tree : tree_collection_.trees_) {
-    representations.push_back(UnrootedSBNMaps::IndexerRepresentationOf(
-        indexer_, tree.Topology(), sbn_parameters_.size()));
+    representations.push_back(IndexerRepresentationOf(tree.Topology()));
   }
   return representations;
 }
@@ -71,7 +198,81 @@ std::vector<SizeVectorVector> UnrootedSBNInstance::MakePSPIndexerRepresentations
   std::vector<SizeVectorVector> representations;
   representations.reserve(tree_collection_.trees_.size());
   for (const auto &tree : tree_collection_.trees_) {
-    representations.push_back(psp_indexer_.RepresentationOf(tree.Topology()));
+    representations.push_back(PSPIndexerRepresentationOf(tree.Topology()));
+  }
+  return representations;
+}
+
+CSRRepresentation UnrootedSBNInstance::MakeFlatIndexerRepresentations() const {
+  CSRRepresentation representations;
+  for (const auto &tree : tree_collection_.trees_) {
+    if (representation_cache_ == nullptr) {
+      representations.PushBack(UnrootedSBNMaps::IndexerRepresentationOf(
+          indexer_, tree.Topology(), sbn_parameters_.size()));
+    } else {
+      representations.PushBack(
+          CachedRepresentationsOf(tree.Topology())->indexer_representation_);
+    }
+  }
+  return representations;
+}
+
+CSRRepresentation UnrootedSBNInstance::MakeFlatPSPIndexerRepresentations() const {
+  CSRRepresentation representations;
+  for (const auto &tree : tree_collection_.trees_) {
+    if (representation_cache_ == nullptr) {
+      representations.PushBack(psp_indexer_.RepresentationOf(tree.Topology()));
+    } else {
+      representations.PushBack(
+          CachedRepresentationsOf(tree.Topology())->psp_representation_);
+    }
+  }
+  return representations;
+}
+
+void UnrootedSBNInstance::SetRepresentationCacheCapacity(size_t capacity) {
+  if (capacity == 0) {
+    representation_cache_.reset();
+  } else {
+    representation_cache_ = std::make_unique<RepresentationCache>(capacity);
+  }
+}
+
+void UnrootedSBNInstance::ClearTreeCollectionAssociatedState() {
+  SBNInstance::ClearTreeCollectionAssociatedState();
+  if (representation_cache_ != nullptr) {
+    representation_cache_->Clear();
+  }
+}
+
+UnrootedIndexerRepresentation UnrootedSBNInstance::IndexerRepresentationOf(
+    const Node::NodePtr &topology) const {
+  if (representation_cache_ == nullptr) {
+    return UnrootedSBNMaps::IndexerRepresentationOf(indexer_, topology,
+                                                    sbn_parameters_.size());
+  }  // else
+  return CachedRepresentationsOf(topology)->indexer_representation_;
+}
+
+SizeVectorVector UnrootedSBNInstance::PSPIndexerRepresentationOf(
+    const Node::NodePtr &topology) const {
+  if (representation_cache_ == nullptr) {
+    return psp_indexer_.RepresentationOf(topology);
+  }  // else
+  return CachedRepresentationsOf(topology)->psp_representation_;
+}
+
+RepresentationCache::RepresentationsPtr UnrootedSBNInstance::CachedRepresentationsOf(
+    const Node::NodePtr &topology) const {
+  Assert(representation_cache_ != nullptr, "The representation cache is off.");
+  auto representations = representation_cache_->Find(topology);
+  if (representations == nullptr) {
+    representations =
+        std::make_shared<const TopologyRepresentations>(TopologyRepresentations{
+            UnrootedSBNMaps::IndexerRepresentationOf(indexer_, topology,
+                                                     sbn_parameters_.size()),
+            psp_indexer_.RepresentationOf(topology)});
+    representation_cache_->Insert(topology, representations);
   }
   return representations;
 }
@@ -80,6 +281,10 @@ DoubleVectorVector UnrootedSBNInstance::SplitLengths() const {
   return psp_indexer_.SplitLengths(tree_collection_);
 }
 
+FlatSplitLengths UnrootedSBNInstance::MakeFlatSplitLengths(size_t thread_count) const {
+  return psp_indexer_.MakeFlatSplitLengths(tree_collection_, thread_count);
+}
+
 StringSetVector UnrootedSBNInstance::StringIndexerRepresentationOf(
     UnrootedIndexerRepresentation indexer_representation) const {
   auto reversed_indexer = StringReversedIndexer();
@@ -103,63 +308,460 @@ std::pair<StringSizeMap, StringPCSSMap> UnrootedSBNInstance::SplitCounters() con
 
 // ** I/O
 
-void UnrootedSBNInstance::ReadNewickFile(std::string fname) {
-  Driver driver;
+void UnrootedSBNInstance::ReadNewickFile(std::string fname, size_t thread_count,
+                                        bool use_cache) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Parsing);
+  const std::function<UnrootedTreeCollection()> parse = [&fname, thread_count]() {
+    Driver driver;
+    return UnrootedTreeCollection::OfTreeCollection(
+        driver.ParseNewickFile(fname, thread_count));
+  };
   tree_collection_ =
-      UnrootedTreeCollection::OfTreeCollection(driver.ParseNewickFile(fname));
+      use_cache ? TreeCollectionCache::ReadThrough(fname, parse) : parse();
 }
 
-void UnrootedSBNInstance::ReadNexusFile(std::string fname) {
-  Driver driver;
+void UnrootedSBNInstance::ReadNexusFile(std::string fname, size_t thread_count,
+                                        bool use_cache) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Parsing);
+  const std::function<UnrootedTreeCollection()> parse = [&fname, thread_count]() {
+    Driver driver;
+    return UnrootedTreeCollection::OfTreeCollection(
+        driver.ParseNexusFile(fname, thread_count));
+  };
   tree_collection_ =
-      UnrootedTreeCollection::OfTreeCollection(driver.ParseNexusFile(fname));
+      use_cache ? TreeCollectionCache::ReadThrough(fname, parse) : parse();
 }
 
 // ** Phylogenetic likelihood
 
 std::vector<double> UnrootedSBNInstance::LogLikelihoods() {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+#ifdef LIBSBN_MPI
+  if (mpi_engine_ != nullptr) {
+    return mpi_engine_->LogLikelihoods(tree_collection_, phylo_model_params_,
+                                       rescaling_);
+  }
+#endif
+  if (shared_memory_engine_ != nullptr) {
+    return shared_memory_engine_->LogLikelihoods(tree_collection_, phylo_model_params_,
+                                                 rescaling_);
+  }
   return GetEngine()->LogLikelihoods(tree_collection_, phylo_model_params_, rescaling_);
 }
 
+double UnrootedSBNInstance::IncrementalLogLikelihood(size_t tree_number) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(1);
+  if (tree_number >= TreeCount()) {
+    Failwith("IncrementalLogLikelihood: tree number out of range.");
+  }
+  return GetEngine()->IncrementalLogLikelihood(tree_collection_.GetTree(tree_number),
+                                               phylo_model_params_.row(tree_number),
+                                               rescaling_);
+}
+
+double UnrootedSBNInstance::LogLikelihoodOf(const UnrootedTree &tree,
+                                            EigenVectorXd phylo_model_params) const {
+  return GetEngine()->LogLikelihood(tree, phylo_model_params, rescaling_);
+}
+
+UnrootedTreeGradient UnrootedSBNInstance::GradientOf(
+    const UnrootedTree &tree, EigenVectorXd phylo_model_params) const {
+  return GetEngine()->Gradient(tree, phylo_model_params, rescaling_);
+}
+
 std::vector<UnrootedTreeGradient> UnrootedSBNInstance::Gradients() {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+#ifdef LIBSBN_MPI
+  if (mpi_engine_ != nullptr) {
+    return mpi_engine_->Gradients(tree_collection_, phylo_model_params_, rescaling_);
+  }
+#endif
+  if (shared_memory_engine_ != nullptr) {
+    return shared_memory_engine_->Gradients(tree_collection_, phylo_model_params_,
+                                            rescaling_);
+  }
   return GetEngine()->Gradients(tree_collection_, phylo_model_params_, rescaling_);
 }
 
-void UnrootedSBNInstance::PushBackRangeForParentIfAvailable(
-    const Bitset &parent, UnrootedSBNInstance::RangeVector &range_vector) {
-  if (parent_to_range_.count(parent) > 0) {
-    range_vector.push_back(parent_to_range_.at(parent));
+void UnrootedSBNInstance::LogLikelihoods(EigenVectorXdRef log_likelihoods) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::LogLikelihoods);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+#ifdef LIBSBN_MPI
+  if (mpi_engine_ != nullptr) {
+    mpi_engine_->LogLikelihoods(tree_collection_, phylo_model_params_, rescaling_,
+                                log_likelihoods);
+    return;
+  }
+#endif
+  if (shared_memory_engine_ != nullptr) {
+    shared_memory_engine_->LogLikelihoods(tree_collection_, phylo_model_params_,
+                                          rescaling_, log_likelihoods);
+    return;
+  }
+  GetEngine()->LogLikelihoods(tree_collection_, phylo_model_params_, rescaling_,
+                              log_likelihoods);
+}
+
+void UnrootedSBNInstance::BranchGradients(EigenVectorXdRef log_likelihoods,
+                                         EigenMatrixXdRef branch_gradients) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+#ifdef LIBSBN_MPI
+  if (mpi_engine_ != nullptr) {
+    mpi_engine_->BranchGradients(tree_collection_, phylo_model_params_, rescaling_,
+                                 log_likelihoods, branch_gradients);
+    return;
+  }
+#endif
+  if (shared_memory_engine_ != nullptr) {
+    shared_memory_engine_->BranchGradients(tree_collection_, phylo_model_params_,
+                                           rescaling_, log_likelihoods,
+                                           branch_gradients);
+    return;
+  }
+  GetEngine()->BranchGradients(tree_collection_, phylo_model_params_, rescaling_,
+                               log_likelihoods, branch_gradients);
+}
+
+void UnrootedSBNInstance::BranchGradientsAndHessianDiagonals(
+    EigenVectorXdRef log_likelihoods, EigenMatrixXdRef branch_gradients,
+    EigenMatrixXdRef branch_hessian_diagonals) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->BranchGradientsAndHessianDiagonals(tree_collection_,
+                                                  phylo_model_params_, rescaling_,
+                                                  log_likelihoods, branch_gradients,
+                                                  branch_hessian_diagonals);
+}
+
+void UnrootedSBNInstance::SubsetBranchGradients(const SizeVector &edge_ids,
+                                                EigenVectorXdRef log_likelihoods,
+                                                EigenMatrixXdRef branch_gradients) {
+  PerfStats::PhaseScope scope(perf_stats_, PerfStats::Gradients);
+  perf_stats_.AddTreesEvaluated(TreeCount());
+  GetEngine()->SubsetBranchGradients(tree_collection_, phylo_model_params_, rescaling_,
+                                     edge_ids, log_likelihoods, branch_gradients);
+}
+
+#ifdef LIBSBN_MPI
+void UnrootedSBNInstance::PrepareForDistributedPhyloLikelihood(
+    const PhyloModelSpecification &model_specification, size_t thread_count,
+    const std::vector<BeagleFlags> &beagle_flag_vector, const bool use_tip_states,
+    std::optional<size_t> tree_count_option) {
+  PrepareForPhyloLikelihood(model_specification, thread_count, beagle_flag_vector,
+                            use_tip_states, tree_count_option);
+  MPIEngine::Initialize();
+  const EngineSpecification engine_specification{thread_count, beagle_flag_vector,
+                                                 use_tip_states};
+  mpi_engine_ =
+      std::make_unique<MPIEngine>(MPI_COMM_WORLD, *GetEngine(), engine_specification,
+                                  model_specification, alignment_, TagTaxonMap());
+}
+#endif
+
+void UnrootedSBNInstance::PrepareForSharedMemoryPhyloLikelihood(
+    const PhyloModelSpecification &model_specification, const std::string &name,
+    std::optional<size_t> tree_count_option) {
+  CheckSequencesAndTreesLoaded();
+  ResetEngines();
+  shared_memory_engine_ = std::make_unique<SharedMemoryEngine>(
+      name, model_specification, SitePattern(alignment_, *GetTaxonRegistry()),
+      tree_count_option ? *tree_count_option : TreeCount());
+  ResizePhyloModelParams(tree_count_option);
+}
+
+void UnrootedSBNInstance::WaitForSharedMemoryWorkers(size_t worker_count) const {
+  if (shared_memory_engine_ == nullptr) {
+    Failwith("Call PrepareForSharedMemoryPhyloLikelihood before waiting for workers.");
+  }
+  shared_memory_engine_->WaitForWorkers(worker_count);
+}
+
+std::shared_future<std::vector<double>> UnrootedSBNInstance::SubmitLogLikelihoods()
+    const {
+  auto task = [engine = GetEngine(), tree_collection = tree_collection_,
+               phylo_model_params = phylo_model_params_,
+               rescaling = rescaling_]() mutable {
+    return engine->LogLikelihoods(tree_collection, phylo_model_params, rescaling);
+  };
+  return std::async(std::launch::async, std::move(task)).share();
+}
+
+std::shared_future<std::vector<UnrootedTreeGradient>>
+UnrootedSBNInstance::SubmitGradients() const {
+  auto task = [engine = GetEngine(), tree_collection = tree_collection_,
+               phylo_model_params = phylo_model_params_,
+               rescaling = rescaling_]() mutable {
+    return engine->Gradients(tree_collection, phylo_model_params, rescaling);
+  };
+  return std::async(std::launch::async, std::move(task)).share();
+}
+
+size_t UnrootedSBNInstance::ScoreTreeFile(const std::string &fname, bool is_nexus,
+                                          size_t batch_size,
+                                          const TreeScoreCallback &callback,
+                                          bool gradients, double burn_in_fraction,
+                                          size_t thinning, size_t queue_capacity) {
+  PerfStats::PhaseScope scope(perf_stats_, gradients ? PerfStats::Gradients
+                                                     : PerfStats::LogLikelihoods);
+  if (batch_size == 0) {
+    Failwith("ScoreTreeFile needs a positive batch size.");
   }
+  if (phylo_model_params_.rows() == 0) {
+    Failwith("ScoreTreeFile needs a row of phylogenetic model parameters.");
+  }
+  const Engine *engine = GetEngine();
+  const TagStringMap tag_taxon_map = TagTaxonMap();
+  // Every tree gets the first row of parameters.
+  EigenMatrixXd batch_params = phylo_model_params_.topRows(1).replicate(
+      static_cast<Eigen::Index>(batch_size), 1);
+  // We open the file here, so that a missing file fails before we start any threads.
+  TreeFileStream stream(fname, is_nexus, batch_size, burn_in_fraction, thinning);
+  BoundedQueue<UnrootedTreeCollection> tree_queue(queue_capacity);
+  BoundedQueue<TreeScoreBatch> score_queue(queue_capacity);
+  // A stage that fails closes its queues, so that the other stages wind down, and we
+  // rethrow its exception once they have.
+  std::exception_ptr reader_exception;
+  std::exception_ptr writer_exception;
+  std::thread reader([&] {
+    try {
+      while (auto batch = stream.NextBatch()) {
+        if (batch->TagTaxonMap() != tag_taxon_map) {
+          Failwith("The trees of " + fname + " don't have the taxa of our trees.");
+        }
+        if (!tree_queue.Push(UnrootedTreeCollection::OfTreeCollection(*batch))) {
+          break;
+        }
+      }
+    } catch (...) {
+      reader_exception = std::current_exception();
+    }
+    tree_queue.Close();
+  });
+  std::thread writer([&] {
+    try {
+      while (auto scores = score_queue.Pop()) {
+        callback(*scores);
+      }
+    } catch (...) {
+      writer_exception = std::current_exception();
+      // Let the evaluation stage know that we're done.
+      score_queue.Close();
+    }
+  });
+  size_t tree_count = 0;
+  std::exception_ptr evaluation_exception;
+  try {
+    while (auto trees = tree_queue.Pop()) {
+      auto params = batch_params.topRows(static_cast<Eigen::Index>(trees->TreeCount()));
+      TreeScoreBatch scores{tree_count, {}, {}};
+      if (gradients) {
+        scores.gradients_ = engine->Gradients(*trees, params, rescaling_);
+        for (const auto &gradient : scores.gradients_) {
+          scores.log_likelihoods_.push_back(gradient.log_likelihood_);
+        }
+      } else {
+        scores.log_likelihoods_ = engine->LogLikelihoods(*trees, params, rescaling_);
+      }
+      tree_count += trees->TreeCount();
+      if (!score_queue.Push(std::move(scores))) {
+        break;
+      }
+    }
+  } catch (...) {
+    evaluation_exception = std::current_exception();
+  }
+  tree_queue.Close();
+  score_queue.Close();
+  reader.join();
+  writer.join();
+  for (const auto &exception :
+       {evaluation_exception, reader_exception, writer_exception}) {
+    if (exception != nullptr) {
+      std::rethrow_exception(exception);
+    }
+  }
+  perf_stats_.AddTreesEvaluated(tree_count);
+  return tree_count;
 }
 
-// Retrieves range of subsplits for each s|t that appears in the tree
-// given by rooted_representation.
-UnrootedSBNInstance::RangeVector UnrootedSBNInstance::GetSubsplitRanges(
-    const SizeVector &rooted_representation) {
-  RangeVector subsplit_ranges;
-  // PROFILE: should we be reserving here?
-  subsplit_ranges.emplace_back(0, rootsplits_.size());
-  Bitset root = rootsplits_.at(rooted_representation[0]);
-  PushBackRangeForParentIfAvailable(root + ~root, subsplit_ranges);
-  PushBackRangeForParentIfAvailable(~root + root, subsplit_ranges);
-  // Starting at 1 here because we took care of the rootsplit above (the 0th element).
-  for (size_t i = 1; i < rooted_representation.size(); i++) {
-    Bitset child = index_to_child_.at(rooted_representation[i]);
-    PushBackRangeForParentIfAvailable(child, subsplit_ranges);
-    PushBackRangeForParentIfAvailable(child.RotateSubsplit(), subsplit_ranges);
+size_t UnrootedSBNInstance::ScoreTreeFileToPath(
+    const std::string &fname, bool is_nexus, size_t batch_size,
+    const std::string &out_path, bool gradients, double burn_in_fraction,
+    size_t thinning, size_t queue_capacity) {
+  std::ofstream out_stream(out_path);
+  if (!out_stream) {
+    Failwith("Couldn't open " + out_path + " for writing.");
   }
-  return subsplit_ranges;
+  out_stream << std::setprecision(std::numeric_limits<double>::max_digits10);
+  const auto write_scores = [&out_stream](const TreeScoreBatch &scores) {
+    for (size_t idx = 0; idx < scores.log_likelihoods_.size(); idx++) {
+      out_stream << scores.first_tree_idx_ + idx << '\t'
+                 << scores.log_likelihoods_[idx];
+      if (!scores.gradients_.empty()) {
+        for (const double entry : scores.gradients_[idx].branch_lengths_) {
+          out_stream << '\t' << entry;
+        }
+      }
+      out_stream << '\n';
+    }
+    if (!out_stream) {
+      Failwith("Couldn't write the scores.");
+    }
+  };
+  return ScoreTreeFile(fname, is_nexus, batch_size, write_scores, gradients,
+                       burn_in_fraction, thinning, queue_capacity);
+}
+
+// ** Variational inference
+
+void UnrootedSBNInstance::AssertLogNormalParams(EigenConstMatrixXdRef lognormal_params,
+                                                const std::string &context) const {
+  const size_t split_count = psp_indexer_.AfterRootsplitsIndex();
+  if (static_cast<size_t>(lognormal_params.rows()) != split_count ||
+      lognormal_params.cols() != 2) {
+    Failwith(context +
+             " needs a (mu, sigma) row of LogNormal parameters for each of the " +
+             std::to_string(split_count) + " splits.");
+  }
+}
+
+// This is eq:gLogNorm, keeping epsilon for the gradients.
+EigenVectorXd UnrootedSBNInstance::SampleLogNormalBranchLengths(
+    EigenConstMatrixXdRef lognormal_params, double prior_rate, EigenMatrixXd &epsilons,
+    std::vector<SizeVector> &branch_to_split) {
+  const size_t tree_count = TreeCount();
+  // An unrooted tree has 2n-3 branches, and then the branch length of the root.
+  const size_t branch_count = 2 * TaxonCount() - 3;
+  const double log_normalizer = 0.5 * std::log(2. * M_PI);
+  epsilons.resize(tree_count, branch_count);
+  branch_to_split.resize(tree_count);
+  EigenVectorXd log_prior_minus_log_q(tree_count);
+  std::normal_distribution<double> standard_normal;
+  for (size_t particle_idx = 0; particle_idx < tree_count; particle_idx++) {
+    auto &tree = tree_collection_.trees_[particle_idx];
+    branch_to_split[particle_idx] = PSPIndexerRepresentationOf(tree.Topology())[0];
+    double value = 0.;
+    for (size_t branch_idx = 0; branch_idx < branch_count; branch_idx++) {
+      const size_t split_idx = branch_to_split[particle_idx][branch_idx];
+      const double mu = lognormal_params(split_idx, 0);
+      const double sigma = lognormal_params(split_idx, 1);
+      const double epsilon = standard_normal(random_generator_);
+      const double log_branch_length = mu + sigma * epsilon;
+      const double branch_length = std::exp(log_branch_length);
+      tree.branch_lengths_[branch_idx] = branch_length;
+      epsilons(particle_idx, branch_idx) = epsilon;
+      value += std::log(prior_rate) - prior_rate * branch_length;
+      value += log_branch_length + std::log(sigma) + log_normalizer +
+               0.5 * epsilon * epsilon;
+    }
+    log_prior_minus_log_q(particle_idx) = value;
+  }
+  return log_prior_minus_log_q;
+}
+
+// Comments of the form eq:XX refer to equations in the tex, as in vip/branch_model.py.
+VariationalStepResult UnrootedSBNInstance::VariationalStep(
+    size_t particle_count, EigenConstMatrixXdRef lognormal_params, double beta,
+    bool use_vimco, double prior_rate, size_t thread_count) {
+  AssertLogNormalParams(lognormal_params, "VariationalStep");
+  if (particle_count == 0) {
+    Failwith("VariationalStep needs at least one particle.");
+  }
+  SampleTrees(particle_count, thread_count);
+  if (static_cast<size_t>(phylo_model_params_.rows()) != particle_count) {
+    ResizePhyloModelParams(particle_count);
+  }
+  const size_t split_count = psp_indexer_.AfterRootsplitsIndex();
+  const size_t branch_count = 2 * TaxonCount() - 3;
+  EigenMatrixXd epsilons;
+  std::vector<SizeVector> branch_to_split;
+  const EigenVectorXd log_prior_minus_log_q = SampleLogNormalBranchLengths(
+      lognormal_params, prior_rate, epsilons, branch_to_split);
+
+  VariationalStepResult result;
+  result.log_likelihoods_.resize(particle_count);
+  EigenMatrixXd branch_gradients(particle_count, 2 * TaxonCount() - 1);
+  BranchGradients(result.log_likelihoods_, branch_gradients);
+  const EigenVectorXd log_sbn_probabilities =
+      CalculateSBNProbabilities(thread_count).array().log();
+  const EigenVectorXd log_f_without_likelihood =
+      log_prior_minus_log_q - log_sbn_probabilities;
+  result.elbo_ = (result.log_likelihoods_ + log_f_without_likelihood).mean();
+  result.log_f_ = beta * result.log_likelihoods_ + log_f_without_likelihood;
+
+  // eq:dLdPsi, with eq:dgdPsi and eq:dlogqgdPsi.
+  result.scalar_gradient_ = EigenMatrixXd::Zero(split_count, 2);
+  for (size_t particle_idx = 0; particle_idx < particle_count; particle_idx++) {
+    const auto &branch_lengths = tree_collection_.trees_[particle_idx].branch_lengths_;
+    for (size_t branch_idx = 0; branch_idx < branch_count; branch_idx++) {
+      const size_t split_idx = branch_to_split[particle_idx][branch_idx];
+      const double sigma = lognormal_params(split_idx, 1);
+      const double epsilon = epsilons(particle_idx, branch_idx);
+      const double dlogp_dtheta =
+          branch_gradients(particle_idx, branch_idx) - prior_rate;
+      const double dg_dmu = branch_lengths[branch_idx];
+      result.scalar_gradient_(split_idx, 0) += dlogp_dtheta * dg_dmu + 1.;
+      result.scalar_gradient_(split_idx, 1) +=
+          dlogp_dtheta * dg_dmu * epsilon + epsilon + 1. / sigma;
+    }
+  }
+  result.sbn_gradient_ = TopologyGradients(result.log_f_, use_vimco, thread_count);
+  return result;
+}
+
+MarginalLikelihoodEstimate UnrootedSBNInstance::EstimateMarginalLikelihood(
+    size_t particle_count, EigenConstMatrixXdRef lognormal_params, size_t batch_size,
+    double prior_rate, size_t thread_count) {
+  AssertLogNormalParams(lognormal_params, "EstimateMarginalLikelihood");
+  if (particle_count == 0 || batch_size == 0) {
+    Failwith(
+        "EstimateMarginalLikelihood needs a positive particle count and batch size.");
+  }
+  ImportanceSamplingAccumulator accumulator;
+  EigenMatrixXd epsilons;
+  std::vector<SizeVector> branch_to_split;
+  EigenVectorXd log_likelihoods;
+  for (size_t batch_begin = 0; batch_begin < particle_count;
+       batch_begin += batch_size) {
+    const size_t batch_count = std::min(batch_size, particle_count - batch_begin);
+    SampleTrees(batch_count, thread_count);
+    if (static_cast<size_t>(phylo_model_params_.rows()) != batch_count) {
+      ResizePhyloModelParams(batch_count);
+    }
+    const EigenVectorXd log_prior_minus_log_q = SampleLogNormalBranchLengths(
+        lognormal_params, prior_rate, epsilons, branch_to_split);
+    log_likelihoods.resize(batch_count);
+    LogLikelihoods(log_likelihoods);
+    const EigenVectorXd log_sbn_probabilities =
+        CalculateSBNProbabilities(thread_count).array().log();
+    for (size_t particle_idx = 0; particle_idx < batch_count; particle_idx++) {
+      accumulator.Add(log_likelihoods(particle_idx) +
+                      log_prior_minus_log_q(particle_idx) -
+                      log_sbn_probabilities(particle_idx));
+    }
+  }
+  return {accumulator.Count(),
+          accumulator.LogMarginalLikelihood(),
+          accumulator.LogMarginalLikelihoodStandardError(),
+          accumulator.ELBO(),
+          accumulator.ELBOStandardError(),
+          accumulator.EffectiveSampleSize()};
 }
 
 // This gives the gradient of log q at a specific unrooted topology.
 // See eq:gradLogQ in the tex, and TopologyGradients for more information about
 // normalized_sbn_parameters_in_log.
-EigenVectorXd UnrootedSBNInstance::GradientOfLogQ(
+template <typename RootedRepresentations>
+EigenVectorXd UnrootedSBNInstance::GradientOfLogQOfRootings(
     EigenVectorXdRef normalized_sbn_parameters_in_log,
-    const UnrootedIndexerRepresentation &indexer_representation) {
+    const RootedRepresentations &rooted_representations) {
   EigenVectorXd grad_log_q = EigenVectorXd::Zero(sbn_parameters_.size());
   double log_q = DOUBLE_NEG_INF;
-  for (const auto &rooted_representation : indexer_representation) {
+  for (const auto &rooted_representation : rooted_representations) {
     if (SBNProbability::IsInSBNSupport(rooted_representation, sbn_parameters_.size())) {
       auto subsplit_ranges = GetSubsplitRanges(rooted_representation);
       // Calculate entries in normalized_sbn_parameters_in_log as needed.
@@ -178,19 +780,17 @@ EigenVectorXd UnrootedSBNInstance::GradientOfLogQ(
       double log_probability_rooted_tree = SBNProbability::SumOf(
           normalized_sbn_parameters_in_log, rooted_representation, 0.0);
       double probability_rooted_tree = exp(log_probability_rooted_tree);
-      // We need to look up the subsplits in the tree.
-      // Set representation allows fast lookup.
-      std::unordered_set<size_t> rooted_representation_as_set(
-          rooted_representation.begin(), rooted_representation.end());
-      // Now, we actually perform the eq:gradLogQ calculation.
+      // Now, we actually perform the eq:gradLogQ calculation. The ranges are disjoint
+      // and cover every subsplit of the rooted tree, so we can subtract the
+      // expected indicators over the ranges and then add the indicators of the
+      // subsplits in the tree.
       for (const auto &[begin, end] : subsplit_ranges) {
-        for (size_t pcss_idx = begin; pcss_idx < end; pcss_idx++) {
-          double indicator_subsplit_in_rooted_tree =
-              static_cast<double>(rooted_representation_as_set.count(pcss_idx) > 0);
-          grad_log_q[pcss_idx] += probability_rooted_tree *
-                                  (indicator_subsplit_in_rooted_tree -
-                                   exp(normalized_sbn_parameters_in_log[pcss_idx]));
-        }
+        grad_log_q.segment(begin, end - begin).array() -=
+            probability_rooted_tree *
+            normalized_sbn_parameters_in_log.segment(begin, end - begin).array().exp();
+      }
+      for (const auto pcss_idx : rooted_representation) {
+        grad_log_q[pcss_idx] += probability_rooted_tree;
       }
       log_q = NumericalUtils::LogAdd(log_q, log_probability_rooted_tree);
     }
@@ -199,26 +799,64 @@ EigenVectorXd UnrootedSBNInstance::GradientOfLogQ(
   return grad_log_q;
 }
 
+EigenVectorXd UnrootedSBNInstance::GradientOfLogQ(
+    EigenVectorXdRef normalized_sbn_parameters_in_log,
+    const UnrootedIndexerRepresentation &indexer_representation) {
+  return GradientOfLogQOfRootings(normalized_sbn_parameters_in_log,
+                                  indexer_representation);
+}
+
+EigenVectorXd UnrootedSBNInstance::GradientOfLogQ(
+    EigenVectorXdRef normalized_sbn_parameters_in_log,
+    const CSRRepresentation &indexer_representations, size_t tree_idx) {
+  return GradientOfLogQOfRootings(normalized_sbn_parameters_in_log,
+                                  indexer_representations.RowsOf(tree_idx));
+}
+
 EigenVectorXd UnrootedSBNInstance::TopologyGradients(const EigenVectorXdRef log_f,
-                                                     bool use_vimco) {
+                                                     bool use_vimco,
+                                                     size_t thread_count) {
   size_t tree_count = tree_collection_.TreeCount();
-  EigenVectorXd gradient_vector = EigenVectorXd::Zero(sbn_parameters_.size());
   EigenVectorXd multiplicative_factors =
       use_vimco ? SBNInstance::CalculateVIMCOMultiplicativeFactors(log_f)
                 : SBNInstance::CalculateMultiplicativeFactors(log_f);
-  // This variable acts as a cache to store normalized SBN parameters in log.
-  // Initialization to DOUBLE_NAN indicates that all entries are empty.
-  // It is mutated by GradientOfLogQ.
-  EigenVectorXd normalized_sbn_parameters_in_log =
-      EigenVectorXd::Constant(sbn_parameters_.size(), DOUBLE_NAN);
-  for (size_t i = 0; i < tree_count; i++) {
-    const auto indexer_representation = UnrootedSBNMaps::IndexerRepresentationOf(
-        indexer_, tree_collection_.GetTree(i).Topology(), sbn_parameters_.size());
-    // PROFILE: does it matter that we are allocating another sbn_vector_ sized object?
-    EigenVectorXd log_grad_q =
-        GradientOfLogQ(normalized_sbn_parameters_in_log, indexer_representation);
-    log_grad_q.array() *= multiplicative_factors(i);
-    gradient_vector += log_grad_q;
+  const auto indexer_representations = MakeFlatIndexerRepresentations();
+  // The trees are split into contiguous chunks, one per thread, each of which
+  // accumulates into its own gradient vector. The chunks are summed in order, so the
+  // result doesn't depend on how the threads get scheduled.
+  const size_t chunk_count = std::max<size_t>(1, std::min(thread_count, tree_count));
+  std::vector<EigenVectorXd> chunk_gradients(chunk_count);
+  const auto accumulate_chunk = [&](size_t chunk_idx) {
+    EigenVectorXd &gradient_vector = chunk_gradients[chunk_idx];
+    gradient_vector = EigenVectorXd::Zero(sbn_parameters_.size());
+    // This variable acts as a cache to store normalized SBN parameters in log.
+    // Initialization to DOUBLE_NAN indicates that all entries are empty.
+    // It is mutated by GradientOfLogQ.
+    EigenVectorXd normalized_sbn_parameters_in_log =
+        EigenVectorXd::Constant(sbn_parameters_.size(), DOUBLE_NAN);
+    const size_t end = (chunk_idx + 1) * tree_count / chunk_count;
+    for (size_t i = chunk_idx * tree_count / chunk_count; i < end; i++) {
+      // PROFILE: does it matter that we are allocating another sbn_vector_ sized
+      // object?
+      EigenVectorXd log_grad_q =
+          GradientOfLogQ(normalized_sbn_parameters_in_log, indexer_representations, i);
+      log_grad_q.array() *= multiplicative_factors(i);
+      gradient_vector += log_grad_q;
+    }
+  };
+  if (chunk_count > 1) {
+    SizeVector thread_indices(chunk_count);
+    std::iota(thread_indices.begin(), thread_indices.end(), 0);
+    WorkStealingPool<size_t> thread_pool(thread_indices);
+    thread_pool.Run(chunk_count, [&accumulate_chunk](size_t, size_t chunk_idx) {
+      accumulate_chunk(chunk_idx);
+    });
+  } else {
+    accumulate_chunk(0);
+  }
+  EigenVectorXd &gradient_vector = chunk_gradients[0];
+  for (size_t chunk_idx = 1; chunk_idx < chunk_count; chunk_idx++) {
+    gradient_vector += chunk_gradients[chunk_idx];
   }
   return gradient_vector;
 }
@@ -4,9 +4,51 @@
 #ifndef SRC_UNROOTED_SBN_INSTANCE_HPP_
 #define SRC_UNROOTED_SBN_INSTANCE_HPP_
 
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "importance_sampling.hpp"
+#include "representation_cache.hpp"
 #include "sbn_instance.hpp"
 #include "unrooted_tree_collection.hpp"
 
+// The result of UnrootedSBNInstance::VariationalStep. Each vector has an entry per
+// particle.
+struct VariationalStepResult {
+  // The naive Monte Carlo estimate of the ELBO from this sample.
+  double elbo_;
+  EigenVectorXd log_likelihoods_;
+  // The (annealed) log f values that went into the topology gradient.
+  EigenVectorXd log_f_;
+  // The gradient with respect to the LogNormal parameters, laid out like them.
+  EigenMatrixXd scalar_gradient_;
+  // The gradient with respect to sbn_parameters_.
+  EigenVectorXd sbn_gradient_;
+};
+
+// The result of UnrootedSBNInstance::EstimateMarginalLikelihood; see
+// ImportanceSamplingAccumulator.
+struct MarginalLikelihoodEstimate {
+  size_t particle_count_;
+  double log_marginal_likelihood_;
+  double log_marginal_likelihood_standard_error_;
+  double elbo_;
+  double elbo_standard_error_;
+  double effective_sample_size_;
+};
+
+// The scores of one batch of trees from UnrootedSBNInstance::ScoreTreeFile. The
+// gradients are empty unless we asked for them.
+struct TreeScoreBatch {
+  // The index of the first tree of the batch among the trees that we score.
+  size_t first_tree_idx_;
+  std::vector<double> log_likelihoods_;
+  std::vector<UnrootedTreeGradient> gradients_;
+};
+
 class UnrootedSBNInstance : public SBNInstance {
  public:
   // Trees get loaded in from a file or sampled from SBNs.
@@ -17,7 +59,17 @@ class UnrootedSBNInstance : public SBNInstance {
   size_t TaxonCount() const override { return tree_collection_.TaxonCount(); }
   StringVector TaxonNames() const override { return tree_collection_.TaxonNames(); }
   size_t TreeCount() const override { return tree_collection_.TreeCount(); }
+  size_t TreeCollectionByteCount() const override {
+    return tree_collection_.ApproximateByteCount();
+  }
+  double MaxPrecisionError(size_t sample_count) override {
+    return GetEngine()->MaxPrecisionError(tree_collection_, phylo_model_params_,
+                                          sample_count);
+  }
   TagStringMap TagTaxonMap() const override { return tree_collection_.TagTaxonMap(); }
+  std::shared_ptr<const TaxonRegistry> GetTaxonRegistry() const override {
+    return tree_collection_.GetTaxonRegistry();
+  }
   Node::TopologyCounter TopologyCounter() const override {
     return tree_collection_.TopologyCounter();
   }
@@ -33,19 +85,46 @@ class UnrootedSBNInstance : public SBNInstance {
 
   void TrainSimpleAverage();
   // max_iter is the maximum number of EM iterations to do, while score_epsilon
-  // is the cutoff for score improvement.
+  // is the cutoff for score improvement, and relative_score_epsilon that for score
+  // improvement as a fraction of the total so far. With squarem we accelerate EM as
+  // described at SBNProbability::ExpectationMaximization.
   EigenVectorXd TrainExpectationMaximization(double alpha, size_t max_iter,
-                                             double score_epsilon = 0.);
+                                             double score_epsilon = 0.,
+                                             size_t thread_count = 1,
+                                             double relative_score_epsilon = 0.,
+                                             bool squarem = false);
 
-  // Calculate SBN probabilities for all currently-loaded trees.
-  EigenVectorXd CalculateSBNProbabilities();
+  // Calculate SBN probabilities for all currently-loaded trees, splitting the trees
+  // between thread_count threads.
+  EigenVectorXd CalculateSBNProbabilities(size_t thread_count = 1);
+
+  // ** Online SBN training
+  //
+  // These train the SBN with SimpleAverage on trees that arrive in batches, so the
+  // whole collection never needs to be loaded. Between batches we keep only the
+  // counts of the rootsplits and PCSSs over all rootings of the trees seen so far.
+  // UpdateSBNFromOnlineSimpleAverage can be called at any time: it makes the SBN
+  // maps for the support seen so far and sets sbn_parameters_ to the SimpleAverage
+  // estimate, just as ProcessLoadedTrees then TrainSimpleAverage would on all of
+  // these trees at once. The loaded trees are left alone.
+  void ResetOnlineSimpleAverage();
+  void AddToOnlineSimpleAverage(const UnrootedTreeCollection &trees);
+  void UpdateSBNFromOnlineSimpleAverage();
+  // Stream a file through AddToOnlineSimpleAverage in batches of batch_size trees,
+  // then update the SBN. These continue from any trees already added.
+  void TrainOnlineSimpleAverageOnNewickFile(const std::string &fname,
+                                            size_t batch_size);
+  void TrainOnlineSimpleAverageOnNexusFile(const std::string &fname, size_t batch_size);
 
   // Sample a topology from the SBN.
   using SBNInstance::SampleTopology;
   Node::NodePtr SampleTopology() const;
 
-  // Sample trees and store them internally
-  void SampleTrees(size_t count);
+  // Sample trees and store them internally. The trees are sampled in chunks of
+  // sample_chunk_size_, each with its own generator seeded from random_generator_
+  // and the chunk index. The chunks are split between thread_count threads, and
+  // the sample for a given seed doesn't depend on the thread count.
+  void SampleTrees(size_t count, size_t thread_count = 1);
 
   // Get indexer representations of the trees in tree_collection_.
   // See the documentation of IndexerRepresentationOf in sbn_maps.hpp for an
@@ -57,10 +136,30 @@ class UnrootedSBNInstance : public SBNInstance {
   // Get PSP indexer representations of the trees in tree_collection_.
   std::vector<SizeVectorVector> MakePSPIndexerRepresentations() const;
 
+  // The same two, packed into CSRRepresentations. These avoid allocating a vector
+  // for each rooting of each tree, and can be passed to NumPy without copying.
+  CSRRepresentation MakeFlatIndexerRepresentations() const;
+  CSRRepresentation MakeFlatPSPIndexerRepresentations() const;
+
+  // Remember the indexer and PSP indexer representations of up to capacity
+  // topologies, which the functions above and VariationalStep then look up rather
+  // than recompute. This pays off when the same topologies come up step after step,
+  // as they do when sampling from a concentrated SBN. The cache is cleared when the
+  // SBN maps are rebuilt. Zero (the default) turns this off. See
+  // representation_cache.hpp.
+  void SetRepresentationCacheCapacity(size_t capacity);
+  // The cache, or nullptr if it is off.
+  const RepresentationCache *GetRepresentationCache() const {
+    return representation_cache_.get();
+  }
+
   // Return a ragged vector of vectors such that the ith vector is the
   // collection of branch lengths in the current tree collection for the ith
   // split.
   DoubleVectorVector SplitLengths() const;
+  // The same thing packed into one buffer, splitting the trees between thread_count
+  // threads.
+  FlatSplitLengths MakeFlatSplitLengths(size_t thread_count = 1) const;
 
   // Turn an IndexerRepresentation into a string representation of the underying
   // bitsets. This is really just so that we can make a test of indexer
@@ -78,10 +177,114 @@ class UnrootedSBNInstance : public SBNInstance {
 
   // For each loaded tree, returns a pair of (likelihood, gradient).
   std::vector<UnrootedTreeGradient> Gradients();
+  // These write into caller-provided storage; see the corresponding Engine methods.
+  void LogLikelihoods(EigenVectorXdRef log_likelihoods);
+  void BranchGradients(EigenVectorXdRef log_likelihoods,
+                       EigenMatrixXdRef branch_gradients);
+  // BranchGradients, also writing the second derivatives of the log likelihoods with
+  // respect to the branch lengths into branch_hessian_diagonals, which is laid out
+  // like branch_gradients. This uses the engine of this process.
+  void BranchGradientsAndHessianDiagonals(EigenVectorXdRef log_likelihoods,
+                                          EigenMatrixXdRef branch_gradients,
+                                          EigenMatrixXdRef branch_hessian_diagonals);
+  // BranchGradients along only the branches above the nodes of edge_ids; see
+  // Engine::SubsetBranchGradients. This uses the engine of this process.
+  void SubsetBranchGradients(const SizeVector &edge_ids,
+                             EigenVectorXdRef log_likelihoods,
+                             EigenMatrixXdRef branch_gradients);
+  // The log likelihood of the tree_number-th tree, computed incrementally from the
+  // last call; see Engine::IncrementalLogLikelihood. After editing the branch lengths
+  // or topology of a tree, call this again to recompute only what the edit changed.
+  // This uses the engine of this process.
+  double IncrementalLogLikelihood(size_t tree_number);
+  // The log likelihood or gradient of a tree, which needn't be one of ours, with
+  // these phylogenetic model parameters, computed on the calling thread; see
+  // Engine::LogLikelihood. These leave the perf stats alone so that several threads
+  // can call them at once. This uses the engine of this process.
+  double LogLikelihoodOf(const UnrootedTree &tree,
+                         EigenVectorXd phylo_model_params) const;
+  UnrootedTreeGradient GradientOf(const UnrootedTree &tree,
+                                  EigenVectorXd phylo_model_params) const;
+#ifdef LIBSBN_MPI
+  // Prepare as PrepareForPhyloLikelihood does, then share the trees of the four
+  // methods above between this process, which has to be of rank 0, and the other
+  // processes of MPI_COMM_WORLD, which should be in MPIEngine::ServeWorker. See
+  // mpi_engine.hpp. The methods below still compute on this process alone.
+  void PrepareForDistributedPhyloLikelihood(
+      const PhyloModelSpecification &model_specification, size_t thread_count,
+      const std::vector<BeagleFlags> &beagle_flag_vector = {},
+      const bool use_tip_states = true,
+      std::optional<size_t> tree_count_option = std::nullopt);
+#endif
+  // Instead of making an engine, hand the four methods above to worker processes that
+  // call SharedMemoryEngine::ServeWorker with this shared memory name, taking batches
+  // of up to as many trees as we have now, or tree_count_option. See
+  // shared_memory_engine.hpp. As for MPI, the methods below need a local engine.
+  void PrepareForSharedMemoryPhyloLikelihood(
+      const PhyloModelSpecification &model_specification, const std::string &name,
+      std::optional<size_t> tree_count_option = std::nullopt);
+  // Wait until at least worker_count workers serve our SharedMemoryEngine.
+  void WaitForSharedMemoryWorkers(size_t worker_count) const;
+  // Start computing log likelihoods or gradients on another thread, returning a
+  // future for the result. We take a copy of the trees and the phylogenetic model
+  // parameters, so these can be changed while the computation runs. Don't prepare a
+  // new engine while there are computations pending.
+  std::shared_future<std::vector<double>> SubmitLogLikelihoods() const;
+  std::shared_future<std::vector<UnrootedTreeGradient>> SubmitGradients() const;
+  // Score the trees of a Newick or Nexus file without loading them all, in a
+  // pipeline of three stages: a reader thread parses batches of batch_size trees with
+  // a TreeFileStream (which drops the burn-in and thins as it goes), this thread
+  // computes their log likelihoods, and gradients if asked, on the engine, and a
+  // writer thread hands the scores of each batch to callback in file order. The
+  // stages are connected by BoundedQueues of queue_capacity batches, so parsing,
+  // likelihood computation and output overlap, and only a few batches are in memory
+  // at once. The trees need the taxa of the loaded trees, for which the engine was
+  // prepared, and they all use the first row of the phylogenetic model parameters.
+  // This uses the engine of this process. We return the number of trees scored.
+  using TreeScoreCallback = std::function<void(const TreeScoreBatch &)>;
+  size_t ScoreTreeFile(const std::string &fname, bool is_nexus, size_t batch_size,
+                       const TreeScoreCallback &callback, bool gradients = false,
+                       double burn_in_fraction = 0., size_t thinning = 1,
+                       size_t queue_capacity = 2);
+  // ScoreTreeFile, writing a line per tree to out_path: the index of the tree and its
+  // log likelihood, then its branch length gradient if we compute gradients, all
+  // separated by tabs.
+  size_t ScoreTreeFileToPath(const std::string &fname, bool is_nexus,
+                             size_t batch_size, const std::string &out_path,
+                             bool gradients = false, double burn_in_fraction = 0.,
+                             size_t thinning = 1, size_t queue_capacity = 2);
   // Topology gradient for unrooted trees.
   // Assumption: This function is called from Python side
   // after the trees (both the topology and the branch lengths) are sampled.
-  EigenVectorXd TopologyGradients(const EigenVectorXdRef log_f, bool use_vimco = true);
+  // The trees are split between thread_count threads.
+  EigenVectorXd TopologyGradients(const EigenVectorXdRef log_f, bool use_vimco = true,
+                                  size_t thread_count = 1);
+  // ** Variational inference
+
+  // One stochastic gradient step of vip/burrito.py with the split-based LogNormal
+  // branch length model and an Exponential(prior_rate) branch length prior, without
+  // going back to Python in between. We sample particle_count trees from the SBN,
+  // draw their branch lengths from LogNormal(mu, sigma), where row i of
+  // lognormal_params holds the (mu, sigma) of the ith split, and compute the log
+  // likelihoods and branch gradients with the engine. From these we get the ELBO
+  // estimate, the reparameterization gradient of the LogNormal parameters, and the
+  // topology gradient of TopologyGradients. As in Burrito.gradient_step, the
+  // annealing factor beta only multiplies the log likelihood in log f. The sampled
+  // trees stay in tree_collection_.
+  VariationalStepResult VariationalStep(size_t particle_count,
+                                        EigenConstMatrixXdRef lognormal_params,
+                                        double beta = 1., bool use_vimco = true,
+                                        double prior_rate = 10.,
+                                        size_t thread_count = 1);
+  // Importance sampling estimates of the log marginal likelihood and of the ELBO,
+  // with particle_count particles drawn from the SBN and the branch length model of
+  // VariationalStep, with the Exponential(prior_rate) prior. The particles go through
+  // tree_collection_ batch_size at a time, so that we only hold one batch of trees
+  // and a few running sums; the last batch stays in tree_collection_.
+  MarginalLikelihoodEstimate EstimateMarginalLikelihood(
+      size_t particle_count, EigenConstMatrixXdRef lognormal_params,
+      size_t batch_size = 1000, double prior_rate = 10., size_t thread_count = 1);
+
   // Computes gradient WRT \phi of log q_{\phi}(\tau).
   // IndexerRepresentation contains all rootings of \tau.
   // normalized_sbn_parameters_in_log is a cache; see implementation of
@@ -90,17 +293,59 @@ class UnrootedSBNInstance : public SBNInstance {
   EigenVectorXd GradientOfLogQ(
       EigenVectorXdRef normalized_sbn_parameters_in_log,
       const UnrootedIndexerRepresentation &indexer_representation);
+  // The same, for the tree_idx-th tree of a CSRRepresentation.
+  EigenVectorXd GradientOfLogQ(EigenVectorXdRef normalized_sbn_parameters_in_log,
+                               const CSRRepresentation &indexer_representations,
+                               size_t tree_idx);
 
   // ** I/O
 
-  void ReadNewickFile(std::string fname);
-  void ReadNexusFile(std::string fname);
+  // With more than one thread, see Driver::ParseNewickFile. With use_cache, we keep
+  // the parsed trees in a sidecar file and read them from it when it is newer than
+  // fname. See tree_collection_cache.hpp.
+  void ReadNewickFile(std::string fname, size_t thread_count = 1,
+                      bool use_cache = false);
+  void ReadNexusFile(std::string fname, size_t thread_count = 1,
+                     bool use_cache = false);
 
  protected:
-  void PushBackRangeForParentIfAvailable(
-      const Bitset &parent, UnrootedSBNInstance::RangeVector &range_vector);
-  RangeVector GetSubsplitRanges(
-      const RootedIndexerRepresentation &rooted_representation);
+  static constexpr size_t sample_chunk_size_ = 256;
+
+  // The state of the online SimpleAverage.
+  BitsetSizeDict online_rootsplit_counts_ = BitsetSizeDict(0);
+  PCSSDict online_pcss_counts_;
+  StringVector online_taxon_names_;
+
+  // Mutable so that the const representation functions can fill it.
+  mutable std::unique_ptr<RepresentationCache> representation_cache_;
+
+  void ClearTreeCollectionAssociatedState() override;
+
+  // This takes a range of RootedIndexerRepresentations or CSRRepresentation::Rows
+  // for the rootings.
+  template <typename RootedRepresentations>
+  EigenVectorXd GradientOfLogQOfRootings(
+      EigenVectorXdRef normalized_sbn_parameters_in_log,
+      const RootedRepresentations &rooted_representations);
+
+ private:
+  // Check that lognormal_params has a (mu, sigma) row for each split.
+  void AssertLogNormalParams(EigenConstMatrixXdRef lognormal_params,
+                             const std::string &context) const;
+  // Draw the branch lengths of the trees of tree_collection_ from the LogNormal model
+  // of VariationalStep, setting the standard normal draw and the split of each branch.
+  // Returns log prior - log q of the branch lengths of each tree.
+  EigenVectorXd SampleLogNormalBranchLengths(EigenConstMatrixXdRef lognormal_params,
+                                             double prior_rate, EigenMatrixXd &epsilons,
+                                             std::vector<SizeVector> &branch_to_split);
+  // The representations of a topology, from representation_cache_ if it is on.
+  UnrootedIndexerRepresentation IndexerRepresentationOf(
+      const Node::NodePtr &topology) const;
+  SizeVectorVector PSPIndexerRepresentationOf(const Node::NodePtr &topology) const;
+  // Find the representations of a topology in representation_cache_, or make and
+  // insert them. The cache must be on.
+  RepresentationCache::RepresentationsPtr CachedRepresentationsOf(
+      const Node::NodePtr &topology) const;
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
@@ -222,6 +467,98 @@ TEST_CASE("UnrootedSBNInstance: indexer and PSP representations") {
       correct_rooted_indexer_representation_2);
 }
 
+TEST_CASE("UnrootedSBNInstance: flat representations") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  const auto indexer_representations = inst.MakeIndexerRepresentations();
+  const auto psp_indexer_representations = inst.MakePSPIndexerRepresentations();
+  const auto flat_indexer_representations = inst.MakeFlatIndexerRepresentations();
+  const auto flat_psp_indexer_representations =
+      inst.MakeFlatPSPIndexerRepresentations();
+  CHECK_EQ(flat_indexer_representations.TreeCount(), inst.TreeCount());
+  CHECK_EQ(flat_psp_indexer_representations.TreeCount(), inst.TreeCount());
+  EigenVectorXd normalized_sbn_parameters_in_log(inst.sbn_parameters_.size());
+  for (size_t tree_idx = 0; tree_idx < inst.TreeCount(); tree_idx++) {
+    CHECK_EQ(flat_indexer_representations.VectorsOf(tree_idx),
+             indexer_representations[tree_idx]);
+    CHECK_EQ(flat_psp_indexer_representations.VectorsOf(tree_idx),
+             psp_indexer_representations[tree_idx]);
+    normalized_sbn_parameters_in_log.setConstant(DOUBLE_NAN);
+    const EigenVectorXd grad_log_q = inst.GradientOfLogQ(
+        normalized_sbn_parameters_in_log, indexer_representations[tree_idx]);
+    normalized_sbn_parameters_in_log.setConstant(DOUBLE_NAN);
+    CheckVectorXdEquality(
+        inst.GradientOfLogQ(normalized_sbn_parameters_in_log,
+                            flat_indexer_representations, tree_idx),
+        grad_log_q, 1e-12);
+  }
+  // The flat version sums the PCSSs of a rooting in another order, so we compare
+  // probabilities rather than the huge numbers that unnormalized parameters give.
+  inst.NormalizeSBNParametersInLog(inst.sbn_parameters_);
+  const EigenVectorXd flat_probabilities =
+      SBNProbability::ProbabilityOf(inst.sbn_parameters_, flat_indexer_representations);
+  CheckVectorXdEquality(
+      flat_probabilities,
+      SBNProbability::ProbabilityOf(inst.sbn_parameters_, indexer_representations),
+      1e-12);
+  // Splitting the trees between threads doesn't change anything.
+  CHECK((SBNProbability::ProbabilityOf(inst.sbn_parameters_,
+                                       flat_indexer_representations, 3)
+             .array() == flat_probabilities.array())
+            .all());
+  // Rootings with a PCSS outside of the support have probability zero.
+  const size_t out_of_support = inst.sbn_parameters_.size();
+  auto with_out_of_support = indexer_representations[0];
+  for (size_t rooting_idx = 1; rooting_idx < with_out_of_support.size();
+       rooting_idx++) {
+    with_out_of_support[rooting_idx].back() = out_of_support;
+  }
+  CSRRepresentation partly_out_of_support;
+  partly_out_of_support.PushBack(with_out_of_support);
+  CHECK_EQ(
+      SBNProbability::ProbabilityOf(inst.sbn_parameters_, partly_out_of_support)[0],
+      doctest::Approx(
+          SBNProbability::ProbabilityOf(inst.sbn_parameters_, with_out_of_support)));
+}
+
+TEST_CASE("UnrootedSBNInstance: split lengths") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ProcessLoadedTrees();
+  for (const auto &tree : inst.tree_collection_.trees_) {
+    CHECK_EQ(inst.psp_indexer_.SplitIndicesOf(tree.Topology()),
+             inst.psp_indexer_.RepresentationOf(tree.Topology())[0]);
+  }
+  const auto split_lengths = inst.SplitLengths();
+  for (size_t thread_count : {1, 3, 20}) {
+    const auto flat_split_lengths = inst.MakeFlatSplitLengths(thread_count);
+    REQUIRE_EQ(flat_split_lengths.offsets_.size(), split_lengths.size() + 1);
+    for (size_t split_idx = 0; split_idx < split_lengths.size(); split_idx++) {
+      const auto begin =
+          flat_split_lengths.lengths_.begin() + flat_split_lengths.offsets_[split_idx];
+      const auto end = flat_split_lengths.lengths_.begin() +
+                       flat_split_lengths.offsets_[split_idx + 1];
+      CHECK_EQ(std::vector<double>(begin, end), split_lengths[split_idx]);
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: multithreaded subsplit support") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  const auto pretty_indexer = inst.PrettyIndexer();
+  const auto [indexer, parent_to_range] = inst.GetIndexers();
+  // The indexing should not depend on the number of threads.
+  for (size_t thread_count : {2, 3, 8}) {
+    inst.ProcessLoadedTrees(thread_count);
+    CHECK_EQ(inst.PrettyIndexer(), pretty_indexer);
+    CHECK_EQ(inst.GetIndexers(), std::make_tuple(indexer, parent_to_range));
+  }
+}
+
 TEST_CASE("UnrootedSBNInstance: likelihood and gradient") {
   UnrootedSBNInstance inst("charlie");
   inst.ReadNewickFile("data/hello.nwk");
@@ -334,6 +671,824 @@ TEST_CASE("UnrootedSBNInstance: likelihood and gradient with Weibull") {
   }
 }
 
+TEST_CASE("UnrootedSBNInstance: per-tree phylo model parameters") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"GTR", "weibull+4", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  auto param_block_map = inst.GetPhyloModelParamBlockMap();
+  auto set_parameters = [&param_block_map](size_t row, double shape, double rate) {
+    param_block_map.at(WeibullSiteModel::shape_key_).row(row).setConstant(shape);
+    // Changing the transition rate changes the GTR Q matrix.
+    param_block_map.at(GTRModel::rates_key_).row(row) << 1., rate, 1., 1., rate, 1.;
+    param_block_map.at(GTRModel::frequencies_key_).row(row).setConstant(0.25);
+  };
+  const size_t tree_count = inst.TreeCount();
+  // Evaluate all of the trees under each of two models.
+  std::vector<std::vector<double>> uniform_likelihoods;
+  for (const auto& [shape, rate] : {std::make_pair(0.1, 1.), std::make_pair(0.5, 2.)}) {
+    for (size_t row = 0; row < tree_count; row++) {
+      set_parameters(row, shape, rate);
+    }
+    uniform_likelihoods.push_back(inst.LogLikelihoods());
+  }
+  // Now mix the two models across trees. Each FatBeagle has to notice every change
+  // of parameters from one tree to the next.
+  for (size_t row = 0; row < tree_count; row++) {
+    set_parameters(row, 0.1, 1.);
+  }
+  for (size_t row = 1; row < tree_count; row += 3) {
+    set_parameters(row, 0.5, 2.);
+  }
+  auto mixed_likelihoods = inst.LogLikelihoods();
+  for (size_t row = 0; row < tree_count; row++) {
+    const size_t model_idx = (row % 3 == 1) ? 1 : 0;
+    CHECK_LT(fabs(mixed_likelihoods[row] - uniform_likelihoods[model_idx][row]), 1e-8);
+  }
+  CHECK_GT(fabs(uniform_likelihoods[0][0] - uniform_likelihoods[1][0]), 1.);
+}
+
+TEST_CASE("UnrootedSBNInstance: partial cache") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "weibull+4", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  // Give all of the trees the same branch lengths so that they share subtrees.
+  for (auto& tree : inst.tree_collection_.trees_) {
+    std::fill(tree.branch_lengths_.begin(), tree.branch_lengths_.end(), 0.1);
+  }
+  auto set_shape = [&inst](double shape) {
+    auto param_block_map = inst.GetPhyloModelParamBlockMap();
+    param_block_map.at(WeibullSiteModel::shape_key_).setConstant(shape);
+  };
+  auto check_likelihoods_equal = [](const std::vector<double>& v1,
+                                    const std::vector<double>& v2) {
+    REQUIRE_EQ(v1.size(), v2.size());
+    for (size_t i = 0; i < v1.size(); i++) {
+      CHECK_LT(fabs(v1[i] - v2[i]), 1e-8);
+    }
+  };
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  set_shape(0.1);
+  const auto uncached_likelihoods = inst.LogLikelihoods();
+  set_shape(0.5);
+  const auto uncached_likelihoods_other_shape = inst.LogLikelihoods();
+  // A small cache, so that it has to be cleared along the way.
+  for (const size_t capacity : {30, 1000}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, capacity);
+    set_shape(0.1);
+    check_likelihoods_equal(inst.LogLikelihoods(), uncached_likelihoods);
+    // The second time around everything comes from the cache.
+    check_likelihoods_equal(inst.LogLikelihoods(), uncached_likelihoods);
+    // Changing the model parameters has to invalidate the cache.
+    set_shape(0.5);
+    check_likelihoods_equal(inst.LogLikelihoods(), uncached_likelihoods_other_shape);
+  }
+  // Changing a branch length only changes the likelihood of that tree.
+  inst.tree_collection_.trees_[0].branch_lengths_[0] = 0.2;
+  const auto cached_likelihoods = inst.LogLikelihoods();
+  CHECK_GT(fabs(cached_likelihoods[0] - uncached_likelihoods_other_shape[0]), 1e-6);
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  set_shape(0.5);
+  check_likelihoods_equal(cached_likelihoods, inst.LogLikelihoods());
+}
+
+TEST_CASE("UnrootedSBNInstance: batched likelihoods") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "weibull+4", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto set_shapes = [&inst]() {
+    auto param_block_map = inst.GetPhyloModelParamBlockMap();
+    auto shapes = param_block_map.at(WeibullSiteModel::shape_key_);
+    shapes.setConstant(0.1);
+    // Break batches up into runs of trees with the same parameters.
+    for (size_t row = 1; row < inst.TreeCount(); row += 3) {
+      shapes.row(row).setConstant(0.5);
+    }
+  };
+  auto check_likelihoods_equal = [](const std::vector<double>& v1,
+                                    const std::vector<double>& v2) {
+    REQUIRE_EQ(v1.size(), v2.size());
+    for (size_t i = 0; i < v1.size(); i++) {
+      CHECK_LT(fabs(v1[i] - v2[i]), 1e-8);
+    }
+  };
+  for (const auto rescaling : {false, true}) {
+    inst.SetRescaling(rescaling);
+    for (const auto tip_state_option : {false, true}) {
+      inst.PrepareForPhyloLikelihood(specification, 2, {}, tip_state_option);
+      set_shapes();
+      const auto unbatched_likelihoods = inst.LogLikelihoods();
+      // The 10 trees don't fill the last batch of 3 or 4.
+      for (const size_t batch_size : {3, 4, 20}) {
+        inst.PrepareForPhyloLikelihood(specification, 2, {}, tip_state_option,
+                                       std::nullopt, 0, batch_size);
+        set_shapes();
+        check_likelihoods_equal(inst.LogLikelihoods(), unbatched_likelihoods);
+      }
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: site pattern sharding") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto likelihoods = inst.LogLikelihoods();
+  const auto gradients = inst.Gradients();
+  for (const size_t tree_batch_size : {1, 4}) {
+    inst.PrepareForPhyloLikelihood(specification, 3, {}, true, std::nullopt, 0,
+                                   tree_batch_size, true);
+    const auto sharded_likelihoods = inst.LogLikelihoods();
+    const auto sharded_gradients = inst.Gradients();
+    REQUIRE_EQ(sharded_likelihoods.size(), likelihoods.size());
+    for (size_t tree_number = 0; tree_number < likelihoods.size(); tree_number++) {
+      CHECK_LT(fabs(sharded_likelihoods[tree_number] - likelihoods[tree_number]), 1e-8);
+      const auto& gradient = gradients[tree_number];
+      const auto& sharded_gradient = sharded_gradients[tree_number];
+      CHECK_LT(fabs(sharded_gradient.log_likelihood_ - gradient.log_likelihood_), 1e-8);
+      const auto& branch_gradient = gradient.branch_lengths_;
+      const auto& sharded_branch_gradient = sharded_gradient.branch_lengths_;
+      for (size_t i = 0; i < branch_gradient.size(); i++) {
+        CHECK_LT(fabs(sharded_branch_gradient[i] - branch_gradient[i]), 1e-8);
+      }
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: in-place likelihoods and branch gradients") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  const size_t tree_count = inst.TreeCount();
+  const size_t node_count = 2 * inst.TaxonCount() - 1;
+  for (const auto shard_site_patterns : {false, true}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1,
+                                   shard_site_patterns);
+    const auto likelihoods = inst.LogLikelihoods();
+    const auto gradients = inst.Gradients();
+    EigenVectorXd log_likelihoods(tree_count);
+    inst.LogLikelihoods(log_likelihoods);
+    EigenVectorXd gradient_log_likelihoods(tree_count);
+    EigenMatrixXd branch_gradients(tree_count, node_count);
+    inst.BranchGradients(gradient_log_likelihoods, branch_gradients);
+    for (size_t tree_number = 0; tree_number < tree_count; tree_number++) {
+      CHECK_LT(fabs(log_likelihoods(tree_number) - likelihoods[tree_number]), 1e-8);
+      CHECK_LT(fabs(gradient_log_likelihoods(tree_number) - likelihoods[tree_number]),
+               1e-8);
+      for (size_t node_id = 0; node_id < node_count; node_id++) {
+        CHECK_LT(fabs(branch_gradients(tree_number, node_id) -
+                      gradients[tree_number].branch_lengths_[node_id]),
+                 1e-8);
+      }
+    }
+    // The output needs the right shape.
+    EigenMatrixXd too_narrow(tree_count, node_count - 1);
+    CHECK_THROWS(inst.BranchGradients(gradient_log_likelihoods, too_narrow));
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: branch Hessian diagonals") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "weibull+4", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  const size_t tree_count = inst.TreeCount();
+  const size_t node_count = 2 * inst.TaxonCount() - 1;
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  inst.GetPhyloModelParamBlockMap().at(WeibullSiteModel::shape_key_).setConstant(0.5);
+  EigenVectorXd log_likelihoods(tree_count);
+  EigenMatrixXd branch_gradients(tree_count, node_count);
+  EigenMatrixXd hessian_diagonals(tree_count, node_count);
+  inst.BranchGradientsAndHessianDiagonals(log_likelihoods, branch_gradients,
+                                          hessian_diagonals);
+  EigenVectorXd plain_log_likelihoods(tree_count);
+  EigenMatrixXd plain_branch_gradients(tree_count, node_count);
+  inst.BranchGradients(plain_log_likelihoods, plain_branch_gradients);
+  CHECK_LT((log_likelihoods - plain_log_likelihoods).norm(), 1e-8);
+  CHECK_LT((branch_gradients - plain_branch_gradients).norm(), 1e-8);
+  // Compare to central differences of the branch gradients.
+  const double step = 1e-5;
+  EigenMatrixXd gradients_above(tree_count, node_count);
+  EigenMatrixXd gradients_below(tree_count, node_count);
+  for (size_t node_id = 0; node_id < node_count; node_id++) {
+    for (auto& tree : inst.tree_collection_.trees_) {
+      tree.branch_lengths_[node_id] += step;
+    }
+    inst.BranchGradients(plain_log_likelihoods, gradients_above);
+    for (auto& tree : inst.tree_collection_.trees_) {
+      tree.branch_lengths_[node_id] -= 2. * step;
+    }
+    inst.BranchGradients(plain_log_likelihoods, gradients_below);
+    for (auto& tree : inst.tree_collection_.trees_) {
+      tree.branch_lengths_[node_id] += step;
+    }
+    for (size_t tree_number = 0; tree_number < tree_count; tree_number++) {
+      const double finite_difference = (gradients_above(tree_number, node_id) -
+                                        gradients_below(tree_number, node_id)) /
+                                       (2. * step);
+      CHECK_LT(fabs(hessian_diagonals(tree_number, node_id) - finite_difference),
+               1e-3 * std::max(1., fabs(finite_difference)));
+    }
+  }
+  // Splitting the site patterns between threads gives the same answers.
+  inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1, true);
+  inst.GetPhyloModelParamBlockMap().at(WeibullSiteModel::shape_key_).setConstant(0.5);
+  EigenMatrixXd sharded_hessian_diagonals(tree_count, node_count);
+  inst.BranchGradientsAndHessianDiagonals(log_likelihoods, branch_gradients,
+                                          sharded_hessian_diagonals);
+  CHECK_LT((sharded_hessian_diagonals - hessian_diagonals).norm(), 1e-6);
+  EigenMatrixXd too_narrow(tree_count, node_count - 1);
+  CHECK_THROWS(inst.BranchGradientsAndHessianDiagonals(log_likelihoods,
+                                                       branch_gradients, too_narrow));
+}
+
+TEST_CASE("UnrootedSBNInstance: subset branch gradients") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  const size_t tree_count = inst.TreeCount();
+  const size_t node_count = 2 * inst.TaxonCount() - 1;
+  for (const auto shard_site_patterns : {false, true}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1,
+                                   shard_site_patterns);
+    EigenVectorXd log_likelihoods(tree_count);
+    EigenMatrixXd branch_gradients(tree_count, node_count);
+    inst.BranchGradients(log_likelihoods, branch_gradients);
+    const SizeVector edge_ids({0, 7, node_count - 3});
+    EigenVectorXd subset_log_likelihoods(tree_count);
+    EigenMatrixXd subset_branch_gradients(tree_count, node_count);
+    inst.SubsetBranchGradients(edge_ids, subset_log_likelihoods,
+                               subset_branch_gradients);
+    CHECK_LT((subset_log_likelihoods - log_likelihoods).norm(), 1e-8);
+    for (size_t tree_number = 0; tree_number < tree_count; tree_number++) {
+      for (size_t node_id = 0; node_id < node_count; node_id++) {
+        const bool in_subset =
+            std::find(edge_ids.begin(), edge_ids.end(), node_id) != edge_ids.end();
+        CHECK_LT(fabs(subset_branch_gradients(tree_number, node_id) -
+                      (in_subset ? branch_gradients(tree_number, node_id) : 0.)),
+                 1e-8);
+      }
+    }
+    // The root has no branch.
+    CHECK_THROWS(inst.SubsetBranchGradients({node_count - 1}, subset_log_likelihoods,
+                                            subset_branch_gradients));
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: submitting likelihoods and gradients") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto likelihoods = inst.LogLikelihoods();
+  const auto gradients = inst.Gradients();
+  auto likelihoods_future = inst.SubmitLogLikelihoods();
+  auto gradients_future = inst.SubmitGradients();
+  // The submitted computations work on copies of the trees.
+  for (auto& tree : inst.tree_collection_.trees_) {
+    std::fill(tree.branch_lengths_.begin(), tree.branch_lengths_.end(), 0.5);
+  }
+  const auto submitted_likelihoods = likelihoods_future.get();
+  const auto submitted_gradients = gradients_future.get();
+  REQUIRE_EQ(submitted_likelihoods.size(), likelihoods.size());
+  REQUIRE_EQ(submitted_gradients.size(), gradients.size());
+  for (size_t tree_number = 0; tree_number < likelihoods.size(); tree_number++) {
+    CHECK_EQ(submitted_likelihoods[tree_number], likelihoods[tree_number]);
+    CHECK_EQ(submitted_gradients[tree_number].branch_lengths_,
+             gradients[tree_number].branch_lengths_);
+  }
+  CHECK_NE(inst.LogLikelihoods()[0], likelihoods[0]);
+}
+
+TEST_CASE("UnrootedSBNInstance: auto-tuning") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  const auto timings = inst.AutoTunePhyloLikelihood(specification, 2, std::nullopt, 3);
+  REQUIRE_FALSE(timings.empty());
+  for (size_t i = 1; i < timings.size(); i++) {
+    CHECK_LE(timings[i - 1].seconds_per_evaluation_,
+             timings[i].seconds_per_evaluation_);
+  }
+  // Whatever configuration won, the likelihoods are the same.
+  const auto tuned_likelihoods = inst.LogLikelihoods();
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto likelihoods = inst.LogLikelihoods();
+  REQUIRE_EQ(tuned_likelihoods.size(), likelihoods.size());
+  for (size_t tree_number = 0; tree_number < likelihoods.size(); tree_number++) {
+    CHECK_LT(fabs(tuned_likelihoods[tree_number] - likelihoods[tree_number]), 1e-8);
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: operation schedule cache") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto compute = [&inst]() {
+    std::vector<double> results = inst.LogLikelihoods();
+    for (const auto& gradient : inst.Gradients()) {
+      results.insert(results.end(), gradient.branch_lengths_.begin(),
+                     gradient.branch_lengths_.end());
+    }
+    return results;
+  };
+  auto check_results_equal = [](const std::vector<double>& v1,
+                                const std::vector<double>& v2) {
+    REQUIRE_EQ(v1.size(), v2.size());
+    for (size_t i = 0; i < v1.size(); i++) {
+      CHECK_LT(fabs(v1[i] - v2[i]), 1e-8);
+    }
+  };
+  for (const bool rescaling : {false, true}) {
+    inst.SetRescaling(rescaling);
+    inst.PrepareForPhyloLikelihood(specification, 2);
+    const auto expected = compute();
+    // A small capacity, so that schedules get evicted along the way.
+    for (const size_t capacity : {2, 100}) {
+      inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1,
+                                     false, capacity);
+      check_results_equal(compute(), expected);
+      // The second time around the schedules come from the cache.
+      check_results_equal(compute(), expected);
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: host transition matrices") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"GTR", "weibull+4", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto set_parameters = [&inst]() {
+    auto param_block_map = inst.GetPhyloModelParamBlockMap();
+    param_block_map.at(WeibullSiteModel::shape_key_).setConstant(0.5);
+    for (size_t row = 0; row < inst.TreeCount(); row++) {
+      param_block_map.at(GTRModel::rates_key_).row(row) << 0.5, 2., 1., 1., 2., 0.5;
+      param_block_map.at(GTRModel::frequencies_key_).row(row) << 0.3, 0.2, 0.2, 0.3;
+    }
+  };
+  auto compute = [&inst]() {
+    std::vector<double> results = inst.LogLikelihoods();
+    for (const auto& gradient : inst.Gradients()) {
+      results.insert(results.end(), gradient.branch_lengths_.begin(),
+                     gradient.branch_lengths_.end());
+    }
+    return results;
+  };
+  for (const auto tip_state_option : {false, true}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, tip_state_option);
+    set_parameters();
+    const auto expected = compute();
+    // Batches of trees share one upload of their matrices.
+    for (const size_t batch_size : {1, 4}) {
+      inst.PrepareForPhyloLikelihood(specification, 2, {}, tip_state_option,
+                                     std::nullopt, 0, batch_size, false, 0,
+                                     SitePatternOrder::FirstAppearance, true);
+      set_parameters();
+      const auto results = compute();
+      REQUIRE_EQ(results.size(), expected.size());
+      for (size_t i = 0; i < results.size(); i++) {
+        CHECK_LT(fabs(results[i] - expected[i]), 1e-8);
+      }
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: thread pinning") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto compute = [&inst]() {
+    std::vector<double> results = inst.LogLikelihoods();
+    for (const auto& gradient : inst.Gradients()) {
+      results.insert(results.end(), gradient.branch_lengths_.begin(),
+                     gradient.branch_lengths_.end());
+    }
+    return results;
+  };
+  inst.PrepareForPhyloLikelihood(specification, 3);
+  const auto expected = compute();
+  for (const auto thread_pinning : {ThreadPinning::Core, ThreadPinning::NumaNode}) {
+    inst.PrepareForPhyloLikelihood(specification, 3, {}, true, std::nullopt, 0, 1,
+                                   false, 0, SitePatternOrder::FirstAppearance, false,
+                                   thread_pinning);
+    CHECK_EQ(compute(), expected);
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: memory budget") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  // Make an engine with a budget of memory_budget bytes and check that its memory is
+  // as estimated for these arguments.
+  auto check_prepare = [&inst, &specification](size_t memory_budget,
+                                               size_t thread_count, bool use_tip_states,
+                                               bool shard_site_patterns = false) {
+    const auto byte_counts = inst.EstimatePhyloLikelihoodByteCounts(
+        specification, thread_count, {}, use_tip_states, std::nullopt, 0, 1,
+        shard_site_patterns);
+    inst.PrepareForPhyloLikelihood(specification, 3, {}, false, std::nullopt, 0, 1,
+                                   shard_site_patterns, 0,
+                                   SitePatternOrder::FirstAppearance, false,
+                                   ThreadPinning::None, memory_budget);
+    const auto memory_byte_counts = inst.MemoryByteCounts();
+    CHECK_EQ(memory_byte_counts.at("beagle_buffers"), byte_counts.at("beagle_buffers"));
+    CHECK_EQ(memory_byte_counts.at("phylo_model_params"),
+             byte_counts.at("phylo_model_params"));
+  };
+  const auto total = [&inst, &specification](size_t thread_count, bool use_tip_states) {
+    return MemoryBudget::TotalByteCount(inst.EstimatePhyloLikelihoodByteCounts(
+        specification, thread_count, {}, use_tip_states));
+  };
+  CHECK_LT(total(3, true), total(3, false));
+  CHECK_LT(total(2, true), total(3, true));
+  // If it fits we change nothing, and otherwise we switch to tip states and then
+  // drop threads.
+  check_prepare(total(3, false), 3, false);
+  check_prepare(total(3, false) - 1, 3, true);
+  check_prepare(total(3, true) - 1, 2, true);
+  check_prepare(total(1, true), 1, true);
+  check_prepare(std::numeric_limits<size_t>::max(), 3, false, true);
+  // Even one thread in single precision doesn't fit in nothing.
+  CHECK_THROWS(inst.PrepareForPhyloLikelihood(
+      specification, 3, {}, false, std::nullopt, 0, 1, false, 0,
+      SitePatternOrder::FirstAppearance, false, ThreadPinning::None, 0));
+}
+
+TEST_CASE("UnrootedSBNInstance: engine reuse") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification jc_specification{"JC69", "constant", "strict"};
+  PhyloModelSpecification gtr_specification{"GTR", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto engine_count = [&inst]() {
+    return inst.GetPerfStats().GetPhaseCounter(PerfStats::MakingEngines).call_count_;
+  };
+  inst.PrepareForPhyloLikelihood(gtr_specification, 2);
+  inst.GetPhyloModelParamBlockMap().at(GTRModel::rates_key_).setConstant(1.);
+  inst.GetPhyloModelParamBlockMap().at(GTRModel::frequencies_key_).setConstant(0.25);
+  const auto gtr_likelihoods = inst.LogLikelihoods();
+  const auto gtr_parameter_count = inst.GetPhyloModelParams().cols();
+  CHECK_EQ(engine_count(), 1);
+  // Changing the tree count or the model keeps the engine.
+  inst.PrepareForPhyloLikelihood(jc_specification, 2, {}, true, 3);
+  CHECK_EQ(engine_count(), 1);
+  CHECK_EQ(inst.GetPhyloModelParams().rows(), 3);
+  CHECK_EQ(inst.GetPhyloModelParams().cols(), gtr_parameter_count - 10);
+  inst.PrepareForPhyloLikelihood(jc_specification, 2);
+  CHECK_EQ(engine_count(), 1);
+  // GTR with equal rates and frequencies is JC69.
+  const auto jc_likelihoods = inst.LogLikelihoods();
+  for (size_t tree_idx = 0; tree_idx < jc_likelihoods.size(); tree_idx++) {
+    CHECK_LT(fabs(jc_likelihoods[tree_idx] - gtr_likelihoods[tree_idx]), 1e-6);
+  }
+  // Anything else makes a new engine.
+  inst.PrepareForPhyloLikelihood(jc_specification, 3);
+  CHECK_EQ(engine_count(), 2);
+  inst.PrepareForPhyloLikelihood(jc_specification, 3, {}, false);
+  CHECK_EQ(engine_count(), 3);
+  inst.PrepareForPhyloLikelihood({"JC69", "weibull+4", "strict"}, 3, {}, false);
+  CHECK_EQ(engine_count(), 4);
+  CHECK_EQ(inst.LogLikelihoods().size(), jc_likelihoods.size());
+}
+
+TEST_CASE("UnrootedSBNInstance: adaptive rescaling") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto compute = [&inst]() {
+    std::vector<double> results = inst.LogLikelihoods();
+    for (const auto& gradient : inst.Gradients()) {
+      results.push_back(gradient.log_likelihood_);
+      results.insert(results.end(), gradient.branch_lengths_.begin(),
+                     gradient.branch_lengths_.end());
+    }
+    return results;
+  };
+  auto check_close = [](const std::vector<double>& results,
+                        const std::vector<double>& expected) {
+    REQUIRE_EQ(results.size(), expected.size());
+    for (size_t idx = 0; idx < results.size(); idx++) {
+      CHECK_LT(fabs(results[idx] - expected[idx]), 1e-6);
+    }
+  };
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  inst.SetRescaling(true);
+  const auto rescaled = compute();
+  inst.SetRescaling(false);
+  inst.SetAdaptiveRescaling(true);
+  // These trees don't underflow, so nothing gets rescaled.
+  for (const size_t tree_batch_size : {1, 3}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0,
+                                   tree_batch_size);
+    check_close(compute(), rescaled);
+    CHECK_EQ(inst.RescaledTopologyCount(), 0);
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: incremental likelihoods") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  const size_t internal_count = inst.TaxonCount() - 1;
+  for (const auto rescaling : {false, true}) {
+    inst.SetRescaling(rescaling);
+    // With one thread, LogLikelihoods is sure to use the FatBeagle that we use.
+    inst.PrepareForPhyloLikelihood(specification, 1);
+    auto& tree = inst.tree_collection_.trees_[0];
+    const auto branch_lengths = tree.branch_lengths_;
+    const auto likelihoods = inst.LogLikelihoods();
+    // The first call computes every partial, and a second one none of them.
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(0) - likelihoods[0]), 1e-8);
+    CHECK_EQ(inst.IncrementalPartialUpdateCount(), internal_count);
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(0) - likelihoods[0]), 1e-8);
+    CHECK_EQ(inst.IncrementalPartialUpdateCount(), 0);
+    // Once the tree is detrifurcated, the first child of the root is a child of the
+    // new root, and the second is a grandchild.
+    const auto root_children = tree.Children();
+    tree.branch_lengths_[root_children[0]->Id()] *= 2.;
+    const double first_likelihood = inst.IncrementalLogLikelihood(0);
+    CHECK_EQ(inst.IncrementalPartialUpdateCount(), 1);
+    tree.branch_lengths_[root_children[1]->Id()] *= 2.;
+    const double second_likelihood = inst.IncrementalLogLikelihood(0);
+    CHECK_EQ(inst.IncrementalPartialUpdateCount(), 2);
+    // Switching to another topology recomputes the nodes whose children differ.
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(1) - likelihoods[1]), 1e-8);
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(0) - second_likelihood), 1e-8);
+    tree.branch_lengths_[root_children[1]->Id()] /= 2.;
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(0) - first_likelihood), 1e-8);
+    CHECK_LT(fabs(inst.LogLikelihoods()[0] - first_likelihood), 1e-8);
+    // LogLikelihoods overwrote the buffers, so we start again from scratch.
+    CHECK_LT(fabs(inst.IncrementalLogLikelihood(0) - first_likelihood), 1e-8);
+    CHECK_EQ(inst.IncrementalPartialUpdateCount(), internal_count);
+    tree.branch_lengths_ = branch_lengths;
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: single tree likelihoods") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto likelihoods = inst.LogLikelihoods();
+  const auto gradients = inst.Gradients();
+  const EigenVectorXd phylo_model_params = inst.GetPhyloModelParams().row(0);
+  const auto check_tree = [&](size_t tree_idx) {
+    const auto &tree = inst.tree_collection_.GetTree(tree_idx);
+    CHECK_LT(fabs(inst.LogLikelihoodOf(tree, phylo_model_params) -
+                  likelihoods[tree_idx]),
+             1e-8);
+    const auto gradient = inst.GradientOf(tree, phylo_model_params);
+    CHECK_LT(fabs(gradient.log_likelihood_ - likelihoods[tree_idx]), 1e-8);
+    for (size_t idx = 0; idx < gradient.branch_lengths_.size(); idx++) {
+      CHECK_LT(fabs(gradient.branch_lengths_[idx] -
+                    gradients[tree_idx].branch_lengths_[idx]),
+               1e-6);
+    }
+  };
+  for (const bool shard_site_patterns : {false, true}) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1,
+                                   shard_site_patterns);
+    check_tree(0);
+    // More threads than FatBeagles share them through the free list.
+    std::vector<double> threaded_likelihoods(inst.TreeCount());
+    std::vector<std::thread> threads;
+    for (size_t thread_idx = 0; thread_idx < 4; thread_idx++) {
+      threads.emplace_back([&, thread_idx] {
+        for (size_t tree_idx = thread_idx; tree_idx < inst.TreeCount(); tree_idx += 4) {
+          threaded_likelihoods[tree_idx] = inst.LogLikelihoodOf(
+              inst.tree_collection_.GetTree(tree_idx), phylo_model_params);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (size_t tree_idx = 0; tree_idx < inst.TreeCount(); tree_idx++) {
+      CHECK_LT(fabs(threaded_likelihoods[tree_idx] - likelihoods[tree_idx]), 1e-8);
+    }
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: streaming tree scores") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto likelihoods = inst.LogLikelihoods();
+  const auto gradients = inst.Gradients();
+  for (const bool with_gradients : {false, true}) {
+    std::vector<double> streamed_likelihoods;
+    std::vector<UnrootedTreeGradient> streamed_gradients;
+    const size_t tree_count = inst.ScoreTreeFile(
+        "data/DS1.subsampled_10.t", true, 3,
+        [&](const TreeScoreBatch &scores) {
+          CHECK_EQ(scores.first_tree_idx_, streamed_likelihoods.size());
+          CHECK_LE(scores.log_likelihoods_.size(), 3);
+          streamed_likelihoods.insert(streamed_likelihoods.end(),
+                                      scores.log_likelihoods_.begin(),
+                                      scores.log_likelihoods_.end());
+          streamed_gradients.insert(streamed_gradients.end(),
+                                    scores.gradients_.begin(), scores.gradients_.end());
+        },
+        with_gradients, 0., 1, 1);
+    CHECK_EQ(tree_count, likelihoods.size());
+    CHECK_EQ(streamed_likelihoods.size(), likelihoods.size());
+    CHECK_EQ(streamed_gradients.size(), with_gradients ? gradients.size() : 0);
+    for (size_t tree_idx = 0; tree_idx < streamed_likelihoods.size(); tree_idx++) {
+      CHECK_LT(fabs(streamed_likelihoods[tree_idx] - likelihoods[tree_idx]), 1e-8);
+    }
+    for (size_t tree_idx = 0; tree_idx < streamed_gradients.size(); tree_idx++) {
+      CHECK_EQ(streamed_gradients[tree_idx].branch_lengths_,
+               gradients[tree_idx].branch_lengths_);
+    }
+  }
+  // Thinning and writing to a file.
+  CHECK_EQ(inst.ScoreTreeFileToPath("data/DS1.subsampled_10.t", true, 4,
+                                    "_ignore/scores.tsv", false, 0., 2),
+           (likelihoods.size() + 1) / 2);
+  std::ifstream scores_stream("_ignore/scores.tsv");
+  size_t tree_idx;
+  double log_likelihood;
+  size_t line_count = 0;
+  while (scores_stream >> tree_idx >> log_likelihood) {
+    CHECK_EQ(tree_idx, line_count);
+    CHECK_LT(fabs(log_likelihood - likelihoods[2 * tree_idx]), 1e-8);
+    line_count++;
+  }
+  CHECK_EQ(line_count, (likelihoods.size() + 1) / 2);
+  // Failures in any stage come back to us.
+  CHECK_THROWS(inst.ScoreTreeFile(
+      "data/DS1.subsampled_10.t", true, 2,
+      [](const TreeScoreBatch &) { Failwith("The callback failed."); }));
+  CHECK_THROWS(inst.ScoreTreeFile("data/five_taxon_unrooted.nwk", false, 2,
+                                  [](const TreeScoreBatch &) {}));
+}
+
+TEST_CASE("UnrootedSBNInstance: single precision") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  auto prepare = [&inst, &specification](std::optional<double> tolerance) {
+    inst.PrepareForPhyloLikelihood(specification, 2, {}, true, std::nullopt, 0, 1,
+                                   false, 0, SitePatternOrder::FirstAppearance, false,
+                                   ThreadPinning::None, std::nullopt, true, tolerance);
+  };
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto double_likelihoods = inst.LogLikelihoods();
+  CHECK_LT(inst.MaxPrecisionError(inst.TreeCount()), 1e-6);
+  // Single precision always rescales, even though we don't ask for it.
+  inst.SetRescaling(false);
+  prepare(std::nullopt);
+  const auto single_likelihoods = inst.LogLikelihoods();
+  REQUIRE_EQ(single_likelihoods.size(), double_likelihoods.size());
+  for (size_t i = 0; i < single_likelihoods.size(); i++) {
+    CHECK_LT(fabs(single_likelihoods[i] - double_likelihoods[i]),
+             1e-4 * fabs(double_likelihoods[i]));
+  }
+  const double error = inst.MaxPrecisionError(inst.TreeCount());
+  CHECK_GT(error, 0.);
+  // A loose tolerance keeps single precision, and a tight one goes back to double.
+  prepare(2. * error);
+  CHECK_EQ(inst.MaxPrecisionError(inst.TreeCount()), error);
+  prepare(error / 2.);
+  CHECK_LT(inst.MaxPrecisionError(inst.TreeCount()), 1e-6);
+  const auto fallback_likelihoods = inst.LogLikelihoods();
+  for (size_t i = 0; i < fallback_likelihoods.size(); i++) {
+    CHECK_LT(fabs(fallback_likelihoods[i] - double_likelihoods[i]), 1e-8);
+  }
+}
+
+TEST_CASE("UnrootedSBNInstance: variational step") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  inst.SetSeed(1);
+  const size_t particle_count = 6;
+  const size_t split_count = inst.psp_indexer_.AfterRootsplitsIndex();
+  EigenMatrixXd lognormal_params(split_count, 2);
+  lognormal_params.col(0).setConstant(-3.);
+  lognormal_params.col(1).setConstant(0.2);
+  const auto result = inst.VariationalStep(particle_count, lognormal_params);
+  REQUIRE_EQ(inst.TreeCount(), particle_count);
+  // The pieces agree with those we get by calling the separate methods on the
+  // sampled trees.
+  const auto log_likelihoods = inst.LogLikelihoods();
+  for (size_t i = 0; i < particle_count; i++) {
+    CHECK_LT(fabs(result.log_likelihoods_[i] - log_likelihoods[i]), 1e-8);
+  }
+  CHECK_LT(fabs(result.elbo_ - result.log_f_.mean()), 1e-8);
+  EigenVectorXd log_f = result.log_f_;
+  const EigenVectorXd sbn_gradient = inst.TopologyGradients(log_f);
+  CHECK_LT((sbn_gradient - result.sbn_gradient_).cwiseAbs().maxCoeff(), 1e-10);
+  CHECK_EQ(result.scalar_gradient_.rows(), split_count);
+  CHECK(result.scalar_gradient_.allFinite());
+  // Annealing only changes the likelihood term of log f.
+  inst.SetSeed(1);
+  const auto annealed = inst.VariationalStep(particle_count, lognormal_params, 0.5);
+  CHECK_LT(fabs(annealed.elbo_ - result.elbo_), 1e-8);
+  CHECK_LT(((result.log_f_ - annealed.log_f_) - 0.5 * result.log_likelihoods_)
+               .cwiseAbs()
+               .maxCoeff(),
+           1e-8);
+  EigenMatrixXd wrong_params(split_count + 1, 2);
+  CHECK_THROWS(inst.VariationalStep(particle_count, wrong_params));
+}
+
+TEST_CASE("UnrootedSBNInstance: marginal likelihood estimate") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const size_t split_count = inst.psp_indexer_.AfterRootsplitsIndex();
+  EigenMatrixXd lognormal_params(split_count, 2);
+  lognormal_params.col(0).setConstant(-3.);
+  lognormal_params.col(1).setConstant(0.2);
+  // Batching doesn't change the particles, so it doesn't change the estimate.
+  inst.SetSeed(1);
+  const auto estimate = inst.EstimateMarginalLikelihood(10, lognormal_params, 10);
+  inst.SetSeed(1);
+  const auto batched_estimate =
+      inst.EstimateMarginalLikelihood(10, lognormal_params, 3);
+  CHECK_EQ(estimate.particle_count_, 10);
+  CHECK_EQ(inst.TreeCount(), 1);
+  CHECK_LT(fabs(estimate.log_marginal_likelihood_ -
+                batched_estimate.log_marginal_likelihood_),
+           1e-8);
+  CHECK_LT(fabs(estimate.elbo_ - batched_estimate.elbo_), 1e-8);
+  // Jensen's inequality.
+  CHECK_GE(estimate.log_marginal_likelihood_, estimate.elbo_);
+  CHECK_GT(estimate.elbo_standard_error_, 0.);
+  CHECK_GT(estimate.log_marginal_likelihood_standard_error_, 0.);
+  CHECK_GE(estimate.effective_sample_size_, 1.);
+  CHECK_LE(estimate.effective_sample_size_, 10.);
+  // With one batch we sample as VariationalStep does, and get its ELBO.
+  inst.SetSeed(1);
+  const auto step = inst.VariationalStep(10, lognormal_params);
+  CHECK_LT(fabs(step.elbo_ - estimate.elbo_), 1e-8);
+  CHECK_THROWS(inst.EstimateMarginalLikelihood(10, lognormal_params, 0));
+}
+
+TEST_CASE("UnrootedSBNInstance: hot path profiling") {
+  UnrootedSBNInstance inst("charlie");
+  PhyloModelSpecification specification{"JC69", "constant", "strict"};
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ReadFastaFile("data/DS1.fasta");
+  inst.PrepareForPhyloLikelihood(specification, 2);
+  const auto call_count = [&inst](HotPathProfile::Phase phase) {
+    return inst.GetProfile().GetPhaseCounter(phase).call_count_;
+  };
+  const auto queue_wait_count = [&inst] {
+    const auto histogram = inst.GetProfile().GetQueueWaitHistogram();
+    return std::accumulate(histogram.begin(), histogram.end(), uint64_t(0));
+  };
+  // Nothing is recorded while profiling is off.
+  inst.LogLikelihoods();
+  CHECK_EQ(call_count(HotPathProfile::Partials), 0);
+  CHECK_EQ(queue_wait_count(), 0);
+  inst.SetProfiling(true);
+  const size_t tree_count = inst.TreeCount();
+  inst.LogLikelihoods();
+  CHECK_EQ(call_count(HotPathProfile::TransitionMatrices), tree_count);
+  CHECK_EQ(call_count(HotPathProfile::Partials), tree_count);
+  CHECK_EQ(call_count(HotPathProfile::RootLikelihoods), tree_count);
+  CHECK_EQ(call_count(HotPathProfile::PrePartials), 0);
+  CHECK_EQ(queue_wait_count(), tree_count);
+  inst.Gradients();
+  CHECK_EQ(call_count(HotPathProfile::PrePartials), tree_count);
+  CHECK_EQ(call_count(HotPathProfile::EdgeDerivatives), tree_count);
+  CHECK_EQ(call_count(HotPathProfile::RootLikelihoods), 2 * tree_count);
+  CHECK_GT(inst.GetProfile().GetPhaseCounter(HotPathProfile::Partials).nanoseconds_, 0);
+  inst.ResetProfile();
+  CHECK_EQ(call_count(HotPathProfile::RootLikelihoods), 0);
+  CHECK_EQ(queue_wait_count(), 0);
+}
+
 TEST_CASE("UnrootedSBNInstance: SBN training") {
   UnrootedSBNInstance inst("charlie");
   inst.ReadNewickFile("data/DS1.100_topologies.nwk");
@@ -354,6 +1509,139 @@ TEST_CASE("UnrootedSBNInstance: SBN training") {
   const auto expected_EM_05_100 = ExpectedEMVectorAlpha05();
   inst.TrainExpectationMaximization(0.5, 100);
   CheckVectorXdEquality(inst.CalculateSBNProbabilities(), expected_EM_05_100, 1e-5);
+  // Splitting the E-step between threads gives the same answers.
+  inst.TrainExpectationMaximization(0., 23, 0., 3);
+  CheckVectorXdEquality(inst.CalculateSBNProbabilities(), expected_EM_0_23, 1e-12);
+  inst.TrainExpectationMaximization(0.5, 100, 0., 4);
+  CheckVectorXdEquality(inst.CalculateSBNProbabilities(), expected_EM_05_100, 1e-5);
+}
+
+TEST_CASE("UnrootedSBNInstance: accelerated and early-stopping EM") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  const auto expected_EM_05_100 = ExpectedEMVectorAlpha05();
+  const auto em_scores = inst.TrainExpectationMaximization(0.5, 1000, 1e-13);
+  // Stopping early keeps the scores of the iterations we did.
+  CHECK_LT(em_scores.size(), 1000);
+  CHECK_EQ(em_scores[em_scores.size() - 1], doctest::Approx(-750.793644).epsilon(1e-9));
+  // SQUAREM gets to the same place, with far fewer E-steps than plain EM.
+  const auto squarem_scores =
+      inst.TrainExpectationMaximization(0.5, 1000, 1e-13, 1, 0., true);
+  CHECK_LT(3 * squarem_scores.size(), em_scores.size() / 4);
+  CheckVectorXdEquality(inst.CalculateSBNProbabilities(), expected_EM_05_100, 1e-5);
+  CHECK_GE(squarem_scores[squarem_scores.size() - 1],
+           em_scores[em_scores.size() - 1] - 1e-8);
+  for (Eigen::Index em_idx = 1; em_idx < squarem_scores.size(); em_idx++) {
+    CHECK_GE(squarem_scores[em_idx], squarem_scores[em_idx - 1]);
+  }
+  // As it does with threads, and without regularization.
+  inst.TrainExpectationMaximization(0.5, 1000, 1e-13, 3, 0., true);
+  CheckVectorXdEquality(inst.CalculateSBNProbabilities(), expected_EM_05_100, 1e-5);
+  const auto unregularized_scores =
+      inst.TrainExpectationMaximization(0., 1000, 1e-13, 1, 0., true);
+  CHECK_LT(unregularized_scores.size(), 1000);
+  // The relative stopping rule stops once the score has nearly stopped improving.
+  const auto relative_scores =
+      inst.TrainExpectationMaximization(0.5, 1000, 0., 1, 1e-6);
+  const auto relative_count = relative_scores.size();
+  CHECK_LT(relative_count, em_scores.size());
+  CHECK_LE(relative_scores[relative_count - 1] - relative_scores[relative_count - 2],
+           1e-6 * (relative_scores[relative_count - 1] - relative_scores[0]));
+}
+
+TEST_CASE("UnrootedSBNInstance: cached normalization") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  const auto check_normalization = [&inst]() {
+    EigenVectorXd expected = inst.sbn_parameters_;
+    inst.NormalizeSBNParametersInLog(expected);
+    const auto &normalized = inst.GetNormalizedSBNParameters();
+    CHECK((normalized.InLog().array() == expected.array()).all());
+    CheckVectorXdEquality(normalized.Probabilities(), expected.array().exp().matrix(),
+                          1e-15);
+  };
+  check_normalization();
+  const EigenVectorXd probabilities = inst.CalculateSBNProbabilities();
+  // A change to one rootsplit shows up in the cache, as does changing it back.
+  const double rootsplit_parameter = inst.sbn_parameters_[0];
+  inst.sbn_parameters_[0] += 1.;
+  check_normalization();
+  CHECK_NE(inst.CalculateSBNProbabilities(), probabilities);
+  inst.sbn_parameters_[0] = rootsplit_parameter;
+  CHECK_EQ(inst.CalculateSBNProbabilities(), probabilities);
+  inst.SampleTrees(10);
+  CHECK_EQ(inst.TreeCount(), 10);
+  CHECK_GT(inst.MemoryByteCounts().at("normalized_sbn_parameters"),
+           3 * inst.sbn_parameters_.size() * sizeof(double));
+}
+
+TEST_CASE("UnrootedSBNInstance: online SimpleAverage") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNexusFile("data/DS1.subsampled_10.t");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  const auto pretty_indexer = inst.PrettyIndexer();
+  const EigenVectorXd sbn_parameters = inst.sbn_parameters_;
+  // Streaming the same file in batches, or adding the loaded collection at once,
+  // gives the same SBN.
+  const auto check_same_sbn = [&pretty_indexer,
+                               &sbn_parameters](UnrootedSBNInstance &other_inst) {
+    CHECK_EQ(other_inst.PrettyIndexer(), pretty_indexer);
+    CheckVectorXdEquality(other_inst.sbn_parameters_, sbn_parameters, 1e-12);
+  };
+  UnrootedSBNInstance online_inst("online");
+  for (size_t batch_size : {1, 3, 100}) {
+    online_inst.ResetOnlineSimpleAverage();
+    online_inst.TrainOnlineSimpleAverageOnNexusFile("data/DS1.subsampled_10.t",
+                                                    batch_size);
+    check_same_sbn(online_inst);
+  }
+  online_inst.ResetOnlineSimpleAverage();
+  online_inst.AddToOnlineSimpleAverage(inst.tree_collection_);
+  online_inst.UpdateSBNFromOnlineSimpleAverage();
+  check_same_sbn(online_inst);
+  // Trees on other taxa can't be added.
+  UnrootedSBNInstance five_taxon_inst("five");
+  five_taxon_inst.ReadNewickFile("data/five_taxon_unrooted.nwk");
+  CHECK_THROWS(online_inst.AddToOnlineSimpleAverage(five_taxon_inst.tree_collection_));
+}
+
+TEST_CASE("UnrootedSBNInstance: SBN snapshots") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  const std::string snapshot_path = "_ignore/DS1.sbn_snapshot";
+  inst.SaveSBNSnapshot(snapshot_path);
+  // A fresh instance gets the same SBN from the snapshot without any trees.
+  UnrootedSBNInstance loaded_inst("loaded");
+  loaded_inst.LoadSBNSnapshot(snapshot_path);
+  CHECK_EQ(loaded_inst.taxon_names_, inst.taxon_names_);
+  CHECK_EQ(loaded_inst.PrettyIndexer(), inst.PrettyIndexer());
+  CHECK_EQ(loaded_inst.GetIndexers(), inst.GetIndexers());
+  CHECK_EQ(loaded_inst.psp_indexer_.Details(), inst.psp_indexer_.Details());
+  CHECK((loaded_inst.sbn_parameters_.array() == inst.sbn_parameters_.array()).all());
+  // The gradient needs the subsplit range table, which loading also builds.
+  const auto indexer_representation = inst.MakeIndexerRepresentations().at(0);
+  EigenVectorXd normalized_sbn_parameters_in_log(inst.sbn_parameters_.size());
+  normalized_sbn_parameters_in_log.setConstant(DOUBLE_NAN);
+  const EigenVectorXd grad_log_q =
+      inst.GradientOfLogQ(normalized_sbn_parameters_in_log, indexer_representation);
+  normalized_sbn_parameters_in_log.setConstant(DOUBLE_NAN);
+  CheckVectorXdEquality(loaded_inst.GradientOfLogQ(normalized_sbn_parameters_in_log,
+                                                   indexer_representation),
+                        grad_log_q, 1e-12);
+  loaded_inst.SetSeed(1);
+  loaded_inst.SampleTrees(10);
+  CHECK_EQ(loaded_inst.TreeCount(), 10);
+  // The snapshot must match the taxa of any loaded trees.
+  UnrootedSBNInstance five_taxon_inst("five");
+  five_taxon_inst.ReadNewickFile("data/five_taxon_unrooted.nwk");
+  CHECK_THROWS(five_taxon_inst.LoadSBNSnapshot(snapshot_path));
+  CHECK_THROWS(loaded_inst.LoadSBNSnapshot("data/DS1.100_topologies.nwk"));
 }
 
 TEST_CASE("UnrootedSBNInstance: tree sampling") {
@@ -374,8 +1662,9 @@ TEST_CASE("UnrootedSBNInstance: tree sampling") {
   size_t sampled_tree_count = 1'000'000;
   RootedIndexerRepresentationSizeDict counter_from_sampling(0);
   ProgressBar progress_bar(sampled_tree_count / 1000);
+  const auto alias_table = inst.MakeAliasTable();
   for (size_t sample_idx = 0; sample_idx < sampled_tree_count; ++sample_idx) {
-    const auto rooted_topology = inst.SampleTopology(true);
+    const auto rooted_topology = inst.SampleTopology(alias_table, true);
     RootedSBNMaps::IncrementRootedIndexerRepresentationSizeDict(
         counter_from_sampling,
         RootedSBNMaps::RootedIndexerRepresentationOf(inst.indexer_, rooted_topology,
@@ -396,6 +1685,37 @@ TEST_CASE("UnrootedSBNInstance: tree sampling") {
   progress_bar.done();
 }
 
+TEST_CASE("UnrootedSBNInstance: parallel tree sampling") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  inst.TrainSimpleAverage();
+  // Use enough trees for several chunks, and a partial last chunk.
+  const size_t tree_count = 1000;
+  const auto sampled_topologies = [&inst, tree_count](size_t thread_count) {
+    inst.SetSeed(42);
+    inst.SampleTrees(tree_count, thread_count);
+    CHECK_EQ(inst.TreeCount(), tree_count);
+    Node::NodePtrVec topologies;
+    for (const auto &tree : inst.tree_collection_.Trees()) {
+      topologies.push_back(tree.Topology());
+    }
+    return topologies;
+  };
+  const auto topologies = sampled_topologies(1);
+  for (size_t thread_count : {2, 3, 8}) {
+    CHECK(sampled_topologies(thread_count) == topologies);
+  }
+  // A different seed gives a different sample.
+  inst.SetSeed(43);
+  inst.SampleTrees(tree_count);
+  size_t difference_count = 0;
+  for (size_t i = 0; i < tree_count; i++) {
+    difference_count += !(inst.tree_collection_.Trees()[i].Topology() == topologies[i]);
+  }
+  CHECK_GT(difference_count, 0);
+}
+
 TEST_CASE("UnrootedSBNInstance: gradient of log q_{phi}(tau) WRT phi") {
   UnrootedSBNInstance inst("charlie");
   // File gradient_test.t contains two trees:
@@ -577,7 +1897,75 @@ TEST_CASE("UnrootedSBNInstance: gradient of log q_{phi}(tau) WRT phi") {
   }
   use_vimco = true;
   realized_nabla = inst.TopologyGradients(log_f, use_vimco);
+  // Splitting the trees between threads only changes the order of summation.
+  for (size_t thread_count : {2, 3, 8}) {
+    CheckVectorXdEquality(inst.TopologyGradients(log_f, use_vimco, thread_count),
+                          expected_nabla, 1e-8);
+  }
   CheckVectorXdEquality(realized_nabla, expected_nabla, 1e-8);
 }
+
+TEST_CASE("UnrootedSBNInstance: perf stats") {
+  UnrootedSBNInstance inst("charlie");
+  inst.SetPerfTracing(true);
+  inst.ReadNewickFile("data/DS1.100_topologies.nwk");
+  inst.ProcessLoadedTrees();
+  const auto em_scores = inst.TrainExpectationMaximization(0.0001, 5);
+  inst.SampleTrees(50);
+  const PerfStats &stats = inst.GetPerfStats();
+  for (const auto phase : {PerfStats::Parsing, PerfStats::ProcessLoadedTrees,
+                           PerfStats::ExpectationMaximization, PerfStats::Sampling}) {
+    CHECK_EQ(stats.GetPhaseCounter(phase).call_count_, 1);
+  }
+  CHECK_EQ(stats.GetPhaseCounter(PerfStats::LogLikelihoods).call_count_, 0);
+  CHECK_EQ(stats.GetEMIterations(), em_scores.size());
+  CHECK_EQ(stats.GetTreesSampled(), 50);
+  CHECK_EQ(stats.GetTraceEvents().size(), 4);
+  auto byte_counts = inst.MemoryByteCounts();
+  CHECK_EQ(byte_counts.at("sbn_parameters"),
+           inst.sbn_parameters_.size() * sizeof(double));
+  CHECK_GT(byte_counts.at("sbn_maps"), inst.indexer_.size() * sizeof(Bitset));
+  CHECK_GT(byte_counts.at("tree_collection"), 0);
+  CHECK_EQ(byte_counts.at("beagle_buffers"), 0);
+  inst.ResetPerfStats();
+  CHECK_EQ(inst.GetPerfStats().GetTreesSampled(), 0);
+}
+
+TEST_CASE("UnrootedSBNInstance: representation cache") {
+  UnrootedSBNInstance inst("charlie");
+  inst.ReadNewickFile("data/five_taxon_unrooted.nwk");
+  inst.ProcessLoadedTrees();
+  const auto indexer_representations = inst.MakeIndexerRepresentations();
+  const auto psp_representations = inst.MakePSPIndexerRepresentations();
+  const auto flat_psp_representations = inst.MakeFlatPSPIndexerRepresentations();
+  CHECK_EQ(inst.GetRepresentationCache(), nullptr);
+  inst.SetRepresentationCacheCapacity(2);
+  const size_t tree_count = inst.TreeCount();
+  for (size_t pass = 0; pass < 2; pass++) {
+    CHECK_EQ(inst.MakeIndexerRepresentations(), indexer_representations);
+    CHECK_EQ(inst.MakePSPIndexerRepresentations(), psp_representations);
+    const auto flat_indexer_representations = inst.MakeFlatIndexerRepresentations();
+    const auto cached_flat_psp_representations =
+        inst.MakeFlatPSPIndexerRepresentations();
+    for (size_t tree_idx = 0; tree_idx < tree_count; tree_idx++) {
+      CHECK_EQ(flat_indexer_representations.VectorsOf(tree_idx),
+               indexer_representations[tree_idx]);
+      CHECK_EQ(cached_flat_psp_representations.VectorsOf(tree_idx),
+               flat_psp_representations.VectorsOf(tree_idx));
+    }
+  }
+  // With two slots we keep evicting, but with room for every topology each one is
+  // digested once.
+  CHECK_EQ(inst.GetRepresentationCache()->Size(), 2);
+  inst.SetRepresentationCacheCapacity(tree_count);
+  inst.MakeIndexerRepresentations();
+  inst.MakeFlatPSPIndexerRepresentations();
+  CHECK_EQ(inst.GetRepresentationCache()->MissCount(), tree_count);
+  CHECK_EQ(inst.GetRepresentationCache()->HitCount(), tree_count);
+  // Rebuilding the SBN maps clears the cache.
+  inst.ProcessLoadedTrees();
+  CHECK_EQ(inst.GetRepresentationCache()->Size(), 0);
+  CHECK_EQ(inst.MakeIndexerRepresentations(), indexer_representations);
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 #endif  // SRC_UNROOTED_SBN_INSTANCE_HPP_
@@ -4,6 +4,8 @@
 #ifndef SRC_UNROOTED_TREE_COLLECTION_HPP_
 #define SRC_UNROOTED_TREE_COLLECTION_HPP_
 
+#include <fstream>
+#include <numeric>
 #include "tree_collection.hpp"
 #include "unrooted_tree.hpp"
 
@@ -18,7 +20,51 @@ class UnrootedTreeCollection : public PreUnrootedTreeCollection {
 };
 
 #ifdef DOCTEST_LIBRARY_INCLUDED
-TEST_CASE("UnrootedTreeCollection") {}
+TEST_CASE("UnrootedTreeCollection") {
+  // Newick strings. We have enough trees to make several blocks for the file.
+  std::vector<UnrootedTree> trees;
+  const auto topologies = Node::ExampleTopologies();
+  for (size_t tree_idx = 0; tree_idx < 2 * NewickWriter::block_size_ + 1; tree_idx++) {
+    const auto &topology = topologies[tree_idx % 3];
+    std::vector<double> branch_lengths(topology->Id() + 1);
+    std::iota(branch_lengths.begin(), branch_lengths.end(),
+              static_cast<double>(tree_idx) / 7.);
+    trees.emplace_back(topology, std::move(branch_lengths));
+  }
+  const UnrootedTreeCollection collection(trees, {"a", "b", "c", "d"});
+  std::string correct_newick;
+  for (const auto &tree : collection.Trees()) {
+    correct_newick.append(tree.Newick(collection.TagTaxonMap()) + "\n");
+  }
+  for (const size_t thread_count : {1, 2, 7}) {
+    CHECK_EQ(collection.Newick(thread_count), correct_newick);
+    collection.WriteNewickFile("_ignore/unrooted_tree_collection.nwk", thread_count);
+    std::ifstream newick_stream("_ignore/unrooted_tree_collection.nwk");
+    const std::string written_newick((std::istreambuf_iterator<char>(newick_stream)),
+                                     std::istreambuf_iterator<char>());
+    CHECK_EQ(written_newick, correct_newick);
+  }
+  // Without a precision we get all of the digits of 1/7.
+  const UnrootedTreeCollection second_tree({trees[1]}, {"a", "b", "c", "d"});
+  CHECK_NE(second_tree.Newick().find(":0.142857"), std::string::npos);
+  CHECK_EQ(second_tree.Newick().find(":0.1428571"), std::string::npos);
+  CHECK_NE(second_tree.Newick(1, std::nullopt).find(":0.14285714285714285"),
+           std::string::npos);
+  CHECK_THROWS(collection.WriteNewickFile("_ignore/no_such_directory/trees.nwk"));
+
+  // Branch lengths as a matrix.
+  UnrootedTreeCollection matrix_collection(
+      {trees[0], trees[1], trees[2]}, std::vector<std::string>{"a", "b", "c", "d"});
+  auto branch_length_matrix = matrix_collection.BranchLengthMatrix();
+  CHECK_EQ(branch_length_matrix.rows(), 3);
+  CHECK_EQ(branch_length_matrix.cols(), 6);
+  CHECK_EQ(branch_length_matrix(1, 2), trees[1].branch_lengths_[2]);
+  branch_length_matrix.array() += 1.;
+  matrix_collection.SetBranchLengths(branch_length_matrix);
+  CHECK_EQ(matrix_collection.GetTree(2).branch_lengths_[5],
+           trees[2].branch_lengths_[5] + 1.);
+  CHECK_THROWS(matrix_collection.SetBranchLengths(EigenMatrixXd::Zero(2, 6)));
+}
 #endif  // DOCTEST_LIBRARY_INCLUDED
 
 #endif  // SRC_UNROOTED_TREE_COLLECTION_HPP_
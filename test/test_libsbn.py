@@ -77,6 +77,20 @@ def sampling_and_indexers_demo():
     print(inst.make_indexer_representations())
     print("\nPSP indexing:")
     print(inst.make_psp_indexer_representations())
+    # The flat representations hold the same indices, as NumPy arrays.
+    flat_representations = inst.make_flat_indexer_representations()
+    assert flat_representations.tree_count() == 2
+    rows = [
+        list(flat_representations.indices[begin:end])
+        for begin, end in zip(
+            flat_representations.row_offsets[:-1], flat_representations.row_offsets[1:]
+        )
+    ]
+    assert rows == [
+        rooted_representation
+        for representation in inst.make_indexer_representations()
+        for rooted_representation in representation
+    ]
     print("\nPSP details:")
     print(inst.psp_indexer.details())
     print("\nSBN parameters:")
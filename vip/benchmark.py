@@ -4,6 +4,7 @@ Documentation in ``vip.cli``.
 """
 
 import os
+import sys
 import timeit
 
 import libsbn
@@ -36,11 +37,18 @@ def fixed(
     )
     # Read MCMC run and get split lengths.
     mcmc_inst = libsbn.unrooted_instance("mcmc_inst")
-    mcmc_inst.read_nexus_file(mcmc_nexus_path)
-    burn_in_count = int(burn_in_fraction * mcmc_inst.tree_count())
-    mcmc_inst.tree_collection.erase(0, burn_in_count)
+    # The burn-in trees are skipped without being parsed.
+    mcmc_inst.tree_collection = next(
+        libsbn.TreeFileStream(
+            mcmc_nexus_path,
+            is_nexus=True,
+            batch_size=sys.maxsize,
+            burn_in_fraction=burn_in_fraction,
+        )
+    )
     mcmc_inst.process_loaded_trees()
-    ragged = [np.array(a) for a in mcmc_inst.split_lengths()]
+    flat_split_lengths = mcmc_inst.make_flat_split_lengths(os.cpu_count())
+    ragged = np.split(flat_split_lengths.lengths, flat_split_lengths.offsets[1:-1])
     mcmc_split_lengths = pd.concat(
         [pd.DataFrame({"variable": idx, "value": a}) for idx, a in enumerate(ragged)],
         sort=False,
@@ -1,4 +1,6 @@
 """The Burrito class wraps an instance and relevant model data."""
+import sys
+
 import click
 import numpy as np
 from scipy.special import logsumexp
@@ -7,6 +9,7 @@ import libsbn
 import vip.branch_model
 import vip.optimizers
 import vip.priors
+import vip.scalar_model
 
 
 class Burrito:
@@ -37,13 +40,20 @@ class Burrito:
         use_vimco=True
     ):
         self.particle_count = particle_count
+        self.thread_count = thread_count
         self.use_vimco = use_vimco
         self.inst = libsbn.unrooted_instance("burrito")
 
         # Read MCMC run to get tree structure.
-        self.inst.read_nexus_file(mcmc_nexus_path)
-        burn_in_count = int(burn_in_fraction * self.inst.tree_count())
-        self.inst.tree_collection.erase(0, burn_in_count)
+        # The burn-in trees are skipped without being parsed.
+        self.inst.tree_collection = next(
+            libsbn.TreeFileStream(
+                mcmc_nexus_path,
+                is_nexus=True,
+                batch_size=sys.maxsize,
+                burn_in_fraction=burn_in_fraction,
+            )
+        )
         self.inst.process_loaded_trees()
 
         # Set up tree likelihood calculation.
@@ -73,7 +83,7 @@ class Burrito:
     def sample_topologies(self, count):
         """Sample trees into the instance and return the np'd version of their
         branch length vectors."""
-        self.inst.sample_trees(count)
+        self.inst.sample_trees(count, self.thread_count)
         # Here we are getting a slice that excludes the last (fake) element.
         # Thus we can just deal with the actual branch lengths.
         return [
@@ -83,6 +93,21 @@ class Burrito:
 
     def gradient_step(self, beta_t=1.0):
         """Take a gradient step."""
+        if self._has_native_gradient_step():
+            result = self.inst.variational_step(
+                self.particle_count,
+                self.branch_model.scalar_model.q_params,
+                beta_t,
+                self.use_vimco,
+                thread_count=self.thread_count,
+            )
+            self.opt.gradient_step(
+                {
+                    "scalar_params": np.array(result.scalar_gradient),
+                    "sbn_params": np.array(result.sbn_gradient),
+                }
+            )
+            return
         px_branch_lengths = self.sample_topologies(self.particle_count)
         px_branch_representation = self.branch_model.px_branch_representation()
         # This design may seem a little strange, in that we separate out the
@@ -113,9 +138,22 @@ class Burrito:
             px_phylo_log_like, px_theta_sample, px_branch_representation
         )
         # Get topology gradients.
-        sbn_grad = self.inst.topology_gradients(px_log_f, self.use_vimco)
+        sbn_grad = self.inst.topology_gradients(
+            px_log_f, self.use_vimco, self.thread_count
+        )
         self.opt.gradient_step({"scalar_params": scalar_grad, "sbn_params": sbn_grad})
 
+    def _has_native_gradient_step(self):
+        """The split-based LogNormal model with the exponential prior has a gradient
+        step implemented in libsbn."""
+        return (
+            isinstance(self.branch_model, vip.branch_model.SplitModel)
+            and isinstance(
+                self.branch_model.scalar_model, vip.scalar_model.LogNormalModel
+            )
+            and self.branch_model.log_prior is vip.priors.log_exp_prior
+        )
+
     def gradient_steps(self, step_count):
         betas = np.arange(1, step_count + 1, dtype=np.float)
         betas = np.maximum(betas / step_count, 0.001)
@@ -127,6 +165,12 @@ class Burrito:
     def estimate_elbo(self, particle_count):
         """Sample particle_count particles and then make a naive Monte Carlo
         estimate of the ELBO."""
+        if self._has_native_gradient_step():
+            return self.inst.estimate_marginal_likelihood(
+                particle_count,
+                self.branch_model.scalar_model.q_params,
+                thread_count=self.thread_count,
+            ).elbo
         px_branch_lengths = self.sample_topologies(particle_count)
         px_branch_representation = self.branch_model.px_branch_representation()
         # Sample continuous variables based on the branch representations.
@@ -2,7 +2,7 @@
 
 import abc
 import numpy as np
-import vip.sgd_server
+import libsbn
 from vip.sbn_model import SBNModel
 from vip.scalar_model import ScalarModel
 
@@ -18,12 +18,7 @@ class BaseOptimizer(abc.ABC):
         self.step_number = 0
         self.step_size = scalar_model.suggested_step_size()
         self.sbn_step_size = 0.001
-        self.sgd_server = vip.sgd_server.SGD_Server(
-            {
-                "scalar_params": scalar_model.q_params.shape,
-                "sbn_params": sbn_model.sbn_parameters.shape,
-            }
-        )
+        self.stochastic_optimizer = libsbn.StochasticOptimizer("adam")
 
     def _simple_gradient_step(self, grad_dict, history=None):
         """Just take a simple gradient step.
@@ -39,16 +34,13 @@ class BaseOptimizer(abc.ABC):
         if not np.isfinite(np.array([scalar_grad])).all():
             return False
         assert self.sbn_model.sbn_parameters.shape == sbn_grad.shape
-        update_dict = self.sgd_server.adam(
-            {"scalar_params": self.step_size, "sbn_params": self.sbn_step_size},
-            {
-                "scalar_params": self.scalar_model.q_params,
-                "sbn_params": self.sbn_model.sbn_parameters,
-            },
-            grad_dict,
+        # These update the parameters in place.
+        self.stochastic_optimizer.step_matrix(
+            "scalar_params", self.step_size, self.scalar_model.q_params, scalar_grad
+        )
+        self.stochastic_optimizer.step_vector(
+            "sbn_params", self.sbn_step_size, self.sbn_model.sbn_parameters, sbn_grad
         )
-        self.scalar_model.q_params += update_dict["scalar_params"]
-        self.sbn_model.sbn_parameters += update_dict["sbn_params"]
         if history is not None:
             history.append(self.scalar_model.q_params.copy())
             history.append(self.sbn_model.sbn_parameters.copy())